@@ -21,6 +21,103 @@ Environment:
 
 #include "pch.h"
 
+//
+//  Local routines of the metadata journal.
+//
+
+RTL_AVL_COMPARE_ROUTINE FmmIndexCompare;
+RTL_AVL_ALLOCATE_ROUTINE FmmIndexAllocate;
+RTL_AVL_FREE_ROUTINE FmmIndexFree;
+
+VOID
+FmmJournalClearIndex (
+    _Inout_ PFMM_JOURNAL Journal
+    );
+
+ULONG
+FmmJournalChecksum (
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    );
+
+ULONG
+FmmJournalBuildRecord (
+    _Out_writes_bytes_(FMM_JOURNAL_MAX_RECORD_SIZE) PVOID Buffer,
+    _In_ USHORT Type,
+    _In_ ULONG Flags,
+    _In_ ULONGLONG Lsn,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength
+    );
+
+NTSTATUS
+FmmJournalApply (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ USHORT Type,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength,
+    _Out_opt_ PBOOLEAN Changed
+    );
+
+NTSTATUS
+FmmJournalWrite (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ LONGLONG Offset,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    );
+
+NTSTATUS
+FmmJournalWriteHeader (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ ULONG Sequence,
+    _In_ LONGLONG JournalStart,
+    _In_ ULONG CheckpointLength,
+    _In_ ULONGLONG CheckpointLsn
+    );
+
+NTSTATUS
+FmmJournalFormat (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject
+    );
+
+NTSTATUS
+FmmJournalRecover (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject
+    );
+
+NTSTATUS
+FmmJournalReplay (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ PFMM_JOURNAL_HEADER Header
+    );
+
+NTSTATUS
+FmmJournalBuildCheckpoint (
+    _Inout_ PFMM_JOURNAL Journal,
+    _Outptr_result_bytebuffer_maybenull_(*Length) PUCHAR *Buffer,
+    _Out_ PULONG Length,
+    _Out_ PLONGLONG Offset,
+    _Out_ PULONGLONG Lsn
+    );
+
+NTSTATUS
+FmmJournalWriteCheckpoint (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_reads_bytes_opt_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _In_ LONGLONG Offset,
+    _In_ ULONGLONG Lsn
+    );
+
 //
 //  Assign text sections for each routine.
 //
@@ -33,6 +130,31 @@ Environment:
 #pragma alloc_text(PAGE, FmmSetMetadataOpenTriggerFileObject)
 #pragma alloc_text(PAGE, FmmBeginFileSystemOperation)
 #pragma alloc_text(PAGE, FmmEndFileSystemOperation)
+#pragma alloc_text(PAGE, FmmIndexCompare)
+#pragma alloc_text(PAGE, FmmIndexAllocate)
+#pragma alloc_text(PAGE, FmmIndexFree)
+#pragma alloc_text(PAGE, FmmJournalClearIndex)
+#pragma alloc_text(PAGE, FmmJournalChecksum)
+#pragma alloc_text(PAGE, FmmJournalBuildRecord)
+#pragma alloc_text(PAGE, FmmJournalApply)
+#pragma alloc_text(PAGE, FmmJournalWrite)
+#pragma alloc_text(PAGE, FmmJournalWriteHeader)
+#pragma alloc_text(PAGE, FmmJournalFormat)
+#pragma alloc_text(PAGE, FmmJournalRecover)
+#pragma alloc_text(PAGE, FmmJournalReplay)
+#pragma alloc_text(PAGE, FmmJournalBuildCheckpoint)
+#pragma alloc_text(PAGE, FmmJournalWriteCheckpoint)
+#pragma alloc_text(PAGE, FmmJournalAppend)
+#pragma alloc_text(PAGE, FmmJournalCommit)
+#pragma alloc_text(PAGE, FmmJournalInitialize)
+#pragma alloc_text(PAGE, FmmJournalCleanup)
+#pragma alloc_text(PAGE, FmmJournalAttach)
+#pragma alloc_text(PAGE, FmmJournalDetach)
+#pragma alloc_text(PAGE, FmmJournalHoldWrites)
+#pragma alloc_text(PAGE, FmmSetFileMetadata)
+#pragma alloc_text(PAGE, FmmDeleteFileMetadata)
+#pragma alloc_text(PAGE, FmmQueryFileMetadata)
+#pragma alloc_text(PAGE, FmmQueryJournalStatistics)
 #endif
 
 _Requires_lock_held_(_Global_critical_region_)
@@ -307,11 +429,29 @@ RetryFltCreateFile:
     }
 
     //
-    //  Here the filter may read the metadata contents and initialize
-    //  its in memory data structures with the data from the metadata
-    //  file
+    //  Load the metadata index from the journal (or start a new journal)
+    //  and start logging updates to the metadata file
     //
 
+    FmmBeginFileSystemOperation( InstanceContext );
+
+    status = FmmJournalAttach( &InstanceContext->Journal,
+                               InstanceContext->MetadataFileObject,
+                               (BOOLEAN)(ioStatus.Information == FILE_CREATED) );
+
+    FmmEndFileSystemOperation( InstanceContext );
+
+    if (!NT_SUCCESS( status )) {
+
+        DebugTrace( DEBUG_TRACE_METADATA_OPERATIONS | DEBUG_TRACE_ERROR,
+                    ("[Fmm]: Failed to load metadata journal %wZ (Volume = %p, Status = 0x%x)\n",
+                     &fileName,
+                     InstanceContext->Volume,
+                     status) );
+
+        goto FmmOpenMetadataCleanup;
+    }
+
 
 FmmOpenMetadataCleanup:
 
@@ -411,6 +551,16 @@ Note:
                 ("[Fmm]: Closing metadata file ... (Volume = %p)\n",
                  InstanceContext->Volume ) );
 
+    //
+    //  Write out pending metadata updates and stop using the file object.
+    //
+
+    FmmBeginFileSystemOperation( InstanceContext );
+
+    FmmJournalDetach( &InstanceContext->Journal );
+
+    FmmEndFileSystemOperation( InstanceContext );
+
     //
     //  Dereference the file object and close the file handle.
     //
@@ -960,6 +1110,1889 @@ Note:
 
 
 
+//
+//  Metadata journal.
+//
+//  See MetadataManagerStruc.h for a description of the on-disk format.
+//
+
+RTL_GENERIC_COMPARE_RESULTS
+NTAPI
+FmmIndexCompare (
+    _In_ PRTL_AVL_TABLE Table,
+    _In_ PVOID FirstStruct,
+    _In_ PVOID SecondStruct
+    )
+/*++
+
+Routine Description:
+
+    AVL table comparison routine for the metadata index.  Entries are
+    ordered by file id.
+
+--*/
+{
+    PFMM_METADATA_ENTRY first = FirstStruct;
+    PFMM_METADATA_ENTRY second = SecondStruct;
+
+    UNREFERENCED_PARAMETER( Table );
+
+    PAGED_CODE();
+
+    if (first->FileId < second->FileId) {
+
+        return GenericLessThan;
+
+    } else if (first->FileId > second->FileId) {
+
+        return GenericGreaterThan;
+    }
+
+    return GenericEqual;
+}
+
+PVOID
+NTAPI
+FmmIndexAllocate (
+    _In_ PRTL_AVL_TABLE Table,
+    _In_ CLONG ByteSize
+    )
+/*++
+
+Routine Description:
+
+    AVL table allocation routine for the metadata index.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( Table );
+
+    PAGED_CODE();
+
+    return ExAllocatePoolWithTag( PagedPool, ByteSize, FMM_INDEX_ENTRY_TAG );
+}
+
+VOID
+NTAPI
+FmmIndexFree (
+    _In_ PRTL_AVL_TABLE Table,
+    _In_ __drv_freesMem(Mem) _Post_invalid_ PVOID Buffer
+    )
+/*++
+
+Routine Description:
+
+    AVL table free routine for the metadata index.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( Table );
+
+    PAGED_CODE();
+
+    ExFreePoolWithTag( Buffer, FMM_INDEX_ENTRY_TAG );
+}
+
+VOID
+FmmJournalClearIndex (
+    _Inout_ PFMM_JOURNAL Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine removes every entry from the metadata index.
+
+Arguments:
+
+    Journal - Supplies the journal whose index is to be emptied.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PVOID entry;
+
+    PAGED_CODE();
+
+    while ((entry = RtlGetElementGenericTableAvl( &Journal->Index, 0 )) != NULL) {
+
+        RtlDeleteElementGenericTableAvl( &Journal->Index, entry );
+    }
+}
+
+ULONG
+FmmJournalChecksum (
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine computes the checksum used to detect torn or stale headers
+    and records (32 bit FNV-1a).
+
+Arguments:
+
+    Buffer - Supplies the bytes to checksum.
+
+    Length - Supplies the number of bytes.
+
+Return Value:
+
+    The checksum.
+
+--*/
+{
+    PUCHAR bytes = Buffer;
+    ULONG hash = 2166136261;
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < Length; i++) {
+
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+ULONG
+FmmJournalBuildRecord (
+    _Out_writes_bytes_(FMM_JOURNAL_MAX_RECORD_SIZE) PVOID Buffer,
+    _In_ USHORT Type,
+    _In_ ULONG Flags,
+    _In_ ULONGLONG Lsn,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength
+    )
+/*++
+
+Routine Description:
+
+    This routine formats a journal record.
+
+Arguments:
+
+    Buffer - Supplies the buffer receiving the record.
+
+    Type - Supplies the record type, FMM_JOURNAL_RECORD_XXX.
+
+    Flags - Supplies the record flags, FMM_JOURNAL_RECORD_F_XXX.
+
+    Lsn - Supplies the log sequence number of the record.
+
+    FileId - Supplies the file the record describes.
+
+    Data, DataLength - Supply the file's metadata for a set record.
+
+Return Value:
+
+    The size of the record in bytes.
+
+--*/
+{
+    PFMM_JOURNAL_RECORD record = Buffer;
+    ULONG size = FMM_JOURNAL_RECORD_SIZE( DataLength );
+
+    PAGED_CODE();
+
+    FLT_ASSERT( DataLength <= FMM_METADATA_MAX_LENGTH );
+
+    RtlZeroMemory( record, size );
+
+    record->Signature = FMM_JOURNAL_RECORD_SIGNATURE;
+    record->Type = Type;
+    record->DataLength = DataLength;
+    record->Lsn = Lsn;
+    record->FileId = FileId;
+    record->Flags = Flags;
+
+    if (DataLength > 0) {
+
+        RtlCopyMemory( record->Data, Data, DataLength );
+    }
+
+    record->Checksum = FmmJournalChecksum( record, size );
+
+    return size;
+}
+
+NTSTATUS
+FmmJournalApply (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ USHORT Type,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength,
+    _Out_opt_ PBOOLEAN Changed
+    )
+/*++
+
+Routine Description:
+
+    This routine applies a set or delete to the metadata index.
+
+Arguments:
+
+    Journal - Supplies the journal whose index is to be updated.
+
+    Type - Supplies FMM_JOURNAL_RECORD_SET or FMM_JOURNAL_RECORD_DELETE.
+
+    FileId - Supplies the file to update.
+
+    Data, DataLength - Supply the file's new metadata for a set.
+
+    Changed - Optionally receives FALSE if a delete found nothing to delete.
+
+Return Value:
+
+    Returns the status of this operation.
+
+Note:
+
+    The caller must hold the journal resource exclusive.
+
+--*/
+{
+    FMM_METADATA_ENTRY newEntry;
+    PFMM_METADATA_ENTRY entry;
+
+    PAGED_CODE();
+
+    FLT_ASSERT( DataLength <= FMM_METADATA_MAX_LENGTH );
+
+    if (Changed != NULL) {
+
+        *Changed = TRUE;
+    }
+
+    newEntry.FileId = FileId;
+
+    if (Type == FMM_JOURNAL_RECORD_DELETE) {
+
+        if (!RtlDeleteElementGenericTableAvl( &Journal->Index, &newEntry ) &&
+            Changed != NULL) {
+
+            *Changed = FALSE;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    entry = RtlLookupElementGenericTableAvl( &Journal->Index, &newEntry );
+
+    if (entry == NULL) {
+
+        newEntry.Length = 0;
+
+        entry = RtlInsertElementGenericTableAvl( &Journal->Index,
+                                                 &newEntry,
+                                                 sizeof( FMM_METADATA_ENTRY ),
+                                                 NULL );
+
+        if (entry == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    entry->Length = DataLength;
+
+    if (DataLength > 0) {
+
+        RtlCopyMemory( entry->Data, Data, DataLength );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FmmJournalWrite (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ LONGLONG Offset,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine writes to the metadata file and flushes it to disk.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+    Offset - Supplies the file offset to write at.
+
+    Buffer, Length - Supply the data to write.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    LARGE_INTEGER byteOffset;
+    ULONG bytesWritten;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (Length == 0) {
+
+        return STATUS_SUCCESS;
+    }
+
+    byteOffset.QuadPart = Offset;
+
+    status = FltWriteFile( Journal->Instance,
+                           FileObject,
+                           &byteOffset,
+                           Length,
+                           Buffer,
+                           FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+                           &bytesWritten,
+                           NULL,
+                           NULL );
+
+    if (NT_SUCCESS( status ) && bytesWritten != Length) {
+
+        status = STATUS_DISK_FULL;
+    }
+
+    if (NT_SUCCESS( status )) {
+
+        status = FltFlushBuffers( Journal->Instance, FileObject );
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        DebugTrace( DEBUG_TRACE_JOURNAL | DEBUG_TRACE_ERROR,
+                    ("[Fmm]: Failed to write metadata journal (Offset = 0x%I64x, Length = 0x%x, Status = 0x%x)\n",
+                     Offset,
+                     Length,
+                     status) );
+    }
+
+    return status;
+}
+
+NTSTATUS
+FmmJournalWriteHeader (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ ULONG Sequence,
+    _In_ LONGLONG JournalStart,
+    _In_ ULONG CheckpointLength,
+    _In_ ULONGLONG CheckpointLsn
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a journal header to the slot selected by its
+    sequence number, so that the previous header is left intact.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+    Sequence - Supplies the sequence number of the new header.
+
+    JournalStart - Supplies the offset of the checkpoint.
+
+    CheckpointLength - Supplies the length of the checkpoint.
+
+    CheckpointLsn - Supplies the LSN of the checkpoint records.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    FMM_JOURNAL_HEADER header;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( &header, sizeof( header ) );
+
+    header.Signature = FMM_JOURNAL_SIGNATURE;
+    header.Version = FMM_JOURNAL_VERSION;
+    header.Sequence = Sequence;
+    header.CheckpointLength = CheckpointLength;
+    header.JournalStart = JournalStart;
+    header.CheckpointLsn = CheckpointLsn;
+    header.Checksum = FmmJournalChecksum( &header, sizeof( header ) );
+
+    return FmmJournalWrite( Journal,
+                            FileObject,
+                            (Sequence & 1) * FMM_JOURNAL_HEADER_SIZE,
+                            &header,
+                            sizeof( header ) );
+}
+
+NTSTATUS
+FmmJournalFormat (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine writes an empty journal to the metadata file.  If the
+    index already holds metadata (because the metadata file was recreated
+    while the volume was locked) a checkpoint is written on the next commit.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+Return Value:
+
+    Returns the status of this operation.
+
+Note:
+
+    The caller must hold the journal resource exclusive.
+
+--*/
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FmmJournalWriteHeader( Journal,
+                                    FileObject,
+                                    Journal->HeaderSequence + 1,
+                                    FMM_JOURNAL_DATA_OFFSET,
+                                    0,
+                                    Journal->NextLsn - 1 );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    Journal->HeaderSequence += 1;
+    Journal->JournalStart = FMM_JOURNAL_DATA_OFFSET;
+    Journal->CheckpointLength = 0;
+    Journal->Tail = FMM_JOURNAL_DATA_OFFSET;
+    Journal->BytesSinceCheckpoint = 0;
+    Journal->CheckpointNeeded = (BOOLEAN)(RtlNumberGenericTableElementsAvl( &Journal->Index ) > 0);
+
+    DebugTrace( DEBUG_TRACE_JOURNAL,
+                ("[Fmm]: Formatted metadata journal (Instance = %p, Sequence = %u)\n",
+                 Journal->Instance,
+                 Journal->HeaderSequence) );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FmmJournalRecover (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine loads the index from the metadata file.  The checkpoint
+    described by the newest valid header is loaded and the journal records
+    following it are replayed.  If that checkpoint is incomplete the older
+    header is tried, and if neither can be loaded the metadata is discarded
+    and an empty journal is started, so a damaged file never keeps the
+    metadata from being opened.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+Return Value:
+
+    Returns the status of this operation.
+
+Note:
+
+    The caller must hold the journal resource exclusive.  The flush buffer
+    is used for reading, so the journal must not be attached.
+
+--*/
+{
+    PFMM_JOURNAL_HEADER header;
+    PUCHAR buffer = Journal->FlushBuffer;
+    LARGE_INTEGER byteOffset;
+    ULONG bytesRead;
+    ULONG checksum;
+    ULONG slot;
+    ULONG count = 0;
+    FMM_JOURNAL_HEADER headers[2];
+    FMM_JOURNAL_HEADER swap;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    FLT_ASSERT( Journal->FileObject == NULL );
+
+    //
+    //  Read both header slots and keep the valid ones, newest first.
+    //
+
+    byteOffset.QuadPart = 0;
+
+    status = FltReadFile( Journal->Instance,
+                          FileObject,
+                          &byteOffset,
+                          2 * FMM_JOURNAL_HEADER_SIZE,
+                          buffer,
+                          FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+                          &bytesRead,
+                          NULL,
+                          NULL );
+
+    if (status == STATUS_END_OF_FILE) {
+
+        bytesRead = 0;
+        status = STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    for (slot = 0; slot < 2; slot++) {
+
+        if (bytesRead < slot * FMM_JOURNAL_HEADER_SIZE + sizeof( FMM_JOURNAL_HEADER )) {
+
+            break;
+        }
+
+        header = (PFMM_JOURNAL_HEADER) (buffer + slot * FMM_JOURNAL_HEADER_SIZE);
+
+        checksum = header->Checksum;
+        header->Checksum = 0;
+
+        if (header->Signature == FMM_JOURNAL_SIGNATURE &&
+            header->Version == FMM_JOURNAL_VERSION &&
+            header->JournalStart >= FMM_JOURNAL_DATA_OFFSET &&
+            checksum == FmmJournalChecksum( header, sizeof( FMM_JOURNAL_HEADER ) )) {
+
+            headers[count] = *header;
+            headers[count].Checksum = checksum;
+            count += 1;
+        }
+
+        header->Checksum = checksum;
+    }
+
+    if (count == 0) {
+
+        //
+        //  This is either a new or an unrecognized metadata file.  Start
+        //  with an empty journal.
+        //
+
+        DebugTrace( DEBUG_TRACE_JOURNAL,
+                    ("[Fmm]: No valid metadata journal header found (Instance = %p, Length = 0x%x)\n",
+                     Journal->Instance,
+                     bytesRead) );
+
+        return FmmJournalFormat( Journal, FileObject );
+    }
+
+    if (count == 2 && headers[1].Sequence > headers[0].Sequence) {
+
+        swap = headers[0];
+        headers[0] = headers[1];
+        headers[1] = swap;
+    }
+
+    for (slot = 0; slot < count; slot++) {
+
+        status = FmmJournalReplay( Journal, FileObject, &headers[slot] );
+
+        if (status != STATUS_FILE_CORRUPT_ERROR) {
+
+            return status;
+        }
+    }
+
+    //
+    //  No checkpoint survived.  Drop whatever was partially loaded and
+    //  start over with a header that supersedes both damaged ones.
+    //
+
+    DebugTrace( DEBUG_TRACE_JOURNAL | DEBUG_TRACE_ERROR,
+                ("[Fmm]: Discarding unrecoverable metadata journal (Instance = %p)\n",
+                 Journal->Instance) );
+
+    FmmJournalClearIndex( Journal );
+
+    Journal->HeaderSequence = headers[0].Sequence;
+
+    return FmmJournalFormat( Journal, FileObject );
+}
+
+NTSTATUS
+FmmJournalReplay (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ PFMM_JOURNAL_HEADER Header
+    )
+/*++
+
+Routine Description:
+
+    This routine loads the checkpoint described by a header, then replays
+    the journal records following it up to the first record that is torn or
+    that predates the checkpoint.  The journal continues from that point;
+    anything past it is overwritten by later writes.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+    Header - Supplies the header to load.
+
+Return Value:
+
+    STATUS_FILE_CORRUPT_ERROR if the checkpoint is incomplete, otherwise the
+    status of this operation.
+
+Note:
+
+    The caller must hold the journal resource exclusive.
+
+--*/
+{
+    PFMM_JOURNAL_RECORD record;
+    PUCHAR buffer = Journal->FlushBuffer;
+    LARGE_INTEGER byteOffset;
+    LONGLONG fileOffset;
+    LONGLONG checkpointEnd;
+    ULONGLONG lastLsn;
+    ULONG bytesRead;
+    ULONG position;
+    ULONG size;
+    ULONG checksum;
+    ULONG replayed = 0;
+    BOOLEAN endOfJournal = FALSE;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    FmmJournalClearIndex( Journal );
+
+    fileOffset = Header->JournalStart;
+    checkpointEnd = Header->JournalStart + Header->CheckpointLength;
+    lastLsn = Header->CheckpointLsn;
+    position = 0;
+
+    while (!endOfJournal) {
+
+        byteOffset.QuadPart = fileOffset;
+
+        status = FltReadFile( Journal->Instance,
+                              FileObject,
+                              &byteOffset,
+                              FMM_JOURNAL_BUFFER_SIZE,
+                              buffer,
+                              FLTFL_IO_OPERATION_DO_NOT_UPDATE_BYTE_OFFSET,
+                              &bytesRead,
+                              NULL,
+                              NULL );
+
+        if (status == STATUS_END_OF_FILE) {
+
+            bytesRead = 0;
+            status = STATUS_SUCCESS;
+        }
+
+        if (!NT_SUCCESS( status )) {
+
+            return status;
+        }
+
+        position = 0;
+
+        while (bytesRead - position >= FMM_JOURNAL_RECORD_HEADER_SIZE) {
+
+            record = (PFMM_JOURNAL_RECORD) (buffer + position);
+
+            if (record->Signature != FMM_JOURNAL_RECORD_SIGNATURE ||
+                record->DataLength > FMM_METADATA_MAX_LENGTH ||
+                (record->Type != FMM_JOURNAL_RECORD_SET &&
+                 record->Type != FMM_JOURNAL_RECORD_DELETE)) {
+
+                endOfJournal = TRUE;
+                break;
+            }
+
+            size = FMM_JOURNAL_RECORD_SIZE( record->DataLength );
+
+            if (size > bytesRead - position) {
+
+                //
+                //  The record continues past this read.
+                //
+
+                break;
+            }
+
+            checksum = record->Checksum;
+            record->Checksum = 0;
+
+            if (checksum != FmmJournalChecksum( record, size )) {
+
+                endOfJournal = TRUE;
+                break;
+            }
+
+            if (fileOffset + position < checkpointEnd) {
+
+                //
+                //  Every record of the checkpoint must be present.
+                //
+
+                if (!FlagOn( record->Flags, FMM_JOURNAL_RECORD_F_CHECKPOINT ) ||
+                    record->Lsn != Header->CheckpointLsn) {
+
+                    endOfJournal = TRUE;
+                    break;
+                }
+
+            } else {
+
+                //
+                //  Journal records were written after the checkpoint and
+                //  have increasing LSNs.  Anything else is left over from
+                //  before the checkpoint or from a torn write.
+                //
+
+                if (FlagOn( record->Flags, FMM_JOURNAL_RECORD_F_CHECKPOINT ) ||
+                    record->Lsn <= lastLsn) {
+
+                    endOfJournal = TRUE;
+                    break;
+                }
+
+                lastLsn = record->Lsn;
+            }
+
+            status = FmmJournalApply( Journal,
+                                      record->Type,
+                                      record->FileId,
+                                      record->Data,
+                                      record->DataLength,
+                                      NULL );
+
+            if (!NT_SUCCESS( status )) {
+
+                return status;
+            }
+
+            replayed += 1;
+            position += size;
+        }
+
+        if (bytesRead < FMM_JOURNAL_BUFFER_SIZE) {
+
+            //
+            //  This read reached the end of the file.
+            //
+
+            endOfJournal = TRUE;
+        }
+
+        if (!endOfJournal) {
+
+            fileOffset += position;
+        }
+    }
+
+    fileOffset += position;
+
+    if (fileOffset < checkpointEnd) {
+
+        DebugTrace( DEBUG_TRACE_JOURNAL | DEBUG_TRACE_ERROR,
+                    ("[Fmm]: Metadata checkpoint is incomplete (Instance = %p, Sequence = %u)\n",
+                     Journal->Instance,
+                     Header->Sequence) );
+
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    Journal->HeaderSequence = Header->Sequence;
+    Journal->JournalStart = Header->JournalStart;
+    Journal->CheckpointLength = Header->CheckpointLength;
+    Journal->Tail = fileOffset;
+    Journal->BytesSinceCheckpoint = fileOffset - checkpointEnd;
+    Journal->DurableLsn = lastLsn;
+
+    //
+    //  Records of a torn write may remain past the tail with LSNs above the
+    //  last one replayed.  Skip past any LSN such a write could have used,
+    //  so that they can never be taken for records written from now on.
+    //
+
+    Journal->NextLsn = lastLsn + 1 + FMM_JOURNAL_MAX_RECORDS_PER_WRITE;
+
+    DebugTrace( DEBUG_TRACE_JOURNAL,
+                ("[Fmm]: Recovered metadata journal (Instance = %p, Sequence = %u, Records = %u, Tail = 0x%I64x)\n",
+                 Journal->Instance,
+                 Journal->HeaderSequence,
+                 replayed,
+                 Journal->Tail) );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FmmJournalBuildCheckpoint (
+    _Inout_ PFMM_JOURNAL Journal,
+    _Outptr_result_bytebuffer_maybenull_(*Length) PUCHAR *Buffer,
+    _Out_ PULONG Length,
+    _Out_ PLONGLONG Offset,
+    _Out_ PULONGLONG Lsn
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the whole index into a new buffer as checkpoint
+    records, and chooses where in the metadata file the checkpoint goes.
+    Records appended but not yet written are discarded since the
+    checkpoint includes them.
+
+    The checkpoint is placed at the start of the data area if it fits in
+    front of the live journal, which lets the file be truncated after it,
+    otherwise it is appended after the journal.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    Buffer - Receives the checkpoint records, or NULL if the index is
+        empty.  The caller frees it.
+
+    Length - Receives the length of the checkpoint.
+
+    Offset - Receives the file offset at which to write the checkpoint.
+
+    Lsn - Receives the LSN the checkpoint makes durable.
+
+Return Value:
+
+    Returns the status of this operation.
+
+Note:
+
+    The caller must hold the journal resource exclusive.
+
+--*/
+{
+    PFMM_METADATA_ENTRY entry;
+    PUCHAR buffer = NULL;
+    ULONG length = 0;
+    ULONG position = 0;
+    ULONGLONG lsn = Journal->NextLsn - 1;
+
+    PAGED_CODE();
+
+    for (entry = RtlEnumerateGenericTableAvl( &Journal->Index, TRUE );
+         entry != NULL;
+         entry = RtlEnumerateGenericTableAvl( &Journal->Index, FALSE )) {
+
+        length += FMM_JOURNAL_RECORD_SIZE( entry->Length );
+    }
+
+    if (length > 0) {
+
+        buffer = ExAllocatePoolWithTag( PagedPool, length, FMM_JOURNAL_BUFFER_TAG );
+
+        if (buffer == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (entry = RtlEnumerateGenericTableAvl( &Journal->Index, TRUE );
+             entry != NULL;
+             entry = RtlEnumerateGenericTableAvl( &Journal->Index, FALSE )) {
+
+            position += FmmJournalBuildRecord( buffer + position,
+                                               FMM_JOURNAL_RECORD_SET,
+                                               FMM_JOURNAL_RECORD_F_CHECKPOINT,
+                                               lsn,
+                                               entry->FileId,
+                                               entry->Data,
+                                               entry->Length );
+        }
+
+        FLT_ASSERT( position == length );
+    }
+
+    Journal->ActiveLength = 0;
+
+    *Buffer = buffer;
+    *Length = length;
+    *Lsn = lsn;
+
+    if ((LONGLONG) length <= Journal->JournalStart - FMM_JOURNAL_DATA_OFFSET) {
+
+        *Offset = FMM_JOURNAL_DATA_OFFSET;
+
+    } else {
+
+        *Offset = Journal->Tail;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FmmJournalWriteCheckpoint (
+    _In_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_reads_bytes_opt_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _In_ LONGLONG Offset,
+    _In_ ULONGLONG Lsn
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a checkpoint built by FmmJournalBuildCheckpoint and
+    then a header pointing at it.  Until the header is on disk the previous
+    checkpoint and journal remain the valid ones.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.
+
+    Buffer, Length - Supply the checkpoint records.
+
+    Offset - Supplies the file offset of the checkpoint.
+
+    Lsn - Supplies the LSN of the checkpoint records.
+
+Return Value:
+
+    Returns the status of this operation.
+
+Note:
+
+    The caller must be the thread that set FlushInProgress.
+
+--*/
+{
+    FILE_END_OF_FILE_INFORMATION endOfFile;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FmmJournalWrite( Journal, FileObject, Offset, Buffer, Length );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    status = FmmJournalWriteHeader( Journal,
+                                    FileObject,
+                                    Journal->HeaderSequence + 1,
+                                    Offset,
+                                    Length,
+                                    Lsn );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    if (Offset == FMM_JOURNAL_DATA_OFFSET) {
+
+        //
+        //  Everything past the checkpoint is now stale, give the space back.
+        //  Failing to do so is harmless.
+        //
+
+        endOfFile.EndOfFile.QuadPart = Offset + Length;
+
+        (VOID) FltSetInformationFile( Journal->Instance,
+                                      FileObject,
+                                      &endOfFile,
+                                      sizeof( endOfFile ),
+                                      FileEndOfFileInformation );
+    }
+
+    DebugTrace( DEBUG_TRACE_JOURNAL,
+                ("[Fmm]: Wrote metadata checkpoint (Instance = %p, Offset = 0x%I64x, Length = 0x%x, Lsn = %I64u)\n",
+                 Journal->Instance,
+                 Offset,
+                 Length,
+                 Lsn) );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+FmmJournalAppend (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ USHORT Type,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength,
+    _Out_ PULONGLONG Lsn
+    )
+/*++
+
+Routine Description:
+
+    This routine applies an update to the index and appends its record to
+    the group commit buffer.  The update is not durable until the returned
+    LSN is committed with FmmJournalCommit.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    Type - Supplies FMM_JOURNAL_RECORD_SET or FMM_JOURNAL_RECORD_DELETE.
+
+    FileId - Supplies the file to update.
+
+    Data, DataLength - Supply the file's new metadata for a set.
+
+    Lsn - Receives the LSN to commit.  If nothing was appended, because a
+        delete found no metadata, this is the LSN of the last record
+        appended, which may be the one that removed it.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    ULONG size = FMM_JOURNAL_RECORD_SIZE( DataLength );
+    ULONGLONG lastLsn;
+    BOOLEAN changed;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Lsn = 0;
+
+#pragma warning(push)
+#pragma warning(disable:4127) //  Conditional expression is constant
+    while (TRUE) {
+
+#pragma warning(pop)
+
+        FmmAcquireResourceExclusive( &Journal->Resource );
+
+        if (!Journal->Loaded) {
+
+            FmmReleaseResource( &Journal->Resource );
+            return STATUS_FILE_CLOSED;
+        }
+
+        if (Journal->ActiveLength + size <= FMM_JOURNAL_BUFFER_SIZE) {
+
+            break;
+        }
+
+        //
+        //  The buffer is full.  Write it out and try again.
+        //
+
+        lastLsn = Journal->NextLsn - 1;
+
+        FmmReleaseResource( &Journal->Resource );
+
+        status = FmmJournalCommit( Journal, lastLsn );
+
+        if (!NT_SUCCESS( status )) {
+
+            return status;
+        }
+    }
+
+    status = FmmJournalApply( Journal, Type, FileId, Data, DataLength, &changed );
+
+    if (NT_SUCCESS( status ) && changed) {
+
+        *Lsn = Journal->NextLsn;
+        Journal->NextLsn += 1;
+
+        Journal->ActiveLength += FmmJournalBuildRecord( Journal->ActiveBuffer + Journal->ActiveLength,
+                                                        Type,
+                                                        0,
+                                                        *Lsn,
+                                                        FileId,
+                                                        Data,
+                                                        DataLength );
+        Journal->ActiveRecords += 1;
+
+    } else if (NT_SUCCESS( status )) {
+
+        *Lsn = Journal->NextLsn - 1;
+    }
+
+    FmmReleaseResource( &Journal->Resource );
+
+    return status;
+}
+
+NTSTATUS
+FmmJournalCommit (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ ULONGLONG Lsn
+    )
+/*++
+
+Routine Description:
+
+    This routine waits until the record with the given LSN is on disk.
+
+    The first committer to find no write in progress becomes the leader:
+    it takes every record appended so far, writes and flushes them with a
+    single request, then wakes the other committers.  Committers that
+    arrive while a write is in progress wait for it and then either find
+    their record written or lead the next write, so concurrent updates
+    share one flush.  The leader writes a checkpoint instead when enough
+    journal has accumulated.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    Lsn - Supplies the LSN to commit.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    PFILE_OBJECT fileObject;
+    PUCHAR buffer;
+    ULONG length;
+    ULONG records;
+    LONGLONG offset;
+    ULONGLONG targetLsn;
+    BOOLEAN checkpoint;
+    PKEVENT event;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+#pragma warning(push)
+#pragma warning(disable:4127) //  Conditional expression is constant
+    while (TRUE) {
+
+#pragma warning(pop)
+
+        FmmAcquireResourceExclusive( &Journal->Resource );
+
+        if (Journal->DurableLsn >= Lsn) {
+
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (Journal->FailedLsn >= Lsn) {
+
+            status = Journal->FailedStatus;
+            break;
+        }
+
+        if (Journal->FileObject == NULL) {
+
+            //
+            //  The metadata file is closed.  The record stays in memory and
+            //  is written once the file is reopened.
+            //
+
+            status = STATUS_FILE_CLOSED;
+            break;
+        }
+
+        if (Journal->FlushInProgress || Journal->HoldCount > 0) {
+
+            event = Journal->FlushInProgress ? &Journal->FlushDoneEvent : &Journal->ResumeEvent;
+
+            FmmReleaseResource( &Journal->Resource );
+
+            KeWaitForSingleObject( event, Executive, KernelMode, FALSE, NULL );
+
+            continue;
+        }
+
+        //
+        //  Lead the next write.
+        //
+
+        Journal->FlushInProgress = TRUE;
+        KeClearEvent( &Journal->FlushDoneEvent );
+
+        fileObject = Journal->FileObject;
+        records = Journal->ActiveRecords;
+        Journal->ActiveRecords = 0;
+
+        checkpoint = (BOOLEAN)(Journal->CheckpointNeeded ||
+                               Journal->BytesSinceCheckpoint >= FMM_JOURNAL_CHECKPOINT_THRESHOLD);
+
+        if (checkpoint) {
+
+            status = FmmJournalBuildCheckpoint( Journal,
+                                                &buffer,
+                                                &length,
+                                                &offset,
+                                                &targetLsn );
+
+            if (!NT_SUCCESS( status )) {
+
+                if (Journal->CheckpointNeeded) {
+
+                    //
+                    //  The journal cannot be trusted until a checkpoint is
+                    //  written, so fail everything appended so far.
+                    //
+
+                    Journal->ActiveRecords = records;
+                    Journal->FailedLsn = Journal->NextLsn - 1;
+                    Journal->FailedStatus = status;
+                    Journal->FlushInProgress = FALSE;
+                    KeSetEvent( &Journal->FlushDoneEvent, IO_NO_INCREMENT, FALSE );
+                    break;
+                }
+
+                checkpoint = FALSE;
+            }
+        }
+
+        if (!checkpoint) {
+
+            buffer = Journal->ActiveBuffer;
+            length = Journal->ActiveLength;
+            Journal->ActiveBuffer = Journal->FlushBuffer;
+            Journal->FlushBuffer = buffer;
+            Journal->ActiveLength = 0;
+
+            offset = Journal->Tail;
+            targetLsn = Journal->NextLsn - 1;
+        }
+
+        FmmReleaseResource( &Journal->Resource );
+
+        if (checkpoint) {
+
+            status = FmmJournalWriteCheckpoint( Journal,
+                                                fileObject,
+                                                buffer,
+                                                length,
+                                                offset,
+                                                targetLsn );
+
+            if (buffer != NULL) {
+
+                ExFreePoolWithTag( buffer, FMM_JOURNAL_BUFFER_TAG );
+            }
+
+        } else {
+
+            status = FmmJournalWrite( Journal, fileObject, offset, buffer, length );
+        }
+
+        FmmAcquireResourceExclusive( &Journal->Resource );
+
+        if (NT_SUCCESS( status )) {
+
+            if (checkpoint) {
+
+                Journal->HeaderSequence += 1;
+                Journal->JournalStart = offset;
+                Journal->CheckpointLength = length;
+                Journal->Tail = offset + length;
+                Journal->BytesSinceCheckpoint = 0;
+                Journal->CheckpointNeeded = FALSE;
+                Journal->Checkpoints += 1;
+
+            } else {
+
+                Journal->Tail += length;
+                Journal->BytesSinceCheckpoint += length;
+            }
+
+            Journal->Flushes += 1;
+            Journal->RecordsCommitted += records;
+            Journal->DurableLsn = targetLsn;
+
+        } else {
+
+            //
+            //  The records written may be partially on disk.  Rewrite the
+            //  whole index before anything else is added to the journal.
+            //
+
+            Journal->FailedLsn = targetLsn;
+            Journal->FailedStatus = status;
+            Journal->CheckpointNeeded = TRUE;
+        }
+
+        Journal->FlushInProgress = FALSE;
+        KeSetEvent( &Journal->FlushDoneEvent, IO_NO_INCREMENT, FALSE );
+
+        FmmReleaseResource( &Journal->Resource );
+    }
+
+    FmmReleaseResource( &Journal->Resource );
+
+    return status;
+}
+
+NTSTATUS
+FmmJournalInitialize (
+    _Out_ PFMM_JOURNAL Journal,
+    _In_ PFLT_INSTANCE Instance
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes the journal of an instance.  The journal must
+    be torn down with FmmJournalCleanup even if this routine fails.
+
+Arguments:
+
+    Journal - Supplies the journal to initialize.
+
+    Instance - Supplies the instance the journal belongs to.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    PAGED_CODE();
+
+    RtlZeroMemory( Journal, sizeof( FMM_JOURNAL ) );
+
+    ExInitializeResourceLite( &Journal->Resource );
+
+    RtlInitializeGenericTableAvl( &Journal->Index,
+                                  FmmIndexCompare,
+                                  FmmIndexAllocate,
+                                  FmmIndexFree,
+                                  NULL );
+
+    KeInitializeEvent( &Journal->FlushDoneEvent, NotificationEvent, TRUE );
+    KeInitializeEvent( &Journal->ResumeEvent, NotificationEvent, TRUE );
+
+    Journal->Instance = Instance;
+    Journal->NextLsn = 1;
+
+    Journal->ActiveBuffer = ExAllocatePoolWithTag( PagedPool,
+                                                   FMM_JOURNAL_BUFFER_SIZE,
+                                                   FMM_JOURNAL_BUFFER_TAG );
+
+    Journal->FlushBuffer = ExAllocatePoolWithTag( PagedPool,
+                                                  FMM_JOURNAL_BUFFER_SIZE,
+                                                  FMM_JOURNAL_BUFFER_TAG );
+
+    if (Journal->ActiveBuffer == NULL || Journal->FlushBuffer == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+FmmJournalCleanup (
+    _Inout_ PFMM_JOURNAL Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the index and buffers of a journal.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    FLT_ASSERT( Journal->FileObject == NULL );
+
+    DebugTrace( DEBUG_TRACE_JOURNAL,
+                ("[Fmm]: Metadata journal statistics (Instance = %p, Flushes = %u, Checkpoints = %u, Records = %I64u)\n",
+                 Journal->Instance,
+                 Journal->Flushes,
+                 Journal->Checkpoints,
+                 Journal->RecordsCommitted) );
+
+    FmmJournalClearIndex( Journal );
+
+    if (Journal->ActiveBuffer != NULL) {
+
+        ExFreePoolWithTag( Journal->ActiveBuffer, FMM_JOURNAL_BUFFER_TAG );
+        Journal->ActiveBuffer = NULL;
+    }
+
+    if (Journal->FlushBuffer != NULL) {
+
+        ExFreePoolWithTag( Journal->FlushBuffer, FMM_JOURNAL_BUFFER_TAG );
+        Journal->FlushBuffer = NULL;
+    }
+
+    ExDeleteResourceLite( &Journal->Resource );
+}
+
+NTSTATUS
+FmmJournalAttach (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ BOOLEAN Created
+    )
+/*++
+
+Routine Description:
+
+    This routine starts using the metadata file for the journal.  The first
+    time the file is opened the index is recovered from it.  When the file
+    is reopened after a volume lock the index in memory is kept, and any
+    updates made while the file was closed are written on the next commit.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+    FileObject - Supplies the metadata file object.  It must remain valid
+        until FmmJournalDetach is called.
+
+    Created - Supplies TRUE if the metadata file was just created.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    FmmAcquireResourceExclusive( &Journal->Resource );
+
+    FLT_ASSERT( Journal->FileObject == NULL );
+    FLT_ASSERT( !Journal->FlushInProgress );
+
+    if (Created) {
+
+        status = FmmJournalFormat( Journal, FileObject );
+
+    } else if (!Journal->Loaded) {
+
+        status = FmmJournalRecover( Journal, FileObject );
+    }
+
+    if (NT_SUCCESS( status )) {
+
+        Journal->Loaded = TRUE;
+        Journal->FileObject = FileObject;
+    }
+
+    FmmReleaseResource( &Journal->Resource );
+
+    return status;
+}
+
+VOID
+FmmJournalDetach (
+    _Inout_ PFMM_JOURNAL Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out any pending updates and stops using the
+    metadata file, which the caller is about to close.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG lastLsn;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    FmmAcquireResourceShared( &Journal->Resource );
+    lastLsn = Journal->NextLsn - 1;
+    FmmReleaseResource( &Journal->Resource );
+
+    //
+    //  Don't wait for a snapshot to complete.  Whatever is not written now
+    //  is written after the file is reopened.
+    //
+
+    if (Journal->HoldCount == 0) {
+
+        status = FmmJournalCommit( Journal, lastLsn );
+
+        if (!NT_SUCCESS( status )) {
+
+            DebugTrace( DEBUG_TRACE_JOURNAL | DEBUG_TRACE_ERROR,
+                        ("[Fmm]: Failed to flush metadata journal before close (Instance = %p, Status = 0x%x)\n",
+                         Journal->Instance,
+                         status) );
+        }
+    }
+
+    FmmAcquireResourceExclusive( &Journal->Resource );
+
+    while (Journal->FlushInProgress) {
+
+        FmmReleaseResource( &Journal->Resource );
+
+        KeWaitForSingleObject( &Journal->FlushDoneEvent, Executive, KernelMode, FALSE, NULL );
+
+        FmmAcquireResourceExclusive( &Journal->Resource );
+    }
+
+    Journal->FileObject = NULL;
+
+    FmmReleaseResource( &Journal->Resource );
+}
+
+VOID
+FmmJournalHoldWrites (
+    _Inout_ PFMM_JOURNAL Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out any pending updates and then holds further
+    writes to the metadata file until FmmJournalResumeWrites is called.
+    Updates made in the meantime are kept in memory, and their committers
+    wait.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG lastLsn;
+
+    PAGED_CODE();
+
+    FmmAcquireResourceShared( &Journal->Resource );
+    lastLsn = Journal->NextLsn - 1;
+    FmmReleaseResource( &Journal->Resource );
+
+    (VOID) FmmJournalCommit( Journal, lastLsn );
+
+    if (InterlockedIncrement( &Journal->HoldCount ) == 1) {
+
+        KeClearEvent( &Journal->ResumeEvent );
+    }
+
+    //
+    //  A write started before the hold must finish before we return.
+    //
+
+    FmmAcquireResourceExclusive( &Journal->Resource );
+
+    while (Journal->FlushInProgress) {
+
+        FmmReleaseResource( &Journal->Resource );
+
+        KeWaitForSingleObject( &Journal->FlushDoneEvent, Executive, KernelMode, FALSE, NULL );
+
+        FmmAcquireResourceExclusive( &Journal->Resource );
+    }
+
+    FmmReleaseResource( &Journal->Resource );
+}
+
+VOID
+FmmJournalResumeWrites (
+    _Inout_ PFMM_JOURNAL Journal
+    )
+/*++
+
+Routine Description:
+
+    This routine undoes FmmJournalHoldWrites.  It may be called at up to
+    DISPATCH_LEVEL.
+
+Arguments:
+
+    Journal - Supplies the journal.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FLT_ASSERT( Journal->HoldCount > 0 );
+
+    if (InterlockedDecrement( &Journal->HoldCount ) == 0) {
+
+        KeSetEvent( &Journal->ResumeEvent, IO_NO_INCREMENT, FALSE );
+    }
+}
+
+NTSTATUS
+FmmSetFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ USHORT Length
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the metadata of a file and returns once it is on disk.
+
+Arguments:
+
+    InstanceContext - Supplies the instance context for this instance.
+
+    FileId - Supplies the file id of the file.
+
+    Buffer, Length - Supply the metadata.
+
+Return Value:
+
+    Returns the status of this operation.  On failure the in-memory index
+    may already reflect the update; it is written with a later commit.
+
+--*/
+{
+    ULONGLONG lsn;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (Length > FMM_METADATA_MAX_LENGTH) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = FmmJournalAppend( &InstanceContext->Journal,
+                               FMM_JOURNAL_RECORD_SET,
+                               FileId,
+                               Buffer,
+                               Length,
+                               &lsn );
+
+    if (NT_SUCCESS( status )) {
+
+        status = FmmJournalCommit( &InstanceContext->Journal, lsn );
+    }
+
+    return status;
+}
+
+NTSTATUS
+FmmDeleteFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId
+    )
+/*++
+
+Routine Description:
+
+    This routine deletes the metadata of a file and returns once the
+    deletion is on disk.
+
+Arguments:
+
+    InstanceContext - Supplies the instance context for this instance.
+
+    FileId - Supplies the file id of the file.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    ULONGLONG lsn;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FmmJournalAppend( &InstanceContext->Journal,
+                               FMM_JOURNAL_RECORD_DELETE,
+                               FileId,
+                               NULL,
+                               0,
+                               &lsn );
+
+    if (NT_SUCCESS( status )) {
+
+        status = FmmJournalCommit( &InstanceContext->Journal, lsn );
+    }
+
+    return status;
+}
+
+NTSTATUS
+FmmQueryFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId,
+    _Out_writes_bytes_to_(BufferLength, *ReturnedLength) PVOID Buffer,
+    _In_ USHORT BufferLength,
+    _Out_ PUSHORT ReturnedLength
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the metadata of a file from the in-memory index.
+
+Arguments:
+
+    InstanceContext - Supplies the instance context for this instance.
+
+    FileId - Supplies the file id of the file.
+
+    Buffer, BufferLength - Supply the buffer receiving the metadata.
+
+    ReturnedLength - Receives the length of the metadata.  If the buffer is
+        too small, receives the length required.
+
+Return Value:
+
+    STATUS_NOT_FOUND if the file has no metadata, STATUS_BUFFER_TOO_SMALL if
+    the buffer cannot hold it, otherwise the status of this operation.
+
+--*/
+{
+    PFMM_JOURNAL journal = &InstanceContext->Journal;
+    FMM_METADATA_ENTRY key;
+    PFMM_METADATA_ENTRY entry;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *ReturnedLength = 0;
+    key.FileId = FileId;
+
+    FmmAcquireResourceShared( &journal->Resource );
+
+    entry = RtlLookupElementGenericTableAvl( &journal->Index, &key );
+
+    if (entry == NULL) {
+
+        status = STATUS_NOT_FOUND;
+
+    } else if (entry->Length > BufferLength) {
+
+        *ReturnedLength = entry->Length;
+        status = STATUS_BUFFER_TOO_SMALL;
+
+    } else {
+
+        RtlCopyMemory( Buffer, entry->Data, entry->Length );
+        *ReturnedLength = entry->Length;
+        status = STATUS_SUCCESS;
+    }
+
+    FmmReleaseResource( &journal->Resource );
+
+    return status;
+}
+
+VOID
+FmmQueryJournalStatistics (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _Out_ PFMM_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the journal statistics of an instance.
+
+Arguments:
+
+    InstanceContext - Supplies the instance context for this instance.
+
+    Statistics - Receives the statistics.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFMM_JOURNAL journal = &InstanceContext->Journal;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( Statistics, sizeof( FMM_STATISTICS ) );
+
+    FmmAcquireResourceShared( &journal->Resource );
+
+    Statistics->Flushes = journal->Flushes;
+    Statistics->Checkpoints = journal->Checkpoints;
+    Statistics->RecordsCommitted = journal->RecordsCommitted;
+    Statistics->Files = RtlNumberGenericTableElementsAvl( &journal->Index );
+
+    FmmReleaseResource( &journal->Resource );
+}
+
+
 #if VERIFY_METADATA_OPENED
 
 NTSTATUS
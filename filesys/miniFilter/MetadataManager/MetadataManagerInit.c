@@ -84,6 +84,37 @@ FmmInstanceTeardownComplete (
     _In_ FLT_INSTANCE_TEARDOWN_FLAGS Flags
     );
 
+NTSTATUS
+FmmPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
+    );
+
+VOID
+FmmPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
+    );
+
+NTSTATUS
+FmmPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+NTSTATUS
+FmmGetMessageFile (
+    _In_ HANDLE FileHandle,
+    _Outptr_ PFMM_INSTANCE_CONTEXT *InstanceContext,
+    _Out_ PLONGLONG FileId
+    );
+
 #if DBG
 
 VOID
@@ -110,6 +141,10 @@ FmmInitializeDebugLevel (
 #pragma alloc_text(PAGE, FmmInstanceQueryTeardown)
 #pragma alloc_text(PAGE, FmmInstanceTeardownStart)
 #pragma alloc_text(PAGE, FmmInstanceTeardownComplete)
+#pragma alloc_text(PAGE, FmmPortConnect)
+#pragma alloc_text(PAGE, FmmPortDisconnect)
+#pragma alloc_text(PAGE, FmmPortMessage)
+#pragma alloc_text(PAGE, FmmGetMessageFile)
 #endif
 
 
@@ -236,6 +271,9 @@ Return Value:
 
 --*/
 {
+    PSECURITY_DESCRIPTOR sd;
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING uniString;
     NTSTATUS status;
 
     //
@@ -279,6 +317,42 @@ Return Value:
         return status;
     }
 
+    //
+    //  Create the port applications set and query metadata through.
+    //  Only administrators and the system can connect.
+    //
+
+    status = FltBuildDefaultSecurityDescriptor( &sd,
+                                                FLT_PORT_ALL_ACCESS );
+
+    if (NT_SUCCESS( status )) {
+
+        RtlInitUnicodeString( &uniString, FMM_PORT_NAME );
+
+        InitializeObjectAttributes( &oa,
+                                    &uniString,
+                                    OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                                    NULL,
+                                    sd );
+
+        status = FltCreateCommunicationPort( Globals.Filter,
+                                             &Globals.ServerPort,
+                                             &oa,
+                                             NULL,
+                                             FmmPortConnect,
+                                             FmmPortDisconnect,
+                                             FmmPortMessage,
+                                             FMM_PORT_MAX_CONNECTIONS );
+
+        FltFreeSecurityDescriptor( sd );
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        FltUnregisterFilter( Globals.Filter );
+        return status;
+    }
+
     //
     //  Start filtering I/O
     //
@@ -287,6 +361,7 @@ Return Value:
 
     if (!NT_SUCCESS( status )) {
 
+        FltCloseCommunicationPort( Globals.ServerPort );
         FltUnregisterFilter( Globals.Filter );
     }
 
@@ -407,6 +482,9 @@ Return Value:
                 ("[Fmm]: Unloading driver\n") );
 
 
+    FltCloseCommunicationPort( Globals.ServerPort );
+    Globals.ServerPort = NULL;
+
     FltUnregisterFilter( Globals.Filter );
     Globals.Filter = NULL;
 
@@ -433,6 +511,8 @@ FmmContextCleanup (
                     ("[Fmm]: Cleaning up instance context for volume (Context = %p)\n",
                     instanceContext) );
 
+        FmmJournalCleanup( &instanceContext->Journal );
+
         ExDeleteResourceLite( &instanceContext->MetadataResource );
 
         break;
@@ -581,6 +661,20 @@ Return Value:
     instanceContext->Volume = FltObjects->Volume;
     ExInitializeResourceLite( &instanceContext->MetadataResource );
 
+    status = FmmJournalInitialize( &instanceContext->Journal,
+                                   FltObjects->Instance );
+
+    if( !NT_SUCCESS( status )) {
+
+        DebugTrace( DEBUG_TRACE_INSTANCES | DEBUG_TRACE_ERROR,
+                    ("[Fmm]: Failed to initialize metadata journal (Volume = %p, Instance = %p, Status = 0x%08X)\n",
+                     FltObjects->Volume,
+                     FltObjects->Instance,
+                     status) );
+
+        goto FmmInstanceSetupCleanup;
+    }
+
 
     //
     //  Set the instance context.
@@ -863,3 +957,373 @@ Return Value:
                  FltObjects->Instance) );
 }
 
+
+//
+//  Communication port routines.
+//
+
+NTSTATUS
+FmmPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
+    )
+/*++
+
+Routine Description:
+
+    This is called when an application connects to the metadata port.
+    Several connections can be open at once, so the client port is kept
+    as the connection cookie rather than in a global.
+
+Arguments:
+
+    ClientPort - Supplies the client connection port.
+
+    ServerPortCookie - Unused.
+
+    ConnectionContext - Unused.
+
+    SizeOfContext - Unused.
+
+    ConnectionCookie - Receives the client port.
+
+Return Value:
+
+    STATUS_SUCCESS.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( ServerPortCookie );
+    UNREFERENCED_PARAMETER( ConnectionContext );
+    UNREFERENCED_PARAMETER( SizeOfContext );
+
+    PAGED_CODE();
+
+    *ConnectionCookie = ClientPort;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+FmmPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
+    )
+/*++
+
+Routine Description:
+
+    This is called when a connection to the metadata port is torn down.
+
+Arguments:
+
+    ConnectionCookie - Supplies the client port of the connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFLT_PORT clientPort = ConnectionCookie;
+
+    PAGED_CODE();
+
+    FltCloseClientPort( Globals.Filter, &clientPort );
+}
+
+
+NTSTATUS
+FmmGetMessageFile (
+    _In_ HANDLE FileHandle,
+    _Outptr_ PFMM_INSTANCE_CONTEXT *InstanceContext,
+    _Out_ PLONGLONG FileId
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the instance of this filter on the volume of a file
+    named by a handle of the calling process, and the file's ID.
+
+Arguments:
+
+    FileHandle - Supplies a handle of the calling process.
+
+    InstanceContext - Receives a reference to the instance context.  The
+        caller must release it with FltReleaseContext.
+
+    FileId - Receives the file ID of the file.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    PFILE_OBJECT fileObject = NULL;
+    PFLT_VOLUME volume = NULL;
+    PFLT_INSTANCE instance = NULL;
+    FILE_INTERNAL_INFORMATION internalInformation;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *InstanceContext = NULL;
+    *FileId = 0;
+
+    status = ObReferenceObjectByHandle( FileHandle,
+                                        0,
+                                        *IoFileObjectType,
+                                        UserMode,
+                                        &fileObject,
+                                        NULL );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto FmmGetMessageFileCleanup;
+    }
+
+    status = FltGetVolumeFromFileObject( Globals.Filter,
+                                         fileObject,
+                                         &volume );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto FmmGetMessageFileCleanup;
+    }
+
+    status = FltGetVolumeInstanceFromName( Globals.Filter,
+                                           volume,
+                                           NULL,
+                                           &instance );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto FmmGetMessageFileCleanup;
+    }
+
+    status = FltQueryInformationFile( instance,
+                                      fileObject,
+                                      &internalInformation,
+                                      sizeof( internalInformation ),
+                                      FileInternalInformation,
+                                      NULL );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto FmmGetMessageFileCleanup;
+    }
+
+    status = FltGetInstanceContext( instance,
+                                    InstanceContext );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto FmmGetMessageFileCleanup;
+    }
+
+    *FileId = internalInformation.IndexNumber.QuadPart;
+
+FmmGetMessageFileCleanup:
+
+    if (instance != NULL) {
+
+        FltObjectDereference( instance );
+    }
+
+    if (volume != NULL) {
+
+        FltObjectDereference( volume );
+    }
+
+    if (fileObject != NULL) {
+
+        ObDereferenceObject( fileObject );
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+FmmPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This is called whenever an application sends a message.  The input
+    buffer holds an FMM_COMMAND_MESSAGE, of which the Data of a set
+    command only needs to be as long as DataLength.
+
+    The message is processed in the context of the sending thread, so the
+    file handle it carries is looked up in the sender's process, and a set
+    or delete waits for its journal record to be committed.  Messages from
+    concurrent senders are committed together.
+
+    The buffers are raw user mode addresses, so they must be accessed
+    inside try/except.
+
+Arguments:
+
+    ConnectionCookie - Unused.
+
+    InputBuffer - A buffer containing the command.
+
+    InputBufferSize - The size in bytes of InputBuffer.
+
+    OutputBuffer - A buffer to receive the reply.
+
+    OutputBufferSize - The size in bytes of OutputBuffer.
+
+    ReturnOutputBufferLength - The number of bytes returned in OutputBuffer.
+
+Return Value:
+
+    The status of the command.
+
+--*/
+{
+    FMM_COMMAND_MESSAGE message;
+    PFMM_INSTANCE_CONTEXT instanceContext;
+    FMM_STATISTICS statistics;
+    UCHAR data[FMM_METADATA_MAX_LENGTH];
+    LONGLONG fileId;
+    USHORT length;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( ConnectionCookie );
+
+    PAGED_CODE();
+
+    *ReturnOutputBufferLength = 0;
+
+    if ((InputBuffer == NULL) ||
+        (InputBufferSize < FIELD_OFFSET( FMM_COMMAND_MESSAGE, Data ))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory( &message, sizeof( message ) );
+
+    try {
+
+        RtlCopyMemory( &message,
+                       InputBuffer,
+                       min( InputBufferSize, sizeof( message ) ) );
+
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+
+        return GetExceptionCode();
+    }
+
+    if ((message.Command == FmmSetMetadata) &&
+        ((message.DataLength > FMM_METADATA_MAX_LENGTH) ||
+         (InputBufferSize < FIELD_OFFSET( FMM_COMMAND_MESSAGE, Data ) + (ULONG) message.DataLength))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = FmmGetMessageFile( (HANDLE) (ULONG_PTR) message.FileHandle,
+                                &instanceContext,
+                                &fileId );
+
+    if (!NT_SUCCESS( status )) {
+
+        DebugTrace( DEBUG_TRACE_METADATA_OPERATIONS | DEBUG_TRACE_ERROR,
+                    ("[Fmm]: Failed to find the file of a metadata command (Command = %d, Status = 0x%x)\n",
+                     message.Command,
+                     status) );
+
+        return status;
+    }
+
+    switch (message.Command) {
+
+        case FmmSetMetadata:
+
+            status = FmmSetFileMetadata( instanceContext,
+                                         fileId,
+                                         message.Data,
+                                         message.DataLength );
+            break;
+
+        case FmmDeleteMetadata:
+
+            status = FmmDeleteFileMetadata( instanceContext,
+                                            fileId );
+            break;
+
+        case FmmQueryMetadata:
+
+            status = FmmQueryFileMetadata( instanceContext,
+                                           fileId,
+                                           data,
+                                           sizeof( data ),
+                                           &length );
+
+            if (!NT_SUCCESS( status )) {
+
+                break;
+            }
+
+            if ((OutputBuffer == NULL) || (OutputBufferSize < length)) {
+
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            try {
+
+                RtlCopyMemory( OutputBuffer, data, length );
+                *ReturnOutputBufferLength = length;
+
+            } except (EXCEPTION_EXECUTE_HANDLER) {
+
+                status = GetExceptionCode();
+            }
+
+            break;
+
+        case FmmGetStatistics:
+
+            if ((OutputBuffer == NULL) || (OutputBufferSize < sizeof( FMM_STATISTICS ))) {
+
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            FmmQueryJournalStatistics( instanceContext, &statistics );
+
+            try {
+
+                RtlCopyMemory( OutputBuffer, &statistics, sizeof( FMM_STATISTICS ) );
+                *ReturnOutputBufferLength = sizeof( FMM_STATISTICS );
+
+            } except (EXCEPTION_EXECUTE_HANDLER) {
+
+                status = GetExceptionCode();
+            }
+
+            break;
+
+        default:
+
+            status = STATUS_INVALID_PARAMETER;
+            break;
+    }
+
+    FltReleaseContext( instanceContext );
+
+    return status;
+}
@@ -163,6 +163,84 @@ FmmEndFileSystemOperation (
     );
 
 
+NTSTATUS
+FmmJournalInitialize (
+    _Out_ PFMM_JOURNAL Journal,
+    _In_ PFLT_INSTANCE Instance
+    );
+
+VOID
+FmmJournalCleanup (
+    _Inout_ PFMM_JOURNAL Journal
+    );
+
+NTSTATUS
+FmmJournalAttach (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ BOOLEAN Created
+    );
+
+VOID
+FmmJournalDetach (
+    _Inout_ PFMM_JOURNAL Journal
+    );
+
+VOID
+FmmJournalHoldWrites (
+    _Inout_ PFMM_JOURNAL Journal
+    );
+
+VOID
+FmmJournalResumeWrites (
+    _Inout_ PFMM_JOURNAL Journal
+    );
+
+NTSTATUS
+FmmJournalAppend (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ USHORT Type,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength,
+    _Out_ PULONGLONG Lsn
+    );
+
+NTSTATUS
+FmmJournalCommit (
+    _Inout_ PFMM_JOURNAL Journal,
+    _In_ ULONGLONG Lsn
+    );
+
+NTSTATUS
+FmmSetFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ USHORT Length
+    );
+
+NTSTATUS
+FmmDeleteFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId
+    );
+
+NTSTATUS
+FmmQueryFileMetadata (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _In_ LONGLONG FileId,
+    _Out_writes_bytes_to_(BufferLength, *ReturnedLength) PVOID Buffer,
+    _In_ USHORT BufferLength,
+    _Out_ PUSHORT ReturnedLength
+    );
+
+VOID
+FmmQueryJournalStatistics (
+    _In_ PFMM_INSTANCE_CONTEXT InstanceContext,
+    _Out_ PFMM_STATISTICS Statistics
+    );
+
 #if VERIFY_METADATA_OPENED
     
 NTSTATUS
@@ -33,6 +33,8 @@ Environment:
 
 #define FMM_STRING_TAG                        'tSmF'
 #define FMM_INSTANCE_CONTEXT_TAG              'cImF'
+#define FMM_JOURNAL_BUFFER_TAG                'bJmF'
+#define FMM_INDEX_ENTRY_TAG                   'eImF'
 
 
 //
@@ -47,6 +49,12 @@ typedef struct _FMM_GLOBAL_DATA {
 
     PFLT_FILTER Filter;
 
+    //
+    //  Port applications set and query metadata through.
+    //
+
+    PFLT_PORT ServerPort;
+
 
 #if DBG
 
@@ -64,6 +72,213 @@ extern FMM_GLOBAL_DATA Globals;
 
 
 
+//
+//  Metadata journal
+//
+//  The metadata file is an append-only journal of fixed-format records,
+//  each describing the new metadata of one file (or its deletion).  The
+//  latest metadata of every file is kept in an in-memory index.  Updates
+//  from concurrent threads are accumulated in a buffer and written with a
+//  single write and flush (group commit).  Once enough of the journal has
+//  been written since the last checkpoint, the index is written out as a
+//  compact checkpoint and the journal restarts after it.
+//
+//  On-disk layout:
+//
+//      0                           Header slot 0
+//      FMM_JOURNAL_HEADER_SIZE     Header slot 1
+//      FMM_JOURNAL_DATA_OFFSET     Checkpoint and journal records
+//
+//  Headers are written alternately to the two slots so that a torn header
+//  write never loses the previous one.  The valid header with the highest
+//  sequence number describes where the current checkpoint starts.  On
+//  recovery the checkpoint is loaded and the journal records after it are
+//  replayed up to the first record that is torn or was not written after
+//  the checkpoint.
+//
+
+#define FMM_JOURNAL_SIGNATURE                 'JmmF'
+#define FMM_JOURNAL_RECORD_SIGNATURE          'RmmF'
+#define FMM_JOURNAL_VERSION                   1
+
+#define FMM_JOURNAL_HEADER_SIZE               512
+#define FMM_JOURNAL_DATA_OFFSET               4096
+
+//
+//  Size of the group commit buffer and of the reads done during recovery.
+//
+
+#define FMM_JOURNAL_BUFFER_SIZE               (64 * 1024)
+
+//
+//  Bytes of journal written after a checkpoint before the next one is taken.
+//
+
+#define FMM_JOURNAL_CHECKPOINT_THRESHOLD      (1024 * 1024)
+
+typedef struct _FMM_JOURNAL_HEADER {
+
+    ULONG Signature;
+    ULONG Version;
+
+    //
+    //  Incremented for each checkpoint.  Selects the header slot.
+    //
+
+    ULONG Sequence;
+
+    //
+    //  Length in bytes of the checkpoint records starting at JournalStart.
+    //
+
+    ULONG CheckpointLength;
+    LONGLONG JournalStart;
+
+    //
+    //  LSN carried by the checkpoint records.  Journal records following
+    //  the checkpoint have strictly greater LSNs.
+    //
+
+    ULONGLONG CheckpointLsn;
+
+    ULONG Checksum;
+    ULONG Reserved;
+
+} FMM_JOURNAL_HEADER, *PFMM_JOURNAL_HEADER;
+
+#define FMM_JOURNAL_RECORD_SET                1
+#define FMM_JOURNAL_RECORD_DELETE             2
+
+#define FMM_JOURNAL_RECORD_F_CHECKPOINT       0x00000001
+
+typedef struct _FMM_JOURNAL_RECORD {
+
+    ULONG Signature;
+    USHORT Type;
+    USHORT DataLength;
+    ULONGLONG Lsn;
+    LONGLONG FileId;
+    ULONG Checksum;
+    ULONG Flags;
+    UCHAR Data[1];
+
+} FMM_JOURNAL_RECORD, *PFMM_JOURNAL_RECORD;
+
+#define FMM_JOURNAL_RECORD_HEADER_SIZE        FIELD_OFFSET( FMM_JOURNAL_RECORD, Data )
+
+#define FMM_JOURNAL_RECORD_SIZE(DataLength)   \
+    ((FMM_JOURNAL_RECORD_HEADER_SIZE + (ULONG)(DataLength) + 7) & ~7UL)
+
+#define FMM_JOURNAL_MAX_RECORD_SIZE           FMM_JOURNAL_RECORD_SIZE( FMM_METADATA_MAX_LENGTH )
+
+//
+//  Upper bound on the records a single journal write can carry.  Recovery
+//  advances the next LSN by this much past the last record replayed.
+//
+
+#define FMM_JOURNAL_MAX_RECORDS_PER_WRITE     (FMM_JOURNAL_BUFFER_SIZE / FMM_JOURNAL_RECORD_HEADER_SIZE)
+
+//
+//  Entry in the in-memory metadata index.
+//
+
+typedef struct _FMM_METADATA_ENTRY {
+
+    LONGLONG FileId;
+    USHORT Length;
+    UCHAR Data[FMM_METADATA_MAX_LENGTH];
+
+} FMM_METADATA_ENTRY, *PFMM_METADATA_ENTRY;
+
+typedef struct _FMM_JOURNAL {
+
+    //
+    //  Protects all fields below and the index.  The journal is written
+    //  without holding this resource; FlushInProgress serializes writers.
+    //
+
+    ERESOURCE Resource;
+
+    PFLT_INSTANCE Instance;
+
+    //
+    //  Metadata file object, or NULL while the metadata file is closed.
+    //
+
+    PFILE_OBJECT FileObject;
+
+    //
+    //  TRUE once the index has been loaded from the metadata file.
+    //
+
+    BOOLEAN Loaded;
+
+    //
+    //  TRUE while a thread is writing the journal on behalf of all
+    //  committers.  FlushDoneEvent is signalled when it clears.
+    //
+
+    BOOLEAN FlushInProgress;
+
+    //
+    //  TRUE if the next write must be a checkpoint, because a journal write
+    //  failed or the metadata file had to be recreated.
+    //
+
+    BOOLEAN CheckpointNeeded;
+
+    RTL_AVL_TABLE Index;
+
+    //
+    //  On-disk state, as described by the current header.
+    //
+
+    ULONG HeaderSequence;
+    ULONG CheckpointLength;
+    LONGLONG JournalStart;
+    LONGLONG Tail;
+    LONGLONG BytesSinceCheckpoint;
+
+    //
+    //  LSN to assign to the next record, the highest LSN known to be on
+    //  disk, and the highest LSN whose write failed with FailedStatus.
+    //
+
+    ULONGLONG NextLsn;
+    ULONGLONG DurableLsn;
+    ULONGLONG FailedLsn;
+    NTSTATUS FailedStatus;
+
+    //
+    //  Records appended since the last write, and the buffer being written.
+    //
+
+    PUCHAR ActiveBuffer;
+    ULONG ActiveLength;
+    ULONG ActiveRecords;
+    PUCHAR FlushBuffer;
+
+    KEVENT FlushDoneEvent;
+
+    //
+    //  Writes to the metadata file are held while a volume snapshot is
+    //  being taken.  ResumeEvent is signalled when HoldCount drops to zero.
+    //
+
+    volatile LONG HoldCount;
+    KEVENT ResumeEvent;
+
+    //
+    //  Statistics.
+    //
+
+    ULONG Flushes;
+    ULONG Checkpoints;
+    ULONGLONG RecordsCommitted;
+
+} FMM_JOURNAL, *PFMM_JOURNAL;
+
+
 //
 //  Instance context flags and data structure
 //
@@ -141,6 +356,12 @@ typedef struct _FMM_INSTANCE_CONTEXT {
 
     PFILE_OBJECT MetadataOpenTriggerFileObject;
 
+    //
+    //  Journal and index of the metadata stored in the metadata file.
+    //
+
+    FMM_JOURNAL Journal;
+
 } FMM_INSTANCE_CONTEXT, *PFMM_INSTANCE_CONTEXT;
 
 #define FMM_INSTANCE_CONTEXT_SIZE         sizeof( FMM_INSTANCE_CONTEXT )
@@ -180,6 +401,8 @@ typedef struct _FMM_INSTANCE_CONTEXT {
 
 #define DEBUG_TRACE_INFO                            0x00000020  // Misc. information
 
+#define DEBUG_TRACE_JOURNAL                         0x00000040  // Journal writes, checkpoints and recovery
+
 #define DEBUG_TRACE_ALL                             0xFFFFFFFF  // All flags
 
 
@@ -0,0 +1,129 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    fmmuk.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    and constants that are shared between kernel mode and user mode.
+    Used by applications that set and query the per-file metadata kept
+    by the metadata manager filter.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef __FMMUK_H__
+#define __FMMUK_H__
+
+//
+//  Name of the port metadata is set and queried through.
+//
+
+#define FMM_PORT_NAME                   L"\\MetadataManagerPort"
+
+//
+//  Number of applications, or threads of one application, that can be
+//  connected to the port at the same time.
+//
+
+#define FMM_PORT_MAX_CONNECTIONS        128
+
+//
+//  Largest metadata blob that can be stored for a single file.
+//
+
+#define FMM_METADATA_MAX_LENGTH         256
+
+//
+//  Commands sent with FilterSendMessage.  Every command names a file by a
+//  handle opened by the sender; the metadata is kept on the file's volume,
+//  keyed by its file ID.
+//
+
+typedef enum _FMM_COMMAND {
+
+    //
+    //  Set the metadata of the file to Data.  Returns once it is on disk.
+    //
+
+    FmmSetMetadata,
+
+    //
+    //  Delete the metadata of the file.  Returns once that is on disk.
+    //
+
+    FmmDeleteMetadata,
+
+    //
+    //  Return the metadata of the file in the output buffer.
+    //
+
+    FmmQueryMetadata,
+
+    //
+    //  Return an FMM_STATISTICS structure for the file's volume.
+    //
+
+    FmmGetStatistics
+
+} FMM_COMMAND;
+
+typedef struct _FMM_COMMAND_MESSAGE {
+
+    FMM_COMMAND Command;
+
+    //
+    //  For FmmSetMetadata, the length of Data.
+    //
+
+    USHORT DataLength;
+
+    USHORT Reserved;
+
+    //
+    //  Handle of the file, widened so that the layout is the same for 32
+    //  and 64-bit applications.
+    //
+
+    ULONGLONG FileHandle;
+
+    UCHAR Data[FMM_METADATA_MAX_LENGTH];
+
+} FMM_COMMAND_MESSAGE, *PFMM_COMMAND_MESSAGE;
+
+typedef struct _FMM_STATISTICS {
+
+    //
+    //  Journal writes, each followed by one flush of the metadata file,
+    //  and how many of them were checkpoints.
+    //
+
+    ULONG Flushes;
+
+    ULONG Checkpoints;
+
+    //
+    //  Updates written by those flushes.
+    //
+
+    ULONGLONG RecordsCommitted;
+
+    //
+    //  Files that have metadata.
+    //
+
+    ULONG Files;
+
+    ULONG Reserved;
+
+} FMM_STATISTICS, *PFMM_STATISTICS;
+
+#endif //  __FMMUK_H__
+
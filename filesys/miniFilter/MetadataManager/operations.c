@@ -941,25 +941,13 @@ FmmPreDeviceControl (
 
 
         //
-        //  Here the filter must flush any portion of its metadata
-        //  that it has not flushed to disk
-        //
-        //  If the filter is using mapped cache buffers to read/write
-        //  its metadata then the File System will take care of all the
-        //  flushing. The filter just needs to ensure that it does not
-        //  write to any of its mapped cache buffers while the FS is
-        //  trying to flush changes out to disk.
+        //  Flush any metadata updates that are not yet on disk and hold
+        //  further writes to the metadata file until the post-op callback
+        //  for IOCTL_VOLSNAP_FLUSH_AND_HOLD_WRITES.  Updates made meanwhile
+        //  are kept in memory and written when the hold is released.
         //
 
-        //
-        //  After this point, the filter should not be sending any updates 
-        //  to its metadata file on disk until the post-op callback for 
-        //  IOCTL_VOLSNAP_FLUSH_AND_HOLD_WRITES 
-        //
-        //  The filter would do this by marking its instance context in some way
-        //  (say, by setting a flag) to indicate to other threads that they should 
-        //  not try to update the metadata file on the disk
-        // 
+        FmmJournalHoldWrites( &instanceContext->Journal );
 
         //
         //  Do not release the instance context but instead pass it to the PostOp
@@ -1072,11 +1060,8 @@ FmmPostDeviceControl (
         //  At this point, it is ok for the filter to send updates to its metadata
         //  file on disk
         //
-        //  The filter would do this by unmarking its instance context (say by,
-        //  resetting the flag that it set in the PreOp) to indicate to other threads 
-        //  that it is now ok to update the metadata file on the disk
-        // 
 
+        FmmJournalResumeWrites( &instanceContext->Journal );
 
         //
         //  Release the instance context
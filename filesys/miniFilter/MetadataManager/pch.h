@@ -39,6 +39,7 @@ Environment:
 #include <fltKernel.h>
 #include <dontuse.h>
 #include <suppress.h>
+#include "fmmuk.h"
 #include "MetadataManagerStruc.h"
 #include "MetadataManagerProc.h"
 
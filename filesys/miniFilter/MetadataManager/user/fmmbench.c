@@ -0,0 +1,530 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    fmmbench.c
+
+Abstract:
+
+    This program measures the metadata update throughput of the metadata
+    manager filter, and the number of flushes of the metadata file it
+    takes, for 1, 16 and 64 concurrent writers.
+
+    Each writer connects to the filter's port, creates a file of its own in
+    the given directory and sets the file's metadata in a loop.  A set
+    returns once its journal record is on disk, so one writer pays for one
+    flush per update, while concurrent writers share flushes (group
+    commit).  The flushes are counted by the journal of the volume.  After
+    each run the metadata of every file is read back and checked against
+    the last update of its writer.
+
+    Usage: fmmbench Directory [Seconds]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include "fmmuk.h"
+#include <dontuse.h>
+
+#define FMMBENCH_MAX_WRITERS            64
+#define FMMBENCH_DEFAULT_SECONDS        10
+
+//
+//  Length of the metadata each update sets.
+//
+
+#define FMMBENCH_METADATA_LENGTH        64
+
+const ULONG WriterCounts[] = { 1, 16, 64 };
+
+typedef struct _WRITER {
+
+    HANDLE Port;
+    HANDLE File;
+    ULONG Index;
+
+    //
+    //  Value of the last update that succeeded.  Values are never reused,
+    //  so each update changes the metadata.
+    //
+
+    ULONGLONG LastValue;
+
+    //
+    //  Updates of the current run, and the time they took.
+    //
+
+    ULONGLONG Updates;
+    LONGLONG Ticks;
+
+    HRESULT Result;
+
+} WRITER, *PWRITER;
+
+WRITER Writers[FMMBENCH_MAX_WRITERS];
+
+HANDLE StartEvent;
+volatile LONG StopWriters;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Measures metadata updates through the metadata manager filter\n" );
+    printf( "Usage: fmmbench Directory [Seconds]\n" );
+    printf( "    Directory is on a volume the filter is attached to\n" );
+    printf( "    Seconds is the length of each run (default %u)\n", FMMBENCH_DEFAULT_SECONDS );
+}
+
+
+VOID
+FillMetadata (
+    _Out_writes_bytes_(FMMBENCH_METADATA_LENGTH) PUCHAR Data,
+    _In_ ULONG Writer,
+    _In_ ULONGLONG Value
+    )
+/*++
+
+Routine Description:
+
+    Fills the metadata for an update of a writer.  The whole blob depends
+    on the writer and the value, so a stale or mixed up blob is detected.
+
+--*/
+{
+    ULONGLONG seed = (Value * 0x9E3779B97F4A7C15ULL) ^ Writer;
+    ULONG i;
+
+    for (i = 0; i < FMMBENCH_METADATA_LENGTH; i++) {
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        Data[i] = (UCHAR) (seed >> 56);
+    }
+}
+
+
+HRESULT
+SendCommand (
+    _In_ HANDLE Port,
+    _In_ FMM_COMMAND Command,
+    _In_ HANDLE File,
+    _In_reads_bytes_opt_(DataLength) PVOID Data,
+    _In_ USHORT DataLength,
+    _Out_writes_bytes_to_opt_(OutputLength, *BytesReturned) PVOID Output,
+    _In_ DWORD OutputLength,
+    _Out_ PDWORD BytesReturned
+    )
+{
+    FMM_COMMAND_MESSAGE message;
+
+    ZeroMemory( &message, FIELD_OFFSET( FMM_COMMAND_MESSAGE, Data ) );
+
+    message.Command = Command;
+    message.DataLength = DataLength;
+    message.FileHandle = (ULONGLONG) (ULONG_PTR) File;
+
+    if (DataLength > 0) {
+
+        CopyMemory( message.Data, Data, DataLength );
+    }
+
+    return FilterSendMessage( Port,
+                              &message,
+                              FIELD_OFFSET( FMM_COMMAND_MESSAGE, Data ) + DataLength,
+                              Output,
+                              OutputLength,
+                              BytesReturned );
+}
+
+
+DWORD
+WINAPI
+WriterThread (
+    _In_ LPVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Sets the metadata of the writer's file until the run is stopped.
+
+--*/
+{
+    PWRITER writer = Parameter;
+    UCHAR data[FMMBENCH_METADATA_LENGTH];
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    DWORD bytesReturned;
+    HRESULT hr = S_OK;
+
+    WaitForSingleObject( StartEvent, INFINITE );
+
+    while (!StopWriters) {
+
+        FillMetadata( data, writer->Index, writer->LastValue + 1 );
+
+        QueryPerformanceCounter( &start );
+
+        hr = SendCommand( writer->Port,
+                          FmmSetMetadata,
+                          writer->File,
+                          data,
+                          sizeof( data ),
+                          NULL,
+                          0,
+                          &bytesReturned );
+
+        QueryPerformanceCounter( &end );
+
+        if (IS_ERROR( hr )) {
+
+            break;
+        }
+
+        writer->LastValue += 1;
+        writer->Updates += 1;
+        writer->Ticks += end.QuadPart - start.QuadPart;
+    }
+
+    writer->Result = hr;
+
+    return 0;
+}
+
+
+BOOL
+CheckMetadata (
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Reads back the metadata of the first Count writers' files and checks
+    it against the last update of each.
+
+--*/
+{
+    UCHAR expected[FMMBENCH_METADATA_LENGTH];
+    UCHAR data[FMM_METADATA_MAX_LENGTH];
+    DWORD bytesReturned;
+    HRESULT hr;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        if (Writers[i].LastValue == 0) {
+
+            continue;
+        }
+
+        hr = SendCommand( Writers[i].Port,
+                          FmmQueryMetadata,
+                          Writers[i].File,
+                          NULL,
+                          0,
+                          data,
+                          sizeof( data ),
+                          &bytesReturned );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Querying the metadata of writer %u: 0x%08x\n", i, hr );
+            return FALSE;
+        }
+
+        FillMetadata( expected, i, Writers[i].LastValue );
+
+        if (bytesReturned != sizeof( expected ) ||
+            memcmp( data, expected, sizeof( expected ) ) != 0) {
+
+            printf( "ERROR: The metadata of writer %u is not its last update\n", i );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+RunWriters (
+    _In_ ULONG Count,
+    _In_ ULONG Seconds
+    )
+/*++
+
+Routine Description:
+
+    Runs Count writers for Seconds and prints the update rate and the
+    flushes they took.
+
+--*/
+{
+    HANDLE threads[FMMBENCH_MAX_WRITERS];
+    FMM_STATISTICS before;
+    FMM_STATISTICS after;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    ULONGLONG updates = 0;
+    LONGLONG ticks = 0;
+    ULONG flushes;
+    DWORD bytesReturned;
+    double elapsed;
+    BOOL result = TRUE;
+    HRESULT hr;
+    ULONG i;
+
+    hr = SendCommand( Writers[0].Port,
+                      FmmGetStatistics,
+                      Writers[0].File,
+                      NULL,
+                      0,
+                      &before,
+                      sizeof( before ),
+                      &bytesReturned );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Querying the journal statistics: 0x%08x\n", hr );
+        return FALSE;
+    }
+
+    ResetEvent( StartEvent );
+    StopWriters = 0;
+
+    for (i = 0; i < Count; i++) {
+
+        Writers[i].Updates = 0;
+        Writers[i].Ticks = 0;
+        Writers[i].Result = S_OK;
+
+        threads[i] = CreateThread( NULL, 0, WriterThread, &Writers[i], 0, NULL );
+
+        if (threads[i] == NULL) {
+
+            printf( "ERROR: Creating writer thread: %u\n", GetLastError() );
+
+            InterlockedExchange( &StopWriters, 1 );
+            SetEvent( StartEvent );
+            Count = i;
+            result = FALSE;
+            break;
+        }
+    }
+
+    QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &start );
+
+    if (result) {
+
+        SetEvent( StartEvent );
+        Sleep( Seconds * 1000 );
+        InterlockedExchange( &StopWriters, 1 );
+    }
+
+    if (Count > 0) {
+
+        WaitForMultipleObjects( Count, threads, TRUE, INFINITE );
+    }
+
+    QueryPerformanceCounter( &end );
+
+    for (i = 0; i < Count; i++) {
+
+        CloseHandle( threads[i] );
+
+        if (IS_ERROR( Writers[i].Result )) {
+
+            printf( "ERROR: Writer %u failed to set metadata: 0x%08x\n", i, Writers[i].Result );
+            result = FALSE;
+        }
+
+        updates += Writers[i].Updates;
+        ticks += Writers[i].Ticks;
+    }
+
+    if (!result) {
+
+        return FALSE;
+    }
+
+    hr = SendCommand( Writers[0].Port,
+                      FmmGetStatistics,
+                      Writers[0].File,
+                      NULL,
+                      0,
+                      &after,
+                      sizeof( after ),
+                      &bytesReturned );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Querying the journal statistics: 0x%08x\n", hr );
+        return FALSE;
+    }
+
+    flushes = after.Flushes - before.Flushes;
+    elapsed = (double) (end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+    printf( "%7u %12I64u %12.0f %10u %14.1f %12.1f\n",
+            Count,
+            updates,
+            updates / elapsed,
+            flushes,
+            flushes ? (double) updates / flushes : 0.0,
+            updates ? ticks * 1000000.0 / frequency.QuadPart / updates : 0.0 );
+
+    return CheckMetadata( Count );
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    CHAR path[MAX_PATH];
+    DWORD bytesReturned;
+    ULONG seconds = FMMBENCH_DEFAULT_SECONDS;
+    ULONG i;
+    HRESULT hr;
+    int status = 0;
+
+    if (argc < 2 || argc > 3) {
+
+        Usage();
+        return 1;
+    }
+
+    if (argc == 3) {
+
+        seconds = (ULONG) atoi( argv[2] );
+
+        if (seconds == 0) {
+
+            Usage();
+            return 1;
+        }
+    }
+
+    StartEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+
+    if (StartEvent == NULL) {
+
+        printf( "ERROR: Creating event: %u\n", GetLastError() );
+        return 2;
+    }
+
+    for (i = 0; i < FMMBENCH_MAX_WRITERS; i++) {
+
+        Writers[i].Index = i;
+        Writers[i].Port = INVALID_HANDLE_VALUE;
+        Writers[i].File = INVALID_HANDLE_VALUE;
+    }
+
+    //
+    //  Each writer gets a connection and a file of its own.  The files are
+    //  deleted when they are closed.
+    //
+
+    for (i = 0; i < FMMBENCH_MAX_WRITERS; i++) {
+
+        hr = FilterConnectCommunicationPort( FMM_PORT_NAME,
+                                             0,
+                                             NULL,
+                                             0,
+                                             NULL,
+                                             &Writers[i].Port );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Connecting to filter port: 0x%08x\n", hr );
+            status = 2;
+            goto main_cleanup;
+        }
+
+        if (_snprintf_s( path, sizeof( path ), _TRUNCATE, "%s\\fmmbench%02u.tmp", argv[1], i ) < 0) {
+
+            printf( "ERROR: Directory name is too long\n" );
+            status = 1;
+            goto main_cleanup;
+        }
+
+        Writers[i].File = CreateFileA( path,
+                                       GENERIC_READ | GENERIC_WRITE,
+                                       0,
+                                       NULL,
+                                       CREATE_ALWAYS,
+                                       FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                                       NULL );
+
+        if (Writers[i].File == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Creating %s: %u\n", path, GetLastError() );
+            status = 2;
+            goto main_cleanup;
+        }
+    }
+
+    printf( "%u second runs, %u byte metadata\n\n", seconds, FMMBENCH_METADATA_LENGTH );
+    printf( "writers      updates    updates/s    flushes  updates/flush   us/update\n" );
+
+    for (i = 0; i < ARRAYSIZE( WriterCounts ); i++) {
+
+        if (!RunWriters( WriterCounts[i], seconds )) {
+
+            status = 3;
+            break;
+        }
+    }
+
+main_cleanup:
+
+    //
+    //  Drop the metadata of the files before they are deleted.
+    //
+
+    for (i = 0; i < FMMBENCH_MAX_WRITERS; i++) {
+
+        if (Writers[i].File != INVALID_HANDLE_VALUE) {
+
+            if (Writers[i].LastValue != 0) {
+
+                (VOID) SendCommand( Writers[i].Port,
+                                    FmmDeleteMetadata,
+                                    Writers[i].File,
+                                    NULL,
+                                    0,
+                                    NULL,
+                                    0,
+                                    &bytesReturned );
+            }
+
+            CloseHandle( Writers[i].File );
+        }
+
+        if (Writers[i].Port != INVALID_HANDLE_VALUE) {
+
+            CloseHandle( Writers[i].Port );
+        }
+    }
+
+    CloseHandle( StartEvent );
+
+    return status;
+}
+
@@ -140,6 +140,14 @@ NcPreSetInformationCallback (
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
+FLT_POSTOP_CALLBACK_STATUS
+NcPostSetInformationCallback (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
 FLT_PREOP_CALLBACK_STATUS
 NcPreDirectoryControlCallback (
     _Inout_ PFLT_CALLBACK_DATA Data,
@@ -250,7 +258,7 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_SET_INFORMATION,
       0,
       NcPreSetInformationCallback,
-      NULL },
+      NcPostSetInformationCallback },
 
     { IRP_MJ_DIRECTORY_CONTROL,
       0,
@@ -808,6 +816,8 @@ Logic:
 
     InstanceContext->VolumeFilesystemType = VolumeFilesystemType;
 
+    InstanceContext->RenameGeneration = 0;
+
     //
     //  Register the instance context.
     //
@@ -1672,6 +1682,48 @@ Return Value:
     return result;
 }
 
+FLT_POSTOP_CALLBACK_STATUS
+NcPostSetInformationCallback (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    This is the post set file information callback.  Only renames ask for
+    it, so that directory handles can notice that the namespace changed.
+
+Arguments:
+
+    Data - Pointer to the filter CallbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The context for the completion routine for this
+        operation.  Set by NcPreRename.
+
+    Flags - The flags for this operation.
+
+Return Value:
+
+    Returns the final status of this operation.
+
+--*/
+{
+    FLT_ASSERT( (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation) ||
+                (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformationEx) );
+
+    return NcPostRename( Data,
+                         FltObjects,
+                         CompletionContext,
+                         Flags );
+}
+
 FLT_PREOP_CALLBACK_STATUS
 NcPreDirectoryControlCallback (
     _Inout_ PFLT_CALLBACK_DATA Data,
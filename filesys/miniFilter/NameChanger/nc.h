@@ -30,6 +30,14 @@
 //
 
 #define NC_SEPARATOR ((WCHAR) L'\\')
+
+//
+//  Directory enumeration batching.  Entries are read from the filesystem in
+//  batches of at least this size regardless of the caller's buffer size.
+//
+
+#define NC_DIR_QRY_BATCH_SIZE (64 * 1024)
+#define NC_DIR_QRY_NO_OFFSET  ((ULONG) -1)
 #define EMPTY_UNICODE_STRING {0, 0, NULL}
 
 #define AlignToSize(_length, _alignment)   \
@@ -235,6 +243,11 @@ typedef struct _NC_INSTANCE_CONTEXT {
     // The file system we're attached to
     FLT_FILESYSTEM_TYPE VolumeFilesystemType;
 
+    // Bumped after every rename on the volume completes.  A rename can
+    // move a directory into or out of a mapping's parent, so overlaps
+    // cached on directory handles are only trusted while this matches.
+    volatile LONG RenameGeneration;
+
 } NC_INSTANCE_CONTEXT, *PNC_INSTANCE_CONTEXT;
 
 
@@ -251,12 +264,35 @@ typedef struct _NC_DIR_QRY_CONTEXT {
     // then there is no need to initialize the cache or injection entry.
     BOOLEAN InUse;
 
+    // Determines if UserOverlap and RealOverlap have been computed for
+    // the directory this handle refers to.  They are computed on the first
+    // query so that later queries need not query and parse the name again.
+    // OverlapGeneration is the instance's RenameGeneration sampled before
+    // the name was queried; the overlaps are stale once the two differ.
+    BOOLEAN OverlapValid;
+    LONG OverlapGeneration;
+    NC_PATH_OVERLAP UserOverlap;
+    NC_PATH_OVERLAP RealOverlap;
+
     // Pointer to list of entries which we must drain from.
     NC_CACHE_ENTRY Cache;
 
     // Pointer to entry which we want to inject.
     NC_CACHE_ENTRY InjectionEntry;
 
+    // Buffers backing Cache and InjectionEntry.  The cache buffer is reused
+    // for every batch read from the filesystem; both are freed on close.
+    char *CacheBuffer;
+    ULONG CacheBufferLength;
+    char *InjectionBuffer;
+
+    // Offsets within the current batch at which the injection entry must be
+    // returned and at which the real mapping must be suppressed.  These are
+    // computed in a single pass when the batch is read, or are
+    // NC_DIR_QRY_NO_OFFSET if the batch contains no such position.
+    ULONG InjectionOffset;
+    ULONG SkipOffset;
+
     // The user provided search string which can only be set up on
     // the first query.
     UNICODE_STRING SearchString;
@@ -815,23 +851,26 @@ NcPopulateCacheEntry (
     _In_ FILE_INFORMATION_CLASS FileInfoClass,
     _In_ PUNICODE_STRING SearchString,
     _In_ BOOLEAN RestartScan,
-    _Out_ PNC_CACHE_ENTRY Cache
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
     );
 
-PNC_CACHE_ENTRY 
-NcDirEnumSelectNextEntry ( 
-    _Inout_ PNC_DIR_QRY_CONTEXT Context, 
+VOID
+NcDirEnumPlanBatch (
+    _Inout_ PNC_DIR_QRY_CONTEXT Context,
     _In_ PDIRECTORY_CONTROL_OFFSETS Offsets,
+    _In_ PNC_MAPPING Mapping,
     _In_ BOOLEAN IgnoreCase
     );
 
+PNC_CACHE_ENTRY 
+NcDirEnumSelectNextEntry ( 
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
+    );
+
 BOOLEAN
 NcSkipName (
     _In_ PDIRECTORY_CONTROL_OFFSETS Offsets,
-    _In_ PNC_DIR_QRY_CONTEXT Context, 
-    _In_ NC_PATH_OVERLAP RealOverlap,
-    _In_ PNC_MAPPING Mapping,
-    _In_ BOOLEAN IgnoreCase
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
     );
 
 _Success_(*Copied)
@@ -934,6 +973,14 @@ NcPreRename (
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
+FLT_POSTOP_CALLBACK_STATUS
+NcPostRename (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
 FLT_PREOP_CALLBACK_STATUS
 NcPreSetDisposition (
     _Inout_ PFLT_CALLBACK_DATA Data,
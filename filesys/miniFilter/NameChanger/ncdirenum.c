@@ -24,6 +24,7 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, NcCopyDirEnumEntry)
+#pragma alloc_text(PAGE, NcDirEnumPlanBatch)
 #pragma alloc_text(PAGE, NcDirEnumSelectNextEntry)
 #pragma alloc_text(PAGE, NcEnumerateDirectory)
 #pragma alloc_text(PAGE, NcEnumerateDirectorySetupInjection)
@@ -79,6 +80,9 @@ Return Value:
     NC_PATH_OVERLAP RealOverlap;
     NC_PATH_OVERLAP UserOverlap;
 
+    BOOLEAN OverlapValid = FALSE;
+    LONG Generation;
+
     BOOLEAN Reset = BooleanFlagOn( Data->Iopb->OperationFlags, SL_RESTART_SCAN );
     BOOLEAN FirstQuery;
     BOOLEAN Single = BooleanFlagOn( Data->Iopb->OperationFlags, SL_RETURN_SINGLE_ENTRY );
@@ -98,7 +102,7 @@ Return Value:
     ULONG UserBufferOffset;
     ULONG LastEntryStart;
     BOOLEAN MoreRoom;
-    PNC_CACHE_ENTRY NextEntry;
+    PNC_CACHE_ENTRY NextEntry = NULL;
 
     DIRECTORY_CONTROL_OFFSETS Offsets;
 
@@ -134,46 +138,81 @@ Return Value:
     }
 
     //
-    //  Get the directory's name.
+    //  If this handle has been enumerated before, its context records how
+    //  the directory relates to the mappings, so we need not query and
+    //  parse the directory's name again.  That is only true while no rename
+    //  has completed since; sample the generation before looking at the
+    //  name so a rename racing with this query invalidates what we cache.
     //
 
-    Status = NcGetFileNameInformation( Data,
-                                       NULL,
-                                       NULL,
-                                       FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT,
-                                       &FileNameInformation ); 
+    Generation = ReadAcquire( &InstanceContext->RenameGeneration );
 
-    if (!NT_SUCCESS( Status )) {
+    Status = FltGetStreamHandleContext( FltObjects->Instance,
+                                        FltObjects->FileObject,
+                                        &HandleContext );
 
-        ReturnValue = FLT_PREOP_COMPLETE;
-        goto NcEnumerateDirectoryCleanup;
-    }
+    if (NT_SUCCESS( Status )) {
 
-    Status = FltParseFileNameInformation( FileNameInformation );
+        NcLockStreamHandleContext( HandleContext );
 
-    if (!NT_SUCCESS( Status )) {
+        OverlapValid = HandleContext->DirectoryQueryContext.OverlapValid &&
+                       (HandleContext->DirectoryQueryContext.OverlapGeneration == Generation);
+        UserOverlap = HandleContext->DirectoryQueryContext.UserOverlap;
+        RealOverlap = HandleContext->DirectoryQueryContext.RealOverlap;
 
-        ReturnValue = FLT_PREOP_COMPLETE;
-        goto NcEnumerateDirectoryCleanup;
+        NcUnlockStreamHandleContext( HandleContext );
+
+    } else {
+
+        HandleContext = NULL;
+        UserOverlap.EntireFlags = 0;
+        RealOverlap.EntireFlags = 0;
     }
 
-    //
-    //  See if the directory is parent of either mapping.
-    //
+    if (!OverlapValid) {
+
+        //
+        //  Get the directory's name.
+        //
+
+        Status = NcGetFileNameInformation( Data,
+                                           NULL,
+                                           NULL,
+                                           FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_DEFAULT,
+                                           &FileNameInformation ); 
+
+        if (!NT_SUCCESS( Status )) {
+
+            ReturnValue = FLT_PREOP_COMPLETE;
+            goto NcEnumerateDirectoryCleanup;
+        }
+
+        Status = FltParseFileNameInformation( FileNameInformation );
+
+        if (!NT_SUCCESS( Status )) {
+
+            ReturnValue = FLT_PREOP_COMPLETE;
+            goto NcEnumerateDirectoryCleanup;
+        }
 
-    NcComparePath( &FileNameInformation->Name,
-                   &InstanceContext->Mapping.UserMapping,
-                   NULL,
-                   IgnoreCase,
-                   TRUE,
-                   &UserOverlap );
+        //
+        //  See if the directory is parent of either mapping.
+        //
 
-    NcComparePath( &FileNameInformation->Name,
-                   &InstanceContext->Mapping.RealMapping,
-                   NULL,
-                   IgnoreCase,
-                   TRUE,
-                   &RealOverlap );
+        NcComparePath( &FileNameInformation->Name,
+                       &InstanceContext->Mapping.UserMapping,
+                       NULL,
+                       IgnoreCase,
+                       TRUE,
+                       &UserOverlap );
+
+        NcComparePath( &FileNameInformation->Name,
+                       &InstanceContext->Mapping.RealMapping,
+                       NULL,
+                       IgnoreCase,
+                       TRUE,
+                       &RealOverlap );
+    }
 
     if (!(UserOverlap.Parent || RealOverlap.Parent )) {
 
@@ -182,21 +221,42 @@ Return Value:
         //  because it is not the parent of either
         //  mapping. This means we can just passthrough.
         //
+        //  If the handle already has a context (for example because it
+        //  is also used for change notification) remember this so the
+        //  next query on it can passthrough immediately.  We don't attach
+        //  a context just for this, as that would put one on every
+        //  directory handle that is enumerated on the volume.
+        //
+
+        if (HandleContext != NULL && !OverlapValid) {
+
+            NcLockStreamHandleContext( HandleContext );
+
+            HandleContext->DirectoryQueryContext.UserOverlap = UserOverlap;
+            HandleContext->DirectoryQueryContext.RealOverlap = RealOverlap;
+            HandleContext->DirectoryQueryContext.OverlapGeneration = Generation;
+            HandleContext->DirectoryQueryContext.OverlapValid = TRUE;
+
+            NcUnlockStreamHandleContext( HandleContext );
+        }
 
         Status = STATUS_SUCCESS;
         ReturnValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
         goto NcEnumerateDirectoryCleanup;
     }
 
-    Status = NcStreamHandleContextAllocAndAttach( FltObjects->Filter,
-                                                  FltObjects->Instance,
-                                                  FltObjects->FileObject,
-                                                  &HandleContext );
+    if (HandleContext == NULL) {
 
-    if (!NT_SUCCESS( Status )) {
+        Status = NcStreamHandleContextAllocAndAttach( FltObjects->Filter,
+                                                      FltObjects->Instance,
+                                                      FltObjects->FileObject,
+                                                      &HandleContext );
 
-        ReturnValue = FLT_PREOP_COMPLETE;
-        goto NcEnumerateDirectoryCleanup;
+        if (!NT_SUCCESS( Status )) {
+
+            ReturnValue = FLT_PREOP_COMPLETE;
+            goto NcEnumerateDirectoryCleanup;
+        }
     }
 
     FLT_ASSERT( HandleContext != NULL );
@@ -228,6 +288,19 @@ Return Value:
 
     DirCtx->EnumerationOutstanding = TRUE;
 
+    //
+    //  Remember the directory's relationship to the mappings for later
+    //  queries on this handle.
+    //
+
+    if (!OverlapValid) {
+
+        DirCtx->UserOverlap = UserOverlap;
+        DirCtx->RealOverlap = RealOverlap;
+        DirCtx->OverlapGeneration = Generation;
+        DirCtx->OverlapValid = TRUE;
+    }
+
     //
     //  Now drop the lock.  We're protected by the EnumerationOutstanding
     //  flag; nobody else can muck with the enumeration context structure.
@@ -272,18 +345,20 @@ Return Value:
     do {
 
         //
-        //  If there is no cache entry, populate it.
+        //  If there is no cache entry, populate it.  We read a full batch
+        //  even if the caller's buffer is small, since whatever does not fit
+        //  now is returned from the cache by later queries.
         //
 
         if (DirCtx->Cache.Buffer == NULL) {
 
             Status = NcPopulateCacheEntry( FltObjects->Instance,
                                            FltObjects->FileObject,
-                                           Data->Iopb->Parameters.DirectoryControl.QueryDirectory.Length,
+                                           Max( BufferSize, NC_DIR_QRY_BATCH_SIZE ),
                                            Data->Iopb->Parameters.DirectoryControl.QueryDirectory.FileInformationClass,
                                            Data->Iopb->Parameters.DirectoryControl.QueryDirectory.FileName,
                                            Reset,
-                                           &DirCtx->Cache);
+                                           DirCtx );
 
             //
             //  We only want to reset the cache once.
@@ -301,9 +376,22 @@ Return Value:
                 goto NcEnumerateDirectoryCleanup;
             }
 
+            //
+            //  Find where in this batch the injection entry belongs and
+            //  where the real mapping is, so that draining the batch
+            //  requires no further name comparisons.
+            //
+
+            if (DirCtx->Cache.Buffer != NULL) {
+
+                NcDirEnumPlanBatch( DirCtx,
+                                    &Offsets,
+                                    &InstanceContext->Mapping,
+                                    IgnoreCase );
+            }
         }
 
-        NextEntry = NcDirEnumSelectNextEntry( DirCtx, &Offsets, IgnoreCase );
+        NextEntry = NcDirEnumSelectNextEntry( DirCtx );
 
         if (NextEntry == NULL) {
 
@@ -314,11 +402,7 @@ Return Value:
             break;
         }
 
-        if (NcSkipName( &Offsets, 
-                        DirCtx, 
-                        RealOverlap, 
-                        &InstanceContext->Mapping,
-                        IgnoreCase )) {
+        if (NcSkipName( &Offsets, DirCtx )) {
 
             //
             //  This entry is the real mapping path. That means we have to mask it...
@@ -389,7 +473,16 @@ Return Value:
 
     if (NumEntriesCopied == 0) {
 
-        if (FirstQuery) {
+        if (NextEntry != NULL) {
+
+            //
+            //  There are entries left, but the caller's buffer cannot hold
+            //  even the first of them.
+            //
+
+            Status = STATUS_BUFFER_TOO_SMALL;
+
+        } else if (FirstQuery) {
 
             Status = STATUS_NO_SUCH_FILE;
 
@@ -445,6 +538,9 @@ NcEnumerateDirectoryCleanup:
 
         NcUnlockStreamHandleContext( HandleContext );
         Unlock = FALSE;
+    }
+
+    if (HandleContext != NULL) {
 
         FltReleaseContext( HandleContext );
     }
@@ -612,6 +708,7 @@ Return Value:
 
         DirQryCtx->InjectionEntry.Buffer = NULL;
         DirQryCtx->InjectionEntry.CurrentOffset = 0;
+        DirQryCtx->InjectionBuffer = NULL;
 
         ExFreePoolWithTag( QueryBuffer, NC_DIR_QRY_CACHE_TAG );
         QueryBuffer = NULL;
@@ -645,11 +742,14 @@ Return Value:
                         Offsets );
 
         FLT_ASSERT( DirQryCtx->InjectionEntry.Buffer == NULL );
+        FLT_ASSERT( DirQryCtx->InjectionBuffer == NULL );
 
         //
-        //  Set the injection entry up in the cache.
+        //  Set the injection entry up in the cache.  The buffer is owned
+        //  by the context until it is reset or closed.
         //
 
+        DirQryCtx->InjectionBuffer = QueryBuffer;
         DirQryCtx->InjectionEntry.Buffer = QueryBuffer;
         DirQryCtx->InjectionEntry.CurrentOffset = 0;
     }
@@ -701,11 +801,22 @@ Return Value:
 {
     PAGED_CODE();
 
-    ExFreePoolWithTag( DirCtx->Cache.Buffer, NC_DIR_QRY_CACHE_TAG );
+    //
+    //  The cache buffer is kept for the next batch; only the injection
+    //  entry is specific to the enumeration being reset.
+    //
+
     DirCtx->Cache.Buffer = NULL;
     DirCtx->Cache.CurrentOffset = 0;
+    DirCtx->InjectionOffset = NC_DIR_QRY_NO_OFFSET;
+    DirCtx->SkipOffset = NC_DIR_QRY_NO_OFFSET;
+
+    if (DirCtx->InjectionBuffer != NULL) {
+
+        ExFreePoolWithTag( DirCtx->InjectionBuffer, NC_DIR_QRY_CACHE_TAG );
+        DirCtx->InjectionBuffer = NULL;
+    }
 
-    ExFreePoolWithTag( DirCtx->InjectionEntry.Buffer, NC_DIR_QRY_CACHE_TAG );
     DirCtx->InjectionEntry.Buffer = NULL;
     DirCtx->InjectionEntry.CurrentOffset = 0;
 }
@@ -713,10 +824,7 @@ Return Value:
 BOOLEAN
 NcSkipName (
     _In_ PDIRECTORY_CONTROL_OFFSETS Offsets,
-    _In_ PNC_DIR_QRY_CONTEXT Context, 
-    _In_ NC_PATH_OVERLAP RealOverlap,
-    _In_ PNC_MAPPING Mapping,
-    _In_ BOOLEAN IgnoreCase
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
     )
 /*++
 
@@ -725,6 +833,9 @@ Routine Description:
     Determines if the next entry is for the real mapping.  If it is, we want
     to "skip" returning this entry and proceed to the next.
 
+    The position of the real mapping within the current batch was found by
+    NcDirEnumPlanBatch, so no name comparison is needed here.
+
 Arguments:
 
     Offsets - Offset information for this enumeration class.
@@ -732,10 +843,6 @@ Arguments:
     Context - Pointer to directory query context (on the stream handle.)
         This is used to obtain the entry we are contemplating returning.
 
-    RealOverlap - Relationship of the object that enumeration is being
-        requested on to the real mapping.  This routine will only skip
-        entries if we are enumerating the parent of the real mapping.
-
 Return Value:
 
     TRUE if this entry should be skipped/suppressed; FALSE if it should be
@@ -745,61 +852,43 @@ Return Value:
 {
     BOOLEAN Result = FALSE;
     PVOID CacheEntry;
-    UNICODE_STRING CacheString;
-    PUNICODE_STRING IgnoreString = &Mapping->RealMapping.LongNamePath.FinalComponentName;
     ULONG ElementSize;
     BOOLEAN LastElement;
 
     PAGED_CODE();
 
-    if (RealOverlap.Parent) {
-
-        //
-        //  We have to check for a match.
-        //
+    if (Context->Cache.Buffer != NULL &&
+        Context->Cache.CurrentOffset == Context->SkipOffset) {
 
         CacheEntry = Add2Ptr( Context->Cache.Buffer, Context->Cache.CurrentOffset);
         ElementSize = NcGetEntrySize( CacheEntry, Offsets );
         LastElement = (BOOLEAN)(NcGetNextEntryOffset( CacheEntry, Offsets ) == 0);
 
-        CacheString.Buffer = NcGetFileName( CacheEntry, Offsets );
-        CacheString.Length = (USHORT) NcGetFileNameLength( CacheEntry, Offsets );
-        CacheString.MaximumLength = CacheString.Length;
+        //
+        //  We need to ignore this name.
+        //
 
+        Result = TRUE;
+        Context->SkipOffset = NC_DIR_QRY_NO_OFFSET;
 
-        if (RtlCompareUnicodeString( &CacheString, 
-                                     IgnoreString,
-                                     IgnoreCase ) == 0) {
+        if (LastElement) {
 
             //
-            //  We need to ignore this name.
+            //  This was the last element in the batch, so mark the cache
+            //  empty.  The buffer itself is kept for the next batch.
             //
 
-            Result = TRUE;
+            Context->Cache.Buffer = NULL;
+            Context->Cache.CurrentOffset = 0;
+
+        } else {
 
             //
-            //  skip
+            //  Entry has more elements, update offset counter.
             //
 
-            if (LastElement) {
-
-                //
-                //  This was the last element in the entry, so we should clean the entry.
-                //
-
-                ExFreePoolWithTag(Context->Cache.Buffer, NC_DIR_QRY_CACHE_TAG);
-                Context->Cache.Buffer = NULL;
-                Context->Cache.CurrentOffset = 0;
-
-            } else {
-
-                //
-                //  Entry has more elements, update offset counter.
-                //
-
-                Context->Cache.CurrentOffset += ElementSize;
-            }
-        } 
+            Context->Cache.CurrentOffset += ElementSize;
+        }
     }
 
     return Result;
@@ -813,15 +902,19 @@ NcPopulateCacheEntry (
     _In_ FILE_INFORMATION_CLASS FileInfoClass,
     _In_ PUNICODE_STRING SearchString,
     _In_ BOOLEAN RestartScan,
-    _Out_ PNC_CACHE_ENTRY Cache
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
     )
 /*++
 
 Routine Description:
 
-    Obtains the next entry from the filesystem.  By always reading ahead, we
-    can determine when to return the injected entry (if one exists) while
-    attempting to preserve directory sort order.
+    Obtains the next batch of entries from the filesystem.  By always reading
+    ahead, we can determine when to return the injected entry (if one exists)
+    while attempting to preserve directory sort order.
+
+    The batch is read into a buffer owned by the directory query context,
+    which is reused for every batch and only grown when a larger batch is
+    requested.
 
 Arguments:
 
@@ -829,8 +922,7 @@ Arguments:
 
     FileObject - Directory that we are enumerating.
 
-    BufferLength - Size, in bytes, of the buffer to allocate within this
-        routine.
+    BufferLength - Size, in bytes, of the batch to read.
 
     FileInfoClass - Directory enumeration class that we are using.
 
@@ -840,7 +932,8 @@ Arguments:
     RestartScan - Boolean value set to TRUE if we should start enumeration from
         the beginning.  Set to FALSE to continue from the previous point.
 
-    Cache - Pointer to our structure for receiving the cached entry.
+    Context - Pointer to directory query context (on the stream handle.)
+        Its cache entry receives the batch.
 
 Return Value:
 
@@ -854,6 +947,8 @@ Return Value:
 
     PAGED_CODE();
 
+    FLT_ASSERT( Context->Cache.Buffer == NULL );
+
     if (SearchString != NULL && SearchString->Buffer == NULL) {
 
         //
@@ -864,34 +959,46 @@ Return Value:
         SearchString = NULL;
     }
 
-    Buffer = ExAllocatePoolWithTag( PagedPool, BufferLength, NC_DIR_QRY_CACHE_TAG );
+    if (Context->CacheBufferLength < BufferLength) {
 
-    if (Buffer == NULL) {
+        Buffer = ExAllocatePoolWithTag( PagedPool, BufferLength, NC_DIR_QRY_CACHE_TAG );
 
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        return Status;
+        if (Buffer == NULL) {
+
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            return Status;
+        }
+
+        if (Context->CacheBuffer != NULL) {
+
+            ExFreePoolWithTag( Context->CacheBuffer, NC_DIR_QRY_CACHE_TAG );
+        }
+
+        Context->CacheBuffer = Buffer;
+        Context->CacheBufferLength = BufferLength;
     }
 
     Status = NcQueryDirectoryFile( Instance,
                                    FileObject,
-                                   Buffer,
-                                   BufferLength,
+                                   Context->CacheBuffer,
+                                   Context->CacheBufferLength,
                                    FileInfoClass,
                                    FALSE,
                                    SearchString,
                                    RestartScan,
                                    NULL);
 
+    Context->InjectionOffset = NC_DIR_QRY_NO_OFFSET;
+    Context->SkipOffset = NC_DIR_QRY_NO_OFFSET;
+
     if (Status == STATUS_NO_MORE_FILES || Status == STATUS_NO_SUCH_FILE) {
 
         //
         //  There are no more files. Keep cache empty.
         //
 
-        Cache->Buffer = NULL;
-        Cache->CurrentOffset = 0;
-
-        ExFreePoolWithTag( Buffer, NC_DIR_QRY_CACHE_TAG );
+        Context->Cache.Buffer = NULL;
+        Context->Cache.CurrentOffset = 0;
 
         Status = STATUS_SUCCESS;
 
@@ -901,26 +1008,126 @@ Return Value:
         //  There were entries, populate.
         //
 
-        Cache->Buffer = Buffer;
-        Cache->CurrentOffset = 0;
+        Context->Cache.Buffer = Context->CacheBuffer;
+        Context->Cache.CurrentOffset = 0;
+    }
+
+    return Status;
+}
+
+VOID
+NcDirEnumPlanBatch (
+    _Inout_ PNC_DIR_QRY_CONTEXT Context,
+    _In_ PDIRECTORY_CONTROL_OFFSETS Offsets,
+    _In_ PNC_MAPPING Mapping,
+    _In_ BOOLEAN IgnoreCase
+    )
+/*++
+
+Routine Description:
+
+    This routine makes a single pass over a newly read batch to find the
+    entry before which the injected entry (if any is pending) must be
+    returned, and the entry for the real mapping (if this directory is its
+    parent) which must be suppressed.
+
+    The results are recorded as offsets within the batch so that the
+    batch can then be drained without comparing each entry's name.  The
+    pass stops as soon as both positions are known.
+
+Arguments:
+
+    Context - The enumeration context of this handle.
+
+    Offsets - Information describing the offsets for this enumeration class.
+
+    Mapping - The mapping for this instance.
+
+    IgnoreCase - TRUE if we are case insensitive, FALSE if case sensitive.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PVOID CacheEntry;
+    PVOID InjectEntry;
+    UNICODE_STRING CacheString;
+    UNICODE_STRING InsertString;
+    PUNICODE_STRING IgnoreString = &Mapping->RealMapping.LongNamePath.FinalComponentName;
+    ULONG Offset;
+    ULONG NextOffset;
+    BOOLEAN FindInjection = (BOOLEAN)(Context->InjectionEntry.Buffer != NULL);
+    BOOLEAN FindSkip = (BOOLEAN)(Context->RealOverlap.Parent != 0);
+
+    PAGED_CODE();
+
+    FLT_ASSERT( Context->Cache.Buffer != NULL );
+
+    Context->InjectionOffset = NC_DIR_QRY_NO_OFFSET;
+    Context->SkipOffset = NC_DIR_QRY_NO_OFFSET;
+
+    if (FindInjection) {
+
+        InjectEntry = Add2Ptr( Context->InjectionEntry.Buffer, Context->InjectionEntry.CurrentOffset );
+
+        InsertString.Buffer = NcGetFileName( InjectEntry, Offsets );
+        InsertString.Length = (USHORT) NcGetFileNameLength( InjectEntry, Offsets );
+        InsertString.MaximumLength = InsertString.Length;
 
     } else {
 
+        RtlInitEmptyUnicodeString( &InsertString, NULL, 0 );
+    }
+
+    Offset = Context->Cache.CurrentOffset;
+
+    while (FindInjection || FindSkip) {
+
+        CacheEntry = Add2Ptr( Context->Cache.Buffer, Offset );
+
+        CacheString.Buffer = NcGetFileName( CacheEntry, Offsets );
+        CacheString.Length = (USHORT) NcGetFileNameLength( CacheEntry, Offsets );
+        CacheString.MaximumLength = CacheString.Length;
+
         //
-        //  An unspecified error occurred, return it.
+        //  The injected entry goes before the first entry which does not
+        //  sort before it.
         //
 
-        ExFreePoolWithTag( Buffer, NC_DIR_QRY_CACHE_TAG );
-    }
+        if (FindInjection &&
+            RtlCompareUnicodeString( &CacheString,
+                                     &InsertString,
+                                     IgnoreCase ) >= 0) {
 
-    return Status;
+            Context->InjectionOffset = Offset;
+            FindInjection = FALSE;
+        }
+
+        if (FindSkip &&
+            RtlCompareUnicodeString( &CacheString,
+                                     IgnoreString,
+                                     IgnoreCase ) == 0) {
+
+            Context->SkipOffset = Offset;
+            FindSkip = FALSE;
+        }
+
+        NextOffset = NcGetNextEntryOffset( CacheEntry, Offsets );
+
+        if (NextOffset == 0) {
+
+            break;
+        }
+
+        Offset += NextOffset;
+    }
 }
 
 PNC_CACHE_ENTRY
 NcDirEnumSelectNextEntry( 
-    _Inout_ PNC_DIR_QRY_CONTEXT Context, 
-    _In_ PDIRECTORY_CONTROL_OFFSETS Offsets,
-    _In_ BOOLEAN IgnoreCase
+    _Inout_ PNC_DIR_QRY_CONTEXT Context
     )
 /*++
 
@@ -930,14 +1137,14 @@ Routine Description:
     filesystem) should be returned now or whether the injected entry (as a
     result of our mapping) should be returned now.
 
+    The injected entry's position within the current batch was found by
+    NcDirEnumPlanBatch.  If the whole batch sorts before it, it is returned
+    once the batch is drained.
+
 Arguments:
 
     Context - The enumeration context of this handle.
 
-    Offsets - Information describing the offsets for this enumeration class.
-
-    IgnoreCase - TRUE if we are case insensitive, FALSE if case sensitive.
-
 Return Value:
 
     A pointer to the entry we should return, or NULL if there is nothing
@@ -946,10 +1153,6 @@ Return Value:
 --*/
 {
     PNC_CACHE_ENTRY NextEntry;
-    UNICODE_STRING CacheString;
-    UNICODE_STRING InsertString;
-    PVOID CacheEntry;
-    PVOID InjectEntry;
 
     PAGED_CODE();
 
@@ -982,50 +1185,23 @@ Return Value:
 
         NextEntry = &Context->Cache;
 
-    } else {
+    } else if (Context->Cache.CurrentOffset < Context->InjectionOffset) {
 
         //
-        //  We have to seek in the entry buffer to the current entry within the buffer.
+        //  Cache string comes first
         //
 
-        CacheEntry = Add2Ptr( Context->Cache.Buffer, Context->Cache.CurrentOffset );
-        InjectEntry = Add2Ptr( Context->InjectionEntry.Buffer, Context->InjectionEntry.CurrentOffset );
-
-        //
-        //  Find names within the entries.
-        //
-
-        CacheString.Buffer = NcGetFileName( CacheEntry, Offsets );
-        CacheString.Length = (USHORT) NcGetFileNameLength( CacheEntry, Offsets );
-        CacheString.MaximumLength = CacheString.Length;
+        NextEntry = &Context->Cache;
 
-        InsertString.Buffer = NcGetFileName( InjectEntry, Offsets );
-        InsertString.Length = (USHORT) NcGetFileNameLength( InjectEntry, Offsets );
-        InsertString.MaximumLength = InsertString.Length;
+    } else {
 
         //
-        //  Compare the names
+        //  insert string comes first
         //
 
-        if (RtlCompareUnicodeString( &CacheString,
-                                     &InsertString,
-                                     IgnoreCase ) < 0) {
-
-            //
-            //  Cache string comes first
-            //
-
-            NextEntry = &Context->Cache;
-
-        } else {
-
-            //
-            //  insert string comes first
-            //
-
-            NextEntry = &Context->InjectionEntry;
-        }
+        NextEntry = &Context->InjectionEntry;
     }
+
     return NextEntry;
 }
 
@@ -1092,11 +1268,10 @@ Return Value:
         if (LastElement) {
 
             //
-            //  This was the last element in the entry, so we should clean the
-            //  entry.
+            //  This was the last element in the entry, so mark the entry
+            //  empty.  The buffer is owned by the directory query context.
             //
 
-            ExFreePoolWithTag( Entry->Buffer, NC_TAG );
             Entry->Buffer = NULL;
             Entry->CurrentOffset = 0;
 
@@ -1160,6 +1335,12 @@ Return Value:
     Context->Cache.CurrentOffset = 0;
     Context->InjectionEntry.Buffer = NULL;
     Context->InjectionEntry.CurrentOffset = 0;
+    Context->OverlapValid = FALSE;
+    Context->CacheBuffer = NULL;
+    Context->CacheBufferLength = 0;
+    Context->InjectionBuffer = NULL;
+    Context->InjectionOffset = NC_DIR_QRY_NO_OFFSET;
+    Context->SkipOffset = NC_DIR_QRY_NO_OFFSET;
     Context->SearchString.Length = 0;
     Context->SearchString.MaximumLength = 0;
     Context->SearchString.Buffer = NULL;
@@ -1303,19 +1484,7 @@ Return Value:
         //  should clear the cache either way.
         //
 
-        if (DirContext->Cache.Buffer != NULL) {
-            
-            ExFreePoolWithTag( DirContext->Cache.Buffer, NC_TAG );
-            DirContext->Cache.Buffer = NULL;
-            DirContext->Cache.CurrentOffset = 0;
-        }
-
-        if (DirContext->InjectionEntry.Buffer != NULL) {
-
-            ExFreePoolWithTag( DirContext->InjectionEntry.Buffer, NC_TAG );
-            DirContext->InjectionEntry.Buffer = NULL;
-            DirContext->InjectionEntry.CurrentOffset = 0;
-        }
+        NcEnumerateDirectoryReset( DirContext );
 
         //
         //  Now that the cache is clear we can set up the injection entry.
@@ -1359,7 +1528,7 @@ NcStreamHandleContextEnumSetupCleanup:
 
             if (DirContext->SearchString.Buffer != NULL) {
 
-                ExFreePoolWithTag( DirContext->SearchString.Buffer, NC_TAG );
+                ExFreePoolWithTag( DirContext->SearchString.Buffer, NC_DIR_QRY_SEARCH_STRING );
                 DirContext->SearchString.Buffer = NULL;
                 DirContext->SearchString.Length = 0;
                 DirContext->SearchString.MaximumLength = 0;
@@ -1392,19 +1561,22 @@ Return Value:
 {
     PAGED_CODE();
 
-    if (DirContext->Cache.Buffer != NULL) {
+    if (DirContext->CacheBuffer != NULL) {
 
-        ExFreePoolWithTag( DirContext->Cache.Buffer,
+        ExFreePoolWithTag( DirContext->CacheBuffer,
                            NC_DIR_QRY_CACHE_TAG );
 
+        DirContext->CacheBuffer = NULL;
+        DirContext->CacheBufferLength = 0;
         DirContext->Cache.Buffer = NULL;
     }
 
-    if (DirContext->InjectionEntry.Buffer != NULL)  {
+    if (DirContext->InjectionBuffer != NULL)  {
 
-        ExFreePoolWithTag( DirContext->InjectionEntry.Buffer,
+        ExFreePoolWithTag( DirContext->InjectionBuffer,
                            NC_DIR_QRY_CACHE_TAG );
 
+        DirContext->InjectionBuffer = NULL;
         DirContext->InjectionEntry.Buffer = NULL;
     }
 
@@ -1717,8 +1717,6 @@ Return Value:
 
     PAGED_CODE();
 
-    UNREFERENCED_PARAMETER( CompletionContext );
-
     FLT_ASSERT( IoGetTopLevelIrp() == NULL );
 
     FLT_ASSERT( (fileInformationClass == FileRenameInformation) ||
@@ -1935,17 +1933,35 @@ Return Value:
         //  Complete the IO.
         //
 
+        if (NT_SUCCESS( Status )) {
+
+            InterlockedIncrement( &InstanceContext->RenameGeneration );
+        }
+
         ReturnValue = FLT_PREOP_COMPLETE;
         goto NcPreRenameCleanup;
 
+    } else if (RenameInfo->FileName[0] == ':') {
+
+        //
+        //  Only the stream name is changing, the namespace is not.
+        //
+
+        ReturnValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
+        goto NcPreRenameCleanup;
+
     } else {
 
         //
         //  The target was outside the mapping. The rename does not have 
-        //  to be munged. Pass through.
+        //  to be munged. Pass through, but hand our instance context to
+        //  the post callback so it can record the rename.
         //
 
-        ReturnValue = FLT_PREOP_SUCCESS_NO_CALLBACK;
+        *CompletionContext = InstanceContext;
+        InstanceContext = NULL;
+
+        ReturnValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
         goto NcPreRenameCleanup;
 
     }
@@ -1985,4 +2001,56 @@ NcPreRenameCleanup:
     return ReturnValue;
 }
 
+FLT_POSTOP_CALLBACK_STATUS
+NcPostRename (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    Fltmgr callback for renames that were passed through.  Once the rename
+    has succeeded, overlaps cached on directory handles may no longer match
+    the names of those directories, so advance the instance's rename
+    generation.  This may be called at DPC level.
+
+Arguments:
+
+    Data - Pointer to the filter CallbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The instance context, referenced by NcPreRename.
+
+    Flags - The flags for this operation.
+
+Return Value:
+
+    The return value is the Status of the operation.
+
+--*/
+{
+    PNC_INSTANCE_CONTEXT InstanceContext = CompletionContext;
+
+    UNREFERENCED_PARAMETER( FltObjects );
+
+    FLT_ASSERT( InstanceContext != NULL );
+    _Analysis_assume_( InstanceContext != NULL );
+
+    if (!FlagOn( Flags, FLTFL_POST_OPERATION_DRAINING ) &&
+        NT_SUCCESS( Data->IoStatus.Status )) {
+
+        InterlockedIncrement( &InstanceContext->RenameGeneration );
+    }
+
+    FltReleaseContext( InstanceContext );
+
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
 
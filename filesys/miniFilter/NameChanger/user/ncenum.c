@@ -0,0 +1,559 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ncenum.c
+
+Abstract:
+
+    This program measures how many directory entries per second can be
+    enumerated through the NameChanger filter, against the bare file
+    system.
+
+    It reads the mapping from the filter's service key and fills two
+    directories with Entries empty files:
+
+    - the real mapping, whose entries the filter shows under the user
+      mapping,
+    - the parent of the user mapping, into whose enumeration the filter
+      merges the final component of the user mapping.
+
+    Each directory is then enumerated Passes times with the filter detached
+    from the volume, where the mapped entries are read from the real
+    mapping, and Passes times with the filter attached, where they are read
+    from the user mapping.  A pass that is not timed comes first in each
+    case.  The program prints the entries per second of each and the
+    number of entries seen, which differ by the merged entry for the
+    parent.
+
+    The files are deleted at the end and the filter is left attached to the
+    volume if it was attached at the start.  Detaching and attaching needs
+    administrator rights.
+
+    Usage: ncenum Volume [Entries [Passes]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include <dontuse.h>
+
+#define NCENUM_FILTER_NAME              L"NameChanger"
+#define NCENUM_SERVICE_KEY              "SYSTEM\\CurrentControlSet\\Services\\NameChanger"
+
+#define NCENUM_DEFAULT_ENTRIES          10000
+#define NCENUM_DEFAULT_PASSES           10
+
+typedef enum _DIRECTORY {
+
+    DirectoryParent,
+    DirectoryMapping,
+    DirectoryMax
+
+} DIRECTORY;
+
+const PCSTR DirectoryNames[DirectoryMax] = {
+    "parent of the mapping",
+    "mapping"
+};
+
+typedef enum _CONFIGURATION {
+
+    ConfigurationNoFilter,
+    ConfigurationFilter,
+    ConfigurationMax
+
+} CONFIGURATION;
+
+//
+//  The path the volume is mounted at, without the trailing backslash, and
+//  the parent of the user mapping, the user mapping and the real mapping,
+//  with that path in front.
+//
+
+CHAR VolumeRoot[MAX_PATH];
+CHAR ParentPath[MAX_PATH];
+CHAR UserPath[MAX_PATH];
+CHAR RealPath[MAX_PATH];
+
+ULONG Entries = NCENUM_DEFAULT_ENTRIES;
+ULONG Passes = NCENUM_DEFAULT_PASSES;
+
+//
+//  Entries seen in a pass and entries enumerated per second, by
+//  configuration and directory.
+//
+
+ULONG EntriesSeen[ConfigurationMax][DirectoryMax];
+double EntriesPerSecond[ConfigurationMax][DirectoryMax];
+
+LARGE_INTEGER Frequency;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Measures directory enumeration with and without the NameChanger filter\n" );
+    printf( "Usage: ncenum Volume [Entries [Passes]]\n" );
+    printf( "    Volume is a volume the filter can attach to, for example F:\\\n" );
+    printf( "    Entries is the number of files put in each directory (default %u)\n", NCENUM_DEFAULT_ENTRIES );
+    printf( "    Passes is the number of timed enumerations (default %u)\n", NCENUM_DEFAULT_PASSES );
+}
+
+
+BOOL
+GetMappingPath (
+    _In_ PCSTR ValueName,
+    _Out_writes_(MAX_PATH) PCHAR Path
+    )
+/*++
+
+Routine Description:
+
+    Reads one of the mapping paths of the filter and puts the volume root
+    in front of it.  The paths in the registry start with a backslash.
+
+--*/
+{
+    CHAR mapping[MAX_PATH];
+    DWORD size = sizeof( mapping );
+    LSTATUS status;
+
+    status = RegGetValueA( HKEY_LOCAL_MACHINE,
+                           NCENUM_SERVICE_KEY,
+                           ValueName,
+                           RRF_RT_REG_SZ,
+                           NULL,
+                           mapping,
+                           &size );
+
+    if (status != ERROR_SUCCESS) {
+
+        printf( "ERROR: Reading %s from the filter's service key: %d\n", ValueName, status );
+        return FALSE;
+    }
+
+    if (_snprintf_s( Path, MAX_PATH, _TRUNCATE, "%s%s", VolumeRoot, mapping ) < 0) {
+
+        printf( "ERROR: %s is too long\n", ValueName );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+CreateDirectories (
+    _In_ PCSTR Path
+    )
+/*++
+
+Routine Description:
+
+    Creates a directory and any of its parents that do not exist.
+
+--*/
+{
+    CHAR partial[MAX_PATH];
+    PCHAR separator;
+
+    if (strcpy_s( partial, sizeof( partial ), Path ) != 0) {
+
+        return FALSE;
+    }
+
+    //
+    //  Skip the volume root, which exists.
+    //
+
+    separator = strchr( partial + strlen( VolumeRoot ) + 1, '\\' );
+
+    while (separator != NULL) {
+
+        *separator = '\0';
+
+        if (!CreateDirectoryA( partial, NULL ) &&
+            (GetLastError() != ERROR_ALREADY_EXISTS)) {
+
+            printf( "ERROR: Creating %s: %u\n", partial, GetLastError() );
+            return FALSE;
+        }
+
+        *separator = '\\';
+        separator = strchr( separator + 1, '\\' );
+    }
+
+    if (!CreateDirectoryA( partial, NULL ) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+
+        printf( "ERROR: Creating %s: %u\n", partial, GetLastError() );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+GetFilePath (
+    _In_ PCSTR Directory,
+    _In_ ULONG Index,
+    _Out_writes_(MAX_PATH) PCHAR Path
+    )
+{
+    return _snprintf_s( Path, MAX_PATH, _TRUNCATE, "%s\\ncenum%06u.tmp", Directory, Index ) >= 0;
+}
+
+
+BOOL
+CreateFiles (
+    _In_ PCSTR Directory,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Creates empty files in a directory.  This is not timed.
+
+--*/
+{
+    CHAR path[MAX_PATH];
+    HANDLE file;
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        GetFilePath( Directory, i, path );
+
+        file = CreateFileA( path,
+                            GENERIC_WRITE,
+                            0,
+                            NULL,
+                            CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL );
+
+        if (file == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Creating %s: %u\n", path, GetLastError() );
+            return FALSE;
+        }
+
+        CloseHandle( file );
+    }
+
+    return TRUE;
+}
+
+
+VOID
+DeleteFiles (
+    _In_ PCSTR Directory,
+    _In_ ULONG Count
+    )
+{
+    CHAR path[MAX_PATH];
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+
+        GetFilePath( Directory, i, path );
+        DeleteFileA( path );
+    }
+}
+
+
+BOOL
+Enumerate (
+    _In_ PCSTR Directory,
+    _Out_ PULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Enumerates a directory once and counts its entries.  Large fetches make
+    each query return more entries, so the cost measured is mostly that of
+    the entries rather than of the calls.
+
+--*/
+{
+    CHAR pattern[MAX_PATH];
+    WIN32_FIND_DATAA findData;
+    HANDLE find;
+    ULONG count = 0;
+
+    *Count = 0;
+
+    _snprintf_s( pattern, MAX_PATH, _TRUNCATE, "%s\\*", Directory );
+
+    find = FindFirstFileExA( pattern,
+                             FindExInfoBasic,
+                             &findData,
+                             FindExSearchNameMatch,
+                             NULL,
+                             FIND_FIRST_EX_LARGE_FETCH );
+
+    if (find == INVALID_HANDLE_VALUE) {
+
+        printf( "ERROR: Enumerating %s: %u\n", Directory, GetLastError() );
+        return FALSE;
+    }
+
+    do {
+
+        count += 1;
+
+    } while (FindNextFileA( find, &findData ));
+
+    FindClose( find );
+
+    *Count = count;
+
+    return TRUE;
+}
+
+
+BOOL
+RunConfiguration (
+    _In_ CONFIGURATION Configuration
+    )
+{
+    PCSTR directories[DirectoryMax];
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    DIRECTORY directory;
+    ULONG count;
+    ULONG pass;
+
+    //
+    //  Without the filter the mapped entries are only visible in the real
+    //  mapping.
+    //
+
+    directories[DirectoryParent] = ParentPath;
+    directories[DirectoryMapping] = (Configuration == ConfigurationFilter) ? UserPath : RealPath;
+
+    for (directory = 0; directory < DirectoryMax; directory++) {
+
+        if (!Enumerate( directories[directory], &EntriesSeen[Configuration][directory] )) {
+
+            return FALSE;
+        }
+
+        QueryPerformanceCounter( &start );
+
+        for (pass = 0; pass < Passes; pass++) {
+
+            if (!Enumerate( directories[directory], &count )) {
+
+                return FALSE;
+            }
+
+            if (count != EntriesSeen[Configuration][directory]) {
+
+                printf( "ERROR: %s had %u entries, then %u\n",
+                        directories[directory],
+                        EntriesSeen[Configuration][directory],
+                        count );
+
+                return FALSE;
+            }
+        }
+
+        QueryPerformanceCounter( &end );
+
+        EntriesPerSecond[Configuration][directory] =
+            (double) EntriesSeen[Configuration][directory] * Passes * Frequency.QuadPart /
+            (double) (end.QuadPart - start.QuadPart);
+    }
+
+    return TRUE;
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    CHAR volumePath[MAX_PATH];
+    CHAR volumeName[MAX_PATH];
+    WCHAR volume[MAX_PATH];
+    PCHAR separator;
+    CONFIGURATION configuration;
+    DIRECTORY directory;
+    BOOL attached;
+    BOOL created = FALSE;
+    HRESULT hr;
+    int status = 0;
+
+    if (argc < 2 || argc > 4) {
+
+        Usage();
+        return 1;
+    }
+
+    if (argc >= 3) {
+
+        Entries = (ULONG) atoi( argv[2] );
+    }
+
+    if (argc == 4) {
+
+        Passes = (ULONG) atoi( argv[3] );
+    }
+
+    if ((Entries == 0) || (Passes == 0)) {
+
+        Usage();
+        return 1;
+    }
+
+    //
+    //  The filter is detached from, and attached to, the volume by its
+    //  GUID name.
+    //
+
+    if (!GetVolumePathNameA( argv[1], volumePath, sizeof( volumePath ) ) ||
+        !GetVolumeNameForVolumeMountPointA( volumePath, volumeName, sizeof( volumeName ) ) ||
+        (MultiByteToWideChar( CP_ACP, 0, volumeName, -1, volume, ARRAYSIZE( volume ) ) == 0)) {
+
+        printf( "ERROR: Getting the volume of %s: %u\n", argv[1], GetLastError() );
+        return 2;
+    }
+
+    strcpy_s( VolumeRoot, sizeof( VolumeRoot ), volumePath );
+    VolumeRoot[strlen( VolumeRoot ) - 1] = '\0';
+
+    if (!GetMappingPath( "UserMapping", UserPath ) ||
+        !GetMappingPath( "RealMapping", RealPath )) {
+
+        return 2;
+    }
+
+    strcpy_s( ParentPath, sizeof( ParentPath ), UserPath );
+    separator = strrchr( ParentPath, '\\' );
+
+    if (separator == NULL || separator == ParentPath + strlen( VolumeRoot )) {
+
+        printf( "ERROR: The user mapping %s is not under a directory\n", UserPath );
+        return 2;
+    }
+
+    *separator = '\0';
+
+    QueryPerformanceFrequency( &Frequency );
+
+    //
+    //  The files are created and deleted without the filter, which hides
+    //  the real mapping.  Failing to detach means it was not attached.
+    //
+
+    attached = SUCCEEDED( FilterDetach( NCENUM_FILTER_NAME, volume, NULL ) );
+
+    printf( "%u entries, %u passes, the filter was %sattached\n\n",
+            Entries,
+            Passes,
+            attached ? "" : "not " );
+
+    if (!CreateDirectories( RealPath ) ||
+        !CreateDirectories( ParentPath )) {
+
+        status = 2;
+        goto Cleanup;
+    }
+
+    created = TRUE;
+
+    if (!CreateFiles( RealPath, Entries ) ||
+        !CreateFiles( ParentPath, Entries )) {
+
+        status = 2;
+        goto Cleanup;
+    }
+
+    for (configuration = 0; configuration < ConfigurationMax; configuration++) {
+
+        if (configuration == ConfigurationFilter) {
+
+            hr = FilterAttach( NCENUM_FILTER_NAME, volume, NULL, 0, NULL );
+
+            if (IS_ERROR( hr )) {
+
+                printf( "ERROR: Attaching the filter to %ws: 0x%08x\n", volume, hr );
+                status = 2;
+                goto Cleanup;
+            }
+        }
+
+        if (!RunConfiguration( configuration )) {
+
+            status = 3;
+        }
+
+        if (configuration == ConfigurationFilter) {
+
+            FilterDetach( NCENUM_FILTER_NAME, volume, NULL );
+        }
+
+        if (status != 0) {
+
+            goto Cleanup;
+        }
+    }
+
+    printf( "%-22s %8s %12s %8s %12s %8s\n",
+            "directory",
+            "entries",
+            "no filter/s",
+            "entries",
+            "filter/s",
+            "change" );
+
+    for (directory = 0; directory < DirectoryMax; directory++) {
+
+        printf( "%-22s %8u %12.0f %8u %12.0f %7.1f%%\n",
+                DirectoryNames[directory],
+                EntriesSeen[ConfigurationNoFilter][directory],
+                EntriesPerSecond[ConfigurationNoFilter][directory],
+                EntriesSeen[ConfigurationFilter][directory],
+                EntriesPerSecond[ConfigurationFilter][directory],
+                100.0 * (EntriesPerSecond[ConfigurationFilter][directory] /
+                         EntriesPerSecond[ConfigurationNoFilter][directory] - 1.0) );
+    }
+
+Cleanup:
+
+    if (created) {
+
+        DeleteFiles( RealPath, Entries );
+        DeleteFiles( ParentPath, Entries );
+    }
+
+    if (attached) {
+
+        hr = FilterAttach( NCENUM_FILTER_NAME, volume, NULL, 0, NULL );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Attaching the filter to %ws again: 0x%08x\n", volume, hr );
+            status = 2;
+        }
+    }
+
+    return status;
+}
@@ -10,6 +10,14 @@ Abstract:
 
     This is the main module of the cancelSafe miniFilter driver.
 
+    Pended reads are kept in the cancel safe queue sorted by stream and
+    offset, and a pool of worker routines drains the queue in C-SCAN order:
+    each worker takes the next read at or after the current sweep position,
+    together with the reads that follow it contiguously on the same stream,
+    and the sweep wraps to the start of the queue when it reaches the end.
+    Within a sweep, each process only gets a limited number of reads
+    released, so that one process cannot keep the others waiting.
+
 Environment:
 
     Kernel mode
@@ -31,6 +39,7 @@ Environment:
 #define CSQ_TRACE_CONTEXT_CALLBACK          0x00000008
 #define CSQ_TRACE_CBDQ_CALLBACK             0x00000010
 #define CSQ_TRACE_PRE_READ                  0x00000020
+#define CSQ_TRACE_STATS                     0x00000040
 #define CSQ_TRACE_ALL                       0xFFFFFFFF
 
 #define DebugTrace(Level, Data)               \
@@ -56,8 +65,34 @@ Environment:
 #define CSQ_KEY_NAME_DELAY                L"OperatingDelay"
 #define CSQ_KEY_NAME_PATH                 L"OperatingPath"
 #define CSQ_KEY_NAME_DEBUG_LEVEL          L"DebugLevel"
+#define CSQ_KEY_NAME_WORKER_COUNT         L"WorkerCount"
+#define CSQ_KEY_NAME_PROCESS_QUOTA        L"ProcessQuota"
 #define CSQ_MAX_PATH_LENGTH               256
 
+//
+//  Worker pool and scheduling limits. A process quota of zero disables
+//  per-process fairness.
+//
+
+#define CSQ_DEFAULT_WORKER_COUNT          1
+#define CSQ_MAX_WORKER_COUNT              16
+#define CSQ_DEFAULT_PROCESS_QUOTA         8
+
+//
+//  Maximum number of contiguous reads released together.
+//
+
+#define CSQ_MAX_RUN_LENGTH                16
+
+//
+//  Number of slots processes are hashed into for fairness accounting.
+//  Processes that share a slot share a quota.
+//
+
+#define CSQ_FAIRNESS_SLOTS                16
+
+#define CsqFairnessSlot(ProcessId)        ((ProcessId) % CSQ_FAIRNESS_SLOTS)
+
 
 //
 //  Prototypes
@@ -71,8 +106,59 @@ typedef struct _QUEUE_CONTEXT {
 
     FLT_CALLBACK_DATA_QUEUE_IO_CONTEXT CbdqIoContext;
 
+    //
+    //  Sort key of the read: the stream, identified by the FsContext of its
+    //  file object, and the byte offset.
+    //
+
+    PVOID Stream;
+    LONGLONG ByteOffset;
+    ULONG Length;
+
+    //
+    //  Process that issued the read, for fairness.
+    //
+
+    ULONG ProcessId;
+
+    //
+    //  Interrupt time at which the read was queued.
+    //
+
+    LONGLONG InsertTime;
+
 } QUEUE_CONTEXT, *PQUEUE_CONTEXT;
 
+//
+//  Peek context passed to FltCbdqRemoveNextIo by the workers.
+//
+
+typedef enum _CSQ_PEEK_MODE {
+
+    //
+    //  The next read at or after the sweep position whose process has not
+    //  used up its quota for the sweep.
+    //
+
+    CsqPeekElevator,
+
+    //
+    //  The read that starts at Stream/ByteOffset, if any.
+    //
+
+    CsqPeekContiguous
+
+} CSQ_PEEK_MODE;
+
+typedef struct _CSQ_PEEK_CONTEXT {
+
+    CSQ_PEEK_MODE Mode;
+
+    PVOID Stream;
+    LONGLONG ByteOffset;
+
+} CSQ_PEEK_CONTEXT, *PCSQ_PEEK_CONTEXT;
+
 //
 //  Instance context data structure
 //
@@ -86,7 +172,7 @@ typedef struct _INSTANCE_CONTEXT {
     PFLT_INSTANCE Instance;
 
     //
-    //  Cancel safe queue members
+    //  Cancel safe queue members. The queue is sorted by stream and offset.
     //
 
     FLT_CALLBACK_DATA_QUEUE Cbdq;
@@ -94,10 +180,38 @@ typedef struct _INSTANCE_CONTEXT {
     FAST_MUTEX Lock;
 
     //
-    //  Flag to control the life/death of the work item thread
+    //  The members below are protected by Lock.
+    //
+
+    ULONG QueueDepth;
+
+    //
+    //  Number of worker routines queued or running. Workers are started on
+    //  insertion, up to Globals.WorkerCount and no more than there are reads
+    //  queued, and exit when they find the queue empty.
+    //
+
+    ULONG ActiveWorkers;
+
+    //
+    //  Elevator state: the position the current sweep has reached, and the
+    //  number of reads released per process slot in the sweep.
     //
 
-    volatile LONG WorkerThreadFlag;
+    PVOID SweepStream;
+    LONGLONG SweepOffset;
+    ULONG ProcessServed[CSQ_FAIRNESS_SLOTS];
+
+    //
+    //  Statistics, traced at teardown. Latencies are in 100ns units.
+    //
+
+    ULONG MaxQueueDepth;
+    ULONG Sweeps;
+    ULONGLONG Dispatched;
+    ULONGLONG Coalesced;
+    ULONGLONG TotalLatency;
+    ULONGLONG MaxLatency;
 
     //
     //  Notify the worker thread that the instance is being torndown
@@ -121,6 +235,10 @@ typedef struct _CSQ_GLOBAL_DATA {
     PWSTR PathBuffer;
 
     LONGLONG TimeDelay;
+
+    ULONG WorkerCount;
+
+    ULONG ProcessQuota;
     
 } CSQ_GLOBAL_DATA;
 
@@ -258,6 +376,18 @@ PreReadProcessIo(
     _Inout_ PFLT_CALLBACK_DATA Data
     );
 
+ULONG
+PreReadRemoveNextRun(
+    _In_ PINSTANCE_CONTEXT InstanceContext,
+    _Out_writes_to_(CSQ_MAX_RUN_LENGTH, return) PFLT_CALLBACK_DATA *Run
+    );
+
+VOID
+PreReadCompleteIo(
+    _In_ PINSTANCE_CONTEXT InstanceContext,
+    _Inout_ PFLT_CALLBACK_DATA Data
+    );
+
 VOID
 PreReadEmptyQueueAndComplete(
     _In_ PINSTANCE_CONTEXT InstanceContext
@@ -385,6 +515,10 @@ Return Value:
 
     Globals.TimeDelay = CSQ_DEFAULT_TIME_DELAY;
 
+    Globals.WorkerCount = CSQ_DEFAULT_WORKER_COUNT;
+
+    Globals.ProcessQuota = CSQ_DEFAULT_PROCESS_QUOTA;
+
     Globals.PathBuffer = NULL;
 
     RtlInitUnicodeString( &Globals.MappingPath, CSQ_DEFAULT_MAPPING_PATH );
@@ -465,8 +599,8 @@ SetConfiguration (
 
 Routine Description:
 
-    This routine tries to configure the debuglevel, mapping path and
-    queue delay based on values in the registry.
+    This routine tries to configure the debuglevel, mapping path, queue
+    delay, worker count and process quota based on values in the registry.
 
 Arguments:
 
@@ -555,6 +689,63 @@ Return Value:
         Globals.TimeDelay = (LONGLONG)(*(PULONG)(Value->Data));
         
     }
+
+    //
+    //  Query the number of workers per instance
+    //
+
+    RtlInitUnicodeString( &ValueName, CSQ_KEY_NAME_WORKER_COUNT );
+
+    Status = ZwQueryValueKey( DriverRegKey,
+                              &ValueName,
+                              KeyValuePartialInformation,
+                              Value,
+                              ValueLength,
+                              &ResultLength );
+
+    if (NT_SUCCESS( Status )) {
+
+        if (Value->Type != REG_DWORD) {
+
+            Status = STATUS_INVALID_PARAMETER;
+            goto SetConfigurationCleanup;
+        }
+
+        Globals.WorkerCount = *(PULONG)(Value->Data);
+
+        if (Globals.WorkerCount == 0) {
+
+            Globals.WorkerCount = 1;
+
+        } else if (Globals.WorkerCount > CSQ_MAX_WORKER_COUNT) {
+
+            Globals.WorkerCount = CSQ_MAX_WORKER_COUNT;
+        }
+    }
+
+    //
+    //  Query the number of reads released per process and sweep
+    //
+
+    RtlInitUnicodeString( &ValueName, CSQ_KEY_NAME_PROCESS_QUOTA );
+
+    Status = ZwQueryValueKey( DriverRegKey,
+                              &ValueName,
+                              KeyValuePartialInformation,
+                              Value,
+                              ValueLength,
+                              &ResultLength );
+
+    if (NT_SUCCESS( Status )) {
+
+        if (Value->Type != REG_DWORD) {
+
+            Status = STATUS_INVALID_PARAMETER;
+            goto SetConfigurationCleanup;
+        }
+
+        Globals.ProcessQuota = *(PULONG)(Value->Data);
+    }
   
     //
     // Query the mapping path
@@ -825,6 +1016,8 @@ Return Value:
         goto InstanceSetupCleanup;
     }
 
+    RtlZeroMemory( InstCtx, sizeof( INSTANCE_CONTEXT ) );
+
     Status = FltCbdqInitialize( FltObjects->Instance,
                                 &InstCtx->Cbdq,
                                 CsqInsertIo,
@@ -859,8 +1052,6 @@ Return Value:
 
     InstCtx->Instance = FltObjects->Instance;
 
-    InstCtx->WorkerThreadFlag = 0;
-
     KeInitializeEvent( &InstCtx->TeardownEvent, NotificationEvent, FALSE );
 
     //
@@ -999,6 +1190,16 @@ Return Value:
 
     KeSetEvent( &InstCtx->TeardownEvent, 0, FALSE );
 
+    DebugTrace( CSQ_TRACE_STATS,
+                ("[Csq]: Instance %p: %I64u reads dispatched, %I64u coalesced, %lu sweeps, max queue depth %lu, average latency %I64u us, max latency %I64u us\n",
+                FltObjects->Instance,
+                InstCtx->Dispatched,
+                InstCtx->Coalesced,
+                InstCtx->Sweeps,
+                InstCtx->MaxQueueDepth,
+                (InstCtx->Dispatched != 0) ? (InstCtx->TotalLatency / InstCtx->Dispatched / 10) : 0,
+                InstCtx->MaxLatency / 10) );
+
     //
     //  Cleanup
     //
@@ -1157,6 +1358,9 @@ Routine Description:
     FltMgr calls this routine to insert an entry into our pending I/O queue.
     The queue is already locked before this routine is called.
 
+    The entry is inserted in stream and offset order. The search starts at
+    the tail because reads tend to arrive in ascending order.
+
 Arguments:
 
     DataQueue - Supplies a pointer to the queue itself.
@@ -1174,9 +1378,11 @@ Return Value:
 --*/
 {
     PINSTANCE_CONTEXT InstCtx;
+    PQUEUE_CONTEXT QueueCtx;
+    PQUEUE_CONTEXT PrevCtx;
+    PLIST_ENTRY PrevEntry;
     PFLT_GENERIC_WORKITEM WorkItem = NULL;
     NTSTATUS Status = STATUS_SUCCESS;
-    BOOLEAN WasQueueEmpty;
 
     UNREFERENCED_PARAMETER( Context );
 
@@ -1189,25 +1395,44 @@ Return Value:
 
     InstCtx = CONTAINING_RECORD( DataQueue, INSTANCE_CONTEXT, Cbdq );
 
+    QueueCtx = (PQUEUE_CONTEXT) Data->QueueContext[0];
+
     //
-    //  Save the queue state before inserting to it.
+    //  Find the last entry that sorts before or equal to the new one, and
+    //  insert the callback data entry after it.
     //
 
-    WasQueueEmpty = IsListEmpty( &InstCtx->QueueHead );
+    for (PrevEntry = InstCtx->QueueHead.Blink;
+         PrevEntry != &InstCtx->QueueHead;
+         PrevEntry = PrevEntry->Blink) {
 
-    //
-    //  Insert the callback data entry into the queue.
-    //
+        PrevCtx = (PQUEUE_CONTEXT) CONTAINING_RECORD( PrevEntry, FLT_CALLBACK_DATA, QueueLinks )->QueueContext[0];
+
+        if (PrevCtx->Stream < QueueCtx->Stream ||
+            (PrevCtx->Stream == QueueCtx->Stream &&
+             PrevCtx->ByteOffset <= QueueCtx->ByteOffset)) {
+
+            break;
+        }
+    }
 
-    InsertTailList( &InstCtx->QueueHead,
+    InsertHeadList( PrevEntry,
                     &Data->QueueLinks );
 
+    InstCtx->QueueDepth += 1;
+
+    if (InstCtx->QueueDepth > InstCtx->MaxQueueDepth) {
+
+        InstCtx->MaxQueueDepth = InstCtx->QueueDepth;
+    }
+
     //
-    //  Queue a work item if no worker thread present.
+    //  Queue another worker if the pool is not full and there are more
+    //  reads queued than workers to take them.
     //
 
-    if (WasQueueEmpty &&
-        InterlockedIncrement( &InstCtx->WorkerThreadFlag ) == 1) {
+    if (InstCtx->ActiveWorkers < Globals.WorkerCount &&
+        InstCtx->ActiveWorkers < InstCtx->QueueDepth) {
 
         WorkItem = FltAllocateGenericWorkItem();
 
@@ -1233,27 +1458,25 @@ Return Value:
             Status = STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (!NT_SUCCESS( Status )) {
+        if (NT_SUCCESS( Status )) {
 
-            //
-            //  If we failed to queue a workitem we need to
-            //  decrement the worker thread flag. If we did
-            //  not decrement it future queue insertions would
-            //  not trigger a workitem and requests added to
-            //  the queue would be orphaned. We can safely
-            //  decrement the flag here because we are
-            //  guaranteed that no worker routine is currently
-            //  running and that the queue is currently locked.
-            //
+            InstCtx->ActiveWorkers += 1;
 
-            InterlockedDecrement( &InstCtx->WorkerThreadFlag );
-            NT_ASSERT( InstCtx->WorkerThreadFlag == 0 );
+        } else if (InstCtx->ActiveWorkers == 0) {
 
             //
-            //  Remove the callback data that was inserted into the queue.
+            //  If no worker is running, nothing would ever remove the
+            //  callback data from the queue, so take it back out and fail
+            //  the insertion. Otherwise the running workers will get to it.
             //
 
-            RemoveTailList( &InstCtx->QueueHead );
+            RemoveEntryList( &Data->QueueLinks );
+
+            InstCtx->QueueDepth -= 1;
+
+        } else {
+
+            Status = STATUS_SUCCESS;
         }
     }
 
@@ -1285,16 +1508,20 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER( DataQueue );
+    PINSTANCE_CONTEXT InstCtx;
 
     DebugTrace( CSQ_TRACE_CBDQ_CALLBACK,
                 ("[Csq]: CancelSafe!CsqRemoveIo\n") );
 
+    InstCtx = CONTAINING_RECORD( DataQueue, INSTANCE_CONTEXT, Cbdq );
+
     //
     //  Remove the callback data entry from the queue.
     //
 
     RemoveEntryList( &Data->QueueLinks );
+
+    InstCtx->QueueDepth -= 1;
 }
 
 
@@ -1318,7 +1545,10 @@ Arguments:
     Data - Supplies the callback data we should start our search from.
            If this is NULL, we start at the beginning of the list.
 
-    PeekContext - Supplies user-defined context information.
+    PeekContext - Supplies user-defined context information. If NULL, all
+                  entries are returned in queue order. Otherwise it is a
+                  CSQ_PEEK_CONTEXT from a worker, and only the entries it
+                  selects are returned.
 
 Return Value:
 
@@ -1327,11 +1557,11 @@ Return Value:
 --*/
 {
     PINSTANCE_CONTEXT InstCtx;
+    PCSQ_PEEK_CONTEXT Peek = (PCSQ_PEEK_CONTEXT) PeekContext;
+    PQUEUE_CONTEXT QueueCtx;
     PLIST_ENTRY NextEntry;
     PFLT_CALLBACK_DATA NextData;
 
-    UNREFERENCED_PARAMETER( PeekContext );
-
     DebugTrace( CSQ_TRACE_CBDQ_CALLBACK,
                 ("[Csq]: CancelSafe!CsqPeekNextIo\n") );
 
@@ -1366,7 +1596,73 @@ Return Value:
 
     NextData = CONTAINING_RECORD( NextEntry, FLT_CALLBACK_DATA, QueueLinks );
 
-    return NextData;
+    if (Peek == NULL) {
+
+        return NextData;
+    }
+
+    if (Peek->Mode == CsqPeekContiguous) {
+
+        //
+        //  Only the entry right at the end of the previous read qualifies,
+        //  so there is nothing to retry with.
+        //
+
+        if (Data != NULL) {
+
+            return NULL;
+        }
+
+        for (; NextEntry != &InstCtx->QueueHead; NextEntry = NextEntry->Flink) {
+
+            NextData = CONTAINING_RECORD( NextEntry, FLT_CALLBACK_DATA, QueueLinks );
+            QueueCtx = (PQUEUE_CONTEXT) NextData->QueueContext[0];
+
+            if (QueueCtx->Stream > Peek->Stream ||
+                (QueueCtx->Stream == Peek->Stream &&
+                 QueueCtx->ByteOffset >= Peek->ByteOffset)) {
+
+                if (QueueCtx->Stream == Peek->Stream &&
+                    QueueCtx->ByteOffset == Peek->ByteOffset) {
+
+                    return NextData;
+                }
+
+                break;
+            }
+        }
+
+        return NULL;
+    }
+
+    //
+    //  Elevator: skip the entries behind the sweep position, and those of
+    //  processes that have used up their quota for this sweep. NULL means
+    //  the sweep has reached the end of the queue.
+    //
+
+    for (; NextEntry != &InstCtx->QueueHead; NextEntry = NextEntry->Flink) {
+
+        NextData = CONTAINING_RECORD( NextEntry, FLT_CALLBACK_DATA, QueueLinks );
+        QueueCtx = (PQUEUE_CONTEXT) NextData->QueueContext[0];
+
+        if (QueueCtx->Stream < InstCtx->SweepStream ||
+            (QueueCtx->Stream == InstCtx->SweepStream &&
+             QueueCtx->ByteOffset < InstCtx->SweepOffset)) {
+
+            continue;
+        }
+
+        if (Globals.ProcessQuota != 0 &&
+            InstCtx->ProcessServed[CsqFairnessSlot( QueueCtx->ProcessId )] >= Globals.ProcessQuota) {
+
+            continue;
+        }
+
+        return NextData;
+    }
+
+    return NULL;
 }
 
 
@@ -1546,6 +1842,12 @@ Return Value:
 
     RtlZeroMemory(QueueCtx, sizeof(QUEUE_CONTEXT));
 
+    QueueCtx->Stream = FltObjects->FileObject->FsContext;
+    QueueCtx->ByteOffset = Data->Iopb->Parameters.Read.ByteOffset.QuadPart;
+    QueueCtx->Length = Data->Iopb->Parameters.Read.Length;
+    QueueCtx->ProcessId = FltGetRequestorProcessId( Data );
+    QueueCtx->InsertTime = KeQueryInterruptTime();
+
     //
     //  Get the instance context.
     //
@@ -1582,7 +1884,8 @@ Return Value:
         //  correctly handle the insert/remove race conditions b/w multi threads.
         //  In this sample, the worker thread creation is done in CsqInsertIo.
         //  This is a simpler solution because CsqInsertIo is atomic with 
-        //  respect to other CsqXxxIo callback routines.
+        //  respect to other CsqXxxIo callback routines and to the exit
+        //  check of the workers, which is done under the same lock.
         //
 
         CbStatus = FLT_PREOP_PENDING;
@@ -1630,13 +1933,15 @@ PreReadWorkItemRoutine(
 Routine Description:
 
     This WorkItem routine is called in the system thread context to process
-    all the pended I/O in this mini filter's cancel safe queue. For each I/O
-    in the queue, it completes the I/O after pending the operation for a
-    period of time. The thread exits when the queue is empty.
+    the pended I/O in this mini filter's cancel safe queue. Up to
+    Globals.WorkerCount of these run per instance. Each one repeatedly
+    waits for a period of time, then takes the next run of reads in
+    elevator order and completes them. The thread exits when the queue is
+    empty.
 
 Arguments:
 
-    WorkItem - Unused.
+    WorkItem - The work item, freed on exit.
 
     Filter - Unused.
 
@@ -1649,13 +1954,13 @@ Return Value:
 --*/
 {
     PINSTANCE_CONTEXT InstCtx = NULL;
-    PFLT_CALLBACK_DATA Data;
+    PFLT_CALLBACK_DATA Run[CSQ_MAX_RUN_LENGTH];
     PFLT_INSTANCE Instance = (PFLT_INSTANCE)Context;
-    PQUEUE_CONTEXT QueueCtx;
     NTSTATUS Status;
-    FLT_PREOP_CALLBACK_STATUS callbackStatus;
+    BOOLEAN Exit;
+    ULONG Count;
+    ULONG Index;
 
-    UNREFERENCED_PARAMETER( WorkItem );
     UNREFERENCED_PARAMETER( Filter );
 
     DebugTrace( CSQ_TRACE_PRE_READ,
@@ -1675,124 +1980,300 @@ Return Value:
     }
 
     //
-    //  Process all the pended I/O in the cancel safe queue
+    //  Process the pended I/O in the cancel safe queue
     //
 
     for (;;) {
 
-        callbackStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
-
         PreReadPendIo( InstCtx );
 
         //
-        //  WorkerThreadFlag >= 1;
-        //  Here we reduce it to 1.
+        //  Remove the next run of I/O from the cancel safe queue.
         //
 
-        InterlockedExchange( &InstCtx->WorkerThreadFlag, 1 );
+        Count = PreReadRemoveNextRun( InstCtx, Run );
+
+        if (Count == 0) {
+
+            //
+            //  The exit decision is made under the queue lock, so it is
+            //  atomic with respect to CsqInsertIo: either the insertion
+            //  sees this worker gone and starts a new one, or this worker
+            //  sees the inserted I/O and keeps going. The queue may still
+            //  hold I/O that is being canceled, in which case we look again.
+            //
+
+            Exit = FALSE;
+
+            ExAcquireFastMutex( &InstCtx->Lock );
+
+            if (InstCtx->QueueDepth == 0) {
+
+                InstCtx->ActiveWorkers -= 1;
+                Exit = TRUE;
+            }
+
+            ExReleaseFastMutex( &InstCtx->Lock );
+
+            if (Exit) {
+
+                break;
+            }
+
+            continue;
+        }
+
+        DebugTrace( CSQ_TRACE_PRE_READ,
+                    ("[Csq]: Releasing %lu reads at offset 0x%I64x\n",
+                    Count,
+                    ((PQUEUE_CONTEXT) Run[0]->QueueContext[0])->ByteOffset) );
 
         //
-        //  Remove an I/O from the cancel safe queue.
+        //  Complete the run in ascending order, so that the reads reach the
+        //  file system back to back.
         //
 
-        Data = FltCbdqRemoveNextIo( &InstCtx->Cbdq,
-                                    NULL);
+        for (Index = 0; Index < Count; Index++) {
 
-        if (Data) {
+            PreReadCompleteIo( InstCtx, Run[Index] );
+        }
+    }
 
-            QueueCtx = (PQUEUE_CONTEXT) Data->QueueContext[0];
+    //
+    //  Clean up
+    //
 
-            PreReadProcessIo( Data );
+    FltReleaseContext(InstCtx);
 
-            //
-            //  Check to see if we need to lock the user buffer.
-            //
-            //  If the FLTFL_CALLBACK_DATA_SYSTEM_BUFFER flag is set we don't 
-            //  have to lock the buffer because its already a system buffer.
-            //
-            //  If the MdlAddress is NULL and the buffer is a user buffer, 
-            //  then we have to construct one in order to look at the buffer.
-            //
-            //  If the length of the buffer is zero there is nothing to read,
-            //  so we cannot construct a MDL.
-            //
+    FltFreeGenericWorkItem(WorkItem);
+}
 
-            if (!FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER) && 
-                Data->Iopb->Parameters.Read.MdlAddress == NULL &&
-                Data->Iopb->Parameters.Read.Length > 0) {
 
-                Status = FltLockUserBuffer( Data );
+ULONG
+PreReadRemoveNextRun(
+    _In_ PINSTANCE_CONTEXT InstanceContext,
+    _Out_writes_to_(CSQ_MAX_RUN_LENGTH, return) PFLT_CALLBACK_DATA *Run
+    )
+/*++
 
-                if (!NT_SUCCESS( Status )) {
-                    
-                    //
-                    //  If could not lock the user buffer we cannot
-                    //  allow the IO to go below us. Because we are 
-                    //  in a different VA space and the buffer is a
-                    //  user mode address, we will either fault or 
-                    //  corrpt data
-                    //
-                   
-                    DebugTrace( CSQ_TRACE_PRE_READ | CSQ_TRACE_ERROR,
-                                ("[Csq]: Failed to lock user buffer (Status = 0x%x)\n",
-                                Status) );
+Routine Description:
 
-                    callbackStatus = FLT_PREOP_COMPLETE;
-                    Data->IoStatus.Status = Status;
-                }
-            }
+    This routine removes the next read in C-SCAN order from the cancel safe
+    queue, together with the queued reads that continue it contiguously on
+    the same stream, and advances the sweep past them. When the sweep has
+    reached the end of the queue, a new sweep is started from the beginning.
 
-            //
-            //  Complete the I/O
-            //
+Arguments:
 
-            FltCompletePendedPreOperation( Data,
-                                           callbackStatus,
-                                           NULL );
+    InstanceContext - Supplies a pointer to the instance context.
 
-            //
-            //  Free the extra storage that was allocated for this I/O.
-            //
+    Run - Receives the callback data of the reads removed, in ascending
+          offset order.
 
-            ExFreeToNPagedLookasideList( &Globals.QueueContextLookaside,
-                                         QueueCtx );
+Return Value:
 
-        } else {
+    The number of reads removed, zero if there was none.
 
+--*/
+{
+    CSQ_PEEK_CONTEXT Peek;
+    PQUEUE_CONTEXT QueueCtx;
+    LONGLONG Now;
+    ULONGLONG Latency;
+    BOOLEAN Wrapped = FALSE;
+    ULONG Count;
+    ULONG Index;
+
+    Peek.Mode = CsqPeekElevator;
+    Peek.Stream = NULL;
+    Peek.ByteOffset = 0;
+
+    for (;;) {
+
+        Run[0] = FltCbdqRemoveNextIo( &InstanceContext->Cbdq,
+                                      &Peek );
+
+        if (Run[0] != NULL || Wrapped) {
+
+            break;
+        }
+
+        //
+        //  Nothing is left ahead of the sweep, or only I/O of processes
+        //  that have had their share. Start the next sweep.
+        //
+
+        ExAcquireFastMutex( &InstanceContext->Lock );
+
+        InstanceContext->SweepStream = NULL;
+        InstanceContext->SweepOffset = 0;
+        RtlZeroMemory( InstanceContext->ProcessServed,
+                       sizeof( InstanceContext->ProcessServed ) );
+        InstanceContext->Sweeps += 1;
+
+        ExReleaseFastMutex( &InstanceContext->Lock );
+
+        Wrapped = TRUE;
+    }
+
+    if (Run[0] == NULL) {
+
+        return 0;
+    }
+
+    //
+    //  Take the reads that start where the previous one ends.
+    //
+
+    QueueCtx = (PQUEUE_CONTEXT) Run[0]->QueueContext[0];
+
+    Peek.Mode = CsqPeekContiguous;
+    Peek.Stream = QueueCtx->Stream;
+    Peek.ByteOffset = QueueCtx->ByteOffset + QueueCtx->Length;
+
+    for (Count = 1; Count < CSQ_MAX_RUN_LENGTH; Count++) {
+
+        Run[Count] = FltCbdqRemoveNextIo( &InstanceContext->Cbdq,
+                                          &Peek );
+
+        if (Run[Count] == NULL) {
+
+            break;
+        }
+
+        QueueCtx = (PQUEUE_CONTEXT) Run[Count]->QueueContext[0];
+
+        Peek.ByteOffset = QueueCtx->ByteOffset + QueueCtx->Length;
+    }
+
+    //
+    //  Advance the sweep past the run, unless another worker has already
+    //  gone further, and charge the reads to their processes.
+    //
+
+    Now = KeQueryInterruptTime();
+
+    ExAcquireFastMutex( &InstanceContext->Lock );
+
+    if (Peek.Stream > InstanceContext->SweepStream ||
+        (Peek.Stream == InstanceContext->SweepStream &&
+         Peek.ByteOffset > InstanceContext->SweepOffset)) {
+
+        InstanceContext->SweepStream = Peek.Stream;
+        InstanceContext->SweepOffset = Peek.ByteOffset;
+    }
+
+    for (Index = 0; Index < Count; Index++) {
+
+        QueueCtx = (PQUEUE_CONTEXT) Run[Index]->QueueContext[0];
+
+        InstanceContext->ProcessServed[CsqFairnessSlot( QueueCtx->ProcessId )] += 1;
+
+        Latency = (ULONGLONG) (Now - QueueCtx->InsertTime);
+
+        InstanceContext->TotalLatency += Latency;
+
+        if (Latency > InstanceContext->MaxLatency) {
+
+            InstanceContext->MaxLatency = Latency;
+        }
+    }
+
+    InstanceContext->Dispatched += Count;
+    InstanceContext->Coalesced += Count - 1;
+
+    ExReleaseFastMutex( &InstanceContext->Lock );
+
+    return Count;
+}
+
+
+VOID
+PreReadCompleteIo(
+    _In_ PINSTANCE_CONTEXT InstanceContext,
+    _Inout_ PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    This routine processes a read removed from the queue by a worker and
+    releases it down the stack.
+
+Arguments:
+
+    InstanceContext - Supplies a pointer to the instance context.
+
+    Data - Supplies the callback data that was removed from the queue.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PQUEUE_CONTEXT QueueCtx;
+    NTSTATUS Status;
+    FLT_PREOP_CALLBACK_STATUS callbackStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+    UNREFERENCED_PARAMETER( InstanceContext );
+
+    QueueCtx = (PQUEUE_CONTEXT) Data->QueueContext[0];
+
+    PreReadProcessIo( Data );
+
+    //
+    //  Check to see if we need to lock the user buffer.
+    //
+    //  If the FLTFL_CALLBACK_DATA_SYSTEM_BUFFER flag is set we don't 
+    //  have to lock the buffer because its already a system buffer.
+    //
+    //  If the MdlAddress is NULL and the buffer is a user buffer, 
+    //  then we have to construct one in order to look at the buffer.
+    //
+    //  If the length of the buffer is zero there is nothing to read,
+    //  so we cannot construct a MDL.
+    //
+
+    if (!FlagOn(Data->Flags, FLTFL_CALLBACK_DATA_SYSTEM_BUFFER) && 
+        Data->Iopb->Parameters.Read.MdlAddress == NULL &&
+        Data->Iopb->Parameters.Read.Length > 0) {
+
+        Status = FltLockUserBuffer( Data );
+
+        if (!NT_SUCCESS( Status )) {
+            
             //
-            //  At this moment it is possible that a new IO is being inserted
-            //  into the queue in the CsqInsertIo routine. Now that the queue is
-            //  empty, CsqInsertIo needs to make a decision on whether to create
-            //  a new worker thread. The decision is based on the race between
-            //  the InterlockedIncrement in CsqInsertIo and the
-            //  InterlockedDecrement as below. There are two situations:
-            //
-            //  (1) If the decrement executes earlier before the increment,
-            //      the flag will be decremented to 0 so this worker thread
-            //      will return. Then CsqInsertIo will increment the flag
-            //      from 0 to 1, and therefore create a new worker thread.
-            //  (2) If the increment executes earlier before the decrement,
-            //      the flag will be first incremented to 2 in CsqInsertIo
-            //      so a new worker thread will not be satisfied. Then the
-            //      decrement as below will lower the flag down to 1, and
-            //      therefore continue this worker thread.
+            //  If could not lock the user buffer we cannot
+            //  allow the IO to go below us. Because we are 
+            //  in a different VA space and the buffer is a
+            //  user mode address, we will either fault or 
+            //  corrpt data
             //
+           
+            DebugTrace( CSQ_TRACE_PRE_READ | CSQ_TRACE_ERROR,
+                        ("[Csq]: Failed to lock user buffer (Status = 0x%x)\n",
+                        Status) );
 
-            if (InterlockedDecrement( &InstCtx->WorkerThreadFlag ) == 0) {
-                
-                break;
-            }
-            
+            callbackStatus = FLT_PREOP_COMPLETE;
+            Data->IoStatus.Status = Status;
         }
     }
 
     //
-    //  Clean up
+    //  Complete the I/O
     //
 
-    FltReleaseContext(InstCtx);
+    FltCompletePendedPreOperation( Data,
+                                   callbackStatus,
+                                   NULL );
 
-    FltFreeGenericWorkItem(WorkItem);
+    //
+    //  Free the extra storage that was allocated for this I/O.
+    //
+
+    ExFreeToNPagedLookasideList( &Globals.QueueContextLookaside,
+                                 QueueCtx );
 }
 
 
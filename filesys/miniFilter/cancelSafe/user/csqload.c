@@ -0,0 +1,699 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    csqload.c
+
+Abstract:
+
+    This program generates reads for the cancelSafe filter to queue and
+    measures their latency at a given queue depth.
+
+    Each thread opens the file for unbuffered, overlapped I/O and keeps
+    Depth reads of CSQLOAD_IO_SIZE bytes outstanding on it, issuing a new
+    read as soon as one completes.  The reads of a thread are sequential
+    within a region of the file of its own, or at random offsets with -r,
+    so the filter has both contiguous runs to release together and
+    scattered reads to sort.  With -p the program also starts copies of
+    itself, so that the filter's per-process fairness can be seen in the
+    latency of each process.
+
+    Every process prints the reads per second it completed, the mean number
+    of its reads in flight that gives by Little's law, which is about the
+    depth of the filter's queue while the filter's delay dominates, and the
+    mean, 50th, 99th percentile and maximum latency.  The percentiles are the upper
+    bounds of the log2 buckets they fall in.
+
+    The file must be under the filter's OperatingPath for its reads to be
+    queued.  It is created, or extended, to CSQLOAD_FILE_SIZE bytes.  The
+    filter holds each read for OperatingDelay, so a small OperatingDelay,
+    for example 10000 (1 ms), gives more useful numbers than the default.
+
+    Usage: csqload File [-t Threads] [-d Depth] [-p Processes] [-s Seconds] [-r]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dontuse.h>
+
+#define CSQLOAD_FILE_SIZE               (64 * 1024 * 1024)
+#define CSQLOAD_IO_SIZE                 4096
+#define CSQLOAD_MAX_THREADS             64
+#define CSQLOAD_MAX_DEPTH               64
+#define CSQLOAD_MAX_PROCESSES           16
+
+#define CSQLOAD_DEFAULT_THREADS         1
+#define CSQLOAD_DEFAULT_DEPTH           8
+#define CSQLOAD_DEFAULT_SECONDS         10
+
+//
+//  Latencies are counted in buckets of powers of two microseconds.
+//
+
+#define CSQLOAD_HISTOGRAM_BUCKETS       32
+
+//
+//  Hidden option that tells a copy started with -p not to start more.
+//
+
+#define CSQLOAD_CHILD_OPTION            "-child"
+
+typedef struct _READ_SLOT {
+
+    OVERLAPPED Overlapped;
+    PVOID Buffer;
+    LARGE_INTEGER IssueTime;
+
+} READ_SLOT, *PREAD_SLOT;
+
+typedef struct _WORKER {
+
+    ULONG Index;
+    HANDLE Thread;
+    HANDLE File;
+    HANDLE Port;
+    READ_SLOT Slots[CSQLOAD_MAX_DEPTH];
+    ULONGLONG NextOffset;
+    ULONG Seed;
+
+    LONGLONG Reads;
+    LONGLONG TotalMicroseconds;
+    LONGLONG MaxMicroseconds;
+    LONGLONG Buckets[CSQLOAD_HISTOGRAM_BUCKETS];
+    BOOL Failed;
+
+} WORKER, *PWORKER;
+
+CHAR FilePath[MAX_PATH];
+ULONG ThreadCount = CSQLOAD_DEFAULT_THREADS;
+ULONG Depth = CSQLOAD_DEFAULT_DEPTH;
+ULONG ProcessCount = 1;
+ULONG Seconds = CSQLOAD_DEFAULT_SECONDS;
+BOOL RandomOffsets;
+
+WORKER Workers[CSQLOAD_MAX_THREADS];
+
+volatile LONG StopLoad;
+
+LARGE_INTEGER Frequency;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Generates reads for the cancelSafe filter and measures their latency\n" );
+    printf( "Usage: csqload File [-t Threads] [-d Depth] [-p Processes] [-s Seconds] [-r]\n" );
+    printf( "    File is under the filter's OperatingPath\n" );
+    printf( "    -t  Threads per process (default %u, at most %u)\n", CSQLOAD_DEFAULT_THREADS, CSQLOAD_MAX_THREADS );
+    printf( "    -d  Reads each thread keeps outstanding (default %u, at most %u)\n", CSQLOAD_DEFAULT_DEPTH, CSQLOAD_MAX_DEPTH );
+    printf( "    -p  Processes issuing reads (default 1, at most %u)\n", CSQLOAD_MAX_PROCESSES );
+    printf( "    -s  Length of the run in seconds (default %u)\n", CSQLOAD_DEFAULT_SECONDS );
+    printf( "    -r  Read at random offsets instead of sequentially\n" );
+}
+
+
+ULONGLONG
+NextReadOffset (
+    _Inout_ PWORKER Worker
+    )
+/*++
+
+Routine Description:
+
+    Returns the offset of the next read of a thread.  Sequential reads wrap
+    around in the thread's share of the file.
+
+--*/
+{
+    ULONGLONG regionSize = CSQLOAD_FILE_SIZE / ThreadCount / CSQLOAD_IO_SIZE * CSQLOAD_IO_SIZE;
+    ULONGLONG offset;
+
+    if (RandomOffsets) {
+
+        Worker->Seed = Worker->Seed * 1103515245 + 12345;
+
+        return (ULONGLONG) ((Worker->Seed >> 8) % (CSQLOAD_FILE_SIZE / CSQLOAD_IO_SIZE)) * CSQLOAD_IO_SIZE;
+    }
+
+    offset = regionSize * Worker->Index + Worker->NextOffset;
+
+    Worker->NextOffset += CSQLOAD_IO_SIZE;
+
+    if (Worker->NextOffset + CSQLOAD_IO_SIZE > regionSize) {
+
+        Worker->NextOffset = 0;
+    }
+
+    return offset;
+}
+
+
+BOOL
+IssueRead (
+    _Inout_ PWORKER Worker,
+    _Inout_ PREAD_SLOT Slot
+    )
+{
+    ULONGLONG offset = NextReadOffset( Worker );
+
+    ZeroMemory( &Slot->Overlapped, sizeof( Slot->Overlapped ) );
+    Slot->Overlapped.Offset = (DWORD) offset;
+    Slot->Overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+    QueryPerformanceCounter( &Slot->IssueTime );
+
+    if (!ReadFile( Worker->File, Slot->Buffer, CSQLOAD_IO_SIZE, NULL, &Slot->Overlapped ) &&
+        (GetLastError() != ERROR_IO_PENDING)) {
+
+        printf( "ERROR: Reading %s: %u\n", FilePath, GetLastError() );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+CountRead (
+    _Inout_ PWORKER Worker,
+    _In_ PREAD_SLOT Slot
+    )
+{
+    LARGE_INTEGER now;
+    LONGLONG microseconds;
+    ULONG bucket = 0;
+
+    QueryPerformanceCounter( &now );
+
+    microseconds = (now.QuadPart - Slot->IssueTime.QuadPart) * 1000000 / Frequency.QuadPart;
+
+    while ((bucket < CSQLOAD_HISTOGRAM_BUCKETS - 1) &&
+           (microseconds >= ((LONGLONG) 1 << (bucket + 1)))) {
+
+        bucket += 1;
+    }
+
+    Worker->Reads += 1;
+    Worker->TotalMicroseconds += microseconds;
+    Worker->MaxMicroseconds = max( Worker->MaxMicroseconds, microseconds );
+    Worker->Buckets[bucket] += 1;
+}
+
+
+DWORD
+WINAPI
+WorkerThread (
+    _In_ LPVOID Parameter
+    )
+{
+    PWORKER worker = Parameter;
+    LPOVERLAPPED overlapped;
+    PREAD_SLOT slot;
+    ULONG_PTR key;
+    DWORD bytes;
+    ULONG outstanding = 0;
+    ULONG i;
+
+    for (i = 0; i < Depth; i++) {
+
+        if (!IssueRead( worker, &worker->Slots[i] )) {
+
+            worker->Failed = TRUE;
+            break;
+        }
+
+        outstanding += 1;
+    }
+
+    //
+    //  Reads are reissued until the run ends, then the outstanding ones
+    //  are waited for so that their buffers can be freed.
+    //
+
+    while (outstanding > 0) {
+
+        if (!GetQueuedCompletionStatus( worker->Port, &bytes, &key, &overlapped, INFINITE )) {
+
+            if (overlapped == NULL) {
+
+                printf( "ERROR: Waiting for reads: %u\n", GetLastError() );
+                worker->Failed = TRUE;
+                break;
+            }
+
+            printf( "ERROR: Read failed: %u\n", GetLastError() );
+            worker->Failed = TRUE;
+        }
+
+        slot = CONTAINING_RECORD( overlapped, READ_SLOT, Overlapped );
+        outstanding -= 1;
+
+        CountRead( worker, slot );
+
+        if (!StopLoad && !worker->Failed) {
+
+            if (!IssueRead( worker, slot )) {
+
+                worker->Failed = TRUE;
+                continue;
+            }
+
+            outstanding += 1;
+        }
+    }
+
+    return 0;
+}
+
+
+BOOL
+PrepareFile (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Creates the file, or extends it, to CSQLOAD_FILE_SIZE bytes.
+
+--*/
+{
+    LARGE_INTEGER size;
+    HANDLE file;
+    BOOL result = TRUE;
+
+    file = CreateFileA( FilePath,
+                        GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        NULL,
+                        OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL );
+
+    if (file == INVALID_HANDLE_VALUE) {
+
+        printf( "ERROR: Opening %s: %u\n", FilePath, GetLastError() );
+        return FALSE;
+    }
+
+    if (!GetFileSizeEx( file, &size )) {
+
+        printf( "ERROR: Getting the size of %s: %u\n", FilePath, GetLastError() );
+        result = FALSE;
+
+    } else if (size.QuadPart < CSQLOAD_FILE_SIZE) {
+
+        size.QuadPart = CSQLOAD_FILE_SIZE;
+
+        if (!SetFilePointerEx( file, size, NULL, FILE_BEGIN ) ||
+            !SetEndOfFile( file )) {
+
+            printf( "ERROR: Extending %s: %u\n", FilePath, GetLastError() );
+            result = FALSE;
+        }
+    }
+
+    CloseHandle( file );
+
+    return result;
+}
+
+
+BOOL
+StartChildren (
+    _Out_writes_(ProcessCount - 1) PPROCESS_INFORMATION Children
+    )
+/*++
+
+Routine Description:
+
+    Starts the other processes, with the same options as this one.
+
+--*/
+{
+    CHAR program[MAX_PATH];
+    CHAR commandLine[MAX_PATH * 3];
+    STARTUPINFOA startupInfo;
+    ULONG i;
+
+    if (GetModuleFileNameA( NULL, program, sizeof( program ) ) == 0) {
+
+        printf( "ERROR: Getting the program name: %u\n", GetLastError() );
+        return FALSE;
+    }
+
+    _snprintf_s( commandLine,
+                 sizeof( commandLine ),
+                 _TRUNCATE,
+                 "\"%s\" \"%s\" -t %u -d %u -s %u%s %s",
+                 program,
+                 FilePath,
+                 ThreadCount,
+                 Depth,
+                 Seconds,
+                 RandomOffsets ? " -r" : "",
+                 CSQLOAD_CHILD_OPTION );
+
+    for (i = 0; i < ProcessCount - 1; i++) {
+
+        ZeroMemory( &startupInfo, sizeof( startupInfo ) );
+        startupInfo.cb = sizeof( startupInfo );
+
+        if (!CreateProcessA( NULL,
+                             commandLine,
+                             NULL,
+                             NULL,
+                             TRUE,
+                             0,
+                             NULL,
+                             NULL,
+                             &startupInfo,
+                             &Children[i] )) {
+
+            printf( "ERROR: Starting process %u: %u\n", i + 1, GetLastError() );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+LONGLONG
+Percentile (
+    _In_reads_(CSQLOAD_HISTOGRAM_BUCKETS) LONGLONG *Buckets,
+    _In_ LONGLONG Count,
+    _In_ ULONG Percent
+    )
+{
+    LONGLONG seen = 0;
+    ULONG bucket;
+
+    for (bucket = 0; bucket < CSQLOAD_HISTOGRAM_BUCKETS; bucket++) {
+
+        seen += Buckets[bucket];
+
+        if (seen * 100 >= Count * Percent) {
+
+            break;
+        }
+    }
+
+    return (LONGLONG) 2 << min( bucket, CSQLOAD_HISTOGRAM_BUCKETS - 1 );
+}
+
+
+BOOL
+RunLoad (
+    VOID
+    )
+{
+    LONGLONG buckets[CSQLOAD_HISTOGRAM_BUCKETS];
+    LONGLONG reads = 0;
+    LONGLONG totalMicroseconds = 0;
+    LONGLONG maxMicroseconds = 0;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    double seconds;
+    ULONG prepared;
+    BOOL result = TRUE;
+    ULONG bucket;
+    ULONG i;
+    ULONG j;
+
+    ZeroMemory( buckets, sizeof( buckets ) );
+
+    for (prepared = 0; prepared < ThreadCount; prepared++) {
+
+        Workers[prepared].Index = prepared;
+        Workers[prepared].Seed = GetCurrentProcessId() * CSQLOAD_MAX_THREADS + prepared;
+
+        Workers[prepared].File = CreateFileA( FilePath,
+                                              GENERIC_READ,
+                                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                              NULL,
+                                              OPEN_EXISTING,
+                                              FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING,
+                                              NULL );
+
+        if (Workers[prepared].File == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Opening %s: %u\n", FilePath, GetLastError() );
+            result = FALSE;
+            goto Cleanup;
+        }
+
+        Workers[prepared].Port = CreateIoCompletionPort( Workers[prepared].File, NULL, 0, 1 );
+
+        if (Workers[prepared].Port == NULL) {
+
+            printf( "ERROR: Creating a completion port: %u\n", GetLastError() );
+            prepared += 1;
+            result = FALSE;
+            goto Cleanup;
+        }
+
+        //
+        //  Unbuffered reads need sector aligned buffers, which
+        //  VirtualAlloc gives.
+        //
+
+        for (j = 0; j < Depth; j++) {
+
+            Workers[prepared].Slots[j].Buffer = VirtualAlloc( NULL,
+                                                              CSQLOAD_IO_SIZE,
+                                                              MEM_COMMIT | MEM_RESERVE,
+                                                              PAGE_READWRITE );
+
+            if (Workers[prepared].Slots[j].Buffer == NULL) {
+
+                printf( "ERROR: Allocating a buffer: %u\n", GetLastError() );
+                prepared += 1;
+                result = FALSE;
+                goto Cleanup;
+            }
+        }
+    }
+
+    QueryPerformanceCounter( &start );
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        Workers[i].Thread = CreateThread( NULL, 0, WorkerThread, &Workers[i], 0, NULL );
+
+        if (Workers[i].Thread == NULL) {
+
+            printf( "ERROR: Creating a thread: %u\n", GetLastError() );
+            InterlockedExchange( &StopLoad, 1 );
+            result = FALSE;
+            break;
+        }
+    }
+
+    if (result) {
+
+        Sleep( Seconds * 1000 );
+        InterlockedExchange( &StopLoad, 1 );
+    }
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Thread != NULL) {
+
+            WaitForSingleObject( Workers[i].Thread, INFINITE );
+            CloseHandle( Workers[i].Thread );
+        }
+    }
+
+    QueryPerformanceCounter( &end );
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Failed) {
+
+            result = FALSE;
+        }
+
+        reads += Workers[i].Reads;
+        totalMicroseconds += Workers[i].TotalMicroseconds;
+        maxMicroseconds = max( maxMicroseconds, Workers[i].MaxMicroseconds );
+
+        for (bucket = 0; bucket < CSQLOAD_HISTOGRAM_BUCKETS; bucket++) {
+
+            buckets[bucket] += Workers[i].Buckets[bucket];
+        }
+    }
+
+    if (reads > 0) {
+
+        seconds = (double) (end.QuadPart - start.QuadPart) / Frequency.QuadPart;
+
+        //
+        //  By Little's law the mean number of reads in the filter's queue
+        //  and below it is the rate of reads times their mean latency.
+        //  It is less than Depth times the threads by the time it takes to
+        //  reissue a read.
+        //
+
+        printf( "process %5u %10.0f reads/s %8.1f deep %10.0f us mean %10I64d us p50 %10I64d us p99 %10I64d us max\n",
+                GetCurrentProcessId(),
+                (double) reads / seconds,
+                (double) totalMicroseconds / 1000000.0 / seconds,
+                (double) totalMicroseconds / (double) reads,
+                Percentile( buckets, reads, 50 ),
+                Percentile( buckets, reads, 99 ),
+                maxMicroseconds );
+    }
+
+Cleanup:
+
+    for (i = 0; i < prepared; i++) {
+
+        for (j = 0; j < Depth; j++) {
+
+            if (Workers[i].Slots[j].Buffer != NULL) {
+
+                VirtualFree( Workers[i].Slots[j].Buffer, 0, MEM_RELEASE );
+            }
+        }
+
+        if (Workers[i].Port != NULL) {
+
+            CloseHandle( Workers[i].Port );
+        }
+
+        CloseHandle( Workers[i].File );
+    }
+
+    return result;
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    PROCESS_INFORMATION children[CSQLOAD_MAX_PROCESSES];
+    BOOL child = FALSE;
+    ULONG started = 0;
+    DWORD exitCode;
+    int status = 0;
+    int arg;
+    ULONG i;
+
+    if (argc < 2 ||
+        strcpy_s( FilePath, sizeof( FilePath ), argv[1] ) != 0) {
+
+        Usage();
+        return 1;
+    }
+
+    for (arg = 2; arg < argc; arg++) {
+
+        if ((_stricmp( argv[arg], "-t" ) == 0) && (arg + 1 < argc)) {
+
+            ThreadCount = strtoul( argv[++arg], NULL, 0 );
+
+        } else if ((_stricmp( argv[arg], "-d" ) == 0) && (arg + 1 < argc)) {
+
+            Depth = strtoul( argv[++arg], NULL, 0 );
+
+        } else if ((_stricmp( argv[arg], "-p" ) == 0) && (arg + 1 < argc)) {
+
+            ProcessCount = strtoul( argv[++arg], NULL, 0 );
+
+        } else if ((_stricmp( argv[arg], "-s" ) == 0) && (arg + 1 < argc)) {
+
+            Seconds = strtoul( argv[++arg], NULL, 0 );
+
+        } else if (_stricmp( argv[arg], "-r" ) == 0) {
+
+            RandomOffsets = TRUE;
+
+        } else if (_stricmp( argv[arg], CSQLOAD_CHILD_OPTION ) == 0) {
+
+            child = TRUE;
+
+        } else {
+
+            Usage();
+            return 1;
+        }
+    }
+
+    if ((ThreadCount == 0) || (ThreadCount > CSQLOAD_MAX_THREADS) ||
+        (Depth == 0) || (Depth > CSQLOAD_MAX_DEPTH) ||
+        (ProcessCount == 0) || (ProcessCount > CSQLOAD_MAX_PROCESSES) ||
+        (Seconds == 0)) {
+
+        Usage();
+        return 1;
+    }
+
+    QueryPerformanceFrequency( &Frequency );
+
+    if (!child) {
+
+        if (!PrepareFile()) {
+
+            return 2;
+        }
+
+        printf( "%u processes, %u threads each, %u reads outstanding per thread, %s, %u s\n",
+                ProcessCount,
+                ThreadCount,
+                Depth,
+                RandomOffsets ? "random" : "sequential",
+                Seconds );
+
+        ZeroMemory( children, sizeof( children ) );
+
+        if (ProcessCount > 1) {
+
+            if (!StartChildren( children )) {
+
+                status = 2;
+            }
+
+            for (i = 0; i < ProcessCount - 1; i++) {
+
+                if (children[i].hProcess != NULL) {
+
+                    started += 1;
+                }
+            }
+        }
+    }
+
+    if ((status == 0) && !RunLoad()) {
+
+        status = 3;
+    }
+
+    for (i = 0; i < started; i++) {
+
+        WaitForSingleObject( children[i].hProcess, INFINITE );
+
+        if (GetExitCodeProcess( children[i].hProcess, &exitCode ) && (exitCode != 0)) {
+
+            status = 3;
+        }
+
+        CloseHandle( children[i].hProcess );
+        CloseHandle( children[i].hThread );
+    }
+
+    return status;
+}
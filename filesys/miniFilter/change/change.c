@@ -38,6 +38,12 @@ Abstract:
 
     4. Properly remove the list at TransactionContextCleanup.
 
+    Besides the dirty flags, every file context keeps a map of the blocks
+    written and the generation in which they were written (see dirtymap.c).
+    Transacted writes go to a separate map merged at commit, exactly like
+    TxDirty. CG_FSCTL_QUERY_CHANGED_RANGES returns the ranges written since
+    a generation token, so a backup application can copy only those.
+
 Environment:
 
     Kernel mode
@@ -45,6 +51,34 @@ Environment:
 --*/
 
 #include "change.h"
+
+//
+//  Dirty map globals declared in dirtymap.h
+//
+
+ULONG gDirtyBlockShift = CG_DEFAULT_DIRTY_BLOCK_SHIFT;
+
+volatile LONGLONG gDirtyGeneration = 1;
+
+//
+//  Blocks written, passed from the pre-operation callback of a write to
+//  its post-operation callback so that they can be stamped again once the
+//  write completed.
+//
+
+#define CG_WRITE_COMPLETION_TAG              'cWgC'
+
+typedef struct _CG_WRITE_COMPLETION {
+
+    PCG_FILE_CONTEXT FileContext;
+
+    ULONGLONG StartBlock;
+
+    ULONGLONG EndBlock;
+
+} CG_WRITE_COMPLETION, *PCG_WRITE_COMPLETION;
+
+NPAGED_LOOKASIDE_LIST gWriteCompletionLookaside;
     
 /*************************************************************************
     Local Function Prototypes
@@ -95,6 +129,14 @@ CgPreOperationCallback (
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
+FLT_POSTOP_CALLBACK_STATUS
+CgPostOperationCallback (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
 FLT_PREOP_CALLBACK_STATUS
 CgPreCreate (
     _Inout_ PFLT_CALLBACK_DATA Data,
@@ -140,6 +182,25 @@ CgOperationsNeedDirty (
     _In_ PFLT_CALLBACK_DATA Data
     );
 
+VOID
+CgInitializeDirtyBlockSize (
+    _In_ PUNICODE_STRING RegistryPath
+    );
+
+BOOLEAN
+CgGetDirtyBlockRange (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PFILE_OBJECT FileObject,
+    _Out_ PULONGLONG StartBlock,
+    _Out_ PULONGLONG EndBlock
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+CgQueryChangedRanges (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    );
+
 NTSTATUS
 CgQueryTransactionOutcome(
     _In_ PKTRANSACTION Transaction,
@@ -165,6 +226,7 @@ CgProcessTransactionOutcome(
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(INIT, CgInitializeDirtyBlockSize)
 #pragma alloc_text(PAGE, CgUnload)
 #pragma alloc_text(PAGE, CgInstanceQueryTeardown)
 #pragma alloc_text(PAGE, CgInstanceSetup)
@@ -173,6 +235,7 @@ CgProcessTransactionOutcome(
 #pragma alloc_text(PAGE, CgInstanceTeardownComplete)
 #pragma alloc_text(PAGE, CgPreCreate)
 #pragma alloc_text(PAGE, CgPreFsControl)
+#pragma alloc_text(PAGE, CgQueryChangedRanges)
 #pragma alloc_text(PAGE, CgPostCreate)
 #pragma alloc_text(PAGE, CgPreClose)
 #pragma alloc_text(PAGE, CgKtmNotificationCallback)
@@ -200,17 +263,17 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_WRITE,
       0,
       CgPreOperationCallback,
-      NULL },
+      CgPostOperationCallback },
       
     { IRP_MJ_SET_INFORMATION,
       0,
       CgPreOperationCallback,
-      NULL },
+      CgPostOperationCallback },
 
     { IRP_MJ_FILE_SYSTEM_CONTROL,
       0,
       CgPreFsControl,
-      NULL },
+      CgPostOperationCallback },
 
     { IRP_MJ_OPERATION_END }
 };
@@ -437,11 +500,19 @@ Return Value:
 {
     NTSTATUS status;
 
-    UNREFERENCED_PARAMETER( RegistryPath );
-
     CG_DBG_PRINT( CGDBG_TRACE_ROUTINES,
                   ("[CG] DriverEntry: Entered\n") );
 
+    CgInitializeDirtyBlockSize( RegistryPath );
+
+    ExInitializeNPagedLookasideList( &gWriteCompletionLookaside,
+                                     NULL,
+                                     NULL,
+                                     POOL_NX_ALLOCATION,
+                                     sizeof( CG_WRITE_COMPLETION ),
+                                     CG_WRITE_COMPLETION_TAG,
+                                     0 );
+
     //
     //  Register with FltMgr to tell it our callback routines
     //
@@ -464,6 +535,11 @@ Return Value:
         }
     }
 
+    if (!NT_SUCCESS( status )) {
+
+        ExDeleteNPagedLookasideList( &gWriteCompletionLookaside );
+    }
+
     return status;
 }
 
@@ -501,6 +577,8 @@ Return Value:
     FltUnregisterFilter( gFilterInstance );
     gFilterInstance = NULL;
 
+    ExDeleteNPagedLookasideList( &gWriteCompletionLookaside );
+
     return STATUS_SUCCESS;
 }
 
@@ -569,6 +647,286 @@ Return Value:
     return FALSE;
 }
 
+VOID
+CgInitializeDirtyBlockSize (
+    _In_ PUNICODE_STRING RegistryPath
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the DirtyBlockSize parameter, the granularity in
+    bytes at which written ranges are tracked, from the registry. It must
+    be a power of two between 4KB and 1GB; otherwise the default of 64KB
+    is used.
+
+Arguments:
+
+    RegistryPath - The path key passed to the driver during DriverEntry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    OBJECT_ATTRIBUTES attributes;
+    HANDLE driverRegKey;
+    NTSTATUS status;
+    ULONG resultLength;
+    ULONG blockSize;
+    ULONG shift;
+    UNICODE_STRING valueName;
+    UCHAR buffer[sizeof( KEY_VALUE_PARTIAL_INFORMATION ) + sizeof( ULONG )];
+    PKEY_VALUE_PARTIAL_INFORMATION value = (PKEY_VALUE_PARTIAL_INFORMATION) buffer;
+
+    gDirtyBlockShift = CG_DEFAULT_DIRTY_BLOCK_SHIFT;
+
+    InitializeObjectAttributes( &attributes,
+                                RegistryPath,
+                                OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                                NULL,
+                                NULL );
+
+    status = ZwOpenKey( &driverRegKey,
+                        KEY_READ,
+                        &attributes );
+
+    if (!NT_SUCCESS( status )) {
+
+        return;
+    }
+
+    RtlInitUnicodeString( &valueName, L"DirtyBlockSize" );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              buffer,
+                              sizeof(buffer),
+                              &resultLength );
+
+    if (NT_SUCCESS( status ) &&
+        (value->Type == REG_DWORD) &&
+        (value->DataLength == sizeof( ULONG ))) {
+
+        blockSize = *((PULONG) value->Data);
+
+        for (shift = CG_MIN_DIRTY_BLOCK_SHIFT; shift <= CG_MAX_DIRTY_BLOCK_SHIFT; shift++) {
+
+            if (blockSize == (1UL << shift)) {
+
+                gDirtyBlockShift = shift;
+                break;
+            }
+        }
+
+        if (shift > CG_MAX_DIRTY_BLOCK_SHIFT) {
+
+            CG_DBG_PRINT( CGDBG_TRACE_ERROR,
+                          ("[CG] CgInitializeDirtyBlockSize: Ignoring invalid block size %lu\n",
+                           blockSize) );
+        }
+    }
+
+    ZwClose( driverRegKey );
+}
+
+BOOLEAN
+CgGetDirtyBlockRange (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PFILE_OBJECT FileObject,
+    _Out_ PULONGLONG StartBlock,
+    _Out_ PULONGLONG EndBlock
+    )
+/*++
+
+Routine Description:
+
+    This routine computes the blocks an operation selected by
+    CgOperationsNeedDirty may modify. If the range cannot be determined
+    the whole file is returned.
+
+    This is non-pageable because it could be called on the paging path
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FileObject - The target file object.
+
+    StartBlock - Receives the first block modified.
+
+    EndBlock - Receives one past the last block modified.
+
+Return Value:
+
+    FALSE if the operation modifies no data, or its parameters are
+    invalid so the file system will fail it.
+
+--*/
+{
+    PFLT_IO_PARAMETER_BLOCK iopb = Data->Iopb;
+    PFSRTL_COMMON_FCB_HEADER header = FileObject->FsContext;
+    ULONGLONG endBlock = CgDirtyEndBlock();
+    ULONGLONG offset = 0;
+    ULONGLONG end = (ULONGLONG) MAXLONGLONG;
+    LARGE_INTEGER byteOffset;
+    PVOID buffer;
+    ULONG length;
+
+    switch (iopb->MajorFunction) {
+
+        case IRP_MJ_WRITE:
+
+            byteOffset = iopb->Parameters.Write.ByteOffset;
+            length = iopb->Parameters.Write.Length;
+
+            if (length == 0) {
+
+                return FALSE;
+            }
+
+            if (byteOffset.HighPart == -1 &&
+                byteOffset.LowPart == FILE_USE_FILE_POINTER_POSITION) {
+
+                byteOffset = FileObject->CurrentByteOffset;
+
+            } else if (byteOffset.HighPart == -1 &&
+                       byteOffset.LowPart == FILE_WRITE_TO_END_OF_FILE) {
+
+                if (header == NULL) {
+
+                    break;
+                }
+
+                byteOffset = header->FileSize;
+            }
+
+            if (byteOffset.QuadPart < 0) {
+
+                break;
+            }
+
+            offset = byteOffset.QuadPart;
+            end = Min( offset + length, (ULONGLONG) MAXLONGLONG );
+            break;
+
+        case IRP_MJ_SET_INFORMATION:
+
+            if (iopb->Parameters.SetFileInformation.FileInformationClass != FileEndOfFileInformation) {
+
+                //
+                //  Valid data length changes expose whatever is on disk
+                //  beyond the old valid data length.
+                //
+
+                break;
+            }
+
+            //
+            //  The lazy writer advancing the on-disk size changes no data.
+            //
+
+            if (iopb->Parameters.SetFileInformation.AdvanceOnly) {
+
+                return FALSE;
+            }
+
+            if (iopb->Parameters.SetFileInformation.Length < sizeof( FILE_END_OF_FILE_INFORMATION )) {
+
+                return FALSE;
+            }
+
+            byteOffset = ((PFILE_END_OF_FILE_INFORMATION) iopb->Parameters.SetFileInformation.InfoBuffer)->EndOfFile;
+
+            if (byteOffset.QuadPart < 0) {
+
+                return FALSE;
+            }
+
+            //
+            //  Truncating drops the blocks past the new end, extending adds
+            //  zeroed blocks. Either way everything between the old and the
+            //  new end changes.
+            //
+
+            if (header != NULL) {
+
+                offset = Min( byteOffset.QuadPart, header->FileSize.QuadPart );
+                end = Max( byteOffset.QuadPart, header->FileSize.QuadPart );
+
+                if (offset == end) {
+
+                    return FALSE;
+                }
+            }
+
+            break;
+
+        case IRP_MJ_FILE_SYSTEM_CONTROL:
+
+            buffer = iopb->Parameters.FileSystemControl.Buffered.SystemBuffer;
+            length = iopb->Parameters.FileSystemControl.Buffered.InputBufferLength;
+
+            switch (iopb->Parameters.FileSystemControl.Common.FsControlCode) {
+
+                case FSCTL_SET_ZERO_DATA:
+
+                    if (buffer == NULL || length < sizeof( FILE_ZERO_DATA_INFORMATION )) {
+
+                        return FALSE;
+                    }
+
+                    if (((PFILE_ZERO_DATA_INFORMATION) buffer)->FileOffset.QuadPart < 0 ||
+                        ((PFILE_ZERO_DATA_INFORMATION) buffer)->BeyondFinalZero.QuadPart <=
+                        ((PFILE_ZERO_DATA_INFORMATION) buffer)->FileOffset.QuadPart) {
+
+                        return FALSE;
+                    }
+
+                    offset = ((PFILE_ZERO_DATA_INFORMATION) buffer)->FileOffset.QuadPart;
+                    end = ((PFILE_ZERO_DATA_INFORMATION) buffer)->BeyondFinalZero.QuadPart;
+                    break;
+
+                case FSCTL_OFFLOAD_WRITE:
+
+                    if (buffer == NULL || length < sizeof( FSCTL_OFFLOAD_WRITE_INPUT )) {
+
+                        return FALSE;
+                    }
+
+                    if (((PFSCTL_OFFLOAD_WRITE_INPUT) buffer)->FileOffset > (ULONGLONG) MAXLONGLONG ||
+                        ((PFSCTL_OFFLOAD_WRITE_INPUT) buffer)->CopyLength == 0) {
+
+                        return FALSE;
+                    }
+
+                    offset = ((PFSCTL_OFFLOAD_WRITE_INPUT) buffer)->FileOffset;
+                    end = Min( ((PFSCTL_OFFLOAD_WRITE_INPUT) buffer)->CopyLength, (ULONGLONG) MAXLONGLONG - offset ) + offset;
+                    break;
+
+                default:
+
+                    //
+                    //  Raw encrypted writes may rewrite any part of the file.
+                    //
+
+                    break;
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    *StartBlock = offset >> gDirtyBlockShift;
+    *EndBlock = Min( (end + (1ULL << gDirtyBlockShift) - 1) >> gDirtyBlockShift, endBlock );
+
+    return TRUE;
+}
+
 NTSTATUS
 CgQueryTransactionOutcome(
     _In_ PKTRANSACTION Transaction,
@@ -640,6 +998,7 @@ CgPropagateDirty(
     _In_ ULONG TransactionOutcome
     )
 {
+    KIRQL oldIrql;
     
     if (TransactionOutcome == TransactionOutcomeCommitted) {
 
@@ -663,6 +1022,26 @@ CgPropagateDirty(
     //
     
     FileContext->TxDirty = FALSE;
+
+    //
+    //  The blocks written in the transaction become visible to queries in
+    //  the generation in which it committed. On rollback they are dropped.
+    //
+
+    KeAcquireSpinLock( &FileContext->DirtyMapLock, &oldIrql );
+
+    if (TransactionOutcome == TransactionOutcomeCommitted) {
+
+        CgDirtyMapMerge( &FileContext->DirtyMap,
+                         &FileContext->TxDirtyMap,
+                         CgCurrentGeneration() );
+
+    } else {
+
+        CgFreeDirtyMap( &FileContext->TxDirtyMap );
+    }
+
+    KeReleaseSpinLock( &FileContext->DirtyMapLock, oldIrql );
 }
 
 NTSTATUS
@@ -988,9 +1367,11 @@ Return Value:
 {
     NTSTATUS status;
     PCG_FILE_CONTEXT fileContext = NULL;
+    ULONGLONG startBlock;
+    ULONGLONG endBlock;
+    KIRQL oldIrql;
+    PCG_WRITE_COMPLETION writeCompletion;
     
-    UNREFERENCED_PARAMETER( CompletionContext );
-
     CG_DBG_PRINT( CGDBG_TRACE_ROUTINES,
                   ("[CG] CgPreOperationCallback: Entered\n") );
 
@@ -1049,12 +1430,133 @@ Return Value:
         
         fileContext->Dirty = TRUE;
     }
+
+    //
+    //  Record the blocks written, so that a query made while the write is
+    //  in flight reports them.
+    //
+
+    if (!CgGetDirtyBlockRange( Data, FltObjects->FileObject, &startBlock, &endBlock )) {
+
+        FltReleaseContext( fileContext );
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    KeAcquireSpinLock( &fileContext->DirtyMapLock, &oldIrql );
+
+    CgDirtyMapMarkRange( (fileContext->TxContext != NULL) ?
+                            &fileContext->TxDirtyMap :
+                            &fileContext->DirtyMap,
+                         startBlock,
+                         endBlock,
+                         CgCurrentGeneration() );
+
+    KeReleaseSpinLock( &fileContext->DirtyMapLock, oldIrql );
+
+    //
+    //  That query hands out a newer token, and the data may only reach the
+    //  file after the backup application has read the range, so the blocks
+    //  are stamped again in the post-operation callback. Transacted writes
+    //  need not be: they are stamped with the current generation when the
+    //  transaction commits.
+    //
+
+    if (fileContext->TxContext == NULL) {
+
+        writeCompletion = ExAllocateFromNPagedLookasideList( &gWriteCompletionLookaside );
+
+        if (writeCompletion != NULL) {
+
+            //
+            //  The post-operation callback releases the file context.
+            //
+
+            writeCompletion->FileContext = fileContext;
+            writeCompletion->StartBlock = startBlock;
+            writeCompletion->EndBlock = endBlock;
+
+            *CompletionContext = writeCompletion;
+
+            return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+        }
+
+        CG_DBG_PRINT( CGDBG_TRACE_ERROR,
+                      ("[CG] CgPreOperationCallback: no completion context, blocks stamped before the write only. rq: %d\n",
+                        Data->Iopb->MajorFunction) );
+    }
     
     FltReleaseContext( fileContext );
 
     return FLT_PREOP_SUCCESS_NO_CALLBACK;
 }
 
+FLT_POSTOP_CALLBACK_STATUS
+CgPostOperationCallback (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    This routine is the post-operation completion routine of the operations
+    that have potential to make the file dirty. It stamps the blocks written
+    with the current generation, so that a query which ran while the write
+    was in flight does not hand out a token newer than the write.
+
+    This is non-pageable because it could be called at DPC level
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    CompletionContext - The CG_WRITE_COMPLETION allocated by the
+        pre-operation callback.
+
+    Flags - Denotes whether the completion is successful or is being drained.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING
+
+--*/
+{
+    PCG_WRITE_COMPLETION writeCompletion = CompletionContext;
+    PCG_FILE_CONTEXT fileContext;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER( FltObjects );
+
+    FLT_ASSERT( writeCompletion != NULL );
+
+    fileContext = writeCompletion->FileContext;
+
+    if (!FlagOn( Flags, FLTFL_POST_OPERATION_DRAINING ) &&
+        NT_SUCCESS( Data->IoStatus.Status )) {
+
+        KeAcquireSpinLock( &fileContext->DirtyMapLock, &oldIrql );
+
+        CgDirtyMapMarkRange( &fileContext->DirtyMap,
+                             writeCompletion->StartBlock,
+                             writeCompletion->EndBlock,
+                             CgCurrentGeneration() );
+
+        KeReleaseSpinLock( &fileContext->DirtyMapLock, oldIrql );
+    }
+
+    FltReleaseContext( fileContext );
+
+    ExFreeToNPagedLookasideList( &gWriteCompletionLookaside, writeCompletion );
+
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
 FLT_PREOP_CALLBACK_STATUS
 CgPreFsControl (
     _Inout_ PFLT_CALLBACK_DATA Data,
@@ -1066,7 +1568,8 @@ CgPreFsControl (
 Routine Description:
 
     Pre-file system control callback. This filter example does not support save point feature.
-    So, we explicitly fail the request here.
+    So, we explicitly fail the request here. Queries for changed ranges are
+    completed here too.
 
 Arguments:
 
@@ -1097,9 +1600,157 @@ Return Value:
         Data->IoStatus.Status = STATUS_NOT_SUPPORTED;
         return FLT_PREOP_COMPLETE;
     }
+
+    if (Data->Iopb->Parameters.FileSystemControl.Common.FsControlCode == CG_FSCTL_QUERY_CHANGED_RANGES) {
+
+        return CgQueryChangedRanges( Data, FltObjects );
+    }
+
     return CgPreOperationCallback(Data, FltObjects, CompletionContext);
 }
 
+FLT_PREOP_CALLBACK_STATUS
+CgQueryChangedRanges (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    )
+/*++
+
+Routine Description:
+
+    This routine handles CG_FSCTL_QUERY_CHANGED_RANGES. It returns the
+    ranges of the file written since the generation passed in, and a new
+    generation for the next query. A generation newer than any handed out
+    is rejected.
+
+    The whole file is reported as changed if the generation is zero, or
+    older than the file context, since writes made before the context
+    existed were not tracked.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData that is passed to us.
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+Return Value:
+
+    FLT_PREOP_COMPLETE
+
+--*/
+{
+    NTSTATUS status;
+    PCG_FILE_CONTEXT fileContext = NULL;
+    CG_QUERY_CHANGED_RANGES_INPUT input;
+    PCG_CHANGED_RANGES_OUTPUT output;
+    ULONG outputLength;
+    ULONG maxRanges;
+    BOOLEAN more = FALSE;
+    KIRQL oldIrql;
+
+    PAGED_CODE();
+
+    //
+    //  The control code is METHOD_BUFFERED, so input and output share
+    //  the system buffer. Capture the input before writing the output.
+    //
+
+    output = Data->Iopb->Parameters.FileSystemControl.Buffered.SystemBuffer;
+    outputLength = Data->Iopb->Parameters.FileSystemControl.Buffered.OutputBufferLength;
+
+    if (Data->Iopb->Parameters.FileSystemControl.Buffered.InputBufferLength < sizeof( input )) {
+
+        Data->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        Data->IoStatus.Information = 0;
+        return FLT_PREOP_COMPLETE;
+    }
+
+    if (outputLength < FIELD_OFFSET( CG_CHANGED_RANGES_OUTPUT, Ranges )) {
+
+        Data->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        Data->IoStatus.Information = 0;
+        return FLT_PREOP_COMPLETE;
+    }
+
+    RtlCopyMemory( &input, output, sizeof( input ) );
+
+    //
+    //  A token newer than the current generation was never handed out.
+    //  Fail rather than report no changes, which would make the caller
+    //  skip the file.
+    //
+
+    if (input.Generation > CgCurrentGeneration()) {
+
+        Data->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        Data->IoStatus.Information = 0;
+        return FLT_PREOP_COMPLETE;
+    }
+
+    RtlZeroMemory( output, FIELD_OFFSET( CG_CHANGED_RANGES_OUTPUT, Ranges ) );
+
+    maxRanges = (outputLength - FIELD_OFFSET( CG_CHANGED_RANGES_OUTPUT, Ranges )) / sizeof( CG_CHANGED_RANGE );
+
+    output->BlockSize = 1UL << gDirtyBlockShift;
+
+    status = FltGetFileContext( FltObjects->Instance,
+                                FltObjects->FileObject,
+                                &fileContext );
+
+    if (!NT_SUCCESS( status )) {
+
+        output->Generation = InterlockedIncrement64( &gDirtyGeneration );
+        output->Flags = CG_CHANGED_RANGES_F_ALL;
+
+    } else {
+
+        //
+        //  Advance the generation under the lock, so that every write to
+        //  this file is either in the ranges returned or newer than the
+        //  token returned.
+        //
+
+        KeAcquireSpinLock( &fileContext->DirtyMapLock, &oldIrql );
+
+        output->Generation = InterlockedIncrement64( &gDirtyGeneration );
+
+        if (input.Generation <= fileContext->BaseGeneration) {
+
+            output->Flags = CG_CHANGED_RANGES_F_ALL;
+
+        } else {
+
+            output->RangeCount = CgDirtyMapQuery( &fileContext->DirtyMap,
+                                                  input.Generation,
+                                                  input.StartingOffset >> gDirtyBlockShift,
+                                                  output->Ranges,
+                                                  maxRanges,
+                                                  &more );
+        }
+
+        KeReleaseSpinLock( &fileContext->DirtyMapLock, oldIrql );
+
+        FltReleaseContext( fileContext );
+    }
+
+    if (more) {
+
+        SetFlag( output->Flags, CG_CHANGED_RANGES_F_MORE );
+        Data->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+
+    } else {
+
+        Data->IoStatus.Status = STATUS_SUCCESS;
+    }
+
+    Data->IoStatus.Information = FIELD_OFFSET( CG_CHANGED_RANGES_OUTPUT, Ranges ) +
+                                 output->RangeCount * sizeof( CG_CHANGED_RANGE );
+
+    return FLT_PREOP_COMPLETE;
+}
+
 
 FLT_PREOP_CALLBACK_STATUS
 CgPreCreate (
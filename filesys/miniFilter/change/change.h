@@ -24,6 +24,8 @@ Environment:
 
 #include <fltKernel.h>
 #include <suppress.h>
+#include "changeuk.h"
+#include "dirtymap.h"
 #include "context.h"
 #include "utility.h"
 
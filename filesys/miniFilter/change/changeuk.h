@@ -0,0 +1,107 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All Rights Reserved
+
+Module Name:
+
+    changeuk.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    and constants that are shared between kernel mode and user mode.
+    Used by applications that query the ranges of a file that have
+    changed, such as backup agents.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef __CHANGEUK_H__
+#define __CHANGEUK_H__
+
+//
+//  File system control handled by the change filter. It is sent on a
+//  handle to the file of interest and returns the ranges of the file that
+//  were modified since a generation token returned by an earlier query.
+//
+//  Input:  CG_QUERY_CHANGED_RANGES_INPUT
+//  Output: CG_CHANGED_RANGES_OUTPUT
+//
+//  Every query returns a new generation token. Pass it to the next query
+//  to get only the ranges modified after this one. If the output buffer
+//  is too small the query fails with STATUS_BUFFER_OVERFLOW, sets
+//  CG_CHANGED_RANGES_F_MORE and returns as many ranges as fit; repeat the
+//  query with the same Generation and StartingOffset set to the end of the
+//  last range returned, and keep the token returned by the first call.
+//
+
+#define CG_FSCTL_QUERY_CHANGED_RANGES   CTL_CODE( FILE_DEVICE_FILE_SYSTEM, 0xC47, METHOD_BUFFERED, FILE_READ_DATA )
+
+typedef struct _CG_QUERY_CHANGED_RANGES_INPUT {
+
+    //
+    //  Token returned by a previous query, or zero to get the whole file.
+    //  A token that was never returned fails with STATUS_INVALID_PARAMETER.
+    //
+
+    LONGLONG Generation;
+
+    //
+    //  Offset at which to start returning ranges.
+    //
+
+    ULONGLONG StartingOffset;
+
+} CG_QUERY_CHANGED_RANGES_INPUT, *PCG_QUERY_CHANGED_RANGES_INPUT;
+
+typedef struct _CG_CHANGED_RANGE {
+
+    ULONGLONG Offset;
+    ULONGLONG Length;
+
+} CG_CHANGED_RANGE, *PCG_CHANGED_RANGE;
+
+//
+//  The changes since Generation are not known, for example because the
+//  filter was not tracking the file at the time. The whole file must be
+//  treated as changed.
+//
+
+#define CG_CHANGED_RANGES_F_ALL         0x00000001
+
+//
+//  Not all ranges fit in the output buffer.
+//
+
+#define CG_CHANGED_RANGES_F_MORE        0x00000002
+
+typedef struct _CG_CHANGED_RANGES_OUTPUT {
+
+    //
+    //  Token to pass to the next query.
+    //
+
+    LONGLONG Generation;
+
+    //
+    //  Granularity at which changes are tracked. Ranges are aligned to it,
+    //  except that the last range may extend to the largest possible offset.
+    //
+
+    ULONG BlockSize;
+
+    ULONG Flags;
+
+    ULONG RangeCount;
+
+    ULONG Reserved;
+
+    CG_CHANGED_RANGE Ranges[1];
+
+} CG_CHANGED_RANGES_OUTPUT, *PCG_CHANGED_RANGES_OUTPUT;
+
+#endif
+
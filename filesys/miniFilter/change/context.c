@@ -112,6 +112,9 @@ Return Value:
                  fileContext,
                  fileContext->Dirty) );
 
+    CgFreeDirtyMap( &fileContext->DirtyMap );
+    CgFreeDirtyMap( &fileContext->TxDirtyMap );
+
     CG_DBG_PRINT( CGDBG_TRACE_ROUTINES,
                 ("[CG]: File context cleanup complete.\n") );
 
@@ -448,10 +451,15 @@ Return Value:
     CG_DBG_PRINT( CGDBG_TRACE_ROUTINES,
                 ("[CG]: Allocating file context \n") );
 
+    //
+    //  The context is non-paged because its dirty maps are updated under
+    //  a spin lock.
+    //
+
     status = FltAllocateContext( gFilterInstance,
                                  FLT_FILE_CONTEXT,
                                  CG_FILE_CONTEXT_SIZE,
-                                 PagedPool,
+                                 NonPagedPoolNx,
                                  &fileContext );
 
     if (!NT_SUCCESS( status )) {
@@ -467,6 +475,8 @@ Return Value:
     //
     
     RtlZeroMemory(fileContext, CG_FILE_CONTEXT_SIZE);
+    KeInitializeSpinLock( &fileContext->DirtyMapLock );
+    fileContext->BaseGeneration = CgCurrentGeneration();
     *FileContext = fileContext;
 
     return STATUS_SUCCESS;
@@ -112,6 +112,30 @@ typedef struct _CG_FILE_CONTEXT {
     //
     
     BOOLEAN     TxDirty;
+
+    //
+    //  Generation current when the context was created. Changes made
+    //  before it are not known.
+    //
+
+    LONGLONG    BaseGeneration;
+
+    //
+    //  Blocks written outside of a transaction, and blocks written in
+    //  the transaction the file is enlisted in. The latter are merged
+    //  into the former when the transaction commits.
+    //
+
+    CG_DIRTY_MAP    DirtyMap;
+
+    CG_DIRTY_MAP    TxDirtyMap;
+
+    //
+    //  Lock protecting both maps. It is a spin lock because writes can
+    //  arrive on the paging path.
+    //
+
+    KSPIN_LOCK  DirtyMapLock;
     
     //
     //  A pointer to the transaction context, so we can jump to list in the transaction.
@@ -0,0 +1,515 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All Rights Reserved
+
+Module Name:
+
+    dirtymap.c
+
+Abstract:
+
+    Dirty extent map implementation.
+
+    A map is a sorted array of runs of dirty blocks, each tagged with the
+    generation in which it was last written. Writing a range replaces the
+    parts of older runs it overlaps, so a query for the ranges changed
+    since a generation returns exactly the blocks written since then.
+
+    The routines here do no synchronization. The caller protects the map
+    with the spin lock of the file context, so they are non-pageable and
+    allocate from non-paged pool.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "change.h"
+
+//
+//  Local function prototypes.
+//
+
+BOOLEAN
+CgDirtyMapReserve (
+    _Inout_ PCG_DIRTY_MAP Map
+    );
+
+VOID
+CgDirtyMapMergeClosestRuns (
+    _Inout_ PCG_DIRTY_MAP Map
+    );
+
+VOID
+CgDirtyMapRemoveRuns (
+    _Inout_ PCG_DIRTY_MAP Map,
+    _In_ ULONG Index,
+    _In_ ULONG Count
+    );
+
+
+VOID
+CgFreeDirtyMap (
+    _Inout_ PCG_DIRTY_MAP Map
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the runs of a map and leaves it empty.
+
+Arguments:
+
+    Map - The map to empty.
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (Map->Runs != NULL) {
+
+        ExFreePoolWithTag( Map->Runs, CG_DIRTY_MAP_TAG );
+    }
+
+    RtlZeroMemory( Map, sizeof( CG_DIRTY_MAP ) );
+}
+
+BOOLEAN
+CgDirtyMapReserve (
+    _Inout_ PCG_DIRTY_MAP Map
+    )
+/*++
+
+Routine Description:
+
+    This routine makes room for two more runs in a map, which is the most
+    a single insertion can add. The array is grown up to
+    CG_DIRTY_MAP_MAX_RUNS, after that runs are merged.
+
+Arguments:
+
+    Map - The map.
+
+Return Value:
+
+    FALSE if the map has no array and one could not be allocated.
+
+--*/
+{
+    PCG_DIRTY_RUN runs;
+    ULONG capacity;
+
+    if (Map->RunCount + 2 <= Map->RunCapacity) {
+
+        return TRUE;
+    }
+
+    if (Map->RunCapacity < CG_DIRTY_MAP_MAX_RUNS) {
+
+        capacity = Max( Map->RunCapacity * 2, CG_DIRTY_MAP_INITIAL_RUNS );
+        capacity = Min( capacity, CG_DIRTY_MAP_MAX_RUNS );
+
+        runs = ExAllocatePoolWithTag( NonPagedPoolNx,
+                                      capacity * sizeof( CG_DIRTY_RUN ),
+                                      CG_DIRTY_MAP_TAG );
+
+        if (runs != NULL) {
+
+            if (Map->Runs != NULL) {
+
+                RtlCopyMemory( runs, Map->Runs, Map->RunCount * sizeof( CG_DIRTY_RUN ) );
+                ExFreePoolWithTag( Map->Runs, CG_DIRTY_MAP_TAG );
+            }
+
+            Map->Runs = runs;
+            Map->RunCapacity = capacity;
+
+            return TRUE;
+        }
+
+        if (Map->Runs == NULL) {
+
+            return FALSE;
+        }
+    }
+
+    //
+    //  The map cannot grow. Give up precision instead.
+    //
+
+    while (Map->RunCount + 2 > Map->RunCapacity) {
+
+        CgDirtyMapMergeClosestRuns( Map );
+    }
+
+    return TRUE;
+}
+
+VOID
+CgDirtyMapMergeClosestRuns (
+    _Inout_ PCG_DIRTY_MAP Map
+    )
+/*++
+
+Routine Description:
+
+    This routine merges the two runs with the smallest gap between them.
+    The merged run covers the gap and takes the newer generation, so it
+    includes every block either run included.
+
+Arguments:
+
+    Map - The map. It must have at least two runs.
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONGLONG gap;
+    ULONGLONG smallestGap = MAXULONGLONG;
+    ULONG closest = 0;
+    ULONG i;
+
+    FLT_ASSERT( Map->RunCount >= 2 );
+
+    for (i = 0; i + 1 < Map->RunCount; i++) {
+
+        gap = Map->Runs[i + 1].StartBlock - Map->Runs[i].EndBlock;
+
+        if (gap < smallestGap) {
+
+            smallestGap = gap;
+            closest = i;
+        }
+    }
+
+    Map->Runs[closest].EndBlock = Map->Runs[closest + 1].EndBlock;
+    Map->Runs[closest].Generation = Max( Map->Runs[closest].Generation,
+                                         Map->Runs[closest + 1].Generation );
+
+    CgDirtyMapRemoveRuns( Map, closest + 1, 1 );
+}
+
+VOID
+CgDirtyMapRemoveRuns (
+    _Inout_ PCG_DIRTY_MAP Map,
+    _In_ ULONG Index,
+    _In_ ULONG Count
+    )
+{
+    RtlMoveMemory( &Map->Runs[Index],
+                   &Map->Runs[Index + Count],
+                   (Map->RunCount - Index - Count) * sizeof( CG_DIRTY_RUN ) );
+
+    Map->RunCount -= Count;
+}
+
+VOID
+CgDirtyMapMarkRange (
+    _Inout_ PCG_DIRTY_MAP Map,
+    _In_ ULONGLONG StartBlock,
+    _In_ ULONGLONG EndBlock,
+    _In_ LONGLONG Generation
+    )
+/*++
+
+Routine Description:
+
+    This routine marks blocks [StartBlock, EndBlock) dirty in Generation.
+
+Arguments:
+
+    Map - The map.
+
+    StartBlock - The first block written.
+
+    EndBlock - One past the last block written.
+
+    Generation - The current generation. It must not be older than the
+        generation of any run in the map.
+
+Return Value:
+
+    None
+
+--*/
+{
+    CG_DIRTY_RUN left;
+    CG_DIRTY_RUN right;
+    BOOLEAN hasLeft = FALSE;
+    BOOLEAN hasRight = FALSE;
+    ULONG first;
+    ULONG last;
+    ULONG low;
+    ULONG high;
+    ULONG pieces;
+    ULONG position;
+
+    if (StartBlock >= EndBlock) {
+
+        return;
+    }
+
+    if (Map->AllDirtyGeneration != 0) {
+
+        Map->AllDirtyGeneration = Generation;
+        return;
+    }
+
+    if (!CgDirtyMapReserve( Map )) {
+
+        //
+        //  Without memory to record the range mark the whole file.
+        //
+
+        Map->AllDirtyGeneration = Generation;
+        return;
+    }
+
+    //
+    //  Find the first run that ends after the range starts.
+    //
+
+    low = 0;
+    high = Map->RunCount;
+
+    while (low < high) {
+
+        ULONG middle = low + (high - low) / 2;
+
+        if (Map->Runs[middle].EndBlock > StartBlock) {
+
+            high = middle;
+
+        } else {
+
+            low = middle + 1;
+        }
+    }
+
+    first = low;
+
+    //
+    //  Runs [first, last) overlap the range. Keep the parts that stick out
+    //  on either side with their own generation.
+    //
+
+    for (last = first;
+         last < Map->RunCount && Map->Runs[last].StartBlock < EndBlock;
+         last++) {
+
+        NOTHING;
+    }
+
+    if (last > first) {
+
+        if (Map->Runs[first].StartBlock < StartBlock) {
+
+            left = Map->Runs[first];
+            left.EndBlock = StartBlock;
+            hasLeft = TRUE;
+        }
+
+        if (Map->Runs[last - 1].EndBlock > EndBlock) {
+
+            right = Map->Runs[last - 1];
+            right.StartBlock = EndBlock;
+            hasRight = TRUE;
+        }
+    }
+
+    //
+    //  Replace the overlapping runs with the pieces.
+    //
+
+    pieces = 1 + (hasLeft ? 1 : 0) + (hasRight ? 1 : 0);
+
+    RtlMoveMemory( &Map->Runs[first + pieces],
+                   &Map->Runs[last],
+                   (Map->RunCount - last) * sizeof( CG_DIRTY_RUN ) );
+
+    Map->RunCount = Map->RunCount - (last - first) + pieces;
+
+    position = first;
+
+    if (hasLeft) {
+
+        Map->Runs[position++] = left;
+    }
+
+    Map->Runs[position].StartBlock = StartBlock;
+    Map->Runs[position].EndBlock = EndBlock;
+    Map->Runs[position].Generation = Generation;
+
+    if (hasRight) {
+
+        Map->Runs[position + 1] = right;
+    }
+
+    //
+    //  Merge the new run with adjacent runs of the same generation.
+    //
+
+    if (position + 1 < Map->RunCount &&
+        Map->Runs[position + 1].StartBlock == EndBlock &&
+        Map->Runs[position + 1].Generation == Generation) {
+
+        Map->Runs[position].EndBlock = Map->Runs[position + 1].EndBlock;
+        CgDirtyMapRemoveRuns( Map, position + 1, 1 );
+    }
+
+    if (position > 0 &&
+        Map->Runs[position - 1].EndBlock == StartBlock &&
+        Map->Runs[position - 1].Generation == Generation) {
+
+        Map->Runs[position - 1].EndBlock = Map->Runs[position].EndBlock;
+        CgDirtyMapRemoveRuns( Map, position, 1 );
+    }
+}
+
+VOID
+CgDirtyMapMerge (
+    _Inout_ PCG_DIRTY_MAP Target,
+    _Inout_ PCG_DIRTY_MAP Source,
+    _In_ LONGLONG Generation
+    )
+/*++
+
+Routine Description:
+
+    This routine marks every block that is dirty in Source dirty in Target,
+    in Generation, and empties Source. It is used to apply the blocks
+    written in a transaction when the transaction commits.
+
+Arguments:
+
+    Target - The map to update.
+
+    Source - The map to merge. It is emptied.
+
+    Generation - The current generation.
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    if (Source->AllDirtyGeneration != 0) {
+
+        Target->AllDirtyGeneration = Generation;
+
+    } else {
+
+        for (i = 0; i < Source->RunCount; i++) {
+
+            CgDirtyMapMarkRange( Target,
+                                 Source->Runs[i].StartBlock,
+                                 Source->Runs[i].EndBlock,
+                                 Generation );
+        }
+    }
+
+    CgFreeDirtyMap( Source );
+}
+
+ULONG
+CgDirtyMapQuery (
+    _In_ PCG_DIRTY_MAP Map,
+    _In_ LONGLONG Generation,
+    _In_ ULONGLONG StartBlock,
+    _Out_writes_to_(MaxRanges, return) PCG_CHANGED_RANGE Ranges,
+    _In_ ULONG MaxRanges,
+    _Out_ PBOOLEAN More
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the byte ranges of the blocks, from StartBlock on,
+    that were written in Generation or later. Adjacent ranges are merged.
+
+Arguments:
+
+    Map - The map.
+
+    Generation - The oldest generation of interest.
+
+    StartBlock - The first block of interest.
+
+    Ranges - Receives the ranges.
+
+    MaxRanges - The number of ranges that fit in Ranges.
+
+    More - Receives TRUE if there were more ranges than fit.
+
+Return Value:
+
+    The number of ranges returned.
+
+--*/
+{
+    ULONGLONG endBlock = CgDirtyEndBlock();
+    ULONGLONG runStart;
+    ULONG count = 0;
+    ULONG i;
+
+    *More = FALSE;
+
+    if (Map->AllDirtyGeneration != 0) {
+
+        if (Map->AllDirtyGeneration < Generation || StartBlock >= endBlock) {
+
+            return 0;
+        }
+
+        if (MaxRanges == 0) {
+
+            *More = TRUE;
+            return 0;
+        }
+
+        Ranges[0].Offset = StartBlock << gDirtyBlockShift;
+        Ranges[0].Length = (endBlock << gDirtyBlockShift) - Ranges[0].Offset;
+
+        return 1;
+    }
+
+    for (i = 0; i < Map->RunCount; i++) {
+
+        if (Map->Runs[i].Generation < Generation ||
+            Map->Runs[i].EndBlock <= StartBlock) {
+
+            continue;
+        }
+
+        runStart = Max( Map->Runs[i].StartBlock, StartBlock );
+
+        if (count > 0 &&
+            Ranges[count - 1].Offset + Ranges[count - 1].Length == (runStart << gDirtyBlockShift)) {
+
+            Ranges[count - 1].Length += (Map->Runs[i].EndBlock - runStart) << gDirtyBlockShift;
+            continue;
+        }
+
+        if (count == MaxRanges) {
+
+            *More = TRUE;
+            break;
+        }
+
+        Ranges[count].Offset = runStart << gDirtyBlockShift;
+        Ranges[count].Length = (Map->Runs[i].EndBlock - runStart) << gDirtyBlockShift;
+        count += 1;
+    }
+
+    return count;
+}
+
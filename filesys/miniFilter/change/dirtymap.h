@@ -0,0 +1,139 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All Rights Reserved
+
+Module Name:
+
+    dirtymap.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    constants, global variables and function prototypes of the
+    dirty extent map, which records which blocks of a file were
+    modified and when.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#ifndef __DIRTYMAP_H__
+#define __DIRTYMAP_H__
+
+#define CG_DIRTY_MAP_TAG                     'mDgC'
+
+//
+//  Granularity at which changes are tracked. It can be set with the
+//  DirtyBlockSize registry value of the service key.
+//
+
+#define CG_DEFAULT_DIRTY_BLOCK_SHIFT         16      //  64KB
+#define CG_MIN_DIRTY_BLOCK_SHIFT             12      //  4KB
+#define CG_MAX_DIRTY_BLOCK_SHIFT             30      //  1GB
+
+//
+//  Bounds on the number of runs of a map. A map that would grow past the
+//  maximum merges its two closest runs instead, so it may report blocks
+//  in between as dirty but never misses a dirty block.
+//
+
+#define CG_DIRTY_MAP_INITIAL_RUNS            16
+#define CG_DIRTY_MAP_MAX_RUNS                1024
+
+//
+//  A run of dirty blocks, [StartBlock, EndBlock), last modified in
+//  Generation.
+//
+
+typedef struct _CG_DIRTY_RUN {
+
+    ULONGLONG StartBlock;
+
+    ULONGLONG EndBlock;
+
+    LONGLONG Generation;
+
+} CG_DIRTY_RUN, *PCG_DIRTY_RUN;
+
+//
+//  Dirty extent map. The runs are sorted and do not overlap; adjacent runs
+//  of the same generation are merged.
+//
+
+typedef struct _CG_DIRTY_MAP {
+
+    PCG_DIRTY_RUN Runs;
+
+    ULONG RunCount;
+
+    ULONG RunCapacity;
+
+    //
+    //  If the map could not be allocated the whole file is treated as
+    //  dirty, last modified in this generation.
+    //
+
+    LONGLONG AllDirtyGeneration;
+
+} CG_DIRTY_MAP, *PCG_DIRTY_MAP;
+
+//
+//  Block size shift and the generation counter, defined in change.c.
+//  Generations increase with every query for changed ranges, and are
+//  shared by all files so that a token from a previous instance of a
+//  file context can be recognized.
+//
+
+extern ULONG gDirtyBlockShift;
+
+extern volatile LONGLONG gDirtyGeneration;
+
+FORCEINLINE
+LONGLONG
+CgCurrentGeneration (
+    VOID
+    )
+{
+    return InterlockedCompareExchange64( &gDirtyGeneration, 0, 0 );
+}
+
+//
+//  One past the last block of the largest possible file.
+//
+
+#define CgDirtyEndBlock()  ((((ULONGLONG) MAXLONGLONG) >> gDirtyBlockShift) + 1)
+
+VOID
+CgFreeDirtyMap (
+    _Inout_ PCG_DIRTY_MAP Map
+    );
+
+VOID
+CgDirtyMapMarkRange (
+    _Inout_ PCG_DIRTY_MAP Map,
+    _In_ ULONGLONG StartBlock,
+    _In_ ULONGLONG EndBlock,
+    _In_ LONGLONG Generation
+    );
+
+VOID
+CgDirtyMapMerge (
+    _Inout_ PCG_DIRTY_MAP Target,
+    _Inout_ PCG_DIRTY_MAP Source,
+    _In_ LONGLONG Generation
+    );
+
+ULONG
+CgDirtyMapQuery (
+    _In_ PCG_DIRTY_MAP Map,
+    _In_ LONGLONG Generation,
+    _In_ ULONGLONG StartBlock,
+    _Out_writes_to_(MaxRanges, return) PCG_CHANGED_RANGE Ranges,
+    _In_ ULONG MaxRanges,
+    _Out_ PBOOLEAN More
+    );
+
+#endif
+
@@ -146,19 +146,25 @@ const FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
       0,
       CtxContextCleanup,
       CTX_FILE_CONTEXT_SIZE,
-      CTX_FILE_CONTEXT_TAG },
+      CTX_FILE_CONTEXT_TAG,
+      CtxAllocateContextCallback,
+      CtxFreeContextCallback },
 
     { FLT_STREAM_CONTEXT,
       0,
       CtxContextCleanup,
       CTX_STREAM_CONTEXT_SIZE,
-      CTX_STREAM_CONTEXT_TAG },
+      CTX_STREAM_CONTEXT_TAG,
+      CtxAllocateContextCallback,
+      CtxFreeContextCallback },
 
     { FLT_STREAMHANDLE_CONTEXT,
       0,
       CtxContextCleanup,
       CTX_STREAMHANDLE_CONTEXT_SIZE,
-      CTX_STREAMHANDLE_CONTEXT_TAG },
+      CTX_STREAMHANDLE_CONTEXT_TAG,
+      CtxAllocateContextCallback,
+      CtxFreeContextCallback },
 
     { FLT_CONTEXT_END }
 };
@@ -239,7 +245,16 @@ Return Value:
     DebugTrace( DEBUG_TRACE_LOAD_UNLOAD,
                 ("[Ctx]: Driver being loaded\n") );
 
+    //
+    //  Create the context caches before any context can be allocated
+    //
 
+    status = CtxInitializeContextCaches();
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
 
     //
     //  Register with the filter manager
@@ -251,6 +266,7 @@ Return Value:
 
     if (!NT_SUCCESS( status )) {
 
+        CtxDeleteContextCaches();
         return status;
     }
 
@@ -263,6 +279,7 @@ Return Value:
     if (!NT_SUCCESS( status )) {
 
         FltUnregisterFilter( Globals.Filter );
+        CtxDeleteContextCaches();
     }
 
     DebugTrace( DEBUG_TRACE_LOAD_UNLOAD,
@@ -385,6 +402,12 @@ Return Value:
     FltUnregisterFilter( Globals.Filter );
     Globals.Filter = NULL;
 
+    //
+    //  All contexts have been freed by now
+    //
+
+    CtxDeleteContextCaches();
+
     return STATUS_SUCCESS;
 }
 
@@ -496,16 +519,6 @@ CtxContextCleanup (
                      &streamHandleContext->FileName,
                      streamHandleContext) );
 
-        //
-        //  Delete the resource and memory the memory allocated for the resource
-        //
-
-        if (streamHandleContext->Resource != NULL) {
-
-            ExDeleteResourceLite( streamHandleContext->Resource );
-            CtxFreeResource( streamHandleContext->Resource );
-        }
-
         //
         //  Free the file name
         //
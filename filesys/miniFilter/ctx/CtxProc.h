@@ -94,12 +94,14 @@ NTSTATUS
 CtxFindOrCreateStreamContext (
     _In_ PFLT_CALLBACK_DATA Cbd,
     _In_ BOOLEAN CreateIfNotFound,
+   _When_( CreateIfNotFound != FALSE, _In_ ) _When_( CreateIfNotFound == FALSE, _In_opt_ ) PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAM_CONTEXT *StreamContext,
     _Out_opt_ PBOOLEAN ContextCreated
     );
 
 NTSTATUS
 CtxCreateStreamContext (
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAM_CONTEXT *StreamContext
     );
 
@@ -113,21 +115,17 @@ NTSTATUS
 CtxCreateOrReplaceStreamHandleContext (
     _In_ PFLT_CALLBACK_DATA Cbd,
     _In_ BOOLEAN ReplaceIfExists,
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAMHANDLE_CONTEXT *StreamHandleContext,
     _Out_opt_ PBOOLEAN ContextReplaced
     );
 
 NTSTATUS
 CtxCreateStreamHandleContext (
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAMHANDLE_CONTEXT *StreamHandleContext
     );
 
-NTSTATUS
-CtxUpdateNameInStreamHandleContext (
-    _In_ PUNICODE_STRING DirectoryName,
-    _Inout_ PCTX_STREAMHANDLE_CONTEXT StreamHandleContext
-    );
-
 
 //
 //  Functions implemented in support.c
@@ -149,6 +147,29 @@ CtxFreeUnicodeString (
     _Pre_notnull_ PUNICODE_STRING String
     );
 
+NTSTATUS
+CtxInitializeContextCaches (
+    VOID
+    );
+
+VOID
+CtxDeleteContextCaches (
+    VOID
+    );
+
+PVOID
+CtxAllocateContextCallback (
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T Size,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    );
+
+VOID
+CtxFreeContextCallback (
+    _In_ PVOID Pool,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    );
+
 
 //
 //  Resource support
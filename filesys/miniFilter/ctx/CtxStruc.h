@@ -29,6 +29,69 @@ Environment:
 #define CTX_FILE_CONTEXT_TAG                  'cFxC'
 #define CTX_STREAM_CONTEXT_TAG                'cSxC'
 #define CTX_STREAMHANDLE_CONTEXT_TAG          'cHxC'
+#define CTX_CONTEXT_CACHE_TAG                 'cCxC'
+
+
+//
+//  Per-processor context caches
+//
+//  The file, stream and stream handle contexts are allocated through
+//  CtxAllocateContextCallback, which takes them from a lookaside list
+//  private to the current processor, so that creates on different
+//  processors do not contend for the same pool or lookaside list.
+//  Filter Manager adds its own header to the size of each context; the
+//  cache entries leave CTX_CONTEXT_CACHE_OVERHEAD bytes for it and larger
+//  requests go to pool.
+//
+
+#define CTX_CONTEXT_CACHE_FILE                0
+#define CTX_CONTEXT_CACHE_STREAM              1
+#define CTX_CONTEXT_CACHE_STREAMHANDLE        2
+#define CTX_CONTEXT_CACHE_TYPES               3
+
+#define CTX_CONTEXT_CACHE_NONE                ((ULONG)-1)
+
+#define CTX_CONTEXT_CACHE_OVERHEAD            256
+
+//
+//  Number of entries placed on each list when it is created
+//
+
+#define CTX_CONTEXT_CACHE_PRIME_DEPTH         4
+
+typedef struct _CTX_CONTEXT_CACHE {
+
+    PAGED_LOOKASIDE_LIST Lists[CTX_CONTEXT_CACHE_TYPES];
+
+} CTX_CONTEXT_CACHE, *PCTX_CONTEXT_CACHE;
+
+//
+//  Header preceding every context allocation made by the context caches.
+//  It records which cache, and which processor's list of it, the
+//  allocation came from so that it can be returned there.
+//
+
+#pragma warning(push)
+#pragma warning(disable:4201) // nameless struct/union
+
+typedef union _CTX_CONTEXT_CACHE_HEADER {
+
+    struct {
+
+        ULONG Cache;
+
+        ULONG Processor;
+    };
+
+    //
+    //  Keep the context that follows aligned like a pool allocation
+    //
+
+    UCHAR Alignment[MEMORY_ALLOCATION_ALIGNMENT];
+
+} CTX_CONTEXT_CACHE_HEADER, *PCTX_CONTEXT_CACHE_HEADER;
+
+#pragma warning(pop)
 
 
 //
@@ -42,6 +105,20 @@ typedef struct _CTX_GLOBAL_DATA {
     //
 
     PFLT_FILTER Filter;
+
+    //
+    //  Per-processor context caches, one per possible processor
+    //
+
+    PCTX_CONTEXT_CACHE ContextCaches;
+
+    ULONG ContextCacheCount;
+
+    //
+    //  Size of the entries of each context cache
+    //
+
+    ULONG ContextCacheEntrySize[CTX_CONTEXT_CACHE_TYPES];
     
 #if DBG
 
@@ -128,23 +205,26 @@ typedef struct _CTX_STREAM_CONTEXT {
     //
     //  Number of times we saw a create on this stream
     //
+    //  The counts are updated with interlocked operations and are not
+    //  protected by the resource.
+    //
 
-    ULONG CreateCount;
+    volatile LONG CreateCount;
 
     //
     //  Number of times we saw a cleanup on this stream
     //
 
-    ULONG CleanupCount;
+    volatile LONG CleanupCount;
 
     //
     //  Number of times we saw a close on this stream
     //
 
-    ULONG CloseCount;
+    volatile LONG CloseCount;
 
     //
-    //  Lock used to protect this context.
+    //  Lock used to protect the name in this context.
     //
 
     PERESOURCE Resource;
@@ -168,11 +248,11 @@ typedef struct _CTX_STREAMHANDLE_CONTEXT {
     UNICODE_STRING FileName;
 
     //
-    //  Lock used to protect this context.
+    //  There is no resource to protect the context since the
+    //  filename in the context is never modified. A rename
+    //  replaces the context with a new one instead
     //
 
-    PERESOURCE Resource;
-
 } CTX_STREAMHANDLE_CONTEXT, *PCTX_STREAMHANDLE_CONTEXT;
 
 #define CTX_STREAMHANDLE_CONTEXT_SIZE         sizeof( CTX_STREAMHANDLE_CONTEXT )
@@ -31,7 +31,6 @@ Environment:
 #pragma alloc_text(PAGE, CtxUpdateNameInStreamContext)
 #pragma alloc_text(PAGE, CtxCreateOrReplaceStreamHandleContext)
 #pragma alloc_text(PAGE, CtxCreateStreamHandleContext)
-#pragma alloc_text(PAGE, CtxUpdateNameInStreamHandleContext)
 #endif
 
 
@@ -284,6 +283,7 @@ NTSTATUS
 CtxFindOrCreateStreamContext (
     _In_ PFLT_CALLBACK_DATA Cbd,
     _In_ BOOLEAN CreateIfNotFound,
+   _When_( CreateIfNotFound != FALSE, _In_ ) _When_( CreateIfNotFound == FALSE, _In_opt_ ) PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAM_CONTEXT *StreamContext,
     _Out_opt_ PBOOLEAN ContextCreated
     )
@@ -300,6 +300,7 @@ Arguments:
     Cbd                   - Supplies a pointer to the callbackData which
                             declares the requested operation.
     CreateIfNotFound      - Supplies if the stream must be created if missing
+    FileName              - Supplies the file name for a new context
     StreamContext         - Returns the stream context
     ContextCreated        - Returns if a new context was created
 
@@ -351,7 +352,7 @@ Return Value:
                      Cbd->Iopb->TargetFileObject,
                      Cbd->Iopb->TargetInstance) );
 
-        status = CtxCreateStreamContext( &streamContext );
+        status = CtxCreateStreamContext( FileName, &streamContext );
 
         if (!NT_SUCCESS( status )) {
 
@@ -456,6 +457,7 @@ Return Value:
 
 NTSTATUS
 CtxCreateStreamContext (
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAM_CONTEXT *StreamContext
     )
 /*++
@@ -466,6 +468,7 @@ Routine Description:
 
 Arguments:
 
+    FileName              - Supplies the file name
     StreamContext         - Returns the stream context
 
 Return Value:
@@ -514,6 +517,19 @@ Return Value:
     }
     ExInitializeResourceLite( streamContext->Resource );
 
+    //
+    //  Set the name before the context is published, so that creates
+    //  that find the context only need to check it
+    //
+
+    status = CtxUpdateNameInStreamContext( FileName, streamContext );
+
+    if (!NT_SUCCESS( status )) {
+
+        FltReleaseContext( streamContext );
+        return status;
+    }
+
     *StreamContext = streamContext;
 
     return STATUS_SUCCESS;
@@ -582,6 +598,7 @@ NTSTATUS
 CtxCreateOrReplaceStreamHandleContext (
     _In_ PFLT_CALLBACK_DATA Cbd,
     _In_ BOOLEAN ReplaceIfExists,
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAMHANDLE_CONTEXT *StreamHandleContext,
     _Out_opt_ PBOOLEAN ContextReplaced
     )
@@ -599,6 +616,7 @@ Arguments:
                             declares the requested operation.
     ReplaceIfExists       - Supplies if the stream handle context must be
                             replaced if already present
+    FileName              - Supplies the file name
     StreamContext         - Returns the stream context
     ContextReplaced       - Returns if an existing context was replaced
 
@@ -626,7 +644,7 @@ Return Value:
                  Cbd->Iopb->TargetFileObject,
                  Cbd->Iopb->TargetInstance) );
 
-    status = CtxCreateStreamHandleContext( &streamHandleContext );
+    status = CtxCreateStreamHandleContext( FileName, &streamHandleContext );
 
     if (!NT_SUCCESS( status )) {
 
@@ -762,16 +780,18 @@ Return Value:
 
 NTSTATUS
 CtxCreateStreamHandleContext (
+    _In_ PUNICODE_STRING FileName,
     _Outptr_ PCTX_STREAMHANDLE_CONTEXT *StreamHandleContext
     )
 /*++
 
 Routine Description:
 
-    This routine creates a new stream context
+    This routine creates a new stream handle context
 
 Arguments:
 
+    FileName              - Supplies the file name
     StreamContext         - Returns the stream context
 
 Return Value:
@@ -813,73 +833,23 @@ Return Value:
 
     RtlZeroMemory( streamHandleContext, CTX_STREAMHANDLE_CONTEXT_SIZE );
 
-    streamHandleContext->Resource = CtxAllocateResource();
-    if(streamHandleContext->Resource == NULL) {
-
-        FltReleaseContext( streamHandleContext );
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    ExInitializeResourceLite( streamHandleContext->Resource );
-
-    *StreamHandleContext = streamHandleContext;
-
-    return STATUS_SUCCESS;
-}
-
-
-
-NTSTATUS
-CtxUpdateNameInStreamHandleContext (
-    _In_ PUNICODE_STRING DirectoryName,
-    _Inout_ PCTX_STREAMHANDLE_CONTEXT StreamHandleContext
-    )
-/*++
-
-Routine Description:
-
-    This routine updates the name of the target in the supplied stream handle context
-
-Arguments:
-
-    DirectoryName             - Supplies the directory name
-    StreamHandleContext   - Returns the updated name in the stream context
-
-Return Value:
-
-    Status
-
-Note:
-
-    The caller must synchronize access to the context. This routine does no
-    synchronization
-
---*/
-{
-    NTSTATUS status;
-
-    PAGED_CODE();
-
     //
-    //  Free any existing name
+    //  Allocate and copy off the file name. The name never changes after
+    //  this, so the context needs no lock
     //
 
-    if (StreamHandleContext->FileName.Buffer != NULL) {
+    streamHandleContext->FileName.MaximumLength = FileName->Length;
+    status = CtxAllocateUnicodeString( &streamHandleContext->FileName );
+    if (!NT_SUCCESS( status )) {
 
-        CtxFreeUnicodeString(&StreamHandleContext->FileName);
+        FltReleaseContext( streamHandleContext );
+        return status;
     }
 
+    RtlCopyUnicodeString( &streamHandleContext->FileName, FileName );
 
-    //
-    //  Allocate and copy off the directory name
-    //
-
-    StreamHandleContext->FileName.MaximumLength = DirectoryName->Length;
-    status = CtxAllocateUnicodeString(&StreamHandleContext->FileName);
-    if (NT_SUCCESS(status)) {
-
-        RtlCopyUnicodeString(&StreamHandleContext->FileName, DirectoryName);
-    }
+    *StreamHandleContext = streamHandleContext;
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
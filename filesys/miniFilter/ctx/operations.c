@@ -87,6 +87,7 @@ CtxPostCreate (
 
     NTSTATUS status;
     BOOLEAN fileContextCreated, streamContextCreated, streamHandleContextReplaced;
+    BOOLEAN nameChanged;
 
 
     UNREFERENCED_PARAMETER( FltObjects );
@@ -142,6 +143,7 @@ CtxPostCreate (
 
     status = CtxFindOrCreateStreamContext(Cbd, 
                                           TRUE,
+                                          &nameInfo->Name,
                                           &streamContext,
                                           &streamContextCreated);
     if (!NT_SUCCESS( status )) {
@@ -168,46 +170,65 @@ CtxPostCreate (
                  streamContext,
                  streamContextCreated) );
 
-    //
-    //  Acquire write acccess to the context
-    //
-    
-    CtxAcquireResourceExclusive(streamContext->Resource);
-
     //
     //  Increment the create count
     //
 
-    streamContext->CreateCount++;
-    
+    InterlockedIncrement( &streamContext->CreateCount );
+
     //
-    //  Update the file name in the context
+    //  A new context already has the name. For an existing context the name
+    //  only needs updating if the stream was renamed, so check it under
+    //  the shared lock first and only take the lock exclusive to change it
     //
-    
-    status = CtxUpdateNameInStreamContext( &nameInfo->Name, 
-                                                  streamContext);
 
+    status = STATUS_SUCCESS;
+
+    if (!streamContextCreated) {
+
+        CtxAcquireResourceShared(streamContext->Resource);
+
+        nameChanged = !RtlEqualUnicodeString( &streamContext->FileName,
+                                              &nameInfo->Name,
+                                              FALSE );
+
+        CtxReleaseResource(streamContext->Resource);
+
+        if (nameChanged) {
+
+            //
+            //  Acquire write acccess to the context
+            //
+
+            CtxAcquireResourceExclusive(streamContext->Resource);
+
+            //
+            //  Update the file name in the context
+            //
+
+            status = CtxUpdateNameInStreamContext( &nameInfo->Name, 
+                                                   streamContext);
+
+            //
+            //  Relinquish write acccess to the context
+            //
+
+            CtxReleaseResource(streamContext->Resource);
+        }
+    }
 
     DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
-                ("[Ctx]: CtxPostCreate -> Stream context info for file %wZ (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
+                ("[Ctx]: CtxPostCreate -> Stream context info for file %wZ (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
                  &nameInfo->Name,
                  Cbd,
                  FltObjects->FileObject,
                  streamContext,
-                 &streamContext->FileName,
                  streamContext->CreateCount,
                  streamContext->CleanupCount,
                  streamContext->CloseCount) );
 
     //
-    //  Relinquish write acccess to the context
-    //
-    
-    CtxReleaseResource(streamContext->Resource);
-
-    //
-    //  Quit on failure after we have given up
-    //  the resource
+    //  Quit on failure
     //
 
     if (!NT_SUCCESS( status )) {
@@ -229,6 +250,7 @@ CtxPostCreate (
 
     status = CtxCreateOrReplaceStreamHandleContext(Cbd, 
                                                    TRUE,
+                                                   &nameInfo->Name,
                                                    &streamHandleContext,
                                                    &streamHandleContextReplaced);
     if (!NT_SUCCESS( status )) {
@@ -255,19 +277,6 @@ CtxPostCreate (
                  streamHandleContext,
                  streamHandleContextReplaced) );
 
-    //
-    //  Acquire write acccess to the context
-    //
-
-    CtxAcquireResourceExclusive( streamHandleContext->Resource );
-
-    //
-    //  Update the file name in the context
-    //
-
-    status = CtxUpdateNameInStreamHandleContext( &nameInfo->Name, 
-                                                 streamHandleContext);
-
     DebugTrace( DEBUG_TRACE_STREAMHANDLE_CONTEXT_OPERATIONS,
                 ("[Ctx]: CtxPostCreate -> Stream handle context info for file %wZ (Cbd = %p, FileObject = %p, StreamHandleContext = %p) \n\tName = %wZ\n",
                  &nameInfo->Name,
@@ -275,28 +284,6 @@ CtxPostCreate (
                  FltObjects->FileObject,
                  streamHandleContext,
                  &streamHandleContext->FileName) );
-
-    //
-    //  Relinquish write acccess to the context
-    //
-
-    CtxReleaseResource(streamHandleContext->Resource);
-
-    //
-    //  Quit on failure after we have given up
-    //  the resource
-    //
-
-    if (!NT_SUCCESS( status )) {
-
-        DebugTrace( DEBUG_TRACE_ERROR | DEBUG_TRACE_STREAMHANDLE_CONTEXT_OPERATIONS,
-                    ("[Ctx]: CtxPostCreate -> Failed to update name in stream handle context for file %wZ (Cbd = %p, FileObject = %p)\n",
-                     &nameInfo->Name,
-                     Cbd,
-                     FltObjects->FileObject) );
-
-        goto CtxPostCreateCleanup;
-    }
     
     //
     //  After FltParseFileNameInformation, nameInfo->Name also
@@ -430,6 +417,7 @@ CtxPreCleanup (
 
     status = CtxFindOrCreateStreamContext(Cbd, 
                                           FALSE,     // do not create if one does not exist
+                                          NULL,
                                           &streamContext,
                                           &streamContextCreated);
     if (!NT_SUCCESS( status )) {
@@ -456,46 +444,36 @@ CtxPreCleanup (
                  streamContextCreated) );
 
     //
-    //  Acquire write acccess to the context
+    //  Update the cleanup count in the context
     //
-    
-    CtxAcquireResourceExclusive(streamContext->Resource);
 
+    InterlockedIncrement( &streamContext->CleanupCount );
 
-    DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
-                ("[Ctx]: CtxPreCleanup -> Old info in stream context for file(Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
-                 Cbd,
-                 FltObjects->FileObject,
-                 streamContext,
-                 &streamContext->FileName,
-                 streamContext->CreateCount,
-                 streamContext->CleanupCount,
-                 streamContext->CloseCount) );
-
+#if DBG
 
-    
     //
-    //  Update the cleanup count in the context
+    //  The name may be changed by a rename, so it must be read under
+    //  the resource
     //
-    
-    streamContext->CleanupCount++;
 
-    
-    DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
-                ("[Ctx]: CtxPreCleanup -> New info in stream context for file (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
-                 Cbd,
-                 FltObjects->FileObject,
-                 streamContext,
-                 &streamContext->FileName,
-                 streamContext->CreateCount,
-                 streamContext->CleanupCount,
-                 streamContext->CloseCount) );
+    if (FlagOn( Globals.DebugLevel, DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS )) {
 
-    //
-    //  Relinquish write acccess to the context
-    //
-    
-    CtxReleaseResource(streamContext->Resource);
+        CtxAcquireResourceShared(streamContext->Resource);
+
+        DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
+                    ("[Ctx]: CtxPreCleanup -> New info in stream context for file (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
+                     Cbd,
+                     FltObjects->FileObject,
+                     streamContext,
+                     &streamContext->FileName,
+                     streamContext->CreateCount,
+                     streamContext->CleanupCount,
+                     streamContext->CloseCount) );
+
+        CtxReleaseResource(streamContext->Resource);
+    }
+
+#endif
 
 
 CtxPreCleanupCleanup:
@@ -554,6 +532,7 @@ CtxPreClose (
 
     status = CtxFindOrCreateStreamContext(Cbd, 
                                           FALSE,     // do not create if one does not exist
+                                          NULL,
                                           &streamContext,
                                           &streamContextCreated);
     if (!NT_SUCCESS( status )) {
@@ -580,44 +559,36 @@ CtxPreClose (
                  streamContextCreated) );
 
     //
-    //  Acquire write acccess to the context
+    //  Update the close count in the context
     //
-    
-    CtxAcquireResourceExclusive(streamContext->Resource);
 
+    InterlockedIncrement( &streamContext->CloseCount );
+
+#if DBG
 
-    DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
-                ("[Ctx]: CtxPreClose -> Old info in stream context for file(Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
-                 Cbd,
-                 FltObjects->FileObject,
-                 streamContext,
-                 &streamContext->FileName,
-                 streamContext->CreateCount,
-                 streamContext->CleanupCount,
-                 streamContext->CloseCount) );
-    
     //
-    //  Update the close count in the context
+    //  The name may be changed by a rename, so it must be read under
+    //  the resource
     //
-    
-    streamContext->CloseCount++;
 
-    
-    DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
-                ("[Ctx]: CtxPreClose -> New info in stream context for file (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
-                 Cbd,
-                 FltObjects->FileObject,
-                 streamContext,
-                 &streamContext->FileName,
-                 streamContext->CreateCount,
-                 streamContext->CleanupCount,
-                 streamContext->CloseCount) );
+    if (FlagOn( Globals.DebugLevel, DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS )) {
 
-    //
-    //  Relinquish write acccess to the context
-    //
-    
-    CtxReleaseResource(streamContext->Resource);
+        CtxAcquireResourceShared(streamContext->Resource);
+
+        DebugTrace( DEBUG_TRACE_STREAM_CONTEXT_OPERATIONS,
+                    ("[Ctx]: CtxPreClose -> New info in stream context for file (Cbd = %p, FileObject = %p, StreamContext = %p) \n\tName = %wZ \n\tCreateCount = %x \n\tCleanupCount = %x, \n\tCloseCount = %x\n",
+                     Cbd,
+                     FltObjects->FileObject,
+                     streamContext,
+                     &streamContext->FileName,
+                     streamContext->CreateCount,
+                     streamContext->CleanupCount,
+                     streamContext->CloseCount) );
+
+        CtxReleaseResource(streamContext->Resource);
+    }
+
+#endif
 
 
 CtxPreCloseCleanup:
@@ -819,6 +790,7 @@ CtxPostSetInfo (
 
     status = CtxFindOrCreateStreamContext(Cbd, 
                                           FALSE,     // do not create if one does not exist
+                                          NULL,
                                           &streamContext,
                                           &streamContextCreated);
     if (!NT_SUCCESS( status )) {
@@ -914,6 +886,7 @@ CtxPostSetInfo (
 
     status = CtxCreateOrReplaceStreamHandleContext(Cbd, 
                                                    TRUE,
+                                                   &nameInfo->Name,
                                                    &streamHandleContext,
                                                    &streamHandleContextReplaced);
     if (!NT_SUCCESS( status )) {
@@ -940,19 +913,6 @@ CtxPostSetInfo (
                  streamHandleContext,
                  streamHandleContextReplaced) );
 
-    //
-    //  Acquire write acccess to the context
-    //
-
-    CtxAcquireResourceExclusive(streamHandleContext->Resource);
-
-    //
-    //  Update the file name in the context
-    //
-
-    status = CtxUpdateNameInStreamHandleContext( &nameInfo->Name, 
-                                                 streamHandleContext);
-
     DebugTrace( DEBUG_TRACE_STREAMHANDLE_CONTEXT_OPERATIONS,
                 ("[Ctx]: CtxPostSetInfo -> Stream handle context info for file %wZ (Cbd = %p, FileObject = %p, StreamHandleContext = %p) \n\tName = %wZ\n",
                  &nameInfo->Name,
@@ -961,28 +921,6 @@ CtxPostSetInfo (
                  streamHandleContext,
                  &streamHandleContext->FileName) );
 
-    //
-    //  Relinquish write acccess to the context
-    //
-
-    CtxReleaseResource( streamHandleContext->Resource );
-
-    //
-    //  Quit on failure after we have given up
-    //  the resource
-    //
-
-    if (!NT_SUCCESS( status )) {
-
-        DebugTrace( DEBUG_TRACE_ERROR | DEBUG_TRACE_STREAMHANDLE_CONTEXT_OPERATIONS,
-                    ("[Ctx]: CtxPostSetInfo -> Failed to update name in stream handle context for file %wZ (Cbd = %p, FileObject = %p)\n",
-                     &nameInfo->Name,
-                     Cbd,
-                     FltObjects->FileObject) );
-
-        goto CtxPostSetInfoCleanup;
-    }
-
     
     //
     // Get the file context
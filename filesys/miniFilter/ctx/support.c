@@ -23,6 +23,15 @@ Environment:
 
 #include "pch.h"
 
+//
+//  Local function prototypes
+//
+
+ULONG
+CtxContextCacheIndex (
+    _In_ FLT_CONTEXT_TYPE ContextType
+    );
+
 //
 //  Assign text sections for each routine.
 //
@@ -30,6 +39,8 @@ Environment:
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, CtxAllocateUnicodeString)
 #pragma alloc_text(PAGE, CtxFreeUnicodeString)
+#pragma alloc_text(PAGE, CtxInitializeContextCaches)
+#pragma alloc_text(PAGE, CtxDeleteContextCaches)
 #endif
 
 //
@@ -114,4 +125,307 @@ Return Value:
 }
 
 
+//
+//  Context cache routines
+//
+
+NTSTATUS
+CtxInitializeContextCaches (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine creates the per-processor context caches and places a few
+    entries on each of them, so that the first creates on every processor
+    do not have to go to pool.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    STATUS_SUCCESS                  - success
+    STATUS_INSUFFICIENT_RESOURCES   - failure
+
+--*/
+{
+    static const ULONG contextSizes[CTX_CONTEXT_CACHE_TYPES] = {
+        CTX_FILE_CONTEXT_SIZE,
+        CTX_STREAM_CONTEXT_SIZE,
+        CTX_STREAMHANDLE_CONTEXT_SIZE
+    };
+    static const ULONG contextTags[CTX_CONTEXT_CACHE_TYPES] = {
+        CTX_FILE_CONTEXT_TAG,
+        CTX_STREAM_CONTEXT_TAG,
+        CTX_STREAMHANDLE_CONTEXT_TAG
+    };
+    PVOID entries[CTX_CONTEXT_CACHE_PRIME_DEPTH];
+    PPAGED_LOOKASIDE_LIST list;
+    ULONG count;
+    ULONG processor;
+    ULONG type;
+    ULONG i;
+
+    PAGED_CODE();
+
+    count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+
+    Globals.ContextCaches = ExAllocatePoolWithTag( NonPagedPoolNxCacheAligned,
+                                                   count * sizeof( CTX_CONTEXT_CACHE ),
+                                                   CTX_CONTEXT_CACHE_TAG );
+
+    if (Globals.ContextCaches == NULL) {
+
+        DebugTrace( DEBUG_TRACE_ERROR,
+                    ("[Ctx]: Failed to allocate context caches for %u processors\n",
+                    count) );
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Globals.ContextCacheCount = count;
+
+    for (type = 0; type < CTX_CONTEXT_CACHE_TYPES; type++) {
+
+        Globals.ContextCacheEntrySize[type] = sizeof( CTX_CONTEXT_CACHE_HEADER ) +
+                                              contextSizes[type] +
+                                              CTX_CONTEXT_CACHE_OVERHEAD;
+    }
+
+    for (processor = 0; processor < count; processor++) {
+
+        for (type = 0; type < CTX_CONTEXT_CACHE_TYPES; type++) {
+
+            list = &Globals.ContextCaches[processor].Lists[type];
+
+            ExInitializePagedLookasideList( list,
+                                            NULL,
+                                            NULL,
+                                            0,
+                                            Globals.ContextCacheEntrySize[type],
+                                            contextTags[type],
+                                            0 );
+
+            //
+            //  Prime the list. Failing to do so only costs a pool
+            //  allocation later.
+            //
+
+            for (i = 0; i < CTX_CONTEXT_CACHE_PRIME_DEPTH; i++) {
+
+                entries[i] = ExAllocateFromPagedLookasideList( list );
+            }
+
+            for (i = 0; i < CTX_CONTEXT_CACHE_PRIME_DEPTH; i++) {
+
+                if (entries[i] != NULL) {
+
+                    ExFreeToPagedLookasideList( list, entries[i] );
+                }
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+CtxDeleteContextCaches (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine deletes the per-processor context caches. All contexts
+    must have been freed.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG processor;
+    ULONG type;
+
+    PAGED_CODE();
+
+    if (Globals.ContextCaches == NULL) {
+
+        return;
+    }
+
+    for (processor = 0; processor < Globals.ContextCacheCount; processor++) {
+
+        for (type = 0; type < CTX_CONTEXT_CACHE_TYPES; type++) {
+
+            ExDeletePagedLookasideList( &Globals.ContextCaches[processor].Lists[type] );
+        }
+    }
+
+    ExFreePoolWithTag( Globals.ContextCaches,
+                       CTX_CONTEXT_CACHE_TAG );
+
+    Globals.ContextCaches = NULL;
+    Globals.ContextCacheCount = 0;
+}
 
+ULONG
+CtxContextCacheIndex (
+    _In_ FLT_CONTEXT_TYPE ContextType
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the context cache used for a context type
+
+Arguments:
+
+    ContextType - supplies the context type
+
+Return Value:
+
+    The index of the cache, or CTX_CONTEXT_CACHE_NONE if contexts of this
+    type are not cached
+
+--*/
+{
+    switch (ContextType) {
+
+    case FLT_FILE_CONTEXT:
+
+        return CTX_CONTEXT_CACHE_FILE;
+
+    case FLT_STREAM_CONTEXT:
+
+        return CTX_CONTEXT_CACHE_STREAM;
+
+    case FLT_STREAMHANDLE_CONTEXT:
+
+        return CTX_CONTEXT_CACHE_STREAMHANDLE;
+    }
+
+    return CTX_CONTEXT_CACHE_NONE;
+}
+
+PVOID
+CtxAllocateContextCallback (
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T Size,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    )
+/*++
+
+Routine Description:
+
+    This routine is called by Filter Manager to allocate a context. Paged
+    contexts that fit are taken from the current processor's cache.
+
+Arguments:
+
+    PoolType - supplies the pool type requested for the context
+
+    Size - supplies the size of the allocation
+
+    ContextType - supplies the context type
+
+Return Value:
+
+    The allocation, or NULL on failure
+
+--*/
+{
+    PCTX_CONTEXT_CACHE_HEADER header;
+    ULONG cache;
+    ULONG processor;
+
+    cache = CtxContextCacheIndex( ContextType );
+
+    if (cache != CTX_CONTEXT_CACHE_NONE &&
+        PoolType == PagedPool &&
+        Size <= Globals.ContextCacheEntrySize[cache] - sizeof( CTX_CONTEXT_CACHE_HEADER )) {
+
+        //
+        //  It doesn't matter if this thread moves to another processor
+        //  before the list is used, the list is interlocked.
+        //
+
+        processor = KeGetCurrentProcessorNumberEx( NULL );
+
+        FLT_ASSERT( processor < Globals.ContextCacheCount );
+
+        header = ExAllocateFromPagedLookasideList( &Globals.ContextCaches[processor].Lists[cache] );
+
+    } else {
+
+        cache = CTX_CONTEXT_CACHE_NONE;
+        processor = 0;
+
+        header = ExAllocatePoolWithTag( PoolType,
+                                        Size + sizeof( CTX_CONTEXT_CACHE_HEADER ),
+                                        CTX_CONTEXT_CACHE_TAG );
+    }
+
+    if (header == NULL) {
+
+        return NULL;
+    }
+
+    header->Cache = cache;
+    header->Processor = processor;
+
+    return header + 1;
+}
+
+VOID
+CtxFreeContextCallback (
+    _In_ PVOID Pool,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    )
+/*++
+
+Routine Description:
+
+    This routine is called by Filter Manager to free a context allocated by
+    CtxAllocateContextCallback. Cached contexts are returned to the list
+    they were allocated from, which need not belong to the current
+    processor, so that no list grows at the expense of the others.
+
+Arguments:
+
+    Pool - supplies the allocation
+
+    ContextType - supplies the context type
+
+Return Value:
+
+    None
+
+--*/
+{
+    PCTX_CONTEXT_CACHE_HEADER header = (PCTX_CONTEXT_CACHE_HEADER) Pool - 1;
+
+    UNREFERENCED_PARAMETER( ContextType );
+
+    if (header->Cache == CTX_CONTEXT_CACHE_NONE) {
+
+        ExFreePoolWithTag( header,
+                           CTX_CONTEXT_CACHE_TAG );
+
+    } else {
+
+        FLT_ASSERT( header->Processor < Globals.ContextCacheCount );
+
+        ExFreeToPagedLookasideList( &Globals.ContextCaches[header->Processor].Lists[header->Cache],
+                                    header );
+    }
+}
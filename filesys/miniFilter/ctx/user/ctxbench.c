@@ -0,0 +1,382 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ctxbench.c
+
+Abstract:
+
+    This program measures how many creates per second the ctx filter lets
+    through when many threads open the same file.
+
+    Every create of the file makes the filter look up or create its file
+    and stream contexts and create a stream handle context, which is where
+    threads opening one hot file contend.  Each thread opens and closes the
+    file in a loop.  This is done for 1, 2, 4 and so on up to Threads
+    threads, first with the filter attached to the file's volume and then
+    with it detached, and the program prints the creates per second of
+    each and how they scale with the number of threads.
+
+    The filter is attached again at the end.  Detaching and attaching needs
+    administrator rights.
+
+    Usage: ctxbench File [Threads [Seconds]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include <dontuse.h>
+
+#define CTXBENCH_FILTER_NAME            L"Ctx"
+
+#define CTXBENCH_DEFAULT_SECONDS        5
+#define CTXBENCH_MAX_THREADS            64
+
+typedef enum _CONFIGURATION {
+
+    ConfigurationFilter,
+    ConfigurationNoFilter,
+    ConfigurationMax
+
+} CONFIGURATION;
+
+const PCSTR ConfigurationNames[ConfigurationMax] = {
+    "filter",
+    "no filter"
+};
+
+//
+//  Each thread counts its creates in a cache line of its own, so the
+//  counting does not add contention of its own.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _WORKER {
+
+    HANDLE Thread;
+    LONGLONG Creates;
+    BOOL Failed;
+
+} WORKER, *PWORKER;
+
+CHAR FilePath[MAX_PATH];
+ULONG MaxThreads;
+ULONG Seconds = CTXBENCH_DEFAULT_SECONDS;
+
+WORKER Workers[CTXBENCH_MAX_THREADS];
+
+HANDLE StartEvent;
+volatile LONG StopCreates;
+
+LARGE_INTEGER Frequency;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Measures creates of one file from many threads with and without the ctx filter\n" );
+    printf( "Usage: ctxbench File [Threads [Seconds]]\n" );
+    printf( "    File is an existing file on a volume the filter is attached to\n" );
+    printf( "    Threads defaults to the number of processors, at most %u\n", CTXBENCH_MAX_THREADS );
+    printf( "    Seconds is the length of each run (default %u)\n", CTXBENCH_DEFAULT_SECONDS );
+}
+
+
+DWORD
+WINAPI
+WorkerThread (
+    _In_ LPVOID Parameter
+    )
+{
+    PWORKER worker = Parameter;
+    LONGLONG creates = 0;
+    HANDLE file;
+
+    WaitForSingleObject( StartEvent, INFINITE );
+
+    while (!StopCreates) {
+
+        file = CreateFileA( FilePath,
+                            GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL );
+
+        if (file == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Opening %s: %u\n", FilePath, GetLastError() );
+            worker->Failed = TRUE;
+            break;
+        }
+
+        CloseHandle( file );
+
+        creates += 1;
+    }
+
+    worker->Creates = creates;
+
+    return 0;
+}
+
+
+BOOL
+RunThreads (
+    _In_ ULONG ThreadCount,
+    _Out_ double *CreatesPerSecond
+    )
+/*++
+
+Routine Description:
+
+    Opens the file from ThreadCount threads for Seconds and returns the
+    creates per second of all of them.
+
+--*/
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    LONGLONG creates = 0;
+    BOOL result = TRUE;
+    ULONG i;
+
+    *CreatesPerSecond = 0.0;
+
+    ZeroMemory( Workers, sizeof( Workers ) );
+    ResetEvent( StartEvent );
+    InterlockedExchange( &StopCreates, 0 );
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        Workers[i].Thread = CreateThread( NULL, 0, WorkerThread, &Workers[i], 0, NULL );
+
+        if (Workers[i].Thread == NULL) {
+
+            printf( "ERROR: Creating a thread: %u\n", GetLastError() );
+            InterlockedExchange( &StopCreates, 1 );
+            result = FALSE;
+            break;
+        }
+    }
+
+    //
+    //  The threads start together so that every one of them runs for the
+    //  whole interval.
+    //
+
+    QueryPerformanceCounter( &start );
+    SetEvent( StartEvent );
+
+    if (result) {
+
+        Sleep( Seconds * 1000 );
+        InterlockedExchange( &StopCreates, 1 );
+    }
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Thread != NULL) {
+
+            WaitForSingleObject( Workers[i].Thread, INFINITE );
+            CloseHandle( Workers[i].Thread );
+        }
+    }
+
+    QueryPerformanceCounter( &end );
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Failed) {
+
+            result = FALSE;
+        }
+
+        creates += Workers[i].Creates;
+    }
+
+    *CreatesPerSecond = (double) creates * Frequency.QuadPart / (double) (end.QuadPart - start.QuadPart);
+
+    return result;
+}
+
+
+BOOL
+RunConfiguration (
+    _In_ CONFIGURATION Configuration
+    )
+{
+    double createsPerSecond;
+    double singleThread = 0.0;
+    ULONG threads = 1;
+
+    printf( "%s\n", ConfigurationNames[Configuration] );
+
+    for (;;) {
+
+        if (!RunThreads( threads, &createsPerSecond )) {
+
+            return FALSE;
+        }
+
+        if (threads == 1) {
+
+            singleThread = createsPerSecond;
+        }
+
+        printf( "    %3u threads %12.0f creates/s %6.2fx one thread\n",
+                threads,
+                createsPerSecond,
+                createsPerSecond / singleThread );
+
+        if (threads == MaxThreads) {
+
+            break;
+        }
+
+        //
+        //  Always end with the largest number of threads asked for.
+        //
+
+        threads = min( threads * 2, MaxThreads );
+    }
+
+    return TRUE;
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    CHAR volumePath[MAX_PATH];
+    CHAR volumeName[MAX_PATH];
+    WCHAR volume[MAX_PATH];
+    CONFIGURATION configuration;
+    HANDLE file;
+    BOOL detached = FALSE;
+    HRESULT hr;
+    int status = 0;
+
+    if (argc < 2 || argc > 4) {
+
+        Usage();
+        return 1;
+    }
+
+    if (strcpy_s( FilePath, sizeof( FilePath ), argv[1] ) != 0) {
+
+        printf( "ERROR: File name is too long\n" );
+        return 1;
+    }
+
+    MaxThreads = min( GetActiveProcessorCount( ALL_PROCESSOR_GROUPS ), CTXBENCH_MAX_THREADS );
+
+    if (argc >= 3) {
+
+        MaxThreads = (ULONG) atoi( argv[2] );
+    }
+
+    if (argc == 4) {
+
+        Seconds = (ULONG) atoi( argv[3] );
+    }
+
+    if ((MaxThreads == 0) || (MaxThreads > CTXBENCH_MAX_THREADS) || (Seconds == 0)) {
+
+        Usage();
+        return 1;
+    }
+
+    file = CreateFileA( FilePath,
+                        GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL );
+
+    if (file == INVALID_HANDLE_VALUE) {
+
+        printf( "ERROR: Opening %s: %u\n", FilePath, GetLastError() );
+        return 2;
+    }
+
+    CloseHandle( file );
+
+    //
+    //  The filter is detached from, and attached to, the volume by its
+    //  GUID name.
+    //
+
+    if (!GetVolumePathNameA( FilePath, volumePath, sizeof( volumePath ) ) ||
+        !GetVolumeNameForVolumeMountPointA( volumePath, volumeName, sizeof( volumeName ) ) ||
+        (MultiByteToWideChar( CP_ACP, 0, volumeName, -1, volume, ARRAYSIZE( volume ) ) == 0)) {
+
+        printf( "ERROR: Getting the volume of %s: %u\n", FilePath, GetLastError() );
+        return 2;
+    }
+
+    StartEvent = CreateEventA( NULL, TRUE, FALSE, NULL );
+
+    if (StartEvent == NULL) {
+
+        printf( "ERROR: Creating an event: %u\n", GetLastError() );
+        return 2;
+    }
+
+    QueryPerformanceFrequency( &Frequency );
+
+    printf( "up to %u threads, %u s per run\n\n", MaxThreads, Seconds );
+
+    for (configuration = 0; configuration < ConfigurationMax; configuration++) {
+
+        if (configuration == ConfigurationNoFilter) {
+
+            hr = FilterDetach( CTXBENCH_FILTER_NAME, volume, NULL );
+
+            if (IS_ERROR( hr )) {
+
+                printf( "ERROR: Detaching the filter from %ws: 0x%08x\n", volume, hr );
+                status = 2;
+                break;
+            }
+
+            detached = TRUE;
+        }
+
+        if (!RunConfiguration( configuration )) {
+
+            status = 3;
+            break;
+        }
+    }
+
+    if (detached) {
+
+        hr = FilterAttach( CTXBENCH_FILTER_NAME, volume, NULL, 0, NULL );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Attaching the filter to %ws again: 0x%08x\n", volume, hr );
+            status = 2;
+        }
+    }
+
+    CloseHandle( StartEvent );
+
+    return status;
+}
@@ -10,6 +10,13 @@ Abstract:
 
     This is the main file for the delete detection sample minifilter.
 
+    Deletes that are not part of a transaction are verified by a worker
+    thread rather than in post-cleanup, so that removing many files at once
+    is not slowed down by the verification. The worker finds the files by
+    their file IDs, so no file object is kept open for it. Detected deletes
+    are printed and, when a listener is connected to the filter port,
+    buffered in a ring of records that the listener reads in batches.
+
 
 Environment:
 
@@ -22,6 +29,7 @@ Environment:
 #include <fltKernel.h>
 #include <dontuse.h>
 #include <suppress.h>
+#include "deleteuk.h"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
@@ -30,6 +38,8 @@ Environment:
 #define DFDBG_TRACE_ERRORS              0x00000001
 #define DFDBG_TRACE_ROUTINES            0x00000002
 #define DFDBG_TRACE_OPERATION_STATUS    0x00000004
+#define DFDBG_TRACE_DELETES             0x00000008
+#define DFDBG_TRACE_NAMES               0x00000010
 
 #define DF_VOLUME_GUID_NAME_SIZE        48
 
@@ -39,12 +49,40 @@ Environment:
 #define DF_ERESOURCE_POOL_TAG           'sRfD'
 #define DF_DELETE_NOTIFY_POOL_TAG       'nDfD'
 #define DF_STRING_POOL_TAG              'rSfD'
+#define DF_PENDING_DELETE_POOL_TAG      'dPfD'
+#define DF_RECORD_POOL_TAG              'cRfD'
+#define DF_STREAM_INFO_POOL_TAG         'iSfD'
 
 #define DF_CONTEXT_POOL_TYPE            PagedPool
 
 #define DF_NOTIFICATION_MASK            (TRANSACTION_NOTIFY_COMMIT_FINALIZE | \
                                          TRANSACTION_NOTIFY_ROLLBACK)
 
+//
+//  Delete candidates handed to the worker are processed this many at a
+//  time. Past DF_MAX_PENDING_DELETES queued candidates post-cleanup
+//  verifies deletes itself, so that a worker that falls behind does not
+//  delay reports without bound. Queued candidates are hashed by file ID
+//  into DF_PENDING_DELETE_BUCKETS lists, a power of two.
+//
+
+#define DF_PENDING_DELETE_BATCH         64
+#define DF_MAX_PENDING_DELETES          16384
+#define DF_PENDING_DELETE_BUCKETS       256
+
+//
+//  Buffer for the streams of a file, when the worker looks for a deleted
+//  alternate data stream.
+//
+
+#define DF_STREAM_INFO_SIZE             PAGE_SIZE
+
+//
+//  Set in gListenerFlags while a listener is connected.
+//
+
+#define DF_LISTENER_CONNECTED           0x80000000
+
 
 //////////////////////////////////////////////////////////////////////////////
 //  Macros                                                                  //
@@ -67,7 +105,28 @@ Environment:
 //////////////////////////////////////////////////////////////////////////////
 
 PFLT_FILTER gFilterHandle;
-ULONG gTraceFlags = DFDBG_TRACE_ERRORS;
+ULONG gTraceFlags = DFDBG_TRACE_ERRORS | DFDBG_TRACE_DELETES;
+
+//
+//  Communication port for the listener, and the DF_LISTENER_* flags it
+//  connected with.
+//
+
+PFLT_PORT gServerPort;
+PFLT_PORT gClientPort;
+volatile LONG gListenerFlags;
+
+//
+//  Name printed for a stream whose name was not queried.
+//
+
+UNICODE_STRING gNoName = RTL_CONSTANT_STRING( L"<unnamed>" );
+
+//
+//  Name of the default data stream, as returned for FileStreamInformation.
+//
+
+UNICODE_STRING gDefaultStreamName = RTL_CONSTANT_STRING( L"::$DATA" );
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -95,6 +154,11 @@ typedef union _DF_FILE_REFERENCE {
         sizeof((FID).FileId128)             \
     )
 
+#define DfHashFileId(FID) (                                         \
+    (ULONG) (((FID).FileId64.Value ^ (FID).FileId64.UpperZeroes) &  \
+             (DF_PENDING_DELETE_BUCKETS - 1))                       \
+    )
+
 
 //////////////////////////////////////////////////////////////////////////////
 //  Types                                                                   //
@@ -237,6 +301,143 @@ typedef struct _DF_DELETE_NOTIFY {
 } DF_DELETE_NOTIFY, *PDF_DELETE_NOTIFY;
 
 
+//
+//  This structure represents a delete candidate, not in a transaction, that
+//  post-cleanup handed to the worker for verification. It is keyed by the
+//  file ID of the candidate, which the worker opens the file by, and holds
+//  references on the instance and the stream context.
+//
+
+typedef struct _DF_PENDING_DELETE {
+
+    //
+    //  Links to other DF_PENDING_DELETE structures in the queue, and in
+    //  the hash bucket of the file ID.
+    //
+
+    LIST_ENTRY Links;
+
+    LIST_ENTRY HashLinks;
+
+    PFLT_INSTANCE Instance;
+
+    PDF_STREAM_CONTEXT StreamContext;
+
+    DF_FILE_REFERENCE FileId;
+
+} DF_PENDING_DELETE, *PDF_PENDING_DELETE;
+
+
+//
+//  Queue of delete candidates waiting for the worker. A candidate already
+//  in the queue is not queued again when another handle to the same
+//  stream is cleaned up.
+//
+
+typedef struct _DF_PENDING_DELETE_QUEUE {
+
+    LIST_ENTRY List;
+
+    LIST_ENTRY Buckets[DF_PENDING_DELETE_BUCKETS];
+
+    ULONG Count;
+
+    //
+    //  TRUE while a work item is queued or running. It only goes back to
+    //  FALSE once the worker has found the queue empty.
+    //
+
+    BOOLEAN WorkerActive;
+
+    FAST_MUTEX Mutex;
+
+    PAGED_LOOKASIDE_LIST Lookaside;
+
+} DF_PENDING_DELETE_QUEUE, *PDF_PENDING_DELETE_QUEUE;
+
+
+//
+//  Ring of delete records waiting to be read by the listener. It only
+//  exists while a listener is connected.
+//
+
+typedef struct _DF_RECORD_RING {
+
+    PDF_DELETE_RECORD Records;
+
+    ULONG Capacity;
+
+    //
+    //  Index of the oldest record and number of records buffered.
+    //
+
+    ULONG Head;
+
+    ULONG Count;
+
+    //
+    //  Records overwritten since the listener last read.
+    //
+
+    ULONG LostCount;
+
+    ULONG NextSequenceNumber;
+
+    FAST_MUTEX Mutex;
+
+} DF_RECORD_RING, *PDF_RECORD_RING;
+
+
+DF_PENDING_DELETE_QUEUE gPendingDeletes;
+
+DF_RECORD_RING gRecordRing;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Listener State Helpers                                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+//
+//  Deletes need to be verified only if someone will hear about them: a
+//  listener, or the debugger while DFDBG_TRACE_DELETES is set, as it is by
+//  default.
+//
+
+FORCEINLINE
+BOOLEAN
+DfReportingEnabled (
+    VOID
+    )
+{
+    return (BOOLEAN) (FlagOn( gListenerFlags, DF_LISTENER_CONNECTED ) ||
+                      FlagOn( gTraceFlags, DFDBG_TRACE_DELETES ));
+}
+
+//
+//  Names are resolved only for consumers that use them. Otherwise deletes
+//  are identified by file ID.
+//
+
+FORCEINLINE
+BOOLEAN
+DfNamesRequested (
+    VOID
+    )
+{
+    return (BOOLEAN) (FlagOn( gListenerFlags, DF_LISTENER_FLAG_NAMES ) ||
+                      FlagOn( gTraceFlags, DFDBG_TRACE_NAMES ));
+}
+
+FORCEINLINE
+PUNICODE_STRING
+DfStreamName (
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+{
+    return (StreamContext->NameInfo != NULL) ? &StreamContext->NameInfo->Name : &gNoName;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //  Prototypes                                                              //
 //////////////////////////////////////////////////////////////////////////////
@@ -292,7 +493,7 @@ DfAllocateContext (
 
 NTSTATUS
 DfSetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _In_ FLT_CONTEXT_TYPE ContextType,
     _In_ PFLT_CONTEXT NewContext,
@@ -301,7 +502,7 @@ DfSetContext (
 
 NTSTATUS
 DfGetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _In_ FLT_CONTEXT_TYPE ContextType,
     _Outptr_ PFLT_CONTEXT *Context
@@ -309,7 +510,7 @@ DfGetContext (
 
 NTSTATUS
 DfGetOrSetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _Outptr_ _Pre_valid_ PFLT_CONTEXT *Context,
     _In_ FLT_CONTEXT_TYPE ContextType
@@ -351,23 +552,31 @@ DfFreeUnicodeString (
 
 NTSTATUS
 DfBuildFileIdString (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ PDF_STREAM_CONTEXT StreamContext,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_FILE_REFERENCE FileId,
     _Out_ PUNICODE_STRING String
     );
 
+NTSTATUS
+DfOpenByFileId (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_FILE_REFERENCE FileId,
+    _In_opt_ PFILE_OBJECT TransactionFileObject,
+    _Out_ PHANDLE Handle,
+    _Outptr_opt_ PFILE_OBJECT *FileObject
+    );
+
 NTSTATUS
 DfDetectDeleteByFileId (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
     _In_ PDF_STREAM_CONTEXT StreamContext
     );
 
 NTSTATUS
 DfIsFileDeleted (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
     _In_ PDF_STREAM_CONTEXT StreamContext,
     _In_ BOOLEAN IsTransaction
     );
@@ -381,6 +590,7 @@ DfAddTransDeleteNotify (
 
 VOID
 DfNotifyDelete (
+    _In_ PFLT_INSTANCE Instance,
     _In_ PDF_STREAM_CONTEXT StreamContext,
     _In_ BOOLEAN IsFile,
     _Inout_opt_ PDF_TRANSACTION_CONTEXT TransactionContext
@@ -388,15 +598,94 @@ DfNotifyDelete (
 
 VOID
 DfNotifyDeleteOnTransactionEnd (
+    _In_ PFLT_INSTANCE Instance,
     _In_ PDF_DELETE_NOTIFY DeleteNotify,
     _In_ BOOLEAN Commit
     );
 
 NTSTATUS
 DfProcessDelete (
-    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _In_opt_ PKTRANSACTION Transaction,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    );
+
+VOID
+DfCheckDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _In_opt_ PKTRANSACTION Transaction,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    );
+
+NTSTATUS
+DfQueuePendingDelete (
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ PDF_STREAM_CONTEXT    StreamContext
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    );
+
+VOID
+DfFreePendingDelete (
+    _In_ PDF_PENDING_DELETE PendingDelete
+    );
+
+NTSTATUS
+DfIsStreamPresent (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ HANDLE FileHandle,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    );
+
+VOID
+DfVerifyPendingDelete (
+    _In_ PDF_PENDING_DELETE PendingDelete
+    );
+
+VOID
+DfPendingDeleteWorker (
+    _In_ PFLT_GENERIC_WORKITEM FltWorkItem,
+    _In_ PVOID FltObject,
+    _In_opt_ PVOID Context
+    );
+
+VOID
+DfReportDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_STREAM_CONTEXT StreamContext,
+    _In_ ULONG Flags
+    );
+
+NTSTATUS
+DfPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
+    );
+
+VOID
+DfPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
+    );
+
+NTSTATUS
+DfPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+NTSTATUS
+DfGetRecords (
+    _Out_writes_bytes_to_(OutputBufferSize,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
     );
 
 FLT_PREOP_CALLBACK_STATUS
@@ -453,13 +742,14 @@ DfTransactionNotificationCallback (
 
 NTSTATUS
 DfGetVolumeGuidName (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _Inout_ PUNICODE_STRING VolumeGuidName
     );
 
 NTSTATUS
 DfGetFileId (
-    _In_  PFLT_CALLBACK_DATA Data,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
     _Inout_ PDF_STREAM_CONTEXT StreamContext
     );
 
@@ -487,6 +777,7 @@ DfGetFileId (
 #pragma alloc_text(PAGE, DfAllocateUnicodeString)
 #pragma alloc_text(PAGE, DfFreeUnicodeString)
 #pragma alloc_text(PAGE, DfBuildFileIdString)
+#pragma alloc_text(PAGE, DfOpenByFileId)
 #pragma alloc_text(PAGE, DfDetectDeleteByFileId)
 #pragma alloc_text(PAGE, DfIsFileDeleted)
 #pragma alloc_text(PAGE, DfAddTransDeleteNotify)
@@ -502,6 +793,17 @@ DfGetFileId (
 #pragma alloc_text(PAGE, DfTransactionNotificationCallback)
 #pragma alloc_text(PAGE, DfGetVolumeGuidName)
 #pragma alloc_text(PAGE, DfGetFileId)
+#pragma alloc_text(PAGE, DfCheckDelete)
+#pragma alloc_text(PAGE, DfQueuePendingDelete)
+#pragma alloc_text(PAGE, DfFreePendingDelete)
+#pragma alloc_text(PAGE, DfIsStreamPresent)
+#pragma alloc_text(PAGE, DfVerifyPendingDelete)
+#pragma alloc_text(PAGE, DfPendingDeleteWorker)
+#pragma alloc_text(PAGE, DfReportDelete)
+#pragma alloc_text(PAGE, DfPortConnect)
+#pragma alloc_text(PAGE, DfPortDisconnect)
+#pragma alloc_text(PAGE, DfPortMessage)
+#pragma alloc_text(PAGE, DfGetRecords)
 #endif
 
 
@@ -627,7 +929,11 @@ Return Value:
 
 --*/
 {
+    PSECURITY_DESCRIPTOR sd;
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING portName;
     NTSTATUS status;
+    ULONG i;
 
     UNREFERENCED_PARAMETER( RegistryPath );
 
@@ -640,6 +946,29 @@ Return Value:
 
     ExInitializeDriverRuntime( DrvRtPoolNxOptIn );
 
+    //
+    //  Initialize the pending delete queue and the record ring.
+    //
+
+    InitializeListHead( &gPendingDeletes.List );
+
+    for (i = 0; i < DF_PENDING_DELETE_BUCKETS; i++) {
+
+        InitializeListHead( &gPendingDeletes.Buckets[i] );
+    }
+
+    ExInitializeFastMutex( &gPendingDeletes.Mutex );
+
+    ExInitializePagedLookasideList( &gPendingDeletes.Lookaside,
+                                    NULL,
+                                    NULL,
+                                    0,
+                                    sizeof(DF_PENDING_DELETE),
+                                    DF_PENDING_DELETE_POOL_TAG,
+                                    0 );
+
+    ExInitializeFastMutex( &gRecordRing.Mutex );
+
     //
     //  Register with FltMgr to tell it our callback routines
     //
@@ -650,18 +979,69 @@ Return Value:
 
     ASSERT( NT_SUCCESS( status ) );
 
-    if (NT_SUCCESS( status )) {
+    if (!NT_SUCCESS( status )) {
 
-        //
-        //  Start filtering i/o
-        //
+        goto _exit;
+    }
 
-        status = FltStartFiltering( gFilterHandle );
+    //
+    //  Create the port listeners connect to. Only administrators and the
+    //  system can connect.
+    //
 
-        if (!NT_SUCCESS( status )) {
+    status = FltBuildDefaultSecurityDescriptor( &sd,
+                                                FLT_PORT_ALL_ACCESS );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto _exit;
+    }
+
+    RtlInitUnicodeString( &portName, DF_PORT_NAME );
+
+    InitializeObjectAttributes( &oa,
+                                &portName,
+                                OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                                NULL,
+                                sd );
+
+    status = FltCreateCommunicationPort( gFilterHandle,
+                                         &gServerPort,
+                                         &oa,
+                                         NULL,
+                                         DfPortConnect,
+                                         DfPortDisconnect,
+                                         DfPortMessage,
+                                         1 );
+
+    FltFreeSecurityDescriptor( sd );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto _exit;
+    }
+
+    //
+    //  Start filtering i/o
+    //
+
+    status = FltStartFiltering( gFilterHandle );
+
+_exit:
+
+    if (!NT_SUCCESS( status )) {
+
+        if (NULL != gServerPort) {
+
+            FltCloseCommunicationPort( gServerPort );
+        }
+
+        if (NULL != gFilterHandle) {
 
             FltUnregisterFilter( gFilterHandle );
         }
+
+        ExDeletePagedLookasideList( &gPendingDeletes.Lookaside );
     }
 
     return status;
@@ -696,8 +1076,20 @@ Return Value:
     DF_DBG_PRINT( DFDBG_TRACE_ROUTINES,
                   "delete!DfUnload: Entered\n" );
 
+    //
+    //  Closing the server port disconnects the listener, which frees the
+    //  record ring. Unregistering waits for the pending delete worker.
+    //
+
+    FltCloseCommunicationPort( gServerPort );
+
     FltUnregisterFilter( gFilterHandle );
 
+    ASSERT( IsListEmpty( &gPendingDeletes.List ) );
+    ASSERT( NULL == gRecordRing.Records );
+
+    ExDeletePagedLookasideList( &gPendingDeletes.Lookaside );
+
     return STATUS_SUCCESS;
 }
 
@@ -994,7 +1386,7 @@ Return Value:
 
 NTSTATUS
 DfSetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _In_ FLT_CONTEXT_TYPE ContextType,
     _In_ PFLT_CONTEXT NewContext,
@@ -1008,14 +1400,12 @@ Routine Description:
 
 Arguments:
 
-    FltObjects    - Pointer to the FLT_RELATED_OBJECTS data structure containing
-                    opaque handles to this filter, instance and its associated volume.
+    Instance      - Opaque instance pointer.
 
     Target        - Pointer to the target to which we want to attach the
                     context. It will actually be either a FILE_OBJECT or
                     a KTRANSACTION. For instance contexts, it's ignored, as
-                    the target is the FLT_INSTANCE itself, obtained from
-                    Data->Iopb->TargetInstance.
+                    the target is the FLT_INSTANCE itself.
 
     ContextType   - Type of context to get/allocate/attach. Also used to
                     disambiguate the target/context type as this minifilter
@@ -1038,7 +1428,7 @@ Return Value:
 
         case FLT_STREAM_CONTEXT:
 
-            return FltSetStreamContext( FltObjects->Instance,
+            return FltSetStreamContext( Instance,
                                         (PFILE_OBJECT)Target,
                                         FLT_SET_CONTEXT_KEEP_IF_EXISTS,
                                         NewContext,
@@ -1046,7 +1436,7 @@ Return Value:
 
         case FLT_TRANSACTION_CONTEXT:
 
-            return FltSetTransactionContext( FltObjects->Instance,
+            return FltSetTransactionContext( Instance,
                                              (PKTRANSACTION)Target,
                                              FLT_SET_CONTEXT_KEEP_IF_EXISTS,
                                              NewContext,
@@ -1054,7 +1444,7 @@ Return Value:
 
         case FLT_INSTANCE_CONTEXT:
 
-            return FltSetInstanceContext( FltObjects->Instance,
+            return FltSetInstanceContext( Instance,
                                           FLT_SET_CONTEXT_KEEP_IF_EXISTS,
                                           NewContext,
                                           OldContext );
@@ -1070,7 +1460,7 @@ Return Value:
 
 NTSTATUS
 DfGetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _In_ FLT_CONTEXT_TYPE ContextType,
     _Outptr_ PFLT_CONTEXT *Context
@@ -1083,14 +1473,12 @@ Routine Description:
 
 Arguments:
 
-    FltObjects    - Pointer to the FLT_RELATED_OBJECTS data structure containing
-                    opaque handles to this filter, instance and its associated volume.
+    Instance      - Opaque instance pointer.
 
     Target        - Pointer to the target from which we want to obtain the
                     context. It will actually be either a FILE_OBJECT or
                     a KTRANSACTION. For instance contexts, it's ignored, as
-                    the target is the FLT_INSTANCE itself, obtained from
-                    Data->Iopb->TargetInstance.
+                    the target is the FLT_INSTANCE itself.
 
     ContextType   - Type of context to get. Also used to disambiguate
                     the target/context type as this minifilter
@@ -1110,19 +1498,19 @@ Return Value:
 
         case FLT_STREAM_CONTEXT:
 
-            return FltGetStreamContext( FltObjects->Instance,
+            return FltGetStreamContext( Instance,
                                         (PFILE_OBJECT)Target,
                                         Context );
 
         case FLT_TRANSACTION_CONTEXT:
 
-            return FltGetTransactionContext( FltObjects->Instance,
+            return FltGetTransactionContext( Instance,
                                              (PKTRANSACTION)Target,
                                              Context );
 
         case FLT_INSTANCE_CONTEXT:
 
-            return FltGetInstanceContext( FltObjects->Instance,
+            return FltGetInstanceContext( Instance,
                                           Context );
 
         default:
@@ -1134,7 +1522,7 @@ Return Value:
 
 NTSTATUS
 DfGetOrSetContext (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _When_(ContextType==FLT_INSTANCE_CONTEXT, _In_opt_) _When_(ContextType!=FLT_INSTANCE_CONTEXT, _In_) PVOID Target,
     _Outptr_ _Pre_valid_ PFLT_CONTEXT *Context,
     _In_ FLT_CONTEXT_TYPE ContextType
@@ -1166,8 +1554,7 @@ Routine Description:
 
 Arguments:
 
-    FltObjects    - Pointer to the FLT_RELATED_OBJECTS data structure containing
-                    opaque handles to this filter, instance and its associated volume.
+    Instance      - Opaque instance pointer.
 
     Target        - Pointer to the target to which we want to attach the
                     context. It will actually be either a FILE_OBJECT or
@@ -1202,7 +1589,7 @@ Return Value:
     //  Is there already a context attached to the target?
     //
 
-    status = DfGetContext( FltObjects,
+    status = DfGetContext( Instance,
                            Target,
                            ContextType,
                            &oldContext );
@@ -1269,7 +1656,7 @@ Return Value:
     //  At this point we should have a context to set on the target (newContext).
     //
 
-    status = DfSetContext( FltObjects,
+    status = DfSetContext( Instance,
                            Target,
                            ContextType,
                            newContext,
@@ -1312,7 +1699,7 @@ Return Value:
 
     if (FLT_TRANSACTION_CONTEXT == ContextType) {
 
-        status = FltEnlistInTransaction( FltObjects->Instance,
+        status = FltEnlistInTransaction( Instance,
                                          (PKTRANSACTION)Target,
                                          newContext,
                                          DF_NOTIFICATION_MASK );
@@ -1542,7 +1929,8 @@ Return Value:
 
 NTSTATUS
 DfGetFileId (
-    _In_  PFLT_CALLBACK_DATA Data,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
     _Inout_ PDF_STREAM_CONTEXT StreamContext
     )
 /*++
@@ -1553,7 +1941,9 @@ Routine Description:
 
 Arguments:
 
-    Data  - Pointer to FLT_CALLBACK_DATA.
+    Instance - Opaque instance pointer.
+
+    FileObject - File object for the stream.
 
     StreamContext - Pointer to stream context that will receive the file
                     ID.
@@ -1582,8 +1972,8 @@ Return Value:
         //  Querying for FileInternalInformation gives you the file ID.
         //
 
-        status = FltQueryInformationFile( Data->Iopb->TargetInstance,
-                                          Data->Iopb->TargetFileObject,
+        status = FltQueryInformationFile( Instance,
+                                          FileObject,
                                           &fileInternalInformation,
                                           sizeof(FILE_INTERNAL_INFORMATION),
                                           FileInternalInformation,
@@ -1602,8 +1992,8 @@ Return Value:
 
                 FILE_ID_INFORMATION fileIdInformation;
 
-                status = FltQueryInformationFile( Data->Iopb->TargetInstance,
-                                                  Data->Iopb->TargetFileObject,
+                status = FltQueryInformationFile( Instance,
+                                                  FileObject,
                                                   &fileIdInformation,
                                                   sizeof(FILE_ID_INFORMATION),
                                                   FileIdInformation,
@@ -1736,7 +2126,7 @@ Arguments:
 
 NTSTATUS
 DfGetVolumeGuidName (
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
     _Inout_ PUNICODE_STRING VolumeGuidName
     )
 /*++
@@ -1754,9 +2144,7 @@ Routine Description:
 
 Arguments:
 
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
-        opaque handles to this filter, instance, its associated volume and
-        file object.
+    Instance - Opaque instance pointer for the volume.
 
     VolumeGuidName - Pointer to UNICODE_STRING, returning the volume GUID name.
 
@@ -1771,15 +2159,15 @@ Return Value:
     NTSTATUS status;
     PUNICODE_STRING sourceGuidName;
     PDF_INSTANCE_CONTEXT instanceContext = NULL;
+    PFLT_VOLUME volume;
 
     PAGED_CODE();
 
     //
-    //  Obtain an instance context. Target is NULL for instance context, as
-    //  the FLT_INSTANCE can be obtained from the FltObjects.
+    //  Obtain an instance context. Target is NULL for instance context.
     //
 
-    status = DfGetOrSetContext( FltObjects,
+    status = DfGetOrSetContext( Instance,
                                 NULL,
                                 &instanceContext,
                                 FLT_INSTANCE_CONTEXT );
@@ -1822,15 +2210,25 @@ Return Value:
                               __FUNCTION__,
                               status );
 
+                FltReleaseContext( instanceContext );
+
                 return status;
             }
 
             //  while there is no guid name, don't do the open by id deletion logic.
             //  (it's actually better to defer obtaining the volume GUID name up to
             //   the point when we actually need it, in the open by ID scenario.)
-            status = FltGetVolumeGuidName( FltObjects->Volume,
-                                           &tempString,
-                                           NULL );
+            status = FltGetVolumeFromInstance( Instance,
+                                               &volume );
+
+            if (NT_SUCCESS( status )) {
+
+                status = FltGetVolumeGuidName( volume,
+                                               &tempString,
+                                               NULL );
+
+                FltObjectDereference( volume );
+            }
 
             if (!NT_SUCCESS( status )) {
 
@@ -1841,6 +2239,8 @@ Return Value:
 
                 DfFreeUnicodeString( &tempString );
 
+                FltReleaseContext( instanceContext );
+
                 return status;
             }
 
@@ -1904,9 +2304,8 @@ Return Value:
 
 NTSTATUS
 DfBuildFileIdString (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ PDF_STREAM_CONTEXT StreamContext,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_FILE_REFERENCE FileId,
     _Out_ PUNICODE_STRING String
     )
 /*++
@@ -1915,18 +2314,11 @@ Routine Description:
 
     This helper routine builds a string used to open a file by its ID.
 
-    It will assume the file ID is properly loaded in the stream context
-    (StreamContext->FileId).
-
 Arguments:
 
-    Data - Pointer to FLT_CALLBACK_DATA.
+    Instance - Opaque instance pointer.
 
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
-        opaque handles to this filter, instance, its associated volume and
-        file object.
-
-    StreamContext - Pointer to the stream context.
+    FileId - The file ID.
 
     String - Pointer to UNICODE_STRING (output).
 
@@ -1950,23 +2342,6 @@ Return Value:
     //  3. The File ID.
     //
 
-    //
-    //  Make sure the file ID is loaded in the StreamContext.  Note that if the
-    //  file has been deleted DfGetFileId will return STATUS_FILE_DELETED.
-    //  Since we're interested in detecting whether the file has been deleted
-    //  that's fine; the open-by-ID will not actually take place.  We have to
-    //  ensure it is loaded before building the string length below since we
-    //  may get either a 64-bit or 128-bit file ID back.
-    //
-
-    status = DfGetFileId( Data,
-                          StreamContext );
-
-    if (!NT_SUCCESS( status )) {
-
-        return status;
-    }
-
     //
     //  First add the lengths of 1, 2, 3 and allocate accordingly.
     //  Note that ReFS understands both 64- and 128-bit file IDs when opening
@@ -1975,7 +2350,7 @@ Return Value:
 
     String->MaximumLength = DF_VOLUME_GUID_NAME_SIZE * sizeof(WCHAR) +
                             sizeof(WCHAR) +
-                            DfSizeofFileId( StreamContext->FileId );
+                            DfSizeofFileId( *FileId );
 
     status = DfAllocateUnicodeString( String );
 
@@ -1989,7 +2364,7 @@ Return Value:
     //
 
     // obtain volume GUID name here and cache it in the InstanceContext.
-    status = DfGetVolumeGuidName( FltObjects,
+    status = DfGetVolumeGuidName( Instance,
                                   String );
 
     if (!NT_SUCCESS( status )) {
@@ -2004,10 +2379,10 @@ Return Value:
     //
 
     RtlCopyMemory( Add2Ptr( String->Buffer, String->Length ),
-                   &StreamContext->FileId,
-                   DfSizeofFileId( StreamContext->FileId ));
+                   FileId,
+                   DfSizeofFileId( *FileId ));
 
-    String->Length += DfSizeofFileId( StreamContext->FileId );
+    String->Length += DfSizeofFileId( *FileId );
 
     ASSERT( String->Length == String->MaximumLength );
 
@@ -2016,34 +2391,37 @@ Return Value:
 
 
 NTSTATUS
-DfDetectDeleteByFileId (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ PDF_STREAM_CONTEXT StreamContext
+DfOpenByFileId (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_FILE_REFERENCE FileId,
+    _In_opt_ PFILE_OBJECT TransactionFileObject,
+    _Out_ PHANDLE Handle,
+    _Outptr_opt_ PFILE_OBJECT *FileObject
     )
 /*++
 
 Routine Description:
 
-    This helper routine detects a deleted file by attempting to open it using
-    its file ID.
+    This helper routine opens the default stream of a file by its ID, below
+    this filter, for reading attributes only.
 
-    If the file is successfully opened this routine closes the file before returning.
+    The caller closes the handle with FltClose and, if it asked for the file
+    object, dereferences it.
 
 Arguments:
 
-    Data - Pointer to FLT_CALLBACK_DATA.
+    Instance - Opaque instance pointer.
 
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
-        opaque handles to this filter, instance, its associated volume and
-        file object.
+    FileId - The file ID.
 
-    StreamContext - Pointer to the stream context.
+    TransactionFileObject - A file object whose transaction the open is done
+        in, or NULL to open the file outside of any transaction.
 
-Return Value:
+    Handle - Receives the handle.
 
-    STATUS_FILE_DELETED - Returned through DfBuildFileIdString if the file has
-                          been deleted.
+    FileObject - Optionally receives a referenced file object for the handle.
+
+Return Value:
 
     STATUS_INVALID_PARAMETER - Returned from FltCreateFileEx2 when opening by ID
                                a file that doesn't exist.
@@ -2051,29 +2429,21 @@ Return Value:
     STATUS_DELETE_PENDING - The file has been set to be deleted when the last handle
                             goes away, but there are still open handles.
 
-    Also any other NTSTATUS returned from DfBuildFileIdString, FltCreateFileEx2,
-    or FltClose.
+    Also any other NTSTATUS returned from DfBuildFileIdString or
+    FltCreateFileEx2.
 
 --*/
 {
     NTSTATUS status;
     UNICODE_STRING fileIdString;
-    HANDLE handle;
     OBJECT_ATTRIBUTES objectAttributes;
     IO_STATUS_BLOCK ioStatus;
     IO_DRIVER_CREATE_CONTEXT driverCreateContext;
 
     PAGED_CODE();
 
-    //
-    //  First build the file ID string.  Note that this may fail with STATUS_FILE_DELETED
-    //  and short-circuit our open-by-ID.  Since we're really trying to see if
-    //  the file is deleted, that's perfectly okay.
-    //
-
-    status = DfBuildFileIdString( Data,
-                                  FltObjects,
-                                  StreamContext,
+    status = DfBuildFileIdString( Instance,
+                                  FileId,
                                   &fileIdString );
 
     if (!NT_SUCCESS( status )) {
@@ -2089,19 +2459,23 @@ Return Value:
 
     //
     //  It is important to initialize the IO_DRIVER_CREATE_CONTEXT structure's
-    //  TxnParameters. We'll always want to do this open on behalf of a
-    //  transaction because opening the file by ID is the method we use to
+    //  TxnParameters. When we're in a transaction we want to do this open on
+    //  behalf of it, because opening the file by ID is the method we use to
     //  detect if the whole file still exists when we're in a transaction.
     //
 
     IoInitializeDriverCreateContext( &driverCreateContext );
-    driverCreateContext.TxnParameters =
-        IoGetTransactionParameterBlock( Data->Iopb->TargetFileObject );
+
+    if (NULL != TransactionFileObject) {
+
+        driverCreateContext.TxnParameters =
+            IoGetTransactionParameterBlock( TransactionFileObject );
+    }
 
     status = FltCreateFileEx2( gFilterHandle,
-                               Data->Iopb->TargetInstance,
-                               &handle,
-                               NULL,
+                               Instance,
+                               Handle,
+                               FileObject,
                                FILE_READ_ATTRIBUTES,
                                &objectAttributes,
                                &ioStatus,
@@ -2115,14 +2489,84 @@ Return Value:
                                IO_IGNORE_SHARE_ACCESS_CHECK,
                                &driverCreateContext );
 
+    DfFreeUnicodeString( &fileIdString );
+
+    return status;
+}
+
+
+NTSTATUS
+DfDetectDeleteByFileId (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This helper routine detects a deleted file by attempting to open it using
+    its file ID.
+
+    If the file is successfully opened this routine closes the file before returning.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    FileObject - File object for the stream.
+
+    StreamContext - Pointer to the stream context.
+
+Return Value:
+
+    STATUS_FILE_DELETED - Returned through DfGetFileId if the file has
+                          been deleted.
+
+    STATUS_INVALID_PARAMETER - Returned from FltCreateFileEx2 when opening by ID
+                               a file that doesn't exist.
+
+    STATUS_DELETE_PENDING - The file has been set to be deleted when the last handle
+                            goes away, but there are still open handles.
+
+    Also any other NTSTATUS returned from DfGetFileId, DfOpenByFileId,
+    or FltClose.
+
+--*/
+{
+    NTSTATUS status;
+    HANDLE handle;
+
+    PAGED_CODE();
+
+    //
+    //  Make sure the file ID is loaded in the StreamContext.  Note that if the
+    //  file has been deleted DfGetFileId will return STATUS_FILE_DELETED.
+    //  Since we're interested in detecting whether the file has been deleted
+    //  that's fine; the open-by-ID will not actually take place.
+    //
+
+    status = DfGetFileId( Instance,
+                          FileObject,
+                          StreamContext );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    status = DfOpenByFileId( Instance,
+                             &StreamContext->FileId,
+                             FileObject,
+                             &handle,
+                             NULL );
+
     if (NT_SUCCESS( status )) {
 
         status = FltClose( handle );
         ASSERT( NT_SUCCESS( status ) );
     }
 
-    DfFreeUnicodeString( &fileIdString );
-
     return status;
 }
 
@@ -2133,8 +2577,8 @@ Return Value:
 
 NTSTATUS
 DfIsFileDeleted (
-    _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
     _In_ PDF_STREAM_CONTEXT StreamContext,
     _In_ BOOLEAN IsTransaction
     )
@@ -2151,11 +2595,9 @@ Routine Description:
 
 Arguments:
 
-    Data - Pointer to the filter callbackData that is passed to us.
+    Instance - Opaque instance pointer.
 
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
-        opaque handles to this filter, instance, its associated volume and
-        file object.
+    FileObject - File object for the deleted stream.
 
     StreamContext - Pointer to the stream context.
 
@@ -2181,7 +2623,7 @@ Return Value:
     //  We need to know whether we're on ReFS or NTFS.
     //
 
-    status = FltGetFileSystemType( FltObjects->Instance,
+    status = FltGetFileSystemType( Instance,
                                    &fileSystemType );
 
     if (status != STATUS_SUCCESS) {
@@ -2201,8 +2643,8 @@ Return Value:
     if (IsTransaction ||
         (fileSystemType == FLT_FSTYPE_REFS)) {
 
-        status = DfDetectDeleteByFileId( Data,
-                                         FltObjects,
+        status = DfDetectDeleteByFileId( Instance,
+                                         FileObject,
                                          StreamContext );
 
         switch (status) {
@@ -2239,8 +2681,8 @@ Return Value:
         //  file is a cheaper alternative compared to opening the file by ID.
         //
 
-        status = FltFsControlFile( Data->Iopb->TargetInstance,
-                                   Data->Iopb->TargetFileObject,
+        status = FltFsControlFile( Instance,
+                                   FileObject,
                                    FSCTL_GET_OBJECT_ID,
                                    NULL,
                                    0,
@@ -2250,312 +2692,1448 @@ Return Value:
 
         switch (status) {
 
-            case STATUS_OBJECTID_NOT_FOUND:
+            case STATUS_OBJECTID_NOT_FOUND:
+
+                //
+                //  Getting back STATUS_OBJECTID_NOT_FOUND means the file
+                //  still exists, it just doesn't have an object ID.
+
+                return STATUS_SUCCESS;
+
+            default:
+
+                //
+                //  Else we just get back STATUS_FILE_DELETED if the file
+                //  doesn't exist anymore, or some error status, so no
+                //  status conversion is necessary.
+                //
+
+                NOTHING;
+        }
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+DfAddTransDeleteNotify (
+    _Inout_ PDF_STREAM_CONTEXT StreamContext,
+    _Inout_ PDF_TRANSACTION_CONTEXT TransactionContext,
+    _In_ BOOLEAN FileDelete
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a pending deletion notification (DF_DELETE_NOTIFY)
+    object to the transaction context DeleteNotifyList. It is called from
+    DfNotifyDelete when a file or stream gets deleted in a transaction.
+
+Arguments:
+
+    StreamContext - Pointer to the stream context.
+
+    TransactionContext - Pointer to the transaction context.
+
+    FileDelete - TRUE if this is a FILE deletion, FALSE if it's a STREAM
+                 deletion.
+
+Return Value:
+
+    STATUS_SUCCESS.
+
+--*/
+{
+    PDF_DELETE_NOTIFY deleteNotify;
+
+    PAGED_CODE();
+
+    ASSERT( NULL != TransactionContext->Resource );
+
+    ASSERT( NULL != StreamContext );
+
+    deleteNotify = ExAllocatePoolWithTag( DF_CONTEXT_POOL_TYPE,
+                                          sizeof(DF_DELETE_NOTIFY),
+                                          DF_DELETE_NOTIFY_POOL_TAG );
+
+    if (NULL == deleteNotify) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( deleteNotify, sizeof(DF_DELETE_NOTIFY) );
+
+    FltReferenceContext( StreamContext );
+    deleteNotify->StreamContext = StreamContext;
+    deleteNotify->FileDelete = FileDelete;
+
+    FltAcquireResourceExclusive( TransactionContext->Resource );
+
+    InsertTailList( &TransactionContext->DeleteNotifyList,
+                    &deleteNotify->Links );
+
+    FltReleaseResource( TransactionContext->Resource );
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DfNotifyDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_STREAM_CONTEXT StreamContext,
+    _In_ BOOLEAN IsFile,
+    _Inout_opt_ PDF_TRANSACTION_CONTEXT TransactionContext
+    )
+/*++
+
+Routine Description:
+
+    This routine does the processing after it is verified that a file or
+    stream were deleted. It sorts out whether it's a file or a stream delete,
+    whether this is in a transacted context or not, and issues the
+    appropriate notifications. Deletions outside of a transaction are
+    reported to the listener right away; transacted ones when the
+    transaction commits.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    StreamContext - Pointer to the stream context of the deleted file/stream.
+
+    IsFile - TRUE if deleting a file, FALSE for an alternate data stream.
+
+    TransactionContext - The transaction context. Present if in a transaction,
+                         NULL otherwise.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (InterlockedIncrement( &StreamContext->IsNotified ) <= 1) {
+
+        if (IsFile) {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          "delete!DfNotifyDelete: "
+                          "A file \"%wZ\" (%p, file ID %016I64x%016I64x) has been",
+                          DfStreamName( StreamContext ),
+                          StreamContext,
+                          StreamContext->FileId.FileId64.UpperZeroes,
+                          StreamContext->FileId.FileId64.Value );
+
+        } else {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          "delete!DfNotifyDelete: "
+                          "An alternate data stream \"%wZ\" (%p, file ID %016I64x%016I64x) has been",
+                          DfStreamName( StreamContext ),
+                          StreamContext,
+                          StreamContext->FileId.FileId64.UpperZeroes,
+                          StreamContext->FileId.FileId64.Value );
+        }
+
+        //
+        //  Flag that a delete has been notified on this file/stream.
+        //
+
+        if (NULL == TransactionContext) {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          " deleted!\n" );
+
+            DfReportDelete( Instance,
+                            StreamContext,
+                            IsFile ? DF_RECORD_FILE : 0 );
+
+        } else {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          " deleted in a transaction!\n" );
+
+            DfAddTransDeleteNotify( StreamContext,
+                                    TransactionContext,
+                                    IsFile );
+        }
+    }
+}
+
+
+VOID
+DfNotifyDeleteOnTransactionEnd (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_DELETE_NOTIFY DeleteNotify,
+    _In_ BOOLEAN Commit
+    )
+/*++
+
+Routine Description:
+
+    This routine is called by the transaction notification callback to issue
+    the proper notifications for a file that has been deleted in the context
+    of that transaction.
+    The file will be reported as finally deleted, if the transaction was
+    committed, or "saved" if the transaction was rolled back.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    DeleteNotify - Pointer to the DF_DELETE_NOTIFY object that contains the
+                   data necessary for issuing this notification.
+
+    Commit       - TRUE if the transaction was committed, FALSE if it was
+                   rolled back.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (DeleteNotify->FileDelete) {
+
+        DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                      "delete!DfTransactionNotificationCallback: "
+                      "A file \"%wZ\" (%p, file ID %016I64x%016I64x) has been",
+                      DfStreamName( DeleteNotify->StreamContext ),
+                      DeleteNotify->StreamContext,
+                      DeleteNotify->StreamContext->FileId.FileId64.UpperZeroes,
+                      DeleteNotify->StreamContext->FileId.FileId64.Value );
+
+    } else {
+
+        DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                      "delete!DfTransactionNotificationCallback: "
+                      "An alternate data stream \"%wZ\" (%p, file ID %016I64x%016I64x) has been",
+                      DfStreamName( DeleteNotify->StreamContext ),
+                      DeleteNotify->StreamContext,
+                      DeleteNotify->StreamContext->FileId.FileId64.UpperZeroes,
+                      DeleteNotify->StreamContext->FileId.FileId64.Value );
+    }
+
+    if (Commit) {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          " deleted due to a transaction commit!\n" );
+
+            DfReportDelete( Instance,
+                            DeleteNotify->StreamContext,
+                            DF_RECORD_TRANSACTED |
+                            (DeleteNotify->FileDelete ? DF_RECORD_FILE : 0) );
+
+    } else {
+
+            DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                          " saved due to a transaction rollback!\n" );
+    }
+}
+
+
+NTSTATUS
+DfProcessDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _In_opt_ PKTRANSACTION Transaction,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine does the processing after it is verified that a file or
+    stream were deleted. It sorts out whether it's a file or a stream delete,
+    whether this is in a transacted context or not, and issues the
+    appropriate notifications.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    FileObject - File object for the deleted stream.
+
+    Transaction - The transaction the cleanup was done in, if any.
+
+    StreamContext - Pointer to the stream context of the deleted file/stream.
+
+Return Value:
+
+    STATUS_SUCCESS.
+
+--*/
+{
+    BOOLEAN isTransaction;
+    BOOLEAN isFileDeleted = FALSE;
+    NTSTATUS status;
+    PDF_TRANSACTION_CONTEXT transactionContext = NULL;
+
+	PAGED_CODE();
+
+    //  Is this in a transacted context?
+    isTransaction = (NULL != Transaction);
+
+    if (isTransaction) {
+        DF_DBG_PRINT( DFDBG_TRACE_DELETES,
+                      "delete!DfProcessDelete: In a transaction!\n" );
+
+        status = DfGetOrSetContext( Instance,
+                                    Transaction,
+                                    &transactionContext,
+                                    FLT_TRANSACTION_CONTEXT );
+
+        if (!NT_SUCCESS( status )) {
+
+            return status;
+        }
+    }
+
+    //
+    //  Notify deletion. If this is an Alternate Data Stream being deleted,
+    //  check if the whole file was deleted (by calling DfIsFileDeleted) as
+    //  this could be the last handle to a delete-pending file.
+    //
+
+    status = DfIsFileDeleted( Instance,
+                              FileObject,
+                              StreamContext,
+                              isTransaction );
+
+    if (STATUS_FILE_DELETED == status) {
+
+        isFileDeleted = TRUE;
+        status = STATUS_SUCCESS;
+
+    } else if (!NT_SUCCESS( status )) {
+
+        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+                      "delete!%s: DfIsFileDeleted returned 0x%08x!\n",
+                      __FUNCTION__,
+                      status );
+
+        goto _exit;
+    }
+
+    DfNotifyDelete( Instance,
+                    StreamContext,
+                    isFileDeleted,
+                    transactionContext );
+
+_exit:
+
+    if (NULL != transactionContext) {
+
+        FltReleaseContext( transactionContext );
+    }
+
+    return status;
+}
+
+
+VOID
+DfCheckDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _In_opt_ PKTRANSACTION Transaction,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a deletion candidate was deleted by its last
+    cleanup and, if so, notifies the deletion. It is called from the
+    pending delete worker, or from post-cleanup for transacted cleanups and
+    when the candidate could not be queued.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    FileObject - File object the cleanup was sent on.
+
+    Transaction - The transaction the cleanup was done in, if any.
+
+    StreamContext - Pointer to the stream context of the candidate.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FILE_STANDARD_INFORMATION fileInfo;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    //
+    //  The check for deletion is done via a query to
+    //  FileStandardInformation. If that returns STATUS_FILE_DELETED
+    //  it means the stream was deleted.
+    //
+
+    status = FltQueryInformationFile( Instance,
+                                      FileObject,
+                                      &fileInfo,
+                                      sizeof(fileInfo),
+                                      FileStandardInformation,
+                                      NULL );
+
+    if (STATUS_FILE_DELETED == status) {
+
+        status = DfProcessDelete( Instance,
+                                  FileObject,
+                                  Transaction,
+                                  StreamContext );
+
+        if (!NT_SUCCESS( status )) {
+
+            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+                          "delete!%s: It was not possible to verify "
+                          "deletion due to an error in DfProcessDelete (0x%08x)!\n",
+                          __FUNCTION__,
+                          status );
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Deferred Deletion Checks                                                //
+//////////////////////////////////////////////////////////////////////////////
+
+NTSTATUS
+DfQueuePendingDelete (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine hands a deletion candidate to the pending delete worker so
+    that post-cleanup does not have to wait for the deletion to be verified.
+    A work item is queued if the worker is not already running; otherwise the
+    running worker picks the candidate up with the rest of its batch.
+
+    The worker finds the file by the file ID in the stream context, so no
+    reference is kept on the file object. A candidate that is still queued
+    is not queued again.
+
+Arguments:
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
+        opaque handles to this filter, instance, its associated volume and
+        file object.
+
+    StreamContext - Pointer to the stream context of the candidate.
+
+Return Value:
+
+    STATUS_SUCCESS - The candidate was queued, or already was.
+
+    STATUS_NOT_FOUND - The file ID of the candidate is not known. The
+        caller must check the candidate itself.
+
+    STATUS_INSUFFICIENT_RESOURCES - The queue is full or an allocation
+        failed. The caller must check the candidate itself.
+
+    Other statuses forwarded from FltObjectReference or
+        FltQueueGenericWorkItem.
+
+--*/
+{
+    PDF_PENDING_DELETE pendingDelete;
+    PDF_PENDING_DELETE queuedDelete;
+    PFLT_GENERIC_WORKITEM workItem;
+    PLIST_ENTRY bucket;
+    PLIST_ENTRY entry;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (!StreamContext->FileIdSet) {
+
+        return STATUS_NOT_FOUND;
+    }
+
+    pendingDelete = ExAllocateFromPagedLookasideList( &gPendingDeletes.Lookaside );
+
+    if (NULL == pendingDelete) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    //  The instance reference keeps the instance from being torn down before
+    //  the worker is done with the candidate.
+    //
+
+    status = FltObjectReference( FltObjects->Instance );
+
+    if (!NT_SUCCESS( status )) {
+
+        ExFreeToPagedLookasideList( &gPendingDeletes.Lookaside,
+                                    pendingDelete );
+
+        return status;
+    }
+
+    FltReferenceContext( StreamContext );
+
+    pendingDelete->Instance = FltObjects->Instance;
+    pendingDelete->StreamContext = StreamContext;
+
+    RtlCopyMemory( &pendingDelete->FileId,
+                   &StreamContext->FileId,
+                   sizeof(pendingDelete->FileId) );
+
+    bucket = &gPendingDeletes.Buckets[DfHashFileId( pendingDelete->FileId )];
+
+    ExAcquireFastMutex( &gPendingDeletes.Mutex );
+
+    //
+    //  The streams of a file share its bucket; the stream context tells
+    //  them apart.
+    //
+
+    for (entry = bucket->Flink; entry != bucket; entry = entry->Flink) {
+
+        queuedDelete = CONTAINING_RECORD( entry,
+                                          DF_PENDING_DELETE,
+                                          HashLinks );
+
+        if ((queuedDelete->StreamContext == StreamContext) &&
+            (queuedDelete->Instance == FltObjects->Instance)) {
+
+            ASSERT( RtlEqualMemory( &queuedDelete->FileId,
+                                    &pendingDelete->FileId,
+                                    sizeof(queuedDelete->FileId) ) );
+
+            goto _exit;
+        }
+    }
+
+    if (gPendingDeletes.Count >= DF_MAX_PENDING_DELETES) {
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _exit;
+    }
+
+    if (!gPendingDeletes.WorkerActive) {
+
+        workItem = FltAllocateGenericWorkItem();
+
+        if (NULL == workItem) {
+
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto _exit;
+        }
+
+        status = FltQueueGenericWorkItem( workItem,
+                                          gFilterHandle,
+                                          DfPendingDeleteWorker,
+                                          DelayedWorkQueue,
+                                          NULL );
+
+        if (!NT_SUCCESS( status )) {
+
+            FltFreeGenericWorkItem( workItem );
+            goto _exit;
+        }
+
+        gPendingDeletes.WorkerActive = TRUE;
+    }
+
+    InsertTailList( &gPendingDeletes.List,
+                    &pendingDelete->Links );
+
+    InsertTailList( bucket,
+                    &pendingDelete->HashLinks );
+
+    gPendingDeletes.Count += 1;
+    pendingDelete = NULL;
+
+_exit:
+
+    ExReleaseFastMutex( &gPendingDeletes.Mutex );
+
+    if (NULL != pendingDelete) {
+
+        DfFreePendingDelete( pendingDelete );
+    }
+
+    return status;
+}
+
+
+VOID
+DfFreePendingDelete (
+    _In_ PDF_PENDING_DELETE PendingDelete
+    )
+/*++
+
+Routine Description:
+
+    This routine releases the references held by a pending delete and
+    frees it.
+
+Arguments:
+
+    PendingDelete - The pending delete to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    FltReleaseContext( PendingDelete->StreamContext );
+    FltObjectDereference( PendingDelete->Instance );
+
+    ExFreeToPagedLookasideList( &gPendingDeletes.Lookaside,
+                                PendingDelete );
+}
+
+
+NTSTATUS
+DfIsStreamPresent (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ HANDLE FileHandle,
+    _In_ PFILE_OBJECT FileObject,
+    _In_ PDF_STREAM_CONTEXT StreamContext
+    )
+/*++
+
+Routine Description:
+
+    This routine looks for a stream among the alternate data streams of a
+    file, by opening each of them and comparing its stream context with the
+    given one. It is called by the pending delete worker when the file of a
+    candidate still exists but the candidate is not its default stream.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    FileHandle - Handle to the default stream of the file, opened below
+        this filter.
+
+    FileObject - File object for FileHandle.
+
+    StreamContext - Pointer to the stream context of the candidate.
+
+Return Value:
+
+    STATUS_SUCCESS - The stream exists, or one of the streams is delete
+        pending and may be it.
+
+    STATUS_FILE_DELETED - The stream was not found.
+
+    Other statuses forwarded from FltQueryInformationFile or
+        FltCreateFileEx2, including STATUS_BUFFER_OVERFLOW when the file
+        has more streams than fit in DF_STREAM_INFO_SIZE.
+
+--*/
+{
+    PFILE_STREAM_INFORMATION streamInfo;
+    PFILE_STREAM_INFORMATION entry;
+    PDF_STREAM_CONTEXT streamContext;
+    UNICODE_STRING streamName;
+    OBJECT_ATTRIBUTES objectAttributes;
+    IO_STATUS_BLOCK ioStatus;
+    PFILE_OBJECT streamObject;
+    HANDLE streamHandle;
+    ULONG lengthReturned;
+    NTSTATUS openStatus;
+    NTSTATUS status;
+    BOOLEAN found;
+
+    PAGED_CODE();
+
+    streamInfo = ExAllocatePoolWithTag( PagedPool,
+                                        DF_STREAM_INFO_SIZE,
+                                        DF_STREAM_INFO_POOL_TAG );
+
+    if (NULL == streamInfo) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = FltQueryInformationFile( Instance,
+                                      FileObject,
+                                      streamInfo,
+                                      DF_STREAM_INFO_SIZE,
+                                      FileStreamInformation,
+                                      &lengthReturned );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto _exit;
+    }
+
+    status = STATUS_FILE_DELETED;
+
+    for (entry = (lengthReturned > 0) ? streamInfo : NULL;
+         entry != NULL;
+         entry = (entry->NextEntryOffset != 0) ?
+                     Add2Ptr( entry, entry->NextEntryOffset ) :
+                     NULL) {
+
+        streamName.Buffer = entry->StreamName;
+        streamName.Length = (USHORT) entry->StreamNameLength;
+        streamName.MaximumLength = streamName.Length;
+
+        if (RtlEqualUnicodeString( &streamName,
+                                   &gDefaultStreamName,
+                                   TRUE )) {
+
+            continue;
+        }
+
+        //
+        //  Open the stream relative to the file, as ":name:$DATA".
+        //
+
+        InitializeObjectAttributes( &objectAttributes,
+                                    &streamName,
+                                    OBJ_KERNEL_HANDLE,
+                                    FileHandle,
+                                    NULL );
+
+        openStatus = FltCreateFileEx2( gFilterHandle,
+                                       Instance,
+                                       &streamHandle,
+                                       &streamObject,
+                                       FILE_READ_ATTRIBUTES,
+                                       &objectAttributes,
+                                       &ioStatus,
+                                       (PLARGE_INTEGER) NULL,
+                                       0L,
+                                       FILE_SHARE_VALID_FLAGS,
+                                       FILE_OPEN,
+                                       FILE_OPEN_REPARSE_POINT,
+                                       (PVOID) NULL,
+                                       0L,
+                                       IO_IGNORE_SHARE_ACCESS_CHECK,
+                                       NULL );
+
+        if (STATUS_DELETE_PENDING == openStatus) {
+
+            //
+            //  This may be the candidate, which will be checked again when
+            //  its last handle is cleaned up.
+            //
+
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (!NT_SUCCESS( openStatus )) {
+
+            //
+            //  Without this stream the candidate cannot be ruled out.
+            //
+
+            status = openStatus;
+            continue;
+        }
+
+        found = FALSE;
+
+        if (NT_SUCCESS( FltGetStreamContext( Instance,
+                                             streamObject,
+                                             &streamContext ) )) {
+
+            found = (BOOLEAN) (streamContext == StreamContext);
+
+            FltReleaseContext( streamContext );
+        }
+
+        ObDereferenceObject( streamObject );
+        FltClose( streamHandle );
+
+        if (found) {
+
+            status = STATUS_SUCCESS;
+            break;
+        }
+    }
+
+_exit:
+
+    ExFreePoolWithTag( streamInfo, DF_STREAM_INFO_POOL_TAG );
+
+    return status;
+}
+
+
+VOID
+DfVerifyPendingDelete (
+    _In_ PDF_PENDING_DELETE PendingDelete
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a candidate handed to the worker was deleted
+    and, if so, notifies the deletion. The file is opened by its ID: if that
+    fails the whole file is gone. Otherwise the candidate was deleted only if
+    it was an alternate data stream that the file no longer has.
+
+Arguments:
+
+    PendingDelete - The candidate.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDF_STREAM_CONTEXT streamContext;
+    PFILE_OBJECT fileObject;
+    HANDLE handle;
+    NTSTATUS status;
+    BOOLEAN isDefaultStream = FALSE;
+
+    PAGED_CODE();
+
+    status = DfOpenByFileId( PendingDelete->Instance,
+                             &PendingDelete->FileId,
+                             NULL,
+                             &handle,
+                             &fileObject );
+
+    if (STATUS_INVALID_PARAMETER == status) {
+
+        DfNotifyDelete( PendingDelete->Instance,
+                        PendingDelete->StreamContext,
+                        TRUE,
+                        NULL );
+
+        return;
+    }
+
+    if (STATUS_DELETE_PENDING == status) {
+
+        //
+        //  The file still exists. It is checked again when its last handle
+        //  is cleaned up.
+        //
+
+        return;
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+                      "delete!%s: DfOpenByFileId returned 0x%08x!\n",
+                      __FUNCTION__,
+                      status );
+
+        return;
+    }
+
+    if (NT_SUCCESS( FltGetStreamContext( PendingDelete->Instance,
+                                         fileObject,
+                                         &streamContext ) )) {
+
+        isDefaultStream = (BOOLEAN) (streamContext == PendingDelete->StreamContext);
+
+        FltReleaseContext( streamContext );
+    }
+
+    if (!isDefaultStream) {
+
+        status = DfIsStreamPresent( PendingDelete->Instance,
+                                    handle,
+                                    fileObject,
+                                    PendingDelete->StreamContext );
+
+        if (STATUS_FILE_DELETED == status) {
+
+            DfNotifyDelete( PendingDelete->Instance,
+                            PendingDelete->StreamContext,
+                            FALSE,
+                            NULL );
+
+        } else if (!NT_SUCCESS( status )) {
+
+            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+                          "delete!%s: DfIsStreamPresent returned 0x%08x!\n",
+                          __FUNCTION__,
+                          status );
+        }
+    }
+
+    ObDereferenceObject( fileObject );
+    FltClose( handle );
+}
+
+
+VOID
+DfPendingDeleteWorker (
+    _In_ PFLT_GENERIC_WORKITEM FltWorkItem,
+    _In_ PVOID FltObject,
+    _In_opt_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine verifies the deletion candidates queued by post-cleanup. It
+    takes them off the queue in batches of up to DF_PENDING_DELETE_BATCH, so
+    the queue lock is taken once per batch rather than once per candidate,
+    and runs until it finds the queue empty.
+
+Arguments:
+
+    FltWorkItem - The generic work item this routine was queued with.
+
+    FltObject - The filter handle.
+
+    Context - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LIST_ENTRY batch;
+    PDF_PENDING_DELETE pendingDelete;
+    ULONG count;
+
+    UNREFERENCED_PARAMETER( FltObject );
+    UNREFERENCED_PARAMETER( Context );
+
+    PAGED_CODE();
+
+    for (;;) {
+
+        InitializeListHead( &batch );
+
+        ExAcquireFastMutex( &gPendingDeletes.Mutex );
+
+        for (count = 0;
+             count < DF_PENDING_DELETE_BATCH && !IsListEmpty( &gPendingDeletes.List );
+             count++) {
+
+            pendingDelete = CONTAINING_RECORD( RemoveHeadList( &gPendingDeletes.List ),
+                                               DF_PENDING_DELETE,
+                                               Links );
+
+            RemoveEntryList( &pendingDelete->HashLinks );
+
+            InsertTailList( &batch,
+                            &pendingDelete->Links );
+        }
+
+        gPendingDeletes.Count -= count;
+
+        if (0 == count) {
+
+            //
+            //  The next candidate queued starts a new worker.
+            //
+
+            gPendingDeletes.WorkerActive = FALSE;
+        }
+
+        ExReleaseFastMutex( &gPendingDeletes.Mutex );
+
+        if (0 == count) {
+
+            break;
+        }
+
+        while (!IsListEmpty( &batch )) {
+
+            pendingDelete = CONTAINING_RECORD( RemoveHeadList( &batch ),
+                                               DF_PENDING_DELETE,
+                                               Links );
+
+            //
+            //  Skip candidates whose deletion was already notified through
+            //  another handle while they were queued.
+            //
+
+            if (0 == pendingDelete->StreamContext->IsNotified) {
+
+                DfVerifyPendingDelete( pendingDelete );
+            }
+
+            DfFreePendingDelete( pendingDelete );
+        }
+    }
+
+    FltFreeGenericWorkItem( FltWorkItem );
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//  Listener Communication                                                  //
+//////////////////////////////////////////////////////////////////////////////
+
+VOID
+DfReportDelete (
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PDF_STREAM_CONTEXT StreamContext,
+    _In_ ULONG Flags
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a record of a deletion to the ring read by the
+    listener. If the ring is full the oldest record is overwritten.
+
+Arguments:
+
+    Instance - Opaque instance pointer.
+
+    StreamContext - Pointer to the stream context of the deleted file/stream.
+
+    Flags - DF_RECORD_* flags for the record.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DF_DELETE_RECORD record;
+    UNICODE_STRING volumeName;
+    PUNICODE_STRING name;
+    ULONG index;
+
+    PAGED_CODE();
+
+    if (!FlagOn( gListenerFlags, DF_LISTENER_CONNECTED )) {
+
+        return;
+    }
+
+    RtlZeroMemory( &record, sizeof(record) );
+
+    KeQuerySystemTime( &record.TimeStamp );
+    record.Flags = Flags;
+
+    if (StreamContext->FileIdSet) {
+
+        RtlCopyMemory( record.FileId,
+                       &StreamContext->FileId,
+                       sizeof(record.FileId) );
+    }
+
+    //
+    //  The volume GUID name is cached in the instance context, so this only
+    //  costs a lookup. On failure the record goes out without it.
+    //
+
+    volumeName.Buffer = record.VolumeName;
+    volumeName.Length = 0;
+    volumeName.MaximumLength = sizeof(record.VolumeName);
+
+    if (NT_SUCCESS( DfGetVolumeGuidName( Instance, &volumeName ) )) {
+
+        record.VolumeNameLength = volumeName.Length;
+    }
+
+    if (NULL != StreamContext->NameInfo) {
+
+        name = &StreamContext->NameInfo->Name;
+
+        record.NameLength = (USHORT) min( name->Length, sizeof(record.Name) );
+
+        RtlCopyMemory( record.Name,
+                       name->Buffer,
+                       record.NameLength );
+    }
 
-                //
-                //  Getting back STATUS_OBJECTID_NOT_FOUND means the file
-                //  still exists, it just doesn't have an object ID.
+    ExAcquireFastMutex( &gRecordRing.Mutex );
 
-                return STATUS_SUCCESS;
+    //
+    //  The listener may have disconnected since the check above.
+    //
 
-            default:
+    if (NULL != gRecordRing.Records) {
 
-                //
-                //  Else we just get back STATUS_FILE_DELETED if the file
-                //  doesn't exist anymore, or some error status, so no
-                //  status conversion is necessary.
-                //
+        if (gRecordRing.Count == gRecordRing.Capacity) {
 
-                NOTHING;
+            gRecordRing.Head = (gRecordRing.Head + 1) % gRecordRing.Capacity;
+            gRecordRing.Count -= 1;
+            gRecordRing.LostCount += 1;
         }
+
+        record.SequenceNumber = gRecordRing.NextSequenceNumber++;
+
+        index = (gRecordRing.Head + gRecordRing.Count) % gRecordRing.Capacity;
+
+        RtlCopyMemory( &gRecordRing.Records[index],
+                       &record,
+                       sizeof(record) );
+
+        gRecordRing.Count += 1;
     }
 
-    return status;
+    ExReleaseFastMutex( &gRecordRing.Mutex );
 }
 
 
 NTSTATUS
-DfAddTransDeleteNotify (
-    _Inout_ PDF_STREAM_CONTEXT StreamContext,
-    _Inout_ PDF_TRANSACTION_CONTEXT TransactionContext,
-    _In_ BOOLEAN FileDelete
+DfPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
     )
 /*++
 
 Routine Description:
 
-    This routine adds a pending deletion notification (DF_DELETE_NOTIFY)
-    object to the transaction context DeleteNotifyList. It is called from
-    DfNotifyDelete when a file or stream gets deleted in a transaction.
+    This is called when a listener connects to the port. It allocates the
+    record ring, with the size the listener asked for, and turns on
+    reporting.
 
 Arguments:
 
-    StreamContext - Pointer to the stream context.
+    ClientPort - The port of the listener.
 
-    TransactionContext - Pointer to the transaction context.
+    ServerPortCookie - Unused.
 
-    FileDelete - TRUE if this is a FILE deletion, FALSE if it's a STREAM
-                 deletion.
+    ConnectionContext - Optional DF_CONNECT_CONTEXT.
+
+    SizeOfContext - Size of ConnectionContext in bytes.
+
+    ConnectionCookie - Set to NULL.
 
 Return Value:
 
-    STATUS_SUCCESS.
+    STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if the ring could not
+    be allocated.
 
 --*/
 {
-    PDF_DELETE_NOTIFY deleteNotify;
+    PDF_DELETE_RECORD records;
+    ULONG flags = 0;
+    ULONG ringSize = DF_DEFAULT_RING_SIZE;
+
+    UNREFERENCED_PARAMETER( ServerPortCookie );
 
     PAGED_CODE();
 
-    ASSERT( NULL != TransactionContext->Resource );
+    if ((NULL != ConnectionContext) &&
+        (SizeOfContext >= sizeof(DF_CONNECT_CONTEXT))) {
 
-    ASSERT( NULL != StreamContext );
+        flags = ((PDF_CONNECT_CONTEXT) ConnectionContext)->Flags & DF_LISTENER_VALID_FLAGS;
 
-    deleteNotify = ExAllocatePoolWithTag( DF_CONTEXT_POOL_TYPE,
-                                          sizeof(DF_DELETE_NOTIFY),
-                                          DF_DELETE_NOTIFY_POOL_TAG );
+        if (0 != ((PDF_CONNECT_CONTEXT) ConnectionContext)->RingSize) {
 
-    if (NULL == deleteNotify) {
+            ringSize = ((PDF_CONNECT_CONTEXT) ConnectionContext)->RingSize;
+            ringSize = max( ringSize, DF_MIN_RING_SIZE );
+            ringSize = min( ringSize, DF_MAX_RING_SIZE );
+        }
+    }
+
+    records = ExAllocatePoolWithTag( PagedPool,
+                                     ringSize * sizeof(DF_DELETE_RECORD),
+                                     DF_RECORD_POOL_TAG );
+
+    if (NULL == records) {
 
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    RtlZeroMemory( deleteNotify, sizeof(DF_DELETE_NOTIFY) );
+    ExAcquireFastMutex( &gRecordRing.Mutex );
 
-    FltReferenceContext( StreamContext );
-    deleteNotify->StreamContext = StreamContext;
-    deleteNotify->FileDelete = FileDelete;
+    ASSERT( NULL == gRecordRing.Records );
 
-    FltAcquireResourceExclusive( TransactionContext->Resource );
+    gRecordRing.Records = records;
+    gRecordRing.Capacity = ringSize;
+    gRecordRing.Head = 0;
+    gRecordRing.Count = 0;
+    gRecordRing.LostCount = 0;
+    gRecordRing.NextSequenceNumber = 0;
 
-    InsertTailList( &TransactionContext->DeleteNotifyList,
-                    &deleteNotify->Links );
+    ExReleaseFastMutex( &gRecordRing.Mutex );
 
-    FltReleaseResource( TransactionContext->Resource );
+    ASSERT( NULL == gClientPort );
+    gClientPort = ClientPort;
+
+    InterlockedExchange( &gListenerFlags,
+                         (LONG) (DF_LISTENER_CONNECTED | flags) );
+
+    *ConnectionCookie = NULL;
 
     return STATUS_SUCCESS;
 }
 
 
 VOID
-DfNotifyDelete (
-    _In_ PDF_STREAM_CONTEXT StreamContext,
-    _In_ BOOLEAN IsFile,
-    _Inout_opt_ PDF_TRANSACTION_CONTEXT TransactionContext
+DfPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
     )
 /*++
 
 Routine Description:
 
-    This routine does the processing after it is verified, in the post-cleanup
-    callback, that a file or stream were deleted. It sorts out whether it's a
-    file or a stream delete, whether this is in a transacted context or not,
-    and issues the appropriate notifications.
+    This is called when the listener disconnects. It turns off reporting
+    and frees the record ring, dropping any records that were not read.
 
 Arguments:
 
-    StreamContext - Pointer to the stream context of the deleted file/stream.
+    ConnectionCookie - Unused.
 
-    IsFile - TRUE if deleting a file, FALSE for an alternate data stream.
+Return Value:
 
-    TransactionContext - The transaction context. Present if in a transaction,
-                         NULL otherwise.
+    None.
 
 --*/
 {
-    PAGED_CODE();
-
-    if (InterlockedIncrement( &StreamContext->IsNotified ) <= 1) {
-
-        if (IsFile) {
+    PDF_DELETE_RECORD records;
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          "delete!DfPostCleanupCallback: "
-                          "A file \"%wZ\" (%p) has been",
-                          &StreamContext->NameInfo->Name,
-                          StreamContext );
+    UNREFERENCED_PARAMETER( ConnectionCookie );
 
-        } else {
+    PAGED_CODE();
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          "delete!DfPostCleanupCallback: "
-                          "An alternate data stream \"%wZ\" (%p) has been",
-                          &StreamContext->NameInfo->Name,
-                          StreamContext );
-        }
+    InterlockedExchange( &gListenerFlags, 0 );
 
-        //
-        //  Flag that a delete has been notified on this file/stream.
-        //
+    FltCloseClientPort( gFilterHandle, &gClientPort );
 
-        if (NULL == TransactionContext) {
+    ExAcquireFastMutex( &gRecordRing.Mutex );
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          " deleted!\n" );
+    records = gRecordRing.Records;
+    gRecordRing.Records = NULL;
+    gRecordRing.Count = 0;
 
-        } else {
+    ExReleaseFastMutex( &gRecordRing.Mutex );
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          " deleted in a transaction!\n" );
+    if (NULL != records) {
 
-            DfAddTransDeleteNotify( StreamContext,
-                                    TransactionContext,
-                                    IsFile );
-        }
+        ExFreePoolWithTag( records, DF_RECORD_POOL_TAG );
     }
 }
 
 
-VOID
-DfNotifyDeleteOnTransactionEnd (
-    _In_ PDF_DELETE_NOTIFY DeleteNotify,
-    _In_ BOOLEAN Commit
+NTSTATUS
+DfPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
     )
 /*++
 
 Routine Description:
 
-    This routine is called by the transaction notification callback to issue
-    the proper notifications for a file that has been deleted in the context
-    of that transaction.
-    The file will be reported as finally deleted, if the transaction was
-    committed, or "saved" if the transaction was rolled back.
+    This is called whenever the listener sends a message. The input buffer
+    holds a DF_COMMAND_MESSAGE.
+
+    The buffers are raw user mode addresses, so they are probed by FltMgr
+    but must be accessed inside try/except.
 
 Arguments:
 
-    DeleteNotify - Pointer to the DF_DELETE_NOTIFY object that contains the
-                   data necessary for issuing this notification.
+    ConnectionCookie - Unused.
 
-    Commit       - TRUE if the transaction was committed, FALSE if it was
-                   rolled back.
+    InputBuffer - A buffer containing the command.
+
+    InputBufferSize - The size in bytes of InputBuffer.
+
+    OutputBuffer - A buffer to receive the reply.
+
+    OutputBufferSize - The size in bytes of OutputBuffer.
+
+    ReturnOutputBufferLength - The number of bytes returned in OutputBuffer.
+
+Return Value:
+
+    The status of the command.
 
 --*/
 {
+    DF_COMMAND command;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( ConnectionCookie );
+
     PAGED_CODE();
 
-    if (DeleteNotify->FileDelete) {
+    *ReturnOutputBufferLength = 0;
 
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                      "delete!DfTransactionNotificationCallback: "
-                      "A file \"%wZ\" (%p) has been",
-                      &DeleteNotify->StreamContext->NameInfo->Name,
-                      DeleteNotify->StreamContext );
+    if ((NULL == InputBuffer) ||
+        (InputBufferSize < (FIELD_OFFSET( DF_COMMAND_MESSAGE, Command ) +
+                            sizeof(DF_COMMAND)))) {
 
-    } else {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                      "delete!DfTransactionNotificationCallback: "
-                      "An alternate data stream \"%wZ\" (%p) has been",
-                      &DeleteNotify->StreamContext->NameInfo->Name,
-                      DeleteNotify->StreamContext );
+    try {
+
+        //
+        //  Probed and captured by FltMgr, but the buffer is still user mode.
+        //
+
+        command = ((PDF_COMMAND_MESSAGE) InputBuffer)->Command;
+
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+
+        return GetExceptionCode();
     }
 
-    if (Commit) {
+    switch (command) {
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          " deleted due to a transaction commit!\n" );
+        case DfGetDeleteRecords:
 
-    } else {
+            if ((NULL == OutputBuffer) || (0 == OutputBufferSize)) {
 
-            DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                          " saved due to a transaction rollback!\n" );
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            //
+            //  The records contain 64-bit fields, so the buffer must be
+            //  aligned for the caller's pointer size.
+            //
+
+#if defined(_WIN64)
+            if (IoIs32bitProcess( NULL )) {
+
+                if (!IS_ALIGNED( OutputBuffer, sizeof(ULONG) )) {
+
+                    status = STATUS_DATATYPE_MISALIGNMENT;
+                    break;
+                }
+
+            } else {
+#endif
+
+                if (!IS_ALIGNED( OutputBuffer, sizeof(PVOID) )) {
+
+                    status = STATUS_DATATYPE_MISALIGNMENT;
+                    break;
+                }
+
+#if defined(_WIN64)
+            }
+#endif
+
+            status = DfGetRecords( OutputBuffer,
+                                   OutputBufferSize,
+                                   ReturnOutputBufferLength );
+            break;
+
+        default:
+
+            status = STATUS_INVALID_PARAMETER;
+            break;
     }
+
+    return status;
 }
 
 
 NTSTATUS
-DfProcessDelete (
-    _Inout_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ PDF_STREAM_CONTEXT    StreamContext
+DfGetRecords (
+    _Out_writes_bytes_to_(OutputBufferSize,*ReturnOutputBufferLength) PUCHAR OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
     )
 /*++
 
 Routine Description:
 
-    This routine does the processing after it is verified, in the post-cleanup
-    callback, that a file or stream were deleted. It sorts out whether it's a
-    file or a stream delete, whether this is in a transacted context or not,
-    and issues the appropriate notifications.
+    This routine copies as many buffered records as fit into the listener's
+    buffer, oldest first. Records are only consumed if the copy succeeds.
 
 Arguments:
 
-    Data - Pointer to the filter callbackData that is passed to us.
+    OutputBuffer - The listener's buffer, a DF_DELETE_RECORDS structure.
 
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS data structure containing
-        opaque handles to this filter, instance, its associated volume and
-        file object.
+    OutputBufferSize - The size in bytes of OutputBuffer.
 
-    StreamContext - Pointer to the stream context of the deleted file/stream.
+    ReturnOutputBufferLength - The number of bytes returned.
 
 Return Value:
 
-    STATUS_SUCCESS.
+    STATUS_SUCCESS - Zero or more records were returned.
+
+    STATUS_BUFFER_TOO_SMALL - The buffer cannot hold a single record.
+
+    STATUS_PORT_DISCONNECTED - The ring is gone.
+
+    Exception codes from accessing the buffer.
 
 --*/
 {
-    BOOLEAN isTransaction;
-    BOOLEAN isFileDeleted = FALSE;
-    NTSTATUS status;
-    PDF_TRANSACTION_CONTEXT transactionContext = NULL;
+    PDF_DELETE_RECORDS output = (PDF_DELETE_RECORDS) OutputBuffer;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG recordCount;
+    ULONG first;
+    ULONG i;
 
-	PAGED_CODE();
+    PAGED_CODE();
 
-    //  Is this in a transacted context?
-    isTransaction = (NULL != FltObjects->Transaction);
+    *ReturnOutputBufferLength = 0;
 
-    if (isTransaction) {
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                      "delete!DfProcessDelete: In a transaction!\n" );
+    if (OutputBufferSize < FIELD_OFFSET( DF_DELETE_RECORDS, Records ) + sizeof(DF_DELETE_RECORD)) {
 
-        status = DfGetOrSetContext( FltObjects,
-                                    FltObjects->Transaction,
-                                    &transactionContext,
-                                    FLT_TRANSACTION_CONTEXT );
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
-        if (!NT_SUCCESS( status )) {
+    recordCount = (OutputBufferSize - FIELD_OFFSET( DF_DELETE_RECORDS, Records )) /
+                  sizeof(DF_DELETE_RECORD);
 
-            return status;
-        }
+    ExAcquireFastMutex( &gRecordRing.Mutex );
+
+    if (NULL == gRecordRing.Records) {
+
+        status = STATUS_PORT_DISCONNECTED;
+        goto _exit;
     }
 
-    //
-    //  Notify deletion. If this is an Alternate Data Stream being deleted,
-    //  check if the whole file was deleted (by calling DfIsFileDeleted) as
-    //  this could be the last handle to a delete-pending file.
-    //
+    recordCount = min( recordCount, gRecordRing.Count );
 
-    status = DfIsFileDeleted( Data,
-                              FltObjects,
-                              StreamContext,
-                              isTransaction );
+    try {
 
-    if (STATUS_FILE_DELETED == status) {
+        for (i = 0; i < recordCount; i++) {
 
-        isFileDeleted = TRUE;
-        status = STATUS_SUCCESS;
+            first = (gRecordRing.Head + i) % gRecordRing.Capacity;
 
-    } else if (!NT_SUCCESS( status )) {
+            RtlCopyMemory( &output->Records[i],
+                           &gRecordRing.Records[first],
+                           sizeof(DF_DELETE_RECORD) );
+        }
 
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                      "delete!%s: DfIsFileDeleted returned 0x%08x!\n",
-                      __FUNCTION__,
-                      status );
+        output->RecordCount = recordCount;
+        output->LostCount = gRecordRing.LostCount;
 
-        goto _exit;
-    }
+    } except (EXCEPTION_EXECUTE_HANDLER) {
 
-    DfNotifyDelete( StreamContext,
-                    isFileDeleted,
-                    transactionContext );
+        status = GetExceptionCode();
+    }
 
-_exit:
+    if (NT_SUCCESS( status )) {
 
-    if (NULL != transactionContext) {
+        gRecordRing.Head = (gRecordRing.Head + recordCount) % gRecordRing.Capacity;
+        gRecordRing.Count -= recordCount;
+        gRecordRing.LostCount = 0;
 
-        FltReleaseContext( transactionContext );
+        *ReturnOutputBufferLength = FIELD_OFFSET( DF_DELETE_RECORDS, Records ) +
+                                    recordCount * sizeof(DF_DELETE_RECORD);
     }
 
+_exit:
+
+    ExReleaseFastMutex( &gRecordRing.Mutex );
+
     return status;
 }
 
@@ -2715,7 +4293,7 @@ Return Value:
         //  other context.
         //
 
-        status = DfGetOrSetContext( FltObjects,
+        status = DfGetOrSetContext( FltObjects->Instance,
                                     Data->Iopb->TargetFileObject,
                                     &streamContext,
                                     FLT_STREAM_CONTEXT );
@@ -2812,7 +4390,7 @@ Return Value:
             //  We're interested when the file delete disposition changes.
             //
 
-            status = DfGetOrSetContext( FltObjects,
+            status = DfGetOrSetContext( FltObjects->Instance,
                                         Data->Iopb->TargetFileObject,
                                         &streamContext,
                                         FLT_STREAM_CONTEXT );
@@ -2994,12 +4572,14 @@ Routine Description:
     This routine is the pre-operation completion routine for
     IRP_MJ_CLEANUP in this miniFilter.
 
-    In the preop callback for cleanup, we obtain the file information and
-    save it in the stream context, just so we have a name to use when
-    reporting file deletions.
+    In the preop callback for cleanup, we obtain the file ID and, if any
+    consumer wants names, the file name information and save them in the
+    stream context, so we can identify the file when reporting deletions.
+    The file ID is also what the pending delete worker finds the file by.
 
     That is done for every stream with an attached stream context because
-    those will be deletion candidates most of the time.
+    those will be deletion candidates most of the time. If nobody listens
+    for deletions, post-cleanup is skipped altogether.
 
 Arguments:
 
@@ -3018,15 +4598,13 @@ Return Value:
         here, and we want to synchronize the postop.
 
     FLT_PREOP_SUCCESS_NO_CALLBACK - when we don't manage to get a stream
-        context.
+        context, or deletions are not being reported.
 
 --*/
 {
     PDF_STREAM_CONTEXT streamContext;
     NTSTATUS status;
 
-    UNREFERENCED_PARAMETER( FltObjects );
-
     PAGED_CODE();
 
     DF_DBG_PRINT( DFDBG_TRACE_ROUTINES,
@@ -3038,31 +4616,52 @@ Return Value:
 
     if (NT_SUCCESS( status )) {
 
+        if (!DfReportingEnabled()) {
+
+            FltReleaseContext( streamContext );
+
+            return FLT_PREOP_SUCCESS_NO_CALLBACK;
+        }
+
         //
         //  Only streams with stream context will be sent for deletion check
         //  in post-cleanup, which makes sense because they would only ever
         //  have one if they were flagged as candidates at some point.
+        //
+        //  The file ID can no longer be queried once the file is gone, so
+        //  it is queried here, the first time a handle to the stream is
+        //  cleaned up. Without it the deletion is checked in post-cleanup.
+        //
+
+        DfGetFileId( FltObjects->Instance,
+                     FltObjects->FileObject,
+                     streamContext );
+
         //
         //  Gather file information here so that we have a name to report.
         //  The name will be accurate most of the times, and in the cases it
         //  won't, it serves as a good clue and the stream context pointer
         //  value should offer a way to disambiguate that in case of renames
-        //  etc.
+        //  etc. Names are costly, so this is only done if someone uses them.
         //
 
-        status = DfGetFileNameInformation( Data, streamContext );
+        if (DfNamesRequested()) {
 
-        if (NT_SUCCESS( status )) {
+            status = DfGetFileNameInformation( Data, streamContext );
 
-            // pass from pre-callback to post-callback
-            *CompletionContext = (PVOID)streamContext;
+            if (!NT_SUCCESS( status )) {
 
-            return FLT_PREOP_SYNCHRONIZE;
+                DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+                              "delete!%s: DfGetFileNameInformation returned 0x%08x!\n",
+                              __FUNCTION__,
+                              status );
+            }
+        }
 
-        } else {
+        // pass from pre-callback to post-callback
+        *CompletionContext = (PVOID)streamContext;
 
-            FltReleaseContext( streamContext );
-        }
+        return FLT_PREOP_SYNCHRONIZE;
     }
 
     return FLT_PREOP_SUCCESS_NO_CALLBACK;
@@ -3083,8 +4682,13 @@ Routine Description:
     This routine is the post-operation completion routine for
     IRP_MJ_CLEANUP in this miniFilter.
 
-    Post-cleanup is the core of this minifilter. Here we check to see if
-    the stream or file were deleted and report that through DbgPrint.
+    Post-cleanup is the core of this minifilter. Here we decide whether the
+    stream or file may have been deleted. Candidates outside a transaction
+    are handed to the pending delete worker, which verifies the deletion
+    and reports it; transacted candidates are checked right here, because
+    the deletion must be recorded in the transaction context before the
+    transaction can complete. So are candidates whose file ID is not known
+    or that the worker cannot take.
 
 Arguments:
 
@@ -3105,7 +4709,6 @@ Return Value:
 
 --*/
 {
-    FILE_STANDARD_INFORMATION fileInfo;
     PDF_STREAM_CONTEXT streamContext = NULL;
     NTSTATUS status;
 
@@ -3151,35 +4754,23 @@ Return Value:
         if (((streamContext->NumOps > 0) ||
              (streamContext->SetDisp) ||
              (streamContext->DeleteOnClose)) &&
-            (0 == streamContext->IsNotified)) {
-
-            //
-            //  The check for deletion is done via a query to
-            //  FileStandardInformation. If that returns STATUS_FILE_DELETED
-            //  it means the stream was deleted.
-            //
+            (0 == streamContext->IsNotified) &&
+            DfReportingEnabled()) {
 
-            status = FltQueryInformationFile( Data->Iopb->TargetInstance,
-                                              Data->Iopb->TargetFileObject,
-                                              &fileInfo,
-                                              sizeof(fileInfo),
-                                              FileStandardInformation,
-                                              NULL );
+            status = STATUS_UNSUCCESSFUL;
 
-            if (STATUS_FILE_DELETED == status) {
+            if (NULL == FltObjects->Transaction) {
 
-                status = DfProcessDelete( Data,
-                                          FltObjects,
-                                          streamContext );
+                status = DfQueuePendingDelete( FltObjects,
+                                               streamContext );
+            }
 
-                if (!NT_SUCCESS( status )) {
+            if (!NT_SUCCESS( status )) {
 
-                    DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
-                                  "delete!%s: It was not possible to verify "
-                                  "deletion due to an error in DfProcessDelete (0x%08x)!\n",
-                                  __FUNCTION__,
-                                  status );
-                }
+                DfCheckDelete( FltObjects->Instance,
+                               FltObjects->FileObject,
+                               FltObjects->Transaction,
+                               streamContext );
             }
         }
     }
@@ -3227,8 +4818,6 @@ Return Value:
     BOOLEAN commit = BooleanFlagOn( NotificationMask, TRANSACTION_NOTIFY_COMMIT_FINALIZE );
     PDF_DELETE_NOTIFY deleteNotify = NULL;
 
-    UNREFERENCED_PARAMETER( FltObjects );
-
     PAGED_CODE();
 
     //
@@ -3242,12 +4831,12 @@ Return Value:
 
     if (commit) {
 
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+        DF_DBG_PRINT( DFDBG_TRACE_DELETES,
                       "delete!DfTransactionNotificationCallback: COMMIT!\n" );
 
     } else {
 
-        DF_DBG_PRINT( DFDBG_TRACE_ERRORS,
+        DF_DBG_PRINT( DFDBG_TRACE_DELETES,
                       "delete!DfTransactionNotificationCallback: ROLLBACK!\n" );
     }
 
@@ -3267,7 +4856,8 @@ Return Value:
             InterlockedDecrement( &deleteNotify->StreamContext->IsNotified );
         }
 
-        DfNotifyDeleteOnTransactionEnd( deleteNotify,
+        DfNotifyDeleteOnTransactionEnd( FltObjects->Instance,
+                                        deleteNotify,
                                         commit );
 
         // release stream context
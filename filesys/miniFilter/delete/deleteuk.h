@@ -0,0 +1,148 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    deleteuk.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    constants, global variables and function prototypes that are
+    shared between kernel and user mode. Used by applications that
+    listen for the deletions detected by the delete filter.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef __DELETEUK_H__
+#define __DELETEUK_H__
+
+//
+//  Name of the port a listener connects to. Only one listener can be
+//  connected at a time.
+//
+
+#define DF_PORT_NAME                    L"\\DeleteFilterPort"
+
+//
+//  Context passed when connecting to the port.
+//
+//  Flags - DF_LISTENER_FLAG_* values.
+//
+//  RingSize - Number of records the filter buffers for the listener, or
+//      zero for the default. When the buffer is full the oldest records
+//      are overwritten; the next read reports how many were lost.
+//
+
+#define DF_LISTENER_FLAG_NAMES          0x00000001
+
+#define DF_LISTENER_VALID_FLAGS         (DF_LISTENER_FLAG_NAMES)
+
+#define DF_DEFAULT_RING_SIZE            4096
+#define DF_MIN_RING_SIZE                64
+#define DF_MAX_RING_SIZE                65536
+
+typedef struct _DF_CONNECT_CONTEXT {
+
+    ULONG Flags;
+    ULONG RingSize;
+
+} DF_CONNECT_CONTEXT, *PDF_CONNECT_CONTEXT;
+
+//
+//  Commands sent with FilterSendMessage.
+//
+
+typedef enum _DF_COMMAND {
+
+    //
+    //  Return as many buffered records as fit in the output buffer, in a
+    //  DF_DELETE_RECORDS structure.
+    //
+
+    DfGetDeleteRecords
+
+} DF_COMMAND;
+
+typedef struct _DF_COMMAND_MESSAGE {
+
+    DF_COMMAND Command;
+
+} DF_COMMAND_MESSAGE, *PDF_COMMAND_MESSAGE;
+
+//
+//  A file or a stream was deleted.
+//
+
+#define DF_RECORD_FILE                  0x00000001
+
+//
+//  The deletion was part of a transaction, and the record is only
+//  produced once the transaction commits.
+//
+
+#define DF_RECORD_TRANSACTED            0x00000002
+
+#define DF_RECORD_VOLUME_NAME_CHARS     50
+#define DF_RECORD_NAME_CHARS            260
+
+typedef struct _DF_DELETE_RECORD {
+
+    //
+    //  System time at which the deletion was detected.
+    //
+
+    LARGE_INTEGER TimeStamp;
+
+    //
+    //  Increases by one with every record, so gaps show lost records.
+    //
+
+    ULONG SequenceNumber;
+
+    ULONG Flags;
+
+    //
+    //  File ID of the deleted file, a 64-bit ID zero-extended on NTFS.
+    //  All zeroes if it could not be obtained before the deletion.
+    //
+
+    UCHAR FileId[16];
+
+    //
+    //  Lengths in bytes of the names below, which are not terminated.
+    //  Together the volume GUID name and the file ID can be used to
+    //  identify the file. Name is the opened name of the file or stream,
+    //  truncated to DF_RECORD_NAME_CHARS, and only filled in if the
+    //  listener asked for names.
+    //
+
+    USHORT VolumeNameLength;
+    USHORT NameLength;
+
+    WCHAR VolumeName[DF_RECORD_VOLUME_NAME_CHARS];
+    WCHAR Name[DF_RECORD_NAME_CHARS];
+
+} DF_DELETE_RECORD, *PDF_DELETE_RECORD;
+
+typedef struct _DF_DELETE_RECORDS {
+
+    ULONG RecordCount;
+
+    //
+    //  Records overwritten since the previous read.
+    //
+
+    ULONG LostCount;
+
+    DF_DELETE_RECORD Records[1];
+
+} DF_DELETE_RECORDS, *PDF_DELETE_RECORDS;
+
+#endif //  __DELETEUK_H__
+
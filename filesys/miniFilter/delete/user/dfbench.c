@@ -0,0 +1,556 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    dfbench.c
+
+Abstract:
+
+    This program measures how many files per second can be deleted with
+    and without the delete filter.
+
+    Files are created in the given directory and then deleted, first with
+    DeleteFile, which sets the delete disposition of each file, then by
+    opening each file with FILE_FLAG_DELETE_ON_CLOSE and closing it.  Only
+    the deletion is timed.  This is done three times:
+
+    - with the filter attached to the directory's volume,
+
+    - with the filter attached and a listener connected, which reads the
+      records of the deletions as they come and checks that none is lost,
+
+    - with the filter detached from the volume, as a baseline.
+
+    The filter is attached again at the end.  Detaching and attaching
+    needs administrator rights.
+
+    Usage: dfbench Directory [Files]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include "deleteuk.h"
+#include <dontuse.h>
+
+#define DFBENCH_FILTER_NAME             L"delete"
+#define DFBENCH_DEFAULT_FILES           10000
+
+//
+//  Records the listener reads with one command, and how long it waits for
+//  records once the deletions are over before it decides there are no
+//  more.
+//
+
+#define DFBENCH_LISTENER_BATCH          256
+#define DFBENCH_DRAIN_MILLISECONDS      1000
+
+typedef enum _DELETE_METHOD {
+
+    DeleteMethodDisposition,
+    DeleteMethodDeleteOnClose,
+    DeleteMethodMax
+
+} DELETE_METHOD;
+
+const PCSTR MethodNames[DeleteMethodMax] = {
+    "DeleteFile",
+    "delete-on-close"
+};
+
+typedef enum _CONFIGURATION {
+
+    ConfigurationFilter,
+    ConfigurationListener,
+    ConfigurationNoFilter,
+    ConfigurationMax
+
+} CONFIGURATION;
+
+const PCSTR ConfigurationNames[ConfigurationMax] = {
+    "filter",
+    "filter, listener",
+    "no filter"
+};
+
+typedef struct _LISTENER {
+
+    HANDLE Port;
+    HANDLE Thread;
+
+    volatile LONG Stop;
+
+    //
+    //  Records read and records the filter reported lost, and the tick
+    //  count when the last record was read.
+    //
+
+    volatile LONG64 Records;
+    volatile LONG64 Lost;
+    volatile LONG64 LastRecordTick;
+
+    HRESULT Result;
+
+} LISTENER, *PLISTENER;
+
+CHAR Directory[MAX_PATH];
+ULONG FileCount = DFBENCH_DEFAULT_FILES;
+
+//
+//  Deletions per second, by configuration and method.
+//
+
+double Rates[ConfigurationMax][DeleteMethodMax];
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Measures deletions per second with and without the delete filter\n" );
+    printf( "Usage: dfbench Directory [Files]\n" );
+    printf( "    Directory is on a volume the filter is attached to\n" );
+    printf( "    Files is the number of files deleted by each run (default %u)\n", DFBENCH_DEFAULT_FILES );
+}
+
+
+BOOL
+GetFilePath (
+    _In_ ULONG Index,
+    _Out_writes_(MAX_PATH) PCHAR Path
+    )
+{
+    return _snprintf_s( Path, MAX_PATH, _TRUNCATE, "%s\\dfbench%08u.tmp", Directory, Index ) >= 0;
+}
+
+
+BOOL
+CreateFiles (
+    VOID
+    )
+{
+    CHAR path[MAX_PATH];
+    HANDLE file;
+    ULONG i;
+
+    for (i = 0; i < FileCount; i++) {
+
+        GetFilePath( i, path );
+
+        file = CreateFileA( path,
+                            GENERIC_WRITE,
+                            0,
+                            NULL,
+                            CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL );
+
+        if (file == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Creating %s: %u\n", path, GetLastError() );
+            return FALSE;
+        }
+
+        CloseHandle( file );
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+DeleteFiles (
+    _In_ DELETE_METHOD Method,
+    _Out_ double *Rate
+    )
+/*++
+
+Routine Description:
+
+    Deletes the files with the given method and returns the number of
+    deletions per second.
+
+--*/
+{
+    CHAR path[MAX_PATH];
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    HANDLE file;
+    ULONG i;
+
+    QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &start );
+
+    for (i = 0; i < FileCount; i++) {
+
+        GetFilePath( i, path );
+
+        if (Method == DeleteMethodDisposition) {
+
+            if (!DeleteFileA( path )) {
+
+                printf( "ERROR: Deleting %s: %u\n", path, GetLastError() );
+                return FALSE;
+            }
+
+        } else {
+
+            file = CreateFileA( path,
+                                DELETE,
+                                FILE_SHARE_DELETE,
+                                NULL,
+                                OPEN_EXISTING,
+                                FILE_FLAG_DELETE_ON_CLOSE,
+                                NULL );
+
+            if (file == INVALID_HANDLE_VALUE) {
+
+                printf( "ERROR: Opening %s: %u\n", path, GetLastError() );
+                return FALSE;
+            }
+
+            CloseHandle( file );
+        }
+    }
+
+    QueryPerformanceCounter( &end );
+
+    *Rate = (double) FileCount * frequency.QuadPart / (double) (end.QuadPart - start.QuadPart);
+
+    return TRUE;
+}
+
+
+DWORD
+WINAPI
+ListenerThread (
+    _In_ LPVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Reads the records of the filter until it is stopped.  Without records
+    to read it waits a millisecond, so that the records do not pile up in
+    the filter's ring.
+
+--*/
+{
+    PLISTENER listener = Parameter;
+    DF_COMMAND_MESSAGE command;
+    PDF_DELETE_RECORDS records;
+    DWORD bufferSize;
+    DWORD bytesReturned;
+    HRESULT hr = S_OK;
+
+    bufferSize = FIELD_OFFSET( DF_DELETE_RECORDS, Records ) +
+                 DFBENCH_LISTENER_BATCH * sizeof( DF_DELETE_RECORD );
+
+    records = malloc( bufferSize );
+
+    if (records == NULL) {
+
+        listener->Result = E_OUTOFMEMORY;
+        return 0;
+    }
+
+    command.Command = DfGetDeleteRecords;
+
+    while (!listener->Stop) {
+
+        hr = FilterSendMessage( listener->Port,
+                                &command,
+                                sizeof( command ),
+                                records,
+                                bufferSize,
+                                &bytesReturned );
+
+        if (IS_ERROR( hr )) {
+
+            break;
+        }
+
+        if (records->RecordCount > 0) {
+
+            InterlockedExchangeAdd64( &listener->Records, records->RecordCount );
+            InterlockedExchange64( &listener->LastRecordTick, GetTickCount64() );
+        }
+
+        InterlockedExchangeAdd64( &listener->Lost, records->LostCount );
+
+        if (records->RecordCount < DFBENCH_LISTENER_BATCH) {
+
+            Sleep( 1 );
+        }
+    }
+
+    listener->Result = hr;
+    free( records );
+
+    return 0;
+}
+
+
+BOOL
+StartListener (
+    _Out_ PLISTENER Listener
+    )
+{
+    DF_CONNECT_CONTEXT context;
+    HRESULT hr;
+
+    ZeroMemory( Listener, sizeof( *Listener ) );
+
+    //
+    //  The largest ring, and no names: the cheapest way to hear of every
+    //  deletion.
+    //
+
+    context.Flags = 0;
+    context.RingSize = DF_MAX_RING_SIZE;
+
+    hr = FilterConnectCommunicationPort( DF_PORT_NAME,
+                                         0,
+                                         &context,
+                                         sizeof( context ),
+                                         NULL,
+                                         &Listener->Port );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Connecting to the delete filter: 0x%08x\n", hr );
+        return FALSE;
+    }
+
+    Listener->Thread = CreateThread( NULL, 0, ListenerThread, Listener, 0, NULL );
+
+    if (Listener->Thread == NULL) {
+
+        printf( "ERROR: Creating the listener thread: %u\n", GetLastError() );
+        CloseHandle( Listener->Port );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+StopListener (
+    _Inout_ PLISTENER Listener,
+    _In_ ULONGLONG DeletesEndTick
+    )
+/*++
+
+Routine Description:
+
+    Waits until no record came for DFBENCH_DRAIN_MILLISECONDS, stops the
+    listener and prints what it heard.  The filter verifies deletions on a
+    worker, so records keep coming after the last file is deleted.
+
+--*/
+{
+    LONG64 lastRecordTick;
+    BOOL result = TRUE;
+
+    for (;;) {
+
+        lastRecordTick = max( Listener->LastRecordTick, (LONG64) DeletesEndTick );
+
+        if (GetTickCount64() - lastRecordTick >= DFBENCH_DRAIN_MILLISECONDS) {
+
+            break;
+        }
+
+        Sleep( 100 );
+    }
+
+    InterlockedExchange( &Listener->Stop, 1 );
+    WaitForSingleObject( Listener->Thread, INFINITE );
+
+    CloseHandle( Listener->Thread );
+    CloseHandle( Listener->Port );
+
+    if (IS_ERROR( Listener->Result )) {
+
+        printf( "ERROR: Reading records: 0x%08x\n", Listener->Result );
+        result = FALSE;
+    }
+
+    printf( "    listener: %I64d records, %I64d lost, last one %I64d ms after the last deletion\n",
+            Listener->Records,
+            Listener->Lost,
+            (Listener->LastRecordTick > (LONG64) DeletesEndTick) ?
+                Listener->LastRecordTick - (LONG64) DeletesEndTick : 0 );
+
+    //
+    //  Other files deleted on the machine meanwhile are reported too, so
+    //  there may be more records than files.
+    //
+
+    if (Listener->Lost > 0 || Listener->Records < 2 * (LONG64) FileCount) {
+
+        printf( "ERROR: The listener did not hear of every deletion\n" );
+        result = FALSE;
+    }
+
+    return result;
+}
+
+
+BOOL
+RunConfiguration (
+    _In_ CONFIGURATION Configuration
+    )
+{
+    LISTENER listener;
+    DELETE_METHOD method;
+    BOOL result = TRUE;
+
+    if (Configuration == ConfigurationListener) {
+
+        if (!StartListener( &listener )) {
+
+            return FALSE;
+        }
+    }
+
+    for (method = 0; method < DeleteMethodMax; method++) {
+
+        if (!CreateFiles() ||
+            !DeleteFiles( method, &Rates[Configuration][method] )) {
+
+            result = FALSE;
+            break;
+        }
+
+        printf( "%-18s %-16s %10.0f deletions/s\n",
+                ConfigurationNames[Configuration],
+                MethodNames[method],
+                Rates[Configuration][method] );
+    }
+
+    if (Configuration == ConfigurationListener) {
+
+        if (!StopListener( &listener, GetTickCount64() ) && result) {
+
+            result = FALSE;
+        }
+    }
+
+    return result;
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    CHAR volumePath[MAX_PATH];
+    CHAR volumeName[MAX_PATH];
+    WCHAR volume[MAX_PATH];
+    CONFIGURATION configuration;
+    DELETE_METHOD method;
+    BOOL detached = FALSE;
+    HRESULT hr;
+    int status = 0;
+
+    if (argc < 2 || argc > 3) {
+
+        Usage();
+        return 1;
+    }
+
+    if (strcpy_s( Directory, sizeof( Directory ), argv[1] ) != 0) {
+
+        printf( "ERROR: Directory name is too long\n" );
+        return 1;
+    }
+
+    if (argc == 3) {
+
+        FileCount = (ULONG) atoi( argv[2] );
+
+        if (FileCount == 0) {
+
+            Usage();
+            return 1;
+        }
+    }
+
+    //
+    //  The filter is detached from, and attached to, the volume by its
+    //  GUID name.
+    //
+
+    if (!GetVolumePathNameA( Directory, volumePath, sizeof( volumePath ) ) ||
+        !GetVolumeNameForVolumeMountPointA( volumePath, volumeName, sizeof( volumeName ) ) ||
+        (MultiByteToWideChar( CP_ACP, 0, volumeName, -1, volume, ARRAYSIZE( volume ) ) == 0)) {
+
+        printf( "ERROR: Getting the volume of %s: %u\n", Directory, GetLastError() );
+        return 2;
+    }
+
+    printf( "%u files deleted by each run\n\n", FileCount );
+
+    for (configuration = 0; configuration < ConfigurationMax; configuration++) {
+
+        if (configuration == ConfigurationNoFilter) {
+
+            hr = FilterDetach( DFBENCH_FILTER_NAME, volume, NULL );
+
+            if (IS_ERROR( hr )) {
+
+                printf( "ERROR: Detaching the filter from %ws: 0x%08x\n", volume, hr );
+                status = 2;
+                break;
+            }
+
+            detached = TRUE;
+        }
+
+        if (!RunConfiguration( configuration )) {
+
+            status = 3;
+            break;
+        }
+    }
+
+    if (detached) {
+
+        hr = FilterAttach( DFBENCH_FILTER_NAME, volume, NULL, 0, NULL );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Attaching the filter to %ws again: 0x%08x\n", volume, hr );
+            status = 2;
+        }
+    }
+
+    if (status == 0) {
+
+        printf( "\ncost of the filter, by method\n" );
+
+        for (method = 0; method < DeleteMethodMax; method++) {
+
+            printf( "%-16s %6.1f%% without listener, %6.1f%% with listener\n",
+                    MethodNames[method],
+                    100.0 * (1.0 - Rates[ConfigurationFilter][method] / Rates[ConfigurationNoFilter][method]),
+                    100.0 * (1.0 - Rates[ConfigurationListener][method] / Rates[ConfigurationNoFilter][method]) );
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,268 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    dflisten.c
+
+Abstract:
+
+    This program listens for the deletions detected by the delete filter.
+
+    It connects to the filter's port, which creates the ring of records the
+    filter keeps for it, and reads the records in batches with the
+    DfGetDeleteRecords command.  Each record is printed with the volume
+    GUID name and file ID of the deleted file and, if names were asked for,
+    its opened name.  Records the filter had to overwrite, because the ring
+    filled up before they were read, are reported as lost.
+
+    Usage: dflisten [-n] [-q] [-r RingSize]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include "deleteuk.h"
+#include <dontuse.h>
+
+//
+//  Records read with one command, and how long to wait before asking
+//  again when there were none.
+//
+
+#define DFLISTEN_BATCH                  256
+#define DFLISTEN_POLL_MILLISECONDS      100
+
+volatile LONG StopListening;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Listens for the deletions detected by the delete filter\n" );
+    printf( "Usage: dflisten [-n] [-q] [-r RingSize]\n" );
+    printf( "    -n  Ask for the names of the deleted files\n" );
+    printf( "    -q  Print the number of deletions once a second instead of each one\n" );
+    printf( "    -r  Records the filter buffers (%u to %u, default %u)\n",
+            DF_MIN_RING_SIZE,
+            DF_MAX_RING_SIZE,
+            DF_DEFAULT_RING_SIZE );
+}
+
+
+BOOL
+WINAPI
+ConsoleHandler (
+    _In_ DWORD CtrlType
+    )
+{
+    UNREFERENCED_PARAMETER( CtrlType );
+
+    InterlockedExchange( &StopListening, 1 );
+
+    return TRUE;
+}
+
+
+VOID
+PrintRecord (
+    _In_ PDF_DELETE_RECORD Record
+    )
+/*++
+
+Routine Description:
+
+    Prints one record: the local time of the deletion, the sequence number,
+    what was deleted, and the volume, file ID and name.
+
+--*/
+{
+    FILETIME localTime;
+    SYSTEMTIME time;
+    ULONGLONG fileIdLow;
+    ULONGLONG fileIdHigh;
+
+    FileTimeToLocalFileTime( (PFILETIME) &Record->TimeStamp, &localTime );
+    FileTimeToSystemTime( &localTime, &time );
+
+    CopyMemory( &fileIdLow, &Record->FileId[0], sizeof( fileIdLow ) );
+    CopyMemory( &fileIdHigh, &Record->FileId[8], sizeof( fileIdHigh ) );
+
+    printf( "%02u:%02u:%02u.%03u %8u %s%s %.*ws %016I64x%016I64x %.*ws\n",
+            time.wHour,
+            time.wMinute,
+            time.wSecond,
+            time.wMilliseconds,
+            Record->SequenceNumber,
+            (Record->Flags & DF_RECORD_FILE) ? "file  " : "stream",
+            (Record->Flags & DF_RECORD_TRANSACTED) ? " (transacted)" : "",
+            Record->VolumeNameLength / sizeof( WCHAR ),
+            Record->VolumeName,
+            fileIdHigh,
+            fileIdLow,
+            Record->NameLength / sizeof( WCHAR ),
+            Record->Name );
+}
+
+
+int
+_cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    DF_CONNECT_CONTEXT context;
+    DF_COMMAND_MESSAGE command;
+    PDF_DELETE_RECORDS records;
+    HANDLE port = INVALID_HANDLE_VALUE;
+    DWORD bufferSize;
+    DWORD bytesReturned;
+    ULONGLONG deletions = 0;
+    ULONGLONG lost = 0;
+    ULONGLONG lastDeletions = 0;
+    ULONG nextSequenceNumber = 0;
+    ULONGLONG lastPrint;
+    BOOL quiet = FALSE;
+    HRESULT hr;
+    ULONG i;
+    int arg;
+
+    ZeroMemory( &context, sizeof( context ) );
+
+    for (arg = 1; arg < argc; arg++) {
+
+        if (_stricmp( argv[arg], "-n" ) == 0) {
+
+            context.Flags |= DF_LISTENER_FLAG_NAMES;
+
+        } else if (_stricmp( argv[arg], "-q" ) == 0) {
+
+            quiet = TRUE;
+
+        } else if ((_stricmp( argv[arg], "-r" ) == 0) && (arg + 1 < argc)) {
+
+            context.RingSize = strtoul( argv[++arg], NULL, 0 );
+
+        } else {
+
+            Usage();
+            return 1;
+        }
+    }
+
+    bufferSize = FIELD_OFFSET( DF_DELETE_RECORDS, Records ) +
+                 DFLISTEN_BATCH * sizeof( DF_DELETE_RECORD );
+
+    records = malloc( bufferSize );
+
+    if (records == NULL) {
+
+        printf( "ERROR: Allocating the record buffer\n" );
+        return 1;
+    }
+
+    hr = FilterConnectCommunicationPort( DF_PORT_NAME,
+                                         0,
+                                         &context,
+                                         sizeof( context ),
+                                         NULL,
+                                         &port );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Connecting to the delete filter: 0x%08x\n", hr );
+        free( records );
+        return 1;
+    }
+
+    SetConsoleCtrlHandler( ConsoleHandler, TRUE );
+
+    printf( "Listening for deletions, press Ctrl+C to stop\n" );
+
+    command.Command = DfGetDeleteRecords;
+    lastPrint = GetTickCount64();
+
+    while (!StopListening) {
+
+        hr = FilterSendMessage( port,
+                                &command,
+                                sizeof( command ),
+                                records,
+                                bufferSize,
+                                &bytesReturned );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Reading records: 0x%08x\n", hr );
+            break;
+        }
+
+        if (records->LostCount > 0) {
+
+            lost += records->LostCount;
+
+            if (!quiet) {
+
+                printf( "%u deletions were lost\n", records->LostCount );
+            }
+        }
+
+        for (i = 0; i < records->RecordCount; i++) {
+
+            //
+            //  Sequence numbers start at zero when the ring is created and
+            //  increase by one with every record, so a gap that the lost
+            //  count does not explain is a bug.
+            //
+
+            if ((records->Records[i].SequenceNumber != nextSequenceNumber) &&
+                (records->LostCount == 0)) {
+
+                printf( "ERROR: Record %u follows record %u\n",
+                        records->Records[i].SequenceNumber,
+                        nextSequenceNumber - 1 );
+            }
+
+            nextSequenceNumber = records->Records[i].SequenceNumber + 1;
+            deletions += 1;
+
+            if (!quiet) {
+
+                PrintRecord( &records->Records[i] );
+            }
+        }
+
+        if (quiet && (GetTickCount64() - lastPrint >= 1000)) {
+
+            printf( "%I64u deletions/s, %I64u in all, %I64u lost\n",
+                    deletions - lastDeletions,
+                    deletions,
+                    lost );
+
+            lastDeletions = deletions;
+            lastPrint = GetTickCount64();
+        }
+
+        if (records->RecordCount < DFLISTEN_BATCH) {
+
+            Sleep( DFLISTEN_POLL_MILLISECONDS );
+        }
+    }
+
+    printf( "%I64u deletions, %I64u lost\n", deletions, lost );
+
+    CloseHandle( port );
+    free( records );
+
+    return 0;
+}
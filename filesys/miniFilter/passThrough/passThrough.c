@@ -12,6 +12,12 @@ Abstract:
     This filter hooks all IO operations for both pre and post operation
     callbacks.  The filter passes through the operations.
 
+    It also measures, for each major function, the latency between its
+    pre-operation and post-operation callbacks, that is, the time spent
+    by the filters below it and the file system. The latencies are kept
+    in per-processor histograms that can be read through a communication
+    port, see passThroughuk.h.
+
 Environment:
 
     Kernel mode
@@ -21,6 +27,7 @@ Environment:
 #include <fltKernel.h>
 #include <dontuse.h>
 #include <suppress.h>
+#include "passThroughuk.h"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
@@ -28,6 +35,31 @@ Environment:
 PFLT_FILTER gFilterHandle;
 ULONG_PTR OperationStatusCtx = 1;
 
+#define PT_STATS_TAG                    'sStP'
+
+//
+//  Latency statistics of one processor. Each processor only updates its
+//  own, so the counters do not bounce between caches.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _PT_PROCESSOR_STATS {
+
+    PT_OPERATION_STATS Operations[PT_MAJOR_SLOTS];
+
+} PT_PROCESSOR_STATS, *PPT_PROCESSOR_STATS;
+
+PPT_PROCESSOR_STATS gProcessorStats;
+ULONG gProcessorCount;
+LARGE_INTEGER gPerformanceFrequency;
+
+//
+//  Port statistics are read through, and the port of the connected
+//  application.
+//
+
+PFLT_PORT gServerPort;
+PFLT_PORT gClientPort;
+
 #define PTDBG_TRACE_ROUTINES            0x00000001
 #define PTDBG_TRACE_OPERATION_STATUS    0x00000002
 
@@ -116,6 +148,44 @@ PtDoRequestOperationStatus(
     _In_ PFLT_CALLBACK_DATA Data
     );
 
+VOID
+PtRecordLatency (
+    _In_ UCHAR MajorFunction,
+    _In_ ULONG_PTR StartTime
+    );
+
+NTSTATUS
+PtPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
+    );
+
+VOID
+PtPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
+    );
+
+NTSTATUS
+PtPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+NTSTATUS
+PtGetStatistics (
+    _In_ ULONG Processor,
+    _Out_writes_bytes_(OutputBufferSize) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
 //
 //  Assign text sections for each routine.
 //
@@ -127,6 +197,10 @@ PtDoRequestOperationStatus(
 #pragma alloc_text(PAGE, PtInstanceSetup)
 #pragma alloc_text(PAGE, PtInstanceTeardownStart)
 #pragma alloc_text(PAGE, PtInstanceTeardownComplete)
+#pragma alloc_text(PAGE, PtPortConnect)
+#pragma alloc_text(PAGE, PtPortDisconnect)
+#pragma alloc_text(PAGE, PtPortMessage)
+#pragma alloc_text(PAGE, PtGetStatistics)
 #endif
 
 //
@@ -545,6 +619,9 @@ Return Value:
 
 --*/
 {
+    PSECURITY_DESCRIPTOR sd;
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING uniString;
     NTSTATUS status;
 
     UNREFERENCED_PARAMETER( RegistryPath );
@@ -552,6 +629,33 @@ Return Value:
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("PassThrough!DriverEntry: Entered\n") );
 
+    //
+    //  Default to NonPagedPoolNx for non paged pool allocations where supported.
+    //
+
+    ExInitializeDriverRuntime( DrvRtPoolNxOptIn );
+
+    //
+    //  Allocate the statistics of every processor that can ever be active,
+    //  so that processors added later have theirs.
+    //
+
+    KeQueryPerformanceCounter( &gPerformanceFrequency );
+
+    gProcessorCount = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+
+    gProcessorStats = ExAllocatePoolWithTag( NonPagedPool,
+                                             gProcessorCount * sizeof( PT_PROCESSOR_STATS ),
+                                             PT_STATS_TAG );
+
+    if (gProcessorStats == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( gProcessorStats,
+                   gProcessorCount * sizeof( PT_PROCESSOR_STATS ) );
+
     //
     //  Register with FltMgr to tell it our callback routines
     //
@@ -562,18 +666,70 @@ Return Value:
 
     FLT_ASSERT( NT_SUCCESS( status ) );
 
-    if (NT_SUCCESS( status )) {
+    if (!NT_SUCCESS( status )) {
+
+        goto DriverEntryCleanup;
+    }
+
+    //
+    //  Create the port statistics are read through. Only administrators
+    //  and the system can connect.
+    //
+
+    status = FltBuildDefaultSecurityDescriptor( &sd,
+                                                FLT_PORT_ALL_ACCESS );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto DriverEntryCleanup;
+    }
+
+    RtlInitUnicodeString( &uniString, PT_PORT_NAME );
+
+    InitializeObjectAttributes( &oa,
+                                &uniString,
+                                OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                                NULL,
+                                sd );
+
+    status = FltCreateCommunicationPort( gFilterHandle,
+                                         &gServerPort,
+                                         &oa,
+                                         NULL,
+                                         PtPortConnect,
+                                         PtPortDisconnect,
+                                         PtPortMessage,
+                                         1 );
 
-        //
-        //  Start filtering i/o
-        //
+    FltFreeSecurityDescriptor( sd );
 
-        status = FltStartFiltering( gFilterHandle );
+    if (!NT_SUCCESS( status )) {
 
-        if (!NT_SUCCESS( status )) {
+        goto DriverEntryCleanup;
+    }
+
+    //
+    //  Start filtering i/o
+    //
+
+    status = FltStartFiltering( gFilterHandle );
+
+DriverEntryCleanup:
+
+    if (!NT_SUCCESS( status )) {
+
+        if (gServerPort != NULL) {
+
+            FltCloseCommunicationPort( gServerPort );
+        }
+
+        if (gFilterHandle != NULL) {
 
             FltUnregisterFilter( gFilterHandle );
         }
+
+        ExFreePoolWithTag( gProcessorStats, PT_STATS_TAG );
+        gProcessorStats = NULL;
     }
 
     return status;
@@ -609,8 +765,17 @@ Return Value:
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("PassThrough!PtUnload: Entered\n") );
 
+    FltCloseCommunicationPort( gServerPort );
+
     FltUnregisterFilter( gFilterHandle );
 
+    //
+    //  No callbacks are outstanding once the filter is unregistered.
+    //
+
+    ExFreePoolWithTag( gProcessorStats, PT_STATS_TAG );
+    gProcessorStats = NULL;
+
     return STATUS_SUCCESS;
 }
 
@@ -645,7 +810,9 @@ Arguments:
         file object.
 
     CompletionContext - The context for the completion routine for this
-        operation.
+        operation. Set to the performance counter value, truncated to the
+        size of a pointer, so the post-operation callback can compute the
+        latency without any allocation.
 
 Return Value:
 
@@ -656,7 +823,6 @@ Return Value:
     NTSTATUS status;
 
     UNREFERENCED_PARAMETER( FltObjects );
-    UNREFERENCED_PARAMETER( CompletionContext );
 
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("PassThrough!PtPreOperationPassThrough: Entered\n") );
@@ -683,6 +849,12 @@ Return Value:
         }
     }
 
+    //
+    //  Take the start time last, so that the work above is not counted.
+    //
+
+    *CompletionContext = (PVOID) (ULONG_PTR) KeQueryPerformanceCounter( NULL ).QuadPart;
+
     return FLT_PREOP_SUCCESS_WITH_CALLBACK;
 }
 
@@ -777,10 +949,18 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER( Data );
     UNREFERENCED_PARAMETER( FltObjects );
-    UNREFERENCED_PARAMETER( CompletionContext );
-    UNREFERENCED_PARAMETER( Flags );
+
+    //
+    //  Operations drained at detach did not complete, so their latency
+    //  means nothing.
+    //
+
+    if (!FlagOn( Flags, FLTFL_POST_OPERATION_DRAINING )) {
+
+        PtRecordLatency( Data->Iopb->MajorFunction,
+                         (ULONG_PTR) CompletionContext );
+    }
 
     PT_DBG_PRINT( PTDBG_TRACE_ROUTINES,
                   ("PassThrough!PtPostOperationPassThrough: Entered\n") );
@@ -885,3 +1065,380 @@ Return Value:
              );
 }
 
+
+/*************************************************************************
+    Latency statistics.
+*************************************************************************/
+
+VOID
+PtRecordLatency (
+    _In_ UCHAR MajorFunction,
+    _In_ ULONG_PTR StartTime
+    )
+/*++
+
+Routine Description:
+
+    This routine adds the latency of an operation to the statistics of the
+    current processor.
+
+    This is non-pageable because it is called from the post-operation
+    callback, which may run at DPC level.
+
+Arguments:
+
+    MajorFunction - The major function of the operation.
+
+    StartTime - The performance counter value, truncated to the size of a
+        pointer, taken in the pre-operation callback. The difference is
+        computed in the same size, so it is correct across a wrap.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PPT_OPERATION_STATS stats;
+    ULONG_PTR latency;
+    ULONG slot;
+    ULONG processor;
+    CCHAR bucket;
+
+    latency = (ULONG_PTR) KeQueryPerformanceCounter( NULL ).QuadPart - StartTime;
+
+    slot = PT_SLOT_FROM_MAJOR( MajorFunction );
+    processor = KeGetCurrentProcessorNumberEx( NULL );
+
+    if ((slot >= PT_MAJOR_SLOTS) || (processor >= gProcessorCount)) {
+
+        return;
+    }
+
+    bucket = RtlFindMostSignificantBit( (ULONGLONG) latency );
+
+    if (bucket < 0) {
+
+        bucket = 0;
+
+    } else if (bucket >= PT_HISTOGRAM_BUCKETS) {
+
+        bucket = PT_HISTOGRAM_BUCKETS - 1;
+    }
+
+    stats = &gProcessorStats[processor].Operations[slot];
+
+    //
+    //  Interlocked because a thread can be preempted by another one on the
+    //  same processor. The cache line is not shared, so this is cheap.
+    //
+
+    InterlockedIncrement64( &stats->Count );
+    InterlockedAdd64( &stats->TotalTicks, (LONGLONG) latency );
+    InterlockedIncrement64( &stats->Buckets[bucket] );
+}
+
+
+NTSTATUS
+PtPortConnect (
+    _In_ PFLT_PORT ClientPort,
+    _In_opt_ PVOID ServerPortCookie,
+    _In_reads_bytes_opt_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID *ConnectionCookie
+    )
+/*++
+
+Routine Description:
+
+    This is called when an application connects to the statistics port.
+
+Arguments:
+
+    ClientPort - This is the client connection port that will be used to
+        send messages from the filter.
+
+    ServerPortCookie - Unused.
+
+    ConnectionContext - Unused.
+
+    SizeOfContext - Unused.
+
+    ConnectionCookie - Set to NULL.
+
+Return Value:
+
+    STATUS_SUCCESS.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( ServerPortCookie );
+    UNREFERENCED_PARAMETER( ConnectionContext );
+    UNREFERENCED_PARAMETER( SizeOfContext );
+
+    PAGED_CODE();
+
+    FLT_ASSERT( gClientPort == NULL );
+    gClientPort = ClientPort;
+
+    *ConnectionCookie = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PtPortDisconnect (
+    _In_opt_ PVOID ConnectionCookie
+    )
+/*++
+
+Routine Description:
+
+    This is called when the connection to the statistics port is torn down.
+
+Arguments:
+
+    ConnectionCookie - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNREFERENCED_PARAMETER( ConnectionCookie );
+
+    PAGED_CODE();
+
+    FltCloseClientPort( gFilterHandle, &gClientPort );
+}
+
+
+NTSTATUS
+PtPortMessage (
+    _In_ PVOID ConnectionCookie,
+    _In_reads_bytes_opt_(InputBufferSize) PVOID InputBuffer,
+    _In_ ULONG InputBufferSize,
+    _Out_writes_bytes_to_opt_(OutputBufferSize,*ReturnOutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This is called whenever the application sends a message. The input
+    buffer holds a PT_COMMAND_MESSAGE.
+
+    The buffers are raw user mode addresses, so they must be accessed
+    inside try/except.
+
+Arguments:
+
+    ConnectionCookie - Unused.
+
+    InputBuffer - A buffer containing the command.
+
+    InputBufferSize - The size in bytes of InputBuffer.
+
+    OutputBuffer - A buffer to receive the reply.
+
+    OutputBufferSize - The size in bytes of OutputBuffer.
+
+    ReturnOutputBufferLength - The number of bytes returned in OutputBuffer.
+
+Return Value:
+
+    The status of the command.
+
+--*/
+{
+    PT_COMMAND command;
+    ULONG processor;
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER( ConnectionCookie );
+
+    PAGED_CODE();
+
+    *ReturnOutputBufferLength = 0;
+
+    if ((InputBuffer == NULL) ||
+        (InputBufferSize < sizeof( PT_COMMAND_MESSAGE ))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    try {
+
+        command = ((PPT_COMMAND_MESSAGE) InputBuffer)->Command;
+        processor = ((PPT_COMMAND_MESSAGE) InputBuffer)->Processor;
+
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+
+        return GetExceptionCode();
+    }
+
+    switch (command) {
+
+        case PtGetStatistics:
+
+            if (OutputBuffer == NULL) {
+
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+#if defined(_WIN64)
+            if (IoIs32bitProcess( NULL )) {
+
+                if (!IS_ALIGNED( OutputBuffer, sizeof( ULONG ) )) {
+
+                    status = STATUS_DATATYPE_MISALIGNMENT;
+                    break;
+                }
+
+            } else {
+#endif
+
+                if (!IS_ALIGNED( OutputBuffer, sizeof( PVOID ) )) {
+
+                    status = STATUS_DATATYPE_MISALIGNMENT;
+                    break;
+                }
+
+#if defined(_WIN64)
+            }
+#endif
+
+            status = PtGetStatistics( processor,
+                                      OutputBuffer,
+                                      OutputBufferSize,
+                                      ReturnOutputBufferLength );
+            break;
+
+        case PtResetStatistics:
+
+            //
+            //  Updates racing with this may survive it, which is fine for
+            //  statistics.
+            //
+
+            RtlZeroMemory( gProcessorStats,
+                           gProcessorCount * sizeof( PT_PROCESSOR_STATS ) );
+
+            status = STATUS_SUCCESS;
+            break;
+
+        default:
+
+            status = STATUS_INVALID_PARAMETER;
+            break;
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+PtGetStatistics (
+    _In_ ULONG Processor,
+    _Out_writes_bytes_(OutputBufferSize) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the statistics of one processor, or their sum over
+    all processors, into the application's buffer. The statistics keep
+    changing while they are read, so the counts of a major function may be
+    off by the operations that completed in between.
+
+Arguments:
+
+    Processor - The processor index, or PT_ALL_PROCESSORS.
+
+    OutputBuffer - The application's buffer, a PT_STATISTICS structure.
+
+    OutputBufferSize - The size in bytes of OutputBuffer.
+
+    ReturnOutputBufferLength - The number of bytes returned.
+
+Return Value:
+
+    STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL, STATUS_INVALID_PARAMETER for a
+    bad processor index, or an exception code from accessing the buffer.
+
+--*/
+{
+    PPT_STATISTICS output = (PPT_STATISTICS) OutputBuffer;
+    PPT_OPERATION_STATS source;
+    PPT_OPERATION_STATS target;
+    ULONG first;
+    ULONG last;
+    ULONG processor;
+    ULONG slot;
+    ULONG bucket;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    *ReturnOutputBufferLength = 0;
+
+    if (OutputBufferSize < sizeof( PT_STATISTICS )) {
+
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (Processor == PT_ALL_PROCESSORS) {
+
+        first = 0;
+        last = gProcessorCount;
+
+    } else if (Processor < gProcessorCount) {
+
+        first = Processor;
+        last = Processor + 1;
+
+    } else {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    try {
+
+        RtlZeroMemory( output, sizeof( PT_STATISTICS ) );
+
+        output->Frequency = gPerformanceFrequency;
+        output->ProcessorCount = gProcessorCount;
+
+        for (processor = first; processor < last; processor++) {
+
+            for (slot = 0; slot < PT_MAJOR_SLOTS; slot++) {
+
+                source = &gProcessorStats[processor].Operations[slot];
+                target = &output->Operations[slot];
+
+                target->Count += source->Count;
+                target->TotalTicks += source->TotalTicks;
+
+                for (bucket = 0; bucket < PT_HISTOGRAM_BUCKETS; bucket++) {
+
+                    target->Buckets[bucket] += source->Buckets[bucket];
+                }
+            }
+        }
+
+        *ReturnOutputBufferLength = sizeof( PT_STATISTICS );
+
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+
+        status = GetExceptionCode();
+    }
+
+    return status;
+}
+
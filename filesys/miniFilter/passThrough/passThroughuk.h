@@ -0,0 +1,177 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    passThroughuk.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    and constants that are shared between kernel mode and user mode.
+    Used by applications that read the operation latency statistics
+    collected by the passThrough filter.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef __PASSTHROUGHUK_H__
+#define __PASSTHROUGHUK_H__
+
+//
+//  Name of the port statistics are read through. Only one application can
+//  be connected at a time.
+//
+
+#define PT_PORT_NAME                    L"\\PassThroughStatsPort"
+
+//
+//  Statistics are kept per major function. Regular IRP major functions
+//  (0 to IRP_MJ_MAXIMUM_FUNCTION) use the slot of the same number; the
+//  FltMgr-defined major functions, which are small negative numbers cast
+//  to UCHAR, use the slots after those, with IRP_MJ_ACQUIRE_FOR_SECTION_
+//  SYNCHRONIZATION ((UCHAR)-1) first.
+//
+
+#define PT_IRP_MAJOR_SLOTS              28
+#define PT_FLT_MAJOR_SLOTS              20
+#define PT_MAJOR_SLOTS                  (PT_IRP_MAJOR_SLOTS + PT_FLT_MAJOR_SLOTS)
+
+#define PT_SLOT_FROM_MAJOR(Major)                                           \
+    (((Major) < PT_IRP_MAJOR_SLOTS) ?                                       \
+        (ULONG) (Major) :                                                   \
+        (ULONG) (PT_IRP_MAJOR_SLOTS - 1 + (0x100 - (ULONG) (Major))))
+
+#define PT_MAJOR_FROM_SLOT(Slot)                                            \
+    (((Slot) < PT_IRP_MAJOR_SLOTS) ?                                        \
+        (UCHAR) (Slot) :                                                    \
+        (UCHAR) (0x100 - ((Slot) - PT_IRP_MAJOR_SLOTS + 1)))
+
+//
+//  Latencies are in performance counter ticks; see Frequency below.
+//  Bucket N counts operations whose latency had its highest set bit at
+//  position N, that is [2^N, 2^(N+1)) ticks. Bucket 0 also counts zero.
+//  The last bucket also counts everything longer.
+//
+
+#define PT_HISTOGRAM_BUCKETS            40
+
+typedef struct _PT_OPERATION_STATS {
+
+    //
+    //  Operations that completed, and their total latency between this
+    //  filter's pre-operation and post-operation callbacks.
+    //
+
+    LONGLONG Count;
+
+    LONGLONG TotalTicks;
+
+    LONGLONG Buckets[PT_HISTOGRAM_BUCKETS];
+
+} PT_OPERATION_STATS, *PPT_OPERATION_STATS;
+
+//
+//  Returns the upper bound, in ticks, of the bucket that holds the given
+//  percentile of the operations counted in Stats, or 0 if there are none.
+//
+
+__inline
+LONGLONG
+PtStatsPercentile (
+    _In_ const PT_OPERATION_STATS *Stats,
+    _In_ ULONG Percentile
+    )
+{
+    LONGLONG total = 0;
+    LONGLONG target;
+    ULONG bucket;
+
+    for (bucket = 0; bucket < PT_HISTOGRAM_BUCKETS; bucket++) {
+
+        total += Stats->Buckets[bucket];
+    }
+
+    if (total == 0) {
+
+        return 0;
+    }
+
+    target = (total * Percentile + 99) / 100;
+    total = 0;
+
+    for (bucket = 0; bucket < PT_HISTOGRAM_BUCKETS - 1; bucket++) {
+
+        total += Stats->Buckets[bucket];
+
+        if (total >= target) {
+
+            break;
+        }
+    }
+
+    return (LONGLONG) 2 << bucket;
+}
+
+//
+//  Commands sent with FilterSendMessage.
+//
+
+typedef enum _PT_COMMAND {
+
+    //
+    //  Return a PT_STATISTICS structure with the statistics of one
+    //  processor, or the sum over all processors.
+    //
+
+    PtGetStatistics,
+
+    //
+    //  Zero the statistics of all processors.
+    //
+
+    PtResetStatistics
+
+} PT_COMMAND;
+
+#define PT_ALL_PROCESSORS               0xFFFFFFFF
+
+typedef struct _PT_COMMAND_MESSAGE {
+
+    PT_COMMAND Command;
+
+    //
+    //  For PtGetStatistics, the processor index, or PT_ALL_PROCESSORS.
+    //
+
+    ULONG Processor;
+
+} PT_COMMAND_MESSAGE, *PPT_COMMAND_MESSAGE;
+
+typedef struct _PT_STATISTICS {
+
+    //
+    //  Performance counter frequency, in ticks per second.
+    //
+
+    LARGE_INTEGER Frequency;
+
+    //
+    //  Number of processors statistics are kept for. Valid processor
+    //  indexes are below this.
+    //
+
+    ULONG ProcessorCount;
+
+    ULONG Reserved;
+
+    PT_OPERATION_STATS Operations[PT_MAJOR_SLOTS];
+
+} PT_STATISTICS, *PPT_STATISTICS;
+
+#endif //  __PASSTHROUGHUK_H__
+
@@ -0,0 +1,707 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ptload.c
+
+Abstract:
+
+    This program generates file system load and measures its cost with and
+    without the passThrough filter.
+
+    Each thread works in a directory of its own, which holds PTLOAD_FILES
+    files of PTLOAD_IO_SIZE bytes.  Over and over, it opens one of the
+    files, writes it, reads it back and closes it, and after every
+    PTLOAD_DIRECTORY_INTERVAL files it enumerates the directory.  It times
+    each of these operations.  This is done twice:
+
+    - with the filter attached to the directory's volume.  If the filter's
+      statistics port is free, the statistics are reset before the run and
+      printed after it, which shows the latency the filter measured below
+      itself next to the latency the application saw,
+
+    - with the filter detached from the volume, as a baseline.
+
+    The program then prints the cost of the filter for each operation.
+    The filter is attached again at the end.  Detaching and attaching
+    needs administrator rights.
+
+    Usage: ptload Directory [Threads [Seconds]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include "passThroughuk.h"
+#include <dontuse.h>
+
+#define PTLOAD_FILTER_NAME              L"PassThrough"
+
+#define PTLOAD_DEFAULT_SECONDS          10
+#define PTLOAD_MAX_THREADS              64
+
+#define PTLOAD_FILES                    32
+#define PTLOAD_IO_SIZE                  4096
+#define PTLOAD_DIRECTORY_INTERVAL       8
+
+typedef enum _OPERATION {
+
+    OperationOpen,
+    OperationWrite,
+    OperationRead,
+    OperationClose,
+    OperationEnumerate,
+    OperationMax
+
+} OPERATION;
+
+const PCSTR OperationNames[OperationMax] = {
+    "open",
+    "write",
+    "read",
+    "close",
+    "enumerate"
+};
+
+//
+//  The major functions whose statistics are printed after the run with
+//  the filter: IRP_MJ_CREATE, IRP_MJ_WRITE, IRP_MJ_READ, IRP_MJ_CLEANUP,
+//  IRP_MJ_CLOSE and IRP_MJ_DIRECTORY_CONTROL, which are not defined for
+//  applications.
+//
+
+const UCHAR ReportedMajors[] = {
+    0x00,
+    0x04,
+    0x03,
+    0x12,
+    0x02,
+    0x0c
+};
+
+const PCSTR ReportedMajorNames[] = {
+    "CREATE",
+    "WRITE",
+    "READ",
+    "CLEANUP",
+    "CLOSE",
+    "DIRECTORY_CONTROL"
+};
+
+typedef enum _CONFIGURATION {
+
+    ConfigurationFilter,
+    ConfigurationNoFilter,
+    ConfigurationMax
+
+} CONFIGURATION;
+
+const PCSTR ConfigurationNames[ConfigurationMax] = {
+    "filter",
+    "no filter"
+};
+
+typedef struct _OPERATION_TOTALS {
+
+    LONGLONG Count;
+    LONGLONG Ticks;
+
+} OPERATION_TOTALS, *POPERATION_TOTALS;
+
+typedef struct _WORKER {
+
+    ULONG Index;
+    HANDLE Thread;
+    CHAR Directory[MAX_PATH];
+    OPERATION_TOTALS Totals[OperationMax];
+    BOOL Failed;
+
+} WORKER, *PWORKER;
+
+CHAR Directory[MAX_PATH];
+ULONG ThreadCount;
+ULONG Seconds = PTLOAD_DEFAULT_SECONDS;
+
+WORKER Workers[PTLOAD_MAX_THREADS];
+
+volatile LONG StopLoad;
+
+//
+//  Totals over all threads, by configuration and operation, and the
+//  length of each run in performance counter ticks.
+//
+
+OPERATION_TOTALS Totals[ConfigurationMax][OperationMax];
+LONGLONG RunTicks[ConfigurationMax];
+
+LARGE_INTEGER Frequency;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Measures file operations with and without the passThrough filter\n" );
+    printf( "Usage: ptload Directory [Threads [Seconds]]\n" );
+    printf( "    Directory is on a volume the filter is attached to\n" );
+    printf( "    Threads defaults to the number of processors, at most %u\n", PTLOAD_MAX_THREADS );
+    printf( "    Seconds is the length of each run (default %u)\n", PTLOAD_DEFAULT_SECONDS );
+}
+
+
+BOOL
+GetFilePath (
+    _In_ PWORKER Worker,
+    _In_ ULONG Index,
+    _Out_writes_(MAX_PATH) PCHAR Path
+    )
+{
+    return _snprintf_s( Path, MAX_PATH, _TRUNCATE, "%s\\ptload%04u.tmp", Worker->Directory, Index ) >= 0;
+}
+
+
+BOOL
+CreateFiles (
+    _Inout_ PWORKER Worker
+    )
+/*++
+
+Routine Description:
+
+    Creates the directory of a thread and its files.  This is not timed.
+
+--*/
+{
+    CHAR path[MAX_PATH];
+    UCHAR buffer[PTLOAD_IO_SIZE];
+    HANDLE file;
+    DWORD bytes;
+    ULONG i;
+
+    if (_snprintf_s( Worker->Directory, MAX_PATH, _TRUNCATE, "%s\\ptload%02u", Directory, Worker->Index ) < 0) {
+
+        printf( "ERROR: Directory name is too long\n" );
+        return FALSE;
+    }
+
+    if (!CreateDirectoryA( Worker->Directory, NULL ) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS)) {
+
+        printf( "ERROR: Creating %s: %u\n", Worker->Directory, GetLastError() );
+        return FALSE;
+    }
+
+    FillMemory( buffer, sizeof( buffer ), (UCHAR) Worker->Index );
+
+    for (i = 0; i < PTLOAD_FILES; i++) {
+
+        GetFilePath( Worker, i, path );
+
+        file = CreateFileA( path,
+                            GENERIC_WRITE,
+                            0,
+                            NULL,
+                            CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL );
+
+        if (file == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Creating %s: %u\n", path, GetLastError() );
+            return FALSE;
+        }
+
+        if (!WriteFile( file, buffer, sizeof( buffer ), &bytes, NULL )) {
+
+            printf( "ERROR: Writing %s: %u\n", path, GetLastError() );
+            CloseHandle( file );
+            return FALSE;
+        }
+
+        CloseHandle( file );
+    }
+
+    return TRUE;
+}
+
+
+VOID
+DeleteFiles (
+    _In_ PWORKER Worker
+    )
+{
+    CHAR path[MAX_PATH];
+    ULONG i;
+
+    for (i = 0; i < PTLOAD_FILES; i++) {
+
+        GetFilePath( Worker, i, path );
+        DeleteFileA( path );
+    }
+
+    RemoveDirectoryA( Worker->Directory );
+}
+
+
+VOID
+AddTime (
+    _Inout_ PWORKER Worker,
+    _In_ OPERATION Operation,
+    _Inout_ PLARGE_INTEGER Last
+    )
+/*++
+
+Routine Description:
+
+    Charges the time since Last to an operation and moves Last to now.
+
+--*/
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter( &now );
+
+    Worker->Totals[Operation].Count += 1;
+    Worker->Totals[Operation].Ticks += now.QuadPart - Last->QuadPart;
+
+    *Last = now;
+}
+
+
+DWORD
+WINAPI
+WorkerThread (
+    _In_ LPVOID Parameter
+    )
+{
+    PWORKER worker = Parameter;
+    CHAR path[MAX_PATH];
+    CHAR pattern[MAX_PATH];
+    UCHAR buffer[PTLOAD_IO_SIZE];
+    WIN32_FIND_DATAA findData;
+    LARGE_INTEGER last;
+    HANDLE file;
+    HANDLE find;
+    DWORD bytes;
+    ULONG iteration;
+
+    _snprintf_s( pattern, MAX_PATH, _TRUNCATE, "%s\\*", worker->Directory );
+    FillMemory( buffer, sizeof( buffer ), (UCHAR) worker->Index );
+
+    for (iteration = 0; !StopLoad; iteration++) {
+
+        GetFilePath( worker, iteration % PTLOAD_FILES, path );
+
+        QueryPerformanceCounter( &last );
+
+        file = CreateFileA( path,
+                            GENERIC_READ | GENERIC_WRITE,
+                            0,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL );
+
+        if (file == INVALID_HANDLE_VALUE) {
+
+            printf( "ERROR: Opening %s: %u\n", path, GetLastError() );
+            worker->Failed = TRUE;
+            break;
+        }
+
+        AddTime( worker, OperationOpen, &last );
+
+        if (!WriteFile( file, buffer, sizeof( buffer ), &bytes, NULL )) {
+
+            printf( "ERROR: Writing %s: %u\n", path, GetLastError() );
+            worker->Failed = TRUE;
+            CloseHandle( file );
+            break;
+        }
+
+        AddTime( worker, OperationWrite, &last );
+
+        SetFilePointer( file, 0, NULL, FILE_BEGIN );
+        QueryPerformanceCounter( &last );
+
+        if (!ReadFile( file, buffer, sizeof( buffer ), &bytes, NULL )) {
+
+            printf( "ERROR: Reading %s: %u\n", path, GetLastError() );
+            worker->Failed = TRUE;
+            CloseHandle( file );
+            break;
+        }
+
+        AddTime( worker, OperationRead, &last );
+
+        CloseHandle( file );
+
+        AddTime( worker, OperationClose, &last );
+
+        if ((iteration % PTLOAD_DIRECTORY_INTERVAL) == PTLOAD_DIRECTORY_INTERVAL - 1) {
+
+            find = FindFirstFileA( pattern, &findData );
+
+            if (find == INVALID_HANDLE_VALUE) {
+
+                printf( "ERROR: Enumerating %s: %u\n", worker->Directory, GetLastError() );
+                worker->Failed = TRUE;
+                break;
+            }
+
+            while (FindNextFileA( find, &findData )) {
+
+                NOTHING;
+            }
+
+            FindClose( find );
+
+            AddTime( worker, OperationEnumerate, &last );
+        }
+    }
+
+    return 0;
+}
+
+
+BOOL
+ReadStatistics (
+    _In_ HANDLE Port,
+    _In_ PT_COMMAND Command,
+    _Out_opt_ PPT_STATISTICS Statistics
+    )
+{
+    PT_COMMAND_MESSAGE command;
+    DWORD bytesReturned;
+    HRESULT hr;
+
+    command.Command = Command;
+    command.Processor = PT_ALL_PROCESSORS;
+
+    hr = FilterSendMessage( Port,
+                            &command,
+                            sizeof( command ),
+                            Statistics,
+                            (Statistics != NULL) ? sizeof( *Statistics ) : 0,
+                            &bytesReturned );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Sending a command to the filter: 0x%08x\n", hr );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+PrintFilterStatistics (
+    _In_ PPT_STATISTICS Statistics
+    )
+{
+    PPT_OPERATION_STATS stats;
+    double ticksPerMicrosecond = (double) Statistics->Frequency.QuadPart / 1000000.0;
+    ULONG i;
+
+    printf( "    below the filter:\n" );
+
+    for (i = 0; i < ARRAYSIZE( ReportedMajors ); i++) {
+
+        stats = &Statistics->Operations[PT_SLOT_FROM_MAJOR( ReportedMajors[i] )];
+
+        if (stats->Count == 0) {
+
+            continue;
+        }
+
+        printf( "    %-18s %12I64d %10.1f us mean %10.1f us p99\n",
+                ReportedMajorNames[i],
+                stats->Count,
+                (double) stats->TotalTicks / ticksPerMicrosecond / (double) stats->Count,
+                (double) PtStatsPercentile( stats, 99 ) / ticksPerMicrosecond );
+    }
+}
+
+
+BOOL
+RunConfiguration (
+    _In_ CONFIGURATION Configuration
+    )
+{
+    PPT_STATISTICS statistics = NULL;
+    HANDLE port = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    OPERATION operation;
+    POPERATION_TOTALS totals;
+    ULONG prepared;
+    BOOL result = TRUE;
+    HRESULT hr;
+    ULONG i;
+
+    if (Configuration == ConfigurationFilter) {
+
+        statistics = malloc( sizeof( PT_STATISTICS ) );
+
+        hr = FilterConnectCommunicationPort( PT_PORT_NAME,
+                                             0,
+                                             NULL,
+                                             0,
+                                             NULL,
+                                             &port );
+
+        if (IS_ERROR( hr ) || (statistics == NULL) ||
+            !ReadStatistics( port, PtResetStatistics, NULL )) {
+
+            printf( "    the filter's statistics are not available (0x%08x)\n", hr );
+
+            if (!IS_ERROR( hr )) {
+
+                CloseHandle( port );
+            }
+
+            port = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    ZeroMemory( Workers, sizeof( Workers ) );
+    InterlockedExchange( &StopLoad, 0 );
+
+    for (prepared = 0; prepared < ThreadCount; prepared++) {
+
+        Workers[prepared].Index = prepared;
+
+        if (!CreateFiles( &Workers[prepared] )) {
+
+            prepared += 1;
+            result = FALSE;
+            goto Cleanup;
+        }
+    }
+
+    QueryPerformanceCounter( &start );
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        Workers[i].Thread = CreateThread( NULL, 0, WorkerThread, &Workers[i], 0, NULL );
+
+        if (Workers[i].Thread == NULL) {
+
+            printf( "ERROR: Creating a thread: %u\n", GetLastError() );
+            InterlockedExchange( &StopLoad, 1 );
+            result = FALSE;
+            break;
+        }
+    }
+
+    if (result) {
+
+        Sleep( Seconds * 1000 );
+        InterlockedExchange( &StopLoad, 1 );
+    }
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Thread != NULL) {
+
+            WaitForSingleObject( Workers[i].Thread, INFINITE );
+            CloseHandle( Workers[i].Thread );
+        }
+    }
+
+    QueryPerformanceCounter( &end );
+    RunTicks[Configuration] = end.QuadPart - start.QuadPart;
+
+    for (i = 0; i < ThreadCount; i++) {
+
+        if (Workers[i].Failed) {
+
+            result = FALSE;
+        }
+
+        for (operation = 0; operation < OperationMax; operation++) {
+
+            Totals[Configuration][operation].Count += Workers[i].Totals[operation].Count;
+            Totals[Configuration][operation].Ticks += Workers[i].Totals[operation].Ticks;
+        }
+    }
+
+    printf( "%s\n", ConfigurationNames[Configuration] );
+
+    for (operation = 0; operation < OperationMax; operation++) {
+
+        totals = &Totals[Configuration][operation];
+
+        if (totals->Count == 0) {
+
+            continue;
+        }
+
+        printf( "    %-18s %12.0f/s %10.1f us mean\n",
+                OperationNames[operation],
+                (double) totals->Count * Frequency.QuadPart / (double) RunTicks[Configuration],
+                (double) totals->Ticks * 1000000.0 / Frequency.QuadPart / (double) totals->Count );
+    }
+
+    if ((port != INVALID_HANDLE_VALUE) &&
+        ReadStatistics( port, PtGetStatistics, statistics )) {
+
+        PrintFilterStatistics( statistics );
+    }
+
+Cleanup:
+
+    for (i = 0; i < prepared; i++) {
+
+        DeleteFiles( &Workers[i] );
+    }
+
+    if (port != INVALID_HANDLE_VALUE) {
+
+        CloseHandle( port );
+    }
+
+    free( statistics );
+
+    return result;
+}
+
+
+int _cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    CHAR volumePath[MAX_PATH];
+    CHAR volumeName[MAX_PATH];
+    WCHAR volume[MAX_PATH];
+    CONFIGURATION configuration;
+    OPERATION operation;
+    POPERATION_TOTALS filter;
+    POPERATION_TOTALS noFilter;
+    BOOL detached = FALSE;
+    HRESULT hr;
+    int status = 0;
+
+    if (argc < 2 || argc > 4) {
+
+        Usage();
+        return 1;
+    }
+
+    if (strcpy_s( Directory, sizeof( Directory ), argv[1] ) != 0) {
+
+        printf( "ERROR: Directory name is too long\n" );
+        return 1;
+    }
+
+    ThreadCount = min( GetActiveProcessorCount( ALL_PROCESSOR_GROUPS ), PTLOAD_MAX_THREADS );
+
+    if (argc >= 3) {
+
+        ThreadCount = (ULONG) atoi( argv[2] );
+    }
+
+    if (argc == 4) {
+
+        Seconds = (ULONG) atoi( argv[3] );
+    }
+
+    if ((ThreadCount == 0) || (ThreadCount > PTLOAD_MAX_THREADS) || (Seconds == 0)) {
+
+        Usage();
+        return 1;
+    }
+
+    //
+    //  The filter is detached from, and attached to, the volume by its
+    //  GUID name.
+    //
+
+    if (!GetVolumePathNameA( Directory, volumePath, sizeof( volumePath ) ) ||
+        !GetVolumeNameForVolumeMountPointA( volumePath, volumeName, sizeof( volumeName ) ) ||
+        (MultiByteToWideChar( CP_ACP, 0, volumeName, -1, volume, ARRAYSIZE( volume ) ) == 0)) {
+
+        printf( "ERROR: Getting the volume of %s: %u\n", Directory, GetLastError() );
+        return 2;
+    }
+
+    QueryPerformanceFrequency( &Frequency );
+
+    printf( "%u threads, %u s per run\n\n", ThreadCount, Seconds );
+
+    for (configuration = 0; configuration < ConfigurationMax; configuration++) {
+
+        if (configuration == ConfigurationNoFilter) {
+
+            hr = FilterDetach( PTLOAD_FILTER_NAME, volume, NULL );
+
+            if (IS_ERROR( hr )) {
+
+                printf( "ERROR: Detaching the filter from %ws: 0x%08x\n", volume, hr );
+                status = 2;
+                break;
+            }
+
+            detached = TRUE;
+        }
+
+        if (!RunConfiguration( configuration )) {
+
+            status = 3;
+            break;
+        }
+    }
+
+    if (detached) {
+
+        hr = FilterAttach( PTLOAD_FILTER_NAME, volume, NULL, 0, NULL );
+
+        if (IS_ERROR( hr )) {
+
+            printf( "ERROR: Attaching the filter to %ws again: 0x%08x\n", volume, hr );
+            status = 2;
+        }
+    }
+
+    if (status == 0) {
+
+        printf( "\ncost of the filter, by operation\n" );
+
+        for (operation = 0; operation < OperationMax; operation++) {
+
+            filter = &Totals[ConfigurationFilter][operation];
+            noFilter = &Totals[ConfigurationNoFilter][operation];
+
+            if ((filter->Count == 0) || (noFilter->Count == 0)) {
+
+                continue;
+            }
+
+            printf( "    %-18s %8.2f us, %6.1f%%\n",
+                    OperationNames[operation],
+                    ((double) filter->Ticks / (double) filter->Count -
+                     (double) noFilter->Ticks / (double) noFilter->Count) * 1000000.0 / Frequency.QuadPart,
+                    100.0 * ((double) filter->Ticks * noFilter->Count /
+                             ((double) noFilter->Ticks * filter->Count) - 1.0) );
+        }
+
+        printf( "    %-18s %6.1f%% fewer files per second\n",
+                "all",
+                100.0 * (1.0 - ((double) Totals[ConfigurationFilter][OperationOpen].Count / RunTicks[ConfigurationFilter]) /
+                               ((double) Totals[ConfigurationNoFilter][OperationOpen].Count / RunTicks[ConfigurationNoFilter])) );
+    }
+
+    return status;
+}
@@ -0,0 +1,342 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ptstats.c
+
+Abstract:
+
+    This program reads the operation latency statistics of the passThrough
+    filter through its port and prints them.
+
+    For each major function that completed at least once, it prints the
+    count, the mean latency and the 50th, 90th and 99th percentiles, in
+    microseconds, and with -h the histogram itself.  The percentiles are
+    the upper bounds of the log2 buckets they fall in.
+
+    With -i it resets the statistics and prints those of each interval
+    until Ctrl+C is pressed.
+
+    Usage: ptstats [-p Processor] [-h] [-r] [-i Seconds]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fltuser.h>
+#include "passThroughuk.h"
+#include <dontuse.h>
+
+const PCSTR MajorNames[PT_MAJOR_SLOTS] = {
+    "CREATE",
+    "CREATE_NAMED_PIPE",
+    "CLOSE",
+    "READ",
+    "WRITE",
+    "QUERY_INFORMATION",
+    "SET_INFORMATION",
+    "QUERY_EA",
+    "SET_EA",
+    "FLUSH_BUFFERS",
+    "QUERY_VOLUME_INFORMATION",
+    "SET_VOLUME_INFORMATION",
+    "DIRECTORY_CONTROL",
+    "FILE_SYSTEM_CONTROL",
+    "DEVICE_CONTROL",
+    "INTERNAL_DEVICE_CONTROL",
+    "SHUTDOWN",
+    "LOCK_CONTROL",
+    "CLEANUP",
+    "CREATE_MAILSLOT",
+    "QUERY_SECURITY",
+    "SET_SECURITY",
+    "POWER",
+    "SYSTEM_CONTROL",
+    "DEVICE_CHANGE",
+    "QUERY_QUOTA",
+    "SET_QUOTA",
+    "PNP",
+    "ACQUIRE_FOR_SECTION_SYNCHRONIZATION",
+    "RELEASE_FOR_SECTION_SYNCHRONIZATION",
+    "ACQUIRE_FOR_MOD_WRITE",
+    "RELEASE_FOR_MOD_WRITE",
+    "ACQUIRE_FOR_CC_FLUSH",
+    "RELEASE_FOR_CC_FLUSH",
+    "QUERY_OPEN",
+    "(-8)",
+    "(-9)",
+    "(-10)",
+    "(-11)",
+    "(-12)",
+    "FAST_IO_CHECK_IF_POSSIBLE",
+    "NETWORK_QUERY_OPEN",
+    "MDL_READ",
+    "MDL_READ_COMPLETE",
+    "PREPARE_MDL_WRITE",
+    "MDL_WRITE_COMPLETE",
+    "VOLUME_MOUNT",
+    "VOLUME_DISMOUNT"
+};
+
+volatile LONG StopPrinting;
+
+
+VOID
+Usage (
+    VOID
+    )
+{
+    printf( "Prints the operation latencies measured by the passThrough filter\n" );
+    printf( "Usage: ptstats [-p Processor] [-h] [-r] [-i Seconds]\n" );
+    printf( "    -p  Print the statistics of one processor instead of their sum\n" );
+    printf( "    -h  Print the histograms\n" );
+    printf( "    -r  Reset the statistics after printing them\n" );
+    printf( "    -i  Reset the statistics, then print those of every interval\n" );
+}
+
+
+BOOL
+WINAPI
+ConsoleHandler (
+    _In_ DWORD CtrlType
+    )
+{
+    UNREFERENCED_PARAMETER( CtrlType );
+
+    InterlockedExchange( &StopPrinting, 1 );
+
+    return TRUE;
+}
+
+
+double
+TicksToMicroseconds (
+    _In_ LONGLONG Ticks,
+    _In_ LONGLONG Frequency
+    )
+{
+    return (double) Ticks * 1000000.0 / (double) Frequency;
+}
+
+
+VOID
+PrintStatistics (
+    _In_ PPT_STATISTICS Statistics,
+    _In_ BOOL Histograms
+    )
+{
+    PPT_OPERATION_STATS stats;
+    LONGLONG frequency = Statistics->Frequency.QuadPart;
+    ULONG slot;
+    ULONG bucket;
+
+    printf( "%-36s %12s %10s %10s %10s %10s\n",
+            "operation",
+            "count",
+            "mean us",
+            "p50 us",
+            "p90 us",
+            "p99 us" );
+
+    for (slot = 0; slot < PT_MAJOR_SLOTS; slot++) {
+
+        stats = &Statistics->Operations[slot];
+
+        if (stats->Count == 0) {
+
+            continue;
+        }
+
+        printf( "%-36s %12I64d %10.1f %10.1f %10.1f %10.1f\n",
+                MajorNames[slot],
+                stats->Count,
+                TicksToMicroseconds( stats->TotalTicks, frequency ) / (double) stats->Count,
+                TicksToMicroseconds( PtStatsPercentile( stats, 50 ), frequency ),
+                TicksToMicroseconds( PtStatsPercentile( stats, 90 ), frequency ),
+                TicksToMicroseconds( PtStatsPercentile( stats, 99 ), frequency ) );
+
+        if (!Histograms) {
+
+            continue;
+        }
+
+        for (bucket = 0; bucket < PT_HISTOGRAM_BUCKETS; bucket++) {
+
+            if (stats->Buckets[bucket] == 0) {
+
+                continue;
+            }
+
+            printf( "    < %12.1f us %12I64d\n",
+                    TicksToMicroseconds( (LONGLONG) 2 << bucket, frequency ),
+                    stats->Buckets[bucket] );
+        }
+    }
+}
+
+
+HRESULT
+SendCommand (
+    _In_ HANDLE Port,
+    _In_ PT_COMMAND Command,
+    _In_ ULONG Processor,
+    _Out_opt_ PPT_STATISTICS Statistics
+    )
+{
+    PT_COMMAND_MESSAGE command;
+    DWORD bytesReturned;
+
+    command.Command = Command;
+    command.Processor = Processor;
+
+    return FilterSendMessage( Port,
+                              &command,
+                              sizeof( command ),
+                              Statistics,
+                              (Statistics != NULL) ? sizeof( *Statistics ) : 0,
+                              &bytesReturned );
+}
+
+
+int
+_cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    PPT_STATISTICS statistics;
+    HANDLE port = INVALID_HANDLE_VALUE;
+    ULONG processor = PT_ALL_PROCESSORS;
+    ULONG interval = 0;
+    BOOL histograms = FALSE;
+    BOOL reset = FALSE;
+    HRESULT hr;
+    int status = 0;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+
+        if ((_stricmp( argv[arg], "-p" ) == 0) && (arg + 1 < argc)) {
+
+            processor = strtoul( argv[++arg], NULL, 0 );
+
+        } else if (_stricmp( argv[arg], "-h" ) == 0) {
+
+            histograms = TRUE;
+
+        } else if (_stricmp( argv[arg], "-r" ) == 0) {
+
+            reset = TRUE;
+
+        } else if ((_stricmp( argv[arg], "-i" ) == 0) && (arg + 1 < argc)) {
+
+            interval = strtoul( argv[++arg], NULL, 0 );
+
+            if (interval == 0) {
+
+                Usage();
+                return 1;
+            }
+
+        } else {
+
+            Usage();
+            return 1;
+        }
+    }
+
+    //
+    //  PT_STATISTICS holds LONGLONGs and the filter checks the alignment
+    //  of the buffer.
+    //
+
+    statistics = malloc( sizeof( PT_STATISTICS ) );
+
+    if (statistics == NULL) {
+
+        printf( "ERROR: Allocating the statistics buffer\n" );
+        return 1;
+    }
+
+    hr = FilterConnectCommunicationPort( PT_PORT_NAME,
+                                         0,
+                                         NULL,
+                                         0,
+                                         NULL,
+                                         &port );
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Connecting to the passThrough filter: 0x%08x\n", hr );
+        free( statistics );
+        return 1;
+    }
+
+    if (interval > 0) {
+
+        SetConsoleCtrlHandler( ConsoleHandler, TRUE );
+
+        hr = SendCommand( port, PtResetStatistics, 0, NULL );
+    }
+
+    do {
+
+        if (IS_ERROR( hr )) {
+
+            break;
+        }
+
+        if (interval > 0) {
+
+            Sleep( interval * 1000 );
+        }
+
+        hr = SendCommand( port, PtGetStatistics, processor, statistics );
+
+        if (IS_ERROR( hr )) {
+
+            break;
+        }
+
+        //
+        //  Reset right after reading, so that an interval loses as few
+        //  operations as possible.
+        //
+
+        if (reset || (interval > 0)) {
+
+            hr = SendCommand( port, PtResetStatistics, 0, NULL );
+        }
+
+        if (processor == PT_ALL_PROCESSORS) {
+
+            printf( "\nall %u processors\n", statistics->ProcessorCount );
+
+        } else {
+
+            printf( "\nprocessor %u of %u\n", processor, statistics->ProcessorCount );
+        }
+
+        PrintStatistics( statistics, histograms );
+
+    } while ((interval > 0) && !StopPrinting);
+
+    if (IS_ERROR( hr )) {
+
+        printf( "ERROR: Reading the statistics: 0x%08x\n", hr );
+        status = 1;
+    }
+
+    CloseHandle( port );
+    free( statistics );
+
+    return status;
+}
@@ -23,10 +23,12 @@ However, on downlevel OS Versions SimRep will go ahead and replace the name
 itself.
 
 It is important to note that SimRep only demonstrates how to return
-STATUS_REPARSE, not how to deal with file names on NT. SimRep uses two strings
-to act as a mapping. When the file open name starts with the "old name mapping"
-string the filter replaces it with the "new name mapping" string. This does not
-take short names into account.
+STATUS_REPARSE, not how to deal with file names on NT. SimRep uses pairs of
+strings to act as mappings. When the file open name starts with an "old name
+mapping" string the filter replaces it with the matching "new name mapping"
+string. This does not take short names into account. The mappings are compiled
+into a trie of path components so the cost of a create does not grow with the
+number of mappings, and they are replaced atomically when the registry changes.
 
 SimRep can also be configured to redirect renames and creation of hardlinks.
 This functionality is demonstrated in the code and can be turned on with a
@@ -87,6 +89,7 @@ Environment:
 
 #define SIMREP_STRING_TAG            'tSpR'
 #define SIMREP_REG_TAG               'eRpR'
+#define SIMREP_RUNDOWN_TAG           'dRpR'
 
 //
 // Constants
@@ -96,26 +99,40 @@ Environment:
 
 #define REPLACE_QUERY_DIRECTORY_FILE_ROUTINE_NAME_STRING "FltQueryDirectoryFile"
 
+//
+//  Each string in the "Mappings" REG_MULTI_SZ value holds one rule in the
+//  form "OldPath|NewPath". '|' cannot appear in a file name so it is safe
+//  to use as the separator.
+//
+
+#define SIMREP_MAPPING_SEPARATOR     L'|'
+
 
 //
 //  Context sample filter global data structures.
 //
 
-typedef struct _MAPPING_ENTRY {
+//
+//  The mappings and the tries they are compiled into.
+//
 
-    //
-    //  Path underwhich we want to reparse.
-    //
+#include "simreptrie.h"
 
-    UNICODE_STRING OldName;
+//
+//  Rule sets are published through one of two slots. Readers take rundown
+//  protection on the active slot which is an interlocked operation, not a
+//  lock, so creates never block behind a configuration change. The writer
+//  publishes into the idle slot, switches the active index and then waits
+//  for the readers of the previous slot to drain before freeing its rules.
+//
 
-    //
-    //  Path to reparse to.
-    //
+typedef struct _SIMREP_RULE_SET_SLOT {
+
+    PSIMREP_RULE_SET RuleSet;
 
-    UNICODE_STRING NewName;
+    PEX_RUNDOWN_REF_CACHE_AWARE Rundown;
 
-} MAPPING_ENTRY, *PMAPPING_ENTRY;
+} SIMREP_RULE_SET_SLOT, *PSIMREP_RULE_SET_SLOT;
 
 
 //
@@ -158,10 +175,41 @@ typedef struct _SIMREP_GLOBAL_DATA {
     PFLT_FILTER Filter;
 
     //
-    //  Structure to hold mapping information.
+    //  Slots holding the current and the retiring rule set, and the
+    //  index of the slot creates should use.
+    //
+
+    SIMREP_RULE_SET_SLOT RuleSetSlots[2];
+
+    volatile LONG ActiveRuleSetSlot;
+
+    //
+    //  Handle to the parameters key. It is kept open so the filter can be
+    //  notified when the mappings change and reload them.
+    //
+
+    HANDLE ParametersKey;
+
+    //
+    //  State for the registry change notification. RuleSetUpdateLock
+    //  serializes arming the notification against closing the key on
+    //  unload and RuleSetUpdateIdle is signaled whenever no notification
+    //  is outstanding. The notification can only queue an executive work
+    //  item, which hands the update off to a generic work item so the
+    //  filter stays referenced while the update runs.
     //
 
-    MAPPING_ENTRY Mapping;
+    ERESOURCE RuleSetUpdateLock;
+
+    WORK_QUEUE_ITEM RuleSetUpdateWorkItem;
+
+    PFLT_GENERIC_WORKITEM RuleSetUpdateGenericWorkItem;
+
+    IO_STATUS_BLOCK RuleSetUpdateIoStatus;
+
+    KEVENT RuleSetUpdateIdle;
+
+    BOOLEAN Unloading;
 
     //
     //  Pointer to the function we will use to
@@ -216,6 +264,8 @@ typedef struct _SIMREP_GLOBAL_DATA {
 
 #define DEBUG_TRACE_ALL_IO                              0x00000100  // All IO operations tracked by this filter
 
+#define DEBUG_TRACE_RULE_SET_UPDATES                    0x00000200  // Loading and publishing of mapping rule sets
+
 #define DEBUG_TRACE_ALL                                 0xFFFFFFFF  // All flags
 
 
@@ -299,21 +349,6 @@ SimRepPreSetInformation (
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
-//
-//  Functions that provide string allocation support
-//
-
-_When_(return==0, _Post_satisfies_(String->Buffer != NULL))
-NTSTATUS
-SimRepAllocateUnicodeString (
-    _Inout_ PUNICODE_STRING String
-    );
-
-VOID
-SimRepFreeUnicodeString (
-    _Inout_ PUNICODE_STRING String
-    );
-
 NTSTATUS
 SimRepReplaceFileObjectName (
     _In_ PFILE_OBJECT FileObject,
@@ -339,6 +374,67 @@ SimRepMungeName(
     _Out_ PUNICODE_STRING MungedPath
     );
 
+//
+//  Functions that build, publish and look up mapping rule sets
+//
+
+NTSTATUS
+SimRepQueryRegistryValue (
+    _In_ HANDLE Key,
+    _In_ PCWSTR ValueName,
+    _In_ ULONG Type,
+    _Outptr_ PKEY_VALUE_PARTIAL_INFORMATION *Value
+    );
+
+NTSTATUS
+SimRepLoadRuleSet (
+    _In_ HANDLE ParametersKey,
+    _Outptr_ PSIMREP_RULE_SET *RuleSet
+    );
+
+VOID
+SimRepPublishRuleSet (
+    _In_ PSIMREP_RULE_SET RuleSet
+    );
+
+PSIMREP_RULE_SET_SLOT
+SimRepReferenceRuleSet (
+    VOID
+    );
+
+VOID
+SimRepDereferenceRuleSet (
+    _In_ PSIMREP_RULE_SET_SLOT Slot
+    );
+
+PMAPPING_ENTRY
+SimRepFindMapping (
+    _In_ PSIMREP_RULE_SET RuleSet,
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _In_ BOOLEAN MatchNewName,
+    _In_ BOOLEAN IgnoreCase,
+    _Out_opt_ PBOOLEAN ExactMatch
+    );
+
+NTSTATUS
+SimRepArmRuleSetUpdate (
+    VOID
+    );
+
+WORKER_THREAD_ROUTINE SimRepRuleSetUpdateNotify;
+
+VOID
+SimRepRuleSetUpdateWorker (
+    _In_ PFLT_GENERIC_WORKITEM WorkItem,
+    _In_ PFLT_FILTER Filter,
+    _In_ PVOID Context
+    );
+
+VOID
+SimRepStopRuleSetUpdates (
+    VOID
+    );
+
 //
 //  Functions that implement a pass through name provider
 //
@@ -525,6 +621,16 @@ SIMREP_GLOBAL_DATA Globals;
 #pragma alloc_text(PAGE, SimRepNormalizeNameComponentEx)
 #endif
 #pragma alloc_text(PAGE, SimRepQueryDirectoryFile)
+#pragma alloc_text(PAGE, SimRepQueryRegistryValue)
+#pragma alloc_text(PAGE, SimRepLoadRuleSet)
+#pragma alloc_text(PAGE, SimRepPublishRuleSet)
+#pragma alloc_text(PAGE, SimRepReferenceRuleSet)
+#pragma alloc_text(PAGE, SimRepDereferenceRuleSet)
+#pragma alloc_text(PAGE, SimRepFindMapping)
+#pragma alloc_text(PAGE, SimRepArmRuleSetUpdate)
+#pragma alloc_text(PAGE, SimRepRuleSetUpdateNotify)
+#pragma alloc_text(PAGE, SimRepRuleSetUpdateWorker)
+#pragma alloc_text(PAGE, SimRepStopRuleSetUpdates)
 
 #endif
 
@@ -564,6 +670,7 @@ Return Value:
     NTSTATUS status;
     UNICODE_STRING replaceRoutineName;
     PFLT_REGISTRATION Registration;
+    ULONG i;
 
     //
     //  Default to NonPagedPoolNx for non paged pool allocations where supported.
@@ -583,9 +690,42 @@ Return Value:
 
     Globals.RemapRenamesAndLinks = FALSE;
 
-    RtlInitUnicodeString( &Globals.Mapping.NewName, NULL );
+    //
+    //  Set up the rule set slots. Both slots start out run down, the first
+    //  rule set published by SimRepSetConfiguration activates one of them.
+    //
+
+    ExInitializeResourceLite( &Globals.RuleSetUpdateLock );
 
-    RtlInitUnicodeString( &Globals.Mapping.OldName, NULL );
+    KeInitializeEvent( &Globals.RuleSetUpdateIdle, NotificationEvent, TRUE );
+
+    ExInitializeWorkItem( &Globals.RuleSetUpdateWorkItem,
+                          SimRepRuleSetUpdateNotify,
+                          NULL );
+
+    Globals.RuleSetUpdateGenericWorkItem = FltAllocateGenericWorkItem();
+
+    if (Globals.RuleSetUpdateGenericWorkItem == NULL) {
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto DriverEntryCleanup;
+    }
+
+    Globals.ActiveRuleSetSlot = 1;
+
+    for (i = 0; i < RTL_NUMBER_OF( Globals.RuleSetSlots ); i++) {
+
+        Globals.RuleSetSlots[i].Rundown = ExAllocateCacheAwareRundownProtection( NonPagedPoolNx,
+                                                                                 SIMREP_RUNDOWN_TAG );
+
+        if (Globals.RuleSetSlots[i].Rundown == NULL) {
+
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto DriverEntryCleanup;
+        }
+
+        ExWaitForRundownProtectionReleaseCacheAware( Globals.RuleSetSlots[i].Rundown );
+    }
 
     //
     //  Import function to replace file names.
@@ -646,8 +786,25 @@ Return Value:
     if (!NT_SUCCESS( status )) {
 
         FltUnregisterFilter( Globals.Filter );
+        goto DriverEntryCleanup;
     }
 
+    //
+    //  Watch the parameters key so mapping changes take effect without
+    //  reloading the filter. Failing to arm the notification is not fatal,
+    //  the mappings loaded above stay in effect.
+    //
+
+    FltAcquireResourceExclusive( &Globals.RuleSetUpdateLock );
+
+    if (!NT_SUCCESS( SimRepArmRuleSetUpdate() )) {
+
+        DebugTrace( DEBUG_TRACE_RULE_SET_UPDATES | DEBUG_TRACE_ERROR,
+                    ("[SimRep]: Failed to watch for mapping changes, mappings are static\n") );
+    }
+
+    FltReleaseResource( &Globals.RuleSetUpdateLock );
+
 
 DriverEntryCleanup:
 
@@ -693,264 +850,807 @@ Return Value:
     PKEY_VALUE_PARTIAL_INFORMATION value = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
     ULONG valueLength = sizeof(buffer);
     ULONG resultLength;
-    PKEY_VALUE_PARTIAL_INFORMATION mappingValue = NULL;
-    ULONG mappingValueLength = 0;
-    WCHAR oldMappingTail;
-    WCHAR newMappingTail;
+    PSIMREP_RULE_SET ruleSet;
+
+    PAGED_CODE();
+
+    //
+    //  Open the SimRep registry key.
+    //
+
+    InitializeObjectAttributes( &attributes,
+                                RegistryPath,
+                                OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                                NULL,
+                                NULL );
+
+    status = ZwOpenKey( &driverRegKey,
+                        KEY_READ,
+                        &attributes );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto SimRepSetConfigurationCleanup;
+    }
+
+
+#if DBG
+
+    //
+    // Query the debug level
+    //
+
+    RtlInitUnicodeString( &valueName, L"DebugLevel" );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              value,
+                              valueLength,
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        Globals.DebugLevel = *(PULONG)value->Data;
+    }
+
+#endif
+
+
+    //
+    // Query the remap rename flag
+    //
+
+    RtlInitUnicodeString( &valueName, L"RemapRenamesAndLinks" );
+
+    status = ZwQueryValueKey( driverRegKey,
+                              &valueName,
+                              KeyValuePartialInformation,
+                              value,
+                              valueLength,
+                              &resultLength );
+
+    if (NT_SUCCESS( status )) {
+
+        Globals.RemapRenamesAndLinks = *(PULONG)value->Data > 0 ? TRUE : FALSE;
+    }
+
+    //
+    //  Load the mappings and publish them for creates to use.
+    //
+
+    status = SimRepLoadRuleSet( driverRegKey, &ruleSet );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto SimRepSetConfigurationCleanup;
+    }
+
+    SimRepPublishRuleSet( ruleSet );
+
+    //
+    //  Keep the key open, it is used to reload the mappings when they
+    //  change.
+    //
+
+    Globals.ParametersKey = driverRegKey;
+    driverRegKey = NULL;
+
+SimRepSetConfigurationCleanup:
+
+    if (driverRegKey != NULL) {
+
+        ZwClose( driverRegKey );
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+SimRepQueryRegistryValue (
+    _In_ HANDLE Key,
+    _In_ PCWSTR ValueName,
+    _In_ ULONG Type,
+    _Outptr_ PKEY_VALUE_PARTIAL_INFORMATION *Value
+    )
+/*++
+
+Routine Descrition:
+
+    This routine queries a registry value of the given type into a buffer
+    allocated from paged pool.
+
+Arguments:
+
+    Key - Handle to the key holding the value.
+
+    ValueName - Name of the value to query.
+
+    Type - The registry type the value is required to have.
+
+    Value - Receives the value. The caller frees it with SIMREP_REG_TAG.
+
+Return Value:
+
+    STATUS_OBJECT_NAME_NOT_FOUND if the value does not exist,
+    STATUS_INVALID_PARAMETER if it has the wrong type, or the status of
+    the query.
+
+--*/
+{
+    NTSTATUS status;
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION value = NULL;
+    ULONG valueLength = 0;
+
+    PAGED_CODE();
+
+    *Value = NULL;
+
+    RtlInitUnicodeString( &valueName, ValueName );
+
+    //
+    //  The value may change between the two queries, so retry until the
+    //  buffer is large enough.
+    //
+
+    for (;;) {
+
+        status = ZwQueryValueKey( Key,
+                                  &valueName,
+                                  KeyValuePartialInformation,
+                                  value,
+                                  valueLength,
+                                  &valueLength );
+
+        if (status != STATUS_BUFFER_TOO_SMALL && status != STATUS_BUFFER_OVERFLOW) {
 
+            break;
+        }
+
+        if (value != NULL) {
+
+            ExFreePoolWithTag( value, SIMREP_REG_TAG );
+        }
+
+        value = ExAllocatePoolWithTag( PagedPool,
+                                       valueLength,
+                                       SIMREP_REG_TAG );
+
+        if (value == NULL) {
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (NT_SUCCESS( status ) && value->Type != Type) {
+
+        status = STATUS_INVALID_PARAMETER;
+    }
+
+    if (!NT_SUCCESS( status )) {
+
+        if (value != NULL) {
+
+            ExFreePoolWithTag( value, SIMREP_REG_TAG );
+        }
+
+        return status;
+    }
+
+    *Value = value;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+SimRepLoadRuleSet (
+    _In_ HANDLE ParametersKey,
+    _Outptr_ PSIMREP_RULE_SET *RuleSet
+    )
+/*++
+
+Routine Descrition:
+
+    This routine reads the mappings from the registry and compiles them into
+    a new rule set. The legacy "OldMapping"/"NewMapping" pair is still
+    honored and any number of additional rules may be listed in the
+    "Mappings" REG_MULTI_SZ value as "OldPath|NewPath" strings.
+
+Arguments:
+
+    ParametersKey - Handle to the filter's parameters key.
+
+    RuleSet - Receives the compiled rule set on success.
+
+Return Value:
+
+    Returns the status of this operation. The rule set is only returned if
+    every mapping is valid, so a bad configuration never partially applies.
+
+--*/
+{
+    NTSTATUS status;
+    PKEY_VALUE_PARTIAL_INFORMATION oldMappingValue = NULL;
+    PKEY_VALUE_PARTIAL_INFORMATION newMappingValue = NULL;
+    PKEY_VALUE_PARTIAL_INFORMATION mappingsValue = NULL;
+    PSIMREP_RULE_SET ruleSet = NULL;
+    UNICODE_STRING oldName;
+    UNICODE_STRING newName;
+    PWCHAR current;
+    PWCHAR end;
+    PWCHAR separator;
+    ULONG mappingCount = 0;
+
+    PAGED_CODE();
+
+    *RuleSet = NULL;
+
+    //
+    //  Query the single mapping pair. It is optional when rules are
+    //  supplied through the "Mappings" value.
+    //
+
+    status = SimRepQueryRegistryValue( ParametersKey,
+                                       L"OldMapping",
+                                       REG_SZ,
+                                       &oldMappingValue );
+
+    if (NT_SUCCESS( status )) {
+
+        status = SimRepQueryRegistryValue( ParametersKey,
+                                           L"NewMapping",
+                                           REG_SZ,
+                                           &newMappingValue );
+
+        if (!NT_SUCCESS( status )) {
+
+            goto SimRepLoadRuleSetCleanup;
+        }
+
+        mappingCount += 1;
+
+    } else if (status != STATUS_OBJECT_NAME_NOT_FOUND) {
+
+        goto SimRepLoadRuleSetCleanup;
+    }
+
+    status = SimRepQueryRegistryValue( ParametersKey,
+                                       L"Mappings",
+                                       REG_MULTI_SZ,
+                                       &mappingsValue );
+
+    if (NT_SUCCESS( status )) {
+
+        current = (PWCHAR)mappingsValue->Data;
+        end = current + mappingsValue->DataLength / sizeof( WCHAR );
+
+        while (current < end && *current != UNICODE_NULL) {
+
+            mappingCount += 1;
+
+            while (current < end && *current != UNICODE_NULL) {
+
+                current += 1;
+            }
+
+            current += 1;
+        }
+
+    } else if (status != STATUS_OBJECT_NAME_NOT_FOUND) {
+
+        goto SimRepLoadRuleSetCleanup;
+    }
+
+    if (mappingCount == 0) {
+
+        status = STATUS_INVALID_PARAMETER;
+        goto SimRepLoadRuleSetCleanup;
+    }
+
+    status = SimRepAllocateRuleSet( mappingCount, &ruleSet );
+
+    if (!NT_SUCCESS( status )) {
+
+        goto SimRepLoadRuleSetCleanup;
+    }
+
+    if (oldMappingValue != NULL) {
+
+        //
+        //  The length which we receive from ZwQueryValueKey contains size for
+        //  the NULL termination as well. Since we are dealing with unicode
+        //  string we'll chop off the null termination in the length.
+        //
+
+        if (oldMappingValue->DataLength < sizeof( UNICODE_NULL ) ||
+            newMappingValue->DataLength < sizeof( UNICODE_NULL )) {
+
+            status = STATUS_INVALID_PARAMETER;
+            goto SimRepLoadRuleSetCleanup;
+        }
+
+        oldName.Buffer = (PWCH)oldMappingValue->Data;
+        oldName.Length = (USHORT)(oldMappingValue->DataLength - sizeof( UNICODE_NULL ));
+        oldName.MaximumLength = oldName.Length;
+
+        newName.Buffer = (PWCH)newMappingValue->Data;
+        newName.Length = (USHORT)(newMappingValue->DataLength - sizeof( UNICODE_NULL ));
+        newName.MaximumLength = newName.Length;
+
+        status = SimRepAddMapping( ruleSet, &oldName, &newName );
+
+        if (!NT_SUCCESS( status )) {
+
+            goto SimRepLoadRuleSetCleanup;
+        }
+    }
+
+    if (mappingsValue != NULL) {
+
+        current = (PWCHAR)mappingsValue->Data;
+        end = current + mappingsValue->DataLength / sizeof( WCHAR );
+
+        while (current < end && *current != UNICODE_NULL) {
+
+            oldName.Buffer = current;
+            separator = NULL;
+
+            while (current < end && *current != UNICODE_NULL) {
+
+                if (*current == SIMREP_MAPPING_SEPARATOR && separator == NULL) {
+
+                    separator = current;
+                }
+
+                current += 1;
+            }
+
+            if (separator == NULL) {
+
+                status = STATUS_INVALID_PARAMETER;
+                goto SimRepLoadRuleSetCleanup;
+            }
+
+            oldName.Length = (USHORT)((separator - oldName.Buffer) * sizeof( WCHAR ));
+            oldName.MaximumLength = oldName.Length;
+
+            newName.Buffer = separator + 1;
+            newName.Length = (USHORT)((current - newName.Buffer) * sizeof( WCHAR ));
+            newName.MaximumLength = newName.Length;
+
+            status = SimRepAddMapping( ruleSet, &oldName, &newName );
+
+            if (!NT_SUCCESS( status )) {
+
+                DebugTrace( DEBUG_TRACE_RULE_SET_UPDATES | DEBUG_TRACE_ERROR,
+                            ("[SimRep]: Rejecting mapping %wZ -> %wZ (Status = 0x%08X)\n",
+                             &oldName,
+                             &newName,
+                             status) );
+
+                goto SimRepLoadRuleSetCleanup;
+            }
+
+            current += 1;
+        }
+    }
+
+    NT_ASSERT( ruleSet->MappingCount == mappingCount );
+
+    DebugTrace( DEBUG_TRACE_RULE_SET_UPDATES,
+                ("[SimRep]: Compiled rule set %p with %u mappings\n",
+                 ruleSet,
+                 ruleSet->MappingCount) );
+
+    *RuleSet = ruleSet;
+    ruleSet = NULL;
+
+SimRepLoadRuleSetCleanup:
+
+    if (oldMappingValue != NULL) {
+
+        ExFreePoolWithTag( oldMappingValue, SIMREP_REG_TAG );
+    }
+
+    if (newMappingValue != NULL) {
+
+        ExFreePoolWithTag( newMappingValue, SIMREP_REG_TAG );
+    }
+
+    if (mappingsValue != NULL) {
+
+        ExFreePoolWithTag( mappingsValue, SIMREP_REG_TAG );
+    }
+
+    SimRepFreeRuleSet( ruleSet );
+
+    return status;
+}
+
+
+VOID
+SimRepPublishRuleSet (
+    _In_ PSIMREP_RULE_SET RuleSet
+    )
+/*++
+
+Routine Descrition:
+
+    This routine makes a rule set the one used by new creates and frees the
+    rule set it replaces once no create is using it any more. Callers are
+    serialized: this is only called from DriverEntry and from the update
+    worker, and only one update is ever outstanding.
+
+Arguments:
+
+    RuleSet - The rule set to publish. The filter owns it from here on.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LONG current;
+    LONG next;
+    PSIMREP_RULE_SET_SLOT slot;
+    PSIMREP_RULE_SET retired;
+
+    PAGED_CODE();
+
+    current = Globals.ActiveRuleSetSlot;
+    next = current ^ 1;
+
+    //
+    //  The idle slot was run down when it was retired, so nobody can be
+    //  using it. Fill it in before allowing references on it again. The
+    //  interlocked exchange orders the store ahead of the re-initialization.
+    //
+
+    slot = &Globals.RuleSetSlots[next];
+
+    NT_ASSERT( slot->RuleSet == NULL );
+
+    InterlockedExchangePointer( (PVOID volatile *)&slot->RuleSet, RuleSet );
+
+    ExReInitializeRundownProtectionCacheAware( slot->Rundown );
+
+    InterlockedExchange( &Globals.ActiveRuleSetSlot, next );
+
+    //
+    //  Creates that still hold the previous slot finish with the rules they
+    //  started with. Once they drain the old rules can go. A create that
+    //  picked up the old index after this point fails to acquire rundown
+    //  protection and retries on the new slot.
+    //
+
+    slot = &Globals.RuleSetSlots[current];
+
+    ExWaitForRundownProtectionReleaseCacheAware( slot->Rundown );
+
+    retired = InterlockedExchangePointer( (PVOID volatile *)&slot->RuleSet, NULL );
+
+    DebugTrace( DEBUG_TRACE_RULE_SET_UPDATES,
+                ("[SimRep]: Published rule set %p, retired rule set %p\n",
+                 RuleSet,
+                 retired) );
+
+    SimRepFreeRuleSet( retired );
+}
+
+
+PSIMREP_RULE_SET_SLOT
+SimRepReferenceRuleSet (
+    VOID
+    )
+/*++
+
+Routine Descrition:
+
+    This routine references the active rule set without taking a lock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The referenced slot. Its RuleSet stays valid until the slot is passed to
+    SimRepDereferenceRuleSet.
+
+--*/
+{
+    PSIMREP_RULE_SET_SLOT slot;
+
+    PAGED_CODE();
+
+    for (;;) {
+
+        slot = &Globals.RuleSetSlots[ReadAcquire( &Globals.ActiveRuleSetSlot )];
+
+        if (ExAcquireRundownProtectionCacheAware( slot->Rundown )) {
+
+            NT_ASSERT( slot->RuleSet != NULL );
+
+            return slot;
+        }
+
+        //
+        //  The slot was retired after we read the index. The index now
+        //  points at the replacement, try again.
+        //
+    }
+}
+
+
+VOID
+SimRepDereferenceRuleSet (
+    _In_ PSIMREP_RULE_SET_SLOT Slot
+    )
+/*++
+
+Routine Descrition:
+
+    This routine releases a reference taken by SimRepReferenceRuleSet.
+
+Arguments:
+
+    Slot - The slot returned by SimRepReferenceRuleSet.
+
+Return Value:
+
+    None.
+
+--*/
+{
     PAGED_CODE();
 
-    //
-    //  Open the SimRep registry key.
-    //
+    ExReleaseRundownProtectionCacheAware( Slot->Rundown );
+}
 
-    InitializeObjectAttributes( &attributes,
-                                RegistryPath,
-                                OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                                NULL,
-                                NULL );
 
-    status = ZwOpenKey( &driverRegKey,
-                        KEY_READ,
-                        &attributes );
+#pragma warning(push)
+#pragma warning(disable:4055) // type cast from data pointer to function pointer
 
-    if (!NT_SUCCESS( status )) {
+NTSTATUS
+SimRepArmRuleSetUpdate (
+    VOID
+    )
+/*++
 
-        goto SimRepSetConfigurationCleanup;
-    }
+Routine Descrition:
 
+    This routine asks to be notified when a value under the parameters key
+    changes. The notification queues SimRepRuleSetUpdateNotify. The caller
+    holds RuleSetUpdateLock exclusive and signals RuleSetUpdateIdle after
+    releasing it if this fails.
 
-#if DBG
+Arguments:
 
-    //
-    // Query the debug level
-    //
+    None.
 
-    RtlInitUnicodeString( &valueName, L"DebugLevel" );
+Return Value:
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              value,
-                              valueLength,
-                              &resultLength );
+    Returns the status of this operation.
 
-    if (NT_SUCCESS( status )) {
+--*/
+{
+    NTSTATUS status;
 
-        Globals.DebugLevel = *(PULONG)value->Data;
-    }
+    PAGED_CODE();
 
-#endif
+    if (Globals.Unloading || Globals.ParametersKey == NULL) {
 
+        return STATUS_DELETE_PENDING;
+    }
 
     //
-    // Query the remap rename flag
+    //  A kernel mode caller may pass a work queue item as the APC routine
+    //  and the work queue type as the APC context. The item is queued when
+    //  the key changes or the key handle is closed.
     //
 
-    RtlInitUnicodeString( &valueName, L"RemapRenamesAndLinks" );
+    status = ZwNotifyChangeKey( Globals.ParametersKey,
+                                NULL,
+                                (PIO_APC_ROUTINE)&Globals.RuleSetUpdateWorkItem,
+                                (PVOID)(ULONG_PTR)DelayedWorkQueue,
+                                &Globals.RuleSetUpdateIoStatus,
+                                REG_NOTIFY_CHANGE_LAST_SET,
+                                FALSE,
+                                NULL,
+                                0,
+                                TRUE );
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              value,
-                              valueLength,
-                              &resultLength );
+    //
+    //  The notification cannot be serviced before the caller drops the
+    //  lock, so the event can be cleared after arming.
+    //
 
     if (NT_SUCCESS( status )) {
 
-        Globals.RemapRenamesAndLinks = *(PULONG)value->Data > 0 ? TRUE : FALSE;
+        KeClearEvent( &Globals.RuleSetUpdateIdle );
     }
 
-    //
-    //  Query the length of the old mapping.
-    //
-
-    RtlInitUnicodeString( &valueName, L"OldMapping" );
-
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              NULL,
-                              0,
-                              &mappingValueLength );
+    return status;
+}
 
-    if (status!=STATUS_BUFFER_TOO_SMALL && status!=STATUS_BUFFER_OVERFLOW) {
+#pragma warning(pop)
 
-        status = STATUS_INVALID_PARAMETER;
-        goto SimRepSetConfigurationCleanup;
-    }
 
-    //
-    //  Extract the old mapping string.
-    //
+VOID
+SimRepRuleSetUpdateNotify (
+    _In_ PVOID Parameter
+    )
+/*++
 
-    mappingValue = ExAllocatePoolWithTag( PagedPool,
-                                          mappingValueLength,
-                                          SIMREP_REG_TAG );
+Routine Descrition:
 
-    if (mappingValue == NULL) {
+    This routine runs from the executive work item the registry queues when
+    the parameters key changes. It only queues SimRepRuleSetUpdateWorker as
+    a generic work item, which holds a reference on the filter until the
+    update is done.
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto SimRepSetConfigurationCleanup;
-    }
+Arguments:
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              mappingValue,
-                              mappingValueLength,
-                              &resultLength );
+    Parameter - Unused.
 
-    if (!NT_SUCCESS( status )) {
+Return Value:
 
-        goto SimRepSetConfigurationCleanup;
-    }
+    None.
 
-    if (mappingValue->Type != REG_SZ) {
+--*/
+{
+    NTSTATUS status;
 
-        status = STATUS_INVALID_PARAMETER;
-        goto SimRepSetConfigurationCleanup;
-    }
+    UNREFERENCED_PARAMETER( Parameter );
 
-    Globals.Mapping.OldName.MaximumLength = (USHORT)mappingValue->DataLength;
+    PAGED_CODE();
 
-    status = SimRepAllocateUnicodeString( &Globals.Mapping.OldName );
+    status = FltQueueGenericWorkItem( Globals.RuleSetUpdateGenericWorkItem,
+                                      Globals.Filter,
+                                      SimRepRuleSetUpdateWorker,
+                                      DelayedWorkQueue,
+                                      NULL );
 
     if (!NT_SUCCESS( status )) {
 
-        goto SimRepSetConfigurationCleanup;
+        KeSetEvent( &Globals.RuleSetUpdateIdle, IO_NO_INCREMENT, FALSE );
     }
+}
 
-    //
-    //  The length which we receive from ZwQueryValueKey contains size for
-    //  the NULL termination as well. Since we are dealing with unicode
-    //  string we'll chop off the null termination in the length.
-    //
-
-    Globals.Mapping.OldName.Length = (USHORT)mappingValue->DataLength - sizeof( UNICODE_NULL );
 
-    RtlCopyMemory(Globals.Mapping.OldName.Buffer,
-                  mappingValue->Data,
-                  Globals.Mapping.OldName.Length);
+VOID
+SimRepRuleSetUpdateWorker (
+    _In_ PFLT_GENERIC_WORKITEM WorkItem,
+    _In_ PFLT_FILTER Filter,
+    _In_ PVOID Context
+    )
+/*++
 
-    //
-    //  Query the length of the new mapping.
-    //
+Routine Descrition:
 
-    RtlInitUnicodeString( &valueName, L"NewMapping" );
+    This worker runs when the parameters key changes. It compiles the new
+    mappings and swaps them in, then re-arms the notification. If the new
+    mappings are invalid the current ones stay in effect.
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              mappingValue,
-                              mappingValueLength,
-                              &mappingValueLength );
+Arguments:
 
-    if (!NT_SUCCESS( status )) {
+    WorkItem - The generic work item.
 
-        if (status!=STATUS_BUFFER_TOO_SMALL && status!=STATUS_BUFFER_OVERFLOW) {
+    Filter - Our filter.
 
-            goto SimRepSetConfigurationCleanup;
-        }
+    Context - Unused.
 
-        ExFreePoolWithTag( mappingValue, SIMREP_REG_TAG );
+Return Value:
 
-        mappingValue = ExAllocatePoolWithTag( PagedPool,
-                                               mappingValueLength,
-                                               SIMREP_REG_TAG );
+    None.
 
-        if (mappingValue == NULL) {
+--*/
+{
+    NTSTATUS status;
+    PSIMREP_RULE_SET ruleSet;
+    BOOLEAN idle = TRUE;
 
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto SimRepSetConfigurationCleanup;
-        }
+    UNREFERENCED_PARAMETER( WorkItem );
+    UNREFERENCED_PARAMETER( Filter );
+    UNREFERENCED_PARAMETER( Context );
 
-    }
+    PAGED_CODE();
 
-    //
-    //  Extract the new mapping string.
-    //
+    FltAcquireResourceExclusive( &Globals.RuleSetUpdateLock );
 
-    status = ZwQueryValueKey( driverRegKey,
-                              &valueName,
-                              KeyValuePartialInformation,
-                              mappingValue,
-                              mappingValueLength,
-                              &mappingValueLength );
+    if (Globals.Unloading ||
+        !NT_SUCCESS( Globals.RuleSetUpdateIoStatus.Status )) {
 
-    if (!NT_SUCCESS( status )) {
+        //
+        //  The key was closed for unload, stop watching.
+        //
 
-        goto SimRepSetConfigurationCleanup;
+        goto SimRepRuleSetUpdateWorkerCleanup;
     }
 
+    status = SimRepLoadRuleSet( Globals.ParametersKey, &ruleSet );
 
-    if (mappingValue->Type != REG_SZ) {
+    if (NT_SUCCESS( status )) {
 
-        status = STATUS_INVALID_PARAMETER;
-        goto SimRepSetConfigurationCleanup;
-    }
+        SimRepPublishRuleSet( ruleSet );
 
-    Globals.Mapping.NewName.MaximumLength = (USHORT) mappingValue->DataLength;
+    } else {
 
-    status = SimRepAllocateUnicodeString( &Globals.Mapping.NewName );
+        DebugTrace( DEBUG_TRACE_RULE_SET_UPDATES | DEBUG_TRACE_ERROR,
+                    ("[SimRep]: Keeping current mappings, new mappings failed to load (Status = 0x%08X)\n",
+                     status) );
+    }
 
-    if (!NT_SUCCESS( status )) {
+    if (NT_SUCCESS( SimRepArmRuleSetUpdate() )) {
 
-        goto SimRepSetConfigurationCleanup;
+        idle = FALSE;
     }
 
+SimRepRuleSetUpdateWorkerCleanup:
+
+    FltReleaseResource( &Globals.RuleSetUpdateLock );
+
     //
-    //  The length which we receive from ZwQueryValueKey contains size for
-    //  the NULL termination as well. Since we are dealing with unicode
-    //  string we'll chop off the null termination in the length.
+    //  Only signal unload once the lock is dropped, it deletes the lock.
     //
 
-    Globals.Mapping.NewName.Length = (USHORT)mappingValue->DataLength - sizeof( UNICODE_NULL );
+    if (idle) {
 
-    RtlCopyMemory(Globals.Mapping.NewName.Buffer,
-                  mappingValue->Data,
-                  Globals.Mapping.NewName.Length);
+        KeSetEvent( &Globals.RuleSetUpdateIdle, IO_NO_INCREMENT, FALSE );
+    }
+}
 
 
-    //
-    //  Ensure the old and new mapping are consistent in specifying either files or directories
-    //  as determined by the presence of a trailing backslash
-    //
+VOID
+SimRepStopRuleSetUpdates (
+    VOID
+    )
+/*++
 
-    oldMappingTail = (WCHAR)Globals.Mapping.OldName.Buffer[Globals.Mapping.OldName.Length / sizeof( WCHAR ) - 1];
-    newMappingTail = (WCHAR)Globals.Mapping.NewName.Buffer[Globals.Mapping.NewName.Length / sizeof( WCHAR ) - 1];
+Routine Descrition:
 
-    if ((oldMappingTail != newMappingTail) &&
-        ((oldMappingTail == OBJ_NAME_PATH_SEPARATOR) ||
-         (newMappingTail == OBJ_NAME_PATH_SEPARATOR))) {
+    This routine stops watching the parameters key and waits for an
+    outstanding notification to finish.
 
-        status = STATUS_INVALID_PARAMETER;
-        goto SimRepSetConfigurationCleanup;
-    }
+Arguments:
 
+    None.
 
-SimRepSetConfigurationCleanup:
+Return Value:
 
-    if (mappingValue != NULL) {
+    None.
 
-        ExFreePoolWithTag( mappingValue, SIMREP_REG_TAG );
-        mappingValue = NULL;
-    }
+--*/
+{
+    PAGED_CODE();
 
-    if (driverRegKey != NULL) {
+    FltAcquireResourceExclusive( &Globals.RuleSetUpdateLock );
 
-        ZwClose( driverRegKey );
-    }
+    Globals.Unloading = TRUE;
 
-    if (!NT_SUCCESS( status )) {
+    //
+    //  Closing the key completes an outstanding notification, which runs
+    //  the worker one last time.
+    //
 
-        SimRepFreeUnicodeString( &Globals.Mapping.NewName );
-        SimRepFreeUnicodeString( &Globals.Mapping.OldName );
+    if (Globals.ParametersKey != NULL) {
+
+        ZwClose( Globals.ParametersKey );
+        Globals.ParametersKey = NULL;
     }
 
-    return status;
-}
+    FltReleaseResource( &Globals.RuleSetUpdateLock );
 
+    KeWaitForSingleObject( &Globals.RuleSetUpdateIdle,
+                           Executive,
+                           KernelMode,
+                           FALSE,
+                           NULL );
+}
 
 
 VOID SimRepFreeGlobals(
@@ -970,10 +1670,36 @@ Return Value:
 
 --*/
 {
+    ULONG i;
+
     PAGED_CODE();
 
-    SimRepFreeUnicodeString( &Globals.Mapping.NewName );
-    SimRepFreeUnicodeString( &Globals.Mapping.OldName );
+    SimRepStopRuleSetUpdates();
+
+    //
+    //  No creates reach the filter any more, so the rule sets can be freed
+    //  without running down their slots.
+    //
+
+    for (i = 0; i < RTL_NUMBER_OF( Globals.RuleSetSlots ); i++) {
+
+        SimRepFreeRuleSet( Globals.RuleSetSlots[i].RuleSet );
+        Globals.RuleSetSlots[i].RuleSet = NULL;
+
+        if (Globals.RuleSetSlots[i].Rundown != NULL) {
+
+            ExFreeCacheAwareRundownProtection( Globals.RuleSetSlots[i].Rundown );
+            Globals.RuleSetSlots[i].Rundown = NULL;
+        }
+    }
+
+    if (Globals.RuleSetUpdateGenericWorkItem != NULL) {
+
+        FltFreeGenericWorkItem( Globals.RuleSetUpdateGenericWorkItem );
+        Globals.RuleSetUpdateGenericWorkItem = NULL;
+    }
+
+    ExDeleteResourceLite( &Globals.RuleSetUpdateLock );
 }
 
 NTSTATUS
@@ -1008,6 +1734,13 @@ Return Value:
     DebugTrace( DEBUG_TRACE_LOAD_UNLOAD,
                 ("[SimRep]: Unloading driver\n") );
 
+    //
+    //  The last mapping update is queued against the filter, so stop
+    //  watching the key while the filter is still registered.
+    //
+
+    SimRepStopRuleSetUpdates();
+
     FltUnregisterFilter( Globals.Filter );
 
     SimRepFreeGlobals();
@@ -1165,7 +1898,8 @@ Return Value:
     PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
     NTSTATUS status;
     FLT_PREOP_CALLBACK_STATUS callbackStatus;
-    BOOLEAN match;
+    PSIMREP_RULE_SET_SLOT ruleSetSlot;
+    PMAPPING_ENTRY mapping;
     PIO_STACK_LOCATION irpSp;
 
     UNREFERENCED_PARAMETER( FltObjects );
@@ -1282,12 +2016,15 @@ Return Value:
     //  Note: if the create is case sensitive this comparison must be as well.
     //
 
-    match = SimRepCompareMapping( nameInfo,
-                                  &Globals.Mapping.OldName,
-                                  !FlagOn( irpSp->Flags, SL_CASE_SENSITIVE ),
-                                  NULL );
+    ruleSetSlot = SimRepReferenceRuleSet();
 
-    if (match) {
+    mapping = SimRepFindMapping( ruleSetSlot->RuleSet,
+                                 nameInfo,
+                                 FALSE,
+                                 !FlagOn( irpSp->Flags, SL_CASE_SENSITIVE ),
+                                 NULL );
+
+    if (mapping != NULL) {
 
         DebugTrace( DEBUG_TRACE_REPARSE_OPERATIONS,
                     ("[SimRep]: SimRepPreNetworkQueryOpen -> File name %wZ matches mapping. (Cbd = %p, FileObject = %p)\n"
@@ -1296,8 +2033,8 @@ Return Value:
                      &nameInfo->Name,
                      Cbd,
                      FltObjects->FileObject,
-                     Globals.Mapping.OldName,
-                     Globals.Mapping.NewName) );
+                     &mapping->OldName,
+                     &mapping->NewName) );
 
         //
         // Because the file matched the mapping, we need to redirect this open with a new name.
@@ -1316,6 +2053,8 @@ Return Value:
 
     }
 
+    SimRepDereferenceRuleSet( ruleSetSlot );
+
 
 SimRepPreNetworkQueryOpenCleanup:
 
@@ -1395,6 +2134,9 @@ Return Value:
     NTSTATUS status;
     FLT_PREOP_CALLBACK_STATUS callbackStatus;
     UNICODE_STRING newFileName;
+    PSIMREP_RULE_SET_SLOT ruleSetSlot = NULL;
+    PMAPPING_ENTRY mapping;
+    BOOLEAN ignoreCase;
 
     UNREFERENCED_PARAMETER( FltObjects );
     UNREFERENCED_PARAMETER( CompletionContext );
@@ -1575,15 +2317,30 @@ Return Value:
     }
 
     //
-    //  Munge the path from the old mapping to new mapping if the query overlaps
-    //  the mapping path. Note: if the create is case sensitive this comparison
-    //  must be as well.
+    //  Find the deepest mapping the query overlaps, then munge the path from
+    //  its old mapping to its new mapping. Note: if the create is case
+    //  sensitive this comparison must be as well.
     //
 
+    ignoreCase = !FlagOn( Cbd->Iopb->OperationFlags, SL_CASE_SENSITIVE );
+
+    ruleSetSlot = SimRepReferenceRuleSet();
+
+    mapping = SimRepFindMapping( ruleSetSlot->RuleSet,
+                                 nameInfo,
+                                 FALSE,
+                                 ignoreCase,
+                                 NULL );
+
+    if (mapping == NULL) {
+
+        goto SimRepPreCreateCleanup;
+    }
+
     status = SimRepMungeName( nameInfo,
-                              &Globals.Mapping.OldName,
-                              &Globals.Mapping.NewName,
-                              !FlagOn( Cbd->Iopb->OperationFlags, SL_CASE_SENSITIVE ),
+                              &mapping->OldName,
+                              &mapping->NewName,
+                              ignoreCase,
                               FALSE,
                               &newFileName);
 
@@ -1603,8 +2360,8 @@ Return Value:
                  &nameInfo->Name,
                  Cbd,
                  FltObjects->FileObject,
-                 Globals.Mapping.OldName,
-                 Globals.Mapping.NewName) );
+                 &mapping->OldName,
+                 &mapping->NewName) );
 
 
     //
@@ -1647,6 +2404,11 @@ SimRepPreCreateCleanup:
     //  Release the references we have acquired
     //
 
+    if (ruleSetSlot != NULL) {
+
+        SimRepDereferenceRuleSet( ruleSetSlot );
+    }
+
     SimRepFreeUnicodeString( &newFileName );
 
     if (nameInfo != NULL) {
@@ -1728,6 +2490,10 @@ Return Value:
     PFILE_LINK_INFORMATION newLinkInfo = NULL;
     PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
     UNICODE_STRING newFileName;
+    PSIMREP_RULE_SET_SLOT ruleSetSlot = NULL;
+    PMAPPING_ENTRY mapping;
+    BOOLEAN ignoreCase;
+    BOOLEAN exactMatch;
 
     struct {
         HANDLE RootDirectory;
@@ -1887,33 +2653,57 @@ Return Value:
     }
 
     //
-    //  If the operation destion overlaps the new mapping get a new filename
+    //  If the operation destion overlaps a new mapping get a new filename
     //  string to send in the request.
     //
 
-    status = SimRepMungeName( nameInfo,
-                              &Globals.Mapping.NewName,
-                              &Globals.Mapping.NewName,
-                              !FlagOn( FltObjects->FileObject->Flags, FO_OPENED_CASE_SENSITIVE ),
-                              FALSE,
-                              &newFileName );
+    ignoreCase = !FlagOn( FltObjects->FileObject->Flags, FO_OPENED_CASE_SENSITIVE );
+
+    ruleSetSlot = SimRepReferenceRuleSet();
+
+    status = STATUS_NOT_FOUND;
+
+    mapping = SimRepFindMapping( ruleSetSlot->RuleSet,
+                                 nameInfo,
+                                 TRUE,
+                                 ignoreCase,
+                                 NULL );
+
+    if (mapping != NULL) {
+
+        status = SimRepMungeName( nameInfo,
+                                  &mapping->NewName,
+                                  &mapping->NewName,
+                                  ignoreCase,
+                                  FALSE,
+                                  &newFileName );
+    }
 
     if (status == STATUS_NOT_FOUND) {
 
         //
-        //  If the operation destination overlaps the old mapping exactly, get
+        //  If the operation destination overlaps an old mapping exactly, get
         //  a new filename string munged with the new mapping to send in the
         //  request. This is a special case where our name provider will not
         //  perform the reparse during name resolution because the parent
         //  directories don't overlap the mapping.
         //
 
-        status = SimRepMungeName( nameInfo,
-                                  &Globals.Mapping.OldName,
-                                  &Globals.Mapping.NewName,
-                                  !FlagOn( FltObjects->FileObject->Flags, FO_OPENED_CASE_SENSITIVE ),
-                                  TRUE,
-                                  &newFileName );
+        mapping = SimRepFindMapping( ruleSetSlot->RuleSet,
+                                     nameInfo,
+                                     FALSE,
+                                     ignoreCase,
+                                     &exactMatch );
+
+        if (mapping != NULL && exactMatch) {
+
+            status = SimRepMungeName( nameInfo,
+                                      &mapping->OldName,
+                                      &mapping->NewName,
+                                      ignoreCase,
+                                      TRUE,
+                                      &newFileName );
+        }
     }
 
     if (!NT_SUCCESS( status )) {
@@ -2001,6 +2791,11 @@ Return Value:
 
 SimRepPreSetInformationCleanup:
 
+    if (ruleSetSlot != NULL) {
+
+        SimRepDereferenceRuleSet( ruleSetSlot );
+    }
+
     if (nameInfo) {
 
         FltReleaseFileNameInformation( nameInfo );
@@ -2333,8 +3128,6 @@ Return Value:
 --*/
 {
     UNICODE_STRING fileName;
-    BOOLEAN match;
-    BOOLEAN exactMatch;
 
     PAGED_CODE();
 
@@ -2354,50 +3147,64 @@ Return Value:
     NT_ASSERT( NameInfo->Name.Buffer == NameInfo->Volume.Buffer );
     NT_ASSERT( NameInfo->Name.Length >= NameInfo->Volume.Length);
 
-    match = FALSE;
-    exactMatch = FALSE;
     fileName.Buffer = Add2Ptr( NameInfo->Name.Buffer, NameInfo->Volume.Length );
     fileName.MaximumLength = NameInfo->Name.Length - NameInfo->Volume.Length;
     fileName.Length = fileName.MaximumLength;
 
-    //
-    //  Check if the filename matches this mapping entry (is the mapping
-    //  entry itself or some child directory of the mapping entry)
-    //
+    return SimRepComparePath( &fileName, MappingPath, IgnoreCase, ExactMatch );
+}
 
-    if (RtlPrefixUnicodeString( MappingPath, &fileName, IgnoreCase )) {
 
-        if (fileName.Length == MappingPath->Length) {
+PMAPPING_ENTRY
+SimRepFindMapping (
+    _In_ PSIMREP_RULE_SET RuleSet,
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _In_ BOOLEAN MatchNewName,
+    _In_ BOOLEAN IgnoreCase,
+    _Out_opt_ PBOOLEAN ExactMatch
+    )
+/*++
+Routine Description:
 
-            //
-            //  This path is the mapping itself
-            //
+    This routine finds the mapping that applies to a file. See
+    SimRepFindMappingForPath.
 
-            match = TRUE;
+Arguments:
 
-            exactMatch = TRUE;
+    RuleSet - The referenced rule set to search.
 
-        } else if (fileName.Buffer[(MappingPath->Length/sizeof( WCHAR ))] == OBJ_NAME_PATH_SEPARATOR) {
+    NameInfo - Pointer to the parsed name information for the file.
 
-            //
-            //  This path is a child of the mapping
-            //
+    MatchNewName - If TRUE match against the new mapping paths instead of
+                   the old ones.
 
-            match = TRUE;
-        }
+    IgnoreCase - If TRUE do a case insenstive comparison.
 
-        //
-        //  No match here means the path simply overlaps the mapping like
-        //  \a\b\c overlaps \a\b\cd.txt
-        //
+    ExactMatch - If supplied receives TRUE if the name exactly matches the
+                 returned mapping's path.
 
-    }
+Return Value:
 
-    if (ARGUMENT_PRESENT( ExactMatch )) {
-        *ExactMatch = exactMatch;
-    }
+    The mapping the file is in, or NULL if it is in none.
+
+--*/
+{
+    UNICODE_STRING fileName;
+
+    PAGED_CODE();
 
-    return match;
+    NT_ASSERT( NameInfo->Name.Buffer == NameInfo->Volume.Buffer );
+    NT_ASSERT( NameInfo->Name.Length >= NameInfo->Volume.Length);
+
+    fileName.Buffer = Add2Ptr( NameInfo->Name.Buffer, NameInfo->Volume.Length );
+    fileName.Length = NameInfo->Name.Length - NameInfo->Volume.Length;
+    fileName.MaximumLength = fileName.Length;
+
+    return SimRepFindMappingForPath( RuleSet,
+                                     &fileName,
+                                     MatchNewName,
+                                     IgnoreCase,
+                                     ExactMatch );
 }
 
 
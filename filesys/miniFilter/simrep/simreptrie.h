@@ -0,0 +1,803 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    simreptrie.h
+
+Abstract:
+
+    The compiled mapping rules of the simrep filter: the tries keyed on path
+    components that find the mapping a name is in, and the routines that
+    build, search and free them.
+
+    It only depends on the Rtl string routines, pool allocation and the
+    includer's SimRepAllocateUnicodeString and SimRepFreeUnicodeString, so
+    it is also built by the user mode benchmark in .\test.
+
+Environment:
+
+    Kernel mode and user mode test
+
+--*/
+
+#ifndef __SIMREPTRIE_H__
+#define __SIMREPTRIE_H__
+
+//
+//  Memory Pool Tags
+//
+
+#define SIMREP_RULE_SET_TAG          'sRpR'
+#define SIMREP_TRIE_NODE_TAG         'nTpR'
+
+//
+// Constants
+//
+
+#define SIMREP_TRIE_INITIAL_CHILDREN 4
+
+
+typedef struct _MAPPING_ENTRY {
+
+    //
+    //  Path underwhich we want to reparse.
+    //
+
+    UNICODE_STRING OldName;
+
+    //
+    //  Path to reparse to.
+    //
+
+    UNICODE_STRING NewName;
+
+} MAPPING_ENTRY, *PMAPPING_ENTRY;
+
+
+//
+//  The mappings are compiled into a trie keyed on path components so that
+//  finding the mapping for a name costs one lookup per component of the
+//  name, regardless of how many mappings are configured. Children are kept
+//  sorted with a case insensitive comparison so each step is a binary search.
+//
+
+typedef struct _SIMREP_TRIE_NODE {
+
+    //
+    //  Name of the path component this node represents. The buffer is
+    //  allocated together with the node.
+    //
+
+    UNICODE_STRING Component;
+
+    //
+    //  Mapping whose path ends at this node, NULL if none does.
+    //
+
+    PMAPPING_ENTRY Mapping;
+
+    //
+    //  Children of this node, sorted by component name.
+    //
+
+    ULONG ChildCount;
+    ULONG ChildCapacity;
+    struct _SIMREP_TRIE_NODE **Children;
+
+    //
+    //  Links every node allocated for a rule set so they can be freed
+    //  without walking the trie recursively.
+    //
+
+    struct _SIMREP_TRIE_NODE *NextAllocated;
+
+} SIMREP_TRIE_NODE, *PSIMREP_TRIE_NODE;
+
+
+//
+//  An immutable, compiled set of mappings. Once published a rule set is
+//  never modified; a configuration change builds a new one and swaps it in.
+//
+
+typedef struct _SIMREP_RULE_SET {
+
+    ULONG MappingCount;
+    PMAPPING_ENTRY Mappings;
+
+    //
+    //  Tries keyed on the old and new mapping paths. The new name trie is
+    //  used to keep renames and hardlinks consistent.
+    //
+
+    SIMREP_TRIE_NODE OldNameRoot;
+    SIMREP_TRIE_NODE NewNameRoot;
+
+    PSIMREP_TRIE_NODE AllocatedNodes;
+
+} SIMREP_RULE_SET, *PSIMREP_RULE_SET;
+
+
+//
+//  Functions that provide string allocation support, implemented by the
+//  includer.
+//
+
+_When_(return==0, _Post_satisfies_(String->Buffer != NULL))
+NTSTATUS
+SimRepAllocateUnicodeString (
+    _Inout_ PUNICODE_STRING String
+    );
+
+VOID
+SimRepFreeUnicodeString (
+    _Inout_ PUNICODE_STRING String
+    );
+
+
+__inline
+BOOLEAN
+SimRepNextComponent (
+    _Inout_ PUNICODE_STRING Remaining,
+    _Out_ PUNICODE_STRING Component
+    )
+/*++
+
+Routine Descrition:
+
+    This routine splits the next path component off a path.
+
+Arguments:
+
+    Remaining - The part of the path not yet consumed. On return it is
+                advanced past the component.
+
+    Component - Receives the component. It points into Remaining's buffer.
+
+Return Value:
+
+    TRUE if a component was returned, FALSE if the path is exhausted.
+
+--*/
+{
+    PAGED_CODE();
+
+    while (Remaining->Length >= sizeof( WCHAR ) &&
+           Remaining->Buffer[0] == OBJ_NAME_PATH_SEPARATOR) {
+
+        Remaining->Buffer += 1;
+        Remaining->Length -= sizeof( WCHAR );
+    }
+
+    if (Remaining->Length == 0) {
+
+        return FALSE;
+    }
+
+    Component->Buffer = Remaining->Buffer;
+    Component->Length = 0;
+
+    while (Remaining->Length >= sizeof( WCHAR ) &&
+           Remaining->Buffer[0] != OBJ_NAME_PATH_SEPARATOR) {
+
+        Remaining->Buffer += 1;
+        Remaining->Length -= sizeof( WCHAR );
+        Component->Length += sizeof( WCHAR );
+    }
+
+    Component->MaximumLength = Component->Length;
+    Remaining->MaximumLength = Remaining->Length;
+
+    return TRUE;
+}
+
+
+__inline
+PSIMREP_TRIE_NODE
+SimRepTrieFindChild (
+    _In_ PSIMREP_TRIE_NODE Node,
+    _In_ PCUNICODE_STRING Component,
+    _Out_opt_ PULONG InsertIndex
+    )
+/*++
+
+Routine Descrition:
+
+    This routine binary searches a node's children for a component. All
+    comparisons are case insensitive; a case sensitive create verifies the
+    mapping it finds against the exact mapping path afterwards.
+
+Arguments:
+
+    Node - The node whose children are searched.
+
+    Component - The component to find.
+
+    InsertIndex - If supplied receives the index at which the component
+                  would have to be inserted to keep the children sorted.
+
+Return Value:
+
+    The child node, or NULL if the node has no such child.
+
+--*/
+{
+    LONG low = 0;
+    LONG high = (LONG)Node->ChildCount - 1;
+    LONG middle;
+    LONG result;
+
+    PAGED_CODE();
+
+    while (low <= high) {
+
+        middle = low + (high - low) / 2;
+
+        result = RtlCompareUnicodeString( Component,
+                                          &Node->Children[middle]->Component,
+                                          TRUE );
+
+        if (result == 0) {
+
+            if (ARGUMENT_PRESENT( InsertIndex )) {
+
+                *InsertIndex = (ULONG)middle;
+            }
+
+            return Node->Children[middle];
+
+        } else if (result < 0) {
+
+            high = middle - 1;
+
+        } else {
+
+            low = middle + 1;
+        }
+    }
+
+    if (ARGUMENT_PRESENT( InsertIndex )) {
+
+        *InsertIndex = (ULONG)low;
+    }
+
+    return NULL;
+}
+
+
+__inline
+NTSTATUS
+SimRepTrieInsert (
+    _Inout_ PSIMREP_RULE_SET RuleSet,
+    _Inout_ PSIMREP_TRIE_NODE Root,
+    _In_ PUNICODE_STRING Path,
+    _In_ PMAPPING_ENTRY Mapping,
+    _In_ BOOLEAN AllowDuplicates
+    )
+/*++
+
+Routine Descrition:
+
+    This routine adds a mapping to a trie, creating nodes for the
+    components of its path that are not in the trie yet.
+
+Arguments:
+
+    RuleSet - The rule set that owns the trie.
+
+    Root - The root of the trie.
+
+    Path - The mapping path to insert.
+
+    Mapping - The mapping to record at the last component of Path.
+
+    AllowDuplicates - If FALSE fail when another mapping already ends at
+                      the same path, otherwise keep the first one.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    UNICODE_STRING remaining = *Path;
+    UNICODE_STRING component;
+    PSIMREP_TRIE_NODE node = Root;
+    PSIMREP_TRIE_NODE child;
+    PSIMREP_TRIE_NODE *children;
+    ULONG capacity;
+    ULONG index;
+
+    PAGED_CODE();
+
+    while (SimRepNextComponent( &remaining, &component )) {
+
+        child = SimRepTrieFindChild( node, &component, &index );
+
+        if (child == NULL) {
+
+            if (node->ChildCount == node->ChildCapacity) {
+
+                capacity = (node->ChildCapacity == 0) ?
+                           SIMREP_TRIE_INITIAL_CHILDREN :
+                           node->ChildCapacity * 2;
+
+                children = ExAllocatePoolWithTag( PagedPool,
+                                                  capacity * sizeof( PSIMREP_TRIE_NODE ),
+                                                  SIMREP_TRIE_NODE_TAG );
+
+                if (children == NULL) {
+
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                if (node->Children != NULL) {
+
+                    RtlCopyMemory( children,
+                                   node->Children,
+                                   node->ChildCount * sizeof( PSIMREP_TRIE_NODE ) );
+
+                    ExFreePoolWithTag( node->Children, SIMREP_TRIE_NODE_TAG );
+                }
+
+                node->Children = children;
+                node->ChildCapacity = capacity;
+            }
+
+            child = ExAllocatePoolWithTag( PagedPool,
+                                           sizeof( SIMREP_TRIE_NODE ) + component.Length,
+                                           SIMREP_TRIE_NODE_TAG );
+
+            if (child == NULL) {
+
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            RtlZeroMemory( child, sizeof( SIMREP_TRIE_NODE ) );
+
+            child->Component.Buffer = (PWCH)(child + 1);
+            child->Component.MaximumLength = component.Length;
+            RtlCopyUnicodeString( &child->Component, &component );
+
+            child->NextAllocated = RuleSet->AllocatedNodes;
+            RuleSet->AllocatedNodes = child;
+
+            RtlMoveMemory( &node->Children[index + 1],
+                           &node->Children[index],
+                           (node->ChildCount - index) * sizeof( PSIMREP_TRIE_NODE ) );
+
+            node->Children[index] = child;
+            node->ChildCount += 1;
+        }
+
+        node = child;
+    }
+
+    //
+    //  A mapping of the volume root has no components and is not supported.
+    //
+
+    if (node == Root) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (node->Mapping != NULL) {
+
+        return AllowDuplicates ? STATUS_SUCCESS : STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    node->Mapping = Mapping;
+
+    return STATUS_SUCCESS;
+}
+
+
+__inline
+VOID
+SimRepFreeRuleSet (
+    _In_opt_ _Post_invalid_ PSIMREP_RULE_SET RuleSet
+    )
+/*++
+
+Routine Descrition:
+
+    This routine frees a rule set, its mappings and its tries. The rule set
+    must not be published or any readers must have drained.
+
+Arguments:
+
+    RuleSet - The rule set to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSIMREP_TRIE_NODE node;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (RuleSet == NULL) {
+
+        return;
+    }
+
+    while (RuleSet->AllocatedNodes != NULL) {
+
+        node = RuleSet->AllocatedNodes;
+        RuleSet->AllocatedNodes = node->NextAllocated;
+
+        if (node->Children != NULL) {
+
+            ExFreePoolWithTag( node->Children, SIMREP_TRIE_NODE_TAG );
+        }
+
+        ExFreePoolWithTag( node, SIMREP_TRIE_NODE_TAG );
+    }
+
+    if (RuleSet->OldNameRoot.Children != NULL) {
+
+        ExFreePoolWithTag( RuleSet->OldNameRoot.Children, SIMREP_TRIE_NODE_TAG );
+    }
+
+    if (RuleSet->NewNameRoot.Children != NULL) {
+
+        ExFreePoolWithTag( RuleSet->NewNameRoot.Children, SIMREP_TRIE_NODE_TAG );
+    }
+
+    if (RuleSet->Mappings != NULL) {
+
+        for (i = 0; i < RuleSet->MappingCount; i++) {
+
+            SimRepFreeUnicodeString( &RuleSet->Mappings[i].OldName );
+            SimRepFreeUnicodeString( &RuleSet->Mappings[i].NewName );
+        }
+
+        ExFreePoolWithTag( RuleSet->Mappings, SIMREP_RULE_SET_TAG );
+    }
+
+    ExFreePoolWithTag( RuleSet, SIMREP_RULE_SET_TAG );
+}
+
+
+__inline
+NTSTATUS
+SimRepAllocateRuleSet (
+    _In_ ULONG MappingCount,
+    _Outptr_ PSIMREP_RULE_SET *RuleSet
+    )
+/*++
+
+Routine Descrition:
+
+    This routine allocates an empty rule set with room for a number of
+    mappings. They are added with SimRepAddMapping.
+
+Arguments:
+
+    MappingCount - The number of mappings the rule set will hold.
+
+    RuleSet - Receives the rule set on success.
+
+Return Value:
+
+    Returns the status of this operation.
+
+--*/
+{
+    PSIMREP_RULE_SET ruleSet;
+
+    PAGED_CODE();
+
+    *RuleSet = NULL;
+
+    ruleSet = ExAllocatePoolWithTag( PagedPool,
+                                     sizeof( SIMREP_RULE_SET ),
+                                     SIMREP_RULE_SET_TAG );
+
+    if (ruleSet == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( ruleSet, sizeof( SIMREP_RULE_SET ) );
+
+    ruleSet->Mappings = ExAllocatePoolWithTag( PagedPool,
+                                               MappingCount * sizeof( MAPPING_ENTRY ),
+                                               SIMREP_RULE_SET_TAG );
+
+    if (ruleSet->Mappings == NULL) {
+
+        ExFreePoolWithTag( ruleSet, SIMREP_RULE_SET_TAG );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( ruleSet->Mappings, MappingCount * sizeof( MAPPING_ENTRY ) );
+
+    *RuleSet = ruleSet;
+
+    return STATUS_SUCCESS;
+}
+
+
+__inline
+NTSTATUS
+SimRepAddMapping (
+    _Inout_ PSIMREP_RULE_SET RuleSet,
+    _In_ PCUNICODE_STRING OldName,
+    _In_ PCUNICODE_STRING NewName
+    )
+/*++
+
+Routine Descrition:
+
+    This routine validates one mapping, copies it into the rule set and
+    adds it to the old and new name tries.
+
+Arguments:
+
+    RuleSet - The rule set being compiled.
+
+    OldName - Path under which we want to reparse.
+
+    NewName - Path to reparse to.
+
+Return Value:
+
+    STATUS_INVALID_PARAMETER if the mapping is malformed,
+    STATUS_OBJECT_NAME_COLLISION if another mapping has the same old path,
+    or the status of the allocations.
+
+--*/
+{
+    NTSTATUS status;
+    PMAPPING_ENTRY mapping;
+    WCHAR oldMappingTail;
+    WCHAR newMappingTail;
+
+    PAGED_CODE();
+
+    if (OldName->Length < sizeof( WCHAR ) || NewName->Length < sizeof( WCHAR )) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    //  Ensure the old and new mapping are consistent in specifying either files or directories
+    //  as determined by the presence of a trailing backslash
+    //
+
+    oldMappingTail = OldName->Buffer[OldName->Length / sizeof( WCHAR ) - 1];
+    newMappingTail = NewName->Buffer[NewName->Length / sizeof( WCHAR ) - 1];
+
+    if ((oldMappingTail != newMappingTail) &&
+        ((oldMappingTail == OBJ_NAME_PATH_SEPARATOR) ||
+         (newMappingTail == OBJ_NAME_PATH_SEPARATOR))) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    mapping = &RuleSet->Mappings[RuleSet->MappingCount];
+
+    mapping->OldName.MaximumLength = OldName->Length;
+
+    status = SimRepAllocateUnicodeString( &mapping->OldName );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    RtlCopyUnicodeString( &mapping->OldName, OldName );
+
+    mapping->NewName.MaximumLength = NewName->Length;
+
+    status = SimRepAllocateUnicodeString( &mapping->NewName );
+
+    if (!NT_SUCCESS( status )) {
+
+        SimRepFreeUnicodeString( &mapping->OldName );
+        return status;
+    }
+
+    RtlCopyUnicodeString( &mapping->NewName, NewName );
+
+    //
+    //  The entry is owned by the rule set from here on, so it is freed with
+    //  the rule set if adding it to the tries fails.
+    //
+
+    RuleSet->MappingCount += 1;
+
+    status = SimRepTrieInsert( RuleSet,
+                               &RuleSet->OldNameRoot,
+                               &mapping->OldName,
+                               mapping,
+                               FALSE );
+
+    if (!NT_SUCCESS( status )) {
+
+        return status;
+    }
+
+    //
+    //  Several old paths may be redirected to the same new path. Any of
+    //  them produces the same result when a rename destination is munged
+    //  from the new path onto itself.
+    //
+
+    return SimRepTrieInsert( RuleSet,
+                             &RuleSet->NewNameRoot,
+                             &mapping->NewName,
+                             mapping,
+                             TRUE );
+}
+
+
+__inline
+BOOLEAN
+SimRepComparePath (
+    _In_ PCUNICODE_STRING FileName,
+    _In_ PCUNICODE_STRING MappingPath,
+    _In_ BOOLEAN IgnoreCase,
+    _Out_opt_ PBOOLEAN ExactMatch
+    )
+/*++
+Routine Description:
+
+    This routine will compare a file name to the given mapping path
+    to determine if the file is the mapping path itself or a child
+    of the mapping path.
+
+Arguments:
+
+    FileName - The name of the file, excluding the name of the volume.
+
+    MappingPath - The mapping path to compare against.
+
+    IgnoreCase - If TRUE do a case insenstive comparison.
+
+    ExactMatch - If supplied receives TRUE if the name exactly
+                 matches the mapping path.
+
+Return Value:
+
+    TRUE - the file matches the mapping path
+
+    FALSE - the file is not in the mapping path
+
+--*/
+{
+    BOOLEAN match;
+    BOOLEAN exactMatch;
+
+    PAGED_CODE();
+
+    match = FALSE;
+    exactMatch = FALSE;
+
+    //
+    //  Check if the filename matches this mapping entry (is the mapping
+    //  entry itself or some child directory of the mapping entry)
+    //
+
+    if (RtlPrefixUnicodeString( MappingPath, FileName, IgnoreCase )) {
+
+        if (FileName->Length == MappingPath->Length) {
+
+            //
+            //  This path is the mapping itself
+            //
+
+            match = TRUE;
+
+            exactMatch = TRUE;
+
+        } else if (FileName->Buffer[(MappingPath->Length/sizeof( WCHAR ))] == OBJ_NAME_PATH_SEPARATOR) {
+
+            //
+            //  This path is a child of the mapping
+            //
+
+            match = TRUE;
+        }
+
+        //
+        //  No match here means the path simply overlaps the mapping like
+        //  \a\b\c overlaps \a\b\cd.txt
+        //
+
+    }
+
+    if (ARGUMENT_PRESENT( ExactMatch )) {
+        *ExactMatch = exactMatch;
+    }
+
+    return match;
+}
+
+
+__inline
+PMAPPING_ENTRY
+SimRepFindMappingForPath (
+    _In_ PSIMREP_RULE_SET RuleSet,
+    _In_ PCUNICODE_STRING FileName,
+    _In_ BOOLEAN MatchNewName,
+    _In_ BOOLEAN IgnoreCase,
+    _Out_opt_ PBOOLEAN ExactMatch
+    )
+/*++
+Routine Description:
+
+    This routine finds the mapping that applies to a file name by walking
+    the rule set's trie one path component at a time. The cost depends on
+    the depth of the path, not on the number of mappings. When mappings are
+    nested the deepest one the file is in wins.
+
+    Every candidate found in the trie is confirmed with SimRepComparePath
+    so the result matches exactly what comparing against that single mapping
+    would give, including case sensitivity.
+
+Arguments:
+
+    RuleSet - The referenced rule set to search.
+
+    FileName - The name of the file, excluding the name of the volume.
+
+    MatchNewName - If TRUE match against the new mapping paths instead of
+                   the old ones.
+
+    IgnoreCase - If TRUE do a case insenstive comparison.
+
+    ExactMatch - If supplied receives TRUE if the name exactly matches the
+                 returned mapping's path.
+
+Return Value:
+
+    The mapping the file is in, or NULL if it is in none.
+
+--*/
+{
+    UNICODE_STRING remaining = *FileName;
+    UNICODE_STRING component;
+    PSIMREP_TRIE_NODE node;
+    PMAPPING_ENTRY mapping = NULL;
+    BOOLEAN exactMatch = FALSE;
+    BOOLEAN candidateExactMatch;
+
+    PAGED_CODE();
+
+    node = MatchNewName ? &RuleSet->NewNameRoot : &RuleSet->OldNameRoot;
+
+    while (SimRepNextComponent( &remaining, &component )) {
+
+        node = SimRepTrieFindChild( node, &component, NULL );
+
+        if (node == NULL) {
+
+            break;
+        }
+
+        if (node->Mapping != NULL &&
+            SimRepComparePath( FileName,
+                               MatchNewName ? &node->Mapping->NewName : &node->Mapping->OldName,
+                               IgnoreCase,
+                               &candidateExactMatch )) {
+
+            mapping = node->Mapping;
+            exactMatch = candidateExactMatch;
+        }
+    }
+
+    if (ARGUMENT_PRESENT( ExactMatch )) {
+        *ExactMatch = exactMatch;
+    }
+
+    return mapping;
+}
+
+#endif // __SIMREPTRIE_H__
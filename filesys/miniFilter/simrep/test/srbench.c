@@ -0,0 +1,436 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    srbench.c
+
+Abstract:
+
+    This program measures the cost simrep adds to the create path for
+    rule sets of 10, 1000 and 10000 mappings, in user mode.
+
+    On every create SimRepPreCreate looks up the mapping the opened name is
+    in with SimRepFindMapping, a walk of the rule set's trie.  The trie
+    routines are built here unchanged from simreptrie.h.  For each rule set
+    size the program times compiling the rule set, then the lookup of three
+    kinds of names:
+
+    - a hit, a file under one of the mapped directories,
+    - a near miss, a name that shares all but the last component with a
+      mapping,
+    - an unrelated name, which is what most creates on a volume are.
+
+    Each lookup is also done by comparing the name against every mapping,
+    which is what the cost was before the trie, and both must find the same
+    mapping.  Only the rule lookup is measured; the name query and the
+    reparse that follow a hit are the same whatever the number of rules.
+
+    Usage: srbench [Lookups]
+
+Environment:
+
+    User mode
+
+--*/
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <winternl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+//  The kernel routines and definitions simreptrie.h uses.  The string
+//  routines are exported by ntdll.
+//
+
+NTSYSAPI
+LONG
+NTAPI
+RtlCompareUnicodeString (
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive
+    );
+
+NTSYSAPI
+BOOLEAN
+NTAPI
+RtlPrefixUnicodeString (
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive
+    );
+
+NTSYSAPI
+VOID
+NTAPI
+RtlCopyUnicodeString (
+    _Inout_ PUNICODE_STRING DestinationString,
+    _In_opt_ PCUNICODE_STRING SourceString
+    );
+
+#define NonPagedPool                    0
+#define PagedPool                       1
+
+#define ExAllocatePoolWithTag(_PoolType, _Size, _Tag) malloc( (_Size) )
+#define ExFreePoolWithTag(_P, _Tag)     free( (_P) )
+
+#define PAGED_CODE()
+
+#ifndef ARGUMENT_PRESENT
+#define ARGUMENT_PRESENT(_ArgumentPointer) ((CHAR *)((ULONG_PTR)(_ArgumentPointer)) != (CHAR *)(NULL))
+#endif
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(_Status)             (((NTSTATUS)(_Status)) >= 0)
+#endif
+
+#ifndef OBJ_NAME_PATH_SEPARATOR
+#define OBJ_NAME_PATH_SEPARATOR         ((WCHAR)L'\\')
+#endif
+
+#include "simreptrie.h"
+
+#define SRBENCH_DEFAULT_LOOKUPS         1000000
+#define SRBENCH_RULES_PER_GROUP         100
+#define SRBENCH_NAME_LENGTH             128
+
+typedef enum _SRBENCH_NAME_KIND {
+    SrBenchHit,
+    SrBenchNearMiss,
+    SrBenchUnrelated,
+    SrBenchNameKinds
+} SRBENCH_NAME_KIND;
+
+const PCSTR NameKinds[SrBenchNameKinds] = {
+    "hit",
+    "near miss",
+    "unrelated"
+};
+
+const ULONG RuleCounts[] = { 10, 1000, 10000 };
+
+
+_When_(return==0, _Post_satisfies_(String->Buffer != NULL))
+NTSTATUS
+SimRepAllocateUnicodeString (
+    _Inout_ PUNICODE_STRING String
+    )
+{
+    String->Buffer = malloc( String->MaximumLength );
+
+    if (String->Buffer == NULL) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    String->Length = 0;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+SimRepFreeUnicodeString (
+    _Inout_ PUNICODE_STRING String
+    )
+{
+    free( String->Buffer );
+
+    String->Length = String->MaximumLength = 0;
+    String->Buffer = NULL;
+}
+
+
+VOID
+SetName (
+    _Out_ PUNICODE_STRING Name,
+    _Out_writes_(SRBENCH_NAME_LENGTH) PWCHAR Buffer,
+    _In_ PCWSTR Format,
+    ...
+    )
+{
+    va_list args;
+    int length;
+
+    va_start( args, Format );
+    length = _vsnwprintf_s( Buffer, SRBENCH_NAME_LENGTH, _TRUNCATE, Format, args );
+    va_end( args );
+
+    Name->Buffer = Buffer;
+    Name->Length = (USHORT)(length * sizeof( WCHAR ));
+    Name->MaximumLength = Name->Length;
+}
+
+
+PMAPPING_ENTRY
+FindMappingLinear (
+    _In_ PSIMREP_RULE_SET RuleSet,
+    _In_ PCUNICODE_STRING FileName
+    )
+/*++
+
+Routine Description:
+
+    Finds the mapping a name is in by comparing it against every mapping,
+    keeping the deepest one like the trie does.
+
+--*/
+{
+    PMAPPING_ENTRY mapping = NULL;
+    ULONG i;
+
+    for (i = 0; i < RuleSet->MappingCount; i++) {
+
+        if (SimRepComparePath( FileName, &RuleSet->Mappings[i].OldName, TRUE, NULL ) &&
+            ((mapping == NULL) ||
+             (RuleSet->Mappings[i].OldName.Length > mapping->OldName.Length))) {
+
+            mapping = &RuleSet->Mappings[i];
+        }
+    }
+
+    return mapping;
+}
+
+
+double
+ElapsedNanoseconds (
+    _In_ LARGE_INTEGER Start,
+    _In_ LARGE_INTEGER End,
+    _In_ LARGE_INTEGER Frequency,
+    _In_ ULONG Count
+    )
+{
+    return (double) (End.QuadPart - Start.QuadPart) * 1000000000.0 /
+           (double) Frequency.QuadPart / (double) Count;
+}
+
+
+BOOL
+RunRuleCount (
+    _In_ ULONG RuleCount,
+    _In_ ULONG Lookups,
+    _In_ LARGE_INTEGER Frequency
+    )
+{
+    BOOL Success = TRUE;
+    PSIMREP_RULE_SET ruleSet = NULL;
+    WCHAR oldBuffer[SRBENCH_NAME_LENGTH];
+    WCHAR newBuffer[SRBENCH_NAME_LENGTH];
+    WCHAR nameBuffers[SrBenchNameKinds][SRBENCH_NAME_LENGTH];
+    UNICODE_STRING oldName;
+    UNICODE_STRING newName;
+    UNICODE_STRING names[SrBenchNameKinds];
+    PMAPPING_ENTRY expected[SrBenchNameKinds];
+    PMAPPING_ENTRY found;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    double buildNanoseconds;
+    double trieNanoseconds;
+    double linearNanoseconds;
+    ULONG linearLookups;
+    ULONG rule;
+    ULONG kind;
+    ULONG i;
+    NTSTATUS status;
+
+    //
+    //  Compile the rule set the way SimRepLoadRuleSet does.
+    //
+
+    QueryPerformanceCounter( &start );
+
+    status = SimRepAllocateRuleSet( RuleCount, &ruleSet );
+
+    TEST_ASSERT( NT_SUCCESS( status ), "Allocating a rule set of %u mappings failed: 0x%08x", RuleCount, status );
+
+    for (rule = 0; rule < RuleCount; rule++) {
+
+        SetName( &oldName,
+                 oldBuffer,
+                 L"\\rules\\group%03u\\rule%05u",
+                 rule / SRBENCH_RULES_PER_GROUP,
+                 rule );
+
+        SetName( &newName,
+                 newBuffer,
+                 L"\\redirect\\group%03u\\rule%05u",
+                 rule / SRBENCH_RULES_PER_GROUP,
+                 rule );
+
+        status = SimRepAddMapping( ruleSet, &oldName, &newName );
+
+        TEST_ASSERT( NT_SUCCESS( status ), "Adding mapping %u failed: 0x%08x", rule, status );
+    }
+
+    QueryPerformanceCounter( &end );
+
+    buildNanoseconds = ElapsedNanoseconds( start, end, Frequency, RuleCount );
+
+    //
+    //  The hit and the near miss are in the middle of the rule set so the
+    //  linear scan does not find them first or last.
+    //
+
+    rule = RuleCount / 2;
+
+    SetName( &names[SrBenchHit],
+             nameBuffers[SrBenchHit],
+             L"\\rules\\group%03u\\rule%05u\\dir\\file.txt",
+             rule / SRBENCH_RULES_PER_GROUP,
+             rule );
+
+    SetName( &names[SrBenchNearMiss],
+             nameBuffers[SrBenchNearMiss],
+             L"\\rules\\group%03u\\rule%05u.txt",
+             rule / SRBENCH_RULES_PER_GROUP,
+             rule );
+
+    SetName( &names[SrBenchUnrelated],
+             nameBuffers[SrBenchUnrelated],
+             L"\\Windows\\System32\\drivers\\etc\\hosts" );
+
+    expected[SrBenchHit] = &ruleSet->Mappings[rule];
+    expected[SrBenchNearMiss] = NULL;
+    expected[SrBenchUnrelated] = NULL;
+
+    //
+    //  The linear scan is too slow for a million lookups of 10000 rules,
+    //  so it does as many mapping comparisons as the trie does lookups.
+    //
+
+    linearLookups = max( Lookups / RuleCount, 1 );
+
+    for (kind = 0; kind < SrBenchNameKinds; kind++) {
+
+        found = SimRepFindMappingForPath( ruleSet, &names[kind], FALSE, TRUE, NULL );
+
+        TEST_ASSERT( found == expected[kind],
+                     "%u mappings, %s: the trie found %p instead of %p",
+                     RuleCount,
+                     NameKinds[kind],
+                     found,
+                     expected[kind] );
+
+        found = FindMappingLinear( ruleSet, &names[kind] );
+
+        TEST_ASSERT( found == expected[kind],
+                     "%u mappings, %s: the linear scan found %p instead of %p",
+                     RuleCount,
+                     NameKinds[kind],
+                     found,
+                     expected[kind] );
+
+        QueryPerformanceCounter( &start );
+
+        for (i = 0; i < Lookups; i++) {
+
+            found = SimRepFindMappingForPath( ruleSet, &names[kind], FALSE, TRUE, NULL );
+
+            if (found != expected[kind]) {
+
+                break;
+            }
+        }
+
+        QueryPerformanceCounter( &end );
+
+        trieNanoseconds = ElapsedNanoseconds( start, end, Frequency, Lookups );
+
+        QueryPerformanceCounter( &start );
+
+        for (i = 0; i < linearLookups; i++) {
+
+            found = FindMappingLinear( ruleSet, &names[kind] );
+
+            if (found != expected[kind]) {
+
+                break;
+            }
+        }
+
+        QueryPerformanceCounter( &end );
+
+        linearNanoseconds = ElapsedNanoseconds( start, end, Frequency, linearLookups );
+
+        TEST_ASSERT( found == expected[kind], "%u mappings, %s: lookups disagree", RuleCount, NameKinds[kind] );
+
+        TEST_COMMENT( "%8u %12.0f %-10s %12.1f %14.1f",
+                      RuleCount,
+                      buildNanoseconds,
+                      NameKinds[kind],
+                      trieNanoseconds,
+                      linearNanoseconds );
+    }
+
+End:
+
+    SimRepFreeRuleSet( ruleSet );
+
+    return Success;
+}
+
+
+int
+_cdecl
+main (
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    BOOL Success = TRUE;
+    LARGE_INTEGER frequency;
+    ULONG lookups = SRBENCH_DEFAULT_LOOKUPS;
+    ULONG i;
+
+    if (argc > 1) {
+
+        lookups = strtoul( argv[1], NULL, 0 );
+
+        if (lookups == 0) {
+
+            printf( "Usage: srbench [Lookups]\n" );
+            return 1;
+        }
+    }
+
+    QueryPerformanceFrequency( &frequency );
+
+    TEST_COMMENT( "%u lookups of each name", lookups );
+    TEST_COMMENT( "%8s %12s %-10s %12s %14s",
+                  "mappings",
+                  "build ns/map",
+                  "name",
+                  "trie ns",
+                  "linear ns" );
+
+    for (i = 0; i < ARRAYSIZE( RuleCounts ); i++) {
+
+        TEST_ASSERT( RunRuleCount( RuleCounts[i], lookups, frequency ),
+                     "%u mappings failed",
+                     RuleCounts[i] );
+    }
+
+End:
+
+    printf( "%s\n", Success ? "PASSED" : "FAILED" );
+
+    return Success ? 0 : 1;
+}
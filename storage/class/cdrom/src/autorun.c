@@ -29,6 +29,7 @@ Revision History:
 #include "cdrom.h"
 #include "mmc.h"
 #include "ioctl.h"
+#include "scratch.h"
 
 #include "ntstrsafe.h"
 
@@ -409,6 +410,8 @@ Notes:
             // don't notify that new media arrived, just set the
             // DO_VERIFY to force a FS reload.
 
+            ReadAhead_Invalidate(DeviceExtension);
+
             if (IsVolumeMounted(DeviceExtension->DeviceObject))
             {
                 SET_FLAG(DeviceExtension->DeviceObject->Flags, DO_VERIFY_VOLUME);
@@ -684,6 +687,11 @@ Return Value:
 
     info->LastKnownMediaDetectionState = NewState;
 
+    if (oldMediaState != NewState)
+    {
+        ReadAhead_Invalidate(DeviceExtension);
+    }
+
     // Increment MediaChangeCount on transition to MediaPresent
     if (NewState == MediaPresent && oldMediaState != NewState)
     {
@@ -951,6 +951,7 @@ Return Value:
     // Release all the memory that we have allocated.
 
     DeviceDeallocateMmcResources(Device);
+    ReadAhead_Deallocate(deviceExtension);
     ScratchBuffer_Deallocate(deviceExtension);
     RtlZeroMemory(&(deviceExtension->DeviceAdditionalData.Mmc), sizeof(CDROM_MMC_EXTENSION));
 
@@ -2187,6 +2188,25 @@ Return Value:
         break;
     }
 
+    case IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS:
+    {
+        // The statistics are only updated in the serial queue context;
+        // read them there so they are consistent with each other.
+        if (RequestParameters.Parameters.DeviceIoControl.OutputBufferLength <
+            sizeof(CDROM_READ_AHEAD_STATISTICS))
+        {
+            dataLength = sizeof(CDROM_READ_AHEAD_STATISTICS);
+            status = STATUS_BUFFER_TOO_SMALL;
+        }
+        else
+        {
+            status = STATUS_SUCCESS;
+        }
+
+        processed = TRUE;
+        break;
+    }
+
     case IOCTL_DISK_IS_WRITABLE: 
     {
         status = STATUS_SUCCESS;
@@ -3684,6 +3704,10 @@ Return Value:
         status = DeviceHandleSetReadAhead(DeviceExtension, Request, requestParameters, &information);
         break;
 
+    case IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS:
+        status = RequestHandleQueryReadAheadStatistics(DeviceExtension, Request, requestParameters, &information);
+        break;
+
     case IOCTL_CDROM_SET_SPEED:
         status = DeviceHandleSetSpeed(DeviceExtension, Request, requestParameters, &information);
         break;
@@ -4102,7 +4126,8 @@ Return Value:
             ioctlCode == IOCTL_STORAGE_GET_DEVICE_NUMBER  ||
             ioctlCode == IOCTL_STORAGE_GET_MEDIA_TYPES_EX ||
             ioctlCode == IOCTL_CDROM_EXCLUSIVE_ACCESS     ||
-            ioctlCode == IOCTL_CDROM_GET_INQUIRY_DATA
+            ioctlCode == IOCTL_CDROM_GET_INQUIRY_DATA     ||
+            ioctlCode == IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS
             )
         {
             *IsBlocked = FALSE;
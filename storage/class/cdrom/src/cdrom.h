@@ -42,6 +42,7 @@ Revision History:
 #include "ntddvol.h"
 #include "specstrings.h"
 #include "cdromp.h"
+#include "cdromra.h"
 
 // Set component ID for DbgPrintEx calls
 #ifndef DEBUG_COMP_ID
@@ -271,6 +272,11 @@ typedef struct _CDROM_SCRATCH_READ_WRITE_CONTEXT {
     LARGE_INTEGER   StartingOffset;
     BOOLEAN         IsRead;
 
+    // Set when the data goes to the read-ahead buffer rather than to the
+    // buffer of the original request. DataMdl then describes DataBuffer.
+    BOOLEAN         IsReadAhead;
+    PMDL            DataMdl;
+
     // A pointer to the SRB history item to be filled upon completion
     PSRB_HISTORY_ITEM   SrbHistoryItem;
 
@@ -308,6 +314,54 @@ typedef struct _CDROM_SCRATCH_CONTEXT {
   
 } CDROM_SCRATCH_CONTEXT, *PCDROM_SCRATCH_CONTEXT;
 
+// Optical media have long seek times, and file systems tend to read them in
+// small pieces. When reads become sequential, a larger range is read into
+// this buffer and the following reads are satisfied from it.
+// Only used in the serial I/O queue context, except for InvalidateCount.
+typedef struct _CDROM_READ_AHEAD_CONTEXT {
+
+    _Field_size_bytes_(BufferSize)  PUCHAR  Buffer;     // NULL if read-ahead is disabled
+    PMDL                            BufferMdl;
+    ULONG                           BufferSize;
+
+    // The range of the disc held in the buffer. It is only valid while
+    // InvalidateCount and the media change count of the device have the
+    // values they had when the buffer was filled.
+    LARGE_INTEGER           StartingOffset;
+    ULONG                   ValidLength;
+    LONG                    FillInvalidateCount;
+    ULONG                   FillMediaChangeCount;
+
+    // Bumped on writes and media events.
+    volatile LONG           InvalidateCount;
+
+    // Where the next read starts if the reader is sequential.
+    LARGE_INTEGER           NextOffset;
+
+    // Fills do not extend past this offset. It is lowered to where a fill
+    // failed, which usually is the end of the track, and reset when the
+    // buffer is invalidated.
+    LARGE_INTEGER           Limit;
+    LONG                    LimitInvalidateCount;
+    ULONG                   LimitMediaChangeCount;
+
+    // The part of the fill that the original request asked for.
+    ULONG                   RequestedLength;
+    PUCHAR                  RequestedBuffer;
+
+    // Statistics, returned by IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS.
+    // Hits out of Reads gives the hit rate. CommandsAvoided counts the
+    // commands hits would have needed, CommandsAdded the commands fills
+    // needed beyond those of the reads that caused them.
+    ULONGLONG               Reads;
+    ULONGLONG               Hits;
+    ULONGLONG               Fills;
+    ULONGLONG               FailedFills;
+    ULONGLONG               CommandsAvoided;
+    ULONGLONG               CommandsAdded;
+
+} CDROM_READ_AHEAD_CONTEXT, *PCDROM_READ_AHEAD_CONTEXT;
+
 // Context structure for the IOCTL work item
 typedef struct _CDROM_IOCTL_CONTEXT {
 
@@ -586,6 +640,9 @@ typedef struct _CDROM_DEVICE_EXTENSION {
     // scratch buffer related fields.
     CDROM_SCRATCH_CONTEXT   ScratchContext;
 
+    // read-ahead buffer for sequential reads.
+    CDROM_READ_AHEAD_CONTEXT ReadAheadContext;
+
     // Hold new private data that only classpnp should modify
     // in this structure.
     PCDROM_PRIVATE_FDO_DATA PrivateFdoData;
@@ -681,6 +738,9 @@ typedef struct _COMPLETION_CONTEXT {
 
 #define CDROM_SRB_LIST_SIZE          4
 
+#define CDROM_READ_AHEAD_DEFAULT_SIZE   (1024 * 1024)
+#define CDROM_READ_AHEAD_MAX_SIZE       (4 * 1024 * 1024)
+
 #define PLAY_ACTIVE(x) (x->DeviceAdditionalData.PlayActive)
 
 #define MSF_TO_LBA(Minutes,Seconds,Frames) \
@@ -724,6 +784,7 @@ typedef struct _COMPLETION_CONTEXT {
 #define CDROM_TAG_STREAM                'OCCS'  // "SCCO" - Set stream buffer
 #define CDROM_TAG_NOTIFICATION          'oCcS'  // "ScCo" - Device Notification buffer
 #define CDROM_TAG_PLAY_ACTIVE           'pCcS'  // "ScCp" - Play active checks
+#define CDROM_TAG_READ_AHEAD            'RCcS'  // "ScCR" - Read-ahead buffer
 #define CDROM_TAG_REGISTRY              'rCcS'  // "ScCr" - Registry string
 #define CDROM_TAG_SRB                   'SCcS'  // "ScCS" - Srb allocation
 #define CDROM_TAG_STRINGS               'sCcS'  // "ScCs" - Assorted string data
@@ -743,6 +804,7 @@ typedef struct _COMPLETION_CONTEXT {
 #define CDROM_TYPE_ONE_GET_CONFIG_NAME          (L"NoTypeOneGetConfig") // Type One Get Config commands not supported
 #define CDROM_NON_MMC_VENDOR_SPECIFIC_PROFILE   (L"NonMmcVendorSpecificProfile") // GET_CONFIG returns vendor specific header
                                                                                  // profiles that are not per spec (length divisible by 4)
+#define CDROM_READ_AHEAD_SIZE_NAME              (L"ReadAheadSize")  // size of the read-ahead buffer in bytes, 0 disables it
 #define DVD_DEFAULT_REGION          (L"DefaultDvdRegion")   // this is init. by the dvd class installer
 #define DVD_MAX_REGION              8
 
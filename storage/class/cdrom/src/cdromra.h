@@ -0,0 +1,56 @@
+/*++
+
+Copyright (C) Microsoft Corporation. All rights reserved.
+
+Module Name:
+
+    cdromra.h
+
+Abstract:
+
+    Definitions shared between cdrom.sys and user mode applications that
+    query the statistics of its read-ahead buffer.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef __CDROMRA_H__
+#define __CDROMRA_H__
+
+//
+// Read-ahead statistics.  They are counted from when the device was
+// started and are not reset.
+//
+// Reads counts the reads that were looked up in the buffer and Hits those
+// that were satisfied from it, so Hits out of Reads is the hit rate.  Fills
+// counts the reads that filled the buffer, FailedFills those fills that
+// failed and had the read issued again by itself.  CommandsAvoided counts
+// the commands hits and fills saved, CommandsAdded the commands fills
+// needed beyond those of the reads that caused them.
+//
+// Applications read them by sending IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS
+// with an output buffer of sizeof(CDROM_READ_AHEAD_STATISTICS).  BufferSize
+// is zero if read-ahead is disabled.
+//
+#define IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS \
+    CTL_CODE(IOCTL_CDROM_BASE, 0x0800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define CDROM_READ_AHEAD_STATISTICS_VERSION         1
+
+typedef struct _CDROM_READ_AHEAD_STATISTICS {
+    ULONG       Version;            // CDROM_READ_AHEAD_STATISTICS_VERSION
+    ULONG       Size;               // sizeof(CDROM_READ_AHEAD_STATISTICS)
+    ULONG       BufferSize;
+    ULONG       Reserved;
+    ULONGLONG   Reads;
+    ULONGLONG   Hits;
+    ULONGLONG   Fills;
+    ULONGLONG   FailedFills;
+    ULONGLONG   CommandsAvoided;
+    ULONGLONG   CommandsAdded;
+} CDROM_READ_AHEAD_STATISTICS, *PCDROM_READ_AHEAD_STATISTICS;
+
+#endif // __CDROMRA_H__
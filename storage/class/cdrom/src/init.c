@@ -860,6 +860,11 @@ Return Value:
                     status
                     ));
     }
+    else
+    {
+        // Read-ahead is an optimization; the device works without it.
+        ReadAhead_Allocate(DeviceExtension);
+    }
 
     return status;
 }
@@ -3920,6 +3920,8 @@ Return Value:
                          WDF_REQUEST_SEND_OPTION_SYNCHRONOUS,
                          NULL);
 
+    // The command may have written to or changed the media
+    ReadAhead_Invalidate(deviceExtension);
 
     if (!NT_SUCCESS(status) &&
         (isSoftEject != FALSE))
@@ -6373,7 +6375,6 @@ Return Value:
 --*/
 {
     NTSTATUS            status = STATUS_SUCCESS;
-    PCDROM_DATA         cdData = &(DeviceExtension->DeviceAdditionalData);
 
     size_t              transferByteCount = 0;
     PIRP                irp = NULL;
@@ -6381,7 +6382,6 @@ Return Value:
 
     PUCHAR              dataBuffer;
 
-
     irp = WdfRequestWdmGetIrp(Request);
     currentStack = IoGetCurrentIrpStackLocation(irp);
     dataBuffer = MmGetMdlVirtualAddress(irp->MdlAddress);
@@ -6423,64 +6423,28 @@ Return Value:
 
     if (NT_SUCCESS(status))
     {
-        ULONG   entireXferLen = currentStack->Parameters.Read.Length;
-        ULONG   maxLength = 0;
-        ULONG   packetsCount = 0;
-
-        PCDROM_SCRATCH_READ_WRITE_CONTEXT readWriteContext;
-        PCDROM_REQUEST_CONTEXT            requestContext;
-        PCDROM_REQUEST_CONTEXT            originalRequestContext;
-
-        // get the count of packets we need to send.
-        if ((((ULONG_PTR)dataBuffer) & (PAGE_SIZE-1)) == 0) 
-        {
-            maxLength = cdData->MaxPageAlignedTransferBytes;
-        } 
-        else 
+        if (RequestParameters.Type == WdfRequestTypeWrite)
         {
-            maxLength = cdData->MaxUnalignedTransferBytes;
+            // What was read ahead may no longer match the media
+            ReadAhead_Invalidate(DeviceExtension);
         }
-
-        packetsCount = entireXferLen / maxLength;
-
-        if (entireXferLen % maxLength != 0)
+        else if (ReadAhead_TryRead(DeviceExtension,
+                                   Request,
+                                   currentStack->Parameters.Read.ByteOffset,
+                                   currentStack->Parameters.Read.Length,
+                                   dataBuffer,
+                                   &status))
         {
-            packetsCount++;
+            return status;
         }
 
-        originalRequestContext = RequestGetContext(Request);
-
-
-        ScratchBuffer_BeginUse(DeviceExtension);
-
-        readWriteContext = &DeviceExtension->ScratchContext.ScratchReadWriteContext;
-        requestContext = RequestGetContext(DeviceExtension->ScratchContext.ScratchRequest);
-
-        readWriteContext->PacketsCount = packetsCount;
-        readWriteContext->EntireXferLen = entireXferLen;
-        readWriteContext->MaxLength = maxLength;
-        readWriteContext->StartingOffset = currentStack->Parameters.Read.ByteOffset;
-        readWriteContext->DataBuffer = dataBuffer;
-        readWriteContext->TransferedBytes = 0;
-        readWriteContext->IsRead = (RequestParameters.Type == WdfRequestTypeRead);
-
-        requestContext->OriginalRequest = Request;
-        requestContext->DeviceExtension = DeviceExtension;
-
-        //
-        // Setup the READ/WRITE fields in the original request which is what
-        // we use to properly synchronize cancellation logic between the
-        // cancel callback and the timer routine.
-        //
-
-        originalRequestContext->ReadWriteIsCompleted = FALSE;
-        originalRequestContext->ReadWriteRetryInitialized = FALSE;
-        originalRequestContext->DeviceExtension = DeviceExtension;
-
-        status = ScratchBuffer_PerformNextReadWrite(DeviceExtension, TRUE);
-                        
-        // We do not call ScratchBuffer_EndUse here, because we're not releasing the scratch SRB.
-        // It will be released in the completion routine.
+        status = ScratchBuffer_StartReadWrite(DeviceExtension,
+                                              Request,
+                                              currentStack->Parameters.Read.ByteOffset,
+                                              currentStack->Parameters.Read.Length,
+                                              dataBuffer,
+                                              NULL,
+                                              (RequestParameters.Type == WdfRequestTypeRead));
     }
 
     return status;
@@ -6962,6 +6926,65 @@ Return Value:
     return status;
 }
 
+NTSTATUS
+RequestHandleQueryReadAheadStatistics(
+    _In_  PCDROM_DEVICE_EXTENSION  DeviceExtension, 
+    _In_  WDFREQUEST               Request, 
+    _In_  WDF_REQUEST_PARAMETERS   RequestParameters,
+    _Out_ size_t *                 DataLength
+    )
+/*++
+
+Routine Description:
+
+   Handle request of IOCTL_CDROM_QUERY_READ_AHEAD_STATISTICS.
+   Must be called in the serial I/O queue context, where the statistics
+   are updated.
+
+Arguments:
+
+    DeviceExtension - device context
+    Request - request to be handled
+    RequestParameters - request parameter
+    DataLength - transferred data length
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    NTSTATUS                        status = STATUS_SUCCESS;
+    PCDROM_READ_AHEAD_CONTEXT       readAhead = &DeviceExtension->ReadAheadContext;
+    PCDROM_READ_AHEAD_STATISTICS    statistics = NULL;
+
+    *DataLength = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            RequestParameters.Parameters.DeviceIoControl.OutputBufferLength,
+                                            (PVOID*)&statistics,
+                                            NULL);
+
+    if (NT_SUCCESS(status))
+    {
+        RtlZeroMemory(statistics, sizeof(CDROM_READ_AHEAD_STATISTICS));
+
+        statistics->Version = CDROM_READ_AHEAD_STATISTICS_VERSION;
+        statistics->Size = sizeof(CDROM_READ_AHEAD_STATISTICS);
+        statistics->BufferSize = readAhead->BufferSize;
+        statistics->Reads = readAhead->Reads;
+        statistics->Hits = readAhead->Hits;
+        statistics->Fills = readAhead->Fills;
+        statistics->FailedFills = readAhead->FailedFills;
+        statistics->CommandsAvoided = readAhead->CommandsAvoided;
+        statistics->CommandsAdded = readAhead->CommandsAdded;
+
+        *DataLength = sizeof(CDROM_READ_AHEAD_STATISTICS);
+    }
+
+    return status;
+}
+
 #if (NTDDI_VERSION >= NTDDI_WIN8)
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS
@@ -264,6 +264,14 @@ RequestHandlePersistentReserve(
     _Out_ size_t *                 DataLength
     );
 
+NTSTATUS
+RequestHandleQueryReadAheadStatistics(
+    _In_  PCDROM_DEVICE_EXTENSION  DeviceExtension, 
+    _In_  WDFREQUEST               Request, 
+    _In_  WDF_REQUEST_PARAMETERS   RequestParameters,
+    _Out_ size_t *                 DataLength
+    );
+
 #if (NTDDI_VERSION >= NTDDI_WIN8)
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS
@@ -44,6 +44,8 @@ EVT_WDF_REQUEST_COMPLETION_ROUTINE  ScratchBuffer_ReadWriteCompletionRoutine;
 #pragma alloc_text(PAGE, ScratchBuffer_Allocate)
 #pragma alloc_text(PAGE, ScratchBuffer_SetupSrb)
 #pragma alloc_text(PAGE, ScratchBuffer_ExecuteCdbEx)
+#pragma alloc_text(PAGE, ReadAhead_Allocate)
+#pragma alloc_text(PAGE, ReadAhead_Deallocate)
 
 #endif
 
@@ -425,6 +427,134 @@ Return Value:
 }
 
 
+ULONG
+ScratchBuffer_GetMaxTransferLength(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ PUCHAR                   DataBuffer
+    )
+/*++
+
+Routine Description:
+
+    Returns the largest transfer a single read/write SRB can carry for a
+    buffer at the given address.
+
+Arguments:
+
+    DeviceExtension - Device extension
+
+    DataBuffer - start of the buffer
+
+Return Value:
+
+    maximum transfer length in bytes
+
+--*/
+{
+    if ((((ULONG_PTR)DataBuffer) & (PAGE_SIZE-1)) == 0) 
+    {
+        return DeviceExtension->DeviceAdditionalData.MaxPageAlignedTransferBytes;
+    } 
+    else 
+    {
+        return DeviceExtension->DeviceAdditionalData.MaxUnalignedTransferBytes;
+    }
+}
+
+
+NTSTATUS
+ScratchBuffer_StartReadWrite(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ WDFREQUEST               OriginalRequest,
+    _In_ LARGE_INTEGER            StartingOffset,
+    _In_ ULONG                    Length,
+    _In_ PUCHAR                   DataBuffer,
+    _In_opt_ PMDL                 DataMdl,
+    _In_ BOOLEAN                  IsRead
+    )
+/*++
+
+Routine Description:
+
+    This function takes the scratch request for a read/write and sends the
+    first SRB down the stack. The completion routine sends the rest.
+
+Arguments:
+
+    DeviceExtension - Device extension
+
+    OriginalRequest - the read/write request
+
+    StartingOffset - offset on the disc to start the transfer at
+
+    Length - length of the transfer
+
+    DataBuffer - buffer of the transfer
+
+    DataMdl - MDL of DataBuffer if it is the read-ahead buffer,
+              NULL if it is the buffer of the original request
+
+    IsRead - TRUE (read); FALSE (write)
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    PCDROM_SCRATCH_READ_WRITE_CONTEXT readWriteContext;
+    PCDROM_REQUEST_CONTEXT            requestContext;
+    PCDROM_REQUEST_CONTEXT            originalRequestContext;
+    ULONG                             maxLength = 0;
+    ULONG                             packetsCount = 0;
+
+    // get the count of packets we need to send.
+    maxLength = ScratchBuffer_GetMaxTransferLength(DeviceExtension, DataBuffer);
+
+    packetsCount = Length / maxLength;
+
+    if (Length % maxLength != 0)
+    {
+        packetsCount++;
+    }
+
+    originalRequestContext = RequestGetContext(OriginalRequest);
+
+
+    ScratchBuffer_BeginUse(DeviceExtension);
+
+    readWriteContext = &DeviceExtension->ScratchContext.ScratchReadWriteContext;
+    requestContext = RequestGetContext(DeviceExtension->ScratchContext.ScratchRequest);
+
+    readWriteContext->PacketsCount = packetsCount;
+    readWriteContext->EntireXferLen = Length;
+    readWriteContext->MaxLength = maxLength;
+    readWriteContext->StartingOffset = StartingOffset;
+    readWriteContext->DataBuffer = DataBuffer;
+    readWriteContext->TransferedBytes = 0;
+    readWriteContext->IsRead = IsRead;
+    readWriteContext->IsReadAhead = (DataMdl != NULL);
+    readWriteContext->DataMdl = DataMdl;
+
+    requestContext->OriginalRequest = OriginalRequest;
+    requestContext->DeviceExtension = DeviceExtension;
+
+    //
+    // Setup the READ/WRITE fields in the original request which is what
+    // we use to properly synchronize cancellation logic between the
+    // cancel callback and the timer routine.
+    //
+
+    originalRequestContext->ReadWriteIsCompleted = FALSE;
+    originalRequestContext->ReadWriteRetryInitialized = FALSE;
+    originalRequestContext->DeviceExtension = DeviceExtension;
+
+    // We do not call ScratchBuffer_EndUse here, because we're not releasing the scratch SRB.
+    // It will be released in the completion routine.
+    return ScratchBuffer_PerformNextReadWrite(DeviceExtension, TRUE);
+}
+
+
 NTSTATUS
 ScratchBuffer_PerformNextReadWrite(
     _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
@@ -553,7 +683,15 @@ Return Value:
         if (!NT_SUCCESS(status))
         {
             ScratchBuffer_EndUse(deviceExtension);
-            RequestCompletion(deviceExtension, originalRequest, status, readWriteContext->TransferedBytes);
+
+            if (readWriteContext->IsReadAhead)
+            {
+                ReadAhead_CompleteFill(deviceExtension, originalRequest, status);
+            }
+            else
+            {
+                RequestCompletion(deviceExtension, originalRequest, status, readWriteContext->TransferedBytes);
+            }
         }
     }
 
@@ -618,7 +756,8 @@ Return Value:
 
     // If WdfTimerStop returned TRUE, it means this request was scheduled for a retry
     // and the retry has not happened yet. We just need to cancel it and release the scratch buffer.
-    RequestCompletion(deviceExtension, Request, STATUS_CANCELLED, readWriteContext->TransferedBytes);
+    RequestCompletion(deviceExtension, Request, STATUS_CANCELLED,
+                      readWriteContext->IsReadAhead ? 0 : readWriteContext->TransferedBytes);
 }
 
 VOID
@@ -670,6 +809,11 @@ Return Value:
         (deviceExtension->ScratchContext.ScratchSrb->InternalStatus == STATUS_CANCELLED))
     {
         // The request has been cancelled, just need to complete it
+        if (readWriteContext->IsReadAhead)
+        {
+            // Make sure the read is not sent again without the read-ahead
+            status = STATUS_CANCELLED;
+        }
     }
     else if (SRB_STATUS(deviceExtension->ScratchContext.ScratchSrb->SrbStatus) != SRB_STATUS_SUCCESS)
     {
@@ -799,6 +943,12 @@ Return Value:
 
     ScratchBuffer_EndUse(deviceExtension);
 
+    if (readWriteContext->IsReadAhead)
+    {
+        // The data is in the read-ahead buffer, not yet in the original request
+        ReadAhead_CompleteFill(deviceExtension, originalRequest, status);
+        return;
+    }
 
     RequestCompletion(deviceExtension, originalRequest, status, readWriteContext->TransferedBytes);
 }
@@ -1235,7 +1385,8 @@ Return Value:
 
 --*/
 {
-    //NOTE: R/W request not use the ScratchBuffer, instead, it uses the buffer associated with IRP.
+    //NOTE: R/W request not use the ScratchBuffer, instead, it uses the buffer associated with IRP,
+    //      or the read-ahead buffer if the read/write context has an MDL.
 
     PSCSI_REQUEST_BLOCK srb = DeviceExtension->ScratchContext.ScratchSrb;
     PCDB                cdb = (PCDB)srb->Cdb;
@@ -1243,6 +1394,7 @@ Return Value:
     ULONG               numTransferBlocks;
 
     PIRP                originalIrp = WdfRequestWdmGetIrp(OriginalRequest);
+    PMDL                dataMdl = DeviceExtension->ScratchContext.ScratchReadWriteContext.DataMdl;
 
     PIRP                irp = WdfRequestWdmGetIrp(DeviceExtension->ScratchContext.ScratchRequest);
     PIO_STACK_LOCATION  irpStack = NULL;
@@ -1347,9 +1499,14 @@ Return Value:
     // is needed because more than one driver might be mapping the same MDL
     // and this causes problems.
     //
+    if (dataMdl == NULL)
+    {
+        dataMdl = originalIrp->MdlAddress;
+    }
+
     if (UsePartialMdl == FALSE) 
     {
-        irp->MdlAddress = originalIrp->MdlAddress;
+        irp->MdlAddress = dataMdl;
     } 
     else 
     {
@@ -1358,7 +1515,7 @@ Return Value:
             MmPrepareMdlForReuse(DeviceExtension->ScratchContext.PartialMdl);
         }
 
-        IoBuildPartialMdl(originalIrp->MdlAddress, DeviceExtension->ScratchContext.PartialMdl, srb->DataBuffer, srb->DataTransferLength);
+        IoBuildPartialMdl(dataMdl, DeviceExtension->ScratchContext.PartialMdl, srb->DataBuffer, srb->DataTransferLength);
         DeviceExtension->ScratchContext.PartialMdlIsBuilt = TRUE;
         irp->MdlAddress = DeviceExtension->ScratchContext.PartialMdl;
     }
@@ -1462,3 +1619,415 @@ Return Value:
 }
 
 
+
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReadAhead_Allocate(
+    _Inout_ PCDROM_DEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    allocate the read-ahead buffer. Its size comes from the ReadAheadSize
+    device parameter; zero disables read-ahead. Failing to allocate the
+    buffer is not fatal, reads are then sent down as issued.
+
+Arguments:
+
+    DeviceExtension - device extension
+
+Return Value:
+
+    none
+
+--*/
+{
+    PCDROM_READ_AHEAD_CONTEXT readAhead = &DeviceExtension->ReadAheadContext;
+    ULONG                     bufferSize = CDROM_READ_AHEAD_DEFAULT_SIZE;
+
+    PAGED_CODE ();
+
+    // quick-exit if already allocated
+    if (readAhead->Buffer != NULL)
+    {
+        return;
+    }
+
+    DeviceGetParameter(DeviceExtension,
+                       CDROM_SUBKEY_NAME,
+                       CDROM_READ_AHEAD_SIZE_NAME,
+                       &bufferSize);
+
+    bufferSize = min(bufferSize, CDROM_READ_AHEAD_MAX_SIZE);
+    bufferSize &= ~(PAGE_SIZE - 1);
+
+    if (bufferSize == 0)
+    {
+        TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_INIT,
+                    "Read-ahead is disabled\n"));
+        return;
+    }
+
+    readAhead->Buffer = ExAllocatePoolWithTag(NonPagedPoolNx,
+                                              bufferSize,
+                                              CDROM_TAG_READ_AHEAD);
+
+    if (readAhead->Buffer != NULL)
+    {
+        readAhead->BufferMdl = IoAllocateMdl(readAhead->Buffer,
+                                             bufferSize,
+                                             FALSE, FALSE, NULL);
+
+        if (readAhead->BufferMdl == NULL)
+        {
+            ExFreePool(readAhead->Buffer);
+            readAhead->Buffer = NULL;
+        }
+        else
+        {
+            MmBuildMdlForNonPagedPool(readAhead->BufferMdl);
+        }
+    }
+
+    if (readAhead->Buffer == NULL)
+    {
+        TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_INIT,
+                    "Failed to allocate read-ahead buffer of %x bytes, read-ahead is disabled\n",
+                    bufferSize
+                    ));
+        return;
+    }
+
+    readAhead->BufferSize = bufferSize;
+    readAhead->ValidLength = 0;
+    readAhead->NextOffset.QuadPart = -1;
+    readAhead->Limit.QuadPart = MAXLONGLONG;
+    readAhead->LimitInvalidateCount = readAhead->InvalidateCount;
+    readAhead->LimitMediaChangeCount = DeviceExtension->MediaChangeCount;
+
+    return;
+}
+
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+ReadAhead_Deallocate(
+    _Inout_ PCDROM_DEVICE_EXTENSION DeviceExtension
+    )
+/*++
+
+Routine Description:
+
+    release the read-ahead buffer.
+
+Arguments:
+
+    DeviceExtension - device extension
+
+Return Value:
+
+    none
+
+--*/
+{
+    PCDROM_READ_AHEAD_CONTEXT readAhead = &DeviceExtension->ReadAheadContext;
+
+    PAGED_CODE ();
+
+    if (readAhead->Buffer != NULL)
+    {
+        TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_GENERAL,
+                    "Read-ahead: %I64u reads, %I64u hits, %I64u fills, %I64u failed fills, %I64u commands avoided, %I64u commands added\n",
+                    readAhead->Reads,
+                    readAhead->Hits,
+                    readAhead->Fills,
+                    readAhead->FailedFills,
+                    readAhead->CommandsAvoided,
+                    readAhead->CommandsAdded
+                    ));
+    }
+
+    if (readAhead->BufferMdl != NULL)
+    {
+        IoFreeMdl(readAhead->BufferMdl);
+        readAhead->BufferMdl = NULL;
+    }
+    if (readAhead->Buffer != NULL)
+    {
+        ExFreePool(readAhead->Buffer);
+        readAhead->Buffer = NULL;
+    }
+
+    readAhead->BufferSize = 0;
+    readAhead->ValidLength = 0;
+
+    return;
+}
+
+
+BOOLEAN
+ReadAhead_TryRead(
+    _In_  PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_  WDFREQUEST               Request,
+    _In_  LARGE_INTEGER            StartingOffset,
+    _In_  ULONG                    Length,
+    _In_  PUCHAR                   DataBuffer,
+    _Out_ NTSTATUS*                Status
+    )
+/*++
+
+Routine Description:
+
+    Complete a read from the read-ahead buffer if it holds the data.
+    Otherwise, if the read starts where the previous one ended, start
+    filling the buffer from the start of the read. The fill is cut at the
+    end of the disc and at the point where an earlier fill failed.
+
+    Must be called in the serial I/O queue context.
+
+Arguments:
+
+    DeviceExtension - device extension
+
+    Request - the read request
+
+    StartingOffset - offset on the disc the read starts at
+
+    Length - length of the read
+
+    DataBuffer - buffer of the read, as used for the transfer
+
+    Status - status to return for the request if TRUE is returned
+
+Return Value:
+
+    TRUE if the request was completed or a fill was started for it.
+    FALSE if the request is to be sent down as issued.
+
+--*/
+{
+    PCDROM_READ_AHEAD_CONTEXT readAhead = &DeviceExtension->ReadAheadContext;
+    PIRP                      irp = WdfRequestWdmGetIrp(Request);
+    LONG                      invalidateCount = readAhead->InvalidateCount;
+    ULONG                     mediaChangeCount = DeviceExtension->MediaChangeCount;
+    BOOLEAN                   sequential = FALSE;
+    PUCHAR                    systemBuffer = NULL;
+    LONGLONG                  fillEnd = 0;
+    ULONG                     fillLength = 0;
+    ULONG                     readPackets = 0;
+    ULONG                     fillPackets = 0;
+    ULONG                     maxLength = 0;
+
+    *Status = STATUS_SUCCESS;
+
+    if ((readAhead->Buffer == NULL) ||
+        (Length > readAhead->BufferSize / 2) ||
+        RequestIsRealtimeStreaming(Request, TRUE))
+    {
+        return FALSE;
+    }
+
+    readAhead->Reads++;
+
+    sequential = (StartingOffset.QuadPart == readAhead->NextOffset.QuadPart);
+    readAhead->NextOffset.QuadPart = StartingOffset.QuadPart + Length;
+
+    // Drop what was read ahead, and forget where fills failed, if the media
+    // may have been changed or written since.
+    if ((readAhead->FillInvalidateCount != invalidateCount) ||
+        (readAhead->FillMediaChangeCount != mediaChangeCount))
+    {
+        readAhead->ValidLength = 0;
+    }
+
+    if ((readAhead->LimitInvalidateCount != invalidateCount) ||
+        (readAhead->LimitMediaChangeCount != mediaChangeCount))
+    {
+        readAhead->Limit.QuadPart = MAXLONGLONG;
+        readAhead->LimitInvalidateCount = invalidateCount;
+        readAhead->LimitMediaChangeCount = mediaChangeCount;
+    }
+
+    maxLength = ScratchBuffer_GetMaxTransferLength(DeviceExtension, DataBuffer);
+    readPackets = (Length + maxLength - 1) / maxLength;
+
+    if ((readAhead->ValidLength != 0) &&
+        (StartingOffset.QuadPart >= readAhead->StartingOffset.QuadPart) &&
+        (StartingOffset.QuadPart + Length <= readAhead->StartingOffset.QuadPart + readAhead->ValidLength))
+    {
+        systemBuffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+
+        if (systemBuffer == NULL)
+        {
+            return FALSE;
+        }
+
+        RtlCopyMemory(systemBuffer,
+                      readAhead->Buffer + (StartingOffset.QuadPart - readAhead->StartingOffset.QuadPart),
+                      Length);
+
+        readAhead->Hits++;
+        readAhead->CommandsAvoided += readPackets;
+
+        RequestCompletion(DeviceExtension, Request, STATUS_SUCCESS, Length);
+
+        return TRUE;
+    }
+
+    if (!sequential)
+    {
+        return FALSE;
+    }
+
+    fillEnd = min(StartingOffset.QuadPart + readAhead->BufferSize,
+                  DeviceExtension->StartingOffset.QuadPart + DeviceExtension->PartitionLength.QuadPart);
+    fillEnd = min(fillEnd, readAhead->Limit.QuadPart);
+
+    if (fillEnd <= StartingOffset.QuadPart + Length)
+    {
+        return FALSE;
+    }
+
+    fillLength = (ULONG)(fillEnd - StartingOffset.QuadPart);
+    fillLength &= ~(DeviceExtension->DiskGeometry.BytesPerSector - 1);
+
+    if (fillLength <= Length)
+    {
+        return FALSE;
+    }
+
+    systemBuffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+
+    if (systemBuffer == NULL)
+    {
+        return FALSE;
+    }
+
+    readAhead->ValidLength = 0;
+    readAhead->StartingOffset = StartingOffset;
+    readAhead->FillInvalidateCount = invalidateCount;
+    readAhead->FillMediaChangeCount = mediaChangeCount;
+    readAhead->RequestedLength = Length;
+    readAhead->RequestedBuffer = systemBuffer;
+
+    fillPackets = (fillLength + DeviceExtension->DeviceAdditionalData.MaxPageAlignedTransferBytes - 1) /
+                  DeviceExtension->DeviceAdditionalData.MaxPageAlignedTransferBytes;
+
+    readAhead->Fills++;
+
+    if (fillPackets > readPackets)
+    {
+        readAhead->CommandsAdded += fillPackets - readPackets;
+    }
+    else
+    {
+        readAhead->CommandsAvoided += readPackets - fillPackets;
+    }
+
+    *Status = ScratchBuffer_StartReadWrite(DeviceExtension,
+                                           Request,
+                                           StartingOffset,
+                                           fillLength,
+                                           readAhead->Buffer,
+                                           readAhead->BufferMdl,
+                                           TRUE);
+
+    return TRUE;
+}
+
+
+VOID
+ReadAhead_CompleteFill(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ WDFREQUEST               OriginalRequest,
+    _In_ NTSTATUS                 Status
+    )
+/*++
+
+Routine Description:
+
+    Complete the read a fill of the read-ahead buffer was started for.
+    The scratch request must have been released.
+
+    If the fill failed, the read is served from what the fill did transfer
+    if that covers it, and otherwise sent down again as issued, so that a
+    fill never fails a read that would have succeeded on its own. Only a
+    cancelled fill fails the read. If the failure suggests the fill ran
+    into the end of the track or into an unreadable area past the requested
+    data, fills are also not extended to that point again.
+
+Arguments:
+
+    DeviceExtension - device extension
+
+    OriginalRequest - the read request
+
+    Status - status of the fill
+
+Return Value:
+
+    none
+
+--*/
+{
+    PCDROM_READ_AHEAD_CONTEXT           readAhead = &DeviceExtension->ReadAheadContext;
+    PCDROM_SCRATCH_READ_WRITE_CONTEXT   readWriteContext = &DeviceExtension->ScratchContext.ScratchReadWriteContext;
+    ULONG                               transferredBytes = readWriteContext->TransferedBytes;
+    PIRP                                irp = NULL;
+    NTSTATUS                            status = STATUS_SUCCESS;
+
+    if (!NT_SUCCESS(Status))
+    {
+        if (Status == STATUS_CANCELLED)
+        {
+            RequestCompletion(DeviceExtension, OriginalRequest, Status, 0);
+            return;
+        }
+
+        readAhead->FailedFills++;
+
+        TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_RW,
+                    "ReadAhead_CompleteFill: fill failed %!STATUS! after %x bytes\n",
+                    Status,
+                    transferredBytes
+                    ));
+
+        if ((Status == STATUS_NONEXISTENT_SECTOR) ||
+            (Status == STATUS_INVALID_DEVICE_REQUEST) ||
+            (Status == STATUS_DEVICE_DATA_ERROR) ||
+            (Status == STATUS_CRC_ERROR) ||
+            (Status == STATUS_IO_DEVICE_ERROR))
+        {
+            readAhead->Limit.QuadPart = readAhead->StartingOffset.QuadPart + transferredBytes;
+        }
+    }
+
+    if (transferredBytes >= readAhead->RequestedLength)
+    {
+        readAhead->ValidLength = transferredBytes;
+
+        RtlCopyMemory(readAhead->RequestedBuffer, readAhead->Buffer, readAhead->RequestedLength);
+
+        RequestCompletion(DeviceExtension, OriginalRequest, STATUS_SUCCESS, readAhead->RequestedLength);
+        return;
+    }
+
+    // Not even the requested data was read; read just that, as if there had
+    // been no read-ahead.
+    irp = WdfRequestWdmGetIrp(OriginalRequest);
+
+    status = ScratchBuffer_StartReadWrite(DeviceExtension,
+                                          OriginalRequest,
+                                          readAhead->StartingOffset,
+                                          readAhead->RequestedLength,
+                                          MmGetMdlVirtualAddress(irp->MdlAddress),
+                                          NULL,
+                                          TRUE);
+
+    if (!NT_SUCCESS(status))
+    {
+        RequestCompletion(DeviceExtension, OriginalRequest, status, 0);
+    }
+}
@@ -75,6 +75,23 @@ ScratchBuffer_SendSrb(
                 PSRB_HISTORY_ITEM       *SrbHistoryItem
     );
 
+ULONG
+ScratchBuffer_GetMaxTransferLength(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ PUCHAR                   DataBuffer
+    );
+
+NTSTATUS
+ScratchBuffer_StartReadWrite(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ WDFREQUEST               OriginalRequest,
+    _In_ LARGE_INTEGER            StartingOffset,
+    _In_ ULONG                    Length,
+    _In_ PUCHAR                   DataBuffer,
+    _In_opt_ PMDL                 DataMdl,
+    _In_ BOOLEAN                  IsRead
+    );
+
 NTSTATUS
 ScratchBuffer_PerformNextReadWrite(
     _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
@@ -184,4 +201,41 @@ ScratchBuffer_ExecuteCdb(
 
 KDEFERRED_ROUTINE ScratchBuffer_ReadWriteTimerRoutine;
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+ReadAhead_Allocate(
+    _Inout_ PCDROM_DEVICE_EXTENSION DeviceExtension
+    );
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+ReadAhead_Deallocate(
+    _Inout_ PCDROM_DEVICE_EXTENSION DeviceExtension
+    );
+
+BOOLEAN
+ReadAhead_TryRead(
+    _In_  PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_  WDFREQUEST               Request,
+    _In_  LARGE_INTEGER            StartingOffset,
+    _In_  ULONG                    Length,
+    _In_  PUCHAR                   DataBuffer,
+    _Out_ NTSTATUS*                Status
+    );
+
+VOID
+ReadAhead_CompleteFill(
+    _In_ PCDROM_DEVICE_EXTENSION  DeviceExtension,
+    _In_ WDFREQUEST               OriginalRequest,
+    _In_ NTSTATUS                 Status
+    );
+
+__inline VOID ReadAhead_Invalidate(_Inout_ PCDROM_DEVICE_EXTENSION DeviceExtension)
+{
+    // May be called from any context. The data in the read-ahead buffer
+    // is dropped the next time a read looks at it.
+    InterlockedIncrement(&DeviceExtension->ReadAheadContext.InvalidateCount);
+    return;
+}
+
 #endif //__SCRATCH_H__
@@ -0,0 +1,71 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 1991 - 2010
+
+Module Name:
+
+    classlat.h
+
+Abstract:
+
+    Definitions shared between the class driver and user mode
+    applications that query the per-device latency histograms.
+
+Environment:
+
+    Kernel & user mode
+
+--*/
+
+#ifndef _CLASSLAT_H_
+#define _CLASSLAT_H_
+
+//
+// Latency histograms.  The time from sending a request to the port
+// driver until it completes is counted for reads and writes sent in
+// transfer packets, and for the flushes and unmaps sent with
+// ClassSendSrbSynchronous, each retry separately.
+//
+// Reads and writes are further split by transfer size: size class 0 is
+// up to 4KB and each following class doubles that, the last one holding
+// everything larger than 256KB.  Flushes and unmaps are all in size
+// class 0.
+//
+// Bucket N counts requests that took [2^N, 2^(N+1)) microseconds, bucket
+// 0 also those that took less than a microsecond and the last bucket
+// also everything longer.
+//
+// Applications read a device's histograms by sending
+// IOCTL_CLASS_QUERY_LATENCY_HISTOGRAMS with an output buffer of
+// sizeof(CLASS_LATENCY_HISTOGRAMS).  The driver keeps a copy per
+// processor and returns their sum.
+//
+typedef enum _CLASS_LATENCY_OPERATION {
+    ClassLatencyRead = 0,
+    ClassLatencyWrite,
+    ClassLatencyFlush,
+    ClassLatencyUnmap,
+    ClassLatencyMaxOperation
+} CLASS_LATENCY_OPERATION, *PCLASS_LATENCY_OPERATION;
+
+#define CLASS_LATENCY_SIZE_CLASSES                  8
+#define CLASS_LATENCY_BUCKETS                       20
+
+#define IOCTL_CLASS_QUERY_LATENCY_HISTOGRAMS \
+    CTL_CODE(IOCTL_STORAGE_BASE, 0x0800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _CLASS_LATENCY_HISTOGRAM {
+    ULONGLONG Count;
+    ULONGLONG TotalMicroseconds;
+    ULONGLONG Buckets[CLASS_LATENCY_BUCKETS];
+} CLASS_LATENCY_HISTOGRAM, *PCLASS_LATENCY_HISTOGRAM;
+
+#define CLASS_LATENCY_HISTOGRAMS_VERSION            1
+
+typedef struct _CLASS_LATENCY_HISTOGRAMS {
+    ULONG Version;                  // CLASS_LATENCY_HISTOGRAMS_VERSION
+    ULONG Size;                     // sizeof(CLASS_LATENCY_HISTOGRAMS)
+    CLASS_LATENCY_HISTOGRAM Histograms[ClassLatencyMaxOperation][CLASS_LATENCY_SIZE_CLASSES];
+} CLASS_LATENCY_HISTOGRAMS, *PCLASS_LATENCY_HISTOGRAMS;
+
+#endif // _CLASSLAT_H_
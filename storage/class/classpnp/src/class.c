@@ -2087,6 +2087,10 @@ NTSTATUS ClassPnpStartDevice(IN PDEVICE_OBJECT DeviceObject)
                      *  Allocate/initialize TRANSFER_PACKETs and related resources.
                      */
                     status = InitializeTransferPackets(DeviceObject);
+                    if (NT_SUCCESS(status)) {
+                        ClasspInitializeWriteMerge(fdoExtension);
+                        HistoryInitializeLatencyLog(fdoExtension->PrivateFdoData);
+                    }
                 }
                 else {
                     TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_PNP,  "ClassPnpStartDevice: Could not initialize hotplug information %lx\n", status));
@@ -2579,9 +2583,17 @@ NTSTATUS ClassReadWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
                             ClassAcquireRemoveLock(DeviceObject, (PVOID)&uniqueAddr);
 
                             ClasspMarkIrpAsIdle(Irp, FALSE);
-                            status = ServiceTransferRequest(DeviceObject, Irp, FALSE);
+                            if (ClasspIsWriteMergeCandidate(DeviceObject, Irp)) {
+                                status = ClasspMergeOrServiceWrite(DeviceObject, Irp);
+                            }
+                            else {
+                                status = ServiceTransferRequest(DeviceObject, Irp, FALSE);
+                            }
                             if (fdoData->IdlePrioritySupported == TRUE) {
-                                fdoData->LastNonIdleIoTime = ClasspGetCurrentTime();
+                                LARGE_INTEGER currentTime = ClasspGetCurrentTime();
+
+                                ClasspRecordForegroundArrival(fdoData, currentTime);
+                                fdoData->LastNonIdleIoTime = currentTime;
                             }
 
                             ClassReleaseRemoveLock(DeviceObject, (PVOID)&uniqueAddr);
@@ -4018,6 +4030,7 @@ ClassSendSrbSynchronous(
     ULONG retryCount = MAXIMUM_RETRIES;
     NTSTATUS status;
     BOOLEAN retry;
+    LARGE_INTEGER startTime;
     PSTORAGE_REQUEST_BLOCK_HEADER Srb = (PSTORAGE_REQUEST_BLOCK_HEADER)_Srb;
 
     //
@@ -4243,6 +4256,8 @@ retry:
     // Call the port driver with the request and wait for it to complete.
     //
 
+    startTime = ClasspGetCurrentTime();
+
     status = IoCallDriver(fdoExtension->CommonExtension.LowerDeviceObject, irp);
 
     if (status == STATUS_PENDING) {
@@ -4250,6 +4265,8 @@ retry:
         status = ioStatus.Status;
     }
 
+    HISTORYLOGLATENCY(fdoData, Srb, (ULONGLONG)startTime.QuadPart, (ULONGLONG)ClasspGetCurrentTime().QuadPart);
+
 //    NT_ASSERT(SRB_STATUS(Srb->SrbStatus) != SRB_STATUS_PENDING);
     NT_ASSERT(status != STATUS_PENDING);
     NT_ASSERT(!(Srb->SrbStatus & SRB_STATUS_QUEUE_FROZEN));
@@ -8614,6 +8631,23 @@ ClassDeviceControl(
             break;
         }
 
+        case IOCTL_CLASS_QUERY_LATENCY_HISTOGRAMS: {
+
+            FREE_POOL(srb);
+
+            if (!commonExtension->IsFdo) {
+
+                IoCopyCurrentIrpStackLocationToNext(Irp);
+
+                ClassReleaseRemoveLock(DeviceObject, Irp);
+                status = IoCallDriver(commonExtension->LowerDeviceObject, Irp);
+                break;
+            }
+
+            status = HistoryQueryLatencyLog(DeviceObject, Irp);
+            break;
+        }
+
         case IOCTL_STORAGE_EVENT_NOTIFICATION: {
 
             FREE_POOL(srb);
@@ -10450,6 +10484,7 @@ ClassRemoveDevice(
                     }
                     InitializeListHead(allFdosListEntry);
 
+                    ClasspCleanupWriteMerge(fdoExtension->PrivateFdoData);
                     DestroyAllTransferPackets(DeviceObject);
 
                     //
@@ -10460,6 +10495,8 @@ ClassRemoveDevice(
 
                     FREE_POOL(fdoExtension->PrivateFdoData->PowerProcessIrp);
                     FREE_POOL(fdoExtension->PrivateFdoData->FreeTransferPacketsLists);
+                    FREE_POOL(fdoExtension->PrivateFdoData->TransferPacketCaches);
+                    FREE_POOL(fdoExtension->PrivateFdoData->LatencyLog);
                     FREE_POOL(fdoExtension->PrivateFdoData);
                 }
 
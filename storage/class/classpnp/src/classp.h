@@ -110,10 +110,14 @@ extern ULONG ClassMaxInterleavePerCriticalIo;
 #define CLASSP_REG_ACCESS_ALIGNMENT_NOT_SUPPORTED   (L"AccessAlignmentQueryNotSupported")
 #define CLASSP_REG_DISBALE_IDLE_POWER_NAME          (L"DisableIdlePowerManagement")
 #define CLASSP_REG_IDLE_TIMEOUT_IN_SECONDS          (L"IdleTimeoutInSeconds")
+#define CLASSP_REG_IDLE_LATENCY_TARGET              (L"IdleForegroundLatencyTargetInMicroseconds")
+#define CLASSP_REG_IDLE_MIN_WAIT_INTERVAL           (L"IdleMinimumWaitInMilliseconds")
 #define CLASSP_REG_DISABLE_D3COLD                   (L"DisableD3Cold")
 #define CLASSP_REG_QERR_OVERRIDE_MODE               (L"QERROverrideMode")
 #define CLASSP_REG_LEGACY_ERROR_HANDLING            (L"LegacyErrorHandling")
 #define CLASSP_REG_COPY_OFFLOAD_MAX_TARGET_DURATION (L"CopyOffloadMaxTargetDuration")
+#define CLASSP_REG_WRITE_MERGE_WINDOW               (L"WriteMergeWindowInMicroseconds")
+#define CLASSP_REG_WRITE_MERGE_MAX_LENGTH           (L"WriteMergeMaxLength")
 
 #define CLASS_PERF_RESTORE_MINIMUM                  (0x10)
 #define CLASS_ERROR_LEVEL_1                         (0x4)
@@ -184,6 +188,42 @@ extern ULONG ClassMaxInterleavePerCriticalIo;
 #define CLASSPNP_POOL_TAG_LOG_MESSAGE               'mlcS'
 #define CLASSPNP_POOL_TAG_ADDITIONAL_DATA           'DAcS'
 #define CLASSPNP_POOL_TAG_FIRMWARE                  'wFcS'
+#define CLASSPNP_POOL_TAG_WRITE_MERGE               'gMcS'
+
+//
+// Write merging.  Writes of less than the maximum merged length that
+// continue the previous write are held for up to the merge window so
+// that the writes following them can be sent in the same transfer.
+// The window is off (zero) unless set in the registry, and is capped
+// at CLASS_WRITE_MERGE_MAX_WINDOW_IN_US.
+//
+#define CLASS_WRITE_MERGE_MAX_WINDOW_IN_US          (10 * 1000)
+#define CLASS_WRITE_MERGE_DEFAULT_MAX_LENGTH        (128 * 1024)
+#define CLASS_WRITE_MERGE_MAX_REQUESTS              32
+
+//
+// WMI data block reporting the write merge counters; see classlog.mof.
+//
+#define MSStorageDriver_ClassWriteMergeStatisticsGuid \
+    { 0x2a843e69, 0xed69, 0x472a, { 0x93, 0x9a, 0x8c, 0x5c, 0x1a, 0x55, 0x3a, 0xc7 } }
+
+typedef struct _MSStorageDriver_ClassWriteMergeStatistics
+{
+    ULONG windowInMicroseconds;
+    ULONG maxLength;
+    ULONGLONG candidateWrites;
+    ULONGLONG mergedWrites;
+    ULONGLONG mergedTransfers;
+    ULONGLONG windowExpirations;
+    ULONGLONG failedTransfers;
+} MSStorageDriver_ClassWriteMergeStatistics, *PMSStorageDriver_ClassWriteMergeStatistics;
+
+#define MSStorageDriver_ClassWriteMergeStatistics_SIZE sizeof(MSStorageDriver_ClassWriteMergeStatistics)
+
+//
+// Latency histograms; the layout returned to callers is in classlat.h.
+//
+#include <classlat.h>
 
 //
 // Macros related to Token Operation commands
@@ -626,14 +666,58 @@ typedef struct _TRANSFER_PACKET {
 #define MAX_OUTSTANDING_IO_PER_LUN_DEFAULT                  16
 #define MAX_CLEANUP_TRANSFER_PACKETS_AT_ONCE                8192
 
+/*
+ *  Maximum number of work items queued at once to log retried or failed
+ *  IOs to the system event log.  A device returning the same CHECK
+ *  CONDITION for every IO would otherwise queue one work item per IO;
+ *  events beyond this are only kept in the private error log.
+ */
+#define MAX_IO_EVENT_LOG_WORK_ITEMS                         4
+
+/*
+ *  Within the bounds above, the working set of each node follows the
+ *  number of its packets that were in use (sent down or held in a
+ *  processor cache) at once.  It is re-evaluated every
+ *  TRANSFER_PACKET_WORKINGSET_INTERVAL (in 100ns units) from the peak
+ *  observed during the previous interval.  When the node is out of
+ *  stress we snap down to twice the working set and lazily work down
+ *  to the working set itself.
+ */
+#define TRANSFER_PACKET_WORKINGSET_INTERVAL                 (1000 * 1000 * 10)
+
+/*
+ *  Each processor keeps up to TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH free
+ *  packets of its own node in front of the node's free list, so that a
+ *  processor that sends and completes its own transfers does not touch the
+ *  shared list head.  The cache is refilled from and spilled to the node
+ *  list half a cache at a time.  It holds a full default queue of the LUN,
+ *  so that a processor keeping the LUN busy by itself does not refill and
+ *  spill on every round of that queue.
+ */
+#define TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH               MAX_OUTSTANDING_IO_PER_LUN_DEFAULT
+
+
 
+#include "pktcache.h"
+
+/*
+ *  A write made of several contiguous client writes (see WriteMerge in
+ *  CLASS_PRIVATE_FDO_DATA).  The client irps are linked through
+ *  Tail.Overlay.ListEntry.
+ */
+typedef struct _CLASS_WRITE_MERGE_CONTEXT {
+    PDEVICE_OBJECT Fdo;
+    LIST_ENTRY Irps;
+    PVOID Buffer;
+    PMDL Mdl;
+} CLASS_WRITE_MERGE_CONTEXT, *PCLASS_WRITE_MERGE_CONTEXT;
 
-typedef struct _PNL_SLIST_HEADER {
-    DECLSPEC_CACHEALIGN SLIST_HEADER SListHeader;
-    DECLSPEC_CACHEALIGN ULONG NumFreeTransferPackets;
-    ULONG NumTotalTransferPackets;
-    ULONG DbgPeakNumTransferPackets;
-} PNL_SLIST_HEADER, *PPNL_SLIST_HEADER;
+/*
+ *  The latency histograms of one processor.
+ */
+typedef struct DECLSPEC_CACHEALIGN _CLASS_LATENCY_LOG {
+    CLASS_LATENCY_HISTOGRAM Histograms[ClassLatencyMaxOperation][CLASS_LATENCY_SIZE_CLASSES];
+} CLASS_LATENCY_LOG, *PCLASS_LATENCY_LOG;
 
 //
 // !!! WARNING !!!
@@ -691,6 +775,21 @@ struct _CLASS_PRIVATE_FDO_DATA {
      */
     ULONG UpdateDiskPropertiesWorkItemActive;
 
+    /*
+     * Set while a work item is queued to handle the corresponding
+     * event, so that the same sense data reported by many requests
+     * queues only one work item at a time.
+     */
+    LONG ResourceExhaustionEventPending;
+    LONG CapacityChangedEventPending;
+    LONG ProvisioningTypeChangedEventPending;
+
+    /*
+     * Number of queued work items logging retried or failed IOs
+     * (see MAX_IO_EVENT_LOG_WORK_ITEMS).
+     */
+    LONG NumIoEventLogWorkItems;
+
     //
     // Local equivalents of MinWorkingSetTransferPackets and MaxWorkingSetTransferPackets.
     // These values are initialized by the global equivalents but are then adjusted as
@@ -737,6 +836,35 @@ struct _CLASS_PRIVATE_FDO_DATA {
         KTIMER            Timer;       // timer to fire DPC
     } Retry;
 
+    //
+    // Write merging (see CLASS_WRITE_MERGE_MAX_WINDOW_IN_US).
+    // Pending writes are linked through Tail.Overlay.ListEntry and are
+    // cancellable (see ClasspWriteMergeCancel).
+    // Everything but the configuration is protected by Lock.
+    //
+    struct {
+        LONGLONG          WindowIn100ns;     // zero if merging is off
+        ULONG             MaxLength;
+        KSPIN_LOCK        Lock;
+        KDPC              Dpc;               // sends the pending writes
+        KTIMER            Timer;             // when the window expires
+        LIST_ENTRY        PendingIrps;
+        ULONG             NumPendingIrps;
+        ULONG             PendingLength;
+        LONGLONG          PendingOffset;
+        LONGLONG          NextOffset;        // end of the last candidate write
+        UCHAR             PendingFlags;      // stack location flags of the pending writes
+
+        //
+        // Counters reported through WMI.
+        //
+        ULONGLONG         CandidateWrites;   // writes considered for merging
+        ULONGLONG         MergedWrites;      // writes sent as part of a merged transfer
+        ULONGLONG         MergedTransfers;   // transfers made of more than one write
+        ULONGLONG         WindowExpirations; // batches sent because the window expired
+        ULONGLONG         FailedTransfers;   // merged transfers retried as separate writes
+    } WriteMerge;
+
     BOOLEAN TimerInitialized;
     BOOLEAN LoggedTURFailureSinceLastIO;
     BOOLEAN LoggedSYNCFailure;
@@ -759,6 +887,20 @@ struct _CLASS_PRIVATE_FDO_DATA {
     LIST_ENTRY AllTransferPacketsList;
     PPNL_SLIST_HEADER FreeTransferPacketsLists;
 
+    /*
+     *  Per-processor caches in front of FreeTransferPacketsLists,
+     *  indexed by processor index.
+     */
+    PPNL_PROCESSOR_CACHE TransferPacketCaches;
+    ULONG NumTransferPacketCaches;
+
+    /*
+     *  Per-processor latency histograms, indexed by processor index.
+     *  NULL if they could not be allocated.
+     */
+    PCLASS_LATENCY_LOG LatencyLog;
+    ULONG NumLatencyLogs;
+
     /*
      *  Queue for deferred client irps
      */
@@ -937,6 +1079,45 @@ struct _CLASS_PRIVATE_FDO_DATA {
     //
     LONG ActiveIdleIoCount;
 
+    //
+    // Adaptive idle I/O scheduling (see CLASS_IDLE_LATENCY_TARGET_FACTOR).
+    // Latencies and gaps are in 100ns units.  The latency peaks and the
+    // budget are updated with interlocked operations and IdleWaitInterval
+    // under IdleListLock; the arrival gap is a heuristic updated without
+    // synchronization.
+    //
+
+    //
+    // Number of idle requests allowed in the port driver.
+    //
+    LONG IdleBudget;
+
+    //
+    // Configured latency target of normal requests, zero if it is derived
+    // from ForegroundBaselineLatency.
+    //
+    ULONG IdleLatencyTarget;
+
+    //
+    // Decaying peak latency of normal requests, and of the normal requests
+    // that completed while no idle requests were outstanding.
+    //
+    ULONG ForegroundLatency;
+    ULONG ForegroundBaselineLatency;
+
+    //
+    // Average gap between arrivals of normal requests.
+    //
+    ULONG ForegroundArrivalGap;
+    LARGE_INTEGER LastNonIdleArrivalTime;
+
+    //
+    // Time (ms) the device must be quiet before idle requests are issued,
+    // and the lowest value it may be adapted down to.
+    //
+    USHORT IdleWaitInterval;
+    USHORT IdleMinWaitInterval;
+
     //
     // Support for class drivers to extend
     // the interpret sense information routine
@@ -1187,12 +1368,49 @@ typedef struct _IO_RETRIED_LOG_MESSAGE_CONTEXT {
 #define CLASS_IDLE_INTERVAL         12          // 12 milliseconds
 #define CLASS_STARVATION_INTERVAL   500         // 500 milliseconds
 
+//
+// Adaptive idle I/O scheduling.
+//
+// The number of idle requests allowed in the port driver (the idle budget)
+// moves between zero and IdleActiveIoMax: it grows by one for every idle
+// request that completes while normal requests meet the latency target,
+// and is halved whenever a normal request misses it.  The target is the
+// IdleForegroundLatencyTargetInMicroseconds registry value, or if that is
+// not set, CLASS_IDLE_LATENCY_TARGET_FACTOR times the latency of normal
+// requests seen while no idle requests were outstanding.
+//
+// Latency is tracked as a peak that decays by 1/2^CLASS_IDLE_PEAK_DECAY_SHIFT
+// per normal request, which follows the tail rather than the average.
+//
+// Idle requests start after the device has been quiet for twice the
+// average gap between normal requests, between the
+// IdleMinimumWaitInMilliseconds registry value and IdleInterval
+// milliseconds.  The minimum defaults to IdleInterval, so the wait stays
+// fixed unless it is configured; it cannot be set below
+// CLASS_IDLE_WAIT_INTERVAL_MIN.
+//
+#define CLASS_IDLE_LATENCY_TARGET_FACTOR    2
+#define CLASS_IDLE_PEAK_DECAY_SHIFT         7
+#define CLASS_IDLE_WAIT_INTERVAL_MIN        2           // 2 milliseconds
+
 //
 // Value of 50 milliseconds in 100 nanoseconds units
 //
 #define FIFTY_MS_IN_100NS_UNITS     50 * 100
 
 
+/*
+ *  Record the number of packets of a node currently outside its free list.
+ *  Unsynchronized; the peak is only a heuristic.
+ */
+__inline VOID ClasspSampleTransferPacketsInUse(PPNL_SLIST_HEADER FreeList)
+{
+    LONG inUse = (LONG)FreeList->NumTotalTransferPackets - (LONG)FreeList->NumFreeTransferPackets;
+    if (inUse > (LONG)FreeList->PeakTransferPacketsInUse){
+        FreeList->PeakTransferPacketsInUse = (ULONG)inUse;
+    }
+}
+
 /*
  *  Simple singly-linked-list queuing macros, with no synchronization.
  */
@@ -1691,10 +1909,27 @@ VOID DestroyTransferPacket(_In_ __drv_freesMem(mem) PTRANSFER_PACKET Pkt);
 VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, __drv_aliasesMem PTRANSFER_PACKET Pkt);
 PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNeeded);
 PTRANSFER_PACKET DequeueFreeTransferPacketEx(_In_ PDEVICE_OBJECT Fdo, _In_ BOOLEAN AllocIfNeeded, _In_ ULONG Node);
+PTRANSFER_PACKET ClasspDequeueCachedTransferPacket(_In_ PCLASS_PRIVATE_FDO_DATA FdoData, _Out_ PULONG Node);
+BOOLEAN ClasspCacheFreeTransferPacket(_In_ PCLASS_PRIVATE_FDO_DATA FdoData, _In_ PTRANSFER_PACKET Pkt, _Out_ PBOOLEAN Spilled);
+PTRANSFER_PACKET ClasspStealTransferPacket(_In_ PCLASS_PRIVATE_FDO_DATA FdoData, _In_ ULONG Node, _In_ ULONG ThiefIndex);
+VOID ClasspFlushTransferPacketCaches(_In_ PCLASS_PRIVATE_FDO_DATA FdoData);
+VOID ClasspUpdateTransferPacketWorkingSet(_In_ PCLASS_PRIVATE_FDO_DATA FdoData, _In_ ULONG Node);
 VOID SetupReadWriteTransferPacket(PTRANSFER_PACKET pkt, PVOID Buf, ULONG Len, LARGE_INTEGER DiskLocation, PIRP OriginalIrp);
 NTSTATUS SubmitTransferPacket(PTRANSFER_PACKET Pkt);
 IO_COMPLETION_ROUTINE TransferPktComplete;
 NTSTATUS ServiceTransferRequest(PDEVICE_OBJECT Fdo, PIRP Irp, BOOLEAN PostToDpc);
+BOOLEAN ClasspIsWriteMergeCandidate(PDEVICE_OBJECT Fdo, PIRP Irp);
+NTSTATUS ClasspMergeOrServiceWrite(PDEVICE_OBJECT Fdo, PIRP Irp);
+BOOLEAN ClasspQueueWriteForMerge(PCLASS_PRIVATE_FDO_DATA FdoData, PIRP Irp);
+VOID ClasspTakeWriteMergePendingIrps(PCLASS_PRIVATE_FDO_DATA FdoData, PLIST_ENTRY BatchList);
+VOID ClasspSubmitWriteMergeBatch(PDEVICE_OBJECT Fdo, PLIST_ENTRY BatchList);
+VOID ClasspFlushWriteMergeIfIdle(PDEVICE_OBJECT Fdo);
+ULONG ClasspTransferPacketsInUse(PCLASS_PRIVATE_FDO_DATA FdoData);
+DRIVER_CANCEL ClasspWriteMergeCancel;
+KDEFERRED_ROUTINE ClasspWriteMergeTimerDpc;
+IO_COMPLETION_ROUTINE ClasspWriteMergeComplete;
+VOID ClasspInitializeWriteMerge(PFUNCTIONAL_DEVICE_EXTENSION FdoExtension);
+VOID ClasspCleanupWriteMerge(PCLASS_PRIVATE_FDO_DATA FdoData);
 VOID TransferPacketQueueRetryDpc(PTRANSFER_PACKET Pkt);
 KDEFERRED_ROUTINE TransferPacketRetryTimerDpc;
 BOOLEAN InterpretTransferPacketError(PTRANSFER_PACKET Pkt);
@@ -2288,6 +2523,18 @@ ClasspCompleteIdleRequest(
     PFUNCTIONAL_DEVICE_EXTENSION FdoExtension
     );
 
+VOID
+ClasspRecordForegroundArrival(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    LARGE_INTEGER CurrentTime
+    );
+
+VOID
+ClasspRecordForegroundLatency(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    ULONGLONG Latency
+    );
+
 NTSTATUS
 ClasspPriorityHint(
     PDEVICE_OBJECT DeviceObject,
@@ -2333,6 +2580,32 @@ HistoryLogReturnedPacket(
         }                                      \
     }
 
+VOID
+HistoryInitializeLatencyLog(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData
+    );
+
+VOID
+HistoryLogLatency(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+    _In_ PSTORAGE_REQUEST_BLOCK_HEADER Srb,
+    _In_ ULONGLONG StartTime,
+    _In_ ULONGLONG EndTime
+    );
+
+#define HISTORYLOGLATENCY(_fdoData, _srb, _startTime, _endTime)        \
+    {                                                                  \
+        if ((_fdoData)->LatencyLog != NULL) {                          \
+            HistoryLogLatency(_fdoData, _srb, _startTime, _endTime);   \
+        }                                                              \
+    }
+
+NTSTATUS
+HistoryQueryLatencyLog(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp
+    );
+
 BOOLEAN
 InterpretSenseInfoWithoutHistory(
     _In_  PDEVICE_OBJECT Fdo,
@@ -92,10 +92,14 @@ GUIDREGINFO wmiClassGuids[] =
 {
     {
         MSStorageDriver_ClassErrorLogGuid, 1, 0
+    },
+    {
+        MSStorageDriver_ClassWriteMergeStatisticsGuid, 1, 0
     }
 };
 
 #define MSStorageDriver_ClassErrorLogGuid_Index     0
+#define MSStorageDriver_ClassWriteMergeStatisticsGuid_Index     1
 #define NUM_CLASS_WMI_GUIDS     (sizeof(wmiClassGuids) / sizeof(GUIDREGINFO))
 
 
@@ -893,6 +897,28 @@ Return Value:
                 senseData->fieldReplaceableUnitCode = fdoSenseData->FieldReplaceableUnitCode;
                 RtlMoveMemory(senseData->senseKeySpecific, fdoSenseData->SenseKeySpecific, sizeof(senseData->senseKeySpecific));
             }
+            status = STATUS_SUCCESS;
+        } else {
+            status = STATUS_BUFFER_TOO_SMALL;
+        }
+    } else if (GuidIndex == MSStorageDriver_ClassWriteMergeStatisticsGuid_Index) {
+
+        sizeNeeded = MSStorageDriver_ClassWriteMergeStatistics_SIZE;
+        if (BufferAvail >= sizeNeeded) {
+            PMSStorageDriver_ClassWriteMergeStatistics stats = (PMSStorageDriver_ClassWriteMergeStatistics) Buffer;
+            PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+            KIRQL oldIrql;
+
+            KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+            stats->windowInMicroseconds = (ULONG)(fdoData->WriteMerge.WindowIn100ns / 10);
+            stats->maxLength = fdoData->WriteMerge.MaxLength;
+            stats->candidateWrites = fdoData->WriteMerge.CandidateWrites;
+            stats->mergedWrites = fdoData->WriteMerge.MergedWrites;
+            stats->mergedTransfers = fdoData->WriteMerge.MergedTransfers;
+            stats->windowExpirations = fdoData->WriteMerge.WindowExpirations;
+            stats->failedTransfers = fdoData->WriteMerge.FailedTransfers;
+            KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+
             status = STATUS_SUCCESS;
         } else {
             status = STATUS_BUFFER_TOO_SMALL;
@@ -39,6 +39,11 @@ ClasspStopIdleTimer(
     PCLASS_PRIVATE_FDO_DATA FdoData
     );
 
+VOID
+ClasspSetIdleTimer(
+    PCLASS_PRIVATE_FDO_DATA FdoData
+    );
+
 KDEFERRED_ROUTINE ClasspIdleTimerDpc;
 
 VOID
@@ -53,6 +58,24 @@ ClasspDequeueIdleRequest(
     PFUNCTIONAL_DEVICE_EXTENSION FdoExtension
     );
 
+ULONG
+ClasspGetIdleLatencyTarget(
+    PCLASS_PRIVATE_FDO_DATA FdoData
+    );
+
+VOID
+ClasspUpdateIdleBudget(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    BOOLEAN IdleRequestCompleted
+    );
+
+ULONG
+ClasspDecayLatencyPeak(
+    volatile ULONG *Peak,
+    ULONG Latency,
+    ULONG DecayShift
+    );
+
 
 /*++
 
@@ -180,6 +203,8 @@ ClasspInitializeIdleTimer(
     ULONG idleInterval = CLASS_IDLE_INTERVAL;
     ULONG idlePrioritySupported = TRUE;
     ULONG activeIdleIoMax = 1;
+    ULONG latencyTarget = 0;
+    ULONG minWaitInterval;
 
     ClassGetDeviceParameter(FdoExtension,
                             CLASSP_REG_SUBKEY_NAME,
@@ -235,6 +260,39 @@ ClasspInitializeIdleTimer(
 
     fdoData->IdleActiveIoMax = (USHORT)activeIdleIoMax;
 
+    //
+    // Start with one idle request at a time and the full idle interval
+    // until normal requests have been seen.
+    //
+    ClassGetDeviceParameter(FdoExtension,
+                            CLASSP_REG_SUBKEY_NAME,
+                            CLASSP_REG_IDLE_LATENCY_TARGET,
+                            &latencyTarget);
+
+    latencyTarget = min(latencyTarget, MAXULONG / 10);
+
+    minWaitInterval = fdoData->IdleInterval;
+
+    ClassGetDeviceParameter(FdoExtension,
+                            CLASSP_REG_SUBKEY_NAME,
+                            CLASSP_REG_IDLE_MIN_WAIT_INTERVAL,
+                            &minWaitInterval);
+
+    minWaitInterval = max(minWaitInterval, CLASS_IDLE_WAIT_INTERVAL_MIN);
+    minWaitInterval = min(minWaitInterval, fdoData->IdleInterval);
+
+    fdoData->IdleLatencyTarget = latencyTarget * 10;
+    fdoData->IdleBudget = 1;
+    fdoData->IdleWaitInterval = fdoData->IdleInterval;
+    fdoData->IdleMinWaitInterval = (USHORT)minWaitInterval;
+    fdoData->ForegroundLatency = 0;
+    fdoData->ForegroundBaselineLatency = 0;
+    fdoData->ForegroundArrivalGap = 0;
+    fdoData->LastNonIdleArrivalTime.QuadPart = 0;
+
+    TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_TIMER, "ClasspInitializeIdleTimer: disk %p idle interval %u-%u ms, up to %u idle requests, latency target %u us\n",
+                FdoExtension, fdoData->IdleMinWaitInterval, fdoData->IdleInterval, fdoData->IdleActiveIoMax, latencyTarget));
+
     return;
 }
 
@@ -245,8 +303,9 @@ ClasspStartIdleTimer
 Routine Description:
 
     Start the idle timer if not already running. Reset the
-    timer counters before starting the timer. Use the IdleInterval
+    timer counters before starting the timer. Use the IdleWaitInterval
     in the private fdo data to setup the timer.
+    Must be called with IdleListLock held.
 
 Arguments:
 
@@ -262,8 +321,6 @@ ClasspStartIdleTimer(
     IN PCLASS_PRIVATE_FDO_DATA FdoData
     )
 {
-    LARGE_INTEGER dueTime;
-    LONG mstotimer;
     LONG timerStarted;
 
     TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_TIMER, "ClasspStartIdleTimer: Start idle timer\n"));
@@ -277,21 +334,52 @@ ClasspStartIdleTimer(
         //
         FdoData->AntiStarvationStartTime = ClasspGetCurrentTime();
 
-        //
-        // convert milliseconds to a relative 100ns
-        //
-        mstotimer = (-10) * 1000;
+        ClasspSetIdleTimer(FdoData);
+    }
+    return;
+}
 
-        //
-        // multiply the period
-        //
-        dueTime.QuadPart = Int32x32To64(FdoData->IdleInterval, mstotimer);
+/*++
 
-        KeSetTimerEx(&FdoData->IdleTimer,
-                     dueTime,
-                     FdoData->IdleInterval,
-                     &FdoData->IdleDpc);
-    }
+ClasspSetIdleTimer
+
+Routine Description:
+
+    Set the idle timer to expire every IdleWaitInterval milliseconds,
+    starting IdleWaitInterval from now.
+    Must be called with IdleListLock held.
+
+Arguments:
+
+    FdoData - Pointer to the private fdo data
+
+Return Value:
+
+    None
+
+--*/
+VOID
+ClasspSetIdleTimer(
+    PCLASS_PRIVATE_FDO_DATA FdoData
+    )
+{
+    LARGE_INTEGER dueTime;
+    LONG mstotimer;
+
+    //
+    // convert milliseconds to a relative 100ns
+    //
+    mstotimer = (-10) * 1000;
+
+    //
+    // multiply the period
+    //
+    dueTime.QuadPart = Int32x32To64(FdoData->IdleWaitInterval, mstotimer);
+
+    KeSetTimerEx(&FdoData->IdleTimer,
+                 dueTime,
+                 FdoData->IdleWaitInterval,
+                 &FdoData->IdleDpc);
     return;
 }
 
@@ -374,7 +462,7 @@ ClasspGetIdleTime (
         //
         // Failed to get time difference, assume enough time passed.
         //
-        idleTime = FdoData->IdleInterval;
+        idleTime = FdoData->IdleWaitInterval;
     }
 
     return idleTime;
@@ -434,7 +522,7 @@ ClasspIdleDurationSufficient (
         **CurrentTimeIn = CurrentTime;
     }
 
-    if (idleInterval >= FdoData->IdleInterval) {
+    if (idleInterval >= FdoData->IdleWaitInterval) {
         return TRUE;
     }
 
@@ -448,8 +536,8 @@ ClasspIdleTimerDpc
 Routine Description:
 
     Timer dpc function. This function will be called once every
-    IdleInterval. An idle request will be queued if sufficient idle time
-    has elapsed since the last non-idle request.
+    IdleWaitInterval. An idle request will be queued if sufficient idle time
+    has elapsed since the last non-idle request and the idle budget allows.
 
 Arguments:
 
@@ -492,9 +580,16 @@ ClasspIdleTimerDpc(
     if (fdoData->ActiveIoCount <= 0) {
 
         //
-        // If there are max active idle requests, do not issue another one here.
+        // With no normal requests to measure, let the latency peak decay
+        // so that a budget cut by an old latency spike can grow again.
         //
-        if (fdoData->ActiveIdleIoCount >= fdoData->IdleActiveIoMax) {
+        ClasspDecayLatencyPeak(&fdoData->ForegroundLatency, 0, 3);
+        ClasspUpdateIdleBudget(fdoData, FALSE);
+
+        //
+        // If the idle budget is used up, do not issue another one here.
+        //
+        if (fdoData->ActiveIdleIoCount >= fdoData->IdleBudget) {
             return;
         }
 
@@ -597,10 +692,10 @@ ClasspEnqueueIdleRequest(
     }
 
     //
-    // If there are already max active idle requests in the port driver, then
+    // If the idle budget is already used up in the port driver, then
     // queue this idle request.
     //
-    if (fdoData->ActiveIdleIoCount >= fdoData->IdleActiveIoMax) {
+    if (fdoData->ActiveIdleIoCount >= fdoData->IdleBudget) {
         issueRequest = FALSE;
     }
 
@@ -715,14 +810,15 @@ ClasspCompleteIdleRequest(
 {
     PCLASS_PRIVATE_FDO_DATA fdoData = FdoExtension->PrivateFdoData;
 
+    ClasspUpdateIdleBudget(fdoData, TRUE);
+
     //
     // Issue the next idle request if there are any left in the queue, there are
-    // no non-idle requests outstanding, there are less than max idle requests
-    // outstanding, and it has been long enough since the completion of the last
-    // non-idle request.
+    // no non-idle requests outstanding, the idle budget is not used up, and it
+    // has been long enough since the completion of the last non-idle request.
     //
     if ((fdoData->IdleIoCount > 0) &&
-        (fdoData->ActiveIdleIoCount < fdoData->IdleActiveIoMax) &&
+        (fdoData->ActiveIdleIoCount < fdoData->IdleBudget) &&
         (fdoData->ActiveIoCount <= 0) &&
         (ClasspIdleDurationSufficient(fdoData, NULL))) {
         TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_TIMER, "ClasspCompleteIdleRequest: Service next idle reqeusts\n"));
@@ -767,3 +863,269 @@ ClasspServiceIdleRequest(
     return;
 }
 
+/*++
+
+ClasspGetIdleLatencyTarget
+
+Routine Description:
+
+    Return the latency normal requests should stay within while idle
+    requests are outstanding.
+
+Arguments:
+
+    FdoData - Pointer to the private fdo data
+
+Return Value:
+
+    The target in 100ns units, MAXULONG if there is none yet.
+
+--*/
+ULONG
+ClasspGetIdleLatencyTarget(
+    PCLASS_PRIVATE_FDO_DATA FdoData
+    )
+{
+    ULONG baseline;
+
+    if (FdoData->IdleLatencyTarget != 0) {
+        return FdoData->IdleLatencyTarget;
+    }
+
+    baseline = FdoData->ForegroundBaselineLatency;
+
+    if ((baseline == 0) || (baseline > MAXULONG / CLASS_IDLE_LATENCY_TARGET_FACTOR)) {
+        return MAXULONG;
+    }
+
+    return baseline * CLASS_IDLE_LATENCY_TARGET_FACTOR;
+}
+
+/*++
+
+ClasspUpdateIdleBudget
+
+Routine Description:
+
+    Grow the idle budget by one if normal requests are within the latency
+    target, and recompute how long the device must be quiet before idle
+    requests are issued. If that changes, the idle timer is set again so
+    that it expires at the new interval.
+
+Arguments:
+
+    FdoData - Pointer to the private fdo data
+
+    IdleRequestCompleted - TRUE when called for a completed idle request.
+        Otherwise the budget is only grown from zero.
+
+Return Value:
+
+    None
+
+--*/
+VOID
+ClasspUpdateIdleBudget(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    BOOLEAN IdleRequestCompleted
+    )
+{
+    LONG budget;
+    ULONGLONG waitInterval;
+    KIRQL oldIrql;
+
+    //
+    // ClasspRecordForegroundLatency may halve the budget at the same time,
+    // so it is only grown from the value it was checked against.
+    //
+    if (ReadULongNoFence((volatile ULONG *)&FdoData->ForegroundLatency) <= ClasspGetIdleLatencyTarget(FdoData)) {
+
+        do {
+            budget = ReadNoFence(&FdoData->IdleBudget);
+
+            if ((!IdleRequestCompleted && (budget != 0)) ||
+                (budget >= FdoData->IdleActiveIoMax)) {
+                break;
+            }
+
+        } while (InterlockedCompareExchange(&FdoData->IdleBudget, budget + 1, budget) != budget);
+    }
+
+    //
+    // Wait for twice the average gap between normal requests.
+    //
+    waitInterval = ClasspTimeDiffToMs(2 * (ULONGLONG)FdoData->ForegroundArrivalGap);
+    waitInterval = max(waitInterval, FdoData->IdleMinWaitInterval);
+    waitInterval = min(waitInterval, FdoData->IdleInterval);
+
+    //
+    // The timer is periodic with the interval it was set with, so set it
+    // again when the interval changes.  IdleListLock serializes this with
+    // starting and stopping the timer.
+    //
+    if ((USHORT)waitInterval != FdoData->IdleWaitInterval) {
+
+        KeAcquireSpinLock(&FdoData->IdleListLock, &oldIrql);
+
+        if ((USHORT)waitInterval != FdoData->IdleWaitInterval) {
+            FdoData->IdleWaitInterval = (USHORT)waitInterval;
+
+            if (FdoData->IdleTimerStarted) {
+                ClasspSetIdleTimer(FdoData);
+            }
+        }
+
+        KeReleaseSpinLock(&FdoData->IdleListLock, oldIrql);
+    }
+
+    return;
+}
+
+/*++
+
+ClasspRecordForegroundArrival
+
+Routine Description:
+
+    Update the average gap between normal requests with one that has
+    just been sent.
+
+Arguments:
+
+    FdoData - Pointer to the private fdo data
+
+    CurrentTime - The time the request was sent
+
+Return Value:
+
+    None
+
+--*/
+VOID
+ClasspRecordForegroundArrival(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    LARGE_INTEGER CurrentTime
+    )
+{
+    ULONGLONG gap;
+    ULONG averageGap = FdoData->ForegroundArrivalGap;
+
+    if ((FdoData->LastNonIdleArrivalTime.QuadPart != 0) &&
+        (CurrentTime.QuadPart > FdoData->LastNonIdleArrivalTime.QuadPart)) {
+
+        gap = (ULONGLONG)(CurrentTime.QuadPart - FdoData->LastNonIdleArrivalTime.QuadPart);
+        gap = min(gap, MAXULONG);
+
+        //
+        // Exponential moving average with a weight of 1/8.
+        //
+        FdoData->ForegroundArrivalGap = averageGap - (averageGap >> 3) + ((ULONG)gap >> 3);
+    }
+
+    FdoData->LastNonIdleArrivalTime = CurrentTime;
+    return;
+}
+
+/*++
+
+ClasspRecordForegroundLatency
+
+Routine Description:
+
+    Account for the latency of a normal request that has just completed.
+    If it missed the latency target while idle requests were outstanding,
+    halve the idle budget.
+
+Arguments:
+
+    FdoData - Pointer to the private fdo data
+
+    Latency - Time from sending the request to its completion, in 100ns units
+
+Return Value:
+
+    None
+
+--*/
+VOID
+ClasspRecordForegroundLatency(
+    PCLASS_PRIVATE_FDO_DATA FdoData,
+    ULONGLONG Latency
+    )
+{
+    ULONG latency = (ULONG)min(Latency, MAXULONG);
+    LONG budget;
+
+    //
+    // Requests complete on several processors at once, so the peaks and
+    // the budget are updated with interlocked operations.
+    //
+    ClasspDecayLatencyPeak(&FdoData->ForegroundLatency, latency, CLASS_IDLE_PEAK_DECAY_SHIFT);
+
+    if (FdoData->ActiveIdleIoCount == 0) {
+
+        ClasspDecayLatencyPeak(&FdoData->ForegroundBaselineLatency, latency, CLASS_IDLE_PEAK_DECAY_SHIFT);
+
+    } else if (latency > ClasspGetIdleLatencyTarget(FdoData)) {
+
+        do {
+            budget = ReadNoFence(&FdoData->IdleBudget);
+
+            if (budget <= 0) {
+                return;
+            }
+
+        } while (InterlockedCompareExchange(&FdoData->IdleBudget, budget / 2, budget) != budget);
+
+        TracePrint((TRACE_LEVEL_VERBOSE, TRACE_FLAG_TIMER, "ClasspRecordForegroundLatency: latency %u missed the target, idle budget %d -> %d\n",
+                    latency, budget, budget / 2));
+    }
+
+    return;
+}
+
+/*++
+
+ClasspDecayLatencyPeak
+
+Routine Description:
+
+    Let a decaying latency peak decay by 1/2^DecayShift of its value and
+    raise it to Latency if that is higher.
+
+Arguments:
+
+    Peak - The peak to update
+
+    Latency - Latency just measured, in 100ns units; zero to only decay the peak
+
+    DecayShift - How fast the peak decays
+
+Return Value:
+
+    The new peak.
+
+--*/
+ULONG
+ClasspDecayLatencyPeak(
+    volatile ULONG *Peak,
+    ULONG Latency,
+    ULONG DecayShift
+    )
+{
+    ULONG peak;
+    ULONG newPeak;
+
+    do {
+        peak = ReadULongNoFence(Peak);
+        newPeak = peak - (peak >> DecayShift);
+        newPeak = max(newPeak, Latency);
+
+        if (newPeak == peak) {
+            break;
+        }
+
+    } while ((ULONG)InterlockedCompareExchange((volatile LONG *)Peak, (LONG)newPeak, (LONG)peak) != peak);
+
+    return newPeak;
+}
@@ -33,6 +33,10 @@ Revision History:
 //    #pragma alloc_text(PAGE, InitializeTransferPackets)
 //#endif
 
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, HistoryInitializeLatencyLog)
+#endif
+
 VOID HistoryInitializeRetryLogs(_Out_ PSRB_HISTORY History, ULONG HistoryCount) {
     ULONG tmpSize = HistoryCount * sizeof(SRB_HISTORY_ITEM);
     tmpSize += sizeof(SRB_HISTORY) - sizeof(SRB_HISTORY_ITEM);
@@ -144,3 +148,189 @@ VOID HistoryLogReturnedPacket(TRANSFER_PACKET *Pkt) {
     return;
 }
 
+
+/*
+ *  HistoryInitializeLatencyLog
+ *
+ *      Allocate the per-processor latency histograms.  Without them the
+ *      device works as before, only the histograms cannot be queried.
+ */
+VOID HistoryInitializeLatencyLog(_In_ PCLASS_PRIVATE_FDO_DATA FdoData) {
+
+    ULONG numLogs;
+
+    PAGED_CODE();
+
+    if (FdoData->LatencyLog != NULL) {
+        return;
+    }
+
+    numLogs = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    FdoData->LatencyLog = ExAllocatePoolZero(NonPagedPoolNxCacheAligned,
+                                             numLogs * sizeof(CLASS_LATENCY_LOG),
+                                             CLASS_TAG_PRIVATE_DATA);
+    if (FdoData->LatencyLog == NULL) {
+        TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_INIT, "HistoryInitializeLatencyLog: could not allocate latency histograms for %u processors.", numLogs));
+        return;
+    }
+
+    FdoData->NumLatencyLogs = numLogs;
+    return;
+}
+
+
+/*
+ *  HistoryLogLatency
+ *
+ *      Count a request that was sent at StartTime and completed at
+ *      EndTime (as returned by ClasspGetCurrentTime) in the histogram of
+ *      its operation and size.  Requests other than reads, writes,
+ *      flushes and unmaps are not counted.
+ */
+VOID HistoryLogLatency(_In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+                       _In_ PSTORAGE_REQUEST_BLOCK_HEADER Srb,
+                       _In_ ULONGLONG StartTime,
+                       _In_ ULONGLONG EndTime) {
+
+    PCDB cdb;
+    CLASS_LATENCY_OPERATION operation;
+    PCLASS_LATENCY_HISTOGRAM histogram;
+    ULONG length;
+    ULONG sizeClass = 0;
+    ULONG bucket = 0;
+    ULONGLONG microseconds = 0;
+    ULONG processorIndex;
+    KIRQL oldIrql;
+
+    cdb = SrbGetCdb(Srb);
+    if (cdb == NULL) {
+        return;
+    }
+
+    switch (cdb->CDB6GENERIC.OperationCode) {
+        case SCSIOP_READ6:
+        case SCSIOP_READ:
+        case SCSIOP_READ12:
+        case SCSIOP_READ16:
+            operation = ClassLatencyRead;
+            break;
+
+        case SCSIOP_WRITE6:
+        case SCSIOP_WRITE:
+        case SCSIOP_WRITE12:
+        case SCSIOP_WRITE16:
+            operation = ClassLatencyWrite;
+            break;
+
+        case SCSIOP_SYNCHRONIZE_CACHE:
+        case SCSIOP_SYNCHRONIZE_CACHE16:
+            operation = ClassLatencyFlush;
+            break;
+
+        case SCSIOP_UNMAP:
+            operation = ClassLatencyUnmap;
+            break;
+
+        default:
+            return;
+    }
+
+    if ((operation == ClassLatencyRead) || (operation == ClassLatencyWrite)) {
+        length = SrbGetDataTransferLength(Srb);
+        if (length > 4096) {
+            sizeClass = min((ULONG)RtlFindMostSignificantBit(length - 1) - 11, CLASS_LATENCY_SIZE_CLASSES - 1);
+        }
+    }
+
+    if (EndTime > StartTime) {
+        microseconds = (EndTime - StartTime) / 10;
+        if (microseconds != 0) {
+            bucket = min((ULONG)RtlFindMostSignificantBit(microseconds), CLASS_LATENCY_BUCKETS - 1);
+        }
+    }
+
+    /*
+     *  Stay on this processor while updating its histograms, so that they
+     *  need no interlocked operations.
+     */
+    oldIrql = KeRaiseIrqlToDpcLevel();
+
+    processorIndex = KeGetCurrentProcessorIndex();
+    if (processorIndex < FdoData->NumLatencyLogs) {
+        histogram = &FdoData->LatencyLog[processorIndex].Histograms[operation][sizeClass];
+        histogram->Count++;
+        histogram->TotalMicroseconds += microseconds;
+        histogram->Buckets[bucket]++;
+    }
+
+    KeLowerIrql(oldIrql);
+    return;
+}
+
+
+/*
+ *  HistoryQueryLatencyLog
+ *
+ *      Handles IOCTL_CLASS_QUERY_LATENCY_HISTOGRAMS: return the sum of the
+ *      histograms of all processors.  The counts are read without
+ *      stopping the processors that update them, so a request completing
+ *      meanwhile may be only partly included.
+ */
+NTSTATUS HistoryQueryLatencyLog(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
+
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = DeviceObject->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExtension->PrivateFdoData;
+    PCLASS_LATENCY_HISTOGRAMS histograms = Irp->AssociatedIrp.SystemBuffer;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PCLASS_LATENCY_HISTOGRAM source;
+    PCLASS_LATENCY_HISTOGRAM target;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG processorIndex;
+    ULONG operation;
+    ULONG sizeClass;
+    ULONG bucket;
+
+    Irp->IoStatus.Information = 0;
+
+    if (fdoData->LatencyLog == NULL) {
+        status = STATUS_NOT_SUPPORTED;
+        goto QueryLatencyLogExit;
+    }
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof(CLASS_LATENCY_HISTOGRAMS)) {
+
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto QueryLatencyLogExit;
+    }
+
+    RtlZeroMemory(histograms, sizeof(CLASS_LATENCY_HISTOGRAMS));
+    histograms->Version = CLASS_LATENCY_HISTOGRAMS_VERSION;
+    histograms->Size = sizeof(CLASS_LATENCY_HISTOGRAMS);
+
+    for (processorIndex = 0; processorIndex < fdoData->NumLatencyLogs; processorIndex++) {
+        for (operation = 0; operation < ClassLatencyMaxOperation; operation++) {
+            for (sizeClass = 0; sizeClass < CLASS_LATENCY_SIZE_CLASSES; sizeClass++) {
+
+                source = &fdoData->LatencyLog[processorIndex].Histograms[operation][sizeClass];
+                target = &histograms->Histograms[operation][sizeClass];
+
+                target->Count += source->Count;
+                target->TotalMicroseconds += source->TotalMicroseconds;
+                for (bucket = 0; bucket < CLASS_LATENCY_BUCKETS; bucket++) {
+                    target->Buckets[bucket] += source->Buckets[bucket];
+                }
+            }
+        }
+    }
+
+    Irp->IoStatus.Information = sizeof(CLASS_LATENCY_HISTOGRAMS);
+
+QueryLatencyLogExit:
+
+    Irp->IoStatus.Status = status;
+    ClassReleaseRemoveLock(DeviceObject, Irp);
+    ClassCompleteRequest(DeviceObject, Irp, IO_NO_INCREMENT);
+    return status;
+}
@@ -0,0 +1,195 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 1991 - 2010
+
+Module Name:
+
+    pktcache.h
+
+Abstract:
+
+    The free transfer packet lists of the nodes and the processor caches in
+    front of them, and the parts of xferpkt.c that move packets between a
+    cache and its node's list.  These work on a cache whose lock the caller
+    holds and touch the node list with interlocked operations only, so the
+    free list benchmark in ..\test builds this file as it is.
+
+Environment:
+
+    kernel mode only
+
+Notes:
+
+
+Revision History:
+
+--*/
+
+#pragma once
+
+typedef struct _PNL_SLIST_HEADER {
+    DECLSPEC_CACHEALIGN SLIST_HEADER SListHeader;
+    DECLSPEC_CACHEALIGN ULONG NumFreeTransferPackets;
+
+    /*
+     *  Free packets of this node held in processor caches.  Free packets
+     *  are the ones on SListHeader plus these.
+     */
+    ULONG NumCachedTransferPackets;
+    ULONG NumTotalTransferPackets;
+    ULONG DbgPeakNumTransferPackets;
+
+    /*
+     *  Working set tracking, only updated off the fast path.
+     *  PeakTransferPacketsInUse is the largest number of packets seen
+     *  outside the free list during the current interval.
+     */
+    ULONG PeakTransferPacketsInUse;
+    ULONG WorkingSetTransferPackets;
+    ULONGLONG WorkingSetUpdateTime;
+} PNL_SLIST_HEADER, *PPNL_SLIST_HEADER;
+
+typedef struct _PNL_PROCESSOR_CACHE {
+    DECLSPEC_CACHEALIGN KSPIN_LOCK SpinLock;
+    ULONG Node;
+    ULONG NumCachedTransferPackets;
+    PTRANSFER_PACKET Packets[TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH];
+
+    /*
+     *  Contention counters, protected by SpinLock.
+     *  CacheHits       - dequeues satisfied from the cache.
+     *  Refills         - dequeues that had to go to the node list.
+     *  Spills          - enqueues that overflowed to the node list.
+     *  Steals          - packets taken from this cache by other processors.
+     *  LockContention  - times SpinLock was found already held.
+     */
+    ULONG CacheHits;
+    ULONG Refills;
+    ULONG Spills;
+    ULONG Steals;
+    ULONG LockContention;
+} PNL_PROCESSOR_CACHE, *PPNL_PROCESSOR_CACHE;
+
+
+/*
+ *  ClasspCacheDequeuePacket
+ *
+ *      Take a free packet from a processor cache.  If the cache is empty, half
+ *      of it is first refilled from the node's free list, and NumRefilled is set
+ *      to the number of packets taken from that list.
+ *      Returns NULL if the cache and the node list are both empty.
+ *      The caller holds the cache lock.
+ */
+__inline PTRANSFER_PACKET ClasspCacheDequeuePacket(
+    _Inout_ PPNL_PROCESSOR_CACHE Cache,
+    _Inout_ PPNL_SLIST_HEADER FreeList,
+    _Out_ PULONG NumRefilled)
+{
+    PTRANSFER_PACKET pkt = NULL;
+    PSLIST_ENTRY slistEntry;
+    ULONG numRefilled = 0;
+    LONG cachedDelta;
+
+    if (Cache->NumCachedTransferPackets > 0) {
+        Cache->CacheHits++;
+    } else {
+        while (numRefilled < TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2) {
+            slistEntry = InterlockedPopEntrySList(&FreeList->SListHeader);
+            if (slistEntry == NULL) {
+                break;
+            }
+            slistEntry->Next = NULL;
+            Cache->Packets[Cache->NumCachedTransferPackets++] = CONTAINING_RECORD(slistEntry, TRANSFER_PACKET, SlistEntry);
+            numRefilled++;
+        }
+
+        if (numRefilled > 0) {
+            InterlockedAdd((volatile LONG *)&FreeList->NumFreeTransferPackets, -(LONG)numRefilled);
+            Cache->Refills++;
+        }
+    }
+
+    if (Cache->NumCachedTransferPackets > 0) {
+        pkt = Cache->Packets[--Cache->NumCachedTransferPackets];
+        Cache->Packets[Cache->NumCachedTransferPackets] = NULL;
+    }
+
+    /*
+     *  The refilled packets moved into the cache and the returned one
+     *  out of it; account for both at once.
+     */
+    cachedDelta = (LONG)numRefilled - ((pkt != NULL) ? 1 : 0);
+    if (cachedDelta != 0) {
+        InterlockedAdd((volatile LONG *)&FreeList->NumCachedTransferPackets, cachedDelta);
+    }
+
+    *NumRefilled = numRefilled;
+
+    return pkt;
+}
+
+
+/*
+ *  ClasspCacheEnqueuePacket
+ *
+ *      Put a free packet of the cache's node in a processor cache.  If the cache
+ *      is full, the older half of it is first spilled to the node's free list,
+ *      keeping the most recently used packets.
+ *      Returns TRUE if the cache spilled.
+ *      The caller holds the cache lock.
+ */
+__inline BOOLEAN ClasspCacheEnqueuePacket(
+    _Inout_ PPNL_PROCESSOR_CACHE Cache,
+    _Inout_ PPNL_SLIST_HEADER FreeList,
+    _In_ PTRANSFER_PACKET Pkt)
+{
+    ULONG index;
+    LONG cachedDelta = 1;
+    BOOLEAN spilled = FALSE;
+
+    if (Cache->NumCachedTransferPackets == TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH) {
+
+        for (index = 0; index < TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2; index++) {
+            InterlockedPushEntrySList(&FreeList->SListHeader, &Cache->Packets[index]->SlistEntry);
+        }
+        InterlockedAdd((volatile LONG *)&FreeList->NumFreeTransferPackets, TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2);
+
+        RtlMoveMemory(&Cache->Packets[0],
+                      &Cache->Packets[TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2],
+                      (TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2) * sizeof(PTRANSFER_PACKET));
+        Cache->NumCachedTransferPackets = TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2;
+        Cache->Spills++;
+        cachedDelta -= TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH / 2;
+        spilled = TRUE;
+    }
+
+    Cache->Packets[Cache->NumCachedTransferPackets++] = Pkt;
+    InterlockedAdd((volatile LONG *)&FreeList->NumCachedTransferPackets, cachedDelta);
+
+    return spilled;
+}
+
+
+/*
+ *  ClasspCacheStealPacket
+ *
+ *      Take a free packet of the given node from another processor's cache.
+ *      Returns NULL if the cache holds none.
+ *      The caller holds the cache lock.
+ */
+__inline PTRANSFER_PACKET ClasspCacheStealPacket(
+    _Inout_ PPNL_PROCESSOR_CACHE Cache,
+    _Inout_ PPNL_SLIST_HEADER FreeList,
+    _In_ ULONG Node)
+{
+    PTRANSFER_PACKET pkt = NULL;
+
+    if ((Cache->Node == Node) && (Cache->NumCachedTransferPackets > 0)) {
+        pkt = Cache->Packets[--Cache->NumCachedTransferPackets];
+        Cache->Packets[Cache->NumCachedTransferPackets] = NULL;
+        InterlockedDecrement((volatile LONG *)&FreeList->NumCachedTransferPackets);
+        Cache->Steals++;
+    }
+
+    return pkt;
+}
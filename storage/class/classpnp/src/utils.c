@@ -5452,6 +5452,7 @@ Arguments:
 
 --*/
 {
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = (PIO_WORKITEM)Context;
 
     if (NT_SUCCESS(ClasspLogSystemEventWithDeviceNumber(DeviceObject, IO_ERROR_DISK_RESOURCES_EXHAUSTED))) {
@@ -5467,6 +5468,10 @@ Arguments:
                     DeviceObject));
     }
 
+    //
+    // Clear the pending flag so that another event can be queued.
+    //
+    InterlockedExchange(&fdoExtension->PrivateFdoData->ResourceExhaustionEventPending, 0);
 
     ClassReleaseRemoveLock(DeviceObject, (PIRP)workItem);
 
@@ -5550,9 +5555,11 @@ Arguments:
 --*/
 {
     PCOMMON_DEVICE_EXTENSION commonExtension = (PCOMMON_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = NULL;
 
-    if (commonExtension->IsFdo)
+    if (commonExtension->IsFdo &&
+        InterlockedCompareExchange(&fdoExtension->PrivateFdoData->ResourceExhaustionEventPending, 1, 0) == 0)
     {
         workItem = IoAllocateWorkItem(DeviceObject);
 
@@ -5574,6 +5581,12 @@ Arguments:
         }
         else
         {
+            //
+            // Clear the pending flag since this is normally done when the
+            // work item completes.
+            //
+            InterlockedExchange(&fdoExtension->PrivateFdoData->ResourceExhaustionEventPending, 0);
+
             TracePrint((TRACE_LEVEL_ERROR,
                         TRACE_FLAG_GENERAL,
                         "ClassQueueResourceExhaustionEventWorker: DO (%p), Failed to allocate memory for the work item.\n",
@@ -5602,6 +5615,7 @@ Arguments:
 --*/
 {
     NTSTATUS     status;
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = (PIO_WORKITEM)Context;
 
     status = ClasspLogSystemEventWithDeviceNumber(DeviceObject, IO_WARNING_DISK_CAPACITY_CHANGED);
@@ -5619,6 +5633,13 @@ Arguments:
                     DeviceObject));
     }
 
+    //
+    // Clear the pending flag before reading the capacity, so that a change
+    // reported after this point queues another work item instead of being
+    // lost.
+    //
+    InterlockedExchange(&fdoExtension->PrivateFdoData->CapacityChangedEventPending, 0);
+
     //
     // Get disk capacity and notify upper layer if capacity is changed.
     //
@@ -5656,9 +5677,11 @@ Arguments:
 --*/
 {
     PCOMMON_DEVICE_EXTENSION commonExtension = (PCOMMON_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = NULL;
 
-    if (commonExtension->IsFdo)
+    if (commonExtension->IsFdo &&
+        InterlockedCompareExchange(&fdoExtension->PrivateFdoData->CapacityChangedEventPending, 1, 0) == 0)
     {
         workItem = IoAllocateWorkItem(DeviceObject);
 
@@ -5680,6 +5703,12 @@ Arguments:
         }
         else
         {
+            //
+            // Clear the pending flag since this is normally done when the
+            // work item runs.
+            //
+            InterlockedExchange(&fdoExtension->PrivateFdoData->CapacityChangedEventPending, 0);
+
             TracePrint((TRACE_LEVEL_ERROR,
                         TRACE_FLAG_GENERAL,
                         "ClassQueueCapacityChangedEventWorker: DO (%p), Failed to allocate memory for the work item.\n",
@@ -5707,6 +5736,7 @@ Arguments:
 
 --*/
 {
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = (PIO_WORKITEM)Context;
 
     if (NT_SUCCESS(ClasspLogSystemEventWithDeviceNumber(DeviceObject, IO_WARNING_DISK_PROVISIONING_TYPE_CHANGED))) {
@@ -5722,6 +5752,11 @@ Arguments:
                     DeviceObject));
     }
 
+    //
+    // Clear the pending flag so that another event can be queued.
+    //
+    InterlockedExchange(&fdoExtension->PrivateFdoData->ProvisioningTypeChangedEventPending, 0);
+
     ClassReleaseRemoveLock(DeviceObject, (PIRP)workItem);
 
     IoFreeWorkItem(workItem);
@@ -5744,9 +5779,11 @@ Arguments:
 --*/
 {
     PCOMMON_DEVICE_EXTENSION commonExtension = (PCOMMON_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension = (PFUNCTIONAL_DEVICE_EXTENSION)(DeviceObject->DeviceExtension);
     PIO_WORKITEM workItem = NULL;
 
-    if (commonExtension->IsFdo)
+    if (commonExtension->IsFdo &&
+        InterlockedCompareExchange(&fdoExtension->PrivateFdoData->ProvisioningTypeChangedEventPending, 1, 0) == 0)
     {
         workItem = IoAllocateWorkItem(DeviceObject);
 
@@ -5768,6 +5805,12 @@ Arguments:
         }
         else
         {
+            //
+            // Clear the pending flag since this is normally done when the
+            // work item completes.
+            //
+            InterlockedExchange(&fdoExtension->PrivateFdoData->ProvisioningTypeChangedEventPending, 0);
+
             TracePrint((TRACE_LEVEL_ERROR,
                         TRACE_FLAG_GENERAL,
                         "ClassQueueProvisioningTypeChangedEventWorker: DO (%p), Failed to allocate memory for the work item.\n",
@@ -5999,6 +6042,8 @@ Arguments:
                     DeviceObject));
     }
 
+    InterlockedDecrement(&fdoExtension->PrivateFdoData->NumIoEventLogWorkItems);
+
     ClassReleaseRemoveLock(DeviceObject, (PIRP)workItem);
 
     if (ioLogMessageContextHeader->SenseData) {
@@ -6060,6 +6105,22 @@ Arguments:
         return;
     }
 
+    //
+    // Limit the number of queued work items, so that a device failing
+    // every IO with the same sense data doesn't queue one per IO.
+    //
+    if (InterlockedIncrement(&fdoExtension->PrivateFdoData->NumIoEventLogWorkItems) > MAX_IO_EVENT_LOG_WORK_ITEMS) {
+
+        InterlockedDecrement(&fdoExtension->PrivateFdoData->NumIoEventLogWorkItems);
+
+        TracePrint((TRACE_LEVEL_WARNING,
+                    TRACE_FLAG_GENERAL,
+                    "ClasspQueueLogIOEventWithContextWorker: DO (%p), Pkt (%p), Too many queued log messages, not logging.\n",
+                    DeviceObject,
+                    Pkt));
+        return;
+    }
+
     workItem = IoAllocateWorkItem(DeviceObject);
     if (!workItem) {
         goto __ClasspQueueLogIOEventWithContextWorker_ExitWithMessage;
@@ -6147,6 +6208,8 @@ __ClasspQueueLogIOEventWithContextWorker_ExitWithMessage:
                 DeviceObject));
 
 __ClasspQueueLogIOEventWithContextWorker_Exit:
+    InterlockedDecrement(&fdoExtension->PrivateFdoData->NumIoEventLogWorkItems);
+
     if (senseData) {
         ExFreePool(senseData);
     }
@@ -35,6 +35,8 @@ Revision History:
     #pragma alloc_text(PAGE, SetupModeSenseTransferPacket)
     #pragma alloc_text(PAGE, CleanupTransferPacketToWorkingSetSizeWorker)
     #pragma alloc_text(PAGE, ClasspSetupPopulateTokenTransferPacket)
+    #pragma alloc_text(PAGE, ClasspInitializeWriteMerge)
+    #pragma alloc_text(PAGE, ClasspCleanupWriteMerge)
 #endif
 
 /*
@@ -92,6 +94,25 @@ NTSTATUS InitializeTransferPackets(PDEVICE_OBJECT Fdo)
         fdoData->FreeTransferPacketsLists[index].NumFreeTransferPackets = 0;
     }
 
+    //
+    // Allocate per-processor packet caches
+    //
+    arraySize = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    fdoData->TransferPacketCaches =
+        ExAllocatePoolZero(NonPagedPoolNxCacheAligned,
+                           sizeof(PNL_PROCESSOR_CACHE) * arraySize,
+                           CLASS_TAG_PRIVATE_DATA);
+
+    if (fdoData->TransferPacketCaches == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        return status;
+    }
+
+    for (index = 0; index < arraySize; index++) {
+        KeInitializeSpinLock(&fdoData->TransferPacketCaches[index].SpinLock);
+    }
+    fdoData->NumTransferPacketCaches = arraySize;
+
     InitializeListHead(&fdoData->AllTransferPacketsList);
 
     //
@@ -203,8 +224,21 @@ NTSTATUS InitializeTransferPackets(PDEVICE_OBJECT Fdo)
         // that's all the adjustments required/allowed
     } // end working set size special code
 
+    //
+    // Start each node at the upper bound; the working set is then sized
+    // from the number of packets actually in use.
+    //
+    arraySize = KeQueryHighestNodeNumber() + 1;
+    for (index = 0; index < arraySize; index++) {
+        fdoData->FreeTransferPacketsLists[index].WorkingSetTransferPackets = fdoData->LocalMaxWorkingSetTransferPackets;
+    }
+
     for (index = 0; index < arraySize; index++) {
-        while (fdoData->FreeTransferPacketsLists[index].NumFreeTransferPackets < MIN_INITIAL_TRANSFER_PACKETS){
+        //
+        // Count total rather than free packets; those of the current node
+        // may land in this processor's cache instead of the free list.
+        //
+        while (fdoData->FreeTransferPacketsLists[index].NumTotalTransferPackets < MIN_INITIAL_TRANSFER_PACKETS){
             PTRANSFER_PACKET pkt = NewTransferPacket(Fdo);
             if (pkt) {
                 InterlockedIncrement((volatile LONG *)&(fdoData->FreeTransferPacketsLists[index].NumTotalTransferPackets));
@@ -304,6 +338,11 @@ VOID DestroyAllTransferPackets(PDEVICE_OBJECT Fdo)
 
         NT_ASSERT(IsListEmpty(&fdoData->DeferredClientIrpList));
 
+        //
+        // Return the packets held in processor caches to their node lists.
+        //
+        ClasspFlushTransferPacketCaches(fdoData);
+
         arraySize = KeQueryHighestNodeNumber() + 1;
         for (index = 0; index < arraySize; index++) {
             pkt = DequeueFreeTransferPacketEx(Fdo, FALSE, index);
@@ -533,34 +572,54 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, __drv_aliasesMem PTRANSFER_PA
 {
     PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
     PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PPNL_SLIST_HEADER freeList;
     ULONG allocateNode;
+    ULONG upperWorkingSet;
+    BOOLEAN spilled;
     KIRQL oldIrql;
 
     NT_ASSERT(!Pkt->SlistEntry.Next);
 
     allocateNode = Pkt->AllocateNode;
-    InterlockedPushEntrySList(&(fdoData->FreeTransferPacketsLists[allocateNode].SListHeader), &Pkt->SlistEntry);
-    InterlockedIncrement((volatile LONG *)&(fdoData->FreeTransferPacketsLists[allocateNode].NumFreeTransferPackets));
+    freeList = &fdoData->FreeTransferPacketsLists[allocateNode];
 
     /*
-     *  If the total number of packets is larger than LocalMinWorkingSetTransferPackets,
+     *  Keep the packet in this processor's cache if it belongs to this
+     *  processor's node.  Only when the cache overflows into the node
+     *  list is there anything to trim.
+     */
+    if (ClasspCacheFreeTransferPacket(fdoData, Pkt, &spilled)) {
+        if (!spilled) {
+            return;
+        }
+    } else {
+        InterlockedPushEntrySList(&freeList->SListHeader, &Pkt->SlistEntry);
+        InterlockedIncrement((volatile LONG *)&freeList->NumFreeTransferPackets);
+    }
+
+    ClasspUpdateTransferPacketWorkingSet(fdoData, allocateNode);
+    upperWorkingSet = min(fdoData->LocalMaxWorkingSetTransferPackets, 2 * freeList->WorkingSetTransferPackets);
+
+    /*
+     *  If the total number of packets is larger than the node's working set,
      *  that means that we've been in stress.  If all those packets are now
-     *  free, then we are now out of stress and can free the extra packets.
-     *  Attempt to free down to LocalMaxWorkingSetTransferPackets immediately, and
-     *  down to LocalMinWorkingSetTransferPackets lazily (one at a time).
+     *  free (in the node list or in processor caches), then we are now out of
+     *  stress and can free the extra packets.
+     *  Attempt to free down to twice the working set immediately, and
+     *  down to the working set lazily (one at a time).
      *  However, since we're at DPC, do this is a work item. If the device is removed
      *  or we are unable to allocate the work item, do NOT free more than
      *  MAX_CLEANUP_TRANSFER_PACKETS_AT_ONCE. Subsequent IO completions will end up freeing
      *  up the rest, even if it is MAX_CLEANUP_TRANSFER_PACKETS_AT_ONCE at a time.
      */
-    if (fdoData->FreeTransferPacketsLists[allocateNode].NumFreeTransferPackets >=
-        fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets) {
+    if ((freeList->NumTotalTransferPackets > freeList->WorkingSetTransferPackets) &&
+        (freeList->NumFreeTransferPackets + freeList->NumCachedTransferPackets >=
+         freeList->NumTotalTransferPackets)) {
 
         /*
          *  1.  Immediately snap down to our UPPER threshold.
          */
-        if (fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets >
-            fdoData->LocalMaxWorkingSetTransferPackets) {
+        if (freeList->NumTotalTransferPackets > upperWorkingSet) {
 
             ULONG isRemoved;
             PIO_WORKITEM workItem = NULL;
@@ -609,8 +668,7 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, __drv_aliasesMem PTRANSFER_PA
         /*
          *  2.  Lazily work down to our LOWER threshold (by only freeing one packet at a time).
          */
-        if (fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets >
-            fdoData->LocalMinWorkingSetTransferPackets){
+        if (freeList->NumTotalTransferPackets > freeList->WorkingSetTransferPackets){
             /*
              *  Check the counter again with lock held.  This eliminates a race condition
              *  while still allowing us to not grab the spinlock in the common codepath.
@@ -623,26 +681,22 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, __drv_aliasesMem PTRANSFER_PA
             PTRANSFER_PACKET pktToDelete = NULL;
 
             TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_RW, "Exiting stress, lazily freeing one of %d/%d packets from node %d.",
-                fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets,
-                fdoData->LocalMinWorkingSetTransferPackets,
+                freeList->NumTotalTransferPackets,
+                freeList->WorkingSetTransferPackets,
                 allocateNode));
 
             KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
-            if ((fdoData->FreeTransferPacketsLists[allocateNode].NumFreeTransferPackets >=
-                fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets) &&
-                (fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets >
-                fdoData->LocalMinWorkingSetTransferPackets)){
+            if ((freeList->NumFreeTransferPackets + freeList->NumCachedTransferPackets >=
+                freeList->NumTotalTransferPackets) &&
+                (freeList->NumTotalTransferPackets > freeList->WorkingSetTransferPackets)){
 
+                /*
+                 *  The free packets may all be sitting in processor caches,
+                 *  in which case there is nothing we can free here.
+                 */
                 pktToDelete = DequeueFreeTransferPacketEx(Fdo, FALSE, allocateNode);
                 if (pktToDelete) {
-                    InterlockedDecrement((volatile LONG *)&(fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets));
-                } else {
-                    TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_RW,
-                        "Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (2). Node=%d",
-                        fdoData->LocalMinWorkingSetTransferPackets,
-                        Fdo,
-                        fdoData->FreeTransferPacketsLists[allocateNode].NumTotalTransferPackets,
-                        allocateNode));
+                    InterlockedDecrement((volatile LONG *)&freeList->NumTotalTransferPackets);
                 }
             }
             KeReleaseSpinLock(&fdoData->SpinLock, oldIrql);
@@ -658,7 +712,20 @@ VOID EnqueueFreeTransferPacket(PDEVICE_OBJECT Fdo, __drv_aliasesMem PTRANSFER_PA
 
 PTRANSFER_PACKET DequeueFreeTransferPacket(PDEVICE_OBJECT Fdo, BOOLEAN AllocIfNeeded)
 {
-    return DequeueFreeTransferPacketEx(Fdo, AllocIfNeeded, KeGetCurrentNodeNumber());
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PTRANSFER_PACKET pkt;
+    ULONG node;
+
+    pkt = ClasspDequeueCachedTransferPacket(fdoData, &node);
+
+    if (pkt) {
+        // when dequeuing the packet, also reset the history data
+        HISTORYINITIALIZERETRYLOGS(pkt);
+        return pkt;
+    }
+
+    return DequeueFreeTransferPacketEx(Fdo, AllocIfNeeded, node);
 }
 
 PTRANSFER_PACKET DequeueFreeTransferPacketEx(
@@ -695,6 +762,7 @@ PTRANSFER_PACKET DequeueFreeTransferPacketEx(
                 fdoData->FreeTransferPacketsLists[Node].DbgPeakNumTransferPackets =
                     max(fdoData->FreeTransferPacketsLists[Node].DbgPeakNumTransferPackets,
                         fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets);
+                ClasspSampleTransferPacketsInUse(&fdoData->FreeTransferPacketsLists[Node]);
             } else {
                 TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_RW, "DequeueFreeTransferPacket: packet allocation failed"));
             }
@@ -707,6 +775,260 @@ PTRANSFER_PACKET DequeueFreeTransferPacketEx(
 }
 
 
+/*
+ *  ClasspDequeueCachedTransferPacket
+ *
+ *      Take a free packet from the current processor's cache.  If the cache is
+ *      empty, refill half of it from the node's free list; if that is empty too,
+ *      steal a packet from another processor of the same node.
+ *      Returns NULL if none was found, with Node set to the current node so that
+ *      the caller can allocate a packet for it.
+ */
+PTRANSFER_PACKET ClasspDequeueCachedTransferPacket(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+    _Out_ PULONG Node)
+{
+    PPNL_PROCESSOR_CACHE cache;
+    PPNL_SLIST_HEADER freeList;
+    PTRANSFER_PACKET pkt = NULL;
+    ULONG processorIndex;
+    ULONG numRefilled;
+    KIRQL oldIrql;
+
+    /*
+     *  Raise to DISPATCH_LEVEL so that we stay on the processor whose cache we use;
+     *  the lock is only contended by processors stealing from or flushing the cache.
+     */
+    oldIrql = KeRaiseIrqlToDpcLevel();
+
+    *Node = KeGetCurrentNodeNumber();
+    processorIndex = KeGetCurrentProcessorIndex();
+
+    if (processorIndex < FdoData->NumTransferPacketCaches) {
+
+        cache = &FdoData->TransferPacketCaches[processorIndex];
+        freeList = &FdoData->FreeTransferPacketsLists[*Node];
+
+        if (!KeTryToAcquireSpinLockAtDpcLevel(&cache->SpinLock)) {
+            KeAcquireSpinLockAtDpcLevel(&cache->SpinLock);
+            cache->LockContention++;
+        }
+
+        cache->Node = *Node;
+
+        pkt = ClasspCacheDequeuePacket(cache, freeList, &numRefilled);
+
+        if (numRefilled > 0) {
+            ClasspSampleTransferPacketsInUse(freeList);
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&cache->SpinLock);
+
+        if (pkt == NULL) {
+            pkt = ClasspStealTransferPacket(FdoData, *Node, processorIndex);
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return pkt;
+}
+
+
+/*
+ *  ClasspCacheFreeTransferPacket
+ *
+ *      Put a free packet in the current processor's cache.  Returns FALSE if the
+ *      packet belongs to another node, in which case the caller must put it on
+ *      that node's free list.  If the cache was full, half of it is first spilled
+ *      to the node list and Spilled is set.
+ */
+BOOLEAN ClasspCacheFreeTransferPacket(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+    _In_ PTRANSFER_PACKET Pkt,
+    _Out_ PBOOLEAN Spilled)
+{
+    PPNL_PROCESSOR_CACHE cache;
+    PPNL_SLIST_HEADER freeList;
+    ULONG processorIndex;
+    ULONG node;
+    BOOLEAN cached = FALSE;
+    KIRQL oldIrql;
+
+    *Spilled = FALSE;
+
+    oldIrql = KeRaiseIrqlToDpcLevel();
+
+    node = KeGetCurrentNodeNumber();
+    processorIndex = KeGetCurrentProcessorIndex();
+
+    if ((Pkt->AllocateNode == node) &&
+        (processorIndex < FdoData->NumTransferPacketCaches)) {
+
+        cache = &FdoData->TransferPacketCaches[processorIndex];
+        freeList = &FdoData->FreeTransferPacketsLists[node];
+
+        if (!KeTryToAcquireSpinLockAtDpcLevel(&cache->SpinLock)) {
+            KeAcquireSpinLockAtDpcLevel(&cache->SpinLock);
+            cache->LockContention++;
+        }
+
+        cache->Node = node;
+
+        *Spilled = ClasspCacheEnqueuePacket(cache, freeList, Pkt);
+        cached = TRUE;
+
+        KeReleaseSpinLockFromDpcLevel(&cache->SpinLock);
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return cached;
+}
+
+
+/*
+ *  ClasspStealTransferPacket
+ *
+ *      Take a free packet of the given node from another processor's cache.
+ *      Caches whose lock is held are skipped rather than waited on.
+ *      Must be called at DISPATCH_LEVEL.
+ */
+PTRANSFER_PACKET ClasspStealTransferPacket(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+    _In_ ULONG Node,
+    _In_ ULONG ThiefIndex)
+{
+    PPNL_PROCESSOR_CACHE cache;
+    PTRANSFER_PACKET pkt = NULL;
+    ULONG index;
+
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    for (index = 1; (index < FdoData->NumTransferPacketCaches) && (pkt == NULL); index++) {
+
+        cache = &FdoData->TransferPacketCaches[(ThiefIndex + index) % FdoData->NumTransferPacketCaches];
+
+        /*
+         *  Unsynchronized peek first, to avoid taking the lock of every idle cache.
+         */
+        if ((cache->Node != Node) || (cache->NumCachedTransferPackets == 0)) {
+            continue;
+        }
+
+        if (!KeTryToAcquireSpinLockAtDpcLevel(&cache->SpinLock)) {
+            continue;
+        }
+
+        pkt = ClasspCacheStealPacket(cache, &FdoData->FreeTransferPacketsLists[Node], Node);
+
+        KeReleaseSpinLockFromDpcLevel(&cache->SpinLock);
+    }
+
+    return pkt;
+}
+
+
+/*
+ *  ClasspFlushTransferPacketCaches
+ *
+ *      Return every packet held in a processor cache to its node's free list.
+ */
+VOID ClasspFlushTransferPacketCaches(_In_ PCLASS_PRIVATE_FDO_DATA FdoData)
+{
+    PPNL_PROCESSOR_CACHE cache;
+    PTRANSFER_PACKET pkt;
+    ULONG index;
+    ULONG cacheHits = 0;
+    ULONG refills = 0;
+    ULONG spills = 0;
+    ULONG steals = 0;
+    ULONG lockContention = 0;
+    KIRQL oldIrql;
+
+    if (FdoData->TransferPacketCaches == NULL) {
+        return;
+    }
+
+    for (index = 0; index < FdoData->NumTransferPacketCaches; index++) {
+
+        cache = &FdoData->TransferPacketCaches[index];
+
+        KeAcquireSpinLock(&cache->SpinLock, &oldIrql);
+
+        while (cache->NumCachedTransferPackets > 0) {
+            pkt = cache->Packets[--cache->NumCachedTransferPackets];
+            cache->Packets[cache->NumCachedTransferPackets] = NULL;
+            InterlockedPushEntrySList(&FdoData->FreeTransferPacketsLists[pkt->AllocateNode].SListHeader, &pkt->SlistEntry);
+            InterlockedIncrement((volatile LONG *)&FdoData->FreeTransferPacketsLists[pkt->AllocateNode].NumFreeTransferPackets);
+            InterlockedDecrement((volatile LONG *)&FdoData->FreeTransferPacketsLists[pkt->AllocateNode].NumCachedTransferPackets);
+        }
+
+        cacheHits += cache->CacheHits;
+        refills += cache->Refills;
+        spills += cache->Spills;
+        steals += cache->Steals;
+        lockContention += cache->LockContention;
+
+        KeReleaseSpinLock(&cache->SpinLock, oldIrql);
+    }
+
+    TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_GENERAL,
+                "ClasspFlushTransferPacketCaches: cache hits %u, refills %u, spills %u, steals %u, lock contention %u.",
+                cacheHits, refills, spills, steals, lockContention));
+}
+
+
+/*
+ *  ClasspUpdateTransferPacketWorkingSet
+ *
+ *      Once every TRANSFER_PACKET_WORKINGSET_INTERVAL, set the working set of a node
+ *      to the peak number of packets in use during the last interval, plus a quarter
+ *      for headroom, within LocalMinWorkingSetTransferPackets and
+ *      LocalMaxWorkingSetTransferPackets.
+ */
+VOID ClasspUpdateTransferPacketWorkingSet(
+    _In_ PCLASS_PRIVATE_FDO_DATA FdoData,
+    _In_ ULONG Node)
+{
+    PPNL_SLIST_HEADER freeList = &FdoData->FreeTransferPacketsLists[Node];
+    ULONGLONG currentTime = KeQueryInterruptTime();
+    ULONGLONG lastUpdateTime = freeList->WorkingSetUpdateTime;
+    ULONG workingSet;
+
+    if (currentTime - lastUpdateTime < TRANSFER_PACKET_WORKINGSET_INTERVAL) {
+        return;
+    }
+
+    /*
+     *  Let only one thread do the update.
+     */
+    if ((ULONGLONG)InterlockedCompareExchange64((volatile LONG64 *)&freeList->WorkingSetUpdateTime,
+                                                (LONG64)currentTime,
+                                                (LONG64)lastUpdateTime) != lastUpdateTime) {
+        return;
+    }
+
+    workingSet = freeList->PeakTransferPacketsInUse + freeList->PeakTransferPacketsInUse / 4;
+    workingSet = max(workingSet, FdoData->LocalMinWorkingSetTransferPackets);
+    workingSet = min(workingSet, FdoData->LocalMaxWorkingSetTransferPackets);
+
+    if (workingSet != freeList->WorkingSetTransferPackets) {
+        TracePrint((TRACE_LEVEL_VERBOSE, TRACE_FLAG_GENERAL,
+                    "ClasspUpdateTransferPacketWorkingSet: node %u working set %u -> %u (peak in use %u).",
+                    Node, freeList->WorkingSetTransferPackets, workingSet, freeList->PeakTransferPacketsInUse));
+    }
+
+    freeList->WorkingSetTransferPackets = workingSet;
+
+    /*
+     *  Start the next interval from what is in use now.
+     */
+    freeList->PeakTransferPacketsInUse = 0;
+    ClasspSampleTransferPacketsInUse(freeList);
+}
+
+
 
 /*
  *  SetupReadWriteTransferPacket
@@ -905,6 +1227,8 @@ NTSTATUS SubmitTransferPacket(PTRANSFER_PACKET Pkt)
     DBGLOGSENDPACKET(Pkt);
     HISTORYLOGSENDPACKET(Pkt);
 
+    Pkt->RequestStartTime = ClasspGetCurrentTime().QuadPart;
+
     //
     // Set the original irp here for SFIO.
     //
@@ -951,6 +1275,8 @@ NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Co
 
     completionTime = ClasspGetCurrentTime();
 
+    HISTORYLOGLATENCY(fdoData, pkt->Srb, pkt->RequestStartTime, (ULONGLONG)completionTime.QuadPart);
+
     //
     // Record the time at which the last IO completed while snapping the old
     // value to be used later. This can occur on multiple threads and hence
@@ -976,6 +1302,9 @@ NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Co
             fdoData->LastNonIdleIoTime = completionTime;
             InterlockedDecrement(&fdoData->ActiveIoCount);
             NT_ASSERT(fdoData->ActiveIoCount >= 0);
+            if ((ULONGLONG)completionTime.QuadPart > pkt->RequestStartTime) {
+                ClasspRecordForegroundLatency(fdoData, (ULONGLONG)completionTime.QuadPart - pkt->RequestStartTime);
+            }
         }
     }
 
@@ -1294,6 +1623,12 @@ NTSTATUS TransferPktComplete(IN PDEVICE_OBJECT NullFdo, IN PIRP Irp, IN PVOID Co
             ServiceTransferRequest(Fdo, deferredIrp, TRUE);
         }
 
+        /*
+         *  Writes held for merging wait for the outstanding transfers;
+         *  if this was the last one, send them now.
+         */
+        ClasspFlushWriteMergeIfIdle(Fdo);
+
         ClassReleaseRemoveLock(Fdo, (PVOID)&uniqueAddr);
     }
 
@@ -1629,8 +1964,11 @@ Arguments:
     SINGLE_LIST_ENTRY pktList;
     PSINGLE_LIST_ENTRY slistEntry;
     PTRANSFER_PACKET pktToDelete;
+    ULONG upperWorkingSet = min(fdoData->LocalMaxWorkingSetTransferPackets,
+                                2 * fdoData->FreeTransferPacketsLists[Node].WorkingSetTransferPackets);
+    ULONG numCachedPkts = fdoData->FreeTransferPacketsLists[Node].NumCachedTransferPackets;
     ULONG requiredNumPktToDelete = fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets -
-                                   fdoData->LocalMaxWorkingSetTransferPackets;
+                                   upperWorkingSet;
 
     if (LimitNumPktToDelete) {
         requiredNumPktToDelete = MIN(requiredNumPktToDelete, MAX_CLEANUP_TRANSFER_PACKETS_AT_ONCE);
@@ -1649,8 +1987,8 @@ Arguments:
      */
     SimpleInitSlistHdr(&pktList);
     KeAcquireSpinLock(&fdoData->SpinLock, &oldIrql);
-    while ((fdoData->FreeTransferPacketsLists[Node].NumFreeTransferPackets >= fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets) &&
-           (fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets > fdoData->LocalMaxWorkingSetTransferPackets) &&
+    while ((fdoData->FreeTransferPacketsLists[Node].NumFreeTransferPackets + numCachedPkts >= fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets) &&
+           (fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets > upperWorkingSet) &&
            (requiredNumPktToDelete--)){
 
         pktToDelete = DequeueFreeTransferPacketEx(Fdo, FALSE, Node);
@@ -1661,7 +1999,7 @@ Arguments:
         } else {
             TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_RW,
                 "Extremely unlikely condition (non-fatal): %d packets dequeued at once for Fdo %p. NumTotalTransferPackets=%d (1). Node=%d",
-                fdoData->LocalMaxWorkingSetTransferPackets,
+                upperWorkingSet,
                 Fdo,
                 fdoData->FreeTransferPacketsLists[Node].NumTotalTransferPackets,
                 Node));
@@ -2077,3 +2415,624 @@ Return Value:
 }
 
 
+
+
+/*
+ *  ClasspInitializeWriteMerge
+ *
+ *      Read the write merge settings from the registry and initialize the
+ *      merge state.  Must be called after InitializeTransferPackets, since
+ *      merged writes are limited to the hardware maximum transfer length.
+ */
+VOID ClasspInitializeWriteMerge(PFUNCTIONAL_DEVICE_EXTENSION FdoExtension)
+{
+    PCLASS_PRIVATE_FDO_DATA fdoData = FdoExtension->PrivateFdoData;
+    ULONG windowInUs = 0;
+    ULONG maxLength = CLASS_WRITE_MERGE_DEFAULT_MAX_LENGTH;
+
+    PAGED_CODE();
+
+    /*
+     *  The device can be started again after a stop; the lock, timer and
+     *  list are only set up the first time.
+     */
+    if (fdoData->WriteMerge.Dpc.DeferredRoutine == NULL) {
+        KeInitializeSpinLock(&fdoData->WriteMerge.Lock);
+        KeInitializeTimer(&fdoData->WriteMerge.Timer);
+        KeInitializeDpc(&fdoData->WriteMerge.Dpc,
+                        ClasspWriteMergeTimerDpc,
+                        FdoExtension->DeviceObject);
+        InitializeListHead(&fdoData->WriteMerge.PendingIrps);
+        fdoData->WriteMerge.NextOffset = -1;
+    }
+
+    ClassGetDeviceParameter(FdoExtension,
+                            CLASSP_REG_SUBKEY_NAME,
+                            CLASSP_REG_WRITE_MERGE_WINDOW,
+                            &windowInUs);
+
+    ClassGetDeviceParameter(FdoExtension,
+                            CLASSP_REG_SUBKEY_NAME,
+                            CLASSP_REG_WRITE_MERGE_MAX_LENGTH,
+                            &maxLength);
+
+    /*
+     *  Merging needs a packet engine that can have several writes outstanding,
+     *  and room for at least two sectors in a transfer.
+     */
+    windowInUs = min(windowInUs, CLASS_WRITE_MERGE_MAX_WINDOW_IN_US);
+    maxLength = min(maxLength, fdoData->HwMaxXferLen);
+    maxLength &= ~(FdoExtension->DiskGeometry.BytesPerSector - 1);
+
+    if ((FdoExtension->CommonExtension.DriverExtension->InitData.ClassStartIo != NULL) ||
+        (FdoExtension->DiskGeometry.BytesPerSector == 0) ||
+        (maxLength < 2 * FdoExtension->DiskGeometry.BytesPerSector)) {
+        windowInUs = 0;
+    }
+
+    fdoData->WriteMerge.WindowIn100ns = (LONGLONG)windowInUs * 10;
+    fdoData->WriteMerge.MaxLength = maxLength;
+
+    if (windowInUs != 0) {
+        TracePrint((TRACE_LEVEL_INFORMATION, TRACE_FLAG_INIT,
+                    "ClasspInitializeWriteMerge (%p): merging writes within %u us, up to %u bytes.",
+                    FdoExtension->DeviceObject, windowInUs, maxLength));
+    }
+}
+
+
+/*
+ *  ClasspCleanupWriteMerge
+ *
+ *      Make sure the merge timer DPC is not running before the private
+ *      data goes away.  All merged writes hold the remove lock, so there
+ *      are no pending writes by then.
+ */
+VOID ClasspCleanupWriteMerge(PCLASS_PRIVATE_FDO_DATA FdoData)
+{
+    PAGED_CODE();
+
+    if (FdoData->WriteMerge.Dpc.DeferredRoutine != NULL) {
+        NT_ASSERT(FdoData->WriteMerge.NumPendingIrps == 0);
+        KeCancelTimer(&FdoData->WriteMerge.Timer);
+        KeFlushQueuedDpcs();
+    }
+}
+
+
+/*
+ *  ClasspIsWriteMergeCandidate
+ *
+ *      Return TRUE if the read/write irp is a write that may be held for merging.
+ *      Paging writes are never held, since Mm throttles them separately.
+ */
+BOOLEAN ClasspIsWriteMergeCandidate(PDEVICE_OBJECT Fdo, PIRP Irp)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PIO_STACK_LOCATION currentSp = IoGetCurrentIrpStackLocation(Irp);
+
+    return ((fdoData->WriteMerge.WindowIn100ns != 0) &&
+            (currentSp->MajorFunction == IRP_MJ_WRITE) &&
+            (currentSp->Parameters.Write.Length != 0) &&
+            (currentSp->Parameters.Write.Length < fdoData->WriteMerge.MaxLength) &&
+            (Irp->MdlAddress != NULL) &&
+            !TEST_FLAG(Irp->Flags, IRP_PAGING_IO | IRP_SYNCHRONOUS_PAGING_IO));
+}
+
+
+/*
+ *  ClasspMergeOrServiceWrite
+ *
+ *      Service a write that is a merge candidate.
+ *      A write that continues the pending writes is added to them; they are
+ *      sent when they reach the maximum merged length, when the window
+ *      expires or when the device has nothing else outstanding.  A write that
+ *      does not continue them causes them to be sent.
+ *      A write that continues the previous candidate write starts a new window
+ *      if the device is busy; any other write is sent right away, so random
+ *      writes and writes to an idle device are not delayed.
+ */
+NTSTATUS ClasspMergeOrServiceWrite(PDEVICE_OBJECT Fdo, PIRP Irp)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PIO_STACK_LOCATION currentSp = IoGetCurrentIrpStackLocation(Irp);
+    LONGLONG offset = currentSp->Parameters.Write.ByteOffset.QuadPart;
+    ULONG length = currentSp->Parameters.Write.Length;
+    LIST_ENTRY batchList;
+    BOOLEAN sequential;
+    BOOLEAN held = FALSE;
+    BOOLEAN cancelled = FALSE;
+    KIRQL oldIrql;
+
+    InitializeListHead(&batchList);
+
+    KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+
+    fdoData->WriteMerge.CandidateWrites++;
+    sequential = (offset == fdoData->WriteMerge.NextOffset);
+    fdoData->WriteMerge.NextOffset = offset + length;
+
+    if (fdoData->WriteMerge.NumPendingIrps > 0) {
+
+        if (sequential &&
+            (offset == fdoData->WriteMerge.PendingOffset + fdoData->WriteMerge.PendingLength) &&
+            (currentSp->Flags == fdoData->WriteMerge.PendingFlags) &&
+            (length <= fdoData->WriteMerge.MaxLength - fdoData->WriteMerge.PendingLength)) {
+
+            if (ClasspQueueWriteForMerge(fdoData, Irp)) {
+                held = TRUE;
+
+                /*
+                 *  Send the writes now if another one could not be added.
+                 */
+                if ((fdoData->WriteMerge.NumPendingIrps < CLASS_WRITE_MERGE_MAX_REQUESTS) &&
+                    (fdoData->WriteMerge.PendingLength < fdoData->WriteMerge.MaxLength)) {
+                    goto Exit;
+                }
+            } else {
+                cancelled = TRUE;
+            }
+        }
+
+        KeCancelTimer(&fdoData->WriteMerge.Timer);
+        ClasspTakeWriteMergePendingIrps(fdoData, &batchList);
+    }
+
+    /*
+     *  Open a window with this write, unless nothing is outstanding on the
+     *  device for the writes to wait behind.  If the last transfer completes
+     *  before the write is queued, the write waits for the window instead.
+     */
+    if (!held && !cancelled && sequential &&
+        (ClasspTransferPacketsInUse(fdoData) > 0)) {
+
+        fdoData->WriteMerge.PendingOffset = offset;
+        fdoData->WriteMerge.PendingFlags = currentSp->Flags;
+
+        if (ClasspQueueWriteForMerge(fdoData, Irp)) {
+            LARGE_INTEGER dueTime;
+
+            held = TRUE;
+
+            dueTime.QuadPart = -fdoData->WriteMerge.WindowIn100ns;
+            KeSetTimer(&fdoData->WriteMerge.Timer, dueTime, &fdoData->WriteMerge.Dpc);
+        } else {
+            cancelled = TRUE;
+        }
+    }
+
+Exit:
+
+    KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+
+    if (!IsListEmpty(&batchList)) {
+        ClasspSubmitWriteMergeBatch(Fdo, &batchList);
+    }
+
+    /*
+     *  A held write was marked pending before it was queued, since another
+     *  thread may send and complete it as soon as the lock is released.
+     */
+    if (held) {
+        return STATUS_PENDING;
+    }
+
+    if (cancelled) {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        ClassReleaseRemoveLock(Fdo, Irp);
+        ClassCompleteRequest(Fdo, Irp, IO_NO_INCREMENT);
+        return STATUS_CANCELLED;
+    }
+
+    return ServiceTransferRequest(Fdo, Irp, FALSE);
+}
+
+
+/*
+ *  ClasspQueueWriteForMerge
+ *
+ *      Add a write to the pending writes and make it cancellable.  Returns
+ *      FALSE if the write was cancelled already, in which case it is not
+ *      queued.  Must be called with the merge lock held.
+ */
+BOOLEAN ClasspQueueWriteForMerge(PCLASS_PRIVATE_FDO_DATA FdoData, PIRP Irp)
+{
+    IoSetCancelRoutine(Irp, ClasspWriteMergeCancel);
+
+    /*
+     *  If the cancel routine was already called, it is waiting for the
+     *  merge lock and completes the write once it finds it queued.
+     */
+    if (Irp->Cancel && (IoSetCancelRoutine(Irp, NULL) != NULL)) {
+        return FALSE;
+    }
+
+    IoMarkIrpPending(Irp);
+    InsertTailList(&FdoData->WriteMerge.PendingIrps, &Irp->Tail.Overlay.ListEntry);
+    FdoData->WriteMerge.NumPendingIrps++;
+    FdoData->WriteMerge.PendingLength += IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length;
+
+    return TRUE;
+}
+
+
+/*
+ *  ClasspTakeWriteMergePendingIrps
+ *
+ *      Move the pending writes to BatchList and close the window.  A write
+ *      whose cancel routine is already running is left to it, unlinked so
+ *      that it knows the write is no longer pending.
+ *      Must be called with the merge lock held.
+ */
+VOID ClasspTakeWriteMergePendingIrps(PCLASS_PRIVATE_FDO_DATA FdoData, PLIST_ENTRY BatchList)
+{
+    PIRP irp;
+
+    while (!IsListEmpty(&FdoData->WriteMerge.PendingIrps)) {
+
+        irp = CONTAINING_RECORD(RemoveHeadList(&FdoData->WriteMerge.PendingIrps), IRP, Tail.Overlay.ListEntry);
+
+        if (IoSetCancelRoutine(irp, NULL) == NULL) {
+            InitializeListHead(&irp->Tail.Overlay.ListEntry);
+        } else {
+            InsertTailList(BatchList, &irp->Tail.Overlay.ListEntry);
+        }
+    }
+
+    FdoData->WriteMerge.NumPendingIrps = 0;
+    FdoData->WriteMerge.PendingLength = 0;
+}
+
+
+/*
+ *  ClasspTransferPacketsInUse
+ *
+ *      Return the number of transfer packets outside the free lists and the
+ *      processor caches, i.e. the transfers outstanding on the device.
+ *      Unsynchronized; only a heuristic.
+ */
+ULONG ClasspTransferPacketsInUse(PCLASS_PRIVATE_FDO_DATA FdoData)
+{
+    PPNL_SLIST_HEADER freeList;
+    ULONG arraySize = KeQueryHighestNodeNumber() + 1;
+    ULONG index;
+    LONG inUse = 0;
+
+    for (index = 0; index < arraySize; index++) {
+        freeList = &FdoData->FreeTransferPacketsLists[index];
+        inUse += (LONG)freeList->NumTotalTransferPackets -
+                 (LONG)freeList->NumFreeTransferPackets -
+                 (LONG)freeList->NumCachedTransferPackets;
+    }
+
+    return (inUse > 0) ? (ULONG)inUse : 0;
+}
+
+
+/*
+ *  ClasspFlushWriteMergeIfIdle
+ *
+ *      Send the pending writes if no transfer is outstanding on the device.
+ *      Called when a transfer packet is freed, so that held writes do not
+ *      wait out the window on a device that has gone idle.
+ */
+VOID ClasspFlushWriteMergeIfIdle(PDEVICE_OBJECT Fdo)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    LIST_ENTRY batchList;
+    KIRQL oldIrql;
+
+    /*
+     *  Unsynchronized peek first; this runs for every completed packet.
+     */
+    if ((fdoData->WriteMerge.WindowIn100ns == 0) ||
+        (fdoData->WriteMerge.NumPendingIrps == 0) ||
+        (ClasspTransferPacketsInUse(fdoData) > 0)) {
+        return;
+    }
+
+    InitializeListHead(&batchList);
+
+    KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+
+    if (fdoData->WriteMerge.NumPendingIrps > 0) {
+        KeCancelTimer(&fdoData->WriteMerge.Timer);
+        ClasspTakeWriteMergePendingIrps(fdoData, &batchList);
+    }
+
+    KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+
+    if (!IsListEmpty(&batchList)) {
+        ClasspSubmitWriteMergeBatch(Fdo, &batchList);
+    }
+}
+
+
+/*
+ *  ClasspSubmitWriteMergeBatch
+ *
+ *      Send a batch of writes taken off the pending list.
+ *      More than one write is copied into a single buffer and sent as one
+ *      transfer, whose completion completes the original writes.  If the
+ *      resources for that cannot be had, or a write cancelled from the middle
+ *      of the batch left it discontiguous, the writes are sent separately.
+ */
+VOID ClasspSubmitWriteMergeBatch(PDEVICE_OBJECT Fdo, PLIST_ENTRY BatchList)
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = Fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    PCLASS_WRITE_MERGE_CONTEXT mergeContext = NULL;
+    PIO_STACK_LOCATION firstSp;
+    PIO_STACK_LOCATION mergedSp;
+    PLIST_ENTRY listEntry;
+    PIRP irp;
+    PIRP mergedIrp = NULL;
+    PUCHAR bufPtr;
+    PVOID srcPtr;
+    ULONG length;
+    ULONG totalLength = 0;
+    ULONG numIrps = 0;
+    BOOLEAN contiguous = TRUE;
+    BOOLEAN merged = FALSE;
+    KIRQL oldIrql;
+
+    irp = CONTAINING_RECORD(BatchList->Flink, IRP, Tail.Overlay.ListEntry);
+    firstSp = IoGetCurrentIrpStackLocation(irp);
+
+    for (listEntry = BatchList->Flink; listEntry != BatchList; listEntry = listEntry->Flink) {
+        irp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+        if (IoGetCurrentIrpStackLocation(irp)->Parameters.Write.ByteOffset.QuadPart !=
+            firstSp->Parameters.Write.ByteOffset.QuadPart + totalLength) {
+            contiguous = FALSE;
+        }
+        totalLength += IoGetCurrentIrpStackLocation(irp)->Parameters.Write.Length;
+        numIrps++;
+    }
+
+    if ((numIrps > 1) && contiguous) {
+
+        mergeContext = ExAllocatePoolZero(NonPagedPoolNx,
+                                          sizeof(CLASS_WRITE_MERGE_CONTEXT),
+                                          CLASSPNP_POOL_TAG_WRITE_MERGE);
+        if (mergeContext != NULL) {
+            InitializeListHead(&mergeContext->Irps);
+            mergeContext->Fdo = Fdo;
+            mergeContext->Buffer = ExAllocatePoolZero(NonPagedPoolNx,
+                                                      totalLength,
+                                                      CLASSPNP_POOL_TAG_WRITE_MERGE);
+            if (mergeContext->Buffer != NULL) {
+                mergeContext->Mdl = IoAllocateMdl(mergeContext->Buffer, totalLength, FALSE, FALSE, NULL);
+                if (mergeContext->Mdl != NULL) {
+                    MmBuildMdlForNonPagedPool(mergeContext->Mdl);
+                    mergedIrp = IoAllocateIrp(1, FALSE);
+                }
+            }
+        }
+
+        if (mergedIrp != NULL) {
+
+            /*
+             *  Gather the data of the writes.
+             */
+            merged = TRUE;
+            bufPtr = mergeContext->Buffer;
+            for (listEntry = BatchList->Flink; listEntry != BatchList; listEntry = listEntry->Flink) {
+                irp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+                length = IoGetCurrentIrpStackLocation(irp)->Parameters.Write.Length;
+                srcPtr = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+                if (srcPtr == NULL) {
+                    merged = FALSE;
+                    break;
+                }
+                RtlCopyMemory(bufPtr, srcPtr, length);
+                bufPtr += length;
+            }
+        }
+
+        if (!merged) {
+            TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_RW, "ClasspSubmitWriteMergeBatch (%p): could not merge %u writes, sending them separately.", Fdo, numIrps));
+
+            if (mergedIrp != NULL) {
+                IoFreeIrp(mergedIrp);
+            }
+            if (mergeContext != NULL) {
+                if (mergeContext->Mdl != NULL) {
+                    IoFreeMdl(mergeContext->Mdl);
+                }
+                FREE_POOL(mergeContext->Buffer);
+                FREE_POOL(mergeContext);
+            }
+        }
+    }
+
+    if (!merged) {
+        while (!IsListEmpty(BatchList)) {
+            irp = CONTAINING_RECORD(RemoveHeadList(BatchList), IRP, Tail.Overlay.ListEntry);
+            ServiceTransferRequest(Fdo, irp, FALSE);
+        }
+        return;
+    }
+
+    /*
+     *  Build a write of the gathered data.  Its only stack location is ours,
+     *  so that the completion routine set there runs when the packet engine
+     *  completes it.
+     */
+    IoSetCompletionRoutine(mergedIrp, ClasspWriteMergeComplete, mergeContext, TRUE, TRUE, TRUE);
+    IoSetNextIrpStackLocation(mergedIrp);
+
+    mergedSp = IoGetCurrentIrpStackLocation(mergedIrp);
+    mergedSp->MajorFunction = IRP_MJ_WRITE;
+    mergedSp->Flags = firstSp->Flags;
+    mergedSp->DeviceObject = Fdo;
+    mergedSp->Parameters.Write.Length = totalLength;
+    mergedSp->Parameters.Write.ByteOffset = firstSp->Parameters.Write.ByteOffset;
+    mergedIrp->MdlAddress = mergeContext->Mdl;
+    ClasspMarkIrpAsIdle(mergedIrp, FALSE);
+
+    while (!IsListEmpty(BatchList)) {
+        InsertTailList(&mergeContext->Irps, RemoveHeadList(BatchList));
+    }
+
+    KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+    fdoData->WriteMerge.MergedTransfers++;
+    fdoData->WriteMerge.MergedWrites += numIrps;
+    KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+
+    /*
+     *  Released by TransferPktComplete.  The original writes still hold
+     *  the remove lock, so this acquire does not fail.
+     */
+    ClassAcquireRemoveLock(Fdo, mergedIrp);
+
+    ServiceTransferRequest(Fdo, mergedIrp, FALSE);
+}
+
+
+/*
+ *  ClasspWriteMergeTimerDpc
+ *
+ *      The merge window expired; send the pending writes.
+ */
+VOID
+ClasspWriteMergeTimerDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+{
+    PDEVICE_OBJECT fdo = (PDEVICE_OBJECT)DeferredContext;
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    LIST_ENTRY batchList;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    InitializeListHead(&batchList);
+
+    KeAcquireSpinLockAtDpcLevel(&fdoData->WriteMerge.Lock);
+
+    /*
+     *  The writes may already have been sent, in which case this is either
+     *  nothing to do or the start of a newer window; sending those a little
+     *  early is harmless.
+     */
+    if (fdoData->WriteMerge.NumPendingIrps > 0) {
+        ClasspTakeWriteMergePendingIrps(fdoData, &batchList);
+        fdoData->WriteMerge.WindowExpirations++;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&fdoData->WriteMerge.Lock);
+
+    if (!IsListEmpty(&batchList)) {
+        ClasspSubmitWriteMergeBatch(fdo, &batchList);
+    }
+}
+
+
+/*
+ *  ClasspWriteMergeCancel
+ *
+ *      Cancel routine of a pending write.  Complete it as cancelled; the writes
+ *      held with it are sent right away, since they may no longer be contiguous.
+ */
+VOID
+ClasspWriteMergeCancel(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = DeviceObject->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    LIST_ENTRY batchList;
+    KIRQL oldIrql;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    InitializeListHead(&batchList);
+
+    KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+
+    /*
+     *  The write was unlinked if it was taken off the pending list after
+     *  this routine was called.
+     */
+    if (!IsListEmpty(&Irp->Tail.Overlay.ListEntry)) {
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        KeCancelTimer(&fdoData->WriteMerge.Timer);
+        ClasspTakeWriteMergePendingIrps(fdoData, &batchList);
+    }
+
+    KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+
+    if (!IsListEmpty(&batchList)) {
+        ClasspSubmitWriteMergeBatch(DeviceObject, &batchList);
+    }
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    ClassReleaseRemoveLock(DeviceObject, Irp);
+    ClassCompleteRequest(DeviceObject, Irp, IO_NO_INCREMENT);
+}
+
+
+/*
+ *  ClasspWriteMergeComplete
+ *
+ *      Completion routine of a merged write.  Complete the original writes,
+ *      or if the merged write failed, send them again one by one so that
+ *      each gets its own status.
+ */
+NTSTATUS
+ClasspWriteMergeComplete(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+    )
+{
+    PCLASS_WRITE_MERGE_CONTEXT mergeContext = (PCLASS_WRITE_MERGE_CONTEXT)Context;
+    PDEVICE_OBJECT fdo = mergeContext->Fdo;
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = fdo->DeviceExtension;
+    PCLASS_PRIVATE_FDO_DATA fdoData = fdoExt->PrivateFdoData;
+    NTSTATUS status = Irp->IoStatus.Status;
+    PIRP originalIrp;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    if (!NT_SUCCESS(status)) {
+        TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_RW, "ClasspWriteMergeComplete (%p): merged write failed with %!STATUS!, retrying the writes separately.", fdo, status));
+
+        KeAcquireSpinLock(&fdoData->WriteMerge.Lock, &oldIrql);
+        fdoData->WriteMerge.FailedTransfers++;
+        KeReleaseSpinLock(&fdoData->WriteMerge.Lock, oldIrql);
+    }
+
+    while (!IsListEmpty(&mergeContext->Irps)) {
+
+        originalIrp = CONTAINING_RECORD(RemoveHeadList(&mergeContext->Irps), IRP, Tail.Overlay.ListEntry);
+
+        if (NT_SUCCESS(status)) {
+            originalIrp->IoStatus.Status = STATUS_SUCCESS;
+            originalIrp->IoStatus.Information = IoGetCurrentIrpStackLocation(originalIrp)->Parameters.Write.Length;
+            ClassReleaseRemoveLock(fdo, originalIrp);
+            ClassCompleteRequest(fdo, originalIrp, IO_DISK_INCREMENT);
+        } else {
+            ServiceTransferRequest(fdo, originalIrp, TRUE);
+        }
+    }
+
+    IoFreeMdl(mergeContext->Mdl);
+    FREE_POOL(mergeContext->Buffer);
+    FREE_POOL(mergeContext);
+    IoFreeIrp(Irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
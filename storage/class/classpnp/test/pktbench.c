@@ -0,0 +1,418 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    pktbench.c
+
+Abstract:
+
+    This file measures the transfer packet free list of classpnp in user mode.
+
+    Each thread stands for a processor that sends transfers and completes them
+    itself: it takes QueueDepth packets, then frees them, over and over. The
+    packets come either straight from the node's free list, as classpnp did
+    before it had processor caches, or through a per-processor cache in front
+    of that list. The cache is the driver's own: PNL_SLIST_HEADER,
+    PNL_PROCESSOR_CACHE and the routines that refill, spill and steal come
+    from pktcache.h in ..\src, and the locking around them follows
+    ClasspDequeueCachedTransferPacket, ClasspCacheFreeTransferPacket and
+    ClasspStealTransferPacket in xferpkt.c.
+
+    The program prints packets per second for both, and the contention
+    counters the driver traces when a device's packets are destroyed.
+
+    Usage: pktbench [Threads [QueueDepth [Seconds]]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+#define MAX_THREADS             64
+#define MAX_QUEUE_DEPTH         64
+
+//
+//  Same depth as TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH in classp.h.
+//
+
+#define TRANSFER_PACKET_PROCESSOR_CACHE_DEPTH   16
+
+//
+//  The fields of TRANSFER_PACKET that pktcache.h uses, and Owner, which
+//  stands for the rest of the packet being written by the thread using it.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _TRANSFER_PACKET {
+    SLIST_ENTRY SlistEntry;
+    ULONG AllocateNode;
+    ULONG Owner;
+} TRANSFER_PACKET, *PTRANSFER_PACKET;
+
+//
+//  The cache locks are taken with interlocked operations rather than
+//  spin lock calls.
+//
+
+typedef LONG KSPIN_LOCK;
+
+#include "pktcache.h"
+
+typedef struct _BENCH {
+    BOOLEAN UseCaches;
+    ULONG NumThreads;
+    ULONG QueueDepth;
+    volatile LONG Stop;
+    PNL_SLIST_HEADER FreeList;
+    PNL_PROCESSOR_CACHE Caches[MAX_THREADS];
+    LONGLONG Packets[MAX_THREADS];
+} BENCH, *PBENCH;
+
+typedef struct _WORKER {
+    PBENCH Bench;
+    ULONG Index;
+} WORKER, *PWORKER;
+
+static
+BOOLEAN
+TryAcquire(
+    _Inout_ volatile LONG *Lock
+    )
+{
+    return (BOOLEAN)(InterlockedCompareExchange(Lock, 1, 0) == 0);
+}
+
+static
+VOID
+Acquire(
+    _Inout_ PPNL_PROCESSOR_CACHE Cache
+    )
+{
+    if (!TryAcquire(&Cache->SpinLock)) {
+        while (!TryAcquire(&Cache->SpinLock)) {
+            YieldProcessor();
+        }
+        Cache->LockContention++;
+    }
+}
+
+static
+VOID
+Release(
+    _Inout_ volatile LONG *Lock
+    )
+{
+    InterlockedExchange(Lock, 0);
+}
+
+static
+PTRANSFER_PACKET
+AllocatePacket(
+    _Inout_ PBENCH Bench
+    )
+{
+    PTRANSFER_PACKET pkt = _aligned_malloc(sizeof(TRANSFER_PACKET), 64);
+
+    if (pkt != NULL) {
+        pkt->AllocateNode = 0;
+        InterlockedIncrement((volatile LONG *)&Bench->FreeList.NumTotalTransferPackets);
+    }
+
+    return pkt;
+}
+
+static
+PTRANSFER_PACKET
+DequeueShared(
+    _Inout_ PBENCH Bench
+    )
+{
+    PSLIST_ENTRY slistEntry;
+
+    slistEntry = InterlockedPopEntrySList(&Bench->FreeList.SListHeader);
+
+    if (slistEntry == NULL) {
+        return AllocatePacket(Bench);
+    }
+
+    InterlockedDecrement((volatile LONG *)&Bench->FreeList.NumFreeTransferPackets);
+
+    return CONTAINING_RECORD(slistEntry, TRANSFER_PACKET, SlistEntry);
+}
+
+static
+VOID
+EnqueueShared(
+    _Inout_ PBENCH Bench,
+    _In_ PTRANSFER_PACKET Pkt
+    )
+{
+    InterlockedPushEntrySList(&Bench->FreeList.SListHeader, &Pkt->SlistEntry);
+    InterlockedIncrement((volatile LONG *)&Bench->FreeList.NumFreeTransferPackets);
+}
+
+static
+PTRANSFER_PACKET
+DequeueCached(
+    _Inout_ PBENCH Bench,
+    _In_ ULONG Index
+    )
+{
+    PPNL_PROCESSOR_CACHE cache = &Bench->Caches[Index];
+    PPNL_PROCESSOR_CACHE victim;
+    PTRANSFER_PACKET pkt;
+    ULONG numRefilled;
+    ULONG i;
+
+    Acquire(cache);
+    pkt = ClasspCacheDequeuePacket(cache, &Bench->FreeList, &numRefilled);
+    Release(&cache->SpinLock);
+
+    //
+    //  Steal from another cache, skipping those whose lock is held.
+    //
+
+    for (i = 1; (i < Bench->NumThreads) && (pkt == NULL); i++) {
+
+        victim = &Bench->Caches[(Index + i) % Bench->NumThreads];
+
+        if (victim->NumCachedTransferPackets == 0 || !TryAcquire(&victim->SpinLock)) {
+            continue;
+        }
+
+        pkt = ClasspCacheStealPacket(victim, &Bench->FreeList, 0);
+
+        Release(&victim->SpinLock);
+    }
+
+    if (pkt == NULL) {
+        pkt = AllocatePacket(Bench);
+    }
+
+    return pkt;
+}
+
+static
+VOID
+EnqueueCached(
+    _Inout_ PBENCH Bench,
+    _In_ ULONG Index,
+    _In_ PTRANSFER_PACKET Pkt
+    )
+{
+    PPNL_PROCESSOR_CACHE cache = &Bench->Caches[Index];
+
+    Acquire(cache);
+    ClasspCacheEnqueuePacket(cache, &Bench->FreeList, Pkt);
+    Release(&cache->SpinLock);
+}
+
+DWORD
+WINAPI
+WorkerThread(
+    _In_ LPVOID Parameter
+    )
+{
+    PWORKER worker = Parameter;
+    PBENCH bench = worker->Bench;
+    PTRANSFER_PACKET outstanding[MAX_QUEUE_DEPTH];
+    LONGLONG packets = 0;
+    ULONG i;
+
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (worker->Index % (sizeof(DWORD_PTR) * 8)));
+
+    while (ReadAcquire(&bench->Stop) == 0) {
+
+        for (i = 0; i < bench->QueueDepth; i++) {
+            outstanding[i] = bench->UseCaches ?
+                             DequeueCached(bench, worker->Index) :
+                             DequeueShared(bench);
+        }
+
+        for (i = 0; i < bench->QueueDepth; i++) {
+            if (outstanding[i] == NULL) {
+                continue;
+            }
+            outstanding[i]->Owner = worker->Index;
+            if (bench->UseCaches) {
+                EnqueueCached(bench, worker->Index, outstanding[i]);
+            } else {
+                EnqueueShared(bench, outstanding[i]);
+            }
+        }
+
+        packets += bench->QueueDepth;
+    }
+
+    bench->Packets[worker->Index] = packets;
+
+    return 0;
+}
+
+static
+VOID
+FreePackets(
+    _Inout_ PBENCH Bench
+    )
+{
+    PSLIST_ENTRY slistEntry;
+    ULONG i;
+
+    for (i = 0; i < Bench->NumThreads; i++) {
+        while (Bench->Caches[i].NumCachedTransferPackets > 0) {
+            _aligned_free(Bench->Caches[i].Packets[--Bench->Caches[i].NumCachedTransferPackets]);
+        }
+    }
+
+    while ((slistEntry = InterlockedPopEntrySList(&Bench->FreeList.SListHeader)) != NULL) {
+        _aligned_free(CONTAINING_RECORD(slistEntry, TRANSFER_PACKET, SlistEntry));
+    }
+}
+
+static
+BOOL
+RunBench(
+    _Inout_ PBENCH Bench,
+    _In_ ULONG Seconds
+    )
+{
+    HANDLE threads[MAX_THREADS];
+    WORKER workers[MAX_THREADS];
+    LARGE_INTEGER frequency, start, end;
+    LONGLONG total = 0;
+    double elapsed;
+    ULONG hits = 0, refills = 0, spills = 0, steals = 0, contention = 0;
+    LONG cached;
+    ULONG i;
+    BOOL Success = TRUE;
+
+    InitializeSListHead(&Bench->FreeList.SListHeader);
+    Bench->Stop = 0;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < Bench->NumThreads; i++) {
+        workers[i].Bench = Bench;
+        workers[i].Index = i;
+        threads[i] = CreateThread(NULL, 0, WorkerThread, &workers[i], 0, NULL);
+        TEST_ASSERT(threads[i] != NULL, "CreateThread failed for thread %lu", i);
+    }
+
+    Sleep(Seconds * 1000);
+    InterlockedExchange(&Bench->Stop, 1);
+
+    WaitForMultipleObjects(Bench->NumThreads, threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    for (i = 0; i < Bench->NumThreads; i++) {
+        CloseHandle(threads[i]);
+        total += Bench->Packets[i];
+        hits += Bench->Caches[i].CacheHits;
+        refills += Bench->Caches[i].Refills;
+        spills += Bench->Caches[i].Spills;
+        steals += Bench->Caches[i].Steals;
+        contention += Bench->Caches[i].LockContention;
+    }
+
+    elapsed = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+
+    TEST_COMMENT("%-14s %10.2f Mpackets/s  (%lu packets allocated)",
+                 Bench->UseCaches ? "cached:" : "node list:",
+                 (double)total / elapsed / 1e6,
+                 Bench->FreeList.NumTotalTransferPackets);
+
+    if (Bench->UseCaches) {
+        TEST_COMMENT("    cache hits %lu, refills %lu, spills %lu, steals %lu, lock contention %lu",
+                     hits, refills, spills, steals, contention);
+    }
+
+    //
+    //  Every packet allocated must be back on the free list or in a cache,
+    //  and the count of cached packets must match the caches.
+    //
+
+    cached = 0;
+    for (i = 0; i < Bench->NumThreads; i++) {
+        cached += Bench->Caches[i].NumCachedTransferPackets;
+    }
+
+    TEST_ASSERT((LONG)Bench->FreeList.NumCachedTransferPackets == cached,
+                "%ld packets counted as cached, %ld in the caches",
+                (LONG)Bench->FreeList.NumCachedTransferPackets,
+                cached);
+
+    TEST_ASSERT((LONG)Bench->FreeList.NumFreeTransferPackets + cached == (LONG)Bench->FreeList.NumTotalTransferPackets,
+                "%ld packets free, %ld allocated",
+                (LONG)Bench->FreeList.NumFreeTransferPackets + cached,
+                (LONG)Bench->FreeList.NumTotalTransferPackets);
+
+End:
+    FreePackets(Bench);
+
+    return Success;
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static BENCH bench;
+    ULONG numThreads = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ULONG queueDepth = 4;
+    ULONG seconds = 3;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        numThreads = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        queueDepth = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        seconds = strtoul(argv[3], NULL, 0);
+    }
+
+    TEST_ASSERT(numThreads >= 1 && numThreads <= MAX_THREADS,
+                "Threads must be between 1 and %u", MAX_THREADS);
+    TEST_ASSERT(queueDepth >= 1 && queueDepth <= MAX_QUEUE_DEPTH,
+                "QueueDepth must be between 1 and %u", MAX_QUEUE_DEPTH);
+
+    TEST_COMMENT("%lu threads, queue depth %lu, %lu s per run",
+                 numThreads, queueDepth, seconds);
+
+    ZeroMemory(&bench, sizeof(bench));
+    bench.NumThreads = numThreads;
+    bench.QueueDepth = queueDepth;
+    bench.UseCaches = FALSE;
+    Success = RunBench(&bench, seconds);
+
+    ZeroMemory(&bench, sizeof(bench));
+    bench.NumThreads = numThreads;
+    bench.QueueDepth = queueDepth;
+    bench.UseCaches = TRUE;
+    Success = RunBench(&bench, seconds) && Success;
+
+End:
+    return Success ? 0 : 1;
+}
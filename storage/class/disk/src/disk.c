@@ -80,6 +80,11 @@ BOOLEAN DiskETWEnabled = FALSE;
 
 BOOLEAN DiskIsPastReinit = FALSE;
 
+//
+// The classpnp dispatch routines that DiskTrackedDispatch passes requests on to
+//
+PDRIVER_DISPATCH DiskClassDispatch[IRP_MJ_MAXIMUM_FUNCTION + 1];
+
 const GUID GUID_NULL = { 0 };
 #define DiskCompareGuid(_First,_Second) \
     (memcmp ((_First),(_Second), sizeof (GUID)))
@@ -237,6 +242,20 @@ Return Value:
 
     if (NT_SUCCESS(status)) {
 
+        //
+        // Requests that may leave data in the write cache of the device go
+        // through DiskTrackedDispatch first, so that their completion can
+        // be seen by the flush path
+        //
+
+        DiskClassDispatch[IRP_MJ_WRITE] = DriverObject->MajorFunction[IRP_MJ_WRITE];
+        DiskClassDispatch[IRP_MJ_DEVICE_CONTROL] = DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL];
+        DiskClassDispatch[IRP_MJ_SCSI] = DriverObject->MajorFunction[IRP_MJ_SCSI];
+
+        DriverObject->MajorFunction[IRP_MJ_WRITE] = DiskTrackedDispatch;
+        DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DiskTrackedDispatch;
+        DriverObject->MajorFunction[IRP_MJ_SCSI] = DiskTrackedDispatch;
+
         IoRegisterBootDriverReinitialization(DriverObject,
                                              DiskBootDriverReinit,
                                              NULL);
@@ -501,6 +520,13 @@ Return Value:
         goto DiskCreateFdoExit;
     }
 
+    //
+    // Leave room for the completion routine that DiskTrackedDispatch
+    // sets on requests that may dirty the write cache
+    //
+
+    deviceObject->StackSize++;
+
     //
     // Clear the init flag.
     //
@@ -1152,6 +1178,7 @@ Return Value:
     PSRBEX_DATA_SCSI_CDB16 srbExDataCdb16 = NULL;
     PCDB cdb;
     KIRQL irql;
+    BOOLEAN redundant;
 
     //
     // Flush requests are combined and need to be handled in a special manner
@@ -1178,6 +1205,23 @@ Return Value:
 
         TracePrint((TRACE_LEVEL_VERBOSE, TRACE_FLAG_SCSI, "DiskShutdownFlush: IRP %p flags = 0x%x\n", Irp, irpStack->Flags));
 
+        if (DiskFlushIsRedundant(diskData)) {
+
+            //
+            // Every write that completed before this request
+            // is already covered by a successful flush
+            //
+
+            KeReleaseSpinLock(&diskData->FlushContext.Spinlock, irql);
+
+            TracePrint((TRACE_LEVEL_VERBOSE, TRACE_FLAG_SCSI, "DiskShutdownFlush: nothing to flush for IRP %p\n", Irp));
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            ClassReleaseRemoveLock(DeviceObject, Irp);
+            ClassCompleteRequest(DeviceObject, Irp, IO_NO_INCREMENT);
+            return STATUS_SUCCESS;
+        }
+
         //
         // This request will most likely be completed asynchronously
         //
@@ -1254,12 +1298,45 @@ Return Value:
                     diskData->FlushContext.CurrIrp = diskData->FlushContext.NextIrp;
                     diskData->FlushContext.NextIrp = NULL;
 
+                    redundant = DiskFlushIsRedundant(diskData);
+
                     KeReleaseSpinLock(&diskData->FlushContext.Spinlock, irql);
 
-                    //
-                    // Send this request down to the device
-                    //
-                    DiskFlushDispatch(DeviceObject, &diskData->FlushContext);
+                    if (redundant) {
+
+                        //
+                        // The flush this group waited on covered every write
+                        // that completed before its requests arrived.
+                        // Complete the group and let the next one go ahead
+                        //
+
+                        TracePrint((TRACE_LEVEL_VERBOSE, TRACE_FLAG_SCSI, "DiskShutdownFlush: nothing to flush for group of IRP %p\n", Irp));
+
+                        while (!IsListEmpty(&diskData->FlushContext.CurrList)) {
+
+                            PLIST_ENTRY listEntry = RemoveHeadList(&diskData->FlushContext.CurrList);
+                            PIRP tempIrp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+
+                            InitializeListHead(&tempIrp->Tail.Overlay.ListEntry);
+                            tempIrp->IoStatus.Status = STATUS_SUCCESS;
+
+                            ClassReleaseRemoveLock(DeviceObject, tempIrp);
+                            ClassCompleteRequest(DeviceObject, tempIrp, IO_NO_INCREMENT);
+                        }
+
+                        Irp->IoStatus.Status = STATUS_SUCCESS;
+                        ClassReleaseRemoveLock(DeviceObject, Irp);
+                        ClassCompleteRequest(DeviceObject, Irp, IO_NO_INCREMENT);
+
+                        KeSetEvent(&diskData->FlushContext.Event, IO_NO_INCREMENT, FALSE);
+
+                    } else {
+
+                        //
+                        // Send this request down to the device
+                        //
+                        DiskFlushDispatch(DeviceObject, &diskData->FlushContext);
+                    }
             }
 
         } else {
@@ -1552,6 +1629,11 @@ Return Value:
     PSRBEX_DATA_SCSI_CDB16 srbExDataCdb16;
     NTSTATUS SyncCacheStatus = STATUS_SUCCESS;
 
+    //
+    // Writes that complete from here on are not covered by this flush
+    //
+    FlushContext->SentGeneration = InterlockedCompareExchange64(&FlushContext->WriteGeneration, 0, 0);
+
     //
     // Fill in the srb fields appropriately
     //
@@ -1716,6 +1798,7 @@ Return Value:
     NTSTATUS status;
     PFUNCTIONAL_DEVICE_EXTENSION fdoExt;
     PDISK_DATA diskData;
+    KIRQL irql;
     #pragma warning(suppress:4311) // pointer truncation from 'PVOID' to 'NTSTATUS'
     NTSTATUS SyncCacheStatus = (NTSTATUS) Context;
 
@@ -1753,6 +1836,16 @@ Return Value:
         Irp->IoStatus.Status = status = SyncCacheStatus;
     }
 
+    //
+    // Flushes that arrive before another write completes have nothing to do
+    //
+    if (NT_SUCCESS(status)) {
+
+        KeAcquireSpinLock(&FlushContext->Spinlock, &irql);
+        FlushContext->FlushedGeneration = FlushContext->SentGeneration;
+        KeReleaseSpinLock(&FlushContext->Spinlock, irql);
+    }
+
     //
     // Complete the flush requests tagged to this one
     //
@@ -1782,6 +1875,147 @@ Return Value:
 }
 
 
+NTSTATUS
+DiskTrackedDispatch(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called ahead of the classpnp dispatch routines for
+    write, device control and SCSI requests. Requests that may leave data
+    in the write cache of the device get a completion routine that advances
+    the write generation of the disk, which lets the flush path complete
+    flushes that have nothing to flush without sending them down.
+
+    Writes sent with FUA are on the media when they complete and are not
+    tracked. Of the device control requests, only those that need write
+    access to the disk are tracked.
+
+Arguments:
+
+    DeviceObject - The device object processing the request
+    Irp - The request being serviced
+
+Return Value:
+
+    The status returned by the classpnp dispatch routine
+
+--*/
+
+{
+    PCOMMON_DEVICE_EXTENSION commonExtension = DeviceObject->DeviceExtension;
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExtension;
+    PDISK_DATA diskData;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PDRIVER_DISPATCH classDispatch = DiskClassDispatch[irpStack->MajorFunction];
+    BOOLEAN tracked = TRUE;
+
+    if (!commonExtension->IsFdo) {
+        return classDispatch(DeviceObject, Irp);
+    }
+
+    fdoExtension = DeviceObject->DeviceExtension;
+    diskData = (PDISK_DATA) commonExtension->DriverData;
+
+    if (!ReadNoFence(&diskData->FlushElision)) {
+        return classDispatch(DeviceObject, Irp);
+    }
+
+    if (irpStack->MajorFunction == IRP_MJ_WRITE) {
+
+        if (diskData->FuaWriteThrough &&
+            diskData->FuaSupported &&
+            fdoExtension->CdbForceUnitAccess &&
+            TEST_FLAG(irpStack->Flags, SL_WRITE_THROUGH)) {
+
+            tracked = FALSE;
+        }
+
+    } else if (irpStack->MajorFunction == IRP_MJ_DEVICE_CONTROL) {
+
+        //
+        // The required access is encoded in bits 14 and 15 of the control code
+        //
+
+        if (!TEST_FLAG(irpStack->Parameters.DeviceIoControl.IoControlCode >> 14, FILE_WRITE_ACCESS)) {
+
+            tracked = FALSE;
+        }
+    }
+
+    if (tracked) {
+
+        if (Irp->CurrentLocation <= commonExtension->LowerDeviceObject->StackSize + 1) {
+
+            //
+            // The sender did not leave room for the completion routine, so
+            // this request can not be tracked. Stop eliding flushes
+            //
+
+            TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_GENERAL, "DiskTrackedDispatch: no stack location for irp %p, flush elision disabled for %p\n", Irp, DeviceObject));
+
+            InterlockedExchange(&diskData->FlushElision, FALSE);
+
+        } else {
+
+            IoCopyCurrentIrpStackLocationToNext(Irp);
+            IoSetCompletionRoutine(Irp, DiskTrackedComplete, NULL, TRUE, TRUE, TRUE);
+            IoSetNextIrpStackLocation(Irp);
+        }
+    }
+
+    return classDispatch(DeviceObject, Irp);
+}
+
+
+
+NTSTATUS
+DiskTrackedComplete(
+    IN PDEVICE_OBJECT Fdo,
+    IN PIRP Irp,
+    IN PVOID Context
+    )
+
+/*++
+
+Routine Description:
+
+    This completion routine advances the write generation of the disk.
+    Requests that failed may still have written part of their data, so
+    they advance it as well.
+
+Arguments:
+
+    Fdo - The device object which requested the completion routine
+    Irp - The irp that is being completed
+    Context - Not used
+
+Return Value:
+
+    STATUS_CONTINUE_COMPLETION
+
+--*/
+
+{
+    PFUNCTIONAL_DEVICE_EXTENSION fdoExt = (PFUNCTIONAL_DEVICE_EXTENSION)Fdo->DeviceExtension;
+    PDISK_DATA diskData = (PDISK_DATA)fdoExt->CommonExtension.DriverData;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    if (Irp->PendingReturned) {
+        IoMarkIrpPending(Irp);
+    }
+
+    InterlockedIncrement64(&diskData->FlushContext.WriteGeneration);
+
+    return STATUS_CONTINUE_COMPLETION;
+}
+
+
 
 NTSTATUS
 DiskModeSelect(
@@ -3103,6 +3337,9 @@ Return Value:
 
     RtlZeroMemory(CacheInfo, sizeof(DISK_CACHE_INFORMATION));
 
+    ((PDISK_DATA) FdoExtension->CommonExtension.DriverData)->FuaSupported =
+        TEST_FLAG(modeData->DeviceSpecificParameter, MODE_DSP_FUA_SUPPORTED) ? TRUE : FALSE;
+
     CacheInfo->ParametersSavable = pageData->PageSavable;
 
     CacheInfo->ReadCacheEnabled = !(pageData->ReadDisableCache);
@@ -138,6 +138,21 @@ typedef struct _DISK_GROUP_CONTEXT
     //
     KEVENT Event;
 
+    //
+    // Incremented each time a write that may have left data in the volatile
+    // cache of the device completes
+    //
+    volatile LONG64 WriteGeneration;
+
+    //
+    // The write generation sampled when the outstanding flush was sent down,
+    // and the one covered by the last flush that completed successfully. A
+    // flush that arrives while the latter still equals the write generation
+    // has nothing to flush
+    //
+    LONG64 SentGeneration;
+    LONG64 FlushedGeneration;
+
 
 #if DBG
 
@@ -373,6 +388,24 @@ typedef struct _DISK_DATA {
 
     DISK_USER_WRITE_CACHE_SETTING WriteCacheOverride;
 
+    //
+    // Complete flushes without sending them down when no write has
+    // completed since the last successful flush. Cleared by the dispatch
+    // routine while requests are in flight, so it is only accessed with
+    // ReadNoFence and InterlockedExchange
+    //
+    volatile LONG FlushElision;
+
+    //
+    // Write-through writes rely on FUA and are not tracked as dirtying the cache
+    //
+    BOOLEAN FuaWriteThrough;
+
+    //
+    // The device set DPOFUA in the mode parameter header
+    //
+    BOOLEAN FuaSupported;
+
 
 } DISK_DATA, *PDISK_DATA;
 
@@ -392,6 +425,8 @@ typedef struct _DISK_DATA {
 #define DiskDeviceParameterSubkey           L"Disk"
 #define DiskDeviceUserWriteCacheSetting     L"UserWriteCacheSetting"
 #define DiskDeviceCacheIsPowerProtected     L"CacheIsPowerProtected"
+#define DiskDeviceFlushElision              L"FlushElision"
+#define DiskDeviceFuaWriteThrough           L"FuaWriteThrough"
 
 
 #define FUNCTIONAL_EXTENSION_SIZE sizeof(FUNCTIONAL_DEVICE_EXTENSION) + sizeof(DISK_DATA)
@@ -571,6 +606,30 @@ DiskFlushDispatch(
 
 IO_COMPLETION_ROUTINE DiskFlushComplete;
 
+NTSTATUS
+DiskTrackedDispatch(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    );
+
+IO_COMPLETION_ROUTINE DiskTrackedComplete;
+
+//
+// Returns TRUE when no tracked request has completed since the last
+// successful flush. Called with the flush context spinlock held
+//
+
+FORCEINLINE
+BOOLEAN
+DiskFlushIsRedundant(
+    IN PDISK_DATA DiskData
+    )
+{
+    return (ReadNoFence(&DiskData->FlushElision) &&
+            InterlockedCompareExchange64(&DiskData->FlushContext.WriteGeneration, 0, 0) ==
+            DiskData->FlushContext.FlushedGeneration);
+}
+
 
 NTSTATUS
 DiskModeSelect(
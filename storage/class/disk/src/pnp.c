@@ -577,6 +577,13 @@ Return Value:
     KeInitializeSpinLock(&diskData->FlushContext.Spinlock);
     KeInitializeEvent(&diskData->FlushContext.Event, SynchronizationEvent, FALSE);
 
+    //
+    // Nothing is known about the cache of the device yet, so the
+    // first flush always goes down
+    //
+
+    diskData->FlushContext.WriteGeneration = 1;
+
 
     //
     // Restore the saved value
@@ -932,6 +939,8 @@ Return Value:
     STORAGE_HOTPLUG_INFO hotplugInfo = { 0 };
     DISK_CACHE_INFORMATION cacheInfo = { 0 };
     ULONG isPowerProtected = 0;
+    ULONG flushElision = 0;
+    ULONG fuaWriteThrough = 0;
     NTSTATUS status;
 
     PAGED_CODE();
@@ -1093,6 +1102,29 @@ Return Value:
 
     ADJUST_FUA_FLAG(fdoExtension);
 
+    //
+    // If the user opted in, flushes are completed without being sent down
+    // when no write has completed since the last successful one
+    //
+
+    ClassGetDeviceParameter(fdoExtension, DiskDeviceParameterSubkey, DiskDeviceFlushElision, &flushElision);
+
+    InterlockedExchange(&diskData->FlushElision, (flushElision != 0));
+
+    //
+    // The user may choose to have write-through writes rely on FUA alone,
+    // which is only honored if the device reports that it supports FUA
+    //
+
+    ClassGetDeviceParameter(fdoExtension, DiskDeviceParameterSubkey, DiskDeviceFuaWriteThrough, &fuaWriteThrough);
+
+    diskData->FuaWriteThrough = (fuaWriteThrough != 0);
+
+    if (diskData->FuaWriteThrough && !diskData->FuaSupported) {
+
+        TracePrint((TRACE_LEVEL_WARNING, TRACE_FLAG_PNP, "DiskStartFdo: %p does not report FUA support, write-through writes stay tracked\n", Fdo));
+    }
+
     return STATUS_SUCCESS;
 
 } // end DiskStartFdo()
@@ -54,6 +54,8 @@ Revision History:
 #include "scr_u3m.h"    // memory mapped scripts
 
 #include "lsisiop.h"
+#include "lsisg.h"
+#include "lsilun.h"
 #include "lsinvm.h"
 #include "lsisvdt.h"
 #include "lsiver.h"
@@ -163,6 +165,13 @@ typedef struct _HW_DEVICE_EXTENSION {
 
     USHORT LuFlags[SYM_MAX_TARGETS];        // logical unit spec. flags
 
+// per-LUN queue depth given to Storport, and the per-LUN dispatch counts
+// StartSCSIRequest limits each LUN with (see lsilun.h).  A LUN held at its
+// limit is marked busy, Storport keeps dispatching the other LUNs in turn.
+
+    ULONG  LunQueueDepth;                   // 0 = leave Storport default
+    LUN_DISPATCH LunDispatch;               // per-LUN started/completed
+
     USHORT hbaCapability;           // HBA capabilities bit-field
     UCHAR chip_rev;                 // chip revision
 
@@ -742,6 +751,8 @@ Return Value:
         if (Srb != NULL)
         {
             pEntry->Srb = NULL;
+            LunDispatchComplete( &DeviceExtension->LunDispatch,
+                                 pEntry->target, pEntry->lun );
 
             // complete the Srb back with reset status
             Srb->SrbStatus = SRB_STATUS_BUS_RESET;
@@ -1402,6 +1413,9 @@ Return Value:
     pEntry = DeviceExtension->IoTrackArray;
     for (i = 0; i < START_Q_DEPTH; i++)
     {
+        if ( pEntry->Srb )
+            LunDispatchComplete( &DeviceExtension->LunDispatch,
+                                 pEntry->target, pEntry->lun );
         pEntry->Srb = NULL;
         pEntry++;
     }
@@ -1631,6 +1645,7 @@ Return Value:
 #endif    
     ULONG pci_cfg_len, loop;
     ULONG load_context;
+    ULONG lun_q_depth;
     UCHAR pci_cfg_buf[48], reqId, i, hbaDeviceID;
     USHORT hbaCap = 0;
     BOOLEAN foundNVM;
@@ -1792,6 +1807,16 @@ Return Value:
             DeviceExtension->ntldr_flag = (UCHAR)load_context;
     }
 
+    // set per-LUN queue depth, "lunqdepth=0" leaves the Storport default
+    DeviceExtension->LunQueueDepth = DEFAULT_LUN_Q_DEPTH;
+    if ( (ArgumentString != NULL) &&
+         ProcessParseArgumentString(ArgumentString,"lunqdepth", &lun_q_depth) )
+    {
+        if (lun_q_depth > START_Q_DEPTH)
+            lun_q_depth = START_Q_DEPTH;
+        DeviceExtension->LunQueueDepth = lun_q_depth;
+    }
+
 #ifdef FORCE_SYNC
     // set force sync flag to ignore disable_sync
     // (if not in crash dump context)
@@ -3042,11 +3067,13 @@ Return Value:
         Srb->SrbStatus = SRB_STATUS_SUCCESS;
 
         // if this is a standard Inquiry command, set the device
-        // queue depth to 31 (most U160 devices can handle this)
-        if ( (Srb->Cdb[0] == SCSIOP_INQUIRY) && !(Srb->Cdb[1] & 1) )
+        // queue depth (31 by default, most U160 devices can handle this)
+        if ( (Srb->Cdb[0] == SCSIOP_INQUIRY) && !(Srb->Cdb[1] & 1) &&
+             DeviceExtension->LunQueueDepth )
         {
             StorPortSetDeviceQueueDepth( DeviceExtension, Srb->PathId,
-                                         Srb->TargetId, Srb->Lun, 31);
+                                         Srb->TargetId, Srb->Lun,
+                                         DeviceExtension->LunQueueDepth);
         }
     }
     else
@@ -3121,6 +3148,8 @@ Return Value:
     }
     // reset Srb address
     pEntry->Srb = NULL;
+    LunDispatchComplete( &DeviceExtension->LunDispatch,
+                         pEntry->target, pEntry->lun );
     // get I/O tracking entry post index
     trackFIFO = DeviceExtension->TrackPost;
     DeviceExtension->IoTrackFIFO[trackFIFO++] = trackEntry;
@@ -3245,6 +3274,8 @@ Return Value:
                  (pEntry->target == target) )
             {
                 pEntry->Srb = NULL;
+                LunDispatchComplete( &DeviceExtension->LunDispatch,
+                                     pEntry->target, pEntry->lun );
                 // get I/O tracking entry post index
                 trackFIFO = DeviceExtension->TrackPost;
                 DeviceExtension->IoTrackFIFO[trackFIFO++] = (UCHAR)index;
@@ -4741,6 +4772,8 @@ Return Value:
         return (ISR_START_SCRIPT);
     }
     pEntry->Srb = NULL;
+    LunDispatchComplete( &DeviceExtension->LunDispatch,
+                         pEntry->target, pEntry->lun );
     // get I/O tracking entry post index
     trackFIFO = DeviceExtension->TrackPost;
     DeviceExtension->IoTrackFIFO[trackFIFO++] = trackEntry;
@@ -5746,8 +5779,9 @@ Return Value:
 {
     BOOLEAN dataIn, do64bit;
     USHORT iovLen, i;
-    ULONG scriptCmd, numElements, loop;
+    ULONG scriptCmd, numElements, loop, moveCount;
     ULONG ElementLength;
+    STOR_PHYSICAL_ADDRESS ElementAddress;
     ULONG_PTR iovStart;
     PSRB_EXTENSION SrbExtension = Srb->SrbExtension;
     PULONG iovPtr, iovSR;
@@ -5785,10 +5819,15 @@ Return Value:
     numElements = pSpSGStruct->NumberOfElements;
     pSpSGL = pSpSGStruct->List;
 
-    // build the SG move instructions
-    for ( loop = 1; loop <= numElements; loop++ )
+    // build the SG move instructions, one per run of physically
+    // contiguous elements
+    loop = 0;
+    moveCount = 0;
+    while ( loop < numElements )
     {
-        ElementLength = pSpSGL->Length;
+        loop = MergeScatterGatherElements( pSpSGL, numElements, loop,
+                                           &ElementAddress, &ElementLength );
+
         // for data out, last element needs to be a MOVE instead of a CHMOV
         // for data in, all elements must be a CHMOV (1010 errata)
         if ( (loop == numElements) && !dataIn )
@@ -5801,14 +5840,13 @@ Return Value:
         }
 
         // next dword is low 32-bits of physical address
-        *iovPtr++ = pSpSGL->PhysicalAddress.LowPart;
+        *iovPtr++ = ElementAddress.LowPart;
 
         // if using 64-bit addresses, next dword is high 32-bits
         if (do64bit)
-            *iovPtr++ = pSpSGL->PhysicalAddress.HighPart;
+            *iovPtr++ = ElementAddress.HighPart;
 
-        // bump SGL pointer
-        pSpSGL++;
+        moveCount++;
     }
 
     // if using 64-bit addresses, insert instruction to turn off 64-bit mode
@@ -5822,7 +5860,7 @@ Return Value:
     *iovPtr++ = (ULONG)RETURN_SCRIPT;
     *iovPtr++ = 0;
 
-    SrbExtension->PhysBreakCount = (UCHAR)numElements;
+    SrbExtension->PhysBreakCount = (UCHAR)moveCount;
 
     iovLen = (USHORT)((ULONG_PTR)iovPtr - iovStart);
 
@@ -5835,9 +5873,10 @@ Return Value:
             StorPortWriteRegisterUlong( DeviceExtension, iovSR++, *(iovPtr++));
     }
 
-    DebugPrint((3, "LsiU3(%2x) LsiU3ScatterGather: Phys breaks = %2x, total size = %8x \n",
+    DebugPrint((3, "LsiU3(%2x) LsiU3ScatterGather: Phys breaks = %2x, moves = %2x, total size = %8x \n",
         DeviceExtension->SIOPRegisterBase,
         numElements,
+        moveCount,
         Srb->DataTransferLength));
 
     return(iovLen);
@@ -6865,7 +6904,7 @@ Return Value:
 
 {
     UCHAR qTag, trackEntry;
-    ULONG svdtPAdd, index, svdtMove, tagIndex, trackFIFO;
+    ULONG svdtPAdd, index, svdtMove, tagIndex, trackFIFO, requests;
     PSRB_EXTENSION SrbExtension = Srb->SrbExtension;
     PSVARS_DESCRIPTOR_TABLE svdtPtr;
     PIO_TRACK_ENTRY pEntry;
@@ -6880,6 +6919,23 @@ Return Value:
         return;
     }
 
+    // make sure this LUN isn't at its limit
+    requests = LunDispatchCheck( &DeviceExtension->LunDispatch,
+                                 Srb->TargetId, Srb->Lun,
+                                 DeviceExtension->LunQueueDepth );
+    if ( requests )
+    {
+        DebugPrint((3,"StartSCSIRequest: LUN at its limit... \n"));
+        // return the I/O with Busy status
+        Srb->SrbStatus = SRB_STATUS_BUSY;
+        // hold only this LUN until enough of its requests have completed,
+        // the other LUNs keep being started
+        StorPortDeviceBusy( DeviceExtension, Srb->PathId, Srb->TargetId,
+                            Srb->Lun, requests);
+        StorPortNotification( RequestComplete, DeviceExtension, Srb );
+        return;
+    }
+
     // make sure start queue isn't full
     index = DeviceExtension->ioStartQIndex;
     if (DeviceExtension->ioStartQueue[index].svdtPhysSem & SVDT_SEM_MASK)
@@ -6918,6 +6974,8 @@ Return Value:
     pEntry->Srb = Srb;
     pEntry->target = Srb->TargetId;
     pEntry->lun = Srb->Lun;
+    LunDispatchStart( &DeviceExtension->LunDispatch, pEntry->target,
+                      pEntry->lun );
     // save entry index in SrbExtension
     SrbExtension->trackEntry = trackEntry;
 
@@ -0,0 +1,146 @@
+/*++
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+PARTICULAR PURPOSE.
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Module Name:
+
+    lsilun.h
+
+Abstract:
+
+    Per-LUN dispatch limit applied when a request is started.  A LUN may
+    have a quarter of the LUN queue depth outstanding, and up to the full
+    depth once it has been the only LUN started for twice the depth in a
+    row and no other LUN has I/O outstanding.  A busy LUN then cannot keep
+    the requests of other LUNs waiting behind a full queue of its own,
+    neither while they have I/O nor when they start again after a pause.
+    It only depends on SYM_MAX_TARGETS, so it is also built by the user
+    mode test in ..\test.
+
+Environment:
+
+    kernel mode and user mode test
+
+Notes:
+
+    StartIo and the ISR run at the same time (full duplex), so each counter
+    is only written by one of them: the started counts by StartIo and the
+    completed counts by the completion paths.  A count read from the other
+    side can be stale, which only makes the limit a little late.
+
+Revision History:
+
+--*/
+
+
+#ifndef _LSI_LUN_
+#define _LSI_LUN_
+
+
+#define LUN_DISPATCH_MAX_LUNS   16      // MaximumNumberOfLogicalUnits
+
+// share of the LUN queue depth a LUN keeps while other LUNs have I/O
+#define LUN_FAIR_DEPTH(_Depth)  (((_Depth) >= 4) ? ((_Depth) / 4) : 1)
+
+// starts in a row after which a LUN is taken to be the only one in use
+#define LUN_ALONE_STARTS(_Depth)    ((_Depth) * 2)
+
+typedef struct _LUN_DISPATCH
+{
+    // written when a request is started
+    ULONG           Started[SYM_MAX_TARGETS][LUN_DISPATCH_MAX_LUNS];
+    ULONG           TotalStarted;
+    ULONG           RunLength;      // starts in a row of LastTarget/LastLun
+    UCHAR           LastTarget;
+    UCHAR           LastLun;
+
+    // written when a started request is completed
+    volatile ULONG  Completed[SYM_MAX_TARGETS][LUN_DISPATCH_MAX_LUNS];
+    volatile ULONG  TotalCompleted;
+
+} LUN_DISPATCH, *PLUN_DISPATCH;
+
+
+//
+// Checks whether a request for Target/Lun may be started with LunDepth
+// requests allowed per LUN (0 = no limit).
+//
+// Returns 0 if it may, or the number of this LUN's requests that have to
+// complete before it is below its limit again.
+//
+
+__inline
+ULONG
+LunDispatchCheck(
+    IN PLUN_DISPATCH Dispatch,
+    IN UCHAR Target,
+    IN UCHAR Lun,
+    IN ULONG LunDepth
+    )
+{
+    ULONG outstanding;
+    ULONG limit;
+
+    if ( !LunDepth )
+        return(0);
+
+    outstanding = Dispatch->Started[Target][Lun] -
+                  Dispatch->Completed[Target][Lun];
+
+    // full depth only for a LUN that has been used alone for a while
+    limit = LUN_FAIR_DEPTH(LunDepth);
+    if ( (Dispatch->TotalStarted - Dispatch->TotalCompleted) == outstanding &&
+         Dispatch->LastTarget == Target && Dispatch->LastLun == Lun &&
+         Dispatch->RunLength >= LUN_ALONE_STARTS(LunDepth) )
+        limit = LunDepth;
+
+    if ( outstanding < limit )
+        return(0);
+
+    return(outstanding - limit + 1);
+}
+
+
+__inline
+VOID
+LunDispatchStart(
+    IN PLUN_DISPATCH Dispatch,
+    IN UCHAR Target,
+    IN UCHAR Lun
+    )
+{
+    Dispatch->Started[Target][Lun]++;
+    Dispatch->TotalStarted++;
+
+    if ( Dispatch->LastTarget == Target && Dispatch->LastLun == Lun )
+    {
+        if ( Dispatch->RunLength != MAXULONG )
+            Dispatch->RunLength++;
+    }
+    else
+    {
+        Dispatch->LastTarget = Target;
+        Dispatch->LastLun = Lun;
+        Dispatch->RunLength = 1;
+    }
+}
+
+
+__inline
+VOID
+LunDispatchComplete(
+    IN PLUN_DISPATCH Dispatch,
+    IN UCHAR Target,
+    IN UCHAR Lun
+    )
+{
+    Dispatch->Completed[Target][Lun]++;
+    Dispatch->TotalCompleted++;
+}
+
+#endif // _LSI_LUN_
@@ -0,0 +1,80 @@
+/*++
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+PARTICULAR PURPOSE.
+
+Copyright (c) Microsoft Corporation. All rights reserved
+
+Module Name:
+
+    lsisg.h
+
+Abstract:
+
+    Scatter/gather element merging used to build the SG move instructions.
+    It only depends on STOR_SCATTER_GATHER_ELEMENT and MAX_XFER_LENGTH, so
+    it is also built by the user mode test in ..\test.
+
+Environment:
+
+    kernel mode and user mode test
+
+Notes:
+
+
+Revision History:
+
+--*/
+
+
+#ifndef _LSI_SG_
+#define _LSI_SG_
+
+
+//
+// Starting at List[Index], merge the following elements that start where
+// the previous one ends, as long as the byte count fits the move command
+// and the move does not cross a 4GB boundary.
+//
+// Returns the index of the first element not merged, and the address and
+// byte count of the merged move.
+//
+
+__inline
+ULONG
+MergeScatterGatherElements(
+    IN PSTOR_SCATTER_GATHER_ELEMENT List,
+    IN ULONG NumberOfElements,
+    IN ULONG Index,
+    OUT PSTOR_PHYSICAL_ADDRESS MoveAddress,
+    OUT PULONG MoveLength
+    )
+{
+    STOR_PHYSICAL_ADDRESS ElementAddress;
+    ULONG ElementLength;
+
+    ElementAddress = List[Index].PhysicalAddress;
+    ElementLength = List[Index].Length;
+    Index++;
+
+    while ( (Index < NumberOfElements) &&
+            (List[Index].PhysicalAddress.QuadPart ==
+                ElementAddress.QuadPart + ElementLength) &&
+            (List[Index].Length <= MAX_XFER_LENGTH - ElementLength) &&
+            ((ULONG)((ElementAddress.QuadPart + ElementLength +
+                List[Index].Length - 1) >> 32) ==
+                (ULONG)ElementAddress.HighPart) )
+    {
+        ElementLength += List[Index].Length;
+        Index++;
+    }
+
+    *MoveAddress = ElementAddress;
+    *MoveLength = ElementLength;
+
+    return(Index);
+}
+
+#endif // _LSI_SG_
@@ -65,6 +65,7 @@ Revision History:
 #define SYM_NARROW_MAX_TARGETS  8
 #define MAX_STALL               50000
 #define MAX_XFER_LENGTH 0x00FFFFFF     // maximum transfer length per request
+#define DEFAULT_LUN_Q_DEPTH     31     // per-LUN queue depth (most U160 devices)
 
 // SCSI message byte for Logical Unit Reset (not in storport.h)
 #define SCSIMESS_LOGICAL_UNIT_RESET 0x17
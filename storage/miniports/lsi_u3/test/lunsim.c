@@ -0,0 +1,535 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    lunsim.c
+
+Abstract:
+
+    This file replays a stream of SRBs through a model of Storport and
+    lsi_u3 in user mode, and prints the latency each LUN sees.
+
+    Storport keeps a queue per LUN, dispatches the LUNs in turn and keeps
+    no more than the LUN queue depth of a LUN's requests outstanding.
+    StartSCSIRequest (lsi_u3.c) limits each LUN further with
+    LunDispatchCheck from lsilun.h, which is built here unchanged; a LUN it
+    refuses is held until the number of its requests it returns have
+    completed, as StorPortDeviceBusy does.  Started requests are served one
+    at a time in the order they were started, with a fixed cost per request
+    and per byte, which is the worst case of LUNs sharing one target or a
+    bus that selects in start queue order.
+
+    Every stream is replayed with the per-LUN queue depth alone (the
+    driver before the dispatch limit) and with the dispatch limit.  The
+    default stream is one LUN writing bursts of 64KB requests and three
+    LUNs reading 4KB requests every few milliseconds.  The test checks that
+    every request completes, that the light LUNs' latency is lower with
+    the limit and that the busy LUN still moves as many bytes.
+
+    A stream can also be read from a file, one SRB per line:
+
+        <arrival time in microseconds> <target> <lun> <bytes>
+
+    Usage: lunsim [StreamFile [LunQueueDepth]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+#include "lsisiop.h"
+#include "lsilun.h"
+
+//
+//  Service cost of a started request, about a U160 bus.
+//
+
+#define REQUEST_COST_US         30
+#define BYTES_PER_US            80
+
+#define MAX_SRBS                100000
+#define MAX_LUNS                (SYM_MAX_TARGETS * LUN_DISPATCH_MAX_LUNS)
+
+#define STREAM_US               2000000
+
+typedef struct _SRB {
+    LONGLONG Arrival;
+    LONGLONG Completion;
+    UCHAR Target;
+    UCHAR Lun;
+    ULONG Length;
+    ULONG Next;                 // next SRB in the LUN queue
+} SRB, *PSRB;
+
+typedef struct _LUN {
+    ULONG Head;                 // Storport queue of the LUN
+    ULONG Tail;
+    ULONG Outstanding;          // started and not completed
+    ULONG BusyRequests;         // completions until the LUN is resumed
+    ULONG MaxOutstanding;
+    ULONG Requests;
+    ULONGLONG Bytes;
+    LONGLONG LastCompletion;
+    LONGLONG *Latencies;
+} LUN, *PLUN;
+
+#define NO_SRB                  ((ULONG)-1)
+
+static SRB Srbs[MAX_SRBS];
+static ULONG SrbCount;
+
+static LUN Luns[MAX_LUNS];
+
+//
+//  Started requests, in the order they are served.
+//
+
+static ULONG Started[MAX_SRBS];
+
+static LUN_DISPATCH Dispatch;
+
+typedef struct _RESULT {
+    ULONG Requests;
+    ULONGLONG Bytes;
+    double MeanUs;
+    LONGLONG P99Us;
+    LONGLONG MaxUs;
+    LONGLONG LastCompletion;
+    ULONG MaxOutstanding;
+} RESULT, *PRESULT;
+
+static RESULT Results[2][MAX_LUNS];
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+static
+VOID
+AddSrb (
+    _In_ LONGLONG Arrival,
+    _In_ UCHAR Target,
+    _In_ UCHAR Lun,
+    _In_ ULONG Length
+    )
+{
+    if (SrbCount < MAX_SRBS) {
+        Srbs[SrbCount].Arrival = Arrival;
+        Srbs[SrbCount].Target = Target;
+        Srbs[SrbCount].Lun = Lun;
+        Srbs[SrbCount].Length = Length;
+        SrbCount++;
+    }
+}
+
+static
+int
+__cdecl
+CompareArrival (
+    _In_ const void *First,
+    _In_ const void *Second
+    )
+{
+    const SRB *first = First;
+    const SRB *second = Second;
+
+    if (first->Arrival != second->Arrival) {
+        return (first->Arrival < second->Arrival) ? -1 : 1;
+    }
+
+    if (first->Target != second->Target) {
+        return (first->Target < second->Target) ? -1 : 1;
+    }
+
+    return (int)first->Lun - (int)second->Lun;
+}
+
+static
+int
+__cdecl
+CompareLatency (
+    _In_ const void *First,
+    _In_ const void *Second
+    )
+{
+    LONGLONG first = *(const LONGLONG *)First;
+    LONGLONG second = *(const LONGLONG *)Second;
+
+    return (first < second) ? -1 : (first > second);
+}
+
+//
+//  The default stream: target 0 LUN 0 writes bursts of 64 64KB requests
+//  about every 100ms, which keeps the bus busy for 56ms of each burst, and
+//  target 0 LUN 1 and targets 1 and 2 LUN 0 read 4KB about every 3ms each.
+//
+
+static
+VOID
+DefaultStream (
+    VOID
+    )
+{
+    LONGLONG time;
+    ULONG i, j;
+
+    srand(1);
+
+    for (time = Random32() % 1000; time < STREAM_US; time += 90000 + Random32() % 20000) {
+        for (j = 0; j < 64; j++) {
+            AddSrb(time + j, 0, 0, 0x10000);
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        for (time = Random32() % 3000; time < STREAM_US; time += 1000 + Random32() % 4000) {
+            AddSrb(time, (UCHAR)(i == 0 ? 0 : i), (UCHAR)(i == 0 ? 1 : 0), 0x1000);
+        }
+    }
+}
+
+static
+BOOL
+ReadStream (
+    _In_ PCSTR FileName
+    )
+{
+    FILE *file;
+    long long arrival;
+    unsigned target, lun;
+    unsigned long length;
+
+    if (fopen_s(&file, FileName, "r") != 0) {
+        return FALSE;
+    }
+
+    while (fscanf_s(file, "%lld %u %u %lu", &arrival, &target, &lun, &length) == 4) {
+        if ((target < SYM_MAX_TARGETS) && (lun < LUN_DISPATCH_MAX_LUNS) &&
+            (length != 0) && (length <= MAX_XFER_LENGTH)) {
+            AddSrb(arrival, (UCHAR)target, (UCHAR)lun, length);
+        }
+    }
+
+    fclose(file);
+
+    return TRUE;
+}
+
+static
+LONGLONG
+ServiceUs (
+    _In_ PSRB Srb
+    )
+{
+    return REQUEST_COST_US + (Srb->Length + BYTES_PER_US - 1) / BYTES_PER_US;
+}
+
+//
+//  Storport dispatch: starting after the LUN started last, offer the head
+//  request of each LUN that is not held and is below the queue depth to
+//  the miniport, until none can be started.
+//
+
+static
+VOID
+DispatchLuns (
+    _In_ ULONG LunQueueDepth,
+    _In_ BOOLEAN Limit,
+    _Inout_ PULONG NextLun,
+    _Inout_ PULONG StartedCount,
+    _In_ LONGLONG Now,
+    _Inout_ PLONGLONG ServerFree
+    )
+{
+    BOOLEAN started;
+    PLUN lun;
+    PSRB srb;
+    ULONG index;
+    ULONG requests;
+    ULONG i;
+
+    do {
+        started = FALSE;
+
+        for (i = 0; i < MAX_LUNS; i++) {
+
+            index = (*NextLun + i) % MAX_LUNS;
+            lun = &Luns[index];
+
+            if ((lun->Head == NO_SRB) || lun->BusyRequests ||
+                (lun->Outstanding >= LunQueueDepth)) {
+                continue;
+            }
+
+            srb = &Srbs[lun->Head];
+
+            //
+            //  StartSCSIRequest.
+            //
+
+            if (Limit) {
+
+                requests = LunDispatchCheck(&Dispatch, srb->Target, srb->Lun, LunQueueDepth);
+
+                if (requests) {
+                    lun->BusyRequests = requests;
+                    continue;
+                }
+
+                LunDispatchStart(&Dispatch, srb->Target, srb->Lun);
+            }
+
+            Started[(*StartedCount)++] = lun->Head;
+            lun->Head = srb->Next;
+            lun->Outstanding++;
+            lun->MaxOutstanding = max(lun->MaxOutstanding, lun->Outstanding);
+
+            *ServerFree = max(*ServerFree, Now) + ServiceUs(srb);
+            srb->Completion = *ServerFree;
+
+            *NextLun = (index + 1) % MAX_LUNS;
+            started = TRUE;
+            break;
+        }
+
+    } while (started);
+}
+
+static
+BOOL
+Replay (
+    _In_ ULONG LunQueueDepth,
+    _In_ BOOLEAN Limit,
+    _Out_writes_(MAX_LUNS) PRESULT Results
+    )
+{
+    ULONG nextArrival = 0;
+    ULONG nextCompletion = 0;
+    ULONG startedCount = 0;
+    ULONG nextLun = 0;
+    LONGLONG serverFree = 0;
+    LONGLONG now;
+    LONGLONG total;
+    PLUN lun;
+    PSRB srb;
+    ULONG i, j;
+
+    ZeroMemory(&Dispatch, sizeof(Dispatch));
+
+    for (i = 0; i < MAX_LUNS; i++) {
+        Luns[i].Head = NO_SRB;
+        Luns[i].Tail = NO_SRB;
+        Luns[i].Outstanding = 0;
+        Luns[i].BusyRequests = 0;
+        Luns[i].MaxOutstanding = 0;
+        Luns[i].Requests = 0;
+        Luns[i].Bytes = 0;
+        Luns[i].LastCompletion = 0;
+    }
+
+    while ((nextArrival < SrbCount) || (nextCompletion < startedCount)) {
+
+        //
+        //  Completions are in start order, so the next event is either the
+        //  next arrival or the oldest started request.
+        //
+
+        if ((nextCompletion < startedCount) &&
+            ((nextArrival == SrbCount) ||
+             (Srbs[Started[nextCompletion]].Completion <= Srbs[nextArrival].Arrival))) {
+
+            srb = &Srbs[Started[nextCompletion++]];
+            now = srb->Completion;
+            lun = &Luns[srb->Target * LUN_DISPATCH_MAX_LUNS + srb->Lun];
+
+            if (Limit) {
+                LunDispatchComplete(&Dispatch, srb->Target, srb->Lun);
+            }
+
+            lun->Outstanding--;
+            if (lun->BusyRequests) {
+                lun->BusyRequests--;
+            }
+
+            lun->Latencies[lun->Requests++] = srb->Completion - srb->Arrival;
+            lun->Bytes += srb->Length;
+            lun->LastCompletion = srb->Completion;
+
+        } else {
+
+            srb = &Srbs[nextArrival];
+            now = srb->Arrival;
+            lun = &Luns[srb->Target * LUN_DISPATCH_MAX_LUNS + srb->Lun];
+
+            srb->Next = NO_SRB;
+            if (lun->Head == NO_SRB) {
+                lun->Head = nextArrival;
+            } else {
+                Srbs[lun->Tail].Next = nextArrival;
+            }
+            lun->Tail = nextArrival;
+            nextArrival++;
+        }
+
+        DispatchLuns(LunQueueDepth, Limit, &nextLun, &startedCount, now, &serverFree);
+    }
+
+    for (i = 0; i < MAX_LUNS; i++) {
+
+        lun = &Luns[i];
+        ZeroMemory(&Results[i], sizeof(Results[i]));
+
+        if (lun->Requests == 0) {
+            continue;
+        }
+
+        qsort(lun->Latencies, lun->Requests, sizeof(LONGLONG), CompareLatency);
+
+        total = 0;
+        for (j = 0; j < lun->Requests; j++) {
+            total += lun->Latencies[j];
+        }
+
+        Results[i].Requests = lun->Requests;
+        Results[i].Bytes = lun->Bytes;
+        Results[i].MeanUs = (double)total / lun->Requests;
+        Results[i].P99Us = lun->Latencies[(lun->Requests * 99) / 100];
+        Results[i].MaxUs = lun->Latencies[lun->Requests - 1];
+        Results[i].LastCompletion = lun->LastCompletion;
+        Results[i].MaxOutstanding = lun->MaxOutstanding;
+    }
+
+    return (startedCount == SrbCount);
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static const PCSTR Names[2] = { "queue depth only", "dispatch limit" };
+    ULONG lunQueueDepth = DEFAULT_LUN_Q_DEPTH;
+    ULONG counts[MAX_LUNS] = { 0 };
+    ULONG busiest = 0;
+    double lightMean[2] = { 0.0, 0.0 };
+    LONGLONG lightP99[2] = { 0, 0 };
+    ULONG i, run;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        TEST_ASSERT(ReadStream(argv[1]), "cannot read %s", argv[1]);
+    } else {
+        DefaultStream();
+    }
+
+    if (argc > 2) {
+        lunQueueDepth = strtoul(argv[2], NULL, 0);
+    }
+
+    TEST_ASSERT(SrbCount != 0, "%s", "no SRBs to replay");
+    TEST_ASSERT(lunQueueDepth != 0, "%s", "LUN queue depth must not be 0");
+
+    qsort(Srbs, SrbCount, sizeof(SRB), CompareArrival);
+
+    for (i = 0; i < SrbCount; i++) {
+        counts[Srbs[i].Target * LUN_DISPATCH_MAX_LUNS + Srbs[i].Lun]++;
+    }
+
+    for (i = 0; i < MAX_LUNS; i++) {
+        Luns[i].Latencies = malloc(max(counts[i], 1) * sizeof(LONGLONG));
+        TEST_ASSERT(Luns[i].Latencies != NULL, "%s", "out of memory");
+        if (counts[i] > counts[busiest]) {
+            busiest = i;
+        }
+    }
+
+    TEST_COMMENT("%lu SRBs, LUN queue depth %lu, dispatch limit %lu (%lu after %lu starts of one LUN alone)",
+                 (unsigned long)SrbCount, (unsigned long)lunQueueDepth,
+                 (unsigned long)LUN_FAIR_DEPTH(lunQueueDepth), (unsigned long)lunQueueDepth,
+                 (unsigned long)LUN_ALONE_STARTS(lunQueueDepth));
+
+    for (run = 0; run < 2; run++) {
+
+        TEST_ASSERT(Replay(lunQueueDepth, (BOOLEAN)run, Results[run]),
+                    "%s: requests were never started", Names[run]);
+
+        TEST_COMMENT("\n%s", Names[run]);
+        TEST_COMMENT("    %-7s %8s %10s %10s %10s %10s %6s", "tgt/lun", "requests", "MB/s", "mean us", "p99 us", "max us", "depth");
+
+        for (i = 0; i < MAX_LUNS; i++) {
+
+            if (Results[run][i].Requests == 0) {
+                continue;
+            }
+
+            TEST_COMMENT("    %3lu/%-3lu %8lu %10.1f %10.0f %10lld %10lld %6lu",
+                         (unsigned long)(i / LUN_DISPATCH_MAX_LUNS),
+                         (unsigned long)(i % LUN_DISPATCH_MAX_LUNS),
+                         (unsigned long)Results[run][i].Requests,
+                         (double)Results[run][i].Bytes / (double)max(Results[run][i].LastCompletion, 1),
+                         Results[run][i].MeanUs,
+                         Results[run][i].P99Us,
+                         Results[run][i].MaxUs,
+                         (unsigned long)Results[run][i].MaxOutstanding);
+
+            if (i != busiest) {
+                lightMean[run] = max(lightMean[run], Results[run][i].MeanUs);
+                lightP99[run] = max(lightP99[run], Results[run][i].P99Us);
+            }
+        }
+    }
+
+    //
+    //  The light LUNs must wait less, and the busy LUN must not finish
+    //  its requests more than 5% later.
+    //
+
+    if (lightMean[0] != 0.0) {
+        TEST_COMMENT("\nworst light LUN: mean %.0f -> %.0f us, p99 %lld -> %lld us",
+                     lightMean[0], lightMean[1], lightP99[0], lightP99[1]);
+
+        TEST_ASSERT(lightMean[1] < lightMean[0],
+                    "light LUN mean latency %.0f us with the limit, %.0f us without",
+                    lightMean[1], lightMean[0]);
+        TEST_ASSERT(lightP99[1] <= lightP99[0],
+                    "light LUN p99 latency %lld us with the limit, %lld us without",
+                    lightP99[1], lightP99[0]);
+    }
+
+    TEST_ASSERT(Results[1][busiest].LastCompletion * 100 <= Results[0][busiest].LastCompletion * 105,
+                "busy LUN finished at %lld us with the limit, %lld us without",
+                Results[1][busiest].LastCompletion, Results[0][busiest].LastCompletion);
+
+End:
+    for (i = 0; i < MAX_LUNS; i++) {
+        free(Luns[i].Latencies);
+    }
+
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}
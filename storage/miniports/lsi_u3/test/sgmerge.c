@@ -0,0 +1,379 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    sgmerge.c
+
+Abstract:
+
+    This file tests the scatter/gather element merging of lsi_u3 in user
+    mode.
+
+    ScatterGatherScriptSetup (lsi_u3.c) emits one script move per run of
+    physically contiguous elements, using MergeScatterGatherElements from
+    lsisg.h, which is built here unchanged. The program checks a set of
+    fixed lists with known results, then random lists against the rules a
+    move has to follow:
+
+    - the moves cover exactly the bytes of the elements, in order,
+    - no move is longer than MAX_XFER_LENGTH or crosses a 4GB boundary,
+    - two moves in a row could not have been one.
+
+    Usage: sgmerge [Lists]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+//  The Storport types lsisg.h uses.
+//
+
+typedef LARGE_INTEGER STOR_PHYSICAL_ADDRESS, *PSTOR_PHYSICAL_ADDRESS;
+
+typedef struct _STOR_SCATTER_GATHER_ELEMENT {
+    STOR_PHYSICAL_ADDRESS PhysicalAddress;
+    ULONG Length;
+    ULONG_PTR Reserved;
+} STOR_SCATTER_GATHER_ELEMENT, *PSTOR_SCATTER_GATHER_ELEMENT;
+
+#include "lsisiop.h"
+#include "lsisg.h"
+
+#define PAGE_SIZE               0x1000
+#define FOUR_GB                 0x100000000LL
+
+typedef struct _MOVE {
+    STOR_PHYSICAL_ADDRESS Address;
+    ULONG Length;
+} MOVE, *PMOVE;
+
+//
+//  A fixed list and the moves it must produce.
+//
+
+typedef struct _MERGE_CASE {
+    PCSTR Name;
+    ULONG NumberOfElements;
+    STOR_SCATTER_GATHER_ELEMENT Elements[4];
+    ULONG NumberOfMoves;
+    MOVE Moves[4];
+} MERGE_CASE, *PMERGE_CASE;
+
+#define E(_Address, _Length)    { { .QuadPart = (_Address) }, (_Length), 0 }
+#define M(_Address, _Length)    { { .QuadPart = (_Address) }, (_Length) }
+
+static const MERGE_CASE Cases[] = {
+    { "single element",
+      1, { E(0x10000, 0x200) },
+      1, { M(0x10000, 0x200) } },
+    { "contiguous pages",
+      4, { E(0x10000, 0x1000), E(0x11000, 0x1000), E(0x12000, 0x1000), E(0x13000, 0x1000) },
+      1, { M(0x10000, 0x4000) } },
+    { "gap in the middle",
+      4, { E(0x10000, 0x1000), E(0x11000, 0x1000), E(0x20000, 0x1000), E(0x21000, 0x800) },
+      2, { M(0x10000, 0x2000), M(0x20000, 0x1800) } },
+    { "descending pages",
+      3, { E(0x12000, 0x1000), E(0x11000, 0x1000), E(0x10000, 0x1000) },
+      3, { M(0x12000, 0x1000), M(0x11000, 0x1000), M(0x10000, 0x1000) } },
+    { "run across 4GB",
+      4, { E(0xFFFFE000, 0x1000), E(0xFFFFF000, 0x1000), E(0x100000000, 0x1000), E(0x100001000, 0x1000) },
+      2, { M(0xFFFFE000, 0x2000), M(0x100000000, 0x2000) } },
+    { "partial page ending at 4GB",
+      2, { E(0xFFFFFE00, 0x200), E(0x100000000, 0x1000) },
+      2, { M(0xFFFFFE00, 0x200), M(0x100000000, 0x1000) } },
+    { "run above 4GB",
+      3, { E(0x2FFFFD000, 0x1000), E(0x2FFFFE000, 0x1000), E(0x2FFFFF000, 0x1000) },
+      1, { M(0x2FFFFD000, 0x3000) } },
+    { "run up to the move count limit",
+      2, { E(0x1000000, MAX_XFER_LENGTH - 0x1000), E(0x1000000 + MAX_XFER_LENGTH - 0x1000, 0x1000) },
+      1, { M(0x1000000, MAX_XFER_LENGTH) } },
+    { "run over the move count limit",
+      3, { E(0x1000000, MAX_XFER_LENGTH - 0x800), E(0x1000000 + MAX_XFER_LENGTH - 0x800, 0x1000), E(0x1000000 + MAX_XFER_LENGTH + 0x800, 0x1000) },
+      2, { M(0x1000000, MAX_XFER_LENGTH - 0x800), M(0x1000000 + MAX_XFER_LENGTH - 0x800, 0x2000) } },
+};
+
+//
+//  Builds the moves the way ScatterGatherScriptSetup does.
+//
+
+static
+ULONG
+BuildMoves (
+    _In_reads_(NumberOfElements) PSTOR_SCATTER_GATHER_ELEMENT List,
+    _In_ ULONG NumberOfElements,
+    _Out_writes_(NumberOfElements) PMOVE Moves
+    )
+{
+    ULONG loop = 0;
+    ULONG moveCount = 0;
+
+    while (loop < NumberOfElements) {
+        loop = MergeScatterGatherElements(List,
+                                          NumberOfElements,
+                                          loop,
+                                          &Moves[moveCount].Address,
+                                          &Moves[moveCount].Length);
+        moveCount++;
+    }
+
+    return moveCount;
+}
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+//
+//  A random list as Storport could hand it out: up to MAX_SG_ELEMENTS
+//  elements of at most a page that do not cross a page, no more than
+//  MAX_XFER_LENGTH in all, mostly contiguous, and placed around a 4GB
+//  boundary often enough to hit it.
+//
+
+static
+ULONG
+RandomList (
+    _Out_writes_(MAX_SG_ELEMENTS) PSTOR_SCATTER_GATHER_ELEMENT List
+    )
+{
+    ULONG count = 1 + Random32() % MAX_SG_ELEMENTS;
+    ULONG total = 0;
+    LONGLONG address;
+    ULONG offset;
+    ULONG length;
+    ULONG i;
+
+    address = (LONGLONG)(Random32() % 4) * FOUR_GB - (LONGLONG)(Random32() % 8) * PAGE_SIZE;
+    if (address < 0) {
+        address += FOUR_GB;
+    }
+
+    offset = (Random32() % 2) ? (Random32() % PAGE_SIZE) & ~0x1FF : 0;
+
+    for (i = 0; i < count; i++) {
+
+        if ((i != 0) && (Random32() % 4 == 0)) {
+            address = (LONGLONG)(Random32() % 16) * FOUR_GB / 4 + (LONGLONG)(Random32() % 4096) * PAGE_SIZE;
+            offset = 0;
+        }
+
+        List[i].PhysicalAddress.QuadPart = address + offset;
+        List[i].Length = PAGE_SIZE - offset;
+        List[i].Reserved = 0;
+
+        if (Random32() % 8 == 0) {
+            length = 0x200 * (1 + Random32() % 8);
+            List[i].Length = min(List[i].Length, length);
+        }
+
+        if (List[i].Length > MAX_XFER_LENGTH - total) {
+            List[i].Length = MAX_XFER_LENGTH - total;
+        }
+
+        if (List[i].Length == 0) {
+            break;
+        }
+
+        total += List[i].Length;
+        address = List[i].PhysicalAddress.QuadPart + List[i].Length;
+        offset = (ULONG)(address & (PAGE_SIZE - 1));
+        address -= offset;
+    }
+
+    return i;
+}
+
+//
+//  Checks the moves built from a list follow the rules in the abstract.
+//  Returns NULL, or what is wrong.
+//
+
+static
+PCSTR
+CheckMoves (
+    _In_reads_(NumberOfElements) PSTOR_SCATTER_GATHER_ELEMENT List,
+    _In_ ULONG NumberOfElements,
+    _In_reads_(NumberOfMoves) PMOVE Moves,
+    _In_ ULONG NumberOfMoves
+    )
+{
+    ULONG element = 0;
+    ULONG move;
+    LONGLONG end;
+
+    for (move = 0; move < NumberOfMoves; move++) {
+
+        if ((Moves[move].Length == 0) || (Moves[move].Length > MAX_XFER_LENGTH)) {
+            return "move length out of range";
+        }
+
+        if (((Moves[move].Address.QuadPart + Moves[move].Length - 1) >> 32) != Moves[move].Address.HighPart) {
+            return "move crosses a 4GB boundary";
+        }
+
+        //
+        //  The move has to be made of the next elements, each starting
+        //  where the previous one ends.
+        //
+
+        if ((element >= NumberOfElements) ||
+            (List[element].PhysicalAddress.QuadPart != Moves[move].Address.QuadPart)) {
+            return "move does not start at the next element";
+        }
+
+        end = Moves[move].Address.QuadPart + Moves[move].Length;
+
+        while ((element < NumberOfElements) &&
+               (List[element].PhysicalAddress.QuadPart + List[element].Length <= end)) {
+
+            if ((element != 0) &&
+                (List[element].PhysicalAddress.QuadPart != Moves[move].Address.QuadPart) &&
+                (List[element].PhysicalAddress.QuadPart != List[element - 1].PhysicalAddress.QuadPart + List[element - 1].Length)) {
+                return "move covers a gap between elements";
+            }
+
+            if (List[element].PhysicalAddress.QuadPart + List[element].Length == end) {
+                element++;
+                break;
+            }
+
+            element++;
+        }
+
+        if (List[element - 1].PhysicalAddress.QuadPart + List[element - 1].Length != end) {
+            return "move does not end at an element boundary";
+        }
+
+        //
+        //  The next element must not have fit in this move.
+        //
+
+        if ((element < NumberOfElements) &&
+            (List[element].PhysicalAddress.QuadPart == end) &&
+            ((ULONGLONG)Moves[move].Length + List[element].Length <= MAX_XFER_LENGTH) &&
+            (((end + List[element].Length - 1) >> 32) == Moves[move].Address.HighPart)) {
+            return "move could have taken the next element";
+        }
+    }
+
+    if (element != NumberOfElements) {
+        return "moves do not cover all elements";
+    }
+
+    return NULL;
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static STOR_SCATTER_GATHER_ELEMENT list[MAX_SG_ELEMENTS];
+    static MOVE moves[MAX_SG_ELEMENTS];
+    ULONG lists = 1000000;
+    ULONG numberOfElements;
+    ULONG numberOfMoves;
+    ULONGLONG totalElements = 0;
+    ULONGLONG totalMoves = 0;
+    ULONG crossings = 0;
+    ULONG i, j;
+    PCSTR problem;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        lists = strtoul(argv[1], NULL, 0);
+    }
+
+    //
+    //  Fixed lists.
+    //
+
+    for (i = 0; i < ARRAYSIZE(Cases); i++) {
+
+        RtlCopyMemory(list, Cases[i].Elements, sizeof(Cases[i].Elements));
+
+        numberOfMoves = BuildMoves(list, Cases[i].NumberOfElements, moves);
+
+        TEST_ASSERT(numberOfMoves == Cases[i].NumberOfMoves,
+                    "%s: %lu moves, expected %lu",
+                    Cases[i].Name, (unsigned long)numberOfMoves, (unsigned long)Cases[i].NumberOfMoves);
+
+        for (j = 0; j < numberOfMoves; j++) {
+            TEST_ASSERT((moves[j].Address.QuadPart == Cases[i].Moves[j].Address.QuadPart) &&
+                        (moves[j].Length == Cases[i].Moves[j].Length),
+                        "%s: move %lu is 0x%llx/0x%lx, expected 0x%llx/0x%lx",
+                        Cases[i].Name, (unsigned long)j,
+                        (unsigned long long)moves[j].Address.QuadPart, (unsigned long)moves[j].Length,
+                        (unsigned long long)Cases[i].Moves[j].Address.QuadPart, (unsigned long)Cases[i].Moves[j].Length);
+        }
+
+        TEST_ASSERT(CheckMoves(list, Cases[i].NumberOfElements, moves, numberOfMoves) == NULL,
+                    "%s: %s", Cases[i].Name, CheckMoves(list, Cases[i].NumberOfElements, moves, numberOfMoves));
+    }
+
+    TEST_COMMENT("%lu fixed lists pass", (unsigned long)ARRAYSIZE(Cases));
+
+    //
+    //  Random lists.
+    //
+
+    srand(1);
+
+    for (i = 0; i < lists; i++) {
+
+        numberOfElements = RandomList(list);
+        numberOfMoves = BuildMoves(list, numberOfElements, moves);
+
+        problem = CheckMoves(list, numberOfElements, moves, numberOfMoves);
+
+        TEST_ASSERT(problem == NULL,
+                    "random list %lu (%lu elements, first at 0x%llx): %s",
+                    (unsigned long)i, (unsigned long)numberOfElements,
+                    (unsigned long long)list[0].PhysicalAddress.QuadPart, problem);
+
+        for (j = 1; j < numberOfMoves; j++) {
+            if ((moves[j].Address.QuadPart == moves[j - 1].Address.QuadPart + moves[j - 1].Length) &&
+                ((moves[j].Address.QuadPart & (FOUR_GB - 1)) == 0)) {
+                crossings++;
+            }
+        }
+
+        totalElements += numberOfElements;
+        totalMoves += numberOfMoves;
+    }
+
+    TEST_COMMENT("%lu random lists pass: %llu elements in %llu moves, %lu runs split at 4GB",
+                 (unsigned long)lists, (unsigned long long)totalElements,
+                 (unsigned long long)totalMoves, (unsigned long)crossings);
+
+End:
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}
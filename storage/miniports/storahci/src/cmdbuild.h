@@ -0,0 +1,239 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2009
+
+Module Name:
+
+    cmdbuild.h
+
+Abstract:
+
+    The parts of building a command that SRBtoATA_CFIS, SRBtoPRDT and
+    SRBtoCmdHeader do for every I/O: filling the CFIS from a task file,
+    mapping a scatter/gather list into the PRDT and filling the command
+    header.  These work on the command table, the command header and plain
+    values rather than on the SRB and the channel extension, so the user
+    mode test in ..\test builds this file as it is.
+
+Notes:
+
+Revision History:
+
+--*/
+
+
+#pragma once
+
+__inline
+VOID
+TaskFiletoATA_CFIS (
+    _Out_ PAHCI_H2D_REGISTER_FIS Cfis,
+    _In_ PATA_TASK_FILE TaskFile,
+    _In_ BOOLEAN Ncq,
+    _In_ UCHAR QueueTag,
+    _In_ BOOLEAN Fua
+    )
+/*++
+    Populates a CFIS with an ATA command from a task file.
+
+It performs:
+    (overview)
+    1 Fills in the CFIS structure
+    (details)
+    1.1 Map task file fields to CFIS fields
+    1.2 Special case mapping of NCQ
+--*/
+{
+    // 1.1 Map task file fields to CFIS fields
+    Cfis->FisType = 0x27;
+    Cfis->PMPort = 0;      // StorAHCI doesn't support Port Multiplier
+    Cfis->Reserved1 = 0;
+    Cfis->C = 1;
+    Cfis->Command = TaskFile->Current.bCommandReg;
+
+    // 1.2 Special case mapping of NCQ
+    if (Ncq) {
+
+        Cfis->Features = TaskFile->Current.bSectorCountReg;
+        Cfis->Features_Exp = TaskFile->Previous.bSectorCountReg;
+        Cfis->SectorCount = (QueueTag << 3);
+        Cfis->Dev_Head = 0xF & TaskFile->Current.bDriveHeadReg;
+        Cfis->Dev_Head |= (1 << 6);
+
+        if (Fua) {
+            Cfis->Dev_Head |= ATA_NCQ_FUA_BIT;
+        } else {
+            Cfis->Dev_Head &= ~ATA_NCQ_FUA_BIT;
+        }
+
+    } else {
+        Cfis->Features = TaskFile->Current.bFeaturesReg;
+        Cfis->Features_Exp = TaskFile->Previous.bFeaturesReg;
+        Cfis->SectorCount = TaskFile->Current.bSectorCountReg;
+        Cfis->SectorCount_Exp = TaskFile->Previous.bSectorCountReg;
+        Cfis->Dev_Head = TaskFile->Current.bDriveHeadReg;
+    }
+
+    // 1.1 Map task file fields to CFIS fields
+    Cfis->SectorNumber = TaskFile->Current.bSectorNumberReg;
+    Cfis->SecNum_Exp = TaskFile->Previous.bSectorNumberReg;
+
+    Cfis->CylLow = TaskFile->Current.bCylLowReg;
+    Cfis->CylLow_Exp = TaskFile->Previous.bCylLowReg;
+
+    Cfis->CylHigh = TaskFile->Current.bCylHighReg;
+    Cfis->CylHigh_Exp = TaskFile->Previous.bCylHighReg;
+
+    Cfis->ICC = 0;
+    Cfis->Control = 0; // Device control consists of the 48bit HighOrderByte, SRST and nIEN.  None apply here.
+
+    Cfis->Auxiliary7_0 = 0;
+    Cfis->Auxiliary15_8 = 0;
+    Cfis->Auxiliary23_16 = 0;
+    Cfis->Auxiliary31_24 = 0;
+}
+
+__inline
+ULONG
+SGLtoPRDT (
+    _Out_ PAHCI_COMMAND_TABLE CmdTable,
+    _In_ PLOCAL_SCATTER_GATHER_LIST Sgl,
+    _In_ ULONG DbauMask,
+    _Inout_ PULONG DataTransferLength
+    )
+/*++
+
+It assumes:
+    ScatterGatherList entries will not violate PRDT rules
+It performs:
+    (overview)
+    1 Verify the DataBuffer
+    2 Map SGL entries into PRDT entries
+    (details)
+    1.2 Verify that the DataBuffer is properly aligned
+    2.0 Fast path for SGLs of 1 or 2 aligned, even length entries
+    2.1 Map SGL entries into PRDT entries
+    2.2 Break up all 128K single entry IO into 2 64K IO entries
+    2.3 Verify that the DataLength is even
+
+    DbauMask is all ones if the controller supports 64 bit addresses and 0
+    otherwise. DataTransferLength is lowered by one for an odd length entry.
+
+Return Values:
+    The number of entries generated to fill the PRDT
+    If the value returned is -1 the PRDT could not be built.
+--*/
+{
+    ULONG i;
+
+    // 2.0 Most IOs have 1 or 2 entries. If they are all word aligned, have even lengths and none needs the 128K split, map them directly.
+    if (Sgl->NumberOfElements == 1) {
+        if (((Sgl->List[0].PhysicalAddress.LowPart | Sgl->List[0].Length) & 0x1) == 0 &&
+            (Sgl->List[0].Length != 0x20000)) {
+            CmdTable->PRDT[0].DBA.AsUlong = Sgl->List[0].PhysicalAddress.LowPart;
+            CmdTable->PRDT[0].DBAU = Sgl->List[0].PhysicalAddress.HighPart & DbauMask;
+            CmdTable->PRDT[0].DI.DBC = Sgl->List[0].Length - 1;
+            return 1;
+        }
+    } else if (Sgl->NumberOfElements == 2) {
+        if (((Sgl->List[0].PhysicalAddress.LowPart | Sgl->List[0].Length |
+              Sgl->List[1].PhysicalAddress.LowPart | Sgl->List[1].Length) & 0x1) == 0 &&
+            (Sgl->List[0].Length != 0x20000) &&
+            (Sgl->List[1].Length != 0x20000)) {
+            CmdTable->PRDT[0].DBA.AsUlong = Sgl->List[0].PhysicalAddress.LowPart;
+            CmdTable->PRDT[0].DBAU = Sgl->List[0].PhysicalAddress.HighPart & DbauMask;
+            CmdTable->PRDT[0].DI.DBC = Sgl->List[0].Length - 1;
+            CmdTable->PRDT[1].DBA.AsUlong = Sgl->List[1].PhysicalAddress.LowPart;
+            CmdTable->PRDT[1].DBAU = Sgl->List[1].PhysicalAddress.HighPart & DbauMask;
+            CmdTable->PRDT[1].DI.DBC = Sgl->List[1].Length - 1;
+            return 2;
+        }
+    }
+
+    for (i = 0; i < Sgl->NumberOfElements; i++) {
+        // 1.2 Verify that the DataBuffer is properly aligned
+        if ((Sgl->List[i].PhysicalAddress.LowPart & 0x1) == 0) {
+            // 2.1 Map SGL entries into PRDT entries
+            if (Sgl->List[i].Length != 0x20000) {
+                CmdTable->PRDT[i].DBA.AsUlong = Sgl->List[i].PhysicalAddress.LowPart;
+                CmdTable->PRDT[i].DBAU = Sgl->List[i].PhysicalAddress.HighPart & DbauMask;
+            // 2.2 Break up a 128K single entry IO into 2 64K IO entries (128K is max transfer so there can be only 1 in any SGL)
+            //     although one entry can represent at max 4M length IO, some adapters cannot handle a DBC >= 128K.
+            } else {
+                // Entry 0
+                CmdTable->PRDT[0].DBA.AsUlong = Sgl->List[0].PhysicalAddress.LowPart;
+                CmdTable->PRDT[0].DBAU = Sgl->List[0].PhysicalAddress.HighPart & DbauMask;
+                CmdTable->PRDT[0].DI.DBC = (0x10000 - 1);
+                // Entry 1
+                CmdTable->PRDT[1].DBA.AsUlong = (Sgl->List[0].PhysicalAddress.LowPart + 0x10000);
+                CmdTable->PRDT[1].DBAU = (ULONG)((Sgl->List[0].PhysicalAddress.QuadPart + 0x10000) >> 32) & DbauMask;   //the high part is 1 larger if adding 0x10000 caused a rollover
+                CmdTable->PRDT[1].DI.DBC = (0x10000 - 1);
+                return 2;
+            }
+        } else {
+            NT_ASSERT(FALSE); //Shall Not Pass
+            return (ULONG)-1;
+        }
+
+        // 1.3 Verify that the DataLength is even
+        //     all SATA transfers must be even
+        //     DBC is a 0 based number (i.e. 0 is 1, 1 is 2, etc.
+        //     Sgl->Elements.Length is not (i.e. 0 is 0, 1 is 1, etc.
+        if ((Sgl->List[i].Length & 1) == 0) {                    //therefore length must be even here
+            // 2.3 Set Datalength in the PRDT entries
+            CmdTable->PRDT[i].DI.DBC = Sgl->List[i].Length - 1;         //but it must be odd here
+        } else if (Sgl->List[i].Length <= *DataTransferLength) {
+            // Storport may send down SCSI commands with odd number of data transfer length, and it builds SGL using that transfer length value.
+            // we use the length -1 to get as much data as we can. If the data length is over (length - 1), buffer overrun will be reported when the command is completed.
+            *DataTransferLength = *DataTransferLength - 1;
+            CmdTable->PRDT[i].DI.DBC = Sgl->List[i].Length - 2;
+        } else {
+            NT_ASSERT(FALSE); //Shall Not Pass
+            return (ULONG)-1;
+        }
+    }
+
+    return Sgl->NumberOfElements;
+}
+
+__inline
+VOID
+FillCmdHeader (
+    _Out_ PAHCI_COMMAND_HEADER CmdHeader,
+    _In_ ULONG Length,
+    _In_ BOOLEAN Atapi,
+    _In_ BOOLEAN Write,
+    _In_ BOOLEAN Reset
+    )
+/*++
+It performs:
+    Steps defined in AHCI 1.2 section 5.5.1 step #3
+--*/
+{
+    // a. PRDTL containing the number of entries in the PRD table
+    CmdHeader->DI.PRDTL = Length;
+    // b. CFL set to the length of the command in the CFIS area
+    CmdHeader->DI.CFL = 5;
+    // c. A bit set if it is an ATAPI command
+    CmdHeader->DI.A = Atapi ? 1 : 0;
+    // d. W (Write) bit set if data is going to the device
+    CmdHeader->DI.W = Write ? 1 : 0;
+    // e. P (Prefetch) bit optionally set (see rules in section 5.5.2)
+    //Some controllers have problems if P is set.
+    CmdHeader->DI.P = 0;
+    // f. If a Port Multiplier is attached, the PMP field set to the correct Port Multiplier port.
+    CmdHeader->DI.PMP = 0;
+
+    // Reset
+    CmdHeader->DI.R = Reset;
+    CmdHeader->DI.B = 0;
+    CmdHeader->DI.C = Reset;
+
+    // Initialize the PRD byte count
+    CmdHeader->PRDBC = 0;
+
+    CmdHeader->Reserved[0] = 0;
+    CmdHeader->Reserved[1] = 0;
+    CmdHeader->Reserved[2] = 0;
+    CmdHeader->Reserved[3] = 0;
+}
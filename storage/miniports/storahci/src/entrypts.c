@@ -408,6 +408,7 @@ It performs:
     3.3 get biggest port number
     3.4 Initializing the rest of PORT_CONFIGURATION_INFORMATION
     3.5 Register Power Setting Change Notification Guids
+    3.6 Read Command Completion Coalescing settings from registry, it's programmed in AhciHwInitialize
     4.1 Turn on IE, pending interrupts will be cleared when port starts
         This has to be done after 3.2 because we need to know the number of channels before we check each PxIS.
         Verify that none of the PxIS registers are loaded, but take no action
@@ -545,6 +546,7 @@ Note:
     adapterExtension->Version.AsUlong = StorPortReadRegisterUlong(adapterExtension, &abar->VS.AsUlong);
     adapterExtension->CAP.AsUlong = StorPortReadRegisterUlong(adapterExtension, &abar->CAP.AsUlong);
     adapterExtension->CAP2.AsUlong = StorPortReadRegisterUlong(adapterExtension, &abar->CAP2.AsUlong);
+    adapterExtension->DbauMask = adapterExtension->CAP.S64A ? MAXULONG : 0;
 
     //3.1 Turn on AE (AHCI 1.1 Section 10.1.2 - 1)
     ghc.AsUlong = StorPortReadRegisterUlong(adapterExtension, &abar->GHC.AsUlong);
@@ -690,6 +692,9 @@ Note:
         StorPortSetPowerSettingNotificationGuids(AdapterExtension, 2, powerSettingChangeGuids);
     }
 
+    //3.6 Read Command Completion Coalescing settings
+    AhciAdapterGetCccSettings(adapterExtension);
+
     //4.1 Turn on IE, pending interrupts will be cleared when port starts
     adapterExtension->LastInterruptedPort = (ULONG)(-1);
     ghc.IE = 1;
@@ -821,6 +826,11 @@ AhciHwInitialize (
     //
     GetInterruptMode(adapterExtension);
 
+    //
+    // Command Completion Coalescing depends on the interrupt mode.
+    //
+    AhciAdapterInitializeCcc(adapterExtension);
+
     StorPortEnablePassiveInitialization(AdapterExtension, AhciHwPassiveInitialize);
 
     //
@@ -2017,13 +2027,14 @@ AhciHwStartIo (
 
 VOID
 __inline
-AhciInterruptHandler(
+AhciPortInterruptHandler(
     _In_ PAHCI_CHANNEL_EXTENSION ChannelExtension
     )
 /*++
 Routine Description:
 
-    AhciInterruptHandler is the interrupt handler for a port.
+    AhciPortInterruptHandler handles the interrupt on a port.
+    It doesn't count the interrupt, callers account for the interrupt they were called for.
 
     If the miniport driver requires a large amount of time to process the interrupt it must defer processing to a worker routine.
     This routine must attempt one clear the interrupt on the HBA before it returns TRUE.
@@ -2033,8 +2044,8 @@ NOTE:
     The miniport could however request for a worker routine and make the calls in the worker routine.
 
 Called by:
-    AhciHwInterrupt
-    AhciHwMSIInterrupt
+    AhciInterruptHandler
+    AhciCccInterrupt
 
 It performs:
     (overview)
@@ -2452,6 +2463,8 @@ Return Values:
     outstanding = ci | sact;
 
     if ((ChannelExtension->SlotManager.CommandsIssued & (~outstanding)) > 0) {
+        ChannelExtension->TotalCountCommandCompletion += NumberOfSetBits(ChannelExtension->SlotManager.CommandsIssued & ~outstanding);
+
         // all completed commands by hardware will be marked completed
         ChannelExtension->SlotManager.CommandsToComplete |= (ChannelExtension->SlotManager.CommandsIssued & ~outstanding);
         ChannelExtension->SlotManager.CommandsIssued &= outstanding;
@@ -2476,6 +2489,99 @@ Return Values:
     return;
 }
 
+VOID
+__inline
+AhciInterruptHandler(
+    _In_ PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+Routine Description:
+
+    AhciInterruptHandler is the interrupt handler for a port, for an interrupt raised by that port.
+
+Called by:
+    AhciHwInterrupt
+    AhciHwMSIInterrupt
+
+It performs:
+    1. Count the interrupt on the port
+    2. Handle the interrupt
+
+Return Values:
+    None
+
+--*/
+{
+    ChannelExtension->TotalCountInterrupt++;
+
+    AhciPortInterruptHandler(ChannelExtension);
+
+    return;
+}
+
+BOOLEAN
+AhciCccInterrupt (
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension,
+    _In_ ULONG InterruptStatus
+    )
+/*++
+
+Routine Description:
+
+    Command Completion Coalescing interrupt handler
+
+Arguments:
+
+    AdapterExtension -
+    InterruptStatus - value of the IS register when the interrupt was taken
+
+Called by:
+    AhciHwInterrupt
+
+It performs:
+    1. Clear and count the CCC interrupt
+       It's counted once for the adapter, not on each port it gets handled on.
+    2. Invoke the port interrupt handler for every started port with commands outstanding or interrupt pending
+    3. Adjust CCC to the completion rate
+
+Return Values:
+    TRUE always.
+--*/
+{
+    ULONG                   i;
+    ULONG                   completions;
+    PAHCI_CHANNEL_EXTENSION channelExtension;
+
+    //1. Clear and count the CCC interrupt
+    StorPortWriteRegisterUlong(AdapterExtension, AdapterExtension->IS, (1 << AdapterExtension->Ccc.Interrupt));
+
+    AdapterExtension->Ccc.TotalCountInterrupt++;
+
+    //2. Handle completions on all ports
+    completions = 0;
+
+    for (i = 0; i <= AdapterExtension->HighestPort; i++) {
+        channelExtension = AdapterExtension->PortExtension[i];
+
+        if (!IsPortStartCapable(channelExtension)) {
+            continue;
+        }
+
+        if (((InterruptStatus & (1 << i)) != 0) || (channelExtension->SlotManager.CommandsIssued != 0)) {
+            completions -= channelExtension->TotalCountCommandCompletion;
+
+            AhciPortInterruptHandler(channelExtension);
+
+            completions += channelExtension->TotalCountCommandCompletion;
+        }
+    }
+
+    //3. Adjust CCC
+    AhciAdapterTuneCcc(AdapterExtension, completions, TRUE);
+
+    return TRUE;
+}
+
 BOOLEAN
 AhciHwInterrupt (
     _In_ PVOID AdapterExtension
@@ -2507,6 +2613,7 @@ Return Values:
     ULONG                   interruptPorts;
     ULONG                   i;
     UCHAR                   interruptPortCount;
+    ULONG                   completions;
 
     PAHCI_ADAPTER_EXTENSION adapterExtension = (PAHCI_ADAPTER_EXTENSION)AdapterExtension;
 
@@ -2516,6 +2623,15 @@ Return Values:
         return FALSE;
     }
 
+    //
+    // A CCC interrupt is reported in the IS bit of an unimplemented port, and covers command completions on all ports.
+    //
+    if ((adapterExtension->Ccc.TimeoutValue != 0) &&
+        ((is & (1 << adapterExtension->Ccc.Interrupt)) != 0) &&
+        (is != MAXULONG)) {
+        return AhciCccInterrupt(adapterExtension, is);
+    }
+
     interruptPorts = (is & adapterExtension->PortImplemented);
 
     //
@@ -2555,8 +2671,15 @@ Return Values:
 
     adapterExtension->LastInterruptedPort = i;
 
+    completions = adapterExtension->PortExtension[i]->TotalCountCommandCompletion;
+
     AhciInterruptHandler(adapterExtension->PortExtension[i]);
 
+    if (adapterExtension->Ccc.TimeoutValue != 0) {
+        completions = adapterExtension->PortExtension[i]->TotalCountCommandCompletion - completions;
+        AhciAdapterTuneCcc(adapterExtension, completions, FALSE);
+    }
+
     return TRUE;
 }
 
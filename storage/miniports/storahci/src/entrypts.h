@@ -50,6 +50,18 @@ Authors:
 
 #define AHCI_PORT_WAIT_ON_DET_COUNT         3       // in unit of 10ms, default 30ms.
 
+// Command Completion Coalescing (CCC) is opt-in through the adapter registry value below, which gives CCC_CTL.TV in ms.
+// The number of completions per CCC interrupt is re-evaluated from the completion rate every AHCI_CCC_TUNING_INTERVAL_IN_MS;
+// below AHCI_CCC_IOPS_THRESHOLD, or when fewer than two commands per coalesced interrupt are outstanding, CCC stays disabled
+// so that low queue depth I/O still gets one interrupt per command.
+
+#define AHCI_CCC_REG_VALUE_NAME             "CommandCompletionCoalescingTimeout"
+#define AHCI_CCC_MAX_TIMEOUT_IN_MS          10
+#define AHCI_CCC_TUNING_INTERVAL_IN_MS      100
+#define AHCI_CCC_IOPS_THRESHOLD             20000
+#define AHCI_CCC_TARGET_INTERRUPT_RATE      4000    // interrupts per second the completion count is sized for
+#define AHCI_CCC_MAX_COMPLETIONS            32
+
 
 // port start states
 #define WaitOnDET       0x11
@@ -499,6 +511,10 @@ typedef struct _AHCI_CHANNEL_EXTENSION {
     LARGE_INTEGER           LastTimeStampDpcStart;
     LARGE_INTEGER           LastTimeStampDpcCompletion;
 
+//Statistics for interrupts per command, recorded by RecordInterruptHistory.
+    ULONG                   TotalCountInterrupt;
+    ULONG                   TotalCountCommandCompletion;
+
 } AHCI_CHANNEL_EXTENSION, *PAHCI_CHANNEL_EXTENSION;
 
 typedef struct _ADAPTER_STATE_FLAGS {
@@ -582,6 +598,7 @@ typedef struct _AHCI_ADAPTER_EXTENSION {
     PULONG                  IS;
     AHCI_HBA_CAPABILITIES   CAP;
     AHCI_HBA_CAPABILITIES2  CAP2;
+    ULONG                   DbauMask;               //applied to the high part of data addresses in PRD entries: all ones if CAP.S64A, otherwise 0
 
 //Channel Extensions
     PAHCI_CHANNEL_EXTENSION PortExtension[AHCI_MAX_PORT_COUNT];
@@ -592,6 +609,17 @@ typedef struct _AHCI_ADAPTER_EXTENSION {
 //buffer to preserve MSI message affinity information.
     PGROUP_AFFINITY         MessageGroupAffinity;
 
+//Command Completion Coalescing. TimeoutValue is 0 if CCC is not used on this adapter.
+    struct {
+        USHORT              ConfiguredTimeoutValue; // from registry, read in AhciHwFindAdapter
+        USHORT              TimeoutValue;           // CCC_CTL.TV, in ms
+        UCHAR               Interrupt;              // CCC_CTL.INT, the IS bit that CCC interrupts are reported in
+        UCHAR               Completions;            // CCC_CTL.CC currently programmed, 0 when CCC is disabled
+        ULONG               IntervalCompletions;    // commands completed since IntervalStart
+        LARGE_INTEGER       IntervalStart;
+        ULONG               TotalCountInterrupt;    // CCC interrupts taken, recorded by RecordInterruptHistory
+    } Ccc;
+
 } AHCI_ADAPTER_EXTENSION, *PAHCI_ADAPTER_EXTENSION;
 
 // information that will be transferred to dump/hibernate environment
@@ -26,6 +26,7 @@ Revision History:
 #include "ntddscsi.h"
 #include "ntddstor.h"
 #include "srbhelper.h"
+#include <intrin.h>
 
 
 // storahci header files
@@ -35,6 +36,8 @@ Revision History:
 #include "pnppower.h"
 #include "hbastat.h"
 #include "io.h"
+#include "slots.h"
+#include "cmdbuild.h"
 #include "util.h"
 
 //
@@ -44,62 +44,17 @@ Affected Variables/Registers:
 Return Value:
 --*/
 {
-    UCHAR activeCount = 0;
-    UCHAR emptyCount;
-    UCHAR requestCount;
-    UCHAR lastActiveSlot;
-    ULONG slotToActivate = 0;
-    UCHAR i;
-
     // 1. Device's queue depth is smaller than Controller's
 
     NT_ASSERT(ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth <= ChannelExtension->AdapterExtension->CAP.NCS);
-
-    // Count the number of slots already in use
-    if (ChannelExtension->SlotManager.CommandsIssued > 0) {
-        activeCount = NumberOfSetBits(ChannelExtension->SlotManager.CommandsIssued);
-    }
-
-    // 1.1 Check if all slots are active.
-    if (activeCount >= ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth) {
-        // If all possible slots are full, no matter what, return no work (0)
-        return 0;
-    }
-
-    // 2. Look for any entry from last active slot
-    requestCount = NumberOfSetBits(TargetSlots);
-    lastActiveSlot = ChannelExtension->LastActiveSlot;
-    emptyCount = ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth - activeCount;
-
-    // 3.1 Look for any entry from last active slot
-    for (i = lastActiveSlot; i <= ChannelExtension->AdapterExtension->CAP.NCS; i++) {
-        if ((TargetSlots & (1 << i)) > 0) {
-            slotToActivate |= (1 << i);
-            emptyCount--;
-            requestCount--;
-            if (emptyCount == 0 || requestCount == 0) {
-                ChannelExtension->LastActiveSlot = i;
-                return slotToActivate;
-            }
-        }
-    }
-
-    // 3.2 Look for any entry from beginning to last active slot
-    // Slot 0 is reserved for internal command
-    for (i = 1 ; i <= lastActiveSlot; i++) {
-        if ((TargetSlots & (1 << i)) > 0) {
-            slotToActivate |= (1 << i);
-            emptyCount--;
-            requestCount--;
-            if (emptyCount == 0 || requestCount == 0) {
-                ChannelExtension->LastActiveSlot = i;
-                return slotToActivate;
-            }
-        }
-    }
-
-    NT_ASSERT(FALSE);
-    return slotToActivate;
+    NT_ASSERT((TargetSlots & ~(1 << 0)) != 0);
+
+    // 2. Choose slots from last active slot, see slots.h
+    return SelectSlotsToActivate(TargetSlots,
+                                 ChannelExtension->SlotManager.CommandsIssued,
+                                 (UCHAR)ChannelExtension->AdapterExtension->CAP.NCS,
+                                 (UCHAR)ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth,
+                                 &ChannelExtension->LastActiveSlot);
 }
 
 
@@ -275,6 +230,42 @@ RemoveQueue(
     return (PSTORAGE_REQUEST_BLOCK)nextSrb;
 }
 
+PSTORAGE_REQUEST_BLOCK
+DetachQueue(
+    _In_ PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    _Inout_ PSTORAHCI_QUEUE Queue,
+    _In_ ULONG Signature,
+    _In_ UCHAR Tag
+    )
+/*
+    Removes all Srbs from the Queue at once and returns the first one. The returned Srbs stay chained
+    in queue order through their NextSrb field; the caller unlinks each one before using it.
+*/
+{
+    PVOID firstSrb;
+
+    UNREFERENCED_PARAMETER(ChannelExtension);
+
+    // Check to see if the queue is empty
+    if (Queue->Head == NULL) {
+        return NULL;
+    }
+
+    StorPortQuerySystemTime(&(Queue->LastTimeStampRemoveQueue));
+
+    firstSrb = Queue->Head;
+    Queue->Head = NULL;
+    Queue->Tail = NULL;
+    Queue->CurrentDepth = 0;
+
+    Queue->DepthHistory[Queue->DepthHistoryIndex] = ( (Tag << 24) | Queue->CurrentDepth );
+    Queue->DepthHistoryIndex++;
+    Queue->DepthHistoryIndex %= 100;
+    Queue->DepthHistory[Queue->DepthHistoryIndex] = Signature;
+
+    return (PSTORAGE_REQUEST_BLOCK)firstSrb;
+}
+
 
 BOOLEAN
 ActivateQueue(
@@ -722,52 +713,12 @@ Affected Variables/Registers:
     UNREFERENCED_PARAMETER(ChannelExtension);
 
     // 1.1 Map SRB fields to CFIS fields
-    cmdTable->CFIS.FisType = 0x27;
-    cmdTable->CFIS.PMPort = 0;      // StorAHCI doesn't support Port Multiplier
-    cmdTable->CFIS.Reserved1 = 0;
-    cmdTable->CFIS.C = 1;
-    cmdTable->CFIS.Command = srbExtension->TaskFile.Current.bCommandReg;
-
     // 1.2 Special case mapping of NCQ
-    if (IsNCQCommand(srbExtension)) {
-
-        cmdTable->CFIS.Features = srbExtension->TaskFile.Current.bSectorCountReg;
-        cmdTable->CFIS.Features_Exp = srbExtension->TaskFile.Previous.bSectorCountReg;
-        cmdTable->CFIS.SectorCount = (srbExtension->QueueTag << 3);
-        cmdTable->CFIS.Dev_Head = 0xF & srbExtension->TaskFile.Current.bDriveHeadReg;
-        cmdTable->CFIS.Dev_Head |= (1 << 6);
-
-        if (SlotContent->StateFlags.FUA) {
-            cmdTable->CFIS.Dev_Head |= ATA_NCQ_FUA_BIT;
-        } else {
-            cmdTable->CFIS.Dev_Head &= ~ATA_NCQ_FUA_BIT;
-        }
-
-    } else {
-        cmdTable->CFIS.Features = srbExtension->TaskFile.Current.bFeaturesReg;
-        cmdTable->CFIS.Features_Exp = srbExtension->TaskFile.Previous.bFeaturesReg;
-        cmdTable->CFIS.SectorCount = srbExtension->TaskFile.Current.bSectorCountReg;
-        cmdTable->CFIS.SectorCount_Exp = srbExtension->TaskFile.Previous.bSectorCountReg;
-        cmdTable->CFIS.Dev_Head = srbExtension->TaskFile.Current.bDriveHeadReg;
-    }
-
-    // 1.1 Map SRB fields to CFIS fields
-    cmdTable->CFIS.SectorNumber = srbExtension->TaskFile.Current.bSectorNumberReg;
-    cmdTable->CFIS.SecNum_Exp = srbExtension->TaskFile.Previous.bSectorNumberReg;
-
-    cmdTable->CFIS.CylLow = srbExtension->TaskFile.Current.bCylLowReg;
-    cmdTable->CFIS.CylLow_Exp = srbExtension->TaskFile.Previous.bCylLowReg;
-
-    cmdTable->CFIS.CylHigh = srbExtension->TaskFile.Current.bCylHighReg;
-    cmdTable->CFIS.CylHigh_Exp = srbExtension->TaskFile.Previous.bCylHighReg;
-
-    cmdTable->CFIS.ICC = 0;
-    cmdTable->CFIS.Control = 0; // Device control consists of the 48bit HighOrderByte, SRST and nIEN.  None apply here.
-
-    cmdTable->CFIS.Auxiliary7_0 = 0;
-    cmdTable->CFIS.Auxiliary15_8 = 0;
-    cmdTable->CFIS.Auxiliary23_16 = 0;
-    cmdTable->CFIS.Auxiliary31_24 = 0;
+    TaskFiletoATA_CFIS(&cmdTable->CFIS,
+                       &srbExtension->TaskFile,
+                       IsNCQCommand(srbExtension),
+                       srbExtension->QueueTag,
+                       (BOOLEAN)SlotContent->StateFlags.FUA);
 }
 
 VOID
@@ -944,6 +895,7 @@ It performs:
     (details)
     1.1 Get the ScatterGatherList
     1.2 Verify that the DataBuffer is properly aligned
+    2.0 Fast path for SGLs of 1 or 2 aligned, even length entries
     2.1 Map SGL entries into PRDT entries
     2.2 Break up all 128K single entry IO into 2 64K IO entries
     2.3 Verify that the DataLength is even
@@ -955,10 +907,12 @@ Return Values:
     If the value returned is -1 the PRDT could not be built.
 --*/
 {
-    ULONG i;
+    ULONG length;
+    ULONG dataTransferLength;
     PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(SlotContent->Srb);
     PAHCI_COMMAND_TABLE cmdTable = (PAHCI_COMMAND_TABLE)srbExtension;
     PLOCAL_SCATTER_GATHER_LIST sgl = srbExtension->Sgl;
+    ULONG dbauMask = ChannelExtension->AdapterExtension->DbauMask;  //DBAU is only written with the high part if the controller supports 64 bits
 
     if (sgl == NULL) {
         // Return as invalid request in case of cannot get scatter gather list.
@@ -966,60 +920,16 @@ Return Values:
         return (ULONG)-1;
     }
 
-    for (i = 0; i < sgl->NumberOfElements; i++) {
-        // 1.2 Verify that the DataBuffer is properly aligned
-        if ((sgl->List[i].PhysicalAddress.LowPart & 0x1) == 0) {
-            // 2.1 Map SGL entries into PRDT entries
-            if (sgl->List[i].Length != 0x20000) {
-                cmdTable->PRDT[i].DBA.AsUlong = sgl->List[i].PhysicalAddress.LowPart;
-                if (ChannelExtension->AdapterExtension->CAP.S64A) {//If the controller supports 64 bits, write the high part too
-                    cmdTable->PRDT[i].DBAU = sgl->List[i].PhysicalAddress.HighPart;
-                }
-            // 2.2 Break up a 128K single entry IO into 2 64K IO entries (128K is max transfer so there can be only 1 in any SGL)
-            //     although one entry can represent at max 4M length IO, some adapters cannot handle a DBC >= 128K.
-            } else {
-                // Entry 0
-                cmdTable->PRDT[0].DBA.AsUlong = sgl->List[0].PhysicalAddress.LowPart;
-                if (ChannelExtension->AdapterExtension->CAP.S64A) {//If the controller supports 64 bits, write the high part too
-                    cmdTable->PRDT[0].DBAU = sgl->List[0].PhysicalAddress.HighPart;
-                }
-                cmdTable->PRDT[0].DI.DBC = (0x10000 - 1);
-                // Entry 1
-                cmdTable->PRDT[1].DBA.AsUlong = (sgl->List[0].PhysicalAddress.LowPart + 0x10000);
-                if (ChannelExtension->AdapterExtension->CAP.S64A) {//If the controller supports 64 bits, write the high part too
-                    if ((sgl->List[0].PhysicalAddress.LowPart + 0x10000) < sgl->List[0].PhysicalAddress.LowPart) {
-                        cmdTable->PRDT[1].DBAU = (sgl->List[0].PhysicalAddress.HighPart + 1); //add 1 to the highpart if adding 0x10000 caused a rollover
-                    } else {
-                        cmdTable->PRDT[1].DBAU = sgl->List[0].PhysicalAddress.HighPart;
-                    }
-                }
-                cmdTable->PRDT[1].DI.DBC = (0x10000 - 1);
-                return 2;
-            }
-        } else {
-            NT_ASSERT(FALSE); //Shall Not Pass
-            return (ULONG)-1;
-        }
+    // 2.0 Fast path for SGLs of 1 or 2 aligned, even length entries
+    // 2.1 - 2.3 Map SGL entries into PRDT entries
+    dataTransferLength = RequestGetDataTransferLength(SlotContent->Srb);
+    length = SGLtoPRDT(cmdTable, sgl, dbauMask, &dataTransferLength);
 
-        // 1.3 Verify that the DataLength is even
-        //     all SATA transfers must be even
-        //     DBC is a 0 based number (i.e. 0 is 1, 1 is 2, etc.
-        //     sgl->Elements.Length is not (i.e. 0 is 0, 1 is 1, etc.
-        if ((sgl->List[i].Length & 1) == 0) {                    //therefore length must be even here
-            // 2.3 Set Datalength in the PRDT entries
-            cmdTable->PRDT[i].DI.DBC = sgl->List[i].Length - 1;         //but it must be odd here
-        } else if (sgl->List[i].Length <= RequestGetDataTransferLength(SlotContent->Srb)) {
-            // Storport may send down SCSI commands with odd number of data transfer length, and it builds SGL using that transfer length value.
-            // we use the length -1 to get as much data as we can. If the data length is over (length - 1), buffer overrun will be reported when the command is completed.
-            RequestSetDataTransferLength(SlotContent->Srb, RequestGetDataTransferLength(SlotContent->Srb) - 1);
-            cmdTable->PRDT[i].DI.DBC = sgl->List[i].Length - 2;
-        } else {
-            NT_ASSERT(FALSE); //Shall Not Pass
-            return (ULONG)-1;
-        }
+    if (dataTransferLength != RequestGetDataTransferLength(SlotContent->Srb)) {
+        RequestSetDataTransferLength(SlotContent->Srb, dataTransferLength);
     }
 
-    return sgl->NumberOfElements;
+    return length;
 }
 
 VOID
@@ -1046,32 +956,12 @@ Affected Variables/Registers:
 
     UNREFERENCED_PARAMETER(ChannelExtension);
 
-    // a. PRDTL containing the number of entries in the PRD table
-    cmdHeader->DI.PRDTL = Length;
-    // b. CFL set to the length of the command in the CFIS area
-    cmdHeader->DI.CFL = 5;
-    // c. A bit set if it is an ATAPI command
-    cmdHeader->DI.A = (srbExtension->AtaFunction & ATA_FUNCTION_ATAPI_COMMAND) ? 1 : 0;
-    // d. W (Write) bit set if data is going to the device
-    cmdHeader->DI.W = (srbExtension->Flags & ATA_FLAGS_DATA_OUT) ? 1 : 0;
-    // e. P (Prefetch) bit optionally set (see rules in section 5.5.2)
-    //Some controllers have problems if P is set.
-    cmdHeader->DI.P = 0;
-    // f. If a Port Multiplier is attached, the PMP field set to the correct Port Multiplier port.
-    cmdHeader->DI.PMP = 0;
-
-    // Reset
-    cmdHeader->DI.R = Reset;
-    cmdHeader->DI.B = 0;
-    cmdHeader->DI.C = Reset;
-
-    // Initialize the PRD byte count
-    cmdHeader->PRDBC = 0;
-
-    cmdHeader->Reserved[0] = 0;
-    cmdHeader->Reserved[1] = 0;
-    cmdHeader->Reserved[2] = 0;
-    cmdHeader->Reserved[3] = 0;
+    // Steps defined in AHCI 1.2 section 5.5.1 step #3
+    FillCmdHeader(cmdHeader,
+                  Length,
+                  (srbExtension->AtaFunction & ATA_FUNCTION_ATAPI_COMMAND) ? TRUE : FALSE,
+                  (srbExtension->Flags & ATA_FLAGS_DATA_OUT) ? TRUE : FALSE,
+                  Reset);
 }
 
 BOOLEAN
@@ -1518,6 +1408,7 @@ AhciPortSrbCompletionDpcRoutine(
     PAHCI_CHANNEL_EXTENSION channelExtension = (PAHCI_CHANNEL_EXTENSION)SystemArgument1;
     STOR_LOCK_HANDLE lockhandle = { InterruptLock, 0 };
     PSTORAGE_REQUEST_BLOCK srb = NULL;
+    PSTORAGE_REQUEST_BLOCK batch = NULL;
     PSRB_COMPLETION_ROUTINE completionRoutine = NULL;
     BOOLEAN reservedSlotInUse = FALSE;
     BOOLEAN sendCommand = FALSE;
@@ -1544,15 +1435,26 @@ AhciPortSrbCompletionDpcRoutine(
     reservedSlotInUse = (channelExtension->StateFlags.ReservedSlotInUse == 1);
 
     do {
-        AhciInterruptSpinlockAcquire(channelExtension->AdapterExtension, channelExtension->PortNumber, &lockhandle);
-        srb = RemoveQueue(channelExtension, &channelExtension->CompletionQueue, 0xDEADC0DE, 0x9F);
-        AhciInterruptSpinlockRelease(channelExtension->AdapterExtension, channelExtension->PortNumber, &lockhandle);
+        //
+        // Take all queued requests with one acquisition of the interrupt spinlock, and complete them as a batch.
+        // Requests queued meanwhile, including by the completion routines below, are picked up once the batch is done.
+        //
+        if (batch == NULL) {
+            AhciInterruptSpinlockAcquire(channelExtension->AdapterExtension, channelExtension->PortNumber, &lockhandle);
+            batch = DetachQueue(channelExtension, &channelExtension->CompletionQueue, 0xDEADC0DE, 0x9F);
+            AhciInterruptSpinlockRelease(channelExtension->AdapterExtension, channelExtension->PortNumber, &lockhandle);
+        }
+
+        srb = batch;
 
         if (srb != NULL) {
             PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(srb);
 
             BOOLEAN completeSrb = TRUE;
 
+            batch = (PSTORAGE_REQUEST_BLOCK)SrbGetNextSrb(srb);
+            SrbSetNextSrb(srb, NULL);
+
             completionRoutine = srbExtension->CompletionRoutine;
 
             srbExtension->AtaFunction = 0; // clear this field.
@@ -52,6 +52,14 @@ RemoveQueue (
     _In_ UCHAR Tag
     );
 
+PSTORAGE_REQUEST_BLOCK
+DetachQueue (
+    _In_ PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    _Inout_ PSTORAHCI_QUEUE Queue,
+    _In_ ULONG Signature,
+    _In_ UCHAR Tag
+    );
+
 VOID
 AhciCompleteIssuedSRBs(
     _In_ PAHCI_CHANNEL_EXTENSION ChannelExtension,
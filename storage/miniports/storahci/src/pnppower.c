@@ -282,6 +282,13 @@ Return Values:
         StorPortWriteRegisterUlong(AdapterExtension, &abar->GHC.AsUlong, ghc.AsUlong);
     }
 
+    // CCC registers may not have survived the power cycle. Start over with CCC disabled.
+    if (AdapterExtension->Ccc.TimeoutValue != 0) {
+        AhciAdapterSetCcc(AdapterExtension, 0);
+        AdapterExtension->Ccc.IntervalStart.QuadPart = 0;
+        AdapterExtension->Ccc.IntervalCompletions = 0;
+    }
+
     // Power up all ports that don't have a device present.
     // There is protection method in AhciPortPowerUp() to only allow it run once.
     for (i = 0; i <= AdapterExtension->HighestPort; i++) {
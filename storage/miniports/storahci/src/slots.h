@@ -0,0 +1,240 @@
+/*++
+
+Copyright (C) Microsoft Corporation, 2009
+
+Module Name:
+
+    slots.h
+
+Abstract:
+
+    Command slot mask helpers and the slot selection of GetAvailableSlot
+    and GetSlotToActivate.  These work on plain slot masks rather than on
+    the channel extension, so the user mode benchmark in ..\test builds
+    this file as it is.
+
+Notes:
+
+Revision History:
+
+--*/
+
+
+#pragma once
+
+__inline
+UCHAR
+NumberOfSetBits (
+    _In_ ULONG Value
+    )
+/*++
+    This routine emulates the __popcnt intrinsic function.
+
+Return Value:
+    Count of '1's in the ULONG value
+--*/
+{
+    //
+    // Partition into groups of bit pairs. Compute population count for each
+    // bit pair.
+    //
+    Value -= (Value >> 1) & 0x55555555;
+
+    //
+    // Sum population count of adjacent pairs into quads.
+    //
+    Value = (Value & 0x33333333) + ((Value >> 2) & 0x33333333);
+
+    //
+    // Sum population count of adjacent quads into octets. Lower quad in each
+    // octet has desired sum and upper quad is garbage.
+    //
+    Value = (Value + (Value >> 4)) & 0x0F0F0F0F;
+
+    //
+    // The lower quads in each octet must now be accumulated by multiplying with
+    // a magic multiplier:
+    //
+    //   0p0q0r0s * 0x01010101 =         :0p0q0r0s
+    //                                 0p:0q0r0s
+    //                               0p0q:0r0s
+    //                             0p0q0r:0s
+    //                           000pxxww:vvuutt0s
+    //
+    // The octet vv contains the final interesting result.
+    //
+    Value *= 0x01010101;
+
+    return (UCHAR)(Value >> 24);
+}
+
+__inline
+ULONG
+SlotsFrom (
+    _In_ UCHAR Slot
+    )
+/*++
+    Returns the mask of slots Slot through 31.
+--*/
+{
+    NT_ASSERT(Slot < 32);
+
+    return (0xFFFFFFFF << Slot);
+}
+
+__inline
+ULONG
+SlotsUpTo (
+    _In_ UCHAR Slot
+    )
+/*++
+    Returns the mask of slots 0 through Slot.
+--*/
+{
+    NT_ASSERT(Slot < 32);
+
+    return (0xFFFFFFFF >> (31 - Slot));
+}
+
+__inline
+UCHAR
+LowestSlot (
+    _In_ ULONG Slots
+    )
+/*++
+    Returns the lowest slot set in Slots, which must not be 0.
+--*/
+{
+    ULONG slot;
+
+    NT_ASSERT(Slots != 0);
+
+    _BitScanForward(&slot, Slots);
+
+    return (UCHAR)slot;
+}
+
+__inline
+UCHAR
+HighestSlot (
+    _In_ ULONG Slots
+    )
+/*++
+    Returns the highest slot set in Slots, which must not be 0.
+--*/
+{
+    ULONG slot;
+
+    NT_ASSERT(Slots != 0);
+
+    _BitScanReverse(&slot, Slots);
+
+    return (UCHAR)slot;
+}
+
+__inline
+UCHAR
+SelectAvailableSlot (
+    _In_ ULONG Allocated,
+    _In_ UCHAR NCS,
+    _In_ UCHAR CurrentCommandSlot
+    )
+/*++
+    Chooses a slot circularly starting with CurrentCommandSlot: the lowest free slot
+    from CurrentCommandSlot up to NCS, or if there is none, the lowest free slot from 1
+    up to CurrentCommandSlot. Slot 0 is reserved for internal commands.
+
+Return Value:
+    The slot, or 0xFF if no slot is free.
+--*/
+{
+    ULONG available;
+
+    available = ~Allocated & SlotsUpTo(NCS) & ~(1 << 0);
+
+    if ((available & SlotsFrom(CurrentCommandSlot)) != 0) {
+        return LowestSlot(available & SlotsFrom(CurrentCommandSlot));
+    } else if (available != 0) {
+        return LowestSlot(available);
+    }
+
+    return 0xFF;
+}
+
+__inline
+ULONG
+SelectSlotsToActivate (
+    _In_ ULONG TargetSlots,
+    _In_ ULONG CommandsIssued,
+    _In_ UCHAR NCS,
+    _In_ UCHAR MaxDeviceQueueDepth,
+    _Inout_ PUCHAR LastActiveSlot
+    )
+/*++
+    Chooses which of TargetSlots to activate without going over MaxDeviceQueueDepth
+    commands issued, in order from LastActiveSlot, and updates LastActiveSlot to the
+    last slot chosen.
+
+Return Value:
+    The slots to activate, 0 if none.
+--*/
+{
+    UCHAR activeCount = 0;
+    UCHAR emptyCount;
+    UCHAR requestCount;
+    ULONG slotToActivate = 0;
+    ULONG highSlots;
+    ULONG lowSlots;
+    UCHAR slot;
+
+    // 1. Count the number of slots already in use
+    if (CommandsIssued > 0) {
+        activeCount = NumberOfSetBits(CommandsIssued);
+    }
+
+    // 1.1 Check if all slots are active.
+    if (activeCount >= MaxDeviceQueueDepth) {
+        // If all possible slots are full, no matter what, return no work (0)
+        return 0;
+    }
+
+    // 2. Split the requests into those from last active slot up to NCS, which go first,
+    //    and those from the beginning up to last active slot.
+    //    Slot 0 is reserved for internal command
+    highSlots = TargetSlots & SlotsUpTo(NCS) & SlotsFrom(*LastActiveSlot);
+    lowSlots = TargetSlots & ~SlotsFrom(*LastActiveSlot) & ~(1 << 0);
+
+    requestCount = NumberOfSetBits(highSlots | lowSlots);
+    emptyCount = MaxDeviceQueueDepth - activeCount;
+
+    if (requestCount == 0) {
+        return 0;
+    }
+
+    // 3.1 If all requests fit, take them all. The last one taken is the highest of the
+    //     low part if there is one, otherwise the highest of the high part.
+    if (requestCount <= emptyCount) {
+        *LastActiveSlot = (lowSlots != 0) ? HighestSlot(lowSlots) : HighestSlot(highSlots);
+        return (highSlots | lowSlots);
+    }
+
+    // 3.2 Otherwise take as many as fit, in order from last active slot.
+    slot = *LastActiveSlot;
+
+    while (emptyCount > 0) {
+        if (highSlots != 0) {
+            slot = LowestSlot(highSlots);
+            highSlots &= highSlots - 1;
+        } else {
+            slot = LowestSlot(lowSlots);
+            lowSlots &= lowSlots - 1;
+        }
+
+        slotToActivate |= (1 << slot);
+        emptyCount--;
+    }
+
+    *LastActiveSlot = slot;
+    return slotToActivate;
+}
+
@@ -223,6 +223,27 @@ Return Value:
     ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[12] = PxSERR;
     ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[13] = PxSACT;
     ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[14] = PxCI;
+
+    // Px[0] ~ Px[3] and Px[5] are not register snapshots here: they carry the interrupt coalescing statistics,
+    // i.e. interrupts raised by the port, commands completed, port interrupts per 1000 commands, the CCC_CTL value programmed
+    // and the CCC interrupts taken by the adapter, which can complete commands on any port.
+    ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[0] = ChannelExtension->TotalCountInterrupt;
+    ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[1] = ChannelExtension->TotalCountCommandCompletion;
+    if (ChannelExtension->TotalCountCommandCompletion != 0) {
+        ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[2] =
+            (ULONG)(((ULONGLONG)ChannelExtension->TotalCountInterrupt * 1000) / ChannelExtension->TotalCountCommandCompletion);
+    }
+    if (ChannelExtension->AdapterExtension->Ccc.Completions != 0) {
+        AHCI_COMMAND_COMPLETION_COALESCING_CONTROL cccCtl;
+
+        cccCtl.AsUlong = 0;
+        cccCtl.EN = 1;
+        cccCtl.INT = ChannelExtension->AdapterExtension->Ccc.Interrupt;
+        cccCtl.CC = ChannelExtension->AdapterExtension->Ccc.Completions;
+        cccCtl.TV = ChannelExtension->AdapterExtension->Ccc.TimeoutValue;
+        ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[3] = cccCtl.AsUlong;
+    }
+    ChannelExtension->ExecutionHistory[ChannelExtension->ExecutionHistoryNextAvailableIndex].Px[5] = ChannelExtension->AdapterExtension->Ccc.TotalCountInterrupt;
 }
 
 VOID
@@ -242,10 +263,10 @@ Called by:
     PAHCI_ADAPTER_EXTENSION adapterExtension = ChannelExtension->AdapterExtension;
 
     ie.AsUlong = StorPortReadRegisterUlong(adapterExtension, &IE->AsUlong);
-    ie.DHRE = 1; //Device to Host Register FIS Interrupt (DHRS):  A D2H Register FIS has been received with the �I� bit set, and has been copied into system memory.
+    ie.DHRE = (adapterExtension->Ccc.Completions == 0) ? 1 : 0; //Device to Host Register FIS Interrupt (DHRS):  A D2H Register FIS has been received with the �I� bit set, and has been copied into system memory.
     ie.PSE  = 1; //PIO Setup FIS Interrupt (PSS):  A PIO Setup FIS has been received with the �I� bit set, it has been copied into system memory, and the data related to that FIS has been transferred.  This bit shall be set even if the data transfer resulted in an error.
     ie.DSE  = 1; //DMA Setup FIS Interrupt (DSS):  A DMA Setup FIS has been received with the �I� bit set and has been copied into system memory.
-    ie.SDBE = 1; //Set Device Bits Interrupt (SDBS):  A Set Device Bits FIS has been received with the �I� bit set and has been copied into system memory.
+    ie.SDBE = (adapterExtension->Ccc.Completions == 0) ? 1 : 0; //Set Device Bits Interrupt (SDBS):  A Set Device Bits FIS has been received with the �I� bit set and has been copied into system memory.
 
     ie.UFE  = 0; //Unknown FIS Interrupt (UFS): When set to �1�, indicates that an unknown FIS was received and has been copied into system memory.  This bit is cleared to �0� by software clearing the PxSERR.DIAG.F bit to �0�.  Note that this bit does not directly reflect the PxSERR.DIAG.F bit.  PxSERR.DIAG.F is set immediately when an unknown FIS is detected, whereas this bit is set when that FIS is posted to memory.  Software should wait to act on an unknown FIS until this bit is set to �1� or the two bits may become out of sync.
     ie.DPE  = 0; //Descriptor Processed (DPS):  A PRD with the �I� bit set has transferred all of its data.  Refer to section 5.4.2.
@@ -277,6 +298,267 @@ Called by:
     StorPortWriteRegisterUlong(adapterExtension, &IE->AsUlong, ie.AsUlong);
 }
 
+VOID
+AhciAdapterGetCccSettings(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension
+    )
+/*++
+    Reads the Command Completion Coalescing timeout from the adapter registry key and keeps it in the adapter extension.
+    StorPortRegistryReadAdapterKey can only be called at PASSIVE_LEVEL, so this is done here rather than in AhciHwInitialize.
+
+It assumes:
+    CAP has been read.
+Called by:
+    AhciHwFindAdapter
+
+It performs:
+    1. Check the adapter supports CCC
+    2. Read the CCC timeout value from registry, CCC is not used if it's absent or 0
+Affected Variables/Registers:
+    AdapterExtension->Ccc.ConfiguredTimeoutValue
+Return Value:
+    none
+--*/
+{
+    ULONG storStatus;
+    ULONG timeoutValue = 0;
+    PVOID dataBuffer = &timeoutValue;
+    ULONG dataLength = sizeof(ULONG);
+
+    AdapterExtension->Ccc.ConfiguredTimeoutValue = 0;
+
+  //1. Check the adapter supports CCC
+    if (IsDumpMode(AdapterExtension) || (AdapterExtension->CAP.CCCS == 0)) {
+        return;
+    }
+
+  //2. Read the CCC timeout value from registry
+    storStatus = StorPortRegistryReadAdapterKey(AdapterExtension,
+                                                (PUCHAR)"StorAHCI",
+                                                (PUCHAR)AHCI_CCC_REG_VALUE_NAME,
+                                                MINIPORT_REG_DWORD,
+                                                &dataBuffer,
+                                                &dataLength);
+
+    if ((storStatus != STOR_STATUS_SUCCESS) || (dataLength != sizeof(ULONG))) {
+        return;
+    }
+
+    AdapterExtension->Ccc.ConfiguredTimeoutValue = (USHORT)min(timeoutValue, AHCI_CCC_MAX_TIMEOUT_IN_MS);
+
+    return;
+}
+
+VOID
+AhciAdapterInitializeCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension
+    )
+/*++
+    Decides whether Command Completion Coalescing is used on the adapter and programs CCC_CTL and CCC_PORTS with CCC disabled.
+    CCC gets enabled later by AhciAdapterTuneCcc once the completion rate is high enough.
+
+It assumes:
+    PortImplemented and the interrupt mode have been determined.
+    The CCC timeout value has been read from registry by AhciAdapterGetCccSettings.
+Called by:
+    AhciHwInitialize
+
+It performs:
+    1. Check CCC is configured, and that the CCC interrupt is reported in IS
+       The CCC interrupt has its own MSI message, which is not handled when each port has its own message.
+    2. The CCC interrupt must be the interrupt of an unimplemented port
+    3. Program CCC_CTL and CCC_PORTS
+Affected Variables/Registers:
+    CCC_CTL, CCC_PORTS
+Return Value:
+    none
+--*/
+{
+    AHCI_COMMAND_COMPLETION_COALESCING_CONTROL cccCtl;
+    PAHCI_MEMORY_REGISTERS abar = AdapterExtension->ABAR_Address;
+
+    AdapterExtension->Ccc.TimeoutValue = 0;
+    AdapterExtension->Ccc.Completions = 0;
+
+  //1. Check CCC is configured and the interrupt mode
+    if ((AdapterExtension->Ccc.ConfiguredTimeoutValue == 0) ||
+        (AdapterExtension->StateFlags.InterruptMessagePerPort == 1)) {
+        return;
+    }
+
+  //2. The CCC interrupt must be the interrupt of an unimplemented port
+    cccCtl.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &abar->CCC_CTL.AsUlong);
+
+    if ((AdapterExtension->PortImplemented & (1 << cccCtl.INT)) != 0) {
+        NT_ASSERT(FALSE);
+        return;
+    }
+
+    AdapterExtension->Ccc.TimeoutValue = AdapterExtension->Ccc.ConfiguredTimeoutValue;
+    AdapterExtension->Ccc.Interrupt = (UCHAR)cccCtl.INT;
+
+  //3. Program CCC_CTL and CCC_PORTS, leave CCC disabled
+    AhciAdapterSetCcc(AdapterExtension, 0);
+
+    return;
+}
+
+VOID
+AhciAdapterSetCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension,
+    _In_ UCHAR Completions
+    )
+/*++
+    Enables Command Completion Coalescing with the given number of completions per CCC interrupt, or disables it if Completions is 0.
+    While CCC is enabled, command completion interrupts (PxIE.DHRE, PxIE.SDBE) are disabled on the coalesced ports; error and
+    hot plug interrupts are not affected.
+It assumes:
+    AdapterExtension->Ccc.TimeoutValue is not 0.
+    Called at DIRQL or with the adapter interrupt spinlock held, except from AhciHwFindAdapter and AhciAdapterPowerUp.
+Called by:
+    AhciAdapterInitializeCcc
+    AhciAdapterTuneCcc
+    AhciAdapterPowerUp
+
+It performs:
+    1. Clear CCC_CTL.EN, TV and CC can only be changed while EN is 0
+    2. Program CCC_PORTS and CCC_CTL, set EN if CCC is enabled
+    3. Update command completion interrupt enables on started ports
+       When CCC is disabled, completions that were coalesced but not yet signaled raise a port interrupt once PxIE is restored.
+Affected Variables/Registers:
+    CCC_CTL, CCC_PORTS, PxIE
+Return Value:
+    none
+--*/
+{
+    AHCI_COMMAND_COMPLETION_COALESCING_CONTROL cccCtl;
+    AHCI_INTERRUPT_ENABLE ie;
+    PAHCI_MEMORY_REGISTERS abar = AdapterExtension->ABAR_Address;
+    ULONG i;
+
+    NT_ASSERT(AdapterExtension->Ccc.TimeoutValue != 0);
+
+  //1. Clear CCC_CTL.EN
+    cccCtl.AsUlong = 0;
+    cccCtl.INT = AdapterExtension->Ccc.Interrupt;
+    cccCtl.TV = AdapterExtension->Ccc.TimeoutValue;
+    StorPortWriteRegisterUlong(AdapterExtension, &abar->CCC_CTL.AsUlong, cccCtl.AsUlong);
+
+    AdapterExtension->Ccc.Completions = Completions;
+
+  //2. Program CCC_PORTS and CCC_CTL
+    if (Completions != 0) {
+        StorPortWriteRegisterUlong(AdapterExtension, &abar->CCC_PORTS, AdapterExtension->PortImplemented);
+
+        cccCtl.CC = Completions;
+        StorPortWriteRegisterUlong(AdapterExtension, &abar->CCC_CTL.AsUlong, cccCtl.AsUlong);
+
+        cccCtl.EN = 1;
+        StorPortWriteRegisterUlong(AdapterExtension, &abar->CCC_CTL.AsUlong, cccCtl.AsUlong);
+    }
+
+  //3. Update command completion interrupt enables. Ports with interrupts disabled are left alone, Set_PxIE takes care of them when they start.
+    for (i = 0; i <= AdapterExtension->HighestPort; i++) {
+        if (AdapterExtension->PortExtension[i] == NULL) {
+            continue;
+        }
+
+        ie.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &AdapterExtension->PortExtension[i]->Px->IE.AsUlong);
+
+        if (ie.AsUlong != 0) {
+            ie.DHRE = (Completions == 0) ? 1 : 0;
+            ie.SDBE = (Completions == 0) ? 1 : 0;
+            StorPortWriteRegisterUlong(AdapterExtension, &AdapterExtension->PortExtension[i]->Px->IE.AsUlong, ie.AsUlong);
+        }
+    }
+
+    return;
+}
+
+VOID
+AhciAdapterTuneCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension,
+    _In_ ULONG Completions,
+    _In_ BOOLEAN CccInterrupt
+    )
+/*++
+    Adjusts Command Completion Coalescing to the observed completion rate. Called once per interrupt handled by AhciHwInterrupt.
+It assumes:
+    AdapterExtension->Ccc.TimeoutValue is not 0.
+Called by:
+    AhciHwInterrupt
+
+It performs:
+    1. A CCC interrupt with fewer completions than programmed means the CCC timer expired before a batch filled.
+       The load has dropped, disable CCC at once so that remaining I/O is not delayed by the timer.
+    2. Every AHCI_CCC_TUNING_INTERVAL_IN_MS, size CC from the completion rate, capped by half of the outstanding commands
+       so that a batch can fill without waiting for the timer.
+Affected Variables/Registers:
+    CCC_CTL, CCC_PORTS, PxIE
+Return Value:
+    none
+--*/
+{
+    LARGE_INTEGER currentTime;
+    LONGLONG elapsed;
+    ULONGLONG iops;
+    ULONG outstanding;
+    ULONG completions;
+    ULONG i;
+
+    AdapterExtension->Ccc.IntervalCompletions += Completions;
+
+    StorPortQuerySystemTime(&currentTime);
+
+  //1. The CCC timer expired before a batch filled, start a new interval without CCC
+    if (CccInterrupt && (AdapterExtension->Ccc.Completions != 0) && (Completions < AdapterExtension->Ccc.Completions)) {
+        AhciAdapterSetCcc(AdapterExtension, 0);
+
+        AdapterExtension->Ccc.IntervalStart = currentTime;
+        AdapterExtension->Ccc.IntervalCompletions = 0;
+        return;
+    }
+
+  //2. Re-evaluate CC once per tuning interval
+    elapsed = currentTime.QuadPart - AdapterExtension->Ccc.IntervalStart.QuadPart;
+
+    if ((elapsed >= 0) && (elapsed < (LONGLONG)MS_TO_100NS(AHCI_CCC_TUNING_INTERVAL_IN_MS))) {
+        return;
+    }
+
+    completions = 0;
+
+    if ((elapsed > 0) && (AdapterExtension->Ccc.IntervalStart.QuadPart != 0)) {
+        iops = ((ULONGLONG)AdapterExtension->Ccc.IntervalCompletions * MS_TO_100NS(1000)) / (ULONGLONG)elapsed;
+
+        if (iops >= AHCI_CCC_IOPS_THRESHOLD) {
+            outstanding = 0;
+
+            for (i = 0; i <= AdapterExtension->HighestPort; i++) {
+                if (AdapterExtension->PortExtension[i] != NULL) {
+                    outstanding += NumberOfSetBits(AdapterExtension->PortExtension[i]->SlotManager.CommandsIssued);
+                }
+            }
+
+            completions = (ULONG)min(iops / AHCI_CCC_TARGET_INTERRUPT_RATE, AHCI_CCC_MAX_COMPLETIONS);
+            completions = min(completions, outstanding / 2);
+
+            if (completions < 2) {
+                completions = 0;
+            }
+        }
+    }
+
+    if (completions != AdapterExtension->Ccc.Completions) {
+        AhciAdapterSetCcc(AdapterExtension, (UCHAR)completions);
+    }
+
+    AdapterExtension->Ccc.IntervalStart = currentTime;
+    AdapterExtension->Ccc.IntervalCompletions = 0;
+
+    return;
+}
+
 
 ULONG
 GetStringLength (
@@ -1013,7 +1295,6 @@ Return Value:
 {
     ULONG               allocated;
     UCHAR               limit;
-    UCHAR               i;
     PAHCI_SRB_EXTENSION srbExtension;
 
     srbExtension = GetSrbExtension(Srb);
@@ -1044,22 +1325,11 @@ Return Value:
         }
     }
 
-  //2.2 Chose the slot circularly starting with CCS
-    for (i = limit; i <= ChannelExtension->AdapterExtension->CAP.NCS; i++) {
-        if ( (allocated & (1 << i)) == 0 ) {
-            srbExtension->QueueTag = i;
-            goto getout;
-        }
-    }
-
-    for (i = 1; i < limit; i++) {
-        if ( (allocated & (1 << i)) == 0 ) {
-            srbExtension->QueueTag = i;
-            goto getout;
-        }
-    }
+  //2.2 Chose the slot circularly starting with CCS, see slots.h
+    srbExtension->QueueTag = SelectAvailableSlot(allocated,
+                                                 (UCHAR)ChannelExtension->AdapterExtension->CAP.NCS,
+                                                 limit);
 
-getout:
   //3.1 Update CurrentCommandSlot
     if (IsRequestSenseSrb(srbExtension->AtaFunction)) {
       //If this SRB is for Request Sense, make sure it is given the next chance to run during ActivateQueue by not incrementing CCS.
@@ -897,52 +897,6 @@ RequestSetDataTransferLength (
     return;
 }
 
-__inline
-UCHAR
-NumberOfSetBits (
-    _In_ ULONG Value
-    )
-/*++
-    This routine emulates the __popcnt intrinsic function.
-
-Return Value:
-    Count of '1's in the ULONG value
---*/
-{
-    //
-    // Partition into groups of bit pairs. Compute population count for each
-    // bit pair.
-    //
-    Value -= (Value >> 1) & 0x55555555;
-
-    //
-    // Sum population count of adjacent pairs into quads.
-    //
-    Value = (Value & 0x33333333) + ((Value >> 2) & 0x33333333);
-
-    //
-    // Sum population count of adjacent quads into octets. Lower quad in each
-    // octet has desired sum and upper quad is garbage.
-    //
-    Value = (Value + (Value >> 4)) & 0x0F0F0F0F;
-
-    //
-    // The lower quads in each octet must now be accumulated by multiplying with
-    // a magic multiplier:
-    //
-    //   0p0q0r0s * 0x01010101 =         :0p0q0r0s
-    //                                 0p:0q0r0s
-    //                               0p0q:0r0s
-    //                             0p0q0r:0s
-    //                           000pxxww:vvuutt0s
-    //
-    // The octet vv contains the final interesting result.
-    //
-    Value *= 0x01010101;
-
-    return (UCHAR)(Value >> 24);
-}
-
 __inline
 VOID
 AhciInterruptSpinlockAcquire(
@@ -1032,6 +986,29 @@ Set_PxIE(
     PAHCI_INTERRUPT_ENABLE IE
     );
 
+VOID
+AhciAdapterGetCccSettings(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension
+    );
+
+VOID
+AhciAdapterInitializeCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension
+    );
+
+VOID
+AhciAdapterSetCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension,
+    _In_ UCHAR Completions
+    );
+
+VOID
+AhciAdapterTuneCcc(
+    _In_ PAHCI_ADAPTER_EXTENSION AdapterExtension,
+    _In_ ULONG Completions,
+    _In_ BOOLEAN CccInterrupt
+    );
+
 
 __inline
 BOOLEAN
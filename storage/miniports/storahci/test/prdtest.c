@@ -0,0 +1,473 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    prdtest.c
+
+Abstract:
+
+    This file tests the command building of storahci in user mode.
+
+    SRBtoPRDT (io.c) maps scatter/gather lists of 1 or 2 word aligned, even
+    length entries directly, and leaves every other list to the loop that
+    handles odd lengths and the 128K split. The driver does this in
+    SGLtoPRDT, which cmdbuild.h shares with this test, so the routine
+    tested is the one the driver builds. The loop alone is kept here as
+    the baseline. The program checks that the two write the same PRDT
+    entries, return the same count and adjust the transfer length the same
+    way on random 1 and 2 entry lists.
+
+    It then times each on lists the fast path takes, and times whole
+    commands: the CFIS (SRBtoATA_CFIS), the PRDT and the command header
+    (SRBtoCmdHeader) of random read and write commands, built with the
+    routines of cmdbuild.h, once with the loop and once with the fast path.
+
+    Usage: prdtest [Lists]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+//  Lists the driver never gets, such as odd addresses, are generated on
+//  purpose here, so the asserts of the driver code are left out.
+//
+
+#define NT_ASSERT(_Expression)  ((void)0)
+
+#define NUMBER_OF_TIMED_LISTS   4096
+#define TIMED_ITERATIONS        2000
+
+//
+//  The task file as in common.h and the scatter/gather list as in
+//  entrypts.h, which cmdbuild.h uses.
+//
+
+#include <pshpack1.h>
+typedef struct _ATAREGISTERS {
+    UCHAR bFeaturesReg;
+    UCHAR bSectorCountReg;
+    UCHAR bSectorNumberReg;
+    UCHAR bCylLowReg;
+    UCHAR bCylHighReg;
+    UCHAR bDriveHeadReg;
+    UCHAR bCommandReg;
+    UCHAR bReserved;
+} ATAREGISTERS, *PATAREGISTERS;
+#include <poppack.h>
+
+typedef struct _ATA_TASK_FILE {
+    ATAREGISTERS Current;
+    ATAREGISTERS Previous;
+} ATA_TASK_FILE, *PATA_TASK_FILE;
+
+#define ATA_NCQ_FUA_BIT         (1 << 7)
+
+typedef struct _STOR_SCATTER_GATHER_ELEMENT {
+    LARGE_INTEGER PhysicalAddress;
+    ULONG Length;
+    ULONG_PTR Reserved;
+} STOR_SCATTER_GATHER_ELEMENT, *PSTOR_SCATTER_GATHER_ELEMENT;
+
+typedef struct _LOCAL_SCATTER_GATHER_LIST {
+    ULONG                       NumberOfElements;
+    ULONG_PTR                   Reserved;
+    STOR_SCATTER_GATHER_ELEMENT List[257];
+} LOCAL_SCATTER_GATHER_LIST, *PLOCAL_SCATTER_GATHER_LIST;
+
+#include "ahci.h"
+#include "cmdbuild.h"
+
+//
+//  The request fields SRBtoATA_CFIS, SRBtoPRDT and SRBtoCmdHeader read
+//  and update.
+//
+
+typedef struct _PRDT_REQUEST {
+    LOCAL_SCATTER_GATHER_LIST Sgl;
+    ULONG DataTransferLength;
+    ULONG DbauMask;
+    ATA_TASK_FILE TaskFile;
+    BOOLEAN Ncq;
+    UCHAR QueueTag;
+    BOOLEAN Fua;
+    BOOLEAN Write;
+} PRDT_REQUEST, *PPRDT_REQUEST;
+
+//
+//  SRBtoPRDT, steps 1.2 to 2.3: the loop every list used to take.
+//
+
+static
+ULONG
+PrdtLoop (
+    _Inout_ PPRDT_REQUEST Request,
+    _Out_ PAHCI_COMMAND_TABLE cmdTable
+    )
+{
+    ULONG i;
+    PLOCAL_SCATTER_GATHER_LIST sgl = &Request->Sgl;
+    ULONG dbauMask = Request->DbauMask;
+
+    for (i = 0; i < sgl->NumberOfElements; i++) {
+        if ((sgl->List[i].PhysicalAddress.LowPart & 0x1) == 0) {
+            if (sgl->List[i].Length != 0x20000) {
+                cmdTable->PRDT[i].DBA.AsUlong = sgl->List[i].PhysicalAddress.LowPart;
+                cmdTable->PRDT[i].DBAU = sgl->List[i].PhysicalAddress.HighPart & dbauMask;
+            } else {
+                cmdTable->PRDT[0].DBA.AsUlong = sgl->List[0].PhysicalAddress.LowPart;
+                cmdTable->PRDT[0].DBAU = sgl->List[0].PhysicalAddress.HighPart & dbauMask;
+                cmdTable->PRDT[0].DI.DBC = (0x10000 - 1);
+                cmdTable->PRDT[1].DBA.AsUlong = (sgl->List[0].PhysicalAddress.LowPart + 0x10000);
+                cmdTable->PRDT[1].DBAU = (ULONG)((sgl->List[0].PhysicalAddress.QuadPart + 0x10000) >> 32) & dbauMask;
+                cmdTable->PRDT[1].DI.DBC = (0x10000 - 1);
+                return 2;
+            }
+        } else {
+            return (ULONG)-1;
+        }
+
+        if ((sgl->List[i].Length & 1) == 0) {
+            cmdTable->PRDT[i].DI.DBC = sgl->List[i].Length - 1;
+        } else if (sgl->List[i].Length <= Request->DataTransferLength) {
+            Request->DataTransferLength = Request->DataTransferLength - 1;
+            cmdTable->PRDT[i].DI.DBC = sgl->List[i].Length - 2;
+        } else {
+            return (ULONG)-1;
+        }
+    }
+
+    return sgl->NumberOfElements;
+}
+
+//
+//  SRBtoPRDT as it is now.
+//
+
+static
+ULONG
+PrdtFast (
+    _Inout_ PPRDT_REQUEST Request,
+    _Out_ PAHCI_COMMAND_TABLE cmdTable
+    )
+{
+    return SGLtoPRDT(cmdTable, &Request->Sgl, Request->DbauMask, &Request->DataTransferLength);
+}
+
+//
+//  SRBtoATA_CFIS, SRBtoPRDT and SRBtoCmdHeader for one command, as
+//  AhciProcessIo calls them, with the PRDT built by the loop alone or by
+//  SRBtoPRDT as it is now.
+//
+
+static
+__inline
+ULONG
+BuildCommand (
+    _Inout_ PPRDT_REQUEST Request,
+    _Out_ PAHCI_COMMAND_TABLE cmdTable,
+    _Out_ PAHCI_COMMAND_HEADER cmdHeader,
+    _In_ BOOLEAN Fast
+    )
+{
+    ULONG length;
+
+    TaskFiletoATA_CFIS(&cmdTable->CFIS, &Request->TaskFile, Request->Ncq, Request->QueueTag, Request->Fua);
+
+    if (Fast) {
+        length = PrdtFast(Request, cmdTable);
+    } else {
+        length = PrdtLoop(Request, cmdTable);
+    }
+
+    FillCmdHeader(cmdHeader, length, FALSE, Request->Write, FALSE);
+
+    return length;
+}
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+//
+//  A length up to the 128K maximum transfer, often a whole number of
+//  pages, sometimes exactly 128K and sometimes odd.
+//
+
+static
+ULONG
+RandomLength (
+    VOID
+    )
+{
+    switch (Random32() % 8) {
+    case 0:
+        return 0x20000;
+    case 1:
+        return 1 + Random32() % 0x20000;
+    case 2:
+        return 2 + 2 * (Random32() % 0xFFFF);
+    default:
+        return 0x1000 * (1 + Random32() % 32);
+    }
+}
+
+//
+//  An address below or above 4GB, usually page aligned, sometimes only
+//  word aligned and sometimes odd.
+//
+
+static
+LONGLONG
+RandomAddress (
+    VOID
+    )
+{
+    LONGLONG address = (LONGLONG)(Random32() % 4) << 32;
+
+    switch (Random32() % 8) {
+    case 0:
+        return address | (Random32() | 1);
+    case 1:
+        return address | (Random32() & ~1);
+    case 2:
+        return address | 0xFFFF0000 | ((Random32() % 0x8000) << 1);
+    default:
+        return address | (Random32() & ~0xFFF);
+    }
+}
+
+static
+VOID
+RandomRequest (
+    _Out_ PPRDT_REQUEST Request,
+    _In_ BOOLEAN FastOnly
+    )
+{
+    ULONG i;
+
+    Request->Sgl.NumberOfElements = 1 + Random32() % 2;
+    Request->Sgl.Reserved = 0;
+    Request->DataTransferLength = 0;
+    Request->DbauMask = (Random32() % 2) ? 0xFFFFFFFF : 0;
+
+    //
+    //  A 48 bit read or write, queued or not, at a random LBA.
+    //
+
+    Request->Write = (BOOLEAN)(Random32() % 2);
+    Request->Ncq = (BOOLEAN)(Random32() % 2);
+    Request->QueueTag = (UCHAR)(Random32() % 32);
+    Request->Fua = (BOOLEAN)((Random32() % 4) == 0);
+
+    Request->TaskFile.Current.bFeaturesReg = 0;
+    Request->TaskFile.Current.bSectorCountReg = (UCHAR)Random32();
+    Request->TaskFile.Current.bSectorNumberReg = (UCHAR)Random32();
+    Request->TaskFile.Current.bCylLowReg = (UCHAR)Random32();
+    Request->TaskFile.Current.bCylHighReg = (UCHAR)Random32();
+    Request->TaskFile.Current.bDriveHeadReg = 0xE0;
+    Request->TaskFile.Current.bReserved = 0;
+    Request->TaskFile.Previous = Request->TaskFile.Current;
+    Request->TaskFile.Previous.bSectorCountReg = 0;
+
+    if (Request->Ncq) {
+        Request->TaskFile.Current.bCommandReg = Request->Write ? 0x61 : 0x60;   // WRITE/READ FPDMA QUEUED
+    } else {
+        Request->TaskFile.Current.bCommandReg = Request->Write ? 0x35 : 0x25;   // WRITE/READ DMA EXT
+    }
+
+    for (i = 0; i < Request->Sgl.NumberOfElements; i++) {
+        do {
+            Request->Sgl.List[i].PhysicalAddress.QuadPart = RandomAddress();
+            Request->Sgl.List[i].Length = RandomLength();
+        } while (FastOnly &&
+                 (((Request->Sgl.List[i].PhysicalAddress.LowPart | Request->Sgl.List[i].Length) & 1) ||
+                  (Request->Sgl.List[i].Length == 0x20000)));
+
+        Request->Sgl.List[i].Reserved = 0;
+        Request->DataTransferLength += Request->Sgl.List[i].Length;
+    }
+
+    //
+    //  Storport may build the list from a longer transfer length than the
+    //  command uses.
+    //
+
+    if ((Random32() % 8) == 0) {
+        Request->DataTransferLength -= Random32() % Request->DataTransferLength;
+    }
+}
+
+static
+double
+Seconds (
+    _In_ LARGE_INTEGER Start,
+    _In_ LARGE_INTEGER End
+    )
+{
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)(End.QuadPart - Start.QuadPart) / (double)frequency.QuadPart;
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static AHCI_COMMAND_TABLE loopTable;
+    static AHCI_COMMAND_TABLE fastTable;
+    static AHCI_COMMAND_HEADER cmdHeader;
+    static PRDT_REQUEST timed[NUMBER_OF_TIMED_LISTS];
+    PRDT_REQUEST loopRequest;
+    PRDT_REQUEST fastRequest;
+    PRDT_REQUEST request;
+    ULONG lists = 1000000;
+    ULONG loopCount, fastCount;
+    ULONG fastEligible = 0;
+    ULONG i, j, n;
+    LARGE_INTEGER start, end;
+    volatile ULONG sink = 0;
+    double loopTime, fastTime;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        lists = strtoul(argv[1], NULL, 0);
+    }
+
+    srand(1);
+
+    //
+    //  Both versions start from the same garbage in the command table and
+    //  must leave it byte for byte the same.
+    //
+
+    for (i = 0; i < lists; i++) {
+
+        RandomRequest(&request, FALSE);
+
+        loopRequest = request;
+        fastRequest = request;
+        memset(loopTable.PRDT, 0xA5, sizeof(loopTable.PRDT[0]) * 3);
+        memset(fastTable.PRDT, 0xA5, sizeof(fastTable.PRDT[0]) * 3);
+
+        loopCount = PrdtLoop(&loopRequest, &loopTable);
+        fastCount = PrdtFast(&fastRequest, &fastTable);
+
+        if ((((request.Sgl.List[0].PhysicalAddress.LowPart | request.Sgl.List[0].Length) & 1) == 0) &&
+            (request.Sgl.List[0].Length != 0x20000) &&
+            ((request.Sgl.NumberOfElements == 1) ||
+             ((((request.Sgl.List[1].PhysicalAddress.LowPart | request.Sgl.List[1].Length) & 1) == 0) &&
+              (request.Sgl.List[1].Length != 0x20000)))) {
+            fastEligible++;
+        }
+
+        TEST_ASSERT((loopCount == fastCount) &&
+                    (loopRequest.DataTransferLength == fastRequest.DataTransferLength) &&
+                    (memcmp(loopTable.PRDT, fastTable.PRDT, sizeof(loopTable.PRDT[0]) * 3) == 0),
+                    "list %lu differs: %lu entries, 0x%llx/0x%lx 0x%llx/0x%lx, transfer 0x%lx, DBAU mask 0x%lx: loop %ld, fast %ld",
+                    (unsigned long)i, (unsigned long)request.Sgl.NumberOfElements,
+                    (unsigned long long)request.Sgl.List[0].PhysicalAddress.QuadPart, (unsigned long)request.Sgl.List[0].Length,
+                    (unsigned long long)request.Sgl.List[1].PhysicalAddress.QuadPart, (unsigned long)request.Sgl.List[1].Length,
+                    (unsigned long)request.DataTransferLength, (unsigned long)request.DbauMask,
+                    (long)loopCount, (long)fastCount);
+    }
+
+    TEST_COMMENT("%lu random lists agree, %lu of them on the fast path", (unsigned long)lists, (unsigned long)fastEligible);
+
+    //
+    //  Time each version on lists the fast path takes.
+    //
+
+    for (n = 1; n <= 2; n++) {
+
+        for (i = 0; i < NUMBER_OF_TIMED_LISTS; i++) {
+            do {
+                RandomRequest(&timed[i], TRUE);
+            } while (timed[i].Sgl.NumberOfElements != n);
+        }
+
+        QueryPerformanceCounter(&start);
+        for (j = 0; j < TIMED_ITERATIONS; j++) {
+            for (i = 0; i < NUMBER_OF_TIMED_LISTS; i++) {
+                sink += PrdtLoop(&timed[i], &loopTable);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        loopTime = Seconds(start, end);
+
+        QueryPerformanceCounter(&start);
+        for (j = 0; j < TIMED_ITERATIONS; j++) {
+            for (i = 0; i < NUMBER_OF_TIMED_LISTS; i++) {
+                sink += PrdtFast(&timed[i], &fastTable);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        fastTime = Seconds(start, end);
+
+        TEST_COMMENT("%lu entry lists: loop %6.2f ns, fast path %6.2f ns per call",
+                     (unsigned long)n,
+                     loopTime * 1e9 / ((double)TIMED_ITERATIONS * NUMBER_OF_TIMED_LISTS),
+                     fastTime * 1e9 / ((double)TIMED_ITERATIONS * NUMBER_OF_TIMED_LISTS));
+
+        //
+        //  The whole command: CFIS, PRDT and command header.
+        //
+
+        QueryPerformanceCounter(&start);
+        for (j = 0; j < TIMED_ITERATIONS; j++) {
+            for (i = 0; i < NUMBER_OF_TIMED_LISTS; i++) {
+                sink += BuildCommand(&timed[i], &loopTable, &cmdHeader, FALSE);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        loopTime = Seconds(start, end);
+
+        QueryPerformanceCounter(&start);
+        for (j = 0; j < TIMED_ITERATIONS; j++) {
+            for (i = 0; i < NUMBER_OF_TIMED_LISTS; i++) {
+                sink += BuildCommand(&timed[i], &fastTable, &cmdHeader, TRUE);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        fastTime = Seconds(start, end);
+
+        TEST_COMMENT("%lu entry commands: loop %6.2f ns, fast path %6.2f ns per command",
+                     (unsigned long)n,
+                     loopTime * 1e9 / ((double)TIMED_ITERATIONS * NUMBER_OF_TIMED_LISTS),
+                     fastTime * 1e9 / ((double)TIMED_ITERATIONS * NUMBER_OF_TIMED_LISTS));
+    }
+
+End:
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}
@@ -0,0 +1,346 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    slotbench.c
+
+Abstract:
+
+    This file measures the command slot selection of storahci in user mode.
+
+    GetAvailableSlot (util.c) and GetSlotToActivate (io.c) used to walk the
+    32 slots with (1 << i) tests, and now scan slot masks with
+    SelectAvailableSlot and SelectSlotsToActivate from slots.h, which is
+    built here unchanged. The old loops are kept here on plain values. The
+    program first checks that the two agree on random occupancy masks, then
+    times each over the same masks.
+
+    Usage: slotbench [Iterations]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <intrin.h>
+#include <assert.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+#define NT_ASSERT(_Expression)  assert(_Expression)
+
+#include "slots.h"
+
+#define NUMBER_OF_MASKS         4096
+
+//
+//  The state the two routines read and update.
+//
+
+typedef struct _SLOT_STATE {
+    UCHAR NCS;
+    UCHAR MaxDeviceQueueDepth;
+    UCHAR CurrentCommandSlot;
+    UCHAR LastActiveSlot;
+    ULONG Allocated;
+    ULONG CommandsIssued;
+    ULONG TargetSlots;
+} SLOT_STATE, *PSLOT_STATE;
+
+//
+//  GetAvailableSlot, step 2.2, before and after. Returns the queue tag, or
+//  0xFF if no slot is free.
+//
+
+static
+UCHAR
+AvailableSlotLoop (
+    _In_ PSLOT_STATE State
+    )
+{
+    UCHAR i;
+
+    for (i = State->CurrentCommandSlot; i <= State->NCS; i++) {
+        if ((State->Allocated & (1 << i)) == 0) {
+            return i;
+        }
+    }
+
+    for (i = 1; i < State->CurrentCommandSlot; i++) {
+        if ((State->Allocated & (1 << i)) == 0) {
+            return i;
+        }
+    }
+
+    return 0xFF;
+}
+
+static
+UCHAR
+AvailableSlotScan (
+    _In_ PSLOT_STATE State
+    )
+{
+    return SelectAvailableSlot(State->Allocated, State->NCS, State->CurrentCommandSlot);
+}
+
+//
+//  GetSlotToActivate, before and after. Both update LastActiveSlot.
+//
+
+static
+ULONG
+SlotToActivateLoop (
+    _Inout_ PSLOT_STATE State
+    )
+{
+    UCHAR activeCount = 0;
+    UCHAR emptyCount;
+    UCHAR requestCount;
+    UCHAR lastActiveSlot;
+    ULONG slotToActivate = 0;
+    UCHAR i;
+
+    if (State->CommandsIssued > 0) {
+        activeCount = NumberOfSetBits(State->CommandsIssued);
+    }
+
+    if (activeCount >= State->MaxDeviceQueueDepth) {
+        return 0;
+    }
+
+    requestCount = NumberOfSetBits(State->TargetSlots);
+    lastActiveSlot = State->LastActiveSlot;
+    emptyCount = State->MaxDeviceQueueDepth - activeCount;
+
+    for (i = lastActiveSlot; i <= State->NCS; i++) {
+        if ((State->TargetSlots & (1 << i)) > 0) {
+            slotToActivate |= (1 << i);
+            emptyCount--;
+            requestCount--;
+            if (emptyCount == 0 || requestCount == 0) {
+                State->LastActiveSlot = i;
+                return slotToActivate;
+            }
+        }
+    }
+
+    for (i = 1 ; i <= lastActiveSlot; i++) {
+        if ((State->TargetSlots & (1 << i)) > 0) {
+            slotToActivate |= (1 << i);
+            emptyCount--;
+            requestCount--;
+            if (emptyCount == 0 || requestCount == 0) {
+                State->LastActiveSlot = i;
+                return slotToActivate;
+            }
+        }
+    }
+
+    return slotToActivate;
+}
+
+static
+ULONG
+SlotToActivateScan (
+    _Inout_ PSLOT_STATE State
+    )
+{
+    return SelectSlotsToActivate(State->TargetSlots,
+                                 State->CommandsIssued,
+                                 State->NCS,
+                                 State->MaxDeviceQueueDepth,
+                                 &State->LastActiveSlot);
+}
+
+//
+//  Random states as the driver sees them: slot 0 is reserved, NCQ commands
+//  to activate are allocated but not issued, and the device queue depth is
+//  below the number of slots, which is when GetSlotToActivate is called.
+//
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    //
+    //  rand() may return as few as 15 bits.
+    //
+
+    return ((ULONG)rand() << 17) ^ ((ULONG)rand() << 8) ^ (ULONG)rand();
+}
+
+static
+ULONG
+RandomMask (
+    _In_ UCHAR NCS
+    )
+{
+    ULONG mask = Random32();
+
+    //
+    //  Vary the occupancy between sparse and dense.
+    //
+
+    switch (rand() % 3) {
+    case 0:
+        mask &= Random32();
+        break;
+    case 1:
+        mask |= Random32();
+        break;
+    }
+
+    return mask & SlotsUpTo(NCS) & ~(1 << 0);
+}
+
+static
+VOID
+RandomState (
+    _Out_ PSLOT_STATE State
+    )
+{
+    static const UCHAR ncs[] = { 7, 15, 31 };
+
+    State->NCS = ncs[rand() % ARRAYSIZE(ncs)];
+    State->MaxDeviceQueueDepth = (UCHAR)(1 + rand() % State->NCS);
+    State->CurrentCommandSlot = (UCHAR)(1 + rand() % State->NCS);
+    State->LastActiveSlot = (UCHAR)(rand() % (State->NCS + 1));
+    State->Allocated = RandomMask(State->NCS);
+    State->CommandsIssued = State->Allocated & RandomMask(State->NCS);
+    State->TargetSlots = State->Allocated & ~State->CommandsIssued;
+}
+
+static
+double
+Seconds (
+    _In_ LARGE_INTEGER Start,
+    _In_ LARGE_INTEGER End
+    )
+{
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)(End.QuadPart - Start.QuadPart) / (double)frequency.QuadPart;
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static SLOT_STATE states[NUMBER_OF_MASKS];
+    SLOT_STATE loopState;
+    SLOT_STATE scanState;
+    LARGE_INTEGER start, end;
+    ULONG iterations = 2000;
+    ULONG i, j;
+    volatile ULONG sink = 0;
+    double loopTime, scanTime;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 0);
+    }
+
+    srand(1);
+
+    for (i = 0; i < NUMBER_OF_MASKS; i++) {
+        RandomState(&states[i]);
+    }
+
+    //
+    //  GetAvailableSlot must pick the same slot. GetSlotToActivate must pick
+    //  the same slots and leave the same LastActiveSlot.
+    //
+
+    for (i = 0; i < NUMBER_OF_MASKS; i++) {
+
+        TEST_ASSERT(AvailableSlotLoop(&states[i]) == AvailableSlotScan(&states[i]),
+                    "GetAvailableSlot differs: NCS %u, CCS %u, allocated 0x%08lx",
+                    states[i].NCS, states[i].CurrentCommandSlot, (unsigned long)states[i].Allocated);
+
+        loopState = states[i];
+        scanState = states[i];
+
+        TEST_ASSERT(SlotToActivateLoop(&loopState) == SlotToActivateScan(&scanState) &&
+                    loopState.LastActiveSlot == scanState.LastActiveSlot,
+                    "GetSlotToActivate differs: NCS %u, depth %u, last %u, issued 0x%08lx, target 0x%08lx",
+                    states[i].NCS, states[i].MaxDeviceQueueDepth, states[i].LastActiveSlot,
+                    (unsigned long)states[i].CommandsIssued, (unsigned long)states[i].TargetSlots);
+    }
+
+    TEST_COMMENT("%u random states agree", NUMBER_OF_MASKS);
+
+    //
+    //  Time each version over the same states.
+    //
+
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < NUMBER_OF_MASKS; i++) {
+            sink += AvailableSlotLoop(&states[i]);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    loopTime = Seconds(start, end);
+
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < NUMBER_OF_MASKS; i++) {
+            sink += AvailableSlotScan(&states[i]);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    scanTime = Seconds(start, end);
+
+    TEST_COMMENT("GetAvailableSlot:   loop %6.2f ns, scan %6.2f ns per call",
+                 loopTime * 1e9 / ((double)iterations * NUMBER_OF_MASKS),
+                 scanTime * 1e9 / ((double)iterations * NUMBER_OF_MASKS));
+
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < NUMBER_OF_MASKS; i++) {
+            loopState = states[i];
+            sink += SlotToActivateLoop(&loopState);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    loopTime = Seconds(start, end);
+
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < NUMBER_OF_MASKS; i++) {
+            scanState = states[i];
+            sink += SlotToActivateScan(&scanState);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    scanTime = Seconds(start, end);
+
+    TEST_COMMENT("GetSlotToActivate:  loop %6.2f ns, scan %6.2f ns per call",
+                 loopTime * 1e9 / ((double)iterations * NUMBER_OF_MASKS),
+                 scanTime * 1e9 / ((double)iterations * NUMBER_OF_MASKS));
+
+End:
+    return Success ? 0 : 1;
+}
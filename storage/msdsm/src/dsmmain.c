@@ -3302,6 +3302,364 @@ DsmpDecrementCounters(
 }
 
 
+VOID
+DsmpRecordPathLatency(
+    _In_ PDSM_FAILOVER_GROUP FailGroup,
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ ULONG_PTR StartTime
+    )
+/*++
+
+Routine Description:
+
+    This routine folds the completion time of a read/write request into the
+    moving averages kept for the path that serviced it. These are used by the
+    Least Service Time load balance policy and reported through WMI.
+
+    Concurrent completions on the same path may occasionally lose a sample,
+    which is of no consequence for a moving average.
+
+Arguments:
+
+    FailGroup - The path that serviced the request.
+    Srb - The completed request.
+    StartTime - Interrupt time, truncated to a ULONG_PTR, at which the request
+                was sent down the path.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PCDB cdb = NULL;
+    ULONGLONG currentTime;
+    LONGLONG latency;
+    LONGLONG average;
+    LONGLONG bytes;
+
+    if (!Srb || !StartTime) {
+
+        return;
+    }
+
+    cdb = SrbGetCdb(Srb);
+
+    if (!(cdb && DsmIsReadWrite(cdb->AsByte[0])) ||
+        SRB_STATUS(SrbGetSrbStatus(Srb)) != SRB_STATUS_SUCCESS) {
+
+        return;
+    }
+
+    currentTime = KeQueryInterruptTime();
+
+    //
+    // Only the low bits of the start time fit on 32-bit systems, but they
+    // are enough to time any request that doesn't run for minutes.
+    //
+    latency = (LONGLONG)(ULONG)((ULONG_PTR)currentTime - StartTime);
+    if (latency == 0) {
+        latency = 1;
+    }
+
+    bytes = SrbGetDataTransferLength(Srb);
+
+    average = InterlockedCompareExchange64(&FailGroup->AverageLatency, 0, 0);
+    if (average) {
+        latency = average + ((latency - average) >> DSM_LST_AVERAGE_SHIFT);
+    }
+    InterlockedExchange64(&FailGroup->AverageLatency, max(latency, 1));
+
+    average = InterlockedCompareExchange64(&FailGroup->AverageTransferLength, 0, 0);
+    if (average) {
+        bytes = average + ((bytes - average) >> DSM_LST_AVERAGE_SHIFT);
+    }
+    InterlockedExchange64(&FailGroup->AverageTransferLength, bytes);
+
+    InterlockedExchange64(&FailGroup->LastCompletionTime, (LONGLONG)currentTime);
+
+    return;
+}
+
+
+VOID
+DsmpResetPathLatency(
+    _In_ PDSM_FAILOVER_GROUP FailGroup
+    )
+/*++
+
+Routine Description:
+
+    This routine throws away the completion time history of a path, so that
+    the Least Service Time policy probes it afresh. It is called when the
+    path's access state changes, since the history no longer reflects how
+    the target port group will service requests.
+
+Arguments:
+
+    FailGroup - The path whose history is to be thrown away.
+
+Return Value:
+
+    None
+
+--*/
+{
+    TracePrint((TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_GENERAL,
+                "DsmpResetPathLatency (FOG %p): Resetting average latency %I64u.\n",
+                FailGroup,
+                FailGroup->AverageLatency));
+
+    InterlockedExchange64(&FailGroup->AverageLatency, 0);
+    InterlockedExchange64(&FailGroup->AverageTransferLength, 0);
+    InterlockedExchange64(&FailGroup->LastCompletionTime, 0);
+
+    return;
+}
+
+
+ULONGLONG
+DsmpGetPredictedServiceTime(
+    _In_ PDSM_FAILOVER_GROUP FailGroup,
+    _In_ ULONG Bytes,
+    _In_ ULONGLONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    This routine predicts how long a request of the given size would take to
+    complete if it were sent down the path now: the path's average completion
+    time scaled by the IO that would be outstanding on it, measured in
+    average-sized requests.
+
+    A path that has had nothing in flight for a while has its average decayed,
+    so that it gets retried once whatever made it slow has had time to clear.
+    A path without history is predicted to be free if it is idle (so that it
+    gets probed) and to be the slowest of all otherwise.
+
+Arguments:
+
+    FailGroup - The candidate path.
+    Bytes - Data transfer length of the request, zero if it has none.
+    CurrentTime - The current interrupt time.
+
+Return Value:
+
+    Predicted service time in 100ns units.
+
+--*/
+{
+    ULONGLONG latency = (ULONGLONG)InterlockedCompareExchange64(&FailGroup->AverageLatency, 0, 0);
+    ULONGLONG transferLength = (ULONGLONG)InterlockedCompareExchange64(&FailGroup->AverageTransferLength, 0, 0);
+    ULONGLONG lastCompletion = (ULONGLONG)InterlockedCompareExchange64(&FailGroup->LastCompletionTime, 0, 0);
+    ULONGLONG outstanding = FailGroup->OutstandingBytesOfIO;
+    LONG inFlight = FailGroup->NumberOfRequestsInFlight;
+    ULONGLONG staleIntervals;
+
+    if (latency == 0) {
+
+        return (inFlight > 0) ? MAXULONGLONG - 1 : 0;
+    }
+
+    if (inFlight <= 0 && CurrentTime > lastCompletion) {
+
+        staleIntervals = (CurrentTime - lastCompletion) / DSM_LST_STALE_INTERVAL;
+        latency >>= min(staleIntervals, 63);
+    }
+
+    //
+    // Keep the product below from overflowing. Neither clamp is reached by a
+    // path that is in any reasonable shape.
+    //
+    latency = min(latency, MAXULONG);
+
+    if (transferLength == 0 || (Bytes == 0 && outstanding == 0)) {
+
+        return latency * (ULONGLONG)(max(inFlight, 0) + 1);
+    }
+
+    if (Bytes == 0) {
+
+        Bytes = (ULONG)min(transferLength, MAXULONG);
+    }
+
+    return latency * min(outstanding + Bytes, MAXULONG) / transferLength;
+}
+
+
+VOID
+DsmpUpdateActivePaths(
+    _In_ PDSM_GROUP_ENTRY Group
+    )
+/*++
+
+Routine Description:
+
+    This routine rebuilds the group's snapshot of Active/Optimized devices
+    that DsmpGetNextActivePath() picks from. It is called whenever the path
+    states of the group are recomputed, ie. on path arrival, removal and
+    failure, path verification, TPG state changes and LB policy changes.
+
+    N.B: This routine must be called with DSM Context Lock held in Exclusive
+         mode. The lock keeps devices from being removed from the group while
+         their states are read, and keeps rebuilders from running at once.
+
+Arguments:
+
+    Group - The group whose snapshot is to be rebuilt.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    DsmpRebuildActivePaths(Group);
+
+    return;
+}
+
+
+VOID
+DsmpRebuildActivePaths(
+    _In_ PDSM_GROUP_ENTRY Group
+    )
+/*++
+
+Routine Description:
+
+    This routine rewrites both copies of the group's snapshot of
+    Active/Optimized devices. Each copy is rewritten while readers are
+    steered to the other one, so they keep picking from a complete snapshot.
+
+    The caller must hold the DSM Context Lock in Exclusive mode.
+
+Arguments:
+
+    Group - The group whose snapshot is to be rebuilt.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PDSM_DEVICE_INFO deviceInfo;
+    DSM_ACTIVE_PATHS activePaths;
+    ULONG count = 0;
+    ULONG index;
+
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    for (index = 0; index < DSM_MAX_PATHS; index++) {
+
+        deviceInfo = Group->DeviceList[index];
+
+        if (deviceInfo &&
+            DsmpIsDeviceInitialized(deviceInfo) &&
+            DsmpIsDeviceUsable(deviceInfo) &&
+            DsmpIsDeviceUsablePR(deviceInfo) &&
+            deviceInfo->State == DSM_DEV_ACTIVE_OPTIMIZED) {
+
+            activePaths.Paths[count++] = deviceInfo;
+        }
+    }
+
+    activePaths.NumberPaths = count;
+
+    DsmpPublishActivePaths(&Group->ActivePathsSequence,
+                           Group->ActivePaths,
+                           &activePaths);
+
+    TracePrint((TRACE_LEVEL_INFORMATION,
+                TRACE_FLAG_GENERAL,
+                "DsmpRebuildActivePaths (Group %p): %u active paths.\n",
+                Group,
+                count));
+
+    return;
+}
+
+
+PDSM_FAILOVER_GROUP
+DsmpGetNextActivePath(
+    _In_ PDSM_GROUP_ENTRY Group,
+    _In_ PDSM_IDS DsmList
+    )
+/*++
+
+Routine Description:
+
+    This routine is the lock-free fast path of the Round Robin policies. It
+    picks the next device from the group's snapshot of Active/Optimized
+    devices, using the current processor's cursor.
+
+    The device picked is only used if it is still in DsmList (which MPIO
+    keeps valid for the duration of the call) and is still Active/Optimized.
+    Otherwise NULL is returned, for the caller to fall back to walking
+    DsmList. The snapshot is never rebuilt from here: that is done by the
+    routines that change the path states, under the DSM Context Lock.
+
+Arguments:
+
+    Group - The group the request is for.
+    DsmList - List of DSM Ids sent by MPIO.
+
+Return Value:
+
+    Path to be used for the request, or NULL.
+
+--*/
+{
+    PDSM_DEVICE_INFO deviceInfo;
+    PDSM_RR_CURSOR cursor;
+    ULONG inx;
+
+    cursor = &Group->RoundRobinCursors[KeGetCurrentProcessorIndex() % DSM_RR_CURSORS];
+
+    deviceInfo = DsmpPickActivePath(&Group->ActivePathsSequence,
+                                    Group->ActivePaths,
+                                    cursor);
+
+    if (deviceInfo) {
+
+        for (inx = 0; inx < DsmList->Count; inx++) {
+
+            if (DsmList->IdList[inx] == deviceInfo) {
+
+                if (DsmpIsDeviceInitialized(deviceInfo) &&
+                    DsmpIsDeviceUsable(deviceInfo) &&
+                    DsmpIsDeviceUsablePR(deviceInfo) &&
+                    deviceInfo->State == DSM_DEV_ACTIVE_OPTIMIZED) {
+
+                    return deviceInfo->FailGroup;
+                }
+
+                break;
+            }
+        }
+
+        //
+        // The snapshot is stale. The state change that made it so rebuilds
+        // it once it is done.
+        //
+        TracePrint((TRACE_LEVEL_INFORMATION,
+                    TRACE_FLAG_RW,
+                    "DsmpGetNextActivePath (Group %p): DevInfo %p no longer active.\n",
+                    Group,
+                    deviceInfo));
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+
 PDSM_FAILOVER_GROUP
 DsmpGetPath(
     _In_ IN PDSM_CONTEXT DsmContext,
@@ -3405,6 +3763,19 @@ Return Value:
     //          M paths AU, SB or UA    <- if no AO paths available, subset of these become active (based on TPG
     //                                        states after transition) - one with least cumulative outstanding is chosen.
     //
+    // Least-Service-Time:
+    // -------------------
+    //      If symmetric LUA:
+    //          N paths AO,             <- one with least predicted service time (average completion time scaled
+    //                                     by outstanding IO) is chosen
+    //          Rest of the paths Failed
+    //
+    //      If ALUA:
+    //          N paths AO,             <- one with least predicted service time is chosen
+    //          M paths AU, SB or UA    <- if no AO paths available, subset of these become active (based on TPG
+    //                                        states after transition) - one with least predicted service time is chosen.
+    //                                        A path's history is discarded when its TPG changes state.
+    //
     // Actual implementation of algorithm happens in the following routines: DsmpGetAnyActivePath,
     //          DsmpGetActivePathToBeUsed, flavors of DsmpSetLBForPathXXX.
     //
@@ -3462,6 +3833,23 @@ Return Value:
             ULONG counter = 0;
             BOOLEAN reset = FALSE;
 
+            //
+            // Pick the next path from the snapshot of active paths if possible,
+            // without walking the list or updating PathToBeUsed.
+            //
+            failGroup = DsmpGetNextActivePath(groupEntry, DsmList);
+
+            if (failGroup) {
+
+                TracePrint((TRACE_LEVEL_VERBOSE,
+                            TRACE_FLAG_RW,
+                            "DsmpGetPath (DsmIds %p): Path to be used from snapshot is %p.\n",
+                            DsmList,
+                            failGroup));
+
+                break;
+            }
+
             for (inx = 0; inx < DsmList->Count; inx++) {
 
                 deviceInfo = DsmList->IdList[inx];
@@ -3814,6 +4202,90 @@ Return Value:
             break;
         }
 
+        case DSM_LB_LEAST_SERVICE_TIME: {
+
+            ULONG bytes = 0;
+            PCDB cdb = NULL;
+            ULONGLONG currentTime = KeQueryInterruptTime();
+            ULONGLONG serviceTime;
+            ULONGLONG leastServiceTime = MAXULONGLONG;
+
+            if (Srb) {
+
+                cdb = SrbGetCdb(Srb);
+
+                if (cdb && DsmIsReadWrite(cdb->AsByte[0])) {
+
+                    bytes = SrbGetDataTransferLength(Srb);
+                }
+            }
+
+            //
+            // Choose whichever Active/Optimized path is predicted to service
+            // the request soonest.
+            //
+            for (inx = 0; inx < DsmList->Count; inx++) {
+
+                deviceInfo = DsmList->IdList[inx];
+
+                if (!(deviceInfo && DsmpIsDeviceInitialized(deviceInfo) && DsmpIsDeviceUsable(deviceInfo) && DsmpIsDeviceUsablePR(deviceInfo))) {
+
+                    continue;
+                }
+
+                if (deviceInfo->State != DSM_DEV_ACTIVE_OPTIMIZED) {
+
+                    continue;
+                }
+
+                serviceTime = DsmpGetPredictedServiceTime(deviceInfo->FailGroup, bytes, currentTime);
+
+                if (serviceTime < leastServiceTime) {
+
+                    leastServiceTime = serviceTime;
+                    failGroup = deviceInfo->FailGroup;
+                }
+            }
+
+            if (failGroup) {
+
+                TracePrint((TRACE_LEVEL_VERBOSE,
+                            TRACE_FLAG_RW,
+                            "DsmpGetPath (DsmIds %p): Path to be used for LST is %p (predicted %I64u).\n",
+                            DsmList,
+                            failGroup,
+                            leastServiceTime));
+
+            } else {
+
+                //
+                // As for LQD, ALUA storage may be left with no TPG in the A/O
+                // state. Return some path instead of failing the I/O.
+                //
+                if (!DsmpIsSymmetricAccess((PDSM_DEVICE_INFO)DsmList->IdList[0])) {
+
+                    //
+                    // Use the same path as the one used for the previous request.
+                    //
+                    failGroup = groupEntry->PathToBeUsed;
+
+                    TracePrint((TRACE_LEVEL_WARNING,
+                                TRACE_FLAG_PNP,
+                                "DsmpGetPath (DsmIds %p): Using same path (FOG %p) as previous request for LST.\n",
+                                DsmList,
+                                failGroup));
+                } else {
+
+                    TracePrint((TRACE_LEVEL_ERROR,
+                                TRACE_FLAG_RW,
+                                "DsmpGetPath (DsmIds %p): Failed to find a path for LST.\n",
+                                DsmList));
+                }
+            }
+
+            break;
+        }
+
         default: {
 
             TracePrint((TRACE_LEVEL_ERROR,
@@ -4432,6 +4904,8 @@ Return Value:
 
     if (failGroup) {
 
+        DsmpRecordPathLatency(failGroup, Srb, (ULONG_PTR)irpStack->Parameters.Others.Argument4);
+
         if (DsmpDecrementCounters(failGroup, Srb)) {
 
             //
@@ -5087,12 +5561,13 @@ Return Value:
 
     switch (Group->LoadBalanceType) {
 
+        case DSM_LB_LEAST_SERVICE_TIME:
         case DSM_LB_LEAST_BLOCKS:
         case DSM_LB_DYN_LEAST_QUEUE_DEPTH: {
 
             //
-            // Since we choose the path with the smallest queue or cumulative size in
-            // DsmpGetPath, we just pick any path now
+            // Since we choose the path with the smallest queue, cumulative size or
+            // predicted service time in DsmpGetPath, we just pick any path now
             //
 
             // fall through
@@ -5894,6 +6369,8 @@ Return Value:
                 DeviceInfo->PreviousState = DeviceInfo->State;
                 DeviceInfo->State = DSM_DEV_ACTIVE_OPTIMIZED;
 
+                DsmpUpdateActivePaths(group);
+
                 break;
             }
         }
@@ -6168,13 +6645,14 @@ Return Value:
             break;
         }
 
+        case DSM_LB_LEAST_SERVICE_TIME:
         case DSM_LB_LEAST_BLOCKS:
         case DSM_LB_ROUND_ROBIN:
         case DSM_LB_DYN_LEAST_QUEUE_DEPTH:
         case DSM_LB_WEIGHTED_PATHS: {
 
             //
-            // In RR, LWP, LB and LQD all paths are active so the new device
+            // In RR, LWP, LB, LST and LQD all paths are active so the new device
             // becomes AO or AU.
             //
             if (NewDeviceInfo->State != DSM_DEV_ACTIVE_OPTIMIZED) {
@@ -6204,6 +6682,8 @@ Return Value:
 
 __Exit_DsmpSetLBForPathArrival:
 
+    DsmpUpdateActivePaths(group);
+
     //
     // Update the next path to be used for the group
     //
@@ -6434,6 +6914,8 @@ Return Value:
 
 __Exit_DsmpSetLBForPathArrivalALUA:
 
+    DsmpUpdateActivePaths(group);
+
     //
     // Update the next path to be used for the group
     //
@@ -6593,13 +7075,14 @@ Return Value:
             break;
         }
 
+        case DSM_LB_LEAST_SERVICE_TIME:
         case DSM_LB_LEAST_BLOCKS:
         case DSM_LB_ROUND_ROBIN:
         case DSM_LB_WEIGHTED_PATHS:
         case DSM_LB_DYN_LEAST_QUEUE_DEPTH: {
 
             //
-            // In RR, LQD, LB and LWP, all paths are active so we don't
+            // In RR, LQD, LB, LST and LWP, all paths are active so we don't
             // need to worry about activating a new path
             //
             TracePrint((TRACE_LEVEL_INFORMATION,
@@ -6616,6 +7099,8 @@ Return Value:
         }
     }
 
+    DsmpUpdateActivePaths(group);
+
     //
     // Update the next path to be used for the group
     //
@@ -6734,7 +7219,7 @@ Return Value:
     }
 
     if (group->LoadBalanceType < DSM_LB_FAILOVER ||
-        group->LoadBalanceType > DSM_LB_LEAST_BLOCKS) {
+        group->LoadBalanceType > DSM_LB_LEAST_SERVICE_TIME) {
 
         status = STATUS_INVALID_PARAMETER;
 
@@ -6826,6 +7311,8 @@ Return Value:
         status = STATUS_SUCCESS;
     }
 
+    DsmpUpdateActivePaths(group);
+
     //
     // Update the next path to be used for the group
     //
@@ -6999,7 +7486,7 @@ Return Value:
     group = FailingDeviceInfo->Group;
 
     if (group->LoadBalanceType < DSM_LB_FAILOVER ||
-        group->LoadBalanceType > DSM_LB_LEAST_BLOCKS) {
+        group->LoadBalanceType > DSM_LB_LEAST_SERVICE_TIME) {
 
         status = STATUS_INVALID_PARAMETER;
 
@@ -7278,6 +7765,13 @@ Return Value:
         status = STATUS_SUCCESS;
     }
 
+    //
+    // The lock was dropped above, so take it back for the rebuild.
+    //
+    irql = ExAcquireSpinLockExclusive(&(DsmContext->DsmContextLock));
+    DsmpUpdateActivePaths(group);
+    ExReleaseSpinLockExclusive(&(DsmContext->DsmContextLock), irql);
+
     if (deviceInfo) {
 
         //
@@ -7378,7 +7872,7 @@ Return Value:
 
 
     if (group->LoadBalanceType < DSM_LB_FAILOVER ||
-        group->LoadBalanceType > DSM_LB_LEAST_BLOCKS) {
+        group->LoadBalanceType > DSM_LB_LEAST_SERVICE_TIME) {
 
         status = STATUS_INVALID_PARAMETER;
 
@@ -8574,6 +9068,8 @@ Return Value:
                                            failDevInfoListEntry);
         }
 
+        DsmpUpdateActivePaths(deviceInfo->Group);
+
         ExReleaseSpinLockExclusive(&(context->CompletionContext->DsmContext->DsmContextLock), irql);
     }
 
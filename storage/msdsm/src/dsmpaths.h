@@ -0,0 +1,168 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    dsmpaths.h
+
+Abstract:
+
+    The snapshot of a group's Active/Optimized devices that the Round Robin
+    policies pick from without taking locks, and the routines that publish
+    and read it. Only interlocked and barrier primitives are used here, so
+    the path selection benchmark in ..\test compiles this file as well.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+//
+// Number of round robin cursors kept per group. Processors use the cursor at
+// their index modulo this, and each cursor has a cache line to itself, so that
+// processors picking paths for the same LUN don't contend with each other.
+//
+#define DSM_RR_CURSORS 16
+
+typedef struct _DSM_RR_CURSOR {
+
+    ULONG Cursor;
+
+    UCHAR Reserved[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(ULONG)];
+
+} DSM_RR_CURSOR, *PDSM_RR_CURSOR;
+
+//
+// One copy of the snapshot of a group's Active/Optimized devices.
+//
+typedef struct _DSM_ACTIVE_PATHS {
+
+    ULONG NumberPaths;
+
+    PVOID Paths[DSM_MAX_PATHS];
+
+} DSM_ACTIVE_PATHS, *PDSM_ACTIVE_PATHS;
+
+
+__inline
+VOID
+DsmpPublishActivePaths(
+    _Inout_ volatile LONG *Sequence,
+    _Out_writes_(2) PDSM_ACTIVE_PATHS ActivePaths,
+    _In_ PDSM_ACTIVE_PATHS Snapshot
+    )
+/*++
+
+Routine Description:
+
+    This routine copies Snapshot into both copies of a group's snapshot.
+    Readers use ActivePaths[*Sequence & 1]. Each copy is rewritten while
+    readers are steered to the other one, so they keep picking from a
+    complete snapshot, and readers still on the copy being rewritten see
+    the sequence change and retry.
+
+    Callers must not publish at the same time.
+
+Arguments:
+
+    Sequence - The group's snapshot sequence.
+    ActivePaths - The two copies of the group's snapshot.
+    Snapshot - The devices to publish.
+
+Return Value:
+
+    None
+
+--*/
+{
+    LONG sequence;
+    ULONG copy;
+
+    for (copy = 0; copy < 2; copy++) {
+
+        sequence = InterlockedIncrement(Sequence);
+
+        RtlCopyMemory(&ActivePaths[(sequence & 1) ^ 1],
+                      Snapshot,
+                      sizeof(DSM_ACTIVE_PATHS));
+    }
+
+    return;
+}
+
+
+__inline
+PVOID
+DsmpPickActivePath(
+    _In_ volatile LONG *Sequence,
+    _In_reads_(2) PDSM_ACTIVE_PATHS ActivePaths,
+    _Inout_ PDSM_RR_CURSOR Cursor
+    )
+/*++
+
+Routine Description:
+
+    This routine picks the next device from a group's snapshot with one of
+    its cursors, without taking locks.
+
+Arguments:
+
+    Sequence - The group's snapshot sequence.
+    ActivePaths - The two copies of the group's snapshot.
+    Cursor - The cursor of the current processor.
+
+Return Value:
+
+    The device picked, or NULL if the snapshot is empty or kept changing
+    while it was read. The caller still has to check that the device may
+    be used.
+
+--*/
+{
+    PDSM_ACTIVE_PATHS activePaths;
+    PVOID path;
+    LONG sequence;
+    ULONG count;
+    ULONG retry;
+
+    for (retry = 0; retry < 4; retry++) {
+
+        sequence = ReadAcquire(Sequence);
+        activePaths = &ActivePaths[sequence & 1];
+
+        count = activePaths->NumberPaths;
+
+        if (count == 0) {
+
+            if (ReadNoFence(Sequence) != sequence) {
+
+                continue;
+            }
+
+            return NULL;
+        }
+
+        //
+        // Processors sharing a cursor may occasionally pick the same path
+        // twice in a row, which is harmless.
+        //
+        path = activePaths->Paths[Cursor->Cursor++ % count];
+
+        MemoryBarrier();
+
+        //
+        // A rebuilder moved on to rewrite this copy; the other one is
+        // complete, so try again.
+        //
+        if (ReadNoFence(Sequence) != sequence) {
+
+            continue;
+        }
+
+        return path;
+    }
+
+    return NULL;
+}
@@ -2831,7 +2831,9 @@ Return Value:
                         //
                         if (NT_SUCCESS(status)) {
 
+                            irql = ExAcquireSpinLockExclusive(&(dsmCtxt->DsmContextLock));
                             DsmpAdjustDeviceStatesALUA(group, NULL, SpecialHandlingFlag);
+                            ExReleaseSpinLockExclusive(&(dsmCtxt->DsmContextLock), irql);
                         }
                     }
                 }
@@ -2841,8 +2843,14 @@ Return Value:
 
                 if (deviceInfo->State >= DSM_DEV_FAILED) {
 
+                    irql = ExAcquireSpinLockExclusive(&(dsmCtxt->DsmContextLock));
+
                     foGroup->State = DSM_FG_NORMAL;
                     deviceInfo->State = deviceInfo->LastKnownGoodState;
+
+                    DsmpUpdateActivePaths(group);
+
+                    ExReleaseSpinLockExclusive(&(dsmCtxt->DsmContextLock), irql);
                 }
             }
         }
@@ -3771,6 +3779,7 @@ Return Value:
                 }
 
                 irpStack->Parameters.Others.Argument3 = failGroup;
+                irpStack->Parameters.Others.Argument4 = (PVOID)(ULONG_PTR)KeQueryInterruptTime();
 
                 DsmpIncrementCounters(failGroup, Srb);
             }
@@ -4165,9 +4174,11 @@ Return Value:
                 DsmId));
 
     //
-    // Save off the path that was selected to service this request in Argument3.
+    // Save off the path that was selected to service this request in Argument3,
+    // and the time it was sent down that path in Argument4.
     //
     irpStack->Parameters.Others.Argument3 = failGroup;
+    irpStack->Parameters.Others.Argument4 = (PVOID)(ULONG_PTR)KeQueryInterruptTime();
 
     DsmpIncrementCounters(failGroup, Srb);
 
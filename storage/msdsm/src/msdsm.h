@@ -96,10 +96,21 @@ Notes:
 //
 #define DSM_SERIAL_NUMBER_BUFFER_SIZE 255
 
+//
+// Least Service Time load balance policy. Requests are sent down the
+// Active/Optimized path with the lowest predicted service time, based on the
+// moving average of each path's completion time and the IO outstanding on it.
+// It takes the vendor specific policy value, being MSDSM's own policy.
+//
+#ifndef DSM_LB_VENDOR_SPECIFIC
+#define DSM_LB_VENDOR_SPECIFIC 7
+#endif
+#define DSM_LB_LEAST_SERVICE_TIME DSM_LB_VENDOR_SPECIFIC
+
 //
 // Number of LB Policies that are supported by this driver.
 //
-#define DSM_NUMBER_OF_LB_POLICIES 6
+#define DSM_NUMBER_OF_LB_POLICIES 7
 
 //
 // Size of the buffer passed to read in Persistent Reserve keys.
@@ -112,6 +123,15 @@ Notes:
 //
 #define DSM_LEAST_BLOCKS_DEFAULT_THRESHOLD 0x00100000
 
+//
+// The Least Service Time policy's moving averages give each new sample a
+// weight of 1/2^DSM_LST_AVERAGE_SHIFT. A path that has had nothing in flight
+// for DSM_LST_STALE_INTERVAL has its average halved for each such interval,
+// so that a path that was slow once gets tried again. In 100ns units.
+//
+#define DSM_LST_AVERAGE_SHIFT 3
+#define DSM_LST_STALE_INTERVAL 10000000
+
 //
 // Initialization data structure that needs to be filled in for MPIO
 //
@@ -826,6 +846,11 @@ typedef enum _DSM_DEFAULT_LB_POLICY_TYPE {
 
 typedef ULONG   DSM_LOAD_BALANCE_TYPE, *PDSM_LOAD_BALANCE_TYPE;
 
+//
+// Round robin cursors and the snapshot of a group's Active/Optimized devices.
+//
+#include "dsmpaths.h"
+
 
 //
 // Information about multi-path groups: The same device found via multiple paths
@@ -976,6 +1001,22 @@ typedef struct _DSM_GROUP_ENTRY {
     //
     KEVENT Event;
 
+    //
+    // Snapshot of the devices that were Active/Optimized when the group's path
+    // states last changed, read without locks by the Round Robin policies.
+    // It is kept twice. Readers use ActivePaths[ActivePathsSequence & 1], and
+    // retry if the sequence changed while they read it. A rebuilder steers
+    // them to one copy while it rewrites the other, so readers never wait.
+    // It is only rebuilt with the DsmContextLock held exclusive.
+    //
+    volatile LONG ActivePathsSequence;
+    DSM_ACTIVE_PATHS ActivePaths[2];
+
+    //
+    // Per-processor cursors into ActivePaths.
+    //
+    DSM_RR_CURSOR RoundRobinCursors[DSM_RR_CURSORS];
+
 } DSM_GROUP_ENTRY, *PDSM_GROUP_ENTRY;
 
 //
@@ -1025,6 +1066,16 @@ typedef struct _DSM_FAILOVER_GROUP {
     //
     volatile LONG NumberOfRequestsInFlight;
 
+    //
+    // Moving averages of the completion time (in 100ns units) and of the
+    // transfer length of the read/write requests completed on this path,
+    // and the interrupt time at which the last one completed. These will be
+    // used in LST load balance policy. An average of zero means no sample.
+    //
+    volatile LONGLONG AverageLatency;
+    volatile LONGLONG AverageTransferLength;
+    volatile LONGLONG LastCompletionTime;
+
     //
     // Number of devices in this FOG.
     //
@@ -500,6 +500,41 @@ DsmpDecrementCounters(
     _In_ PSCSI_REQUEST_BLOCK Srb
     );
 
+VOID
+DsmpRecordPathLatency(
+    _In_ PDSM_FAILOVER_GROUP FailGroup,
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ ULONG_PTR StartTime
+    );
+
+VOID
+DsmpResetPathLatency(
+    _In_ PDSM_FAILOVER_GROUP FailGroup
+    );
+
+ULONGLONG
+DsmpGetPredictedServiceTime(
+    _In_ PDSM_FAILOVER_GROUP FailGroup,
+    _In_ ULONG Bytes,
+    _In_ ULONGLONG CurrentTime
+    );
+
+VOID
+DsmpUpdateActivePaths(
+    _In_ PDSM_GROUP_ENTRY Group
+    );
+
+VOID
+DsmpRebuildActivePaths(
+    _In_ PDSM_GROUP_ENTRY Group
+    );
+
+PDSM_FAILOVER_GROUP
+DsmpGetNextActivePath(
+    _In_ PDSM_GROUP_ENTRY Group,
+    _In_ PDSM_IDS DsmList
+    );
+
 PDSM_FAILOVER_GROUP
 DsmpGetPath(
     _In_ IN PDSM_CONTEXT DsmContext,
@@ -1264,6 +1299,15 @@ DsmpQueryDevicePerf(
     _Out_writes_to_(*OutBufferSize, *OutBufferSize) PUCHAR Buffer
     );
 
+NTSTATUS
+DsmpQueryDeviceLatency(
+    _In_ PDSM_CONTEXT DsmContext,
+    _In_ PDSM_IDS DsmIds,
+    _In_ ULONG InBufferSize,
+    _Inout_ PULONG OutBufferSize,
+    _Out_writes_to_(*OutBufferSize, *OutBufferSize) PUCHAR Buffer
+    );
+
 NTSTATUS
 DsmpClearPerfCounters(
     _In_ IN PDSM_CONTEXT DsmContext,
@@ -6252,6 +6252,16 @@ Return Value:
                             deviceInfo->PreviousState,
                             deviceInfo->State));
 
+                //
+                // For LST, the path's completion times were measured against the
+                // TPG's previous state, so have it probed afresh.
+                //
+                if (Group->LoadBalanceType == DSM_LB_LEAST_SERVICE_TIME &&
+                    deviceInfo->PreviousState != deviceInfo->State) {
+
+                    DsmpResetPathLatency(deviceInfo->FailGroup);
+                }
+
                 if (deviceInfo->ALUAState == DSM_DEV_ACTIVE_OPTIMIZED) {
 
                     //
@@ -6697,9 +6707,12 @@ Return Value:
 
     //
     // There may have been a change to the device states.
-    // DsmpGetPath() will pick these changes for RR, RRWS and LQD.
+    // DsmpGetPath() will pick these changes for RR, RRWS and LQD once the
+    // active paths snapshot is rebuilt.
     // However, it won't for FOO and WP, so update PTBU if needed.
     //
+    DsmpUpdateActivePaths(Group);
+
     if (Group->LoadBalanceType == DSM_LB_FAILOVER ||
         Group->LoadBalanceType == DSM_LB_WEIGHTED_PATHS) {
 
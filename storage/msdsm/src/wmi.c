@@ -96,6 +96,7 @@ GUID DSM_QueryLBPolicyV2GUID = DSM_QueryLBPolicy_V2Guid;
 GUID DSM_QuerySupportedLBPoliciesV2GUID = DSM_QuerySupportedLBPolicies_V2Guid;
 GUID MSDSM_DEVICE_PERFGUID = MSDSM_DEVICE_PERFGuid;
 GUID MSDSM_WMI_METHODSGUID = MSDSM_WMI_METHODSGuid;
+GUID MSDSM_DEVICE_LATENCYGUID = MSDSM_DEVICE_LATENCYGuid;
 
 //
 // Symbolic names for the Device-centric guid indexes
@@ -108,6 +109,7 @@ GUID MSDSM_WMI_METHODSGUID = MSDSM_WMI_METHODSGuid;
 #define DSM_QuerySupportedLBPoliciesV2GUID_Index    5
 #define MSDSM_DEVICE_PERFGuidIndex                  6
 #define MSDSM_WMI_METHODSGuidIndex                  7
+#define MSDSM_DEVICE_LATENCYGuidIndex               8
 
 WMIGUIDREGINFO DsmGuidList[] = {
     {
@@ -156,6 +158,12 @@ WMIGUIDREGINFO DsmGuidList[] = {
         &MSDSM_WMI_METHODSGUID,
         1,
         0
+    },
+
+    {
+        &MSDSM_DEVICE_LATENCYGUID,
+        1,
+        0
     }
 };
 
@@ -495,7 +503,7 @@ Return Value:
                     continue;
                 }
 
-                if (targetPolicyInfo->LoadBalancePolicy >= DSM_LB_VENDOR_SPECIFIC) {
+                if (targetPolicyInfo->LoadBalancePolicy > DSM_LB_LEAST_SERVICE_TIME) {
 
                     errorStatus = STATUS_INVALID_PARAMETER;
 
@@ -571,7 +579,7 @@ Return Value:
             //
             // First ensure that the values make sense.
             //
-            if (loadBalancePolicy >= DSM_LB_VENDOR_SPECIFIC) {
+            if (loadBalancePolicy > DSM_LB_LEAST_SERVICE_TIME) {
 
                 status = STATUS_INVALID_PARAMETER;
                 TracePrint((TRACE_LEVEL_ERROR,
@@ -870,6 +878,19 @@ Return Value:
             break;
         }
 
+        case MSDSM_DEVICE_LATENCYGuidIndex: {
+
+            *DataLength = BufferAvail;
+
+            status = DsmpQueryDeviceLatency(DsmContext,
+                                            DsmIds,
+                                            BufferAvail,
+                                            DataLength,
+                                            Buffer);
+
+            break;
+        }
+
         case MSDSM_WMI_METHODSGuidIndex: {
 
             //
@@ -1175,7 +1196,8 @@ Return Value:
             NT_ASSERT(groupEntry->LoadBalanceType != DSM_LB_ROUND_ROBIN &&
                    groupEntry->LoadBalanceType != DSM_LB_WEIGHTED_PATHS &&
                    groupEntry->LoadBalanceType != DSM_LB_DYN_LEAST_QUEUE_DEPTH &&
-                   groupEntry->LoadBalanceType != DSM_LB_LEAST_BLOCKS);
+                   groupEntry->LoadBalanceType != DSM_LB_LEAST_BLOCKS &&
+                   groupEntry->LoadBalanceType != DSM_LB_LEAST_SERVICE_TIME);
         }
 #endif
 
@@ -1550,6 +1572,7 @@ Return Value:
     ULONGLONG preferredPath = (ULONGLONG)((ULONG_PTR)MAXULONG);
     ULONG devInfoIndex;
     ULONG SpecialHandlingFlag = 0;
+    KIRQL irql;
     
     TracePrint((TRACE_LEVEL_VERBOSE,
                 TRACE_FLAG_WMI,
@@ -1696,6 +1719,8 @@ Return Value:
         loadBalanceType = DSM_LB_ROUND_ROBIN_WITH_SUBSET;
     }
 
+    irql = ExAcquireSpinLockExclusive(&(DsmContext->DsmContextLock));
+
     //
     // Finally set the load balance policy and the preferred path.
     //
@@ -1713,6 +1738,8 @@ Return Value:
                                   SpecialHandlingFlag);
     }
 
+    ExReleaseSpinLockExclusive(&(DsmContext->DsmContextLock), irql);
+
 __Exit_DsmpClearLoadBalancePolicy:
 
     if (deviceKey) {
@@ -2034,7 +2061,8 @@ Return Value:
                     if (loadBalancePolicy == DSM_LB_ROUND_ROBIN ||
                         loadBalancePolicy == DSM_LB_WEIGHTED_PATHS ||
                         loadBalancePolicy == DSM_LB_DYN_LEAST_QUEUE_DEPTH ||
-                        loadBalancePolicy == DSM_LB_LEAST_BLOCKS) {
+                        loadBalancePolicy == DSM_LB_LEAST_BLOCKS ||
+                        loadBalancePolicy == DSM_LB_LEAST_SERVICE_TIME) {
 
                         if (devInfo->TargetPortGroup && devInfo->ALUAState != DSM_DEV_ACTIVE_UNOPTIMIZED) {
 
@@ -2077,7 +2105,8 @@ Return Value:
                 if (loadBalancePolicy == DSM_LB_ROUND_ROBIN ||
                     loadBalancePolicy == DSM_LB_WEIGHTED_PATHS ||
                     loadBalancePolicy == DSM_LB_DYN_LEAST_QUEUE_DEPTH ||
-                    loadBalancePolicy == DSM_LB_LEAST_BLOCKS) {
+                    loadBalancePolicy == DSM_LB_LEAST_BLOCKS ||
+                    loadBalancePolicy == DSM_LB_LEAST_SERVICE_TIME) {
 
                     if ((!devInfo->TargetPortGroup) ||
                         (devInfo->TargetPortGroup && devInfo->State != devInfo->ALUAState)) {
@@ -2403,6 +2432,8 @@ Return Value:
                                         DsmWmiVersion,
                                         supportedLBPolicies);
 
+        DsmpUpdateActivePaths(groupEntry);
+
         //
         // Update the next path to be used for the group
         //
@@ -2575,7 +2606,7 @@ Return Value:
     }
 
     if ((supportedLBPolicies->LoadBalancePolicy < DSM_LB_FAILOVER) ||
-        (supportedLBPolicies->LoadBalancePolicy > DSM_LB_LEAST_BLOCKS)) {
+        (supportedLBPolicies->LoadBalancePolicy > DSM_LB_LEAST_SERVICE_TIME)) {
 
         TracePrint((TRACE_LEVEL_ERROR,
                     TRACE_FLAG_WMI,
@@ -3140,6 +3171,144 @@ __Exit_DsmpQueryDevicePerf:
 }
 
 
+NTSTATUS
+DsmpQueryDeviceLatency(
+    _In_ PDSM_CONTEXT DsmContext,
+    _In_ PDSM_IDS DsmIds,
+    _In_ ULONG InBufferSize,
+    _Inout_ PULONG OutBufferSize,
+    _Out_writes_to_(*OutBufferSize, *OutBufferSize) PUCHAR Buffer
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the completion time averages and outstanding IO for
+    each path for the device that corresponds to the passed in DsmIds, along
+    with the service time the Least Service Time policy would predict for a
+    request sent down that path now.
+
+Arguements:
+
+    DsmContext - Global DSM context
+    DsmIds - DSM Ids for the given device
+    InBufferSize - Size of the input buffer
+    OutBufferSize - Size of the output buffer
+    Buffer - Buffer in which the per path latency information is returned,
+             if the buffer is big enough
+
+Return Value:
+
+   STATUS_SUCCESS on success
+   Appropriate error code on error.
+
+--*/
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PDSM_DEVICE_INFO devInfo;
+    PDSM_FAILOVER_GROUP failGroup;
+    ULONG sizeNeeded;
+    PMSDSM_DEVICE_LATENCY deviceLatency;
+    ULONG i;
+    PMSDSM_DEVICEPATH_LATENCY pathLatency;
+    ULONGLONG currentTime;
+    KIRQL irql;
+
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    TracePrint((TRACE_LEVEL_VERBOSE,
+                TRACE_FLAG_WMI,
+                "DsmpQueryDeviceLatency (DsmIds %p): Entering function.\n",
+                DsmIds));
+
+    //
+    // At least one device should be given
+    //
+    if (DsmIds->Count == 0) {
+
+        TracePrint((TRACE_LEVEL_ERROR,
+                    TRACE_FLAG_WMI,
+                    "DsmpQueryDeviceLatency (DsmIds %p): No DSM Ids given.\n",
+                    DsmIds));
+
+        *OutBufferSize = 0;
+        status = STATUS_INVALID_PARAMETER;
+
+        goto __Exit_DsmpQueryDeviceLatency;
+    }
+
+    sizeNeeded = AlignOn8Bytes(FIELD_OFFSET(MSDSM_DEVICE_LATENCY, LatencyInfo));
+    sizeNeeded += (DsmIds->Count * sizeof(MSDSM_DEVICEPATH_LATENCY));
+
+    if (*OutBufferSize < sizeNeeded) {
+
+        TracePrint((TRACE_LEVEL_ERROR,
+                    TRACE_FLAG_WMI,
+                    "DsmpQueryDeviceLatency (DsmIds %p): Output buffer too small.\n",
+                    DsmIds));
+
+        *OutBufferSize = sizeNeeded;
+        status = STATUS_BUFFER_TOO_SMALL;
+
+        goto __Exit_DsmpQueryDeviceLatency;
+    }
+
+    //
+    // Zero out the output buffer first
+    //
+    RtlZeroMemory(Buffer, sizeNeeded);
+
+#if DBG
+    devInfo = DsmIds->IdList[0];
+    DSM_ASSERT(devInfo);
+    DSM_ASSERT(devInfo->DeviceSig == DSM_DEVICE_SIG);
+#endif
+
+    currentTime = KeQueryInterruptTime();
+
+    irql = ExAcquireSpinLockExclusive(&(DsmContext->DsmContextLock));
+
+    deviceLatency = (PMSDSM_DEVICE_LATENCY)Buffer;
+    deviceLatency->NumberPaths = DsmIds->Count;
+
+    //
+    // For each path, get the latency info
+    //
+    for (i = 0; i < DsmIds->Count; i++) {
+
+        pathLatency = &deviceLatency->LatencyInfo[i];
+        devInfo = DsmIds->IdList[i];
+
+        if (DsmpIsDeviceInitialized(devInfo)) {
+
+            failGroup = devInfo->FailGroup;
+
+            pathLatency->PathId = (ULONGLONG)((ULONG_PTR)(failGroup->PathId));
+            pathLatency->AverageLatency = (ULONGLONG)InterlockedCompareExchange64(&failGroup->AverageLatency, 0, 0);
+            pathLatency->AverageTransferLength = (ULONGLONG)InterlockedCompareExchange64(&failGroup->AverageTransferLength, 0, 0);
+            pathLatency->OutstandingBytes = failGroup->OutstandingBytesOfIO;
+            pathLatency->PredictedServiceTime = DsmpGetPredictedServiceTime(failGroup, 0, currentTime);
+            pathLatency->RequestsInFlight = (ULONG)max(failGroup->NumberOfRequestsInFlight, 0);
+            pathLatency->State = devInfo->State;
+        }
+    }
+
+    ExReleaseSpinLockExclusive(&(DsmContext->DsmContextLock), irql);
+
+    *OutBufferSize = sizeNeeded;
+
+__Exit_DsmpQueryDeviceLatency:
+
+    TracePrint((TRACE_LEVEL_VERBOSE,
+                TRACE_FLAG_WMI,
+                "DsmpQueryDeviceLatency (DsmIds %p): Exiting function with status %x.\n",
+                DsmIds,
+                status));
+
+    return status;
+}
+
+
 NTSTATUS
 DsmpClearPerfCounters(
     _In_ IN PDSM_CONTEXT DsmContext,
@@ -0,0 +1,500 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    pathbench.c
+
+Abstract:
+
+    This file measures the Round Robin path selection of msdsm in user mode.
+
+    Reader threads stand for processors issuing I/O to one LUN, and pick a
+    path per request either by walking the DSM Ids list and moving the
+    group's shared PathToBeUsed, as DsmpGetPath() does, or from the snapshot
+    of active paths with a per-processor cursor, as DsmpGetNextActivePath()
+    does. A churn thread meanwhile flips paths between Active/Optimized and
+    Standby at a given rate and rebuilds the snapshot under the context
+    lock, as path arrival, removal and failover do. Readers never take the
+    lock, and never rebuild the snapshot. The snapshot is published and
+    read with DsmpPublishActivePaths and DsmpPickActivePath from
+    dsmpaths.h, which the driver uses and which is built here unchanged.
+
+    The program prints picks per second for both, how often the snapshot
+    sent a request back to the list walk, and how evenly the paths were
+    used.
+
+    Usage: pathbench [Threads [Paths [ChurnPerSecond [Seconds]]]]
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+//  As in msdsm.h and wdm.h.
+//
+
+#define DSM_MAX_PATHS                   32
+#define SYSTEM_CACHE_ALIGNMENT_SIZE     64
+
+#include "dsmpaths.h"
+
+#define MAX_THREADS             64
+
+#define STATE_ACTIVE_OPTIMIZED  0
+#define STATE_STANDBY           1
+
+typedef struct DECLSPEC_CACHEALIGN _DEVICE {
+    volatile LONG State;
+} DEVICE, *PDEVICE;
+
+typedef struct _GROUP {
+
+    //
+    //  Stands for the DSM Ids list MPIO passes in, and the group entry.
+    //
+
+    ULONG NumberPaths;
+    DEVICE Devices[DSM_MAX_PATHS];
+
+    DECLSPEC_CACHEALIGN PDEVICE volatile PathToBeUsed;
+
+    DECLSPEC_CACHEALIGN volatile LONG ActivePathsSequence;
+    DSM_ACTIVE_PATHS ActivePaths[2];
+
+    DSM_RR_CURSOR RoundRobinCursors[DSM_RR_CURSORS];
+
+} GROUP, *PGROUP;
+
+typedef struct _BENCH {
+
+    //
+    //  Stands for the DsmContextLock, which only the churn thread takes.
+    //
+
+    SRWLOCK ContextLock;
+    BOOLEAN UseSnapshot;
+    ULONG NumThreads;
+    ULONG ChurnPerSecond;
+    volatile LONG Stop;
+    GROUP Group;
+    LONG64 Picks[MAX_THREADS];
+    LONG64 Fallbacks[MAX_THREADS];
+    LONG64 PathPicks[MAX_THREADS][DSM_MAX_PATHS];
+    LONG64 Rebuilds;
+    LONG64 Changes;
+} BENCH, *PBENCH;
+
+typedef struct _WORKER {
+    PBENCH Bench;
+    ULONG Index;
+} WORKER, *PWORKER;
+
+//
+//  DsmpRebuildActivePaths. The caller holds the context lock exclusive.
+//
+
+static
+VOID
+RebuildActivePaths(
+    _Inout_ PGROUP Group
+    )
+{
+    DSM_ACTIVE_PATHS activePaths;
+    ULONG count = 0;
+    ULONG index;
+
+    for (index = 0; index < Group->NumberPaths; index++) {
+        if (Group->Devices[index].State == STATE_ACTIVE_OPTIMIZED) {
+            activePaths.Paths[count++] = &Group->Devices[index];
+        }
+    }
+
+    activePaths.NumberPaths = count;
+
+    DsmpPublishActivePaths(&Group->ActivePathsSequence, Group->ActivePaths, &activePaths);
+}
+
+//
+//  DsmpGetNextActivePath, with the device state standing for the checks on
+//  the DSM Ids list and the device.
+//
+
+static
+PDEVICE
+GetNextActivePath(
+    _Inout_ PGROUP Group,
+    _In_ ULONG Processor
+    )
+{
+    PDEVICE device;
+
+    device = DsmpPickActivePath(&Group->ActivePathsSequence,
+                                Group->ActivePaths,
+                                &Group->RoundRobinCursors[Processor % DSM_RR_CURSORS]);
+
+    if (device != NULL && device->State == STATE_ACTIVE_OPTIMIZED) {
+        return device;
+    }
+
+    return NULL;
+}
+
+//
+//  The Round Robin list walk of DsmpGetPath: find PathToBeUsed, or the first
+//  active path if it isn't active any more, use it, and move PathToBeUsed to
+//  the next active path.
+//
+
+static
+PDEVICE
+GetPathByWalk(
+    _Inout_ PGROUP Group
+    )
+{
+    PDEVICE device;
+    PDEVICE candidate = NULL;
+    PDEVICE chosen = NULL;
+    BOOLEAN reset = FALSE;
+    ULONG inx;
+    ULONG jnx = 0;
+    ULONG counter;
+
+    for (inx = 0; inx < Group->NumberPaths; inx++) {
+
+        device = &Group->Devices[inx];
+
+        if (device == Group->PathToBeUsed) {
+            reset = TRUE;
+        }
+
+        if (device->State == STATE_ACTIVE_OPTIMIZED) {
+
+            if (candidate == NULL || reset) {
+                candidate = device;
+                jnx = inx;
+            }
+
+            if (Group->PathToBeUsed == NULL || device == Group->PathToBeUsed) {
+                InterlockedExchangePointer((PVOID volatile *)&Group->PathToBeUsed, device);
+                chosen = device;
+                break;
+            }
+        }
+    }
+
+    if (chosen == NULL) {
+        if (candidate == NULL) {
+            return NULL;
+        }
+        InterlockedExchangePointer((PVOID volatile *)&Group->PathToBeUsed, candidate);
+        chosen = candidate;
+        inx = jnx;
+    }
+
+    for (counter = 0, jnx = inx + 1; counter < Group->NumberPaths; counter++, jnx++) {
+
+        device = &Group->Devices[jnx % Group->NumberPaths];
+
+        if (device->State == STATE_ACTIVE_OPTIMIZED) {
+            InterlockedExchangePointer((PVOID volatile *)&Group->PathToBeUsed, device);
+            break;
+        }
+    }
+
+    return chosen;
+}
+
+DWORD
+WINAPI
+ReaderThread(
+    _In_ LPVOID Parameter
+    )
+{
+    PWORKER worker = Parameter;
+    PBENCH bench = worker->Bench;
+    PDEVICE device;
+    LONG64 picks = 0;
+    LONG64 fallbacks = 0;
+
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (worker->Index % (sizeof(DWORD_PTR) * 8)));
+
+    while (ReadAcquire(&bench->Stop) == 0) {
+
+        device = NULL;
+
+        if (bench->UseSnapshot) {
+            device = GetNextActivePath(&bench->Group, worker->Index);
+            if (device == NULL) {
+                fallbacks++;
+            }
+        }
+
+        if (device == NULL) {
+            device = GetPathByWalk(&bench->Group);
+        }
+
+        if (device != NULL) {
+            bench->PathPicks[worker->Index][device - bench->Group.Devices]++;
+            picks++;
+        }
+    }
+
+    bench->Picks[worker->Index] = picks;
+    bench->Fallbacks[worker->Index] = fallbacks;
+
+    return 0;
+}
+
+DWORD
+WINAPI
+ChurnThread(
+    _In_ LPVOID Parameter
+    )
+{
+    PBENCH bench = Parameter;
+    PGROUP group = &bench->Group;
+    LARGE_INTEGER frequency, start, now;
+    LONG64 changes = 0;
+    ULONG index;
+    ULONG standby;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    while (ReadAcquire(&bench->Stop) == 0) {
+
+        //
+        //  Pace the changes to ChurnPerSecond.
+        //
+
+        QueryPerformanceCounter(&now);
+
+        if ((now.QuadPart - start.QuadPart) * (LONG64)bench->ChurnPerSecond <
+            changes * frequency.QuadPart) {
+
+            if (bench->ChurnPerSecond < 1000) {
+                Sleep(1);
+            } else {
+                YieldProcessor();
+            }
+            continue;
+        }
+
+        //
+        //  Fail or restore one path, keeping at least one active.
+        //
+
+        AcquireSRWLockExclusive(&bench->ContextLock);
+
+        index = (ULONG)rand() % group->NumberPaths;
+
+        if (group->Devices[index].State == STATE_ACTIVE_OPTIMIZED) {
+
+            for (standby = 0, index = 0; index < group->NumberPaths; index++) {
+                standby += (group->Devices[index].State != STATE_ACTIVE_OPTIMIZED);
+            }
+
+            index = (ULONG)rand() % group->NumberPaths;
+
+            if (standby + 1 < group->NumberPaths) {
+                InterlockedExchange(&group->Devices[index].State, STATE_STANDBY);
+            }
+
+        } else {
+
+            InterlockedExchange(&group->Devices[index].State, STATE_ACTIVE_OPTIMIZED);
+        }
+
+        if (bench->UseSnapshot) {
+            RebuildActivePaths(group);
+            bench->Rebuilds++;
+        }
+
+        ReleaseSRWLockExclusive(&bench->ContextLock);
+
+        changes++;
+    }
+
+    bench->Changes = changes;
+
+    return 0;
+}
+
+static
+BOOL
+RunBench(
+    _Inout_ PBENCH Bench,
+    _In_ ULONG NumberPaths,
+    _In_ ULONG Seconds
+    )
+{
+    HANDLE threads[MAX_THREADS + 1];
+    WORKER workers[MAX_THREADS];
+    PGROUP group = &Bench->Group;
+    LARGE_INTEGER frequency, start, end;
+    LONG64 picks = 0;
+    LONG64 fallbacks = 0;
+    LONG64 least = MAXLONGLONG;
+    LONG64 most = 0;
+    LONG64 pathPicks;
+    double elapsed;
+    ULONG numThreads = 0;
+    ULONG i, j;
+    BOOL Success = TRUE;
+
+    InitializeSRWLock(&Bench->ContextLock);
+
+    group->NumberPaths = NumberPaths;
+    RebuildActivePaths(group);
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < Bench->NumThreads; i++) {
+        workers[i].Bench = Bench;
+        workers[i].Index = i;
+        threads[numThreads] = CreateThread(NULL, 0, ReaderThread, &workers[i], 0, NULL);
+        TEST_ASSERT(threads[numThreads] != NULL, "CreateThread failed for reader %lu", i);
+        numThreads++;
+    }
+
+    if (Bench->ChurnPerSecond != 0) {
+        threads[numThreads] = CreateThread(NULL, 0, ChurnThread, Bench, 0, NULL);
+        TEST_ASSERT(threads[numThreads] != NULL, "CreateThread failed for churn thread %lu", numThreads);
+        numThreads++;
+    }
+
+    Sleep(Seconds * 1000);
+
+End:
+    InterlockedExchange(&Bench->Stop, 1);
+
+    WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    for (i = 0; i < numThreads; i++) {
+        CloseHandle(threads[i]);
+    }
+
+    if (!Success) {
+        return Success;
+    }
+
+    for (i = 0; i < Bench->NumThreads; i++) {
+        picks += Bench->Picks[i];
+        fallbacks += Bench->Fallbacks[i];
+    }
+
+    for (i = 0; i < NumberPaths; i++) {
+        for (pathPicks = 0, j = 0; j < Bench->NumThreads; j++) {
+            pathPicks += Bench->PathPicks[j][i];
+        }
+        least = min(least, pathPicks);
+        most = max(most, pathPicks);
+    }
+
+    elapsed = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+
+    TEST_COMMENT("%-10s %8.2f Mpicks/s, %.3f%% fell back to the walk, %lld path changes, %lld rebuilds",
+                 Bench->UseSnapshot ? "snapshot:" : "walk:",
+                 (double)picks / elapsed / 1e6,
+                 picks ? 100.0 * (double)fallbacks / (double)picks : 0.0,
+                 (long long)Bench->Changes,
+                 (long long)Bench->Rebuilds);
+
+    TEST_COMMENT("           picks per path from %lld to %lld",
+                 (long long)least,
+                 (long long)most);
+
+    //
+    //  Without churn every path stays active and should get an even share.
+    //  The walk is only even with one reader: readers racing on PathToBeUsed
+    //  pick the same path.
+    //
+
+    if (Bench->ChurnPerSecond == 0 && (Bench->UseSnapshot || Bench->NumThreads == 1)) {
+
+        Success = (least > 0 && (double)(most - least) <= 0.1 * (double)most);
+
+        if (!Success) {
+            TEST_COMMENT("Uneven path use without churn: %lld to %lld",
+                         (long long)least,
+                         (long long)most);
+        }
+    }
+
+    return Success;
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static BENCH bench;
+    ULONG numThreads = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ULONG numberPaths = 8;
+    ULONG churnPerSecond = 1000;
+    ULONG seconds = 3;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        numThreads = strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        numberPaths = strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3) {
+        churnPerSecond = strtoul(argv[3], NULL, 0);
+    }
+    if (argc > 4) {
+        seconds = strtoul(argv[4], NULL, 0);
+    }
+
+    TEST_ASSERT(numThreads >= 1 && numThreads <= MAX_THREADS,
+                "Threads must be between 1 and %u", MAX_THREADS);
+    TEST_ASSERT(numberPaths >= 1 && numberPaths <= DSM_MAX_PATHS,
+                "Paths must be between 1 and %u", DSM_MAX_PATHS);
+
+    TEST_COMMENT("%lu threads, %lu paths, %lu path changes/s, %lu s per run",
+                 numThreads, numberPaths, churnPerSecond, seconds);
+
+    srand(1);
+
+    ZeroMemory(&bench, sizeof(bench));
+    bench.NumThreads = numThreads;
+    bench.ChurnPerSecond = churnPerSecond;
+    bench.UseSnapshot = FALSE;
+    Success = RunBench(&bench, numberPaths, seconds);
+
+    srand(1);
+
+    ZeroMemory(&bench, sizeof(bench));
+    bench.NumThreads = numThreads;
+    bench.ChurnPerSecond = churnPerSecond;
+    bench.UseSnapshot = TRUE;
+    Success = RunBench(&bench, numberPaths, seconds) && Success;
+
+End:
+    return Success ? 0 : 1;
+}
@@ -93,19 +93,27 @@ main(
     SCSI_PASS_THROUGH_WITH_BUFFERS_EX sptwb_ex;
     SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX sptdwb_ex;
     CHAR string[NAME_COUNT];
+    BOOL benchmark = FALSE;
+    BENCHMARK_PARAMETERS benchmarkParameters = {1, 8, 4, 100, 10};
 
     ULONG length = 0,
           errorCode = 0,
           returned = 0,
           sectorSize = 512;
 
-    if ((argc < 2) || (argc > 3)) {
+    if ((argc < 2) || (argc > 8) ||
+        ((argc > 3) && (tolower(argv[2][0]) != 'b'))) {
        printf("Usage:  %s <port-name> [-mode]\n", argv[0] );
+       printf("        %s <port-name> b [threads] [queue-depth] [KB-per-command] [read-percent] [seconds]\n", argv[0] );
        printf("Examples:\n");
        printf("    spti g:       (open the disk class driver in SHARED READ/WRITE mode)\n");
        printf("    spti Scsi2:   (open the miniport driver for the 3rd host adapter)\n");
        printf("    spti Tape0 w  (open the tape class driver in SHARED WRITE mode)\n");
        printf("    spti i: c     (open the CD-ROM class driver in SHARED READ mode)\n");
+       printf("    spti PhysicalDrive1 b 4 16 4 70 30\n");
+       printf("                  (4 threads, 16 commands outstanding per thread, 4KB random\n");
+       printf("                   READ(16)/WRITE(16), 70%% reads, for 30 seconds.\n");
+       printf("                   Writes DESTROY the data on the device.)\n");
        return;
     }
 
@@ -130,15 +138,48 @@ main(
                 sectorSize = 2048;
                 break;
 
+            case 'b':
+                benchmark = TRUE;
+                break;
+
             default:
                 printf("%s is an invalid mode.\n", argv[2]);
                 puts("\tr = read");
                 puts("\tw = write");
                 puts("\tc = read CD (2048 byte sector mode)");
+                puts("\tb = benchmark");
                 return;
         }
     }
 
+    if (benchmark) {
+
+        PULONG values[] = { &benchmarkParameters.ThreadCount,
+                            &benchmarkParameters.QueueDepth,
+                            &benchmarkParameters.TransferKB,
+                            &benchmarkParameters.ReadPercent,
+                            &benchmarkParameters.Seconds };
+        int i;
+
+        for (i = 3; i < argc; i++) {
+            *values[i - 3] = strtoul(argv[i], NULL, 0);
+        }
+
+        if ((benchmarkParameters.ThreadCount == 0) ||
+            (benchmarkParameters.ThreadCount > BENCHMARK_MAX_THREADS) ||
+            (benchmarkParameters.QueueDepth == 0) ||
+            (benchmarkParameters.QueueDepth > BENCHMARK_MAX_QUEUE_DEPTH) ||
+            (benchmarkParameters.TransferKB == 0) ||
+            (benchmarkParameters.TransferKB > BENCHMARK_MAX_TRANSFER_KB) ||
+            (benchmarkParameters.ReadPercent > 100) ||
+            (benchmarkParameters.Seconds == 0)) {
+            printf("Invalid benchmark parameters. Threads and queue depth are 1 to %d,\n"
+                   "KB per command 1 to %d, read percent 0 to 100, seconds at least 1.\n",
+                   BENCHMARK_MAX_THREADS, BENCHMARK_MAX_TRANSFER_KB);
+            return;
+        }
+    }
+
     fileHandle = CreateFile(string,
        accessMode,
        shareMode,
@@ -174,6 +215,12 @@ main(
            "            *****             was %08x       *****\n\n\n",
            alignmentMask);
 
+    if (benchmark) {
+        CloseHandle(fileHandle);
+        RunBenchmark(string, accessMode, shareMode, alignmentMask, srbType, &benchmarkParameters);
+        return;
+    }
+
     //
     // Send SCSI Pass Through
     //
@@ -1202,3 +1249,657 @@ Cleanup:
 
 }
 
+
+VOID
+RunBenchmark(
+    _In_z_ LPCSTR DeviceName,
+    _In_ DWORD AccessMode,
+    _In_ DWORD ShareMode,
+    _In_ ULONG AlignmentMask,
+    _In_ UCHAR SrbType,
+    _In_ PBENCHMARK_PARAMETERS Parameters
+    )
+{
+    BENCHMARK_CONTEXT context = {0};
+    BENCHMARK_STATISTICS total = {0};
+    BENCHMARK_REQUEST capacityRequest = {0};
+    PBENCHMARK_THREAD threads = NULL;
+    HANDLE threadHandles[BENCHMARK_MAX_THREADS];
+    LARGE_INTEGER startTime, endTime;
+    ULONG threadCount = 0;
+    ULONG i, j, k;
+
+    //
+    // The benchmark needs an overlapped handle so each thread can keep
+    // several commands outstanding.
+    //
+
+    context.DeviceHandle = CreateFile(DeviceName,
+                                      AccessMode,
+                                      ShareMode,
+                                      NULL,
+                                      OPEN_EXISTING,
+                                      FILE_FLAG_OVERLAPPED,
+                                      NULL);
+
+    if (context.DeviceHandle == INVALID_HANDLE_VALUE) {
+        printf("Error opening %s. Error: %d\n",
+               DeviceName, GetLastError());
+        PrintError(GetLastError());
+        return;
+    }
+
+    context.SrbType = SrbType;
+    context.AlignmentMask = AlignmentMask;
+    context.ReadPercent = Parameters->ReadPercent;
+    context.QueueDepth = Parameters->QueueDepth;
+    QueryPerformanceFrequency(&context.Frequency);
+
+    capacityRequest.Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    capacityRequest.DataBuffer = AllocateAlignedBuffer(sizeof(READ_CAPACITY_DATA_EX),
+                                                       AlignmentMask,
+                                                       &capacityRequest.UnAlignedBuffer);
+
+    if ((capacityRequest.Overlapped.hEvent == NULL) ||
+        !BenchmarkReadCapacity(&context, &capacityRequest)) {
+        goto Cleanup;
+    }
+
+    context.TransferLength = Parameters->TransferKB * 1024;
+
+    if ((context.TransferLength % context.BlockSize) != 0) {
+        printf("%d KB is not a multiple of the %d byte block size.\n",
+               Parameters->TransferKB, context.BlockSize);
+        goto Cleanup;
+    }
+
+    context.BlocksPerTransfer = context.TransferLength / context.BlockSize;
+
+    if (context.BlockCount < context.BlocksPerTransfer) {
+        printf("The device is smaller than one command.\n");
+        goto Cleanup;
+    }
+
+    printf("            *****           BENCHMARK           *****\n\n");
+    printf("Device: %I64u blocks of %d bytes\n", context.BlockCount, context.BlockSize);
+    printf("Threads: %d, queue depth per thread: %d, %d KB per command, %d%% reads, %d seconds, %s\n\n",
+           Parameters->ThreadCount,
+           Parameters->QueueDepth,
+           Parameters->TransferKB,
+           Parameters->ReadPercent,
+           Parameters->Seconds,
+           (SrbType == 1) ? "IOCTL_SCSI_PASS_THROUGH_DIRECT_EX" : "IOCTL_SCSI_PASS_THROUGH_DIRECT");
+
+    threads = calloc(Parameters->ThreadCount, sizeof(BENCHMARK_THREAD));
+
+    if (threads == NULL) {
+        printf("Memory allocation error.  Terminating program\n");
+        goto Cleanup;
+    }
+
+    //
+    // Set up every thread and its commands before any starts, so all of
+    // them run for the whole measured interval. The data buffers are
+    // allocated once and reused for every command.
+    //
+
+    for (i = 0; i < Parameters->ThreadCount; i++) {
+
+        threads[i].Context = &context;
+        threads[i].Seed = GetTickCount() ^ ((i + 1) * 0x9E3779B9);
+        threads[i].Requests = calloc(Parameters->QueueDepth, sizeof(BENCHMARK_REQUEST));
+
+        if (threads[i].Requests == NULL) {
+            printf("Memory allocation error.  Terminating program\n");
+            goto Cleanup;
+        }
+
+        for (j = 0; j < Parameters->QueueDepth; j++) {
+
+            PBENCHMARK_REQUEST request = &threads[i].Requests[j];
+
+            request->Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+            if (request->Overlapped.hEvent == NULL) {
+                printf("Error creating event. Error: %d\n", GetLastError());
+                goto Cleanup;
+            }
+
+            request->DataBuffer = AllocateAlignedBuffer(context.TransferLength,
+                                                         AlignmentMask,
+                                                         &request->UnAlignedBuffer);
+            FillMemory(request->DataBuffer, context.TransferLength, (BYTE)(i * Parameters->QueueDepth + j));
+        }
+
+        threads[i].Thread = CreateThread(NULL, 0, BenchmarkThread, &threads[i], CREATE_SUSPENDED, NULL);
+
+        if (threads[i].Thread == NULL) {
+            printf("Error creating thread. Error: %d\n", GetLastError());
+            goto Cleanup;
+        }
+
+        threadHandles[i] = threads[i].Thread;
+        threadCount++;
+    }
+
+    QueryPerformanceCounter(&startTime);
+
+    for (i = 0; i < threadCount; i++) {
+        ResumeThread(threadHandles[i]);
+    }
+
+    Sleep(Parameters->Seconds * 1000);
+
+    InterlockedExchange(&context.Stop, 1);
+    WaitForMultipleObjects(threadCount, threadHandles, TRUE, INFINITE);
+
+    QueryPerformanceCounter(&endTime);
+
+    for (i = 0; i < threadCount; i++) {
+
+        PBENCHMARK_STATISTICS statistics = &threads[i].Statistics;
+
+        total.Reads += statistics->Reads;
+        total.Writes += statistics->Writes;
+        total.BytesRead += statistics->BytesRead;
+        total.BytesWritten += statistics->BytesWritten;
+        total.TotalLatency += statistics->TotalLatency;
+        total.MaxLatency = max(total.MaxLatency, statistics->MaxLatency);
+
+        for (k = 0; k < BENCHMARK_HISTOGRAM_BUCKETS; k++) {
+            total.Histogram[k] += statistics->Histogram[k];
+        }
+
+        if ((total.Errors == 0) && (statistics->Errors != 0)) {
+            total.FirstErrorCode = statistics->FirstErrorCode;
+            total.FirstScsiStatus = statistics->FirstScsiStatus;
+            total.FirstSenseKey = statistics->FirstSenseKey;
+            total.FirstAdditionalSenseCode = statistics->FirstAdditionalSenseCode;
+        }
+        total.Errors += statistics->Errors;
+    }
+
+    PrintBenchmarkResults(&context,
+                          &total,
+                          (ULONGLONG)(endTime.QuadPart - startTime.QuadPart));
+
+Cleanup:
+    if (threads != NULL) {
+
+        //
+        // Threads that were created are only left suspended if starting
+        // the benchmark failed; let them see Stop and exit before their
+        // commands are freed.
+        //
+
+        InterlockedExchange(&context.Stop, 1);
+
+        for (i = 0; i < threadCount; i++) {
+            ResumeThread(threadHandles[i]);
+        }
+        if (threadCount != 0) {
+            WaitForMultipleObjects(threadCount, threadHandles, TRUE, INFINITE);
+        }
+
+        for (i = 0; i < Parameters->ThreadCount; i++) {
+
+            if (threads[i].Thread != NULL) {
+                CloseHandle(threads[i].Thread);
+            }
+
+            if (threads[i].Requests != NULL) {
+                for (j = 0; j < Parameters->QueueDepth; j++) {
+                    if (threads[i].Requests[j].Overlapped.hEvent != NULL) {
+                        CloseHandle(threads[i].Requests[j].Overlapped.hEvent);
+                    }
+                    if (threads[i].Requests[j].UnAlignedBuffer != NULL) {
+                        free(threads[i].Requests[j].UnAlignedBuffer);
+                    }
+                }
+                free(threads[i].Requests);
+            }
+        }
+        free(threads);
+    }
+
+    if (capacityRequest.Overlapped.hEvent != NULL) {
+        CloseHandle(capacityRequest.Overlapped.hEvent);
+    }
+    if (capacityRequest.UnAlignedBuffer != NULL) {
+        free(capacityRequest.UnAlignedBuffer);
+    }
+    CloseHandle(context.DeviceHandle);
+}
+
+_Success_(return)
+BOOL
+BenchmarkReadCapacity(
+    _In_ PBENCHMARK_CONTEXT Context,
+    _Inout_ PBENCHMARK_REQUEST Request
+    )
+{
+    PREAD_CAPACITY_DATA_EX capacity = (PREAD_CAPACITY_DATA_EX)Request->DataBuffer;
+    DWORD returned = 0;
+    BOOL status;
+    UCHAR scsiStatus;
+
+    ZeroMemory(capacity, sizeof(READ_CAPACITY_DATA_EX));
+
+    BenchmarkSetupRequest(Context,
+                          Request,
+                          SCSIOP_READ_CAPACITY16,
+                          0,
+                          sizeof(READ_CAPACITY_DATA_EX),
+                          TRUE);
+
+    status = BenchmarkSendRequest(Context, Request);
+
+    if (status) {
+        status = GetOverlappedResult(Context->DeviceHandle,
+                                     &Request->Overlapped,
+                                     &returned,
+                                     TRUE);
+    }
+
+    if (!status) {
+        printf("READ CAPACITY(16) failed. Error: %d  ", GetLastError());
+        PrintError(GetLastError());
+        return FALSE;
+    }
+
+    scsiStatus = (Context->SrbType == 1) ? Request->sptdwb_ex.sptd.ScsiStatus :
+                                           Request->sptdwb.sptd.ScsiStatus;
+
+    if (scsiStatus != SCSISTAT_GOOD) {
+        printf("READ CAPACITY(16) failed. Scsi status: %02Xh\n", scsiStatus);
+        return FALSE;
+    }
+
+    //
+    // Both values are big-endian, and the address is that of the last block.
+    //
+
+    Context->BlockCount = _byteswap_uint64(capacity->LogicalBlockAddress.QuadPart) + 1;
+    Context->BlockSize = _byteswap_ulong(capacity->BytesPerBlock);
+
+    if ((Context->BlockSize == 0) || (Context->BlockCount == 0)) {
+        printf("READ CAPACITY(16) returned no capacity.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID
+BenchmarkSetupRequest(
+    _In_ PBENCHMARK_CONTEXT Context,
+    _Inout_ PBENCHMARK_REQUEST Request,
+    _In_ UCHAR OperationCode,
+    _In_ ULONGLONG LogicalBlock,
+    _In_ ULONG TransferLength,
+    _In_ BOOLEAN DataIn
+    )
+{
+    PUCHAR cdb;
+    ULONG i;
+
+    Request->IsRead = DataIn;
+
+    if (Context->SrbType == 1) {
+        ZeroMemory(&Request->sptdwb_ex, sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX));
+        Request->sptdwb_ex.sptd.Version = 0;
+        Request->sptdwb_ex.sptd.Length = sizeof(SCSI_PASS_THROUGH_DIRECT_EX);
+        Request->sptdwb_ex.sptd.CdbLength = 16;
+        Request->sptdwb_ex.sptd.StorAddressLength = sizeof(STOR_ADDR_BTL8);
+        Request->sptdwb_ex.sptd.SenseInfoLength = SPT_SENSE_LENGTH;
+        Request->sptdwb_ex.sptd.TimeOutValue = BENCHMARK_TIMEOUT;
+        Request->sptdwb_ex.sptd.StorAddressOffset =
+            offsetof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX,StorAddress);
+        Request->sptdwb_ex.StorAddress.Type = STOR_ADDRESS_TYPE_BTL8;
+        Request->sptdwb_ex.StorAddress.Port = 0;
+        Request->sptdwb_ex.StorAddress.AddressLength = STOR_ADDR_BTL8_ADDRESS_LENGTH;
+        Request->sptdwb_ex.StorAddress.Path = 0;
+        Request->sptdwb_ex.StorAddress.Target = 1;
+        Request->sptdwb_ex.StorAddress.Lun = 0;
+        Request->sptdwb_ex.sptd.SenseInfoOffset =
+           offsetof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX,ucSenseBuf);
+
+        if (DataIn) {
+            Request->sptdwb_ex.sptd.DataDirection = SCSI_IOCTL_DATA_IN;
+            Request->sptdwb_ex.sptd.DataInTransferLength = TransferLength;
+            Request->sptdwb_ex.sptd.DataInBuffer = Request->DataBuffer;
+        } else {
+            Request->sptdwb_ex.sptd.DataDirection = SCSI_IOCTL_DATA_OUT;
+            Request->sptdwb_ex.sptd.DataOutTransferLength = TransferLength;
+            Request->sptdwb_ex.sptd.DataOutBuffer = Request->DataBuffer;
+        }
+        cdb = Request->sptdwb_ex.sptd.Cdb;
+    } else {
+        ZeroMemory(&Request->sptdwb, sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER));
+        Request->sptdwb.sptd.Length = sizeof(SCSI_PASS_THROUGH_DIRECT);
+        Request->sptdwb.sptd.PathId = 0;
+        Request->sptdwb.sptd.TargetId = 1;
+        Request->sptdwb.sptd.Lun = 0;
+        Request->sptdwb.sptd.CdbLength = 16;
+        Request->sptdwb.sptd.SenseInfoLength = SPT_SENSE_LENGTH;
+        Request->sptdwb.sptd.DataIn = DataIn ? SCSI_IOCTL_DATA_IN : SCSI_IOCTL_DATA_OUT;
+        Request->sptdwb.sptd.DataTransferLength = TransferLength;
+        Request->sptdwb.sptd.TimeOutValue = BENCHMARK_TIMEOUT;
+        Request->sptdwb.sptd.DataBuffer = Request->DataBuffer;
+        Request->sptdwb.sptd.SenseInfoOffset =
+           offsetof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER,ucSenseBuf);
+        cdb = Request->sptdwb.sptd.Cdb;
+    }
+
+    cdb[0] = OperationCode;
+
+    if (OperationCode == SCSIOP_READ_CAPACITY16) {
+
+        cdb[1] = SERVICE_ACTION_READ_CAPACITY16;
+        cdb[13] = (UCHAR)TransferLength;                // Allocation length
+
+    } else {
+
+        //
+        // READ(16) and WRITE(16): big-endian LBA in bytes 2-9, and the
+        // number of blocks in bytes 10-13.
+        //
+
+        ULONG blocks = TransferLength / Context->BlockSize;
+
+        for (i = 0; i < 8; i++) {
+            cdb[2 + i] = (UCHAR)(LogicalBlock >> (56 - 8 * i));
+        }
+        for (i = 0; i < 4; i++) {
+            cdb[10 + i] = (UCHAR)(blocks >> (24 - 8 * i));
+        }
+    }
+}
+
+BOOL
+BenchmarkSendRequest(
+    _In_ PBENCHMARK_CONTEXT Context,
+    _Inout_ PBENCHMARK_REQUEST Request
+    )
+{
+    BOOL status;
+
+    QueryPerformanceCounter(&Request->StartTime);
+
+    if (Context->SrbType == 1) {
+        status = DeviceIoControl(Context->DeviceHandle,
+                                 IOCTL_SCSI_PASS_THROUGH_DIRECT_EX,
+                                 &Request->sptdwb_ex,
+                                 sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX),
+                                 &Request->sptdwb_ex,
+                                 sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX),
+                                 NULL,
+                                 &Request->Overlapped);
+    } else {
+        status = DeviceIoControl(Context->DeviceHandle,
+                                 IOCTL_SCSI_PASS_THROUGH_DIRECT,
+                                 &Request->sptdwb,
+                                 sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER),
+                                 &Request->sptdwb,
+                                 sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER),
+                                 NULL,
+                                 &Request->Overlapped);
+    }
+
+    //
+    // Completed synchronously or pending, the event is signaled when the
+    // command is done either way.
+    //
+
+    return (status || (GetLastError() == ERROR_IO_PENDING));
+}
+
+DWORD
+WINAPI
+BenchmarkThread(
+    _In_ LPVOID Parameter
+    )
+{
+    PBENCHMARK_THREAD thread = (PBENCHMARK_THREAD)Parameter;
+    PBENCHMARK_CONTEXT context = thread->Context;
+    PBENCHMARK_STATISTICS statistics = &thread->Statistics;
+    HANDLE events[BENCHMARK_MAX_QUEUE_DEPTH];
+    PBENCHMARK_REQUEST outstanding[BENCHMARK_MAX_QUEUE_DEPTH];
+    ULONG outstandingCount = 0;
+    ULONGLONG transfers = context->BlockCount / context->BlocksPerTransfer;
+    LARGE_INTEGER now;
+    ULONG i;
+
+    //
+    // Commands are kept in a compact array of those outstanding, so their
+    // events can be waited on together. A command is put back right after
+    // it completes until the benchmark stops.
+    //
+
+    for (i = 0; i < context->QueueDepth; i++) {
+        outstanding[outstandingCount] = &thread->Requests[i];
+        events[outstandingCount] = thread->Requests[i].Overlapped.hEvent;
+        outstandingCount++;
+    }
+
+    i = 0;
+
+    while (outstandingCount != 0) {
+
+        PBENCHMARK_REQUEST request = outstanding[i];
+        BOOL submit = (request->StartTime.QuadPart == 0);
+
+        if (!submit) {
+
+            DWORD returned = 0;
+            BOOL status;
+            UCHAR scsiStatus;
+            PUCHAR senseBuffer;
+            ULONGLONG latency;
+            ULONGLONG microseconds;
+            ULONG bucket = 0;
+
+            //
+            // Every completed command is handled, not only the one the wait
+            // returned for, so their latencies are not held back behind
+            // each other.
+            //
+
+            if (!HasOverlappedIoCompleted(&request->Overlapped)) {
+                if (++i < outstandingCount) {
+                    continue;
+                }
+                WaitForMultipleObjects(outstandingCount, events, FALSE, INFINITE);
+                i = 0;
+                continue;
+            }
+
+            QueryPerformanceCounter(&now);
+
+            status = GetOverlappedResult(context->DeviceHandle,
+                                         &request->Overlapped,
+                                         &returned,
+                                         FALSE);
+
+            if (context->SrbType == 1) {
+                scsiStatus = request->sptdwb_ex.sptd.ScsiStatus;
+                senseBuffer = request->sptdwb_ex.ucSenseBuf;
+            } else {
+                scsiStatus = request->sptdwb.sptd.ScsiStatus;
+                senseBuffer = request->sptdwb.ucSenseBuf;
+            }
+
+            if (!status || (scsiStatus != SCSISTAT_GOOD)) {
+
+                if (statistics->Errors == 0) {
+                    statistics->FirstErrorCode = status ? ERROR_SUCCESS : GetLastError();
+                    statistics->FirstScsiStatus = scsiStatus;
+                    statistics->FirstSenseKey = senseBuffer[2] & 0x0F;
+                    statistics->FirstAdditionalSenseCode = senseBuffer[12];
+                }
+                statistics->Errors++;
+
+            } else {
+
+                latency = (ULONGLONG)(now.QuadPart - request->StartTime.QuadPart);
+                microseconds = latency * 1000000 / context->Frequency.QuadPart;
+
+                while ((microseconds >>= 1) != 0) {
+                    bucket++;
+                }
+
+                statistics->Histogram[min(bucket, BENCHMARK_HISTOGRAM_BUCKETS - 1)]++;
+                statistics->TotalLatency += latency;
+                statistics->MaxLatency = max(statistics->MaxLatency, latency);
+
+                if (request->IsRead) {
+                    statistics->Reads++;
+                    statistics->BytesRead += context->TransferLength;
+                } else {
+                    statistics->Writes++;
+                    statistics->BytesWritten += context->TransferLength;
+                }
+            }
+
+            submit = (context->Stop == 0);
+        }
+
+        if (submit && (context->Stop == 0)) {
+
+            ULONGLONG random;
+            BOOLEAN isRead;
+
+            //
+            // xorshift32 for the offset and for the read/write mix.
+            //
+
+            thread->Seed ^= thread->Seed << 13;
+            thread->Seed ^= thread->Seed >> 17;
+            thread->Seed ^= thread->Seed << 5;
+            random = thread->Seed;
+            thread->Seed ^= thread->Seed << 13;
+            thread->Seed ^= thread->Seed >> 17;
+            thread->Seed ^= thread->Seed << 5;
+            random = (random << 32) | thread->Seed;
+
+            isRead = ((ULONG)(random % 100) < context->ReadPercent);
+
+            BenchmarkSetupRequest(context,
+                                  request,
+                                  isRead ? SCSIOP_READ16 : SCSIOP_WRITE16,
+                                  ((random / 100) % transfers) * context->BlocksPerTransfer,
+                                  context->TransferLength,
+                                  isRead);
+
+            if (BenchmarkSendRequest(context, request)) {
+                i++;
+                if (i >= outstandingCount) {
+                    i = 0;
+                }
+                continue;
+            }
+
+            if (statistics->Errors == 0) {
+                statistics->FirstErrorCode = GetLastError();
+            }
+            statistics->Errors++;
+        }
+
+        //
+        // Retire the command: the last outstanding one takes its place.
+        //
+
+        outstandingCount--;
+        outstanding[i] = outstanding[outstandingCount];
+        events[i] = events[outstandingCount];
+
+        if (i >= outstandingCount) {
+            i = 0;
+        }
+    }
+
+    return 0;
+}
+
+VOID
+PrintBenchmarkResults(
+    _In_ PBENCHMARK_CONTEXT Context,
+    _In_ PBENCHMARK_STATISTICS Statistics,
+    _In_ ULONGLONG ElapsedTicks
+    )
+{
+    double seconds = (double)ElapsedTicks / (double)Context->Frequency.QuadPart;
+    double ticksPerMicrosecond = (double)Context->Frequency.QuadPart / 1000000.0;
+    ULONGLONG commands = Statistics->Reads + Statistics->Writes;
+    ULONGLONG counted = 0;
+    ULONGLONG p50 = 0, p99 = 0, p999 = 0;
+    ULONG i;
+
+    printf("Elapsed: %.2f seconds\n", seconds);
+    printf("Commands: %I64u (%I64u reads, %I64u writes), %I64u errors\n",
+           commands, Statistics->Reads, Statistics->Writes, Statistics->Errors);
+
+    if (Statistics->Errors != 0) {
+        printf("First error: %d, Scsi status: %02Xh, sense key: %02Xh, ASC: %02Xh\n",
+               Statistics->FirstErrorCode,
+               Statistics->FirstScsiStatus,
+               Statistics->FirstSenseKey,
+               Statistics->FirstAdditionalSenseCode);
+    }
+
+    if ((commands == 0) || (seconds <= 0.0)) {
+        printf("\n");
+        return;
+    }
+
+    printf("IOPS: %.0f (read %.0f, write %.0f)\n",
+           commands / seconds,
+           Statistics->Reads / seconds,
+           Statistics->Writes / seconds);
+    printf("Throughput: %.2f MB/s (read %.2f MB/s, write %.2f MB/s)\n",
+           (Statistics->BytesRead + Statistics->BytesWritten) / seconds / (1024 * 1024),
+           Statistics->BytesRead / seconds / (1024 * 1024),
+           Statistics->BytesWritten / seconds / (1024 * 1024));
+    printf("Latency: average %.1f us, maximum %.1f us\n",
+           Statistics->TotalLatency / ticksPerMicrosecond / commands,
+           Statistics->MaxLatency / ticksPerMicrosecond);
+
+    //
+    // Percentiles are only known to the bucket, report its upper bound.
+    //
+
+    for (i = 0; i < BENCHMARK_HISTOGRAM_BUCKETS; i++) {
+
+        counted += Statistics->Histogram[i];
+
+        if ((p50 == 0) && (counted * 2 >= commands)) {
+            p50 = 1ULL << (i + 1);
+        }
+        if ((p99 == 0) && (counted * 100 >= commands * 99)) {
+            p99 = 1ULL << (i + 1);
+        }
+        if ((p999 == 0) && (counted * 1000 >= commands * 999)) {
+            p999 = 1ULL << (i + 1);
+        }
+    }
+
+    printf("Latency percentiles: 50%% < %I64u us, 99%% < %I64u us, 99.9%% < %I64u us\n\n",
+           p50, p99, p999);
+
+    printf("Latency histogram (us)\n");
+    printf("-------------------------------------------------------------\n");
+
+    for (i = 0; i < BENCHMARK_HISTOGRAM_BUCKETS; i++) {
+
+        if (Statistics->Histogram[i] == 0) {
+            continue;
+        }
+
+        printf("%10I64u - %-10I64u %12I64u  %6.2f%%\n",
+               (i == 0) ? 0 : (1ULL << i),
+               1ULL << (i + 1),
+               Statistics->Histogram[i],
+               Statistics->Histogram[i] * 100.0 / commands);
+    }
+    printf("\n");
+}
@@ -86,6 +86,103 @@ BOOL
 QueryPropertyForDevice(_In_ HANDLE, _Out_ PULONG, _Out_ PUCHAR);
 
 
+//
+// Benchmark mode.
+//
+// Each thread keeps QueueDepth READ(16)/WRITE(16) commands outstanding
+// with IOCTL_SCSI_PASS_THROUGH_DIRECT(_EX) on an overlapped handle, at
+// random block aligned offsets on the device.
+//
+
+#define BENCHMARK_MAX_THREADS               MAXIMUM_WAIT_OBJECTS
+#define BENCHMARK_MAX_QUEUE_DEPTH           MAXIMUM_WAIT_OBJECTS
+#define BENCHMARK_MAX_TRANSFER_KB           1024
+#define BENCHMARK_TIMEOUT                   30
+
+//
+// Latency histogram bucket N counts commands that took [2^N, 2^(N+1))
+// microseconds. Bucket 0 also counts zero, the last bucket everything
+// longer.
+//
+
+#define BENCHMARK_HISTOGRAM_BUCKETS         32
+
+typedef struct _BENCHMARK_PARAMETERS {
+    ULONG ThreadCount;
+    ULONG QueueDepth;
+    ULONG TransferKB;
+    ULONG ReadPercent;
+    ULONG Seconds;
+} BENCHMARK_PARAMETERS, *PBENCHMARK_PARAMETERS;
+
+typedef struct _BENCHMARK_REQUEST {
+    OVERLAPPED        Overlapped;
+    SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER sptdwb;
+    SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER_EX sptdwb_ex;
+    PUCHAR            DataBuffer;
+    PUCHAR            UnAlignedBuffer;
+    LARGE_INTEGER     StartTime;
+    BOOLEAN           IsRead;
+} BENCHMARK_REQUEST, *PBENCHMARK_REQUEST;
+
+typedef struct _BENCHMARK_STATISTICS {
+    ULONGLONG         Reads;
+    ULONGLONG         Writes;
+    ULONGLONG         BytesRead;
+    ULONGLONG         BytesWritten;
+    ULONGLONG         Errors;
+    ULONGLONG         TotalLatency;     // in performance counter ticks
+    ULONGLONG         MaxLatency;       // in performance counter ticks
+    ULONGLONG         Histogram[BENCHMARK_HISTOGRAM_BUCKETS];
+    DWORD             FirstErrorCode;
+    UCHAR             FirstScsiStatus;
+    UCHAR             FirstSenseKey;
+    UCHAR             FirstAdditionalSenseCode;
+} BENCHMARK_STATISTICS, *PBENCHMARK_STATISTICS;
+
+typedef struct _BENCHMARK_CONTEXT {
+    HANDLE            DeviceHandle;
+    UCHAR             SrbType;
+    ULONG             AlignmentMask;
+    ULONG             BlockSize;
+    ULONGLONG         BlockCount;
+    ULONG             BlocksPerTransfer;
+    ULONG             TransferLength;
+    ULONG             ReadPercent;
+    ULONG             QueueDepth;
+    LARGE_INTEGER     Frequency;
+    volatile LONG     Stop;
+} BENCHMARK_CONTEXT, *PBENCHMARK_CONTEXT;
+
+typedef struct _BENCHMARK_THREAD {
+    PBENCHMARK_CONTEXT    Context;
+    HANDLE                Thread;
+    ULONG                 Seed;
+    PBENCHMARK_REQUEST    Requests;
+    BENCHMARK_STATISTICS  Statistics;
+} BENCHMARK_THREAD, *PBENCHMARK_THREAD;
+
+VOID
+RunBenchmark(_In_z_ LPCSTR, _In_ DWORD, _In_ DWORD, _In_ ULONG, _In_ UCHAR, _In_ PBENCHMARK_PARAMETERS);
+
+_Success_(return)
+BOOL
+BenchmarkReadCapacity(_In_ PBENCHMARK_CONTEXT, _Inout_ PBENCHMARK_REQUEST);
+
+VOID
+BenchmarkSetupRequest(_In_ PBENCHMARK_CONTEXT, _Inout_ PBENCHMARK_REQUEST, _In_ UCHAR, _In_ ULONGLONG, _In_ ULONG, _In_ BOOLEAN);
+
+BOOL
+BenchmarkSendRequest(_In_ PBENCHMARK_CONTEXT, _Inout_ PBENCHMARK_REQUEST);
+
+DWORD
+WINAPI
+BenchmarkThread(_In_ LPVOID);
+
+VOID
+PrintBenchmarkResults(_In_ PBENCHMARK_CONTEXT, _In_ PBENCHMARK_STATISTICS, _In_ ULONGLONG);
+
+
 //
 // Command Descriptor Block constants.
 //
@@ -26,6 +26,39 @@ Environment:
 
 #if !defined(BUFFERED_READ_WRITE) // if doing DIRECT_IO
 
+VOID
+PerformPipelinedBulkTransfer(
+    _In_ WDFREQUEST       Request,
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ PMDL             RequestMdl,
+    _In_ ULONG_PTR        VirtualAddress,
+    _In_ ULONG            TotalLength,
+    _In_ ULONG            StageLength,
+    _In_ ULONG            UrbFlags
+    );
+
+VOID
+SendPipelinedStages(
+    _In_ WDFREQUEST       Request
+    );
+
+VOID
+FinishPipelinedRequest(
+    _In_ WDFREQUEST       Request
+    );
+
+VOID
+StopPipelinedStages(
+    _In_ WDFREQUEST       Request,
+    _In_ NTSTATUS         Status,
+    _In_ ULONG            ExcludedStages
+    );
+
+VOID
+CompletePipelinedRequest(
+    _In_ WDFREQUEST       Request
+    );
+
 VOID
 ReadWriteBulkEndPoints(
     _In_ WDFQUEUE         Queue,
@@ -69,13 +102,14 @@ Return Value:
     ULONG_PTR               virtualAddress = 0;
     PREQUEST_CONTEXT        rwContext = NULL;
     PFILE_CONTEXT           fileContext = NULL;
-    WDFUSBPIPE              pipe;
+    WDFUSBPIPE              pipe = NULL;
     WDF_USB_PIPE_INFORMATION   pipeInfo;
     WDF_OBJECT_ATTRIBUTES   objectAttribs;
     USBD_PIPE_HANDLE        usbdPipeHandle;
     PDEVICE_CONTEXT         deviceContext;
     ULONG                   maxPacketSize;
     PPIPE_CONTEXT           pipeContext;
+    BOOLEAN                 streamStarted = FALSE;
 
     UsbSamp_DbgPrint(3, ("UsbSamp_DispatchReadWrite - begins\n"));
 
@@ -115,6 +149,7 @@ Return Value:
     }
 
     rwContext = GetRequestContext(Request);
+    rwContext->Pipelined = FALSE;
 
     if (RequestType == WdfRequestTypeRead) {
 
@@ -157,6 +192,26 @@ Return Value:
         stageLength = totalLength;
     }
 
+    //
+    // If the transfer takes more than one stage, keep several stages in
+    // flight with the stage requests of the pipe, unless another request
+    // is using them.
+    //
+    if (totalLength > stageLength &&
+        pipeContext->NumberOfStages > 1 &&
+        InterlockedCompareExchange(&pipeContext->StagesInUse, 1, 0) == 0) {
+
+        PerformPipelinedBulkTransfer(Request,
+                                     pipe,
+                                     requestMdl,
+                                     virtualAddress,
+                                     totalLength,
+                                     stageLength,
+                                     urbFlags);
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
     newMdl = IoAllocateMdl((PVOID) virtualAddress,
                            totalLength,
                            FALSE,
@@ -197,8 +252,11 @@ Return Value:
         // For super speed bulk pipe with streams, we specify one of its associated
         // usbd pipe handles to format an URB for sending or receiving data.
         // The usbd pipe handle is returned by the HCD via successful open-streams request
+        // Concurrent requests are spread across the streams, each going to
+        // the one with the fewest transfers in flight.
         //
-        usbdPipeHandle = GetStreamPipeHandleFromBulkPipe(pipe);
+        rwContext->StreamIndex = SelectStreamForTransfer(pipe);
+        usbdPipeHandle = GetStreamPipeHandleFromBulkPipe(pipe, rwContext->StreamIndex);
     }
     else {
         usbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(pipe);
@@ -234,6 +292,14 @@ Return Value:
     rwContext->Numxfer         = 0;
     rwContext->VirtualAddress  = virtualAddress + stageLength;
 
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    if(WdfUsbPipeTypeBulk == pipeInfo.PipeType &&
+        pipeContext->StreamConfigured == TRUE) {
+        StartStreamTransfer(pipe, rwContext->StreamIndex);
+        streamStarted = TRUE;
+    }
+#endif
+
     if (!WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(pipe), WDF_NO_SEND_OPTIONS)) {
         status = WdfRequestGetStatus(Request);
         NT_ASSERT(!NT_SUCCESS(status));
@@ -241,6 +307,11 @@ Return Value:
 
 Exit:
     if (!NT_SUCCESS(status)) {
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+        if (streamStarted) {
+            EndStreamTransfer(pipe, rwContext->StreamIndex, 0);
+        }
+#endif
         WdfRequestCompleteWithInformation(Request, status, 0);
 
         if (newMdl != NULL) {
@@ -421,6 +492,12 @@ End:
 
     IoFreeMdl(rwContext->Mdl);
 
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    if (GetPipeContext(pipe)->StreamConfigured == TRUE) {
+        EndStreamTransfer(pipe, rwContext->StreamIndex, rwContext->Numxfer);
+    }
+#endif
+
     UsbSamp_DbgPrint(3, ("%s request completed with status 0x%x\n",
                                                     operation, status));
 
@@ -429,6 +506,760 @@ End:
     return;
 }
 
+NTSTATUS
+InitializeBulkPipeStages(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFUSBPIPE      Pipe
+    )
+/*++
+
+Routine Description:
+
+    This routine creates the stage requests of a bulk pipe, each with its
+    own URB and partial MDL, so that nothing is allocated when a stage of
+    a transfer is sent. The number of stage requests depends on the speed
+    of the device. On a pipe with streams every stage request is bound to
+    a stream, with BULK_STREAM_QUEUE_DEPTH stage requests per stream.
+
+Arguments:
+
+    DeviceContext - pointer to Device Context
+
+    Pipe - The pipe. Interrupt pipes get no stage requests.
+
+Return Value:
+
+    NT status value. On failure the pipe has no stage requests and the
+    stages of its transfers are sent one at a time.
+
+--*/
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    WDF_USB_PIPE_INFORMATION   pipeInfo;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    PPIPE_CONTEXT           pipeContext;
+    PSTAGE_CONTEXT          stageContext;
+    WDFREQUEST              stageRequest;
+    ULONG                   numberOfStages;
+    ULONG                   maxPacketSize;
+    ULONG                   i;
+
+    pipeContext = GetPipeContext(Pipe);
+    pipeContext->NumberOfStages = 0;
+    pipeContext->StagesInUse = 0;
+
+    WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
+    WdfUsbTargetPipeGetInformation(Pipe, &pipeInfo);
+
+    if (WdfUsbPipeTypeBulk != pipeInfo.PipeType) {
+        return STATUS_SUCCESS;
+    }
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    if (pipeContext->StreamConfigured == TRUE) {
+        numberOfStages = min(pipeContext->StreamInfo.NumberOfStreams * BULK_STREAM_QUEUE_DEPTH,
+                             MAX_BULK_STAGES_IN_FLIGHT);
+    }
+    else
+#endif
+    if (DeviceContext->IsDeviceSuperSpeed == TRUE) {
+        numberOfStages = BULK_STAGES_IN_FLIGHT_SUPER_SPEED;
+    }
+    else if (DeviceContext->IsDeviceHighSpeed == TRUE) {
+        numberOfStages = BULK_STAGES_IN_FLIGHT_HIGH_SPEED;
+    }
+    else {
+        numberOfStages = BULK_STAGES_IN_FLIGHT_FULL_SPEED;
+    }
+
+    maxPacketSize = GetMaxPacketSize(Pipe, DeviceContext);
+
+    for (i = 0; i < numberOfStages; i++) {
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, STAGE_CONTEXT);
+        attributes.ParentObject = Pipe;
+        attributes.EvtCleanupCallback = UsbSamp_EvtStageContextCleanup;
+
+        status = WdfRequestCreate(&attributes,
+                                  WdfUsbTargetPipeGetIoTarget(Pipe),
+                                  &stageRequest);
+
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("WdfRequestCreate failed 0x%x\n", status));
+            break;
+        }
+
+        stageContext = GetStageContext(stageRequest);
+        stageContext->Index = i;
+        stageContext->StreamIndex = 0;
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+        if (pipeContext->StreamConfigured == TRUE) {
+            stageContext->StreamIndex = i % pipeContext->StreamInfo.NumberOfStreams;
+        }
+#endif
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ParentObject = stageRequest;
+
+        status = WdfUsbTargetDeviceCreateUrb(DeviceContext->WdfUsbTargetDevice,
+                                             &attributes,
+                                             &stageContext->UrbMemory,
+                                             NULL);
+
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("WdfUsbTargetDeviceCreateUrb failed 0x%x\n", status));
+            WdfObjectDelete(stageRequest);
+            break;
+        }
+
+        //
+        // A stage can start anywhere in a page, so size the mdl for a
+        // stage that starts at the end of one.
+        //
+        stageContext->Mdl = IoAllocateMdl((PVOID) (PAGE_SIZE - 1),
+                                          maxPacketSize,
+                                          FALSE,
+                                          FALSE,
+                                          NULL);
+
+        if (stageContext->Mdl == NULL) {
+            UsbSamp_DbgPrint(1, ("Failed to alloc mem for mdl\n"));
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            WdfObjectDelete(stageRequest);
+            break;
+        }
+
+        pipeContext->StageRequests[i] = stageRequest;
+    }
+
+    if (!NT_SUCCESS(status)) {
+
+        while (i > 0) {
+            i--;
+            WdfObjectDelete(pipeContext->StageRequests[i]);
+            pipeContext->StageRequests[i] = NULL;
+        }
+
+        return status;
+    }
+
+    pipeContext->NumberOfStages = numberOfStages;
+
+    UsbSamp_DbgPrint(3, ("Created %d stage requests for bulk pipe\n", numberOfStages));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+UsbSamp_EvtStageContextCleanup(
+    _In_ WDFOBJECT WdfObject
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the partial MDL of a stage request.
+
+Arguments:
+
+    WdfObject - The stage request.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PSTAGE_CONTEXT stageContext;
+
+    stageContext = GetStageContext((WDFREQUEST) WdfObject);
+
+    if (stageContext->Mdl != NULL) {
+        IoFreeMdl(stageContext->Mdl);
+        stageContext->Mdl = NULL;
+    }
+}
+
+VOID
+PerformPipelinedBulkTransfer(
+    _In_ WDFREQUEST       Request,
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ PMDL             RequestMdl,
+    _In_ ULONG_PTR        VirtualAddress,
+    _In_ ULONG            TotalLength,
+    _In_ ULONG            StageLength,
+    _In_ ULONG            UrbFlags
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a bulk transfer with up to NumberOfStages of its
+    stages in flight at once. The caller has set StagesInUse of the pipe.
+
+    Stages are sent in the order of their offsets in the buffer, so the
+    device sees the same sequence of transfers as when they are sent one
+    at a time. On a pipe with streams consecutive stages go to different
+    streams, and the device may complete them in any order. The request completes when all stages are done. If a stage
+    fails, the stages after it are cancelled, the pipe is reset and the
+    request fails with the status of that stage.
+
+Arguments:
+
+    Request - The read or write request.
+
+    Pipe - The bulk pipe.
+
+    RequestMdl - The MDL describing the buffer of the request.
+
+    VirtualAddress - The virtual address of the buffer.
+
+    TotalLength - Length of the transfer.
+
+    StageLength - Maximum length of a stage.
+
+    UrbFlags - Transfer flags of the stage URBs.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS                status;
+    PREQUEST_CONTEXT        rwContext;
+    PPIPE_CONTEXT           pipeContext;
+
+    rwContext = GetRequestContext(Request);
+    pipeContext = GetPipeContext(Pipe);
+
+    KeInitializeSpinLock(&rwContext->Lock);
+
+    //
+    // For a pipelined transfer, Mdl is the MDL of the request, the stage
+    // requests have their own partial MDLs.
+    //
+    rwContext->UrbMemory            = NULL;
+    rwContext->Mdl                  = RequestMdl;
+    rwContext->Length               = TotalLength;
+    rwContext->Numxfer              = 0;
+    rwContext->VirtualAddress       = VirtualAddress;
+    rwContext->Pipelined            = TRUE;
+    rwContext->UrbFlags             = UrbFlags;
+    rwContext->CompletionReferences = 2; // the transfer and the cancel routine
+    rwContext->Pipe                 = Pipe;
+
+    PipelineInitialize(&rwContext->Pipeline,
+                       VirtualAddress,
+                       TotalLength,
+                       StageLength,
+                       pipeContext->NumberOfStages);
+
+    UsbSamp_DbgPrint(3, ("Pipelined %s of %d bytes with %d stages in flight\n",
+                         rwContext->Read ? "Read" : "Write",
+                         TotalLength,
+                         pipeContext->NumberOfStages));
+
+    //
+    // The stage requests are created by the driver, so the cancellation
+    // of the request is not passed on to them by the framework.
+    //
+    status = WdfRequestMarkCancelableEx(Request, UsbSamp_EvtPipelinedRequestCancel);
+
+    if (!NT_SUCCESS(status)) {
+        UsbSamp_DbgPrint(1, ("WdfRequestMarkCancelableEx failed 0x%x\n", status));
+        InterlockedExchange(&pipeContext->StagesInUse, 0);
+        WdfRequestCompleteWithInformation(Request, status, 0);
+        return;
+    }
+
+    SendPipelinedStages(Request);
+}
+
+VOID
+SendPipelinedStages(
+    _In_ WDFREQUEST       Request
+    )
+/*++
+
+Routine Description:
+
+    This routine sends the next stages of a pipelined transfer with the
+    idle stage requests of the pipe. Only one thread sends at a time, so
+    that stages are sent in order even when several complete at once on
+    different processors; a stage request that becomes idle while another
+    thread is sending is used by that thread. This also keeps a stage that
+    completes inline from recursing into another send.
+
+    The thread that finds all stages done finishes the request.
+
+Arguments:
+
+    Request - The read or write request.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS                status;
+    KIRQL                   oldIrql;
+    PREQUEST_CONTEXT        rwContext;
+    PPIPE_CONTEXT           pipeContext;
+    PSTAGE_CONTEXT          stageContext;
+    WDFREQUEST              stageRequest;
+    WDF_REQUEST_REUSE_PARAMS   reuseParams;
+    PURB                    urb;
+    USBD_PIPE_HANDLE        usbdPipeHandle;
+    ULONG                   index;
+    ULONG                   stageLength;
+    ULONG_PTR               virtualAddress;
+    BOOLEAN                 finish;
+
+    rwContext = GetRequestContext(Request);
+    pipeContext = GetPipeContext(rwContext->Pipe);
+
+    KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+
+    if (!PipelineStartSending(&rwContext->Pipeline)) {
+        KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+        return;
+    }
+
+    //
+    // Take an idle stage request and the next part of the buffer.
+    //
+    while (PipelineTakeStage(&rwContext->Pipeline, &index, &virtualAddress, &stageLength)) {
+
+        KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+
+        stageRequest = pipeContext->StageRequests[index];
+        stageContext = GetStageContext(stageRequest);
+
+        WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+        status = WdfRequestReuse(stageRequest, &reuseParams);
+        NT_ASSERT(NT_SUCCESS(status));
+
+        //
+        // Following call is required to free any mapping made on the partial MDL
+        // and reset internal MDL state.
+        //
+        MmPrepareMdlForReuse(stageContext->Mdl);
+
+        IoBuildPartialMdl(rwContext->Mdl,
+                          stageContext->Mdl,
+                          (PVOID) virtualAddress,
+                          stageLength);
+
+        urb = (PURB) WdfMemoryGetBuffer(stageContext->UrbMemory, NULL);
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+        //
+        // On a pipe with streams the stage goes to the stream of its stage
+        // request, so consecutive stages go to different streams.
+        //
+        if (pipeContext->StreamConfigured == TRUE) {
+            usbdPipeHandle = GetStreamPipeHandleFromBulkPipe(rwContext->Pipe,
+                                                             stageContext->StreamIndex);
+            StartStreamTransfer(rwContext->Pipe, stageContext->StreamIndex);
+        }
+        else {
+            usbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(rwContext->Pipe);
+        }
+#else
+        usbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(rwContext->Pipe);
+#endif
+
+        UsbBuildInterruptOrBulkTransferRequest(urb,
+                                               sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
+                                               usbdPipeHandle,
+                                               NULL,
+                                               stageContext->Mdl,
+                                               stageLength,
+                                               rwContext->UrbFlags,
+                                               NULL);
+
+        status = WdfUsbTargetPipeFormatRequestForUrb(rwContext->Pipe,
+                                                     stageRequest,
+                                                     stageContext->UrbMemory,
+                                                     NULL);
+
+        if (NT_SUCCESS(status)) {
+
+            WdfRequestSetCompletionRoutine(stageRequest, UsbSamp_EvtStageCompletion, Request);
+
+            if (!WdfRequestSend(stageRequest,
+                                WdfUsbTargetPipeGetIoTarget(rwContext->Pipe),
+                                WDF_NO_SEND_OPTIONS)) {
+                status = WdfRequestGetStatus(stageRequest);
+            }
+        }
+
+        if (!NT_SUCCESS(status)) {
+
+            UsbSamp_DbgPrint(1, ("Failed to send stage request 0x%x\n", status));
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+            if (pipeContext->StreamConfigured == TRUE) {
+                EndStreamTransfer(rwContext->Pipe, stageContext->StreamIndex, 0);
+            }
+#endif
+        }
+
+        KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+
+        if (PipelineStageSent(&rwContext->Pipeline, index, status)) {
+
+            //
+            // The transfer was stopped while the stage was sent.
+            //
+            KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+
+            WdfRequestCancelSentRequest(stageRequest);
+
+            KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+        }
+    }
+
+    finish = PipelineStopSending(&rwContext->Pipeline);
+
+    KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+
+    if (finish) {
+        FinishPipelinedRequest(Request);
+    }
+}
+
+VOID
+UsbSamp_EvtStageCompletion(
+    _In_ WDFREQUEST                  Request,
+    _In_ WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+    _In_ WDFCONTEXT                  Context
+    )
+/*++
+
+Routine Description:
+
+    This is the completion routine for the stage requests of a pipelined
+    transfer. It accounts for the stage and sends the next one with the
+    stage request.
+
+Arguments:
+
+    Request - The stage request.
+
+    Target - The pipe.
+
+    CompletionParams - request completion params
+
+    Context - The read or write request the stage is part of.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS                status;
+    KIRQL                   oldIrql;
+    WDFREQUEST              request;
+    PREQUEST_CONTEXT        rwContext;
+    PSTAGE_CONTEXT          stageContext;
+    PURB                    urb;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    request = (WDFREQUEST) Context;
+    rwContext = GetRequestContext(request);
+    stageContext = GetStageContext(Request);
+    status = CompletionParams->IoStatus.Status;
+    urb = (PURB) WdfMemoryGetBuffer(stageContext->UrbMemory, NULL);
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    if (GetPipeContext(rwContext->Pipe)->StreamConfigured == TRUE) {
+        EndStreamTransfer(rwContext->Pipe,
+                          stageContext->StreamIndex,
+                          NT_SUCCESS(status) ? urb->UrbBulkOrInterruptTransfer.TransferBufferLength : 0);
+    }
+#endif
+
+    if (NT_SUCCESS(status)) {
+
+        KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+
+        PipelineStageDone(&rwContext->Pipeline,
+                          stageContext->Index,
+                          urb->UrbBulkOrInterruptTransfer.TransferBufferLength);
+
+        KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+    }
+    else {
+
+        UsbSamp_DbgPrint(1, ("Stage of %s failed with status 0x%x\n",
+                             rwContext->Read ? "Read" : "Write",
+                             status));
+
+        //
+        // Stages of a bulk pipe complete in order, so this is the first
+        // stage that failed; on a pipe with streams they may not, but the
+        // transfer fails all the same. The other stages are cancelled, as
+        // the pipe is reset anyway. The stage request is marked idle only
+        // afterwards, so the transfer cannot finish, and the stage
+        // requests be used by another transfer, while they are cancelled.
+        //
+        StopPipelinedStages(request, status, 1 << stageContext->Index);
+
+        KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+        PipelineStageIdle(&rwContext->Pipeline, stageContext->Index);
+        KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+    }
+
+    SendPipelinedStages(request);
+}
+
+VOID
+StopPipelinedStages(
+    _In_ WDFREQUEST       Request,
+    _In_ NTSTATUS         Status,
+    _In_ ULONG            ExcludedStages
+    )
+/*++
+
+Routine Description:
+
+    This routine stops a pipelined transfer: no more stages are sent and
+    the stages in flight are cancelled. The request completes with Status
+    once they are done, unless it was already stopped. The stages are
+    cancelled even then: a transfer stopped because a stage could not be
+    sent leaves the stages sent before it to complete, and if one of them
+    fails it may halt the endpoint with the others queued behind it. The
+    caller keeps the transfer from finishing until this returns.
+
+Arguments:
+
+    Request - The read or write request.
+
+    Status - The status to complete the request with.
+
+    ExcludedStages - Bitmask of stage requests not to cancel.
+
+Return Value:
+
+    None
+
+--*/
+{
+    KIRQL                   oldIrql;
+    PREQUEST_CONTEXT        rwContext;
+    PPIPE_CONTEXT           pipeContext;
+    ULONG                   busyStages;
+    ULONG                   index;
+
+    rwContext = GetRequestContext(Request);
+    pipeContext = GetPipeContext(rwContext->Pipe);
+
+    KeAcquireSpinLock(&rwContext->Lock, &oldIrql);
+
+    busyStages = PipelineStop(&rwContext->Pipeline, Status, ExcludedStages);
+
+    KeReleaseSpinLock(&rwContext->Lock, oldIrql);
+
+    //
+    // A busy stage request may complete before it is cancelled; it is
+    // not sent again once the transfer is stopped.
+    //
+    while (busyStages != 0) {
+
+        _BitScanForward(&index, busyStages);
+        busyStages &= ~(1 << index);
+
+        WdfRequestCancelSentRequest(pipeContext->StageRequests[index]);
+    }
+}
+
+VOID
+StopPipelinedRequest(
+    _In_ WDFREQUEST Request,
+    _In_ NTSTATUS   Status
+    )
+/*++
+
+Routine Description:
+
+    This routine stops a pipelined transfer on behalf of EvtIoStop.
+
+Arguments:
+
+    Request - The read or write request.
+
+    Status - The status to complete the request with.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREQUEST_CONTEXT        rwContext;
+
+    rwContext = GetRequestContext(Request);
+
+    //
+    // Keep the request from completing while its stages are cancelled.
+    //
+    if (!PipelineReference(&rwContext->CompletionReferences)) {
+        return;
+    }
+
+    StopPipelinedStages(Request, Status, 0);
+
+    if (PipelineRelease(&rwContext->CompletionReferences, 1)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+VOID
+UsbSamp_EvtPipelinedRequestCancel(
+    _In_ WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    This is the cancel routine of a pipelined transfer. It cancels the
+    stages in flight. The request is completed here or when the last stage
+    is done, whichever comes last.
+
+Arguments:
+
+    Request - The read or write request.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREQUEST_CONTEXT        rwContext;
+
+    rwContext = GetRequestContext(Request);
+
+    StopPipelinedStages(Request, STATUS_CANCELLED, 0);
+
+    if (PipelineRelease(&rwContext->CompletionReferences, 1)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+VOID
+FinishPipelinedRequest(
+    _In_ WDFREQUEST       Request
+    )
+/*++
+
+Routine Description:
+
+    This routine is called once all stages of a pipelined transfer are
+    done. It drops the references of the transfer, and of the cancel
+    routine if it can no longer be called; the last reference completes
+    the request.
+
+Arguments:
+
+    Request - The read or write request.
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS                status;
+    PREQUEST_CONTEXT        rwContext;
+    LONG                    references;
+
+    rwContext = GetRequestContext(Request);
+
+    status = WdfRequestUnmarkCancelable(Request);
+
+    if (status == STATUS_CANCELLED) {
+        references = 1;
+    }
+    else {
+        references = 2;
+    }
+
+    if (PipelineRelease(&rwContext->CompletionReferences, references)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+VOID
+CompletePipelinedRequest(
+    _In_ WDFREQUEST       Request
+    )
+/*++
+
+Routine Description:
+
+    This routine makes the stage requests of the pipe available to the
+    next transfer and completes a pipelined transfer.
+
+Arguments:
+
+    Request - The read or write request.
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREQUEST_CONTEXT        rwContext;
+    PPIPE_CONTEXT           pipeContext;
+
+    rwContext = GetRequestContext(Request);
+    pipeContext = GetPipeContext(rwContext->Pipe);
+
+    InterlockedExchange(&pipeContext->StagesInUse, 0);
+
+    //
+    // For DbgPrintRWContext.
+    //
+    rwContext->Length = rwContext->Pipeline.Length;
+    rwContext->Numxfer = rwContext->Pipeline.Numxfer;
+    rwContext->VirtualAddress = rwContext->Pipeline.VirtualAddress;
+
+    if (!NT_SUCCESS(rwContext->Pipeline.Status)) {
+        //
+        // Queue a workitem to reset the pipe because the completion could be
+        // running at DISPATCH_LEVEL.
+        //
+        QueuePassiveLevelCallback(WdfIoTargetGetDevice(WdfUsbTargetPipeGetIoTarget(rwContext->Pipe)),
+                                  rwContext->Pipe);
+    }
+
+    DbgPrintRWContext(rwContext);
+
+    UsbSamp_DbgPrint(3, ("%s request completed with status 0x%x\n",
+                         rwContext->Read ? "Read" : "Write",
+                         rwContext->Pipeline.Status));
+
+    //
+    // As when the stages are sent one at a time, a failed transfer reports
+    // no bytes transferred.
+    //
+    if (NT_SUCCESS(rwContext->Pipeline.Status)) {
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, rwContext->Numxfer);
+    }
+    else {
+        WdfRequestComplete(Request, rwContext->Pipeline.Status);
+    }
+}
+
 #else
 
 VOID
@@ -470,13 +1301,14 @@ Return Value:
     PVOID                 virtualAddress = 0;
     PREQUEST_CONTEXT      rwContext = NULL;
     PFILE_CONTEXT         fileContext = NULL;
-    WDFUSBPIPE            pipe;
+    WDFUSBPIPE            pipe = NULL;
     WDF_USB_PIPE_INFORMATION pipeInfo;
     WDFMEMORY             reqMemory;
     WDFMEMORY_OFFSET      offset;
     WDF_OBJECT_ATTRIBUTES objectAttribs;
     PDEVICE_CONTEXT       deviceContext;
     PPIPE_CONTEXT         pipeContext;
+    BOOLEAN               streamStarted = FALSE;
 
     ULONG                 maxPacketSize;
 
@@ -588,7 +1420,14 @@ Return Value:
     //
     if(WdfUsbPipeTypeBulk == pipeInfo.PipeType &&
         pipeContext->StreamConfigured == TRUE) {
-        ConfigureStreamPipeHandleForRequest(Request, pipe);
+        //
+        // Concurrent requests are spread across the streams, each going
+        // to the one with the fewest transfers in flight.
+        //
+        rwContext->StreamIndex = SelectStreamForTransfer(pipe);
+        ConfigureStreamPipeHandleForRequest(Request, pipe, rwContext->StreamIndex);
+        StartStreamTransfer(pipe, rwContext->StreamIndex);
+        streamStarted = TRUE;
     }
 #endif
 
@@ -614,6 +1453,11 @@ Return Value:
 
 Exit:
     if (!NT_SUCCESS(status)) {
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+        if (streamStarted) {
+            EndStreamTransfer(pipe, rwContext->StreamIndex, 0);
+        }
+#endif
         WdfRequestCompleteWithInformation(Request, status, 0);
     }
 
@@ -762,7 +1606,7 @@ Return Value:
     //
     if(WdfUsbPipeTypeBulk == pipeInfo.PipeType &&
         pipeContext->StreamConfigured == TRUE) {
-        ConfigureStreamPipeHandleForRequest(Request, pipe);
+        ConfigureStreamPipeHandleForRequest(Request, pipe, rwContext->StreamIndex);
     }
 #endif
 
@@ -793,6 +1637,13 @@ End:
     //
     DbgPrintRWContext(rwContext);
 
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    if(WdfUsbPipeTypeBulk == pipeInfo.PipeType &&
+        pipeContext->StreamConfigured == TRUE) {
+        EndStreamTransfer(pipe, rwContext->StreamIndex, rwContext->Numxfer);
+    }
+#endif
+
     UsbSamp_DbgPrint(3, ("%s request completed with status 0x%x\n",
                                                     operation, status));
 
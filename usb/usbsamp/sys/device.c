@@ -123,7 +123,7 @@ Return Value:
         &fileConfig,
         UsbSamp_EvtDeviceFileCreate,
         WDF_NO_EVENT_CALLBACK,
-        WDF_NO_EVENT_CALLBACK
+        UsbSamp_EvtFileCleanup
         );
 
     //
@@ -726,6 +726,19 @@ Return Value:
                 UsbSamp_DbgPrint(1, ("InitializePipeContext failed %x\n", status));
                 break;
             }
+
+            status = InitializeIsochRing(pipe);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+#if !defined(BUFFERED_READ_WRITE) // if doing DIRECT_IO
+            //
+            // Without stage requests, the stages of bulk transfers on the
+            // pipe are sent one at a time, so a failure is not fatal.
+            //
+            (VOID) InitializeBulkPipeStages(pDeviceContext, pipe);
+#endif
         }
 
     }
@@ -1666,10 +1679,6 @@ Return Value:
 
     pPipeContext->StreamConfigured = FALSE;
     pStreamInfo = &pPipeContext->StreamInfo;
-    pStreamInfo->NumberOfStreams = 0;
-    if(pStreamInfo->StreamList != NULL){
-        ExFreePool(pStreamInfo->StreamList);
-        pStreamInfo->StreamList = NULL;
-    }
+    FreeStreamInfo(pStreamInfo);
 }
 #endif
@@ -0,0 +1,593 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    isochring.h
+
+Abstract:
+
+    The state of an isoch streaming ring and the routines of isorwr.c that
+    update it: the layout of a slot, where each slot is scheduled, what a
+    completed slot adds to the counters and to the circular buffer, which
+    slots are sent or retired and when the ring halts. They work on the
+    state alone; the caller holds the ring lock, except for the layout, and
+    sends, cancels and completes the requests. The user mode model in
+    ..\test builds this file as it is.
+
+Environment:
+
+    Kernel mode and user mode test
+
+--*/
+
+#ifndef _ISOCHRING_H
+#define _ISOCHRING_H
+
+typedef struct _ISOCH_RING_STATE {
+
+    BOOLEAN           Read;
+    BOOLEAN           Stopping;
+    BOOLEAN           Halted;         // a slot failed, none is sent again
+    BOOLEAN           Sending;        // a thread is sending slots
+    NTSTATUS          HaltStatus;     // status of the slot that failed
+    ULONG             NumberOfPackets;    // per slot
+    ULONG             NumberOfFrames;     // per slot
+    ULONG             PacketSize;
+    ULONG             SlotLength;
+    ULONG             NextStartFrame;
+    ULONG             BusySlots;      // bitmask of slots sent to the pipe
+    ULONG             IdleSlots;      // bitmask of slots waiting to be sent
+
+    PUCHAR            Data;
+    ULONG             DataSize;
+    ULONG             DataStart;
+    ULONG             DataLength;
+
+    ULONG             IntervalStartFrame;
+    USBSAMP_ISOCH_STREAM_STATISTICS Statistics;
+
+} ISOCH_RING_STATE, *PISOCH_RING_STATE;
+
+
+__inline
+NTSTATUS
+IsochTransferLayout(
+    _In_  BOOLEAN         IsDeviceSuperSpeed,
+    _In_  BOOLEAN         IsDeviceHighSpeed,
+    _In_  ULONG           TransferSizePerMicroframe,
+    _In_  ULONG           TransferSizePerFrame,
+    _In_  ULONG           TotalLength,
+    _Out_ PULONG          NumberOfPackets,
+    _Out_ PULONG          NumberOfFrames,
+    _Out_ PULONG          PacketSize
+    )
+/*++
+
+Routine Description:
+
+    This routine works out how an isoch transfer of TotalLength bytes is
+    split into packets and frames on a pipe.
+
+Return Value:
+
+    STATUS_INVALID_PARAMETER if the length is not a whole number of frames
+    or needs too many packets.
+
+--*/
+{
+    ULONG maxPackets;
+
+    *NumberOfPackets = 0;
+    *NumberOfFrames = 0;
+    *PacketSize = 0;
+
+    if ((TotalLength % TransferSizePerFrame) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (IsDeviceSuperSpeed || IsDeviceHighSpeed) {
+
+        *PacketSize = TransferSizePerMicroframe;
+        *NumberOfFrames = TotalLength / TransferSizePerFrame;
+        *NumberOfPackets = TotalLength / TransferSizePerMicroframe;
+
+        maxPackets = IsDeviceSuperSpeed ? MAX_SUPPORTED_PACKETS_FOR_SUPER_SPEED :
+                                          MAX_SUPPORTED_PACKETS_FOR_HIGH_SPEED;
+    }
+    else {
+
+        *PacketSize = TransferSizePerFrame;
+        *NumberOfPackets = TotalLength / TransferSizePerFrame;
+        *NumberOfFrames = *NumberOfPackets;
+
+        maxPackets = MAX_SUPPORTED_PACKETS_FOR_FULL_SPEED;
+    }
+
+    //
+    // Then make sure the buffer doesn't exceed maximum allowed packets per transfer
+    //
+    if (*NumberOfPackets > maxPackets) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+__inline
+VOID
+IsochRingDataPut(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine appends data to the circular buffer of a ring. The caller
+    has checked that it fits.
+
+--*/
+{
+    ULONG end;
+    ULONG first;
+
+    NT_ASSERT(Length <= Ring->DataSize - Ring->DataLength);
+
+    end = (Ring->DataStart + Ring->DataLength) % Ring->DataSize;
+    first = min(Length, Ring->DataSize - end);
+
+    RtlCopyMemory(Ring->Data + end, Buffer, first);
+    RtlCopyMemory(Ring->Data, Buffer + first, Length - first);
+
+    Ring->DataLength += Length;
+}
+
+__inline
+VOID
+IsochRingDataGet(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    This routine removes data from the head of the circular buffer of a
+    ring. The caller has checked that there is enough.
+
+--*/
+{
+    ULONG first;
+
+    NT_ASSERT(Length <= Ring->DataLength);
+
+    first = min(Length, Ring->DataSize - Ring->DataStart);
+
+    RtlCopyMemory(Buffer, Ring->Data + Ring->DataStart, first);
+    RtlCopyMemory(Buffer + first, Ring->Data, Length - first);
+
+    Ring->DataStart = (Ring->DataStart + Length) % Ring->DataSize;
+    Ring->DataLength -= Length;
+}
+
+__inline
+BOOLEAN
+IsochRingCanService(
+    _In_ PISOCH_RING_STATE Ring
+    )
+/*++
+
+Return Value:
+
+    FALSE if there is no data for a read, or no space for a write.
+
+--*/
+{
+    if ((Ring->Read && Ring->DataLength == 0) ||
+        (!Ring->Read && Ring->DataLength == Ring->DataSize)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+__inline
+BOOLEAN
+IsochRingServiceRequest(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Information
+    )
+/*++
+
+Routine Description:
+
+    This routine serves a read with as much data as there is, or a write
+    with all of its data.
+
+Return Value:
+
+    FALSE if a write does not fit yet; it is left for later so that the
+    writes stay in order.
+
+--*/
+{
+    if (Ring->Read) {
+
+        *Information = min(Length, Ring->DataLength);
+        IsochRingDataGet(Ring, Buffer, *Information);
+        return TRUE;
+    }
+
+    *Information = 0;
+
+    if (Length > Ring->DataSize - Ring->DataLength) {
+        return FALSE;
+    }
+
+    *Information = Length;
+    IsochRingDataPut(Ring, Buffer, Length);
+
+    return TRUE;
+}
+
+__inline
+ULONG
+IsochRingScheduleSlot(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             Index,
+    _In_ ULONG             FrameNumber
+    )
+/*++
+
+Routine Description:
+
+    This routine schedules a slot to start in the frame right after the
+    last slot sent. If that frame is too close the slot is scheduled a
+    little later instead, which leaves a gap in the stream and counts as a
+    late submission. The slot is busy until IsochRingSlotDone, or
+    IsochRingSlotNotSent if it cannot be sent.
+
+Return Value:
+
+    The frame the slot starts in.
+
+--*/
+{
+    ULONG startFrame;
+
+    if ((LONG)(Ring->NextStartFrame - FrameNumber) <= 1) {
+        Ring->Statistics.LateSubmissions++;
+        Ring->NextStartFrame = FrameNumber + DISPATCH_LATENCY_IN_MS;
+    }
+
+    startFrame = Ring->NextStartFrame;
+    Ring->NextStartFrame += Ring->NumberOfFrames;
+    Ring->BusySlots |= (1 << Index);
+
+    return startFrame;
+}
+
+__inline
+VOID
+IsochRingSlotNotSent(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             Index
+    )
+{
+    Ring->BusySlots &= ~(1 << Index);
+}
+
+__inline
+BOOLEAN
+IsochRingHalt(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ NTSTATUS          Status
+    )
+/*++
+
+Return Value:
+
+    TRUE if this halted the ring; the caller fails the reads or writes
+    waiting.
+
+--*/
+{
+    if (!NT_SUCCESS(Status) && !Ring->Stopping && !Ring->Halted) {
+        Ring->Halted = TRUE;
+        Ring->HaltStatus = Status;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+__inline
+BOOLEAN
+IsochRingSlotDone(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             Index,
+    _In_ ULONG             Latency,
+    _In_ NTSTATUS          Status,
+    _In_ BOOLEAN           TransferFailed,
+    _In_reads_(Ring->NumberOfPackets) PUSBD_ISO_PACKET_DESCRIPTOR IsoPacket,
+    _In_ PUCHAR            Buffer
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a slot that completed Latency frames after
+    its last frame: the counters are updated and the data read is moved to
+    the circular buffer. A slot that fails, or is cancelled while the ring
+    is not stopping, halts the ring.
+
+    The slot is neither busy nor idle until it is given to
+    IsochRingStartSending, so it cannot be retired and the ring cannot be
+    freed before then.
+
+Arguments:
+
+    TransferFailed - The urb of the slot failed, so its packets may not
+        have been touched.
+
+Return Value:
+
+    TRUE if this halted the ring; the caller fails the reads or writes
+    waiting.
+
+--*/
+{
+    PUSBD_ISO_PACKET_DESCRIPTOR packet;
+    ULONG length;
+    ULONG i;
+
+    Ring->BusySlots &= ~(1 << Index);
+
+    if (Status != STATUS_CANCELLED) {
+
+        Ring->Statistics.TransfersCompleted++;
+        Ring->Statistics.TotalCompletionLatency += Latency;
+
+        if (Latency > Ring->Statistics.MaxCompletionLatency) {
+            Ring->Statistics.MaxCompletionLatency = Latency;
+        }
+
+        if (!NT_SUCCESS(Status) || TransferFailed) {
+
+            Ring->Statistics.PacketsLost += Ring->NumberOfPackets;
+        }
+        else {
+
+            for (i = 0; i < Ring->NumberOfPackets; i++) {
+
+                packet = &IsoPacket[i];
+
+                if (!USBD_SUCCESS(packet->Status)) {
+                    Ring->Statistics.PacketsLost++;
+                    continue;
+                }
+
+                Ring->Statistics.PacketsTransferred++;
+
+                if (Ring->Read) {
+
+                    //
+                    // Keep what fits; the rest is lost if the reads fell behind.
+                    //
+                    length = min(packet->Length, Ring->DataSize - Ring->DataLength);
+
+                    IsochRingDataPut(Ring, Buffer + packet->Offset, length);
+
+                    Ring->Statistics.OverrunBytes += packet->Length - length;
+                }
+            }
+        }
+    }
+
+    return IsochRingHalt(Ring, Status);
+}
+
+__inline
+BOOLEAN
+IsochRingStartSending(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             Slots
+    )
+/*++
+
+Routine Description:
+
+    This routine makes slots idle. Only one thread at a time sends them, so
+    that they are scheduled in order even when several complete at once on
+    different processors; a slot that becomes idle while another thread is
+    sending is sent by that thread. This also keeps a slot that completes
+    inline from recursing into another send.
+
+Return Value:
+
+    TRUE if the caller is to send the idle slots.
+
+--*/
+{
+    Ring->IdleSlots |= Slots;
+
+    if (Ring->Sending) {
+        return FALSE;
+    }
+
+    Ring->Sending = TRUE;
+
+    return TRUE;
+}
+
+__inline
+BOOLEAN
+IsochRingTakeSlot(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _Out_ PULONG           Index
+    )
+/*++
+
+Return Value:
+
+    TRUE if the caller is to send the idle slot Index, FALSE once there is
+    none or the ring is stopping or halted.
+
+--*/
+{
+    if (Ring->Stopping ||
+        Ring->Halted ||
+        Ring->IdleSlots == 0) {
+        return FALSE;
+    }
+
+    _BitScanForward(Index, Ring->IdleSlots);
+    Ring->IdleSlots &= ~(1 << *Index);
+
+    return TRUE;
+}
+
+__inline
+VOID
+IsochRingLoadSlot(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _Inout_updates_bytes_(Ring->SlotLength) PUCHAR Buffer,
+    _In_ BOOLEAN           Sent
+    )
+/*++
+
+Routine Description:
+
+    For a write, this routine fills the buffer of a slot about to be sent
+    with whatever was written, and zeroes for what was not. The first time
+    a slot is sent it goes out zeroed.
+
+--*/
+{
+    ULONG length;
+
+    if (Ring->Read || !Sent) {
+        return;
+    }
+
+    length = min(Ring->DataLength, Ring->SlotLength);
+
+    IsochRingDataGet(Ring, Buffer, length);
+
+    if (length < Ring->SlotLength) {
+        RtlZeroMemory(Buffer + length, Ring->SlotLength - length);
+        Ring->Statistics.UnderrunBytes += Ring->SlotLength - length;
+    }
+}
+
+__inline
+BOOLEAN
+IsochRingSlotSent(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             Index,
+    _In_ NTSTATUS          Status,
+    _Inout_ PBOOLEAN       Halted
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a slot the caller tried to send. The
+    completion routine is not called for a slot that could not be sent,
+    so it is idle again and the ring halts; Halted is set if this halted
+    it.
+
+Return Value:
+
+    TRUE if the slot was sent but the ring was stopped meanwhile, possibly
+    after the busy slots were cancelled; the caller cancels it. The slot is
+    not retired before it completes, so it can still be cancelled.
+
+--*/
+{
+    if (!NT_SUCCESS(Status)) {
+
+        Ring->IdleSlots |= (1 << Index);
+
+        if (IsochRingHalt(Ring, Status)) {
+            *Halted = TRUE;
+        }
+
+        return FALSE;
+    }
+
+    return Ring->Stopping;
+}
+
+__inline
+LONG
+IsochRingStopSending(
+    _Inout_ PISOCH_RING_STATE Ring
+    )
+/*++
+
+Routine Description:
+
+    Once the ring is stopping or halted the idle slots are retired instead
+    of sent.
+
+Return Value:
+
+    The number of slots retired. The caller takes them off the slots
+    outstanding, and must not touch the ring once the last one is.
+
+--*/
+{
+    ULONG index;
+    LONG retired = 0;
+
+    Ring->Sending = FALSE;
+
+    if (Ring->Stopping || Ring->Halted) {
+
+        while (Ring->IdleSlots != 0) {
+            _BitScanForward(&index, Ring->IdleSlots);
+            Ring->IdleSlots &= ~(1 << index);
+            retired++;
+        }
+    }
+
+    return retired;
+}
+
+__inline
+VOID
+IsochRingGetStatistics(
+    _Inout_ PISOCH_RING_STATE Ring,
+    _In_ ULONG             FrameNumber,
+    _Out_ PUSBSAMP_ISOCH_STREAM_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the counters for the interval since the previous
+    call, and starts a new interval at FrameNumber.
+
+--*/
+{
+    *Statistics = Ring->Statistics;
+    Statistics->IntervalFrames = FrameNumber - Ring->IntervalStartFrame;
+    Statistics->BufferedBytes = Ring->DataLength;
+
+    RtlZeroMemory(&Ring->Statistics, sizeof(Ring->Statistics));
+    Ring->IntervalStartFrame = FrameNumber;
+}
+
+#endif // _ISOCHRING_H
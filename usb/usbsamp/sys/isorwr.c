@@ -24,6 +24,33 @@ Notes:
 --*/
 
 #include "private.h"
+
+NTSTATUS
+SubmitIsochSlot(
+    _In_ PISOCH_RING Ring,
+    _In_ WDFREQUEST  Slot
+    );
+
+VOID
+SendIsochSlots(
+    _In_ PISOCH_RING Ring,
+    _In_ ULONG       Slots
+    );
+
+VOID
+ServiceIsochRing(
+    _In_ PISOCH_RING Ring
+    );
+
+VOID
+FreeIsochRing(
+    _In_ PISOCH_RING Ring
+    );
+
+VOID
+TearDownIsochRing(
+    _In_ PPIPE_CONTEXT PipeContext
+    );
        
 VOID
 ReadWriteIsochEndPoints(
@@ -47,8 +74,6 @@ Routine Description:
     PDEVICE_CONTEXT             deviceContext;
     PREQUEST_CONTEXT            rwContext;
 
-    UNREFERENCED_PARAMETER(Length);
-
     UsbSamp_DbgPrint(3, ("ReadWriteIsochEndPoints - begins\n"));
 
     //
@@ -79,6 +104,13 @@ Routine Description:
         goto Exit;    
     }
 
+    //
+    // While the pipe is streaming, the request is served from the ring.
+    //
+    if (QueueRequestToIsochRing(pipe, Request, Length, RequestType == WdfRequestTypeRead)) {
+        return;
+    }
+
     deviceContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
     rwContext = GetRequestContext(Request);
 
@@ -190,13 +222,11 @@ Return Value:
     WDFUSBPIPE                  pipe;
     PFILE_CONTEXT               fileContext;
     WDF_OBJECT_ATTRIBUTES       attributes;
-    ULONG                       j;
     USBD_PIPE_HANDLE            usbdPipeHandle;
     PMDL                        requestMdl;
     WDFMEMORY                   urbMemory;
     PURB                        urb;
-    size_t                      urbSize;
-    ULONG                       offset;
+    ULONG                       packetSize;
     ULONG                       frameNumber, numberOfFrames;
     PPIPE_CONTEXT               pipeContext;
 
@@ -211,73 +241,16 @@ Return Value:
     pipe = fileContext->Pipe;
     pipeContext = GetPipeContext(pipe);
 
-    if ((TotalLength % pipeContext->TransferSizePerFrame) != 0) {
-        UsbSamp_DbgPrint(1, ("The transfer must evenly start and end on whole frame boundaries.\n"));
-        UsbSamp_DbgPrint(1, ("Transfer length should be multiples of %d\n", pipeContext->TransferSizePerFrame));
-        status = STATUS_INVALID_PARAMETER;
+    status = GetIsochTransferLayout(DeviceContext,
+                                    pipeContext,
+                                    TotalLength,
+                                    &numberOfPackets,
+                                    &numberOfFrames,
+                                    &packetSize);
+    if (!NT_SUCCESS(status)) {
         goto Exit;
     }
 
-    if (DeviceContext->IsDeviceSuperSpeed) {
-        
-        numberOfFrames  = TotalLength / pipeContext->TransferSizePerFrame;
-        numberOfPackets = TotalLength / pipeContext->TransferSizePerMicroframe;
-        
-        //
-        // Then make sure the buffer doesn't exceed maximum allowed packets per transfer 
-        //
-
-        if (numberOfPackets > MAX_SUPPORTED_PACKETS_FOR_SUPER_SPEED) {
-            UsbSamp_DbgPrint(1, ("NumberOfPackets %d required to transfer exceeds the limit %d\n", 
-                               numberOfPackets, MAX_SUPPORTED_PACKETS_FOR_SUPER_SPEED));
-            status = STATUS_INVALID_PARAMETER;
-            goto Exit;
-        }
-
-        UsbSamp_DbgPrint(3, ("Will send %d packets of %d bytes in %d frames\n",
-                        numberOfPackets, pipeContext->TransferSizePerMicroframe, numberOfFrames));
-
-    } else if (DeviceContext->IsDeviceHighSpeed) {
-
-        
-        numberOfFrames  = TotalLength / pipeContext->TransferSizePerFrame;
-        numberOfPackets = TotalLength / pipeContext->TransferSizePerMicroframe;
-        
-        //
-        // Then make sure the buffer doesn't exceed maximum allowed packets per transfer 
-        //
-
-        if (numberOfPackets > MAX_SUPPORTED_PACKETS_FOR_HIGH_SPEED) {
-            UsbSamp_DbgPrint(1, ("NumberOfPackets %d required to transfer exceeds the limit %d\n", 
-                               numberOfPackets, MAX_SUPPORTED_PACKETS_FOR_HIGH_SPEED));
-            status = STATUS_INVALID_PARAMETER;
-            goto Exit;
-        }
-
-        UsbSamp_DbgPrint(3, ("Will send %d packets of %d bytes in %d frames\n",
-                        numberOfPackets, pipeContext->TransferSizePerMicroframe, numberOfFrames));
-
-    }
-    else {
-
-        numberOfPackets = TotalLength / pipeContext->TransferSizePerFrame;
-        numberOfFrames = numberOfPackets;
-
-        //
-        // Then make sure the buffer doesn't exceed maximum allowed packets per transfer 
-        //
-
-        if (numberOfPackets > MAX_SUPPORTED_PACKETS_FOR_FULL_SPEED) {
-            UsbSamp_DbgPrint(1, ("NumberOfPackets %d required to transfer exceeds the limit %d\n", 
-                               numberOfPackets, MAX_SUPPORTED_PACKETS_FOR_FULL_SPEED));
-            status = STATUS_INVALID_PARAMETER;
-            goto Exit;
-        }
-
-        UsbSamp_DbgPrint(3, ("Will send %d packets of %d bytes in %d frames\n",
-                    numberOfPackets, pipeContext->TransferSizePerFrame, numberOfFrames));
-    }
-
     if (rwContext->Read == TRUE) {
         status = WdfRequestRetrieveOutputWdmMdl(Request, &requestMdl);
         if (!NT_SUCCESS(status)){
@@ -293,8 +266,6 @@ Return Value:
         }
     }
 
-    urbSize = GET_ISO_URB_SIZE(numberOfPackets);
-
     //
     // Allocate memory for URB.
     //
@@ -315,47 +286,14 @@ Return Value:
     urb = WdfMemoryGetBuffer(urbMemory, NULL);
 
     usbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(pipe);
-    urb->UrbIsochronousTransfer.Hdr.Length = (USHORT) urbSize;
-    urb->UrbIsochronousTransfer.Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
-    urb->UrbIsochronousTransfer.PipeHandle = usbdPipeHandle;
-
-    if (rwContext->Read) {
-        urb->UrbIsochronousTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
-    }
-    else {
-        urb->UrbIsochronousTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-    }
-
-    urb->UrbIsochronousTransfer.TransferBufferLength = TotalLength;
-    urb->UrbIsochronousTransfer.TransferBufferMDL = requestMdl;
-    urb->UrbIsochronousTransfer.NumberOfPackets = numberOfPackets;
-    urb->UrbIsochronousTransfer.UrbLink = NULL;   
-        
-    //
-    // Set the offsets for every packet for reads/writes
-    //
-    offset = 0;
-
-    for (j = 0; j < numberOfPackets; j++) {
-
-        if (DeviceContext->IsDeviceHighSpeed ||
-            DeviceContext->IsDeviceSuperSpeed) {
-            urb->UrbIsochronousTransfer.IsoPacket[j].Offset = j * pipeContext->TransferSizePerMicroframe;
-        } 
-        else {
-            urb->UrbIsochronousTransfer.IsoPacket[j].Offset = j * pipeContext->TransferSizePerFrame;
-        }
-
-        //
-        // Length is a return value on Isoch IN.  It is ignored on Isoch OUT.
-        //
-        urb->UrbIsochronousTransfer.IsoPacket[j].Length = 0;
-        urb->UrbIsochronousTransfer.IsoPacket[j].Status = 0;
 
-        UsbSamp_DbgPrint(3, ("IsoPacket[%d].Offset = %X IsoPacket[%d].Length = %X\n",
-                            j, urb->UrbIsochronousTransfer.IsoPacket[j].Offset,
-                            j, urb->UrbIsochronousTransfer.IsoPacket[j].Length));
-    }
+    InitializeIsochUrb(urb,
+                       usbdPipeHandle,
+                       rwContext->Read,
+                       requestMdl,
+                       TotalLength,
+                       numberOfPackets,
+                       packetSize);
 
     //
     // Calculate the StartFrame number:
@@ -443,6 +381,138 @@ Exit:
     return;
 }
 
+NTSTATUS
+GetIsochTransferLayout(
+    _In_  PDEVICE_CONTEXT DeviceContext,
+    _In_  PPIPE_CONTEXT   PipeContext,
+    _In_  ULONG           TotalLength,
+    _Out_ PULONG          NumberOfPackets,
+    _Out_ PULONG          NumberOfFrames,
+    _Out_ PULONG          PacketSize
+    )
+/*++
+
+Routine Description:
+
+    This routine works out how an isoch transfer of TotalLength bytes is
+    split into packets and frames on the pipe.
+
+Arguments:
+
+    DeviceContext - Device context
+    PipeContext - Context of the isoch pipe
+    TotalLength - Length of the transfer
+    NumberOfPackets - Receives the number of packets
+    NumberOfFrames - Receives the number of frames the transfer spans
+    PacketSize - Receives the size of every packet
+
+Return Value:
+
+    STATUS_INVALID_PARAMETER if the length is not a whole number of frames
+    or needs too many packets.
+
+--*/
+{
+    NTSTATUS status;
+
+    status = IsochTransferLayout(DeviceContext->IsDeviceSuperSpeed,
+                                 DeviceContext->IsDeviceHighSpeed,
+                                 PipeContext->TransferSizePerMicroframe,
+                                 PipeContext->TransferSizePerFrame,
+                                 TotalLength,
+                                 NumberOfPackets,
+                                 NumberOfFrames,
+                                 PacketSize);
+    if (!NT_SUCCESS(status)) {
+
+        if ((TotalLength % PipeContext->TransferSizePerFrame) != 0) {
+            UsbSamp_DbgPrint(1, ("The transfer must evenly start and end on whole frame boundaries.\n"));
+            UsbSamp_DbgPrint(1, ("Transfer length should be multiples of %d\n", PipeContext->TransferSizePerFrame));
+        }
+        else {
+            UsbSamp_DbgPrint(1, ("NumberOfPackets %d required to transfer exceeds the limit\n",
+                               *NumberOfPackets));
+        }
+
+        return status;
+    }
+
+    UsbSamp_DbgPrint(3, ("Will send %d packets of %d bytes in %d frames\n",
+                    *NumberOfPackets, *PacketSize, *NumberOfFrames));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+InitializeIsochUrb(
+    _Inout_ PURB             Urb,
+    _In_    USBD_PIPE_HANDLE PipeHandle,
+    _In_    BOOLEAN          Read,
+    _In_    PMDL             Mdl,
+    _In_    ULONG            TotalLength,
+    _In_    ULONG            NumberOfPackets,
+    _In_    ULONG            PacketSize
+    )
+/*++
+
+Routine Description:
+
+    This routine fills in an isoch urb, except for the start frame.
+
+Arguments:
+
+    Urb - Urb allocated for NumberOfPackets packets
+    PipeHandle - Handle of the isoch pipe
+    Read - TRUE for an IN transfer
+    Mdl - Describes the buffer of the transfer
+    TotalLength - Length of the transfer
+    NumberOfPackets - Number of packets of the transfer
+    PacketSize - Size of every packet
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG j;
+
+    Urb->UrbIsochronousTransfer.Hdr.Length = (USHORT) GET_ISO_URB_SIZE(NumberOfPackets);
+    Urb->UrbIsochronousTransfer.Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+    Urb->UrbIsochronousTransfer.PipeHandle = PipeHandle;
+
+    if (Read) {
+        Urb->UrbIsochronousTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
+    }
+    else {
+        Urb->UrbIsochronousTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    }
+
+    Urb->UrbIsochronousTransfer.TransferBufferLength = TotalLength;
+    Urb->UrbIsochronousTransfer.TransferBuffer = NULL;
+    Urb->UrbIsochronousTransfer.TransferBufferMDL = Mdl;
+    Urb->UrbIsochronousTransfer.NumberOfPackets = NumberOfPackets;
+    Urb->UrbIsochronousTransfer.UrbLink = NULL;   
+        
+    //
+    // Set the offsets for every packet for reads/writes
+    //
+    for (j = 0; j < NumberOfPackets; j++) {
+
+        Urb->UrbIsochronousTransfer.IsoPacket[j].Offset = j * PacketSize;
+
+        //
+        // Length is a return value on Isoch IN.  It is ignored on Isoch OUT.
+        //
+        Urb->UrbIsochronousTransfer.IsoPacket[j].Length = 0;
+        Urb->UrbIsochronousTransfer.IsoPacket[j].Status = 0;
+
+        UsbSamp_DbgPrint(3, ("IsoPacket[%d].Offset = %X IsoPacket[%d].Length = %X\n",
+                            j, Urb->UrbIsochronousTransfer.IsoPacket[j].Offset,
+                            j, Urb->UrbIsochronousTransfer.IsoPacket[j].Length));
+    }
+}
+
 
 VOID
 UsbSamp_EvtIsoRequestCompletionRoutine(
@@ -558,8 +628,975 @@ Return Value:
         WdfRequestStopAcknowledge(Request, FALSE); // Don't requeue
     } 
     else if (ActionFlags & WdfRequestStopActionPurge) {
+#if !defined(BUFFERED_READ_WRITE) // if doing DIRECT_IO
+        //
+        // A pipelined bulk transfer is not sent itself, its stages are.
+        //
+        if (GetRequestContext(Request)->Pipelined) {
+            StopPipelinedRequest(Request, STATUS_CANCELLED);
+            return;
+        }
+#endif
         WdfRequestCancelSentRequest(Request);
     }
 
     return;
 }
+
+NTSTATUS
+InitializeIsochRing(
+    _In_ WDFUSBPIPE    Pipe
+    )
+/*++
+
+Routine Description:
+
+    This routine initializes the isoch ring fields of a pipe context. It
+    is called for every configured pipe, as a handle may ask to stop the
+    stream on any pipe.
+
+Arguments:
+
+    Pipe - The pipe
+
+Return Value:
+
+    NT status value
+
+--*/
+{
+    NTSTATUS                status;
+    PPIPE_CONTEXT           pipeContext;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    pipeContext = GetPipeContext(Pipe);
+
+    pipeContext->IsochRing = NULL;
+    ExInitializeRundownProtection(&pipeContext->IsochRingRundown);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Pipe;
+
+    status = WdfWaitLockCreate(&attributes, &pipeContext->IsochRingLock);
+    if (!NT_SUCCESS(status)) {
+        UsbSamp_DbgPrint(1, ("WdfWaitLockCreate failed 0x%x\n", status));
+    }
+
+    return status;
+}
+
+NTSTATUS
+StartIsochRing(
+    _In_ WDFDEVICE     Device,
+    _In_ WDFFILEOBJECT FileObject,
+    _In_ WDFUSBPIPE    Pipe
+    )
+/*++
+
+Routine Description:
+
+    This routine starts streaming on an isoch pipe. It builds the slots of
+    the ring and sends all of them, scheduled one after the other. From
+    then on reads or writes on the pipe are served from the ring until it
+    is stopped.
+
+Arguments:
+
+    Device - Device handle
+    FileObject - The handle the stream belongs to
+    Pipe - The isoch pipe
+
+Return Value:
+
+    NT status value
+
+--*/
+{
+    NTSTATUS                    status;
+    PDEVICE_CONTEXT             deviceContext;
+    PPIPE_CONTEXT               pipeContext;
+    PISOCH_RING                 ring;
+    PISOCH_SLOT_CONTEXT         slotContext;
+    WDF_USB_PIPE_INFORMATION    pipeInfo;
+    WDF_OBJECT_ATTRIBUTES       attributes;
+    WDF_IO_QUEUE_CONFIG         queueConfig;
+    WDFMEMORY                   bufferMemory;
+    PURB                        urb;
+    ULONG                       frameNumber;
+    ULONG                       i;
+    BOOLEAN                     idleStopped = FALSE;
+
+    UsbSamp_DbgPrint(3, ("StartIsochRing - begins\n"));
+
+    deviceContext = GetDeviceContext(Device);
+    pipeContext = GetPipeContext(Pipe);
+
+    WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
+    WdfUsbTargetPipeGetInformation(Pipe, &pipeInfo);
+
+    if (WdfUsbPipeTypeIsochronous != pipeInfo.PipeType) {
+        UsbSamp_DbgPrint(1, ("Pipe type is not Isochronous\n"));
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    //
+    // The lock is held until the ring is running or gone, so that a stop
+    // never finds it half built.
+    //
+    WdfWaitLockAcquire(pipeContext->IsochRingLock, NULL);
+
+    if (pipeContext->IsochRing != NULL) {
+        WdfWaitLockRelease(pipeContext->IsochRingLock);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    ring = ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(ISOCH_RING), POOL_TAG);
+    if (ring == NULL) {
+        WdfWaitLockRelease(pipeContext->IsochRingLock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ring->Pipe = Pipe;
+    ring->Device = Device;
+    ring->DeviceContext = deviceContext;
+    ring->FileObject = FileObject;
+    ring->State.Read = WdfUsbTargetPipeIsInEndpoint(Pipe);
+    ring->State.SlotLength = ISOCH_RING_FRAMES_PER_SLOT * pipeContext->TransferSizePerFrame;
+    KeInitializeSpinLock(&ring->Lock);
+    KeInitializeEvent(&ring->SlotsIdle, NotificationEvent, FALSE);
+
+    status = GetIsochTransferLayout(deviceContext,
+                                    pipeContext,
+                                    ring->State.SlotLength,
+                                    &ring->State.NumberOfPackets,
+                                    &ring->State.NumberOfFrames,
+                                    &ring->State.PacketSize);
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    ring->State.DataSize = ring->State.SlotLength * ISOCH_RING_BUFFERED_SLOTS;
+    ring->State.Data = ExAllocatePool2(POOL_FLAG_NON_PAGED, ring->State.DataSize, POOL_TAG);
+    if (ring->State.Data == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    //
+    // Reads or writes wait here for data or space. The device is kept in
+    // D0 while streaming, so the queue is not power managed.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+
+    status = WdfIoQueueCreate(Device,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &ring->PendingQueue);
+    if (!NT_SUCCESS(status)) {
+        UsbSamp_DbgPrint(1, ("WdfIoQueueCreate failed 0x%x\n", status));
+        goto Error;
+    }
+
+    for (i = 0; i < ISOCH_RING_SLOTS; i++) {
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ISOCH_SLOT_CONTEXT);
+        attributes.ParentObject = Pipe;
+        attributes.EvtCleanupCallback = UsbSamp_EvtIsochSlotContextCleanup;
+
+        status = WdfRequestCreate(&attributes,
+                                  WdfUsbTargetPipeGetIoTarget(Pipe),
+                                  &ring->Slots[i]);
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("WdfRequestCreate failed 0x%x\n", status));
+            goto Error;
+        }
+
+        slotContext = GetIsochSlotContext(ring->Slots[i]);
+        slotContext->Index = i;
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ParentObject = ring->Slots[i];
+
+        status = WdfUsbTargetDeviceCreateIsochUrb(deviceContext->WdfUsbTargetDevice,
+                                                  &attributes,
+                                                  ring->State.NumberOfPackets,
+                                                  &slotContext->UrbMemory,
+                                                  NULL);
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("WdfUsbTargetDeviceCreateIsochUrb failed 0x%x\n", status));
+            goto Error;
+        }
+
+        status = WdfMemoryCreate(&attributes,
+                                 NonPagedPoolNx,
+                                 POOL_TAG,
+                                 ring->State.SlotLength,
+                                 &bufferMemory,
+                                 (PVOID*)&slotContext->Buffer);
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("WdfMemoryCreate failed 0x%x\n", status));
+            goto Error;
+        }
+
+        RtlZeroMemory(slotContext->Buffer, ring->State.SlotLength);
+
+        slotContext->Mdl = IoAllocateMdl(slotContext->Buffer,
+                                         ring->State.SlotLength,
+                                         FALSE,
+                                         FALSE,
+                                         NULL);
+        if (slotContext->Mdl == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Error;
+        }
+
+        MmBuildMdlForNonPagedPool(slotContext->Mdl);
+
+        urb = WdfMemoryGetBuffer(slotContext->UrbMemory, NULL);
+
+        InitializeIsochUrb(urb,
+                           WdfUsbTargetPipeWdmGetPipeHandle(Pipe),
+                           ring->State.Read,
+                           slotContext->Mdl,
+                           ring->State.SlotLength,
+                           ring->State.NumberOfPackets,
+                           ring->State.PacketSize);
+    }
+
+    status = WdfDeviceStopIdle(Device, TRUE);
+    if (!NT_SUCCESS(status)) {
+        UsbSamp_DbgPrint(1, ("WdfDeviceStopIdle failed 0x%x\n", status));
+        goto Error;
+    }
+
+    idleStopped = TRUE;
+
+    status = WdfUsbTargetDeviceRetrieveCurrentFrameNumber(deviceContext->WdfUsbTargetDevice,
+                                                          &frameNumber);
+    if (!NT_SUCCESS(status)) {
+        UsbSamp_DbgPrint(1, ("Failed to get frame number 0x%x\n", status));
+        goto Error;
+    }
+
+    ring->State.NextStartFrame = frameNumber + DISPATCH_LATENCY_IN_MS;
+    ring->State.IntervalStartFrame = frameNumber;
+    ring->SlotsOutstanding = ISOCH_RING_SLOTS;
+
+    InterlockedExchangePointer((PVOID*)&pipeContext->IsochRing, ring);
+
+    //
+    // The ring is only freed with IsochRingLock held, so it can still be
+    // looked at once the slots are sent.
+    //
+    SendIsochSlots(ring, (1 << ISOCH_RING_SLOTS) - 1);
+
+    if (ring->State.Halted) {
+
+        status = ring->State.HaltStatus;
+
+        TearDownIsochRing(pipeContext);
+
+        WdfWaitLockRelease(pipeContext->IsochRingLock);
+        return status;
+    }
+
+    WdfWaitLockRelease(pipeContext->IsochRingLock);
+
+    UsbSamp_DbgPrint(3, ("StartIsochRing - %d slots of %d bytes in flight\n",
+                        ISOCH_RING_SLOTS, ring->State.SlotLength));
+
+    return STATUS_SUCCESS;
+
+Error:
+
+    if (idleStopped) {
+        WdfDeviceResumeIdle(Device);
+    }
+
+    FreeIsochRing(ring);
+
+    WdfWaitLockRelease(pipeContext->IsochRingLock);
+
+    return status;
+}
+
+NTSTATUS
+StopIsochRing(
+    _In_ WDFUSBPIPE    Pipe,
+    _In_ WDFFILEOBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    This routine stops streaming on an isoch pipe. The slots in flight are
+    cancelled and the reads or writes still waiting are cancelled. Only
+    the handle that started the stream can stop it.
+
+Arguments:
+
+    Pipe - The isoch pipe
+    FileObject - The handle asking for the stream to stop
+
+Return Value:
+
+    STATUS_INVALID_DEVICE_STATE if the handle has no stream on the pipe.
+
+--*/
+{
+    PPIPE_CONTEXT   pipeContext;
+    PISOCH_RING     ring;
+
+    pipeContext = GetPipeContext(Pipe);
+
+    //
+    // Starting and stopping the stream are serialized over the whole
+    // teardown, so no other ring can be started on the pipe before this
+    // one is gone.
+    //
+    WdfWaitLockAcquire(pipeContext->IsochRingLock, NULL);
+
+    ring = pipeContext->IsochRing;
+
+    if (ring == NULL || ring->FileObject != FileObject) {
+        WdfWaitLockRelease(pipeContext->IsochRingLock);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    TearDownIsochRing(pipeContext);
+
+    WdfWaitLockRelease(pipeContext->IsochRingLock);
+
+    UsbSamp_DbgPrint(3, ("StopIsochRing - stopped\n"));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+TearDownIsochRing(
+    _In_ PPIPE_CONTEXT PipeContext
+    )
+/*++
+
+Routine Description:
+
+    This routine takes the ring of a pipe down. The slots in flight are
+    cancelled and the reads or writes still waiting are cancelled. The
+    caller holds IsochRingLock.
+
+    The ring stays on the pipe until it is freed. Reads and writes that
+    find it stopping are failed, and so are those that find the rundown
+    protection of the pipe run down, rather than sent to the pipe while
+    slots of the ring may still be in flight.
+
+Arguments:
+
+    PipeContext - Context of the isoch pipe
+
+Return Value:
+
+    None
+
+--*/
+{
+    PISOCH_RING     ring;
+    ULONG           busySlots;
+    ULONG           index;
+    KIRQL           oldIrql;
+
+    ring = PipeContext->IsochRing;
+
+    KeAcquireSpinLock(&ring->Lock, &oldIrql);
+    ring->State.Stopping = TRUE;
+    KeReleaseSpinLock(&ring->Lock, oldIrql);
+
+    //
+    // Wait for the reads and writes that found the ring before it was
+    // stopping.
+    //
+    ExWaitForRundownProtectionRelease(&PipeContext->IsochRingRundown);
+
+    KeAcquireSpinLock(&ring->Lock, &oldIrql);
+    busySlots = ring->State.BusySlots;
+    KeReleaseSpinLock(&ring->Lock, oldIrql);
+
+    //
+    // A busy slot may complete before it is cancelled; it is not sent
+    // again once the ring is stopping.
+    //
+    while (busySlots != 0) {
+
+        _BitScanForward(&index, busySlots);
+        busySlots &= ~(1 << index);
+
+        WdfRequestCancelSentRequest(ring->Slots[index]);
+    }
+
+    KeWaitForSingleObject(&ring->SlotsIdle, Executive, KernelMode, FALSE, NULL);
+
+    WdfDeviceResumeIdle(ring->Device);
+
+    InterlockedExchangePointer((PVOID*)&PipeContext->IsochRing, NULL);
+
+    FreeIsochRing(ring);
+
+    ExReInitializeRundownProtection(&PipeContext->IsochRingRundown);
+}
+
+VOID
+FreeIsochRing(
+    _In_ PISOCH_RING Ring
+    )
+/*++
+
+Routine Description:
+
+    This routine frees a ring that has no slot in flight. The reads or
+    writes still waiting for it are cancelled.
+
+Arguments:
+
+    Ring - The ring
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    if (Ring->PendingQueue != NULL) {
+        WdfIoQueuePurgeSynchronously(Ring->PendingQueue);
+        WdfObjectDelete(Ring->PendingQueue);
+    }
+
+    for (i = 0; i < ISOCH_RING_SLOTS; i++) {
+        if (Ring->Slots[i] != NULL) {
+            WdfObjectDelete(Ring->Slots[i]);
+        }
+    }
+
+    if (Ring->State.Data != NULL) {
+        ExFreePool(Ring->State.Data);
+    }
+
+    ExFreePool(Ring);
+}
+
+VOID
+UsbSamp_EvtIsochSlotContextCleanup(
+    _In_ WDFOBJECT Object
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the mdl describing the buffer of a slot.
+
+Arguments:
+
+    Object - The slot request
+
+Return Value:
+
+    None
+
+--*/
+{
+    PISOCH_SLOT_CONTEXT slotContext;
+
+    slotContext = GetIsochSlotContext(Object);
+
+    if (slotContext->Mdl != NULL) {
+        IoFreeMdl(slotContext->Mdl);
+        slotContext->Mdl = NULL;
+    }
+}
+
+NTSTATUS
+SubmitIsochSlot(
+    _In_ PISOCH_RING Ring,
+    _In_ WDFREQUEST  Slot
+    )
+/*++
+
+Routine Description:
+
+    This routine sends a slot of the ring, scheduled to start in the frame
+    right after the last slot sent. If that frame is too close the slot
+    is scheduled a little later instead, which leaves a gap in the stream
+    and counts as a late submission.
+
+Arguments:
+
+    Ring - The ring
+    Slot - The slot request, not in flight
+
+Return Value:
+
+    NT status value
+
+--*/
+{
+    NTSTATUS                    status;
+    PISOCH_SLOT_CONTEXT         slotContext;
+    WDF_REQUEST_REUSE_PARAMS    reuseParams;
+    PURB                        urb;
+    ULONG                       frameNumber;
+    ULONG                       j;
+    KIRQL                       oldIrql;
+
+    slotContext = GetIsochSlotContext(Slot);
+
+    status = WdfUsbTargetDeviceRetrieveCurrentFrameNumber(Ring->DeviceContext->WdfUsbTargetDevice,
+                                                          &frameNumber);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+
+    slotContext->StartFrame = IsochRingScheduleSlot(&Ring->State,
+                                                    slotContext->Index,
+                                                    frameNumber);
+
+    KeReleaseSpinLock(&Ring->Lock, oldIrql);
+
+    //
+    // The urb was built with the slot; only reset what the stack returns.
+    // A packet the stack does not get to is not taken for one received.
+    //
+    urb = WdfMemoryGetBuffer(slotContext->UrbMemory, NULL);
+
+    urb->UrbIsochronousTransfer.Hdr.Status = USBD_STATUS_SUCCESS;
+    urb->UrbIsochronousTransfer.TransferBufferLength = Ring->State.SlotLength;
+    urb->UrbIsochronousTransfer.ErrorCount = 0;
+    urb->UrbIsochronousTransfer.StartFrame = slotContext->StartFrame;
+
+    for (j = 0; j < Ring->State.NumberOfPackets; j++) {
+        urb->UrbIsochronousTransfer.IsoPacket[j].Length = 0;
+        urb->UrbIsochronousTransfer.IsoPacket[j].Status = USBD_STATUS_ISO_NOT_ACCESSED_BY_HW;
+    }
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+    status = WdfRequestReuse(Slot, &reuseParams);
+    NT_ASSERT(NT_SUCCESS(status));
+
+    status = WdfUsbTargetPipeFormatRequestForUrb(Ring->Pipe,
+                                                 Slot,
+                                                 slotContext->UrbMemory,
+                                                 NULL);
+    if (NT_SUCCESS(status)) {
+
+        WdfRequestSetCompletionRoutine(Slot, UsbSamp_EvtIsochSlotCompletion, Ring);
+
+        if (WdfRequestSend(Slot, WdfUsbTargetPipeGetIoTarget(Ring->Pipe), WDF_NO_SEND_OPTIONS) == FALSE) {
+            status = WdfRequestGetStatus(Slot);
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+        IsochRingSlotNotSent(&Ring->State, slotContext->Index);
+        KeReleaseSpinLock(&Ring->Lock, oldIrql);
+    }
+
+    return status;
+}
+
+VOID
+UsbSamp_EvtIsochSlotCompletion(
+    _In_ WDFREQUEST                  Request,
+    _In_ WDFIOTARGET                 Target,
+    PWDF_REQUEST_COMPLETION_PARAMS   CompletionParams,
+    _In_ WDFCONTEXT                  Context
+    )
+/*++
+
+Routine Description:
+
+    Completion routine of the slots of an isoch ring. The counters are
+    updated and the data read is moved to the circular buffer. The slot
+    is then sent again, with the data to write taken from the buffer.
+
+    A slot that fails, or is cancelled while the ring is not stopping,
+    halts the ring: no slot is sent again and the reads or writes waiting
+    are failed, until the stream is stopped.
+
+Arguments:
+
+    Context - The ring
+    Target - Target handle
+    Request - The slot request
+    Params - request completion params
+
+Return Value:
+
+    VOID
+
+--*/
+{
+    PISOCH_RING             ring;
+    PISOCH_SLOT_CONTEXT     slotContext;
+    PURB                    urb;
+    NTSTATUS                status;
+    ULONG                   frameNumber;
+    ULONG                   endFrame;
+    ULONG                   latency;
+    BOOLEAN                 halted;
+    KIRQL                   oldIrql;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    ring = (PISOCH_RING)Context;
+    slotContext = GetIsochSlotContext(Request);
+    urb = WdfMemoryGetBuffer(slotContext->UrbMemory, NULL);
+    status = CompletionParams->IoStatus.Status;
+
+    endFrame = slotContext->StartFrame + ring->State.NumberOfFrames;
+
+    if (!NT_SUCCESS(WdfUsbTargetDeviceRetrieveCurrentFrameNumber(ring->DeviceContext->WdfUsbTargetDevice,
+                                                                 &frameNumber))) {
+        frameNumber = endFrame;
+    }
+
+    latency = ((LONG)(frameNumber - endFrame) > 0) ? (frameNumber - endFrame) : 0;
+
+    KeAcquireSpinLock(&ring->Lock, &oldIrql);
+
+    halted = IsochRingSlotDone(&ring->State,
+                               slotContext->Index,
+                               latency,
+                               status,
+                               !USBD_SUCCESS(urb->UrbIsochronousTransfer.Hdr.Status),
+                               urb->UrbIsochronousTransfer.IsoPacket,
+                               slotContext->Buffer);
+
+    KeReleaseSpinLock(&ring->Lock, oldIrql);
+
+    //
+    // The slot is neither busy nor idle until it is given to
+    // SendIsochSlots, so it cannot be retired and the ring cannot be freed
+    // before then.
+    //
+    if (halted) {
+        UsbSamp_DbgPrint(1, ("Isoch ring halted, slot %d failed 0x%x\n",
+                            slotContext->Index, status));
+        WdfIoQueuePurge(ring->PendingQueue, WDF_NO_EVENT_CALLBACK, WDF_NO_CONTEXT);
+    }
+    else {
+
+        //
+        // Serve the reads waiting for the data just received, or move the
+        // writes waiting for space into the buffer before it is sent.
+        //
+        ServiceIsochRing(ring);
+    }
+
+    SendIsochSlots(ring, 1 << slotContext->Index);
+}
+
+VOID
+SendIsochSlots(
+    _In_ PISOCH_RING Ring,
+    _In_ ULONG       Slots
+    )
+/*++
+
+Routine Description:
+
+    This routine makes slots of a ring idle and sends the idle slots. Only
+    one thread at a time sends them, so that they are scheduled in order
+    even when several complete at once on different processors; a slot
+    that becomes idle while another thread is sending is sent by that
+    thread. This also keeps a slot that completes inline from recursing
+    into another send.
+
+    Once the ring is stopping or halted the idle slots are retired
+    instead. A slot counts in SlotsOutstanding until it is retired, and
+    the ring may be freed as soon as the last one is, so nothing here
+    touches the ring after retiring slots.
+
+Arguments:
+
+    Ring - The ring
+    Slots - Bitmask of the slots to make idle, neither busy nor retired
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS        status;
+    WDFREQUEST      slot;
+    PISOCH_SLOT_CONTEXT slotContext;
+    ULONG           index;
+    LONG            retired;
+    BOOLEAN         halted = FALSE;
+    KIRQL           oldIrql;
+
+    KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+
+    if (!IsochRingStartSending(&Ring->State, Slots)) {
+        KeReleaseSpinLock(&Ring->Lock, oldIrql);
+        return;
+    }
+
+    while (IsochRingTakeSlot(&Ring->State, &index)) {
+
+        slot = Ring->Slots[index];
+        slotContext = GetIsochSlotContext(slot);
+
+        //
+        // Send whatever was written, and zeroes for what was not.
+        //
+        IsochRingLoadSlot(&Ring->State, slotContext->Buffer, slotContext->Sent);
+
+        slotContext->Sent = TRUE;
+
+        KeReleaseSpinLock(&Ring->Lock, oldIrql);
+
+        status = SubmitIsochSlot(Ring, slot);
+
+        if (!NT_SUCCESS(status)) {
+            UsbSamp_DbgPrint(1, ("Failed to send slot %d of the isoch ring 0x%x\n",
+                                index, status));
+        }
+
+        KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+
+        if (IsochRingSlotSent(&Ring->State, index, status, &halted)) {
+
+            KeReleaseSpinLock(&Ring->Lock, oldIrql);
+
+            WdfRequestCancelSentRequest(slot);
+
+            KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+        }
+    }
+
+    retired = IsochRingStopSending(&Ring->State);
+
+    KeReleaseSpinLock(&Ring->Lock, oldIrql);
+
+    if (halted) {
+        UsbSamp_DbgPrint(1, ("Isoch ring halted\n"));
+        WdfIoQueuePurge(Ring->PendingQueue, WDF_NO_EVENT_CALLBACK, WDF_NO_CONTEXT);
+    }
+
+    //
+    // The ring may be freed as soon as the last slot is retired.
+    //
+    if (retired != 0 && InterlockedAdd(&Ring->SlotsOutstanding, -retired) == 0) {
+        KeSetEvent(&Ring->SlotsIdle, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+BOOLEAN
+QueueRequestToIsochRing(
+    _In_ WDFUSBPIPE Pipe,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG      Length,
+    _In_ BOOLEAN    Read
+    )
+/*++
+
+Routine Description:
+
+    This routine serves a read or write from the isoch ring of the pipe,
+    if the pipe is streaming. A read returns as soon as there is data,
+    with as much as there is; a write returns once all of it has been
+    copied to the ring.
+
+Arguments:
+
+    Pipe - The isoch pipe
+    Request - Read or write request
+    Length - Length of the request
+    Read - TRUE for a read
+
+Return Value:
+
+    FALSE if the pipe is not streaming and the request was not touched.
+
+--*/
+{
+    NTSTATUS        status;
+    PPIPE_CONTEXT   pipeContext;
+    PISOCH_RING     ring;
+
+    pipeContext = GetPipeContext(Pipe);
+
+    if (!ExAcquireRundownProtection(&pipeContext->IsochRingRundown)) {
+
+        //
+        // The stream is being stopped.
+        //
+        WdfRequestCompleteWithInformation(Request, STATUS_INVALID_DEVICE_STATE, 0);
+        return TRUE;
+    }
+
+    ring = pipeContext->IsochRing;
+
+    if (ring == NULL) {
+        ExReleaseRundownProtection(&pipeContext->IsochRingRundown);
+        return FALSE;
+    }
+
+    if (ring->State.Halted || ring->State.Stopping) {
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (!Read && Length > ring->State.DataSize) {
+        UsbSamp_DbgPrint(1, ("Write of %d bytes is larger than the isoch ring\n", Length));
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else {
+        status = WdfRequestForwardToIoQueue(Request, ring->PendingQueue);
+    }
+
+    if (NT_SUCCESS(status)) {
+        ServiceIsochRing(ring);
+    }
+    else {
+        WdfRequestCompleteWithInformation(Request, status, 0);
+    }
+
+    ExReleaseRundownProtection(&pipeContext->IsochRingRundown);
+
+    return TRUE;
+}
+
+VOID
+ServiceIsochRing(
+    _In_ PISOCH_RING Ring
+    )
+/*++
+
+Routine Description:
+
+    This routine completes the reads waiting for data, or the writes
+    waiting for space, in the order they were received, for as long as
+    the ring allows.
+
+Arguments:
+
+    Ring - The ring
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS        status;
+    WDFREQUEST      request;
+    PVOID           buffer;
+    size_t          length;
+    ULONG           information;
+    KIRQL           oldIrql;
+
+    for (;;) {
+
+        information = 0;
+
+        KeAcquireSpinLock(&Ring->Lock, &oldIrql);
+
+        if (!IsochRingCanService(&Ring->State)) {
+            KeReleaseSpinLock(&Ring->Lock, oldIrql);
+            break;
+        }
+
+        status = WdfIoQueueRetrieveNextRequest(Ring->PendingQueue, &request);
+        if (!NT_SUCCESS(status)) {
+            KeReleaseSpinLock(&Ring->Lock, oldIrql);
+            break;
+        }
+
+        if (Ring->State.Read) {
+            status = WdfRequestRetrieveOutputBuffer(request, 1, &buffer, &length);
+        }
+        else {
+            status = WdfRequestRetrieveInputBuffer(request, 1, &buffer, &length);
+        }
+
+        if (NT_SUCCESS(status) &&
+            !IsochRingServiceRequest(&Ring->State, buffer, (ULONG)length, &information)) {
+
+            //
+            // Put it back at the head of the queue so that the writes stay
+            // in order.
+            //
+            status = WdfRequestRequeue(request);
+            if (NT_SUCCESS(status)) {
+                KeReleaseSpinLock(&Ring->Lock, oldIrql);
+                break;
+            }
+        }
+
+        KeReleaseSpinLock(&Ring->Lock, oldIrql);
+
+        WdfRequestCompleteWithInformation(request, status, information);
+    }
+}
+
+NTSTATUS
+GetIsochRingStatistics(
+    _In_  WDFUSBPIPE                       Pipe,
+    _Out_ PUSBSAMP_ISOCH_STREAM_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the counters of the isoch ring of a pipe for the
+    interval since the previous call, and starts a new interval.
+
+Arguments:
+
+    Pipe - The isoch pipe
+    Statistics - Receives the counters
+
+Return Value:
+
+    STATUS_INVALID_DEVICE_STATE if the pipe is not streaming.
+
+--*/
+{
+    PPIPE_CONTEXT   pipeContext;
+    PISOCH_RING     ring;
+    ULONG           frameNumber;
+    KIRQL           oldIrql;
+
+    RtlZeroMemory(Statistics, sizeof(USBSAMP_ISOCH_STREAM_STATISTICS));
+
+    pipeContext = GetPipeContext(Pipe);
+
+    if (!ExAcquireRundownProtection(&pipeContext->IsochRingRundown)) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    ring = pipeContext->IsochRing;
+
+    if (ring == NULL) {
+        ExReleaseRundownProtection(&pipeContext->IsochRingRundown);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (!NT_SUCCESS(WdfUsbTargetDeviceRetrieveCurrentFrameNumber(ring->DeviceContext->WdfUsbTargetDevice,
+                                                                 &frameNumber))) {
+        frameNumber = ring->State.IntervalStartFrame;
+    }
+
+    KeAcquireSpinLock(&ring->Lock, &oldIrql);
+
+    IsochRingGetStatistics(&ring->State, frameNumber, Statistics);
+
+    KeReleaseSpinLock(&ring->Lock, oldIrql);
+
+    ExReleaseRundownProtection(&pipeContext->IsochRingRundown);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    pipeline.h
+
+Abstract:
+
+    The state of a pipelined bulk transfer and the routines of bulkrwr.c
+    that update it: which stage request is sent next and with which part of
+    the buffer, what happens when a stage completes or could not be sent,
+    when the transfer is stopped and which thread finishes it. They work on
+    the state alone; the caller holds the lock of the request and sends,
+    cancels and completes the requests. The user mode model in ..\test
+    builds this file as it is.
+
+Environment:
+
+    Kernel mode and user mode test
+
+--*/
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+typedef struct _PIPELINE_STATE {
+
+    ULONG             Length;         // remaining to send
+    ULONG             Numxfer;
+    ULONG_PTR         VirtualAddress; // va of the next stage
+    ULONG             StageLength;
+    ULONG             AllStages;      // bitmask of the stage requests of the pipe
+    ULONG             IdleStages;     // bitmask of stage requests not sent
+    BOOLEAN           Sending;        // a thread is sending stages
+    BOOLEAN           Stopped;        // a stage failed or it was cancelled
+    BOOLEAN           Finished;       // all stages are done
+    NTSTATUS          Status;
+
+} PIPELINE_STATE, *PPIPELINE_STATE;
+
+
+__inline
+VOID
+PipelineInitialize(
+    _Out_ PPIPELINE_STATE Pipeline,
+    _In_ ULONG_PTR        VirtualAddress,
+    _In_ ULONG            TotalLength,
+    _In_ ULONG            StageLength,
+    _In_ ULONG            NumberOfStages
+    )
+{
+    Pipeline->Length         = TotalLength;
+    Pipeline->Numxfer        = 0;
+    Pipeline->VirtualAddress = VirtualAddress;
+    Pipeline->StageLength    = StageLength;
+    Pipeline->AllStages      = (1 << NumberOfStages) - 1;
+    Pipeline->IdleStages     = Pipeline->AllStages;
+    Pipeline->Sending        = FALSE;
+    Pipeline->Stopped        = FALSE;
+    Pipeline->Finished       = FALSE;
+    Pipeline->Status         = STATUS_SUCCESS;
+}
+
+__inline
+BOOLEAN
+PipelineStartSending(
+    _Inout_ PPIPELINE_STATE Pipeline
+    )
+/*++
+
+Routine Description:
+
+    Only one thread sends at a time, so that stages are sent in order even
+    when several complete at once on different processors; a stage request
+    that becomes idle while another thread is sending is used by that
+    thread.
+
+Return Value:
+
+    TRUE if the caller is to send the stages, FALSE if another thread is.
+
+--*/
+{
+    if (Pipeline->Sending) {
+        return FALSE;
+    }
+
+    Pipeline->Sending = TRUE;
+
+    return TRUE;
+}
+
+__inline
+BOOLEAN
+PipelineTakeStage(
+    _Inout_ PPIPELINE_STATE Pipeline,
+    _Out_ PULONG          Index,
+    _Out_ PULONG_PTR      VirtualAddress,
+    _Out_ PULONG          StageLength
+    )
+/*++
+
+Routine Description:
+
+    Takes an idle stage request and the next part of the buffer, unless the
+    transfer is stopped or all of it has been sent.
+
+Return Value:
+
+    TRUE if the caller is to send the stage request Index.
+
+--*/
+{
+    ULONG length;
+
+    if (Pipeline->Stopped ||
+        Pipeline->Length == 0 ||
+        Pipeline->IdleStages == 0) {
+        return FALSE;
+    }
+
+    _BitScanForward(Index, Pipeline->IdleStages);
+    Pipeline->IdleStages &= ~(1 << *Index);
+
+    if (Pipeline->Length > Pipeline->StageLength) {
+        length = Pipeline->StageLength;
+    }
+    else {
+        length = Pipeline->Length;
+    }
+
+    *VirtualAddress = Pipeline->VirtualAddress;
+    *StageLength = length;
+
+    Pipeline->VirtualAddress += length;
+    Pipeline->Length -= length;
+
+    return TRUE;
+}
+
+__inline
+BOOLEAN
+PipelineStageSent(
+    _Inout_ PPIPELINE_STATE Pipeline,
+    _In_ ULONG            Index,
+    _In_ NTSTATUS         Status
+    )
+/*++
+
+Routine Description:
+
+    Accounts for a stage request the caller tried to send. The completion
+    routine is not called for a request that could not be sent, so it is
+    idle again and the transfer is stopped; stages already sent are left
+    to complete.
+
+Return Value:
+
+    TRUE if the stage was sent but the transfer was stopped meanwhile,
+    possibly before the stage could be cancelled with the others; the
+    caller cancels it. The transfer cannot finish while the caller is
+    sending, so the stage request is not used again in the meantime.
+
+--*/
+{
+    if (!NT_SUCCESS(Status)) {
+
+        Pipeline->IdleStages |= 1 << Index;
+
+        if (!Pipeline->Stopped) {
+            Pipeline->Stopped = TRUE;
+            Pipeline->Status = Status;
+        }
+
+        return FALSE;
+    }
+
+    return Pipeline->Stopped;
+}
+
+__inline
+BOOLEAN
+PipelineStopSending(
+    _Inout_ PPIPELINE_STATE Pipeline
+    )
+/*++
+
+Return Value:
+
+    TRUE if all stages are done and the caller is to finish the request.
+    Only one thread gets TRUE.
+
+--*/
+{
+    Pipeline->Sending = FALSE;
+
+    if (!Pipeline->Finished &&
+        Pipeline->IdleStages == Pipeline->AllStages &&
+        (Pipeline->Stopped || Pipeline->Length == 0)) {
+
+        Pipeline->Finished = TRUE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+__inline
+VOID
+PipelineStageDone(
+    _Inout_ PPIPELINE_STATE Pipeline,
+    _In_ ULONG            Index,
+    _In_ ULONG            TransferLength
+    )
+/*++
+
+Routine Description:
+
+    Accounts for a stage that completed. A stage that failed is accounted
+    for with PipelineStop and then PipelineStageIdle.
+
+--*/
+{
+    Pipeline->Numxfer += TransferLength;
+    Pipeline->IdleStages |= 1 << Index;
+}
+
+__inline
+VOID
+PipelineStageIdle(
+    _Inout_ PPIPELINE_STATE Pipeline,
+    _In_ ULONG            Index
+    )
+{
+    Pipeline->IdleStages |= 1 << Index;
+}
+
+__inline
+ULONG
+PipelineStop(
+    _Inout_ PPIPELINE_STATE Pipeline,
+    _In_ NTSTATUS         Status,
+    _In_ ULONG            ExcludedStages
+    )
+/*++
+
+Routine Description:
+
+    Stops the transfer: no more stages are sent, and the request completes
+    with Status once the stages in flight are done, unless it was already
+    stopped.
+
+Return Value:
+
+    Bitmask of the stage requests in flight other than ExcludedStages,
+    which the caller cancels. They are returned even if the transfer was
+    already stopped: a transfer stopped because a stage could not be sent
+    leaves the stages sent before it to complete, and if one of them fails
+    it may halt the endpoint with the others queued behind it.
+
+--*/
+{
+    if (Pipeline->Finished) {
+        return 0;
+    }
+
+    if (!Pipeline->Stopped) {
+        Pipeline->Stopped = TRUE;
+        Pipeline->Status = Status;
+    }
+
+    return ~Pipeline->IdleStages & Pipeline->AllStages & ~ExcludedStages;
+}
+
+//
+// A pipelined request holds a completion reference for the transfer and
+// one for its cancel routine; the last one released completes it. These
+// are taken and released without the lock of the request.
+//
+
+__inline
+BOOLEAN
+PipelineReference(
+    _Inout_ volatile LONG *References
+    )
+/*++
+
+Return Value:
+
+    TRUE if a reference was taken, FALSE if the request is completing.
+
+--*/
+{
+    LONG references;
+
+    do {
+        references = *References;
+
+        if (references == 0) {
+            return FALSE;
+        }
+
+    } while (InterlockedCompareExchange(References,
+                                        references + 1,
+                                        references) != references);
+
+    return TRUE;
+}
+
+__inline
+BOOLEAN
+PipelineRelease(
+    _Inout_ volatile LONG *References,
+    _In_ LONG             Count
+    )
+/*++
+
+Return Value:
+
+    TRUE if these were the last references and the caller is to complete
+    the request.
+
+--*/
+{
+    return InterlockedExchangeAdd(References, -Count) == Count;
+}
+
+#endif // _PIPELINE_H
@@ -39,6 +39,7 @@ Environment:
 #include <wdf.h>
 #include <wdfusb.h>
 #include "public.h"
+#include "pipeline.h"
 
 
 #ifndef _H
@@ -73,6 +74,32 @@ Environment:
 
 #define DEFAULT_REGISTRY_TRANSFER_SIZE 65536
 
+//
+// Number of stages of a bulk transfer kept in flight at once, by device
+// speed. A stage is at most GetMaxPacketSize bytes, so with a single
+// stage in flight the bus idles between stages.
+//
+// On a bulk pipe with streams every stage request is bound to a stream,
+// BULK_STREAM_QUEUE_DEPTH of them per stream, so that the stages of a
+// transfer are spread across the streams and the device can service
+// them in any order.
+//
+#define MAX_BULK_STAGES_IN_FLIGHT           16
+#define BULK_STREAM_QUEUE_DEPTH             2
+#define BULK_STAGES_IN_FLIGHT_SUPER_SPEED   8
+#define BULK_STAGES_IN_FLIGHT_HIGH_SPEED    4
+#define BULK_STAGES_IN_FLIGHT_FULL_SPEED    2
+
+//
+// Isoch streaming ring. ISOCH_RING_SLOTS transfers of
+// ISOCH_RING_FRAMES_PER_SLOT frames each are kept in flight, and up to
+// ISOCH_RING_BUFFERED_SLOTS transfers worth of data is buffered between
+// them and the reads or writes of the app.
+//
+#define ISOCH_RING_SLOTS            8
+#define ISOCH_RING_FRAMES_PER_SLOT  8
+#define ISOCH_RING_BUFFERED_SLOTS   32
+
 #define IDLE_CAPS_TYPE IdleUsbSelectiveSuspend
 
 
@@ -130,6 +157,8 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, GetFileContext)
 
 #if (NTDDI_VERSION >= NTDDI_WIN8)
 
+#include "streamstate.h"
+
 typedef struct _USBSAMP_STREAM_INFO {
 
     // Number of enabled streams on this pipe
@@ -138,10 +167,18 @@ typedef struct _USBSAMP_STREAM_INFO {
     // Array of stream information structures representing streams on this pipe
     PUSBD_STREAM_INFORMATION StreamList;
 
+    // Array of scheduling states, one per stream
+    PUSBSAMP_STREAM_STATE StreamState;
+
+    // Where the next search for the least busy stream starts
+    LONG NextStream;
+
 } USBSAMP_STREAM_INFO, *PUSBSAMP_STREAM_INFO;
 
 #endif
 
+typedef struct _ISOCH_RING *PISOCH_RING;
+
 //
 // This context is associated with every pipe handle. In this sample,
 // it used for isoch transfers.
@@ -160,6 +197,28 @@ typedef struct _PIPE_CONTEXT {
     USBSAMP_STREAM_INFO    StreamInfo;
 #endif
 
+    //
+    // Preallocated stage requests used to keep several stages of a bulk
+    // transfer in flight. Only one read or write at a time can use them;
+    // StagesInUse is set while it does.
+    //
+    ULONG       NumberOfStages;
+
+    LONG        StagesInUse;
+
+    WDFREQUEST  StageRequests[MAX_BULK_STAGES_IN_FLIGHT];
+
+    //
+    // Streaming ring of an isoch pipe, NULL unless the stream is started.
+    // Reads and writes hold the rundown protection while they use it.
+    // IsochRingLock is held while the stream is started or stopped.
+    //
+    PISOCH_RING     IsochRing;
+
+    EX_RUNDOWN_REF  IsochRingRundown;
+
+    WDFWAITLOCK     IsochRingLock;
+
 } PIPE_CONTEXT, *PPIPE_CONTEXT;
 
 
@@ -178,10 +237,77 @@ typedef struct _REQUEST_CONTEXT {
     ULONG             Numxfer;
     ULONG_PTR         VirtualAddress; // va for next segment of xfer.
     BOOLEAN           Read; // TRUE if Read
+    ULONG             StreamIndex;    // stream used on a pipe with streams
+
+    //
+    // The following are only used when the stages of the transfer are
+    // sent with the stage requests of the pipe.
+    //
+    BOOLEAN           Pipelined;
+    PIPELINE_STATE    Pipeline;       // protected by Lock
+    ULONG             UrbFlags;
+    LONG              CompletionReferences;
+    WDFUSBPIPE        Pipe;
+    KSPIN_LOCK        Lock;
 } REQUEST_CONTEXT, * PREQUEST_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, GetRequestContext)
 
+//
+// This context is associated with every stage request of a pipe.
+//
+typedef struct _STAGE_CONTEXT {
+
+    WDFMEMORY         UrbMemory;
+    PMDL              Mdl;            // partial mdl of the stage
+    ULONG             Index;          // in PIPE_CONTEXT.StageRequests
+    ULONG             StreamIndex;    // stream the stage is sent on, if any
+
+} STAGE_CONTEXT, *PSTAGE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(STAGE_CONTEXT, GetStageContext)
+
+#include "isochring.h"
+
+//
+// A streaming ring of an isoch pipe. The slots are requests with a
+// prebuilt isoch urb and their own buffer; each is resubmitted as soon as
+// it completes, scheduled right after the last one submitted. Data is
+// moved between the slots and the reads or writes of the app through a
+// circular buffer.
+//
+typedef struct _ISOCH_RING {
+
+    WDFUSBPIPE        Pipe;
+    WDFDEVICE         Device;
+    PDEVICE_CONTEXT   DeviceContext;
+    WDFFILEOBJECT     FileObject;     // handle that started the stream
+    WDFQUEUE          PendingQueue;   // reads or writes waiting for data or space
+    ISOCH_RING_STATE  State;          // protected by Lock
+    LONG              SlotsOutstanding;   // slots not retired, see SendIsochSlots
+    KEVENT            SlotsIdle;
+    KSPIN_LOCK        Lock;
+
+    WDFREQUEST        Slots[ISOCH_RING_SLOTS];
+
+} ISOCH_RING;
+
+//
+// This context is associated with every slot request of an isoch ring.
+//
+typedef struct _ISOCH_SLOT_CONTEXT {
+
+    WDFMEMORY         UrbMemory;
+    PUCHAR            Buffer;
+    PMDL              Mdl;
+    ULONG             StartFrame;
+    ULONG             Index;          // in ISOCH_RING.Slots
+    BOOLEAN           Sent;           // the first time, it is sent zeroed
+
+} ISOCH_SLOT_CONTEXT, *PISOCH_SLOT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ISOCH_SLOT_CONTEXT, GetIsochSlotContext)
+
 typedef struct _WORKITEM_CONTEXT {
     WDFDEVICE       Device;
     WDFUSBPIPE      Pipe;
@@ -202,13 +328,19 @@ EVT_WDF_OBJECT_CONTEXT_CLEANUP  UsbSamp_EvtPipeContextCleanup;
 #endif
 
 EVT_WDF_DEVICE_FILE_CREATE UsbSamp_EvtDeviceFileCreate;
+EVT_WDF_FILE_CLEANUP UsbSamp_EvtFileCleanup;
 
 EVT_WDF_IO_QUEUE_IO_READ UsbSamp_EvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE UsbSamp_EvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL UsbSamp_EvtIoDeviceControl;
 
 EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbSamp_EvtReadWriteCompletion;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbSamp_EvtStageCompletion;
+EVT_WDF_REQUEST_CANCEL UsbSamp_EvtPipelinedRequestCancel;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP UsbSamp_EvtStageContextCleanup;
 EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbSamp_EvtIsoRequestCompletionRoutine;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbSamp_EvtIsochSlotCompletion;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP UsbSamp_EvtIsochSlotContextCleanup;
 
 EVT_WDF_IO_QUEUE_IO_STOP UsbSamp_EvtIoStop;
 
@@ -238,6 +370,18 @@ ReadWriteBulkEndPoints(
     _In_ WDF_REQUEST_TYPE RequestType
     );
 
+NTSTATUS
+InitializeBulkPipeStages(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFUSBPIPE      Pipe
+    );
+
+VOID
+StopPipelinedRequest(
+    _In_ WDFREQUEST Request,
+    _In_ NTSTATUS   Status
+    );
+
 NTSTATUS
 ResetPipe(
     _In_ WDFUSBPIPE             Pipe
@@ -287,6 +431,59 @@ PerformIsochTransfer(
     _In_ ULONG            TotalLength
     );
 
+NTSTATUS
+GetIsochTransferLayout(
+    _In_  PDEVICE_CONTEXT DeviceContext,
+    _In_  PPIPE_CONTEXT   PipeContext,
+    _In_  ULONG           TotalLength,
+    _Out_ PULONG          NumberOfPackets,
+    _Out_ PULONG          NumberOfFrames,
+    _Out_ PULONG          PacketSize
+    );
+
+VOID
+InitializeIsochUrb(
+    _Inout_ PURB             Urb,
+    _In_    USBD_PIPE_HANDLE PipeHandle,
+    _In_    BOOLEAN          Read,
+    _In_    PMDL             Mdl,
+    _In_    ULONG            TotalLength,
+    _In_    ULONG            NumberOfPackets,
+    _In_    ULONG            PacketSize
+    );
+
+NTSTATUS
+InitializeIsochRing(
+    _In_ WDFUSBPIPE    Pipe
+    );
+
+NTSTATUS
+StartIsochRing(
+    _In_ WDFDEVICE     Device,
+    _In_ WDFFILEOBJECT FileObject,
+    _In_ WDFUSBPIPE    Pipe
+    );
+
+NTSTATUS
+StopIsochRing(
+    _In_ WDFUSBPIPE    Pipe,
+    _In_ WDFFILEOBJECT FileObject
+    );
+
+NTSTATUS
+GetIsochRingStatistics(
+    _In_  WDFUSBPIPE                       Pipe,
+    _Out_ PUSBSAMP_ISOCH_STREAM_STATISTICS Statistics
+    );
+
+BOOLEAN
+QueueRequestToIsochRing(
+    _In_ WDFUSBPIPE Pipe,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG      Length,
+    _In_ BOOLEAN    Read
+    );
+
 VOID
 DbgPrintRWContext(
     PREQUEST_CONTEXT                 rwContext
@@ -364,13 +561,47 @@ InitializePipeContextForSuperSpeedBulkPipe(
 
 USBD_PIPE_HANDLE
 GetStreamPipeHandleFromBulkPipe(
-    _In_ WDFUSBPIPE Pipe
+    _In_ WDFUSBPIPE Pipe,
+    _In_ ULONG      StreamIndex
     );
 
 VOID
 ConfigureStreamPipeHandleForRequest(
     _In_ WDFREQUEST       Request,
-    _In_ WDFUSBPIPE       Pipe
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ ULONG            StreamIndex
+    );
+
+ULONG
+SelectStreamForTransfer(
+    _In_ WDFUSBPIPE Pipe
+    );
+
+VOID
+StartStreamTransfer(
+    _In_ WDFUSBPIPE Pipe,
+    _In_ ULONG      StreamIndex
+    );
+
+VOID
+EndStreamTransfer(
+    _In_ WDFUSBPIPE Pipe,
+    _In_ ULONG      StreamIndex,
+    _In_ ULONG      BytesTransferred
+    );
+
+NTSTATUS
+GetStreamStatistics(
+    _In_ WDFUSBPIPE Pipe,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesReturned)
+         PUSBSAMP_STREAM_STATISTICS Statistics,
+    _In_ size_t     OutputBufferLength,
+    _Out_ PULONG    BytesReturned
+    );
+
+VOID
+FreeStreamInfo(
+    _Inout_ PUSBSAMP_STREAM_INFO StreamInfo
     );
 
 #endif
@@ -46,4 +46,101 @@ DEFINE_GUID(GUID_CLASS_USBSAMP_USB,
                                                      METHOD_BUFFERED,         \
                                                      FILE_ANY_ACCESS)
 
+//
+// Isoch streaming. Sent on a handle opened to an isoch pipe. While the
+// stream is started the driver keeps a ring of transfers in flight on the
+// pipe, and reads or writes on the pipe copy data out of or into it
+// instead of being sent to the device one by one. The stream is stopped
+// when the handle that started it is closed.
+//
+#define IOCTL_USBSAMP_START_ISOCH_STREAM    CTL_CODE(FILE_DEVICE_UNKNOWN,     \
+                                                     IOCTL_INDEX + 3, \
+                                                     METHOD_BUFFERED,         \
+                                                     FILE_ANY_ACCESS)
+
+#define IOCTL_USBSAMP_STOP_ISOCH_STREAM     CTL_CODE(FILE_DEVICE_UNKNOWN,     \
+                                                     IOCTL_INDEX + 4, \
+                                                     METHOD_BUFFERED,         \
+                                                     FILE_ANY_ACCESS)
+
+//
+// Returns a USBSAMP_ISOCH_STREAM_STATISTICS structure. The counters cover
+// the interval since the previous query, or since the stream started.
+//
+#define IOCTL_USBSAMP_GET_ISOCH_STREAM_STATISTICS                             \
+                                            CTL_CODE(FILE_DEVICE_UNKNOWN,     \
+                                                     IOCTL_INDEX + 5, \
+                                                     METHOD_BUFFERED,         \
+                                                     FILE_ANY_ACCESS)
+
+typedef struct _USBSAMP_ISOCH_STREAM_STATISTICS {
+
+    ULONG IntervalFrames;           // length of the interval in frames (ms)
+
+    ULONG TransfersCompleted;
+
+    ULONG PacketsTransferred;
+
+    ULONG PacketsLost;              // packets that completed with an error
+
+    //
+    // Transfers that could not be scheduled right after the previous one
+    // because its start frame had already passed, leaving a gap.
+    //
+    ULONG LateSubmissions;
+
+    //
+    // Frames between the end of a transfer and its completion reaching
+    // the driver.
+    //
+    ULONG TotalCompletionLatency;
+
+    ULONG MaxCompletionLatency;
+
+    //
+    // Bytes read from the device that were dropped because the reads did
+    // not keep up, or bytes of zeroes sent to the device because the
+    // writes did not keep up.
+    //
+    ULONG OverrunBytes;
+
+    ULONG UnderrunBytes;
+
+    ULONG BufferedBytes;            // waiting in the driver at the query
+
+} USBSAMP_ISOCH_STREAM_STATISTICS, *PUSBSAMP_ISOCH_STREAM_STATISTICS;
+
+//
+// Returns a USBSAMP_STREAM_STATISTICS structure with the utilization of
+// every stream of a SuperSpeed bulk pipe. Sent on a handle opened to the
+// pipe. If the output buffer is too small for all the streams, as many
+// as fit are returned.
+//
+#define IOCTL_USBSAMP_GET_STREAM_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN,     \
+                                                     IOCTL_INDEX + 6, \
+                                                     METHOD_BUFFERED,         \
+                                                     FILE_ANY_ACCESS)
+
+typedef struct _USBSAMP_STREAM_COUNTERS {
+
+    ULONGLONG Transfers;            // transfers or stages sent on the stream
+
+    ULONGLONG BytesTransferred;
+
+    ULONG Outstanding;              // in flight at the query
+
+    ULONG PeakOutstanding;
+
+} USBSAMP_STREAM_COUNTERS, *PUSBSAMP_STREAM_COUNTERS;
+
+typedef struct _USBSAMP_STREAM_STATISTICS {
+
+    ULONG NumberOfStreams;
+
+    ULONG QueueDepth;               // stages of one transfer per stream
+
+    USBSAMP_STREAM_COUNTERS Streams[1];
+
+} USBSAMP_STREAM_STATISTICS, *PUSBSAMP_STREAM_STATISTICS;
+
 #endif
@@ -26,6 +26,7 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, UsbSamp_EvtDeviceFileCreate)
+#pragma alloc_text(PAGE, UsbSamp_EvtFileCleanup)
 #pragma alloc_text(PAGE, UsbSamp_EvtIoDeviceControl)
 #pragma alloc_text(PAGE, UsbSamp_EvtIoRead)
 #pragma alloc_text(PAGE, UsbSamp_EvtIoWrite)
@@ -114,6 +115,41 @@ Return Value:
     return;
 }
 
+VOID
+UsbSamp_EvtFileCleanup(
+    _In_ WDFFILEOBJECT FileObject
+    )
+/*++
+
+Routine Description:
+
+    The framework calls this when the last handle to a file object is
+    closed. If the handle started streaming on its pipe, the stream is
+    stopped.
+
+Arguments:
+
+    FileObject - Pointer to fileobject that represents the open handle.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+    PFILE_CONTEXT               pFileContext;
+
+    PAGED_CODE();
+
+    pFileContext = GetFileContext(FileObject);
+
+    if (pFileContext->Pipe != NULL) {
+        (VOID) StopIsochRing(pFileContext->Pipe, FileObject);
+    }
+
+    return;
+}
+
 VOID
 UsbSamp_EvtIoDeviceControl(
     _In_ WDFQUEUE   Queue,
@@ -155,6 +191,7 @@ Return Value:
     PDEVICE_CONTEXT    pDevContext;
     PFILE_CONTEXT      pFileContext;
     ULONG              length = 0;
+    PUSBSAMP_ISOCH_STREAM_STATISTICS pStatistics;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
@@ -220,6 +257,69 @@ Return Value:
         status = ResetDevice(device);
         break;
 
+    case IOCTL_USBSAMP_START_ISOCH_STREAM:
+    case IOCTL_USBSAMP_STOP_ISOCH_STREAM:
+    case IOCTL_USBSAMP_GET_ISOCH_STREAM_STATISTICS:
+
+        pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+
+        if (pFileContext->Pipe == NULL) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        if (IoControlCode == IOCTL_USBSAMP_START_ISOCH_STREAM) {
+            status = StartIsochRing(device, WdfRequestGetFileObject(Request), pFileContext->Pipe);
+            break;
+        }
+
+        if (IoControlCode == IOCTL_USBSAMP_STOP_ISOCH_STREAM) {
+            status = StopIsochRing(pFileContext->Pipe, WdfRequestGetFileObject(Request));
+            break;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+                                                sizeof(USBSAMP_ISOCH_STREAM_STATISTICS),
+                                                &pStatistics,
+                                                NULL);
+        if (!NT_SUCCESS(status)){
+            UsbSamp_DbgPrint(1, ("WdfRequestRetrieveOutputBuffer failed\n"));
+            break;
+        }
+
+        status = GetIsochRingStatistics(pFileContext->Pipe, pStatistics);
+        if (NT_SUCCESS(status)) {
+            length = sizeof(USBSAMP_ISOCH_STREAM_STATISTICS);
+        }
+
+        break;
+
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    case IOCTL_USBSAMP_GET_STREAM_STATISTICS:
+
+        pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+
+        if (pFileContext->Pipe == NULL) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+                                                FIELD_OFFSET(USBSAMP_STREAM_STATISTICS, Streams),
+                                                &ioBuffer,
+                                                &bufLength);
+        if (!NT_SUCCESS(status)){
+            UsbSamp_DbgPrint(1, ("WdfRequestRetrieveOutputBuffer failed\n"));
+            break;
+        }
+
+        status = GetStreamStatistics(pFileContext->Pipe,
+                                     (PUSBSAMP_STREAM_STATISTICS)ioBuffer,
+                                     bufLength,
+                                     &length);
+        break;
+#endif
+
     default :
         status = STATUS_INVALID_DEVICE_REQUEST;
         break;
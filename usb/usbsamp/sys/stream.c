@@ -143,6 +143,8 @@ Return Value:
 
     pStreamInfo->NumberOfStreams = 0;
     pStreamInfo->StreamList = NULL;
+    pStreamInfo->StreamState = NULL;
+    pStreamInfo->NextStream = 0;
 
     pipeContext->StreamConfigured = FALSE;
 
@@ -209,6 +211,16 @@ Return Value:
         goto End;
     }
 
+    pStreamInfo->StreamState = ExAllocatePool2(
+                                    POOL_FLAG_NON_PAGED,
+                                    supportedStreams * sizeof(USBSAMP_STREAM_STATE),
+                                    POOL_TAG);
+
+    if (pStreamInfo->StreamState == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto End;
+    }
+
     for(i = 0; i < supportedStreams; i++)
     {
         pStreamInfo->StreamList[i].StreamID = i + 1;
@@ -247,12 +259,7 @@ End:
     if (!NT_SUCCESS(status)) {
 
         pipeContext->StreamConfigured = FALSE;
-        pStreamInfo->NumberOfStreams = 0;
-
-        if (pStreamInfo->StreamList != NULL) {
-            ExFreePool(pStreamInfo->StreamList);
-            pStreamInfo->StreamList = NULL;
-        }
+        FreeStreamInfo(pStreamInfo);
 
     }
 
@@ -264,9 +271,43 @@ End:
 }
 
 
+VOID
+FreeStreamInfo(
+    _Inout_ PUSBSAMP_STREAM_INFO    StreamInfo
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the stream list and scheduling state of a pipe.
+
+Arguments:
+
+    StreamInfo - Streams of the pipe
+
+Return Value:
+
+    None
+
+--*/
+{
+    StreamInfo->NumberOfStreams = 0;
+
+    if (StreamInfo->StreamList != NULL) {
+        ExFreePool(StreamInfo->StreamList);
+        StreamInfo->StreamList = NULL;
+    }
+
+    if (StreamInfo->StreamState != NULL) {
+        ExFreePool(StreamInfo->StreamState);
+        StreamInfo->StreamState = NULL;
+    }
+}
+
 USBD_PIPE_HANDLE
 GetStreamPipeHandleFromBulkPipe(
-    _In_ WDFUSBPIPE                 Pipe
+    _In_ WDFUSBPIPE                 Pipe,
+    _In_ ULONG                      StreamIndex
     )
 /*++
 
@@ -278,6 +319,8 @@ Arguments:
 
     Pipe - Bulk Pipe
 
+    StreamIndex - Index of the stream in the stream list of the pipe
+
 Return Value:
 
     A stream's USBD_PIPE_HANDLE
@@ -288,7 +331,6 @@ Return Value:
 
     PUSBSAMP_STREAM_INFO        pStreamInfo;
     USBD_PIPE_HANDLE            streamPipeHandle;
-    ULONG                       index;
 
     pipeContext = GetPipeContext(Pipe);
 
@@ -300,19 +342,14 @@ Return Value:
 
     pStreamInfo = &pipeContext->StreamInfo;
 
-    if (pStreamInfo->NumberOfStreams == 0 ||
+    if (StreamIndex >= pStreamInfo->NumberOfStreams ||
         pStreamInfo->StreamList == NULL)
     {
          streamPipeHandle = NULL;
          goto End;
     }
 
-    //
-    // Specify one associate stream's PipeHandle as the super speed bulk endpoint's PipeHandle
-    //
-    index = 1;
-
-    streamPipeHandle = pStreamInfo->StreamList[index].PipeHandle;
+    streamPipeHandle = pStreamInfo->StreamList[StreamIndex].PipeHandle;
 
 End:
     return streamPipeHandle;
@@ -322,7 +359,8 @@ End:
 VOID
 ConfigureStreamPipeHandleForRequest(
     _In_ WDFREQUEST       Request,
-    _In_ WDFUSBPIPE       Pipe
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ ULONG            StreamIndex
     )
 /*++
 
@@ -337,6 +375,8 @@ Arguments:
 
     Pipe - Bulk Pipe
 
+    StreamIndex - Index of the stream to use
+
 Return Value:
 
     NULL
@@ -364,8 +404,165 @@ Return Value:
     // its associated stream's PipeHandle .
     //
     urb = irpSp->Parameters.Others.Argument1;
-    urb->UrbBulkOrInterruptTransfer.PipeHandle = GetStreamPipeHandleFromBulkPipe(Pipe);
+    urb->UrbBulkOrInterruptTransfer.PipeHandle = GetStreamPipeHandleFromBulkPipe(Pipe, StreamIndex);
+
+}
+
+ULONG
+SelectStreamForTransfer(
+    _In_ WDFUSBPIPE       Pipe
+    )
+/*++
+
+Routine Description:
+
+    This routine picks the stream with the fewest transfers in flight for
+    a new transfer on a super speed bulk pipe with streams. The search
+    starts after the stream picked last time, so that streams that are
+    equally busy are used in turn. The caller accounts for the transfer
+    with StartStreamTransfer.
+
+Arguments:
+
+    Pipe - Bulk Pipe with streams
+
+Return Value:
+
+    Index of the stream
+
+--*/
+{
+    PUSBSAMP_STREAM_INFO        pStreamInfo;
+
+    pStreamInfo = &GetPipeContext(Pipe)->StreamInfo;
+
+    return StreamStateSelect(pStreamInfo->StreamState,
+                             pStreamInfo->NumberOfStreams,
+                             &pStreamInfo->NextStream);
+}
+
+VOID
+StartStreamTransfer(
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ ULONG            StreamIndex
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a transfer, or a stage of one, being sent on
+    a stream.
+
+Arguments:
+
+    Pipe - Bulk Pipe with streams
+
+    StreamIndex - Index of the stream
+
+Return Value:
+
+    None
+
+--*/
+{
+    StreamStateStart(&GetPipeContext(Pipe)->StreamInfo.StreamState[StreamIndex]);
+}
+
+VOID
+EndStreamTransfer(
+    _In_ WDFUSBPIPE       Pipe,
+    _In_ ULONG            StreamIndex,
+    _In_ ULONG            BytesTransferred
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a transfer, or a stage of one, sent on a
+    stream being done.
+
+Arguments:
+
+    Pipe - Bulk Pipe with streams
+
+    StreamIndex - Index of the stream
+
+    BytesTransferred - Bytes the transfer moved
+
+Return Value:
+
+    None
+
+--*/
+{
+    StreamStateEnd(&GetPipeContext(Pipe)->StreamInfo.StreamState[StreamIndex],
+                   BytesTransferred);
+}
+
+NTSTATUS
+GetStreamStatistics(
+    _In_ WDFUSBPIPE       Pipe,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesReturned)
+         PUSBSAMP_STREAM_STATISTICS Statistics,
+    _In_ size_t           OutputBufferLength,
+    _Out_ PULONG          BytesReturned
+    )
+/*++
+
+Routine Description:
+
+    This routine returns the utilization counters of the streams of a
+    super speed bulk pipe, as many as fit in the output buffer.
+
+Arguments:
+
+    Pipe - Bulk Pipe
+
+    Statistics - Output buffer
+
+    OutputBufferLength - Length of the output buffer, at least
+                         FIELD_OFFSET(USBSAMP_STREAM_STATISTICS, Streams)
+
+    BytesReturned - Receives the number of bytes returned
+
+Return Value:
+
+    STATUS_INVALID_DEVICE_REQUEST if the pipe has no streams
+
+--*/
+{
+    PPIPE_CONTEXT               pipeContext;
+    PUSBSAMP_STREAM_INFO        pStreamInfo;
+    ULONG                       count;
+    ULONG                       i;
+
+    *BytesReturned = 0;
+
+    pipeContext = GetPipeContext(Pipe);
+    pStreamInfo = &pipeContext->StreamInfo;
+
+    if (pipeContext->StreamConfigured == FALSE) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    count = (ULONG)((OutputBufferLength - FIELD_OFFSET(USBSAMP_STREAM_STATISTICS, Streams)) /
+                    sizeof(USBSAMP_STREAM_COUNTERS));
+
+    if (count > pStreamInfo->NumberOfStreams) {
+        count = pStreamInfo->NumberOfStreams;
+    }
+
+    Statistics->NumberOfStreams = pStreamInfo->NumberOfStreams;
+    Statistics->QueueDepth = BULK_STREAM_QUEUE_DEPTH;
+
+    for (i = 0; i < count; i++) {
+        StreamStateQuery(&pStreamInfo->StreamState[i], &Statistics->Streams[i]);
+    }
+
+    *BytesReturned = FIELD_OFFSET(USBSAMP_STREAM_STATISTICS, Streams) +
+                     count * sizeof(USBSAMP_STREAM_COUNTERS);
 
+    return STATUS_SUCCESS;
 }
 
 
@@ -0,0 +1,195 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    streamstate.h
+
+Abstract:
+
+    The scheduling state and utilization counters of the streams of a
+    super speed bulk pipe, and the routines of stream.c that pick a stream
+    for a transfer and update and read the counters. They take no lock and
+    use interlocked operations only, so the user mode model in ..\test
+    builds this file as it is.
+
+Environment:
+
+    Kernel mode and user mode test
+
+--*/
+
+#ifndef _STREAMSTATE_H
+#define _STREAMSTATE_H
+
+//
+// Scheduling state and utilization counters of a stream. Updated with
+// interlocked operations.
+//
+typedef struct _USBSAMP_STREAM_STATE {
+
+    // Transfers or stages currently sent on the stream
+    LONG Outstanding;
+
+    LONG PeakOutstanding;
+
+    LONG64 Transfers;
+
+    LONG64 BytesTransferred;
+
+} USBSAMP_STREAM_STATE, *PUSBSAMP_STREAM_STATE;
+
+
+__inline
+ULONG
+StreamStateSelect(
+    _In_reads_(NumberOfStreams) PUSBSAMP_STREAM_STATE StreamState,
+    _In_ ULONG            NumberOfStreams,
+    _Inout_ volatile LONG *NextStream
+    )
+/*++
+
+Routine Description:
+
+    This routine picks the stream with the fewest transfers in flight. The
+    search starts after the stream picked last time, so that streams that
+    are equally busy are used in turn.
+
+Arguments:
+
+    StreamState - The states of the streams of the pipe
+
+    NumberOfStreams - Number of streams of the pipe
+
+    NextStream - Where the next search starts
+
+Return Value:
+
+    Index of the stream
+
+--*/
+{
+    ULONG                       start;
+    ULONG                       index;
+    ULONG                       best;
+    LONG                        outstanding;
+    LONG                        fewest;
+    ULONG                       i;
+
+    start = (ULONG)InterlockedIncrement(NextStream) % NumberOfStreams;
+    best = start;
+    fewest = MAXLONG;
+
+    for (i = 0; i < NumberOfStreams; i++) {
+
+        index = (start + i) % NumberOfStreams;
+        outstanding = ReadNoFence(&StreamState[index].Outstanding);
+
+        if (outstanding < fewest) {
+            fewest = outstanding;
+            best = index;
+
+            if (outstanding == 0) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+__inline
+VOID
+StreamStateStart(
+    _Inout_ PUSBSAMP_STREAM_STATE StreamState
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a transfer, or a stage of one, being sent on
+    a stream. It is counted before it is outstanding, and the peak is
+    raised after, which StreamStateQuery relies on.
+
+--*/
+{
+    LONG                        outstanding;
+    LONG                        peak;
+
+    InterlockedIncrement64(&StreamState->Transfers);
+    outstanding = InterlockedIncrement(&StreamState->Outstanding);
+
+    peak = ReadNoFence(&StreamState->PeakOutstanding);
+
+    while (outstanding > peak) {
+
+        if (InterlockedCompareExchange(&StreamState->PeakOutstanding, outstanding, peak) == peak) {
+            break;
+        }
+
+        peak = ReadNoFence(&StreamState->PeakOutstanding);
+    }
+}
+
+__inline
+VOID
+StreamStateEnd(
+    _Inout_ PUSBSAMP_STREAM_STATE StreamState,
+    _In_ ULONG            BytesTransferred
+    )
+/*++
+
+Routine Description:
+
+    This routine accounts for a transfer, or a stage of one, sent on a
+    stream being done.
+
+--*/
+{
+    InterlockedAdd64(&StreamState->BytesTransferred, BytesTransferred);
+    InterlockedDecrement(&StreamState->Outstanding);
+}
+
+__inline
+VOID
+StreamStateQuery(
+    _In_ PUSBSAMP_STREAM_STATE StreamState,
+    _Out_ PUSBSAMP_STREAM_COUNTERS Counters
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the counters of a stream while transfers may start
+    or end on it.
+
+--*/
+{
+    LONG                        outstanding;
+    LONG                        peak;
+
+    //
+    // The completion paths update the counters with interlocked
+    // operations and no lock, so they are read the same way: whole on
+    // 32-bit systems and in order. StreamStateStart counts a transfer
+    // before it is outstanding and raises the peak after, so reading
+    // Outstanding first never shows more transfers outstanding than were
+    // sent, nor more than the peak.
+    //
+    outstanding = InterlockedCompareExchange(&StreamState->Outstanding, 0, 0);
+    peak = InterlockedCompareExchange(&StreamState->PeakOutstanding, 0, 0);
+
+    Counters->Outstanding = (ULONG)outstanding;
+    Counters->PeakOutstanding = (ULONG)max(peak, outstanding);
+    Counters->Transfers = (ULONGLONG)InterlockedCompareExchange64(&StreamState->Transfers, 0, 0);
+    Counters->BytesTransferred =
+        (ULONGLONG)InterlockedCompareExchange64(&StreamState->BytesTransferred, 0, 0);
+}
+
+#endif // _STREAMSTATE_H
@@ -0,0 +1,1131 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    bulkmodel.c
+
+Abstract:
+
+    This file tests the pipelined bulk transfers of usbsamp in user mode.
+
+    The routines of bulkrwr.c that send the stages of a pipelined transfer,
+    account for their completion, stop the transfer and complete the
+    request are reproduced here around the state of the transfer and the
+    routines that update it, which this test builds from pipeline.h as the
+    driver does. The framework, the USB stack and the device are replaced
+    by a discrete event model of a bulk endpoint: the stages sent are transferred in order, one at a time,
+    at the rate of the bus, and their completion is reported at the next
+    frame or microframe boundary plus a DPC latency.
+
+    On random transfers the model injects stages that fail on the bus and
+    halt the endpoint, stages that cannot be sent, stages the USB stack
+    completes inline, cancellation of the request, with the cancel routine
+    running before or after the transfer finishes, and EvtIoStop; and
+    wherever the driver releases the lock of the request, it may run an
+    event that is due, as another processor would. It checks
+    that every request is completed exactly once, with no stage in flight
+    and the stage requests released; that the device receives the stages
+    in the order of their offsets; that a successful transfer reports all
+    its bytes; and that a failed one reports no bytes and the status of
+    the first failure the driver saw. A stage completing after its request
+    is a failure, and so is a request left pending.
+
+    It then prints the throughput the model gives a transfer at full, high
+    and SuperSpeed with one stage in flight, as when the stages are sent
+    one at a time, and with more.
+
+    Usage: bulkmodel [Transfers]
+
+Environment:
+
+    User mode
+
+--*/
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef LONG NTSTATUS;
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+// Checks made inside the model record the first failure, the test
+// reports it once the transfer is done.
+//
+
+#define MODEL_CHECK(_Assertion, _Message, ...) do { \
+        if (!(_Assertion) && (ModelError[0] == 0)) { \
+            _snprintf_s(ModelError, sizeof(ModelError), _TRUNCATE, _Message, __VA_ARGS__); \
+        }\
+    } while (0)
+
+#include "pipeline.h"
+
+#define MAX_BULK_STAGES_IN_FLIGHT   16  // as in private.h
+#define MAX_EVENTS                  (4 * MAX_BULK_STAGES_IN_FLIGHT + 8)
+
+#define DPC_LATENCY_NS              5000
+#define SUBMIT_NS                   2000
+#define BENCHMARK_LENGTH            (256 * 1024)
+
+//
+// A bulk endpoint at each speed: the stage length is GetMaxPacketSize
+// (stream.c) and the stages in flight are those of InitializeBulkPipeStages
+// (bulkrwr.c). The bus rate and per-transfer overhead are those the model
+// assumes; completions are reported at the next service interval, 0 for
+// an xHCI interrupt per transfer.
+//
+
+typedef struct _SPEED {
+    PCSTR Name;
+    ULONG MaxPacketSize;
+    ULONG StagesInFlight;
+    ULONG PicosecondsPerByte;
+    ULONG OverheadNs;
+    ULONG ServiceIntervalNs;
+} SPEED, *PSPEED;
+
+static SPEED Speeds[] = {
+    { "Full",  64,   2, 833000, 2000, 1000000 },
+    { "High",  512,  4, 25000,  1000, 125000 },
+    { "Super", 1024, 8, 2500,   500,  0 },
+};
+
+struct _REQUEST;
+
+//
+// A stage request of the pipe, with the fields of STAGE_CONTEXT and of
+// its URB the driver uses, and the state the model keeps for it.
+//
+
+typedef struct _STAGE_REQUEST {
+    ULONG Index;
+    ULONG_PTR TransferBuffer;
+    ULONG TransferBufferLength;
+    struct _REQUEST *Context;
+    BOOLEAN Sent;
+    BOOLEAN CompletionQueued;
+    ULONG Generation;
+    NTSTATUS Status;
+} STAGE_REQUEST, *PSTAGE_REQUEST;
+
+typedef struct _PIPE {
+    ULONG NumberOfStages;
+    LONG StagesInUse;
+    STAGE_REQUEST StageRequests[MAX_BULK_STAGES_IN_FLIGHT];
+
+    //
+    // The endpoint: the stages sent and not yet transferred, in order, the
+    // one the bus is transferring, and the bytes the device has received.
+    //
+    PSPEED Speed;
+    ULONG Queue[MAX_BULK_STAGES_IN_FLIGHT];
+    ULONG QueueLength;
+    BOOLEAN BusBusy;
+    BOOLEAN Halted;
+    BOOLEAN ResetQueued;
+    ULONG_PTR DeviceOffset;
+} PIPE, *PPIPE;
+
+//
+// The fields of REQUEST_CONTEXT a pipelined transfer uses, and the state
+// of the request in the framework.
+//
+
+typedef struct _REQUEST {
+    PIPELINE_STATE Pipeline;
+    LONG CompletionReferences;
+    PPIPE Pipe;
+
+    ULONG TotalLength;
+    BOOLEAN Cancelable;
+    BOOLEAN CancelPending;
+    ULONG CancelRoutineCalls;
+    BOOLEAN Completed;
+    NTSTATUS CompletionStatus;
+    ULONG_PTR Information;
+    NTSTATUS FirstFault;
+} REQUEST, *PREQUEST;
+
+typedef enum _EVENT_TYPE {
+    EventBusDone,
+    EventStageCompletion,
+    EventCancelRequest,
+    EventCancelRoutine,
+    EventStop,
+} EVENT_TYPE;
+
+typedef struct _EVENT {
+    ULONGLONG Time;
+    ULONGLONG Sequence;
+    EVENT_TYPE Type;
+    ULONG Index;
+    ULONG Generation;
+    NTSTATUS Status;
+} EVENT, *PEVENT;
+
+//
+// The probabilities of the faults, in 1/65536, for the current transfer.
+// Preemption is that of another processor running an event that is due
+// while the driver does not hold the lock of the request.
+//
+
+typedef struct _FAULTS {
+    ULONG StageFailure;
+    ULONG SendFailure;
+    ULONG InlineCompletion;
+    ULONG MarkCancelableFailure;
+    ULONG Preemption;
+} FAULTS;
+
+static EVENT Events[MAX_EVENTS];
+static ULONG NumberOfEvents;
+static ULONGLONG EventSequence;
+static ULONGLONG Now;
+static FAULTS Faults;
+static PREQUEST CurrentRequest;
+static PPIPE CurrentPipe;
+static CHAR ModelError[256];
+
+static VOID SendPipelinedStages(_In_ PREQUEST Request);
+static VOID CompletePipelinedRequest(_In_ PREQUEST Request);
+static VOID Preempt(VOID);
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+static
+BOOLEAN
+Chance (
+    _In_ ULONG Probability
+    )
+{
+    return (Random32() & 0xFFFF) < Probability;
+}
+
+static
+VOID
+ScheduleEvent (
+    _In_ ULONGLONG Time,
+    _In_ EVENT_TYPE Type,
+    _In_ ULONG Index,
+    _In_ ULONG Generation,
+    _In_ NTSTATUS Status
+    )
+{
+    PEVENT event;
+
+    MODEL_CHECK(NumberOfEvents < MAX_EVENTS, "%s", "too many events");
+
+    if (NumberOfEvents == MAX_EVENTS) {
+        return;
+    }
+
+    event = &Events[NumberOfEvents++];
+    event->Time = Time;
+    event->Sequence = EventSequence++;
+    event->Type = Type;
+    event->Index = Index;
+    event->Generation = Generation;
+    event->Status = Status;
+}
+
+static
+BOOLEAN
+NextEvent (
+    _In_ ULONGLONG Limit,
+    _Out_ PEVENT Event
+    )
+{
+    ULONG i, next = 0;
+
+    if (NumberOfEvents == 0) {
+        return FALSE;
+    }
+
+    for (i = 1; i < NumberOfEvents; i++) {
+        if ((Events[i].Time < Events[next].Time) ||
+            ((Events[i].Time == Events[next].Time) && (Events[i].Sequence < Events[next].Sequence))) {
+            next = i;
+        }
+    }
+
+    if (Events[next].Time > Limit) {
+        return FALSE;
+    }
+
+    *Event = Events[next];
+    Events[next] = Events[--NumberOfEvents];
+
+    if (Event->Time > Now) {
+        Now = Event->Time;
+    }
+
+    return TRUE;
+}
+
+static
+VOID
+NoteFault (
+    _In_ PREQUEST Request,
+    _In_ NTSTATUS Status
+    )
+{
+    if (NT_SUCCESS(Request->FirstFault)) {
+        Request->FirstFault = Status;
+    }
+}
+
+//
+// The device receives the stages of a transfer in order until it is
+// stopped. Once it is, the stages in flight are cancelled one at a time
+// and those behind a cancelled one may still be transferred.
+//
+
+static
+VOID
+DeviceReceive (
+    _In_ PPIPE Pipe,
+    _In_ PSTAGE_REQUEST Stage
+    )
+{
+    if (!Stage->Context->Pipeline.Stopped) {
+        MODEL_CHECK(Stage->TransferBuffer == Pipe->DeviceOffset,
+                    "stage %lu at offset %lu reached the device at offset %lu",
+                    (unsigned long)Stage->Index, (unsigned long)Stage->TransferBuffer,
+                    (unsigned long)Pipe->DeviceOffset);
+    }
+
+    Pipe->DeviceOffset = Stage->TransferBuffer + Stage->TransferBufferLength;
+}
+
+//
+// The endpoint: transfer the stage at the head of the queue unless the
+// endpoint is halted.
+//
+
+static
+VOID
+StartBus (
+    _In_ PPIPE Pipe
+    )
+{
+    PSTAGE_REQUEST stage;
+
+    if (Pipe->BusBusy || Pipe->Halted || (Pipe->QueueLength == 0)) {
+        return;
+    }
+
+    stage = &Pipe->StageRequests[Pipe->Queue[0]];
+    Pipe->BusBusy = TRUE;
+
+    ScheduleEvent(Now + Pipe->Speed->OverheadNs +
+                      (ULONGLONG)stage->TransferBufferLength * Pipe->Speed->PicosecondsPerByte / 1000,
+                  EventBusDone,
+                  stage->Index,
+                  stage->Generation,
+                  STATUS_SUCCESS);
+}
+
+static
+VOID
+BusDone (
+    _In_ PPIPE Pipe,
+    _In_ PEVENT Event
+    )
+{
+    PSTAGE_REQUEST stage = &Pipe->StageRequests[Event->Index];
+    ULONGLONG time;
+    ULONG interval;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!Pipe->BusBusy || (Pipe->Queue[0] != Event->Index) || (stage->Generation != Event->Generation)) {
+        //
+        // The stage was cancelled while it was transferred.
+        //
+        return;
+    }
+
+    Pipe->BusBusy = FALSE;
+    Pipe->QueueLength--;
+    memmove(&Pipe->Queue[0], &Pipe->Queue[1], Pipe->QueueLength * sizeof(Pipe->Queue[0]));
+
+    if (Chance(Faults.StageFailure)) {
+        //
+        // A stall halts the endpoint until the pipe is reset, the stages
+        // queued behind this one stay pending until they are cancelled.
+        //
+        status = STATUS_UNSUCCESSFUL;
+        Pipe->Halted = TRUE;
+    }
+    else {
+        DeviceReceive(Pipe, stage);
+    }
+
+    stage->CompletionQueued = TRUE;
+
+    interval = Pipe->Speed->ServiceIntervalNs;
+    time = Now;
+
+    if (interval != 0) {
+        time = (time + interval - 1) / interval * interval;
+    }
+
+    ScheduleEvent(time + DPC_LATENCY_NS, EventStageCompletion, stage->Index, stage->Generation, status);
+
+    StartBus(Pipe);
+}
+
+//
+// The framework and the USB stack.
+//
+
+static
+NTSTATUS
+WdfRequestMarkCancelableEx (
+    _In_ PREQUEST Request
+    )
+{
+    if (Chance(Faults.MarkCancelableFailure)) {
+        NoteFault(Request, STATUS_CANCELLED);
+        return STATUS_CANCELLED;
+    }
+
+    Request->Cancelable = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+WdfRequestUnmarkCancelable (
+    _In_ PREQUEST Request
+    )
+{
+    if (Request->CancelPending) {
+        return STATUS_CANCELLED;
+    }
+
+    Request->Cancelable = FALSE;
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+WdfRequestComplete (
+    _In_ PREQUEST Request,
+    _In_ NTSTATUS Status,
+    _In_ ULONG_PTR Information
+    )
+{
+    ULONG i;
+
+    MODEL_CHECK(!Request->Completed, "%s", "request completed twice");
+    MODEL_CHECK(!Request->Cancelable, "%s", "request completed while cancelable");
+
+    for (i = 0; i < Request->Pipe->NumberOfStages; i++) {
+        MODEL_CHECK(!Request->Pipe->StageRequests[i].Sent,
+                    "request completed with stage %lu in flight", (unsigned long)i);
+    }
+
+    Request->Completed = TRUE;
+    Request->CompletionStatus = Status;
+    Request->Information = Information;
+}
+
+static
+VOID
+UsbSamp_EvtStageCompletion(
+    _In_ PSTAGE_REQUEST StageRequest,
+    _In_ NTSTATUS Status
+    );
+
+static
+VOID
+CompleteStage (
+    _In_ PSTAGE_REQUEST Stage,
+    _In_ NTSTATUS Status
+    )
+{
+    MODEL_CHECK(Stage->Sent, "stage %lu completed but not sent", (unsigned long)Stage->Index);
+    MODEL_CHECK(!Stage->Context->Completed, "stage %lu completed after its request", (unsigned long)Stage->Index);
+
+    Stage->Sent = FALSE;
+    Stage->CompletionQueued = FALSE;
+
+    if (!NT_SUCCESS(Status)) {
+        NoteFault(Stage->Context, Status);
+    }
+
+    UsbSamp_EvtStageCompletion(Stage, Status);
+}
+
+static
+NTSTATUS
+WdfRequestGetStatus (
+    _In_ PSTAGE_REQUEST Stage
+    )
+{
+    return Stage->Status;
+}
+
+static
+BOOLEAN
+WdfRequestSend (
+    _In_ PSTAGE_REQUEST Stage
+    )
+{
+    PPIPE pipe = Stage->Context->Pipe;
+
+    Now += SUBMIT_NS;
+
+    MODEL_CHECK(!Stage->Sent, "stage %lu sent twice", (unsigned long)Stage->Index);
+
+    Preempt();
+
+    if (Chance(Faults.SendFailure)) {
+        Stage->Status = STATUS_INSUFFICIENT_RESOURCES;
+        NoteFault(Stage->Context, Stage->Status);
+        return FALSE;
+    }
+
+    Stage->Sent = TRUE;
+    Stage->Generation++;
+    Stage->Status = STATUS_PENDING;
+
+    if (Chance(Faults.InlineCompletion)) {
+
+        //
+        // The stack completes the stage before WdfRequestSend returns:
+        // with an error, or, with nothing else queued, transferred.
+        //
+        if (pipe->Halted || pipe->BusBusy || (pipe->QueueLength != 0) || (Random32() % 2)) {
+            CompleteStage(Stage, STATUS_DEVICE_NOT_CONNECTED);
+        }
+        else {
+            DeviceReceive(pipe, Stage);
+            CompleteStage(Stage, STATUS_SUCCESS);
+        }
+
+        return TRUE;
+    }
+
+    pipe->Queue[pipe->QueueLength++] = Stage->Index;
+    StartBus(pipe);
+
+    return TRUE;
+}
+
+static
+VOID
+WdfRequestCancelSentRequest (
+    _In_ PSTAGE_REQUEST Stage
+    )
+{
+    PPIPE pipe;
+    ULONG i;
+
+    //
+    // A stage request taken by the sender but not sent yet is not
+    // cancelled; the sender cancels it once sent if the transfer was
+    // stopped meanwhile.
+    //
+    if (!Stage->Sent || Stage->CompletionQueued) {
+        return;
+    }
+
+    pipe = Stage->Context->Pipe;
+
+    for (i = 0; i < pipe->QueueLength; i++) {
+        if (pipe->Queue[i] == Stage->Index) {
+            break;
+        }
+    }
+
+    MODEL_CHECK(i < pipe->QueueLength, "stage %lu sent but not queued", (unsigned long)Stage->Index);
+
+    if (i == pipe->QueueLength) {
+        return;
+    }
+
+    if (i == 0) {
+        pipe->BusBusy = FALSE;
+    }
+
+    pipe->QueueLength--;
+    memmove(&pipe->Queue[i], &pipe->Queue[i + 1], (pipe->QueueLength - i) * sizeof(pipe->Queue[0]));
+
+    Stage->Generation++;
+    Stage->CompletionQueued = TRUE;
+
+    ScheduleEvent(Now + Random32() % 10000, EventStageCompletion, Stage->Index, Stage->Generation, STATUS_CANCELLED);
+
+    StartBus(pipe);
+}
+
+static
+VOID
+QueuePassiveLevelCallback (
+    _In_ PPIPE Pipe
+    )
+{
+    Pipe->ResetQueued = TRUE;
+}
+
+//
+// The pipelined transfer as in bulkrwr.c. The spin lock of the request is
+// not needed as the model runs on one thread; where the driver releases
+// it, Preempt may run a completion, the cancel routine or EvtIoStop.
+//
+
+static
+VOID
+PerformPipelinedBulkTransfer(
+    _In_ PREQUEST         Request,
+    _In_ ULONG_PTR        VirtualAddress,
+    _In_ ULONG            TotalLength,
+    _In_ ULONG            StageLength
+    )
+{
+    NTSTATUS                status;
+    PREQUEST                rwContext = Request;
+    PPIPE                   pipeContext = Request->Pipe;
+
+    rwContext->CompletionReferences = 2; // the transfer and the cancel routine
+
+    PipelineInitialize(&rwContext->Pipeline,
+                       VirtualAddress,
+                       TotalLength,
+                       StageLength,
+                       pipeContext->NumberOfStages);
+
+    status = WdfRequestMarkCancelableEx(Request);
+
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&pipeContext->StagesInUse, 0);
+        WdfRequestComplete(Request, status, 0);
+        return;
+    }
+
+    SendPipelinedStages(Request);
+}
+
+static
+VOID
+FinishPipelinedRequest(
+    _In_ PREQUEST         Request
+    );
+
+static
+VOID
+SendPipelinedStages(
+    _In_ PREQUEST         Request
+    )
+{
+    NTSTATUS                status;
+    PREQUEST                rwContext = Request;
+    PPIPE                   pipeContext = Request->Pipe;
+    PSTAGE_REQUEST          stageRequest;
+    ULONG                   index;
+    ULONG                   stageLength;
+    ULONG_PTR               virtualAddress;
+    BOOLEAN                 finish;
+
+    if (!PipelineStartSending(&rwContext->Pipeline)) {
+        return;
+    }
+
+    while (PipelineTakeStage(&rwContext->Pipeline, &index, &virtualAddress, &stageLength)) {
+
+        Preempt();
+
+        stageRequest = &pipeContext->StageRequests[index];
+        stageRequest->TransferBuffer = virtualAddress;
+        stageRequest->TransferBufferLength = stageLength;
+        stageRequest->Context = Request;
+
+        status = STATUS_SUCCESS;
+
+        if (!WdfRequestSend(stageRequest)) {
+            status = WdfRequestGetStatus(stageRequest);
+        }
+
+        if (PipelineStageSent(&rwContext->Pipeline, index, status)) {
+
+            Preempt();
+
+            WdfRequestCancelSentRequest(stageRequest);
+        }
+    }
+
+    finish = PipelineStopSending(&rwContext->Pipeline);
+
+    Preempt();
+
+    if (finish) {
+        FinishPipelinedRequest(Request);
+    }
+}
+
+static
+VOID
+StopPipelinedStages(
+    _In_ PREQUEST         Request,
+    _In_ NTSTATUS         Status,
+    _In_ ULONG            ExcludedStages
+    )
+{
+    PREQUEST                rwContext = Request;
+    PPIPE                   pipeContext = Request->Pipe;
+    ULONG                   busyStages;
+    ULONG                   index;
+
+    busyStages = PipelineStop(&rwContext->Pipeline, Status, ExcludedStages);
+
+    Preempt();
+
+    while (busyStages != 0) {
+
+        _BitScanForward(&index, busyStages);
+        busyStages &= ~(1 << index);
+
+        WdfRequestCancelSentRequest(&pipeContext->StageRequests[index]);
+
+        Preempt();
+    }
+}
+
+static
+VOID
+UsbSamp_EvtStageCompletion(
+    _In_ PSTAGE_REQUEST StageRequest,
+    _In_ NTSTATUS Status
+    )
+{
+    PREQUEST                request = StageRequest->Context;
+    PREQUEST                rwContext = request;
+
+    if (NT_SUCCESS(Status)) {
+
+        PipelineStageDone(&rwContext->Pipeline,
+                          StageRequest->Index,
+                          StageRequest->TransferBufferLength);
+    }
+    else {
+
+        StopPipelinedStages(request, Status, 1 << StageRequest->Index);
+
+        Preempt();
+
+        PipelineStageIdle(&rwContext->Pipeline, StageRequest->Index);
+    }
+
+    Preempt();
+
+    SendPipelinedStages(request);
+}
+
+static
+VOID
+StopPipelinedRequest(
+    _In_ PREQUEST   Request,
+    _In_ NTSTATUS   Status
+    )
+{
+    PREQUEST                rwContext = Request;
+
+    if (!PipelineReference(&rwContext->CompletionReferences)) {
+        return;
+    }
+
+    StopPipelinedStages(Request, Status, 0);
+
+    Preempt();
+
+    if (PipelineRelease(&rwContext->CompletionReferences, 1)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+static
+VOID
+UsbSamp_EvtPipelinedRequestCancel(
+    _In_ PREQUEST Request
+    )
+{
+    PREQUEST                rwContext = Request;
+
+    StopPipelinedStages(Request, STATUS_CANCELLED, 0);
+
+    Preempt();
+
+    if (PipelineRelease(&rwContext->CompletionReferences, 1)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+static
+VOID
+FinishPipelinedRequest(
+    _In_ PREQUEST         Request
+    )
+{
+    NTSTATUS                status;
+    PREQUEST                rwContext = Request;
+    LONG                    references;
+
+    status = WdfRequestUnmarkCancelable(Request);
+
+    if (status == STATUS_CANCELLED) {
+        references = 1;
+    }
+    else {
+        references = 2;
+    }
+
+    if (PipelineRelease(&rwContext->CompletionReferences, references)) {
+        CompletePipelinedRequest(Request);
+    }
+}
+
+static
+VOID
+CompletePipelinedRequest(
+    _In_ PREQUEST         Request
+    )
+{
+    PREQUEST                rwContext = Request;
+    PPIPE                   pipeContext = Request->Pipe;
+
+    InterlockedExchange(&pipeContext->StagesInUse, 0);
+
+    if (!NT_SUCCESS(rwContext->Pipeline.Status)) {
+        QueuePassiveLevelCallback(rwContext->Pipe);
+    }
+
+    if (NT_SUCCESS(rwContext->Pipeline.Status)) {
+        WdfRequestComplete(Request, STATUS_SUCCESS, rwContext->Pipeline.Numxfer);
+    }
+    else {
+        WdfRequestComplete(Request, rwContext->Pipeline.Status, 0);
+    }
+}
+
+//
+// Runs an event: on the thread running the model, or on another processor
+// while the driver does not hold the lock of the request.
+//
+
+static
+VOID
+DispatchEvent (
+    _In_ PEVENT Event
+    )
+{
+    PSTAGE_REQUEST stage;
+
+    switch (Event->Type) {
+
+    case EventBusDone:
+        BusDone(CurrentPipe, Event);
+        break;
+
+    case EventStageCompletion:
+        stage = &CurrentPipe->StageRequests[Event->Index];
+
+        if (stage->Generation == Event->Generation) {
+            CompleteStage(stage, Event->Status);
+        }
+        break;
+
+    case EventCancelRequest:
+        //
+        // The cancel routine runs some time after the request is
+        // cancelled; until it does, unmarking the request fails.
+        //
+        if (CurrentRequest->Cancelable) {
+            CurrentRequest->Cancelable = FALSE;
+            CurrentRequest->CancelPending = TRUE;
+            ScheduleEvent(Now + Random32() % 20000, EventCancelRoutine, 0, 0, STATUS_CANCELLED);
+        }
+        break;
+
+    case EventCancelRoutine:
+        MODEL_CHECK(!CurrentRequest->Completed, "%s", "request completed before its cancel routine ran");
+        CurrentRequest->CancelRoutineCalls++;
+        NoteFault(CurrentRequest, STATUS_CANCELLED);
+        UsbSamp_EvtPipelinedRequestCancel(CurrentRequest);
+        break;
+
+    case EventStop:
+        if (!CurrentRequest->Completed) {
+            NoteFault(CurrentRequest, STATUS_CANCELLED);
+            StopPipelinedRequest(CurrentRequest, STATUS_CANCELLED);
+        }
+        break;
+    }
+}
+
+static
+VOID
+Preempt (
+    VOID
+    )
+{
+    EVENT event;
+
+    if (Chance(Faults.Preemption) && NextEvent(Now + SUBMIT_NS, &event)) {
+        DispatchEvent(&event);
+    }
+}
+
+//
+// Runs one transfer of TotalLength bytes on the pipe, as
+// ReadWriteBulkEndPoints starts it, until no event is left. With faults,
+// the request may also be cancelled or stopped at a random time.
+//
+
+static
+VOID
+RunTransfer (
+    _Inout_ PPIPE Pipe,
+    _Out_ PREQUEST Request,
+    _In_ ULONG TotalLength,
+    _In_ BOOLEAN Faulty
+    )
+{
+    EVENT event;
+    ULONG stageLength = Pipe->Speed->MaxPacketSize;
+    ULONGLONG estimate;
+
+    NumberOfEvents = 0;
+    Now = 0;
+    ModelError[0] = 0;
+    CurrentRequest = Request;
+    CurrentPipe = Pipe;
+
+    Pipe->QueueLength = 0;
+    Pipe->BusBusy = FALSE;
+    Pipe->Halted = FALSE;
+    Pipe->ResetQueued = FALSE;
+    Pipe->DeviceOffset = 0;
+
+    ZeroMemory(Request, sizeof(*Request));
+    Request->Pipe = Pipe;
+    Request->TotalLength = TotalLength;
+    Request->FirstFault = STATUS_SUCCESS;
+
+    MODEL_CHECK(InterlockedCompareExchange(&Pipe->StagesInUse, 1, 0) == 0,
+                "%s", "stage requests of the pipe still in use");
+
+    if (Faulty) {
+
+        estimate = (ULONGLONG)((TotalLength + stageLength - 1) / stageLength) *
+                   max(Pipe->Speed->ServiceIntervalNs,
+                       Pipe->Speed->OverheadNs + stageLength * (ULONGLONG)Pipe->Speed->PicosecondsPerByte / 1000 +
+                           DPC_LATENCY_NS + SUBMIT_NS) /
+                   Pipe->NumberOfStages;
+
+        if ((Random32() % 4) == 0) {
+            ScheduleEvent(Random32() % (estimate * 2 + 1), EventCancelRequest, 0, 0, STATUS_CANCELLED);
+        }
+
+        if ((Random32() % 8) == 0) {
+            ScheduleEvent(Random32() % (estimate * 2 + 1), EventStop, 0, 0, STATUS_CANCELLED);
+        }
+    }
+
+    PerformPipelinedBulkTransfer(Request, 0, TotalLength, stageLength);
+
+    while (NextEvent(MAXULONGLONG, &event)) {
+        DispatchEvent(&event);
+    }
+
+    MODEL_CHECK(Request->Completed, "%s", "request left pending");
+    MODEL_CHECK(Pipe->StagesInUse == 0, "%s", "stage requests of the pipe not released");
+    MODEL_CHECK(Request->CancelRoutineCalls <= 1, "cancel routine called %lu times", (unsigned long)Request->CancelRoutineCalls);
+    MODEL_CHECK(!Pipe->Halted || Pipe->ResetQueued, "%s", "halted pipe not reset");
+
+    if (NT_SUCCESS(Request->CompletionStatus)) {
+        MODEL_CHECK((Request->Information == TotalLength) && (Pipe->DeviceOffset == TotalLength),
+                    "transfer of %lu bytes reported %lu, the device got %lu",
+                    (unsigned long)TotalLength, (unsigned long)Request->Information,
+                    (unsigned long)Pipe->DeviceOffset);
+    }
+    else {
+        MODEL_CHECK((Request->Information == 0) && (Request->CompletionStatus == Request->FirstFault),
+                    "failed transfer reported %lu bytes and status 0x%lx, first failure 0x%lx",
+                    (unsigned long)Request->Information, (unsigned long)Request->CompletionStatus,
+                    (unsigned long)Request->FirstFault);
+    }
+}
+
+static
+VOID
+InitializePipe (
+    _Out_ PPIPE Pipe,
+    _In_ PSPEED Speed,
+    _In_ ULONG NumberOfStages
+    )
+{
+    ULONG i;
+
+    ZeroMemory(Pipe, sizeof(*Pipe));
+    Pipe->Speed = Speed;
+    Pipe->NumberOfStages = NumberOfStages;
+
+    for (i = 0; i < NumberOfStages; i++) {
+        Pipe->StageRequests[i].Index = i;
+    }
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static PIPE pipes[ARRAYSIZE(Speeds)][MAX_BULK_STAGES_IN_FLIGHT + 1];
+    PPIPE pipe;
+    REQUEST request;
+    PSPEED speed;
+    ULONG transfers = 200000;
+    ULONG succeeded = 0;
+    ULONG cancelled = 0;
+    ULONG failed = 0;
+    ULONG i, s, n, length;
+    double oneStage;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        transfers = strtoul(argv[1], NULL, 0);
+    }
+
+    srand(1);
+
+    for (s = 0; s < ARRAYSIZE(Speeds); s++) {
+        for (n = 2; n <= MAX_BULK_STAGES_IN_FLIGHT; n++) {
+            InitializePipe(&pipes[s][n], &Speeds[s], n);
+        }
+    }
+
+    //
+    // Random transfers of more than one stage, on pipes of any speed with
+    // 2 to 16 stage requests, the most a pipe with streams has. The pipes
+    // are reused, so a transfer that does not release the stage requests
+    // fails the next one.
+    //
+
+    for (i = 0; i < transfers; i++) {
+
+        s = Random32() % ARRAYSIZE(Speeds);
+        n = 2 + Random32() % (MAX_BULK_STAGES_IN_FLIGHT - 1);
+        pipe = &pipes[s][n];
+        speed = pipe->Speed;
+
+        length = speed->MaxPacketSize * (1 + Random32() % 48) + 1 + Random32() % speed->MaxPacketSize;
+
+        if ((Random32() % 4) == 0) {
+            ZeroMemory(&Faults, sizeof(Faults));
+        }
+        else {
+            Faults.StageFailure = Random32() % 512;
+            Faults.SendFailure = Random32() % 256;
+            Faults.InlineCompletion = Random32() % 4096;
+            Faults.MarkCancelableFailure = 256;
+            Faults.Preemption = Random32() % 32768;
+        }
+
+        RunTransfer(pipe, &request, length, TRUE);
+
+        TEST_ASSERT(ModelError[0] == 0,
+                    "transfer %lu, %s speed, %lu stages, %lu bytes: %s",
+                    (unsigned long)i, speed->Name, (unsigned long)n, (unsigned long)length, ModelError);
+
+        if (NT_SUCCESS(request.CompletionStatus)) {
+            succeeded++;
+        }
+        else if (request.CompletionStatus == STATUS_CANCELLED) {
+            cancelled++;
+        }
+        else {
+            failed++;
+        }
+    }
+
+    TEST_COMMENT("%lu random transfers: %lu succeeded, %lu cancelled, %lu failed",
+                 (unsigned long)transfers, (unsigned long)succeeded,
+                 (unsigned long)cancelled, (unsigned long)failed);
+
+    //
+    // The throughput of the model with the stages in flight of each speed.
+    // With one stage in flight the transfer runs as when ReadWriteBulkEndPoints
+    // sends the stages one at a time.
+    //
+
+    ZeroMemory(&Faults, sizeof(Faults));
+
+    for (s = 0; s < ARRAYSIZE(Speeds); s++) {
+
+        oneStage = 0;
+
+        for (n = 1; n <= Speeds[s].StagesInFlight; n *= 2) {
+
+            pipe = &pipes[s][n];
+
+            if (n == 1) {
+                InitializePipe(pipe, &Speeds[s], 1);
+            }
+
+            RunTransfer(pipe, &request, BENCHMARK_LENGTH, FALSE);
+
+            TEST_ASSERT(ModelError[0] == 0 && NT_SUCCESS(request.CompletionStatus),
+                        "%s speed, %lu stages: %s", Speeds[s].Name, (unsigned long)n, ModelError);
+
+            if (n == 1) {
+                oneStage = (double)Now;
+            }
+
+            TEST_COMMENT("%-5s speed, %2lu stages of %4lu bytes in flight: %8.3f MB/s (%.2fx)",
+                         Speeds[s].Name, (unsigned long)n, (unsigned long)Speeds[s].MaxPacketSize,
+                         (double)BENCHMARK_LENGTH * 1000 / (double)Now,
+                         oneStage / (double)Now);
+        }
+    }
+
+End:
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}
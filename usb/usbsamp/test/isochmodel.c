@@ -0,0 +1,1430 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    isochmodel.c
+
+Abstract:
+
+    This file tests the isoch streaming ring of usbsamp in user mode.
+
+    The routines of isochring.h that lay out a transfer, schedule the
+    slots of the ring, account for their completion, move data through
+    the circular buffer and report the statistics are built here as they
+    are. The routines of isorwr.c around them, which hold the ring lock
+    and send and complete the requests, are reproduced on plain
+    structures, and so is the way device.c sizes the frames of an isoch
+    pipe.
+
+    First every endpoint the driver accepts, at full, high and SuperSpeed
+    and every interval, is checked: a slot must span exactly the frames
+    of the ring in whole packets, with the number of packets per frame
+    the interval gives, and lengths that are not whole frames or need too
+    many packets must be rejected.
+
+    Then streams are run on a model host controller whose frame number
+    starts just before it wraps. The slots sent are transferred at the
+    frames they are scheduled in and their completion reaches the driver
+    after a random delay, in order. Packets are lost or come back short,
+    and the reads or writes of the application are issued at random, so
+    that the ring both overruns and underruns. The test checks that no
+    slot is scheduled in the past or over another one; that the late
+    submissions are exactly the gaps in the schedule, and that there are
+    none while completions are delayed by less than the slots in flight
+    allow; that the application reads the bytes the device sent, and the
+    device receives the bytes the application wrote, in order, less those
+    the counters report as overrun or underrun; and that the statistics
+    add up across queries. Once stopped, no slot is in flight or sent
+    again.
+
+    Some streams also have slots fail, either when they complete or
+    inline, from within the send, and have reads complete inline. The
+    test checks that the ring halts on the first failure: no slot is sent
+    again, the reads or writes waiting are failed and the packets of the
+    failed slots count as lost. It also checks that a slot completing
+    inline does not send slots from within the send, and that the ring is
+    not touched once its last slot is retired.
+
+    It then prints the size of a slot and of the buffer for a few
+    endpoints and the longest completion delay that leaves no gap.
+
+    Usage: isochmodel [Streams]
+
+Environment:
+
+    User mode
+
+--*/
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "devioctl.h"
+#include "public.h"
+
+typedef LONG NTSTATUS;
+typedef LONG USBD_STATUS;
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define USBD_SUCCESS(Status) ((USBD_STATUS)(Status) >= 0)
+
+#define USBD_STATUS_ISO_NOT_ACCESSED_BY_HW  ((USBD_STATUS)0xC0020000L)
+
+typedef struct _USBD_ISO_PACKET_DESCRIPTOR {
+    ULONG Offset;
+    ULONG Length;
+    USBD_STATUS Status;
+} USBD_ISO_PACKET_DESCRIPTOR, *PUSBD_ISO_PACKET_DESCRIPTOR;
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+// Checks made inside the model record the first failure, the test
+// reports it once the stream is stopped.
+//
+
+#define MODEL_CHECK(_Assertion, _Message, ...) do { \
+        if (!(_Assertion) && (ModelError[0] == 0)) { \
+            _snprintf_s(ModelError, sizeof(ModelError), _TRUNCATE, _Message, __VA_ARGS__); \
+        }\
+    } while (0)
+
+#define NT_ASSERT(_Assertion) MODEL_CHECK(_Assertion, "%s", #_Assertion)
+
+static CHAR ModelError[256];
+
+#define MAX_SUPPORTED_PACKETS_FOR_SUPER_SPEED 1024  // as in private.h
+#define MAX_SUPPORTED_PACKETS_FOR_HIGH_SPEED 1024
+#define MAX_SUPPORTED_PACKETS_FOR_FULL_SPEED 255
+#define DISPATCH_LATENCY_IN_MS 10
+
+#define ISOCH_RING_SLOTS            8
+#define ISOCH_RING_FRAMES_PER_SLOT  8
+#define ISOCH_RING_BUFFERED_SLOTS   32
+
+#define MAX_PACKETS_PER_SLOT        (ISOCH_RING_FRAMES_PER_SLOT * 8)
+#define MAX_PENDING_REQUESTS        64
+
+#include "isochring.h"
+
+//
+// The longest delay between the end of a slot and its completion that
+// still leaves the next slot two frames ahead of the bus: the other
+// slots in flight cover the frames until then.
+//
+
+#define MAX_DELAY_WITHOUT_GAP       ((ISOCH_RING_SLOTS - 1) * ISOCH_RING_FRAMES_PER_SLOT - 2)
+
+//
+// An isoch endpoint. At SuperSpeed MaximumPacketSize is wBytesPerInterval
+// of the companion descriptor.
+//
+
+typedef struct _ENDPOINT {
+    PCSTR Name;
+    BOOLEAN IsDeviceSuperSpeed;
+    BOOLEAN IsDeviceHighSpeed;
+    ULONG MaximumPacketSize;
+    ULONG Interval;
+} ENDPOINT, *PENDPOINT;
+
+static ENDPOINT Endpoints[] = {
+    { "Full speed,   192 bytes",           FALSE, FALSE, 192,   1 },
+    { "Full speed,  1023 bytes",           FALSE, FALSE, 1023,  1 },
+    { "High speed,   512 bytes, period 8", FALSE, TRUE,  512,   4 },
+    { "High speed,  1024 bytes, period 1", FALSE, TRUE,  1024,  1 },
+    { "High speed,  3072 bytes, period 1", FALSE, TRUE,  3072,  1 },
+    { "SuperSpeed,  1024 bytes, period 4", TRUE,  FALSE, 1024,  3 },
+    { "SuperSpeed,  3072 bytes, period 1", TRUE,  FALSE, 3072,  1 },
+};
+
+//
+// The fields of PIPE_CONTEXT the isoch path uses.
+//
+
+typedef struct _PIPE_CONTEXT {
+    ULONG TransferSizePerMicroframe;
+    ULONG TransferSizePerFrame;
+} PIPE_CONTEXT, *PPIPE_CONTEXT;
+
+//
+// A slot of the ring, with the fields of ISOCH_SLOT_CONTEXT and of its
+// urb the driver uses, and the state the model keeps for it.
+//
+
+typedef struct _SLOT {
+    ULONG Index;
+    ULONG StartFrame;
+    PUCHAR Buffer;
+    USBD_ISO_PACKET_DESCRIPTOR IsoPacket[MAX_PACKETS_PER_SLOT];
+
+    ULONG CompletionFrame;
+    ULONG LoadedBytes;
+    BOOLEAN Sent;
+    BOOLEAN Transmitted;
+    BOOLEAN Fail;
+} SLOT, *PSLOT;
+
+//
+// A read or write of the application waiting in the pending queue.
+//
+
+typedef struct _PENDING_REQUEST {
+    ULONG Length;
+    ULONGLONG Sequence;
+} PENDING_REQUEST, *PPENDING_REQUEST;
+
+//
+// The fields of ISOCH_RING.
+//
+
+typedef struct _ISOCH_RING {
+    ISOCH_RING_STATE State;
+    LONG SlotsOutstanding;
+    BOOLEAN SlotsIdle;
+    SLOT Slots[ISOCH_RING_SLOTS];
+
+    PENDING_REQUEST PendingQueue[MAX_PENDING_REQUESTS];
+    ULONG PendingHead;
+    ULONG PendingCount;
+} ISOCH_RING, *PISOCH_RING;
+
+//
+// A stream run on the model, and what the model expects of it.
+//
+
+typedef struct _STREAM {
+    ULONG MaxDelay;
+    BOOLEAN FixedDelay;
+    ULONG LongDelayChance;          // in 1/65536
+    ULONG PacketLossChance;
+    ULONG ShortPacketChance;
+    ULONG RequestChance;
+    ULONG MaxRequestLength;
+    ULONG FailChance;
+    ULONG InlineFailChance;
+    ULONG InlineChance;
+
+    //
+    // The host controller: the slots in flight in the order they were
+    // scheduled, and the end of the last one.
+    //
+    ULONG InFlight[ISOCH_RING_SLOTS];
+    ULONG InFlightHead;
+    ULONG InFlightCount;
+    ULONG ScheduleEnd;
+    ULONG LastCompletionFrame;
+
+    //
+    // The bytes the device sent and the application has not read yet, or
+    // the bytes the application wrote and the device has not received,
+    // of which some are in the slots in flight.
+    //
+    PUCHAR Expected;
+    ULONG ExpectedCapacity;
+    ULONG ExpectedStart;
+    ULONG ExpectedLength;
+    ULONG LoadedBytes;
+
+    ULONGLONG DeviceSequence;
+    ULONGLONG ApplicationSequence;
+
+    ULONG Gaps;
+    ULONGLONG TransfersCompleted;
+    ULONGLONG PacketsTransferred;
+    ULONGLONG PacketsLost;
+    ULONGLONG TotalCompletionLatency;
+    ULONG MaxCompletionLatency;
+    ULONGLONG OverrunBytes;
+    ULONGLONG ZeroBytes;
+
+    //
+    // Slots failed, requests failed on a halted ring, and how deep the
+    // completion routine was entered.
+    //
+    ULONG Failures;
+    ULONG FailedRequests;
+    ULONG CompletionDepth;
+    ULONG MaxCompletionDepth;
+
+    //
+    // The sums of the statistics queried from the ring.
+    //
+    ULONGLONG Frames;
+    USBSAMP_ISOCH_STREAM_STATISTICS Sum;
+    ULONG Queries;
+} STREAM, *PSTREAM;
+
+static ULONG Frame;
+static PSTREAM CurrentStream;
+static UCHAR Scratch[2 * ISOCH_RING_FRAMES_PER_SLOT * 8 * 3072];
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+static
+BOOLEAN
+Chance (
+    _In_ ULONG Probability
+    )
+{
+    return (Random32() & 0xFFFF) < Probability;
+}
+
+//
+// The bytes of the device and of the application are never zero, so
+// that the zeroes sent for an underrun can be told apart.
+//
+
+static
+UCHAR
+StreamByte (
+    _In_ ULONGLONG Sequence
+    )
+{
+    return (UCHAR)(1 + ((Sequence * 7) ^ (Sequence >> 8)) % 255);
+}
+
+//
+// As in InitializePipeContextForSuperSpeedDevice, ForHighSpeedDevice and
+// ForFullSpeedDevice (device.c), less the checks of the descriptors.
+//
+
+static
+NTSTATUS
+InitializePipeContext (
+    _In_ PENDPOINT Endpoint,
+    _Out_ PPIPE_CONTEXT PipeContext
+    )
+{
+    PipeContext->TransferSizePerMicroframe = 0;
+    PipeContext->TransferSizePerFrame = 0;
+
+    if (Endpoint->MaximumPacketSize == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Endpoint->IsDeviceSuperSpeed && !Endpoint->IsDeviceHighSpeed) {
+
+        if ((Endpoint->MaximumPacketSize > 1023) || (Endpoint->Interval != 1)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        PipeContext->TransferSizePerFrame = Endpoint->MaximumPacketSize;
+        return STATUS_SUCCESS;
+    }
+
+    if (Endpoint->MaximumPacketSize > (Endpoint->IsDeviceSuperSpeed ? 1024 * 16 * 3 : 1024 * 3)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PipeContext->TransferSizePerMicroframe = Endpoint->MaximumPacketSize;
+
+    switch (Endpoint->Interval) {
+    case 1:
+        PipeContext->TransferSizePerFrame = PipeContext->TransferSizePerMicroframe * 8;
+        break;
+    case 2:
+        PipeContext->TransferSizePerFrame = PipeContext->TransferSizePerMicroframe * 4;
+        break;
+    case 3:
+        PipeContext->TransferSizePerFrame = PipeContext->TransferSizePerMicroframe * 2;
+        break;
+    case 4:
+        PipeContext->TransferSizePerFrame = PipeContext->TransferSizePerMicroframe;
+        break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// As in isorwr.c.
+//
+
+static
+NTSTATUS
+GetIsochTransferLayout (
+    _In_ PENDPOINT Endpoint,
+    _In_ PPIPE_CONTEXT PipeContext,
+    _In_ ULONG TotalLength,
+    _Out_ PULONG NumberOfPackets,
+    _Out_ PULONG NumberOfFrames,
+    _Out_ PULONG PacketSize
+    )
+{
+    return IsochTransferLayout(Endpoint->IsDeviceSuperSpeed,
+                               Endpoint->IsDeviceHighSpeed,
+                               PipeContext->TransferSizePerMicroframe,
+                               PipeContext->TransferSizePerFrame,
+                               TotalLength,
+                               NumberOfPackets,
+                               NumberOfFrames,
+                               PacketSize);
+}
+
+//
+// Checks the layout of a slot, and of the lengths around it, on an
+// endpoint.
+//
+
+static
+VOID
+CheckLayout (
+    _In_ PENDPOINT Endpoint
+    )
+{
+    PIPE_CONTEXT pipeContext;
+    ULONG slotLength;
+    ULONG packets, frames, packetSize;
+    ULONG packetsPerFrame, maxFrames;
+    NTSTATUS status;
+
+    status = InitializePipeContext(Endpoint, &pipeContext);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    if (!Endpoint->IsDeviceSuperSpeed && !Endpoint->IsDeviceHighSpeed) {
+        packetsPerFrame = 1;
+        maxFrames = MAX_SUPPORTED_PACKETS_FOR_FULL_SPEED;
+    }
+    else {
+        packetsPerFrame = 8 >> (Endpoint->Interval - 1);
+        maxFrames = MAX_SUPPORTED_PACKETS_FOR_HIGH_SPEED / packetsPerFrame;
+    }
+
+    slotLength = ISOCH_RING_FRAMES_PER_SLOT * pipeContext.TransferSizePerFrame;
+
+    status = GetIsochTransferLayout(Endpoint, &pipeContext, slotLength, &packets, &frames, &packetSize);
+
+    MODEL_CHECK(NT_SUCCESS(status), "slot of %lu bytes rejected", (unsigned long)slotLength);
+    MODEL_CHECK(frames == ISOCH_RING_FRAMES_PER_SLOT,
+                "slot spans %lu frames", (unsigned long)frames);
+    MODEL_CHECK(packets == frames * packetsPerFrame,
+                "%lu packets in %lu frames, %lu per frame expected",
+                (unsigned long)packets, (unsigned long)frames, (unsigned long)packetsPerFrame);
+    MODEL_CHECK(packets * packetSize == slotLength,
+                "%lu packets of %lu bytes in a slot of %lu bytes",
+                (unsigned long)packets, (unsigned long)packetSize, (unsigned long)slotLength);
+    MODEL_CHECK(packets <= MAX_PACKETS_PER_SLOT, "%lu packets in a slot", (unsigned long)packets);
+    MODEL_CHECK((ULONGLONG)slotLength * ISOCH_RING_BUFFERED_SLOTS <= MAXULONG,
+                "buffer of %lu slots of %lu bytes", (unsigned long)ISOCH_RING_BUFFERED_SLOTS,
+                (unsigned long)slotLength);
+
+    if (pipeContext.TransferSizePerFrame > 1) {
+        status = GetIsochTransferLayout(Endpoint, &pipeContext, slotLength + 1, &packets, &frames, &packetSize);
+        MODEL_CHECK(!NT_SUCCESS(status), "%lu bytes are not whole frames", (unsigned long)slotLength + 1);
+    }
+
+    status = GetIsochTransferLayout(Endpoint, &pipeContext, maxFrames * pipeContext.TransferSizePerFrame,
+                                    &packets, &frames, &packetSize);
+    MODEL_CHECK(NT_SUCCESS(status) && (frames == maxFrames),
+                "%lu frames rejected", (unsigned long)maxFrames);
+
+    status = GetIsochTransferLayout(Endpoint, &pipeContext, (maxFrames + 1) * pipeContext.TransferSizePerFrame,
+                                    &packets, &frames, &packetSize);
+    MODEL_CHECK(!NT_SUCCESS(status), "%lu frames accepted", (unsigned long)maxFrames + 1);
+}
+
+//
+// The bytes the model expects, in order.
+//
+
+static
+VOID
+ExpectBytes (
+    _In_ PSTREAM Stream,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+    )
+{
+    if (Stream->ExpectedStart + Stream->ExpectedLength + Length > Stream->ExpectedCapacity) {
+        MoveMemory(Stream->Expected, Stream->Expected + Stream->ExpectedStart, Stream->ExpectedLength);
+        Stream->ExpectedStart = 0;
+    }
+
+    MODEL_CHECK(Stream->ExpectedLength + Length <= Stream->ExpectedCapacity,
+                "%lu bytes expected", (unsigned long)(Stream->ExpectedLength + Length));
+
+    if (Stream->ExpectedLength + Length > Stream->ExpectedCapacity) {
+        return;
+    }
+
+    CopyMemory(Stream->Expected + Stream->ExpectedStart + Stream->ExpectedLength, Buffer, Length);
+    Stream->ExpectedLength += Length;
+}
+
+static
+VOID
+CheckBytes (
+    _In_ PSTREAM Stream,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _In_ PCSTR Who
+    )
+{
+    MODEL_CHECK(Length <= Stream->ExpectedLength,
+                "the %s got %lu bytes, %lu expected", Who, (unsigned long)Length,
+                (unsigned long)Stream->ExpectedLength);
+
+    if (Length > Stream->ExpectedLength) {
+        return;
+    }
+
+    MODEL_CHECK(memcmp(Buffer, Stream->Expected + Stream->ExpectedStart, Length) == 0,
+                "the %s got the wrong bytes", Who);
+
+    Stream->ExpectedStart += Length;
+    Stream->ExpectedLength -= Length;
+}
+
+//
+// Takes the bytes of a write that failed out of those expected, from
+// where they were loaded.
+//
+
+static
+VOID
+DropBytes (
+    _In_ PSTREAM Stream,
+    _In_ ULONG Offset,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+    )
+{
+    PUCHAR expected;
+
+    MODEL_CHECK(Offset + Length <= Stream->ExpectedLength,
+                "%lu bytes dropped at %lu, %lu expected", (unsigned long)Length,
+                (unsigned long)Offset, (unsigned long)Stream->ExpectedLength);
+
+    if (Offset + Length > Stream->ExpectedLength) {
+        return;
+    }
+
+    expected = Stream->Expected + Stream->ExpectedStart + Offset;
+
+    MODEL_CHECK(memcmp(Buffer, expected, Length) == 0, "%s", "a failed write held the wrong bytes");
+
+    MoveMemory(expected, expected + Length, Stream->ExpectedLength - Offset - Length);
+    Stream->ExpectedLength -= Length;
+}
+
+static VOID ControllerSend(_In_ PISOCH_RING Ring, _In_ PSLOT Slot);
+static VOID ControllerFinish(_In_ PISOCH_RING Ring, _In_ PSLOT Slot, _In_ NTSTATUS Status, _In_ BOOLEAN Inline);
+
+//
+// As in isorwr.c. The frame number of the model is never unavailable and
+// the urb is never rejected.
+//
+
+static
+NTSTATUS
+SubmitIsochSlot (
+    _In_ PISOCH_RING Ring,
+    _In_ PSLOT Slot
+    )
+{
+    ULONG frameNumber;
+    ULONG j;
+
+    frameNumber = Frame;
+
+    Slot->StartFrame = IsochRingScheduleSlot(&Ring->State, Slot->Index, frameNumber);
+
+    for (j = 0; j < Ring->State.NumberOfPackets; j++) {
+        Slot->IsoPacket[j].Length = 0;
+        Slot->IsoPacket[j].Status = USBD_STATUS_ISO_NOT_ACCESSED_BY_HW;
+    }
+
+    ControllerSend(Ring, Slot);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// As in isorwr.c, with the application requests of the pending queue
+// completed by the model.
+//
+
+static
+VOID
+ServiceIsochRing (
+    _In_ PISOCH_RING Ring
+    )
+{
+    PPENDING_REQUEST request;
+    ULONG information;
+    ULONG i;
+
+    MODEL_CHECK(!Ring->SlotsIdle, "%s", "ring serviced after its last slot was retired");
+
+    for (;;) {
+
+        if (!IsochRingCanService(&Ring->State)) {
+            break;
+        }
+
+        if (Ring->PendingCount == 0) {
+            break;
+        }
+
+        request = &Ring->PendingQueue[Ring->PendingHead];
+
+        if (!Ring->State.Read) {
+            for (i = 0; i < request->Length; i++) {
+                Scratch[i] = StreamByte(request->Sequence + i);
+            }
+        }
+
+        if (!IsochRingServiceRequest(&Ring->State, Scratch, request->Length, &information)) {
+            break;
+        }
+
+        if (Ring->State.Read) {
+            CheckBytes(CurrentStream, Scratch, information, "application");
+        }
+        else {
+            ExpectBytes(CurrentStream, Scratch, information);
+        }
+
+        Ring->PendingHead = (Ring->PendingHead + 1) % MAX_PENDING_REQUESTS;
+        Ring->PendingCount--;
+    }
+}
+
+//
+// As in UsbSamp_EvtIsochSlotCompletion (isorwr.c).
+//
+
+static
+VOID
+SendIsochSlots (
+    _In_ PISOCH_RING Ring,
+    _In_ ULONG Slots
+    );
+
+static
+VOID
+IsochSlotCompletion (
+    _In_ PISOCH_RING Ring,
+    _In_ PSLOT Slot,
+    _In_ NTSTATUS Status
+    )
+{
+    ULONG frameNumber;
+    ULONG endFrame;
+    ULONG latency;
+    BOOLEAN halted;
+
+    MODEL_CHECK(!Ring->SlotsIdle, "slot %lu completed after the last slot was retired",
+                (unsigned long)Slot->Index);
+
+    endFrame = Slot->StartFrame + Ring->State.NumberOfFrames;
+    frameNumber = Frame;
+
+    latency = ((LONG)(frameNumber - endFrame) > 0) ? (frameNumber - endFrame) : 0;
+
+    halted = IsochRingSlotDone(&Ring->State,
+                               Slot->Index,
+                               latency,
+                               Status,
+                               FALSE,
+                               Slot->IsoPacket,
+                               Slot->Buffer);
+
+    if (halted) {
+        CurrentStream->FailedRequests += Ring->PendingCount;
+        Ring->PendingCount = 0;
+    }
+    else {
+        ServiceIsochRing(Ring);
+    }
+
+    SendIsochSlots(Ring, 1 << Slot->Index);
+}
+
+//
+// As in SendIsochSlots (isorwr.c). The model runs on one thread, so a
+// thread sending is only found by a slot completing inline.
+//
+
+static
+VOID
+SendIsochSlots (
+    _In_ PISOCH_RING Ring,
+    _In_ ULONG Slots
+    )
+{
+    PSLOT slot;
+    ULONG index;
+    LONG retired;
+    BOOLEAN halted = FALSE;
+    NTSTATUS status;
+
+    MODEL_CHECK(!Ring->SlotsIdle, "%s", "slots sent after the last slot was retired");
+
+    if (!IsochRingStartSending(&Ring->State, Slots)) {
+        return;
+    }
+
+    while (IsochRingTakeSlot(&Ring->State, &index)) {
+
+        slot = &Ring->Slots[index];
+
+        IsochRingLoadSlot(&Ring->State, slot->Buffer, slot->Sent);
+
+        slot->Sent = TRUE;
+
+        status = SubmitIsochSlot(Ring, slot);
+
+        IsochRingSlotSent(&Ring->State, index, status, &halted);
+    }
+
+    retired = IsochRingStopSending(&Ring->State);
+
+    if (halted) {
+        CurrentStream->FailedRequests += Ring->PendingCount;
+        Ring->PendingCount = 0;
+    }
+
+    if (retired != 0 && InterlockedAdd(&Ring->SlotsOutstanding, -retired) == 0) {
+        Ring->SlotsIdle = TRUE;
+    }
+}
+
+//
+// As in GetIsochRingStatistics (isorwr.c).
+//
+
+static
+VOID
+GetIsochRingStatistics (
+    _In_ PISOCH_RING Ring,
+    _Out_ PUSBSAMP_ISOCH_STREAM_STATISTICS Statistics
+    )
+{
+    ULONG frameNumber;
+
+    frameNumber = Frame;
+
+    IsochRingGetStatistics(&Ring->State, frameNumber, Statistics);
+}
+
+//
+// The host controller. A slot sent is transferred in the frames it is
+// scheduled in and completes after a random delay, after the slots sent
+// before it.
+//
+
+static
+VOID
+ControllerSend (
+    _In_ PISOCH_RING Ring,
+    _In_ PSLOT Slot
+    )
+{
+    PSTREAM stream = CurrentStream;
+    ULONG delay;
+    ULONG j;
+
+    MODEL_CHECK((LONG)(Slot->StartFrame - Frame) >= 2,
+                "slot %lu scheduled at frame %lu in frame %lu",
+                (unsigned long)Slot->Index, (unsigned long)Slot->StartFrame, (unsigned long)Frame);
+    MODEL_CHECK((LONG)(Slot->StartFrame - stream->ScheduleEnd) >= 0,
+                "slot %lu scheduled at frame %lu before the end of the last one %lu",
+                (unsigned long)Slot->Index, (unsigned long)Slot->StartFrame,
+                (unsigned long)stream->ScheduleEnd);
+    MODEL_CHECK(stream->InFlightCount < ISOCH_RING_SLOTS, "%s", "too many slots in flight");
+    MODEL_CHECK(!Ring->State.Stopping, "slot %lu sent while stopping", (unsigned long)Slot->Index);
+    MODEL_CHECK(!Ring->State.Halted, "slot %lu sent on a halted ring", (unsigned long)Slot->Index);
+
+    if (Slot->StartFrame != stream->ScheduleEnd) {
+        stream->Gaps++;
+    }
+
+    stream->ScheduleEnd = Slot->StartFrame + Ring->State.NumberOfFrames;
+
+    Slot->Fail = Chance(stream->FailChance);
+
+    if (!Ring->State.Read) {
+        for (j = 0; (j < Ring->State.SlotLength) && (Slot->Buffer[j] != 0); j++);
+        Slot->LoadedBytes = j;
+        stream->LoadedBytes += j;
+
+        MODEL_CHECK((j == Ring->State.SlotLength) || (Ring->State.DataLength == 0),
+                    "slot %lu sent with %lu of %lu bytes and %lu left in the buffer",
+                    (unsigned long)Slot->Index, (unsigned long)j, (unsigned long)Ring->State.SlotLength,
+                    (unsigned long)Ring->State.DataLength);
+    }
+
+    delay = stream->FixedDelay ? stream->MaxDelay : Random32() % (stream->MaxDelay + 1);
+
+    if (Chance(stream->LongDelayChance)) {
+        delay = MAX_DELAY_WITHOUT_GAP + 1 + Random32() % (4 * MAX_DELAY_WITHOUT_GAP);
+    }
+
+    Slot->CompletionFrame = stream->ScheduleEnd + delay;
+
+    if ((LONG)(Slot->CompletionFrame - stream->LastCompletionFrame) < 0) {
+        Slot->CompletionFrame = stream->LastCompletionFrame;
+    }
+
+    stream->LastCompletionFrame = Slot->CompletionFrame;
+
+    //
+    // The stack may fail the slot and complete it before the send returns.
+    // A read may also complete inline, as its data can be received out of
+    // order.
+    //
+    if (Chance(stream->InlineFailChance)) {
+        Slot->Fail = TRUE;
+        ControllerFinish(Ring, Slot, STATUS_SUCCESS, TRUE);
+        return;
+    }
+
+    if (Ring->State.Read && Chance(stream->InlineChance)) {
+        ControllerFinish(Ring, Slot, STATUS_SUCCESS, TRUE);
+        return;
+    }
+
+    stream->InFlight[(stream->InFlightHead + stream->InFlightCount) % ISOCH_RING_SLOTS] = Slot->Index;
+    stream->InFlightCount++;
+}
+
+//
+// The bus transfers a slot: the device fills the packets of a read, or
+// receives the data of a write. A cancelled read transfers nothing; the
+// data of a cancelled write is taken as received, so that the bytes
+// taken from the buffer are all accounted for. A failed read transfers
+// nothing either, though its packets are left looking received, and the
+// data of a failed write is lost. Offset is where the bytes of a write
+// start among the bytes expected.
+//
+
+static
+VOID
+ControllerTransfer (
+    _In_ PISOCH_RING Ring,
+    _In_ PSLOT Slot,
+    _In_ NTSTATUS Status,
+    _In_ ULONG Offset
+    )
+{
+    PSTREAM stream = CurrentStream;
+    PUSBD_ISO_PACKET_DESCRIPTOR packet;
+    ULONG free;
+    ULONG kept;
+    ULONG i, j;
+
+    if (Ring->State.Read) {
+
+        if (Status == STATUS_CANCELLED) {
+            return;
+        }
+
+        if (!NT_SUCCESS(Status)) {
+
+            for (i = 0; i < Ring->State.NumberOfPackets; i++) {
+                Slot->IsoPacket[i].Length = Ring->State.PacketSize;
+                Slot->IsoPacket[i].Status = 0;
+            }
+
+            stream->PacketsLost += Ring->State.NumberOfPackets;
+            return;
+        }
+
+        free = Ring->State.DataSize - stream->ExpectedLength;
+
+        for (i = 0; i < Ring->State.NumberOfPackets; i++) {
+
+            packet = &Slot->IsoPacket[i];
+
+            MODEL_CHECK(packet->Offset == i * Ring->State.PacketSize,
+                        "packet %lu at offset %lu", (unsigned long)i, (unsigned long)packet->Offset);
+
+            if (Chance(stream->PacketLossChance)) {
+                packet->Status = USBD_STATUS_ISO_NOT_ACCESSED_BY_HW;
+                packet->Length = 0;
+                stream->PacketsLost++;
+                continue;
+            }
+
+            packet->Status = 0;
+            packet->Length = Ring->State.PacketSize;
+
+            if (Chance(stream->ShortPacketChance)) {
+                packet->Length = Random32() % (Ring->State.PacketSize + 1);
+            }
+
+            for (j = 0; j < packet->Length; j++) {
+                Slot->Buffer[packet->Offset + j] = StreamByte(stream->DeviceSequence++);
+            }
+
+            kept = min(packet->Length, free);
+            free -= kept;
+
+            ExpectBytes(stream, Slot->Buffer + packet->Offset, kept);
+
+            stream->OverrunBytes += packet->Length - kept;
+            stream->PacketsTransferred++;
+        }
+
+        return;
+    }
+
+    for (i = 0; i < Ring->State.NumberOfPackets; i++) {
+        Slot->IsoPacket[i].Length = 0;
+        Slot->IsoPacket[i].Status = Chance(stream->PacketLossChance) ? USBD_STATUS_ISO_NOT_ACCESSED_BY_HW : 0;
+
+        if (Status != STATUS_CANCELLED) {
+            if (USBD_SUCCESS(Slot->IsoPacket[i].Status) && NT_SUCCESS(Status)) {
+                stream->PacketsTransferred++;
+            }
+            else {
+                stream->PacketsLost++;
+            }
+        }
+    }
+
+    for (j = 0; (j < Ring->State.SlotLength) && (Slot->Buffer[j] != 0); j++);
+
+    for (i = j; i < Ring->State.SlotLength; i++) {
+        MODEL_CHECK(Slot->Buffer[i] == 0, "byte %lu of a write slot after an underrun", (unsigned long)i);
+    }
+
+    if (NT_SUCCESS(Status) || (Status == STATUS_CANCELLED)) {
+        CheckBytes(stream, Slot->Buffer, j, "device");
+    }
+    else {
+        DropBytes(stream, Offset, Slot->Buffer, j);
+    }
+
+    stream->LoadedBytes -= Slot->LoadedBytes;
+
+    //
+    // The slots are zeroed when built; their first transfer is not an
+    // underrun.
+    //
+    if (Slot->Transmitted) {
+        stream->ZeroBytes += Ring->State.SlotLength - j;
+    }
+
+    Slot->Transmitted = TRUE;
+}
+
+//
+// Completes a slot, with a failure if the controller failed it and it was
+// not cancelled. Unless it completes inline, before the slots in flight,
+// the slot is the first sent of those not completed.
+//
+
+static
+VOID
+ControllerFinish (
+    _In_ PISOCH_RING Ring,
+    _In_ PSLOT Slot,
+    _In_ NTSTATUS Status,
+    _In_ BOOLEAN Inline
+    )
+{
+    PSTREAM stream = CurrentStream;
+    LONG latency;
+
+    MODEL_CHECK(Ring->State.BusySlots & (1 << Slot->Index), "slot %lu completed and not busy",
+                (unsigned long)Slot->Index);
+
+    if (Slot->Fail && (Status != STATUS_CANCELLED)) {
+        Status = STATUS_UNSUCCESSFUL;
+
+        if (!Ring->State.Stopping) {
+            stream->Failures++;
+        }
+    }
+
+    ControllerTransfer(Ring, Slot, Status, Inline ? stream->LoadedBytes - Slot->LoadedBytes : 0);
+
+    if (Status != STATUS_CANCELLED) {
+        latency = (LONG)(Frame - (Slot->StartFrame + Ring->State.NumberOfFrames));
+        latency = max(latency, 0);
+        stream->TransfersCompleted++;
+        stream->TotalCompletionLatency += latency;
+        stream->MaxCompletionLatency = max(stream->MaxCompletionLatency, (ULONG)latency);
+    }
+
+    stream->CompletionDepth++;
+    stream->MaxCompletionDepth = max(stream->MaxCompletionDepth, stream->CompletionDepth);
+
+    IsochSlotCompletion(Ring, Slot, Status);
+
+    stream->CompletionDepth--;
+}
+
+static
+VOID
+ControllerComplete (
+    _In_ PISOCH_RING Ring,
+    _In_ NTSTATUS Status
+    )
+{
+    PSTREAM stream = CurrentStream;
+    PSLOT slot;
+
+    slot = &Ring->Slots[stream->InFlight[stream->InFlightHead]];
+    stream->InFlightHead = (stream->InFlightHead + 1) % ISOCH_RING_SLOTS;
+    stream->InFlightCount--;
+
+    ControllerFinish(Ring, slot, Status, FALSE);
+}
+
+static
+VOID
+QueryStatistics (
+    _In_ PISOCH_RING Ring
+    )
+{
+    PSTREAM stream = CurrentStream;
+    USBSAMP_ISOCH_STREAM_STATISTICS statistics;
+
+    GetIsochRingStatistics(Ring, &statistics);
+
+    MODEL_CHECK(statistics.BufferedBytes == stream->ExpectedLength - stream->LoadedBytes,
+                "%lu bytes buffered, %lu expected", (unsigned long)statistics.BufferedBytes,
+                (unsigned long)(stream->ExpectedLength - stream->LoadedBytes));
+
+    stream->Sum.IntervalFrames += statistics.IntervalFrames;
+    stream->Sum.TransfersCompleted += statistics.TransfersCompleted;
+    stream->Sum.PacketsTransferred += statistics.PacketsTransferred;
+    stream->Sum.PacketsLost += statistics.PacketsLost;
+    stream->Sum.LateSubmissions += statistics.LateSubmissions;
+    stream->Sum.TotalCompletionLatency += statistics.TotalCompletionLatency;
+    stream->Sum.MaxCompletionLatency = max(stream->Sum.MaxCompletionLatency,
+                                           statistics.MaxCompletionLatency);
+    stream->Sum.OverrunBytes += statistics.OverrunBytes;
+    stream->Sum.UnderrunBytes += statistics.UnderrunBytes;
+    stream->Queries++;
+}
+
+//
+// Starts a ring as StartIsochRing does, runs it for a number of frames
+// and stops it as TearDownIsochRing does, then checks what the model saw
+// against the statistics.
+//
+
+static
+VOID
+RunStream (
+    _In_ PENDPOINT Endpoint,
+    _In_ BOOLEAN Read,
+    _Inout_ PSTREAM Stream,
+    _In_ ULONG Frames
+    )
+{
+    static ISOCH_RING ring;
+    PIPE_CONTEXT pipeContext;
+    PPENDING_REQUEST request;
+    ULONG i, j, f;
+    NTSTATUS status;
+
+    ModelError[0] = 0;
+    CurrentStream = Stream;
+
+    ZeroMemory(&ring, sizeof(ring));
+
+    status = InitializePipeContext(Endpoint, &pipeContext);
+    MODEL_CHECK(NT_SUCCESS(status), "%s", "endpoint rejected");
+
+    ring.State.Read = Read;
+    ring.State.SlotLength = ISOCH_RING_FRAMES_PER_SLOT * pipeContext.TransferSizePerFrame;
+
+    status = GetIsochTransferLayout(Endpoint, &pipeContext, ring.State.SlotLength,
+                                    &ring.State.NumberOfPackets, &ring.State.NumberOfFrames, &ring.State.PacketSize);
+    MODEL_CHECK(NT_SUCCESS(status), "%s", "slot rejected");
+
+    if (ModelError[0] != 0) {
+        return;
+    }
+
+    ring.State.DataSize = ring.State.SlotLength * ISOCH_RING_BUFFERED_SLOTS;
+    ring.State.Data = malloc(ring.State.DataSize);
+
+    Stream->ExpectedCapacity = 2 * ring.State.DataSize + 2 * ring.State.SlotLength;
+    Stream->Expected = malloc(Stream->ExpectedCapacity);
+
+    for (i = 0; i < ISOCH_RING_SLOTS; i++) {
+
+        ring.Slots[i].Index = i;
+        ring.Slots[i].Buffer = calloc(1, ring.State.SlotLength);
+
+        for (j = 0; j < ring.State.NumberOfPackets; j++) {
+            ring.Slots[i].IsoPacket[j].Offset = j * ring.State.PacketSize;
+        }
+    }
+
+    ring.State.NextStartFrame = Frame + DISPATCH_LATENCY_IN_MS;
+    ring.State.IntervalStartFrame = Frame;
+    ring.SlotsOutstanding = ISOCH_RING_SLOTS;
+
+    Stream->ScheduleEnd = ring.State.NextStartFrame;
+    Stream->LastCompletionFrame = Frame;
+
+    SendIsochSlots(&ring, (1 << ISOCH_RING_SLOTS) - 1);
+
+    for (f = 0; f < Frames; f++) {
+
+        Frame++;
+        Stream->Frames++;
+
+        while ((Stream->InFlightCount != 0) &&
+               ((LONG)(Frame - ring.Slots[Stream->InFlight[Stream->InFlightHead]].CompletionFrame) >= 0)) {
+            ControllerComplete(&ring, STATUS_SUCCESS);
+        }
+
+        //
+        // The application reads or writes, as QueueRequestToIsochRing
+        // queues the request and services the ring, or fails it if the
+        // ring is halted.
+        //
+        if (ring.State.Halted) {
+
+            if (Chance(Stream->RequestChance)) {
+                Stream->FailedRequests++;
+            }
+
+        } else if (Chance(Stream->RequestChance) && (ring.PendingCount < MAX_PENDING_REQUESTS)) {
+
+            request = &ring.PendingQueue[(ring.PendingHead + ring.PendingCount) % MAX_PENDING_REQUESTS];
+            request->Length = 1 + Random32() % Stream->MaxRequestLength;
+            request->Sequence = Stream->ApplicationSequence;
+
+            if (!Read) {
+                Stream->ApplicationSequence += request->Length;
+            }
+
+            ring.PendingCount++;
+
+            ServiceIsochRing(&ring);
+        }
+
+        if (Chance(64)) {
+            QueryStatistics(&ring);
+        }
+
+        MODEL_CHECK(ring.State.Halted == (Stream->Failures != 0),
+                    "ring %s after %lu failures", ring.State.Halted ? "halted" : "running",
+                    (unsigned long)Stream->Failures);
+        MODEL_CHECK(!ring.State.Halted || (ring.PendingCount == 0),
+                    "%lu requests left waiting on a halted ring", (unsigned long)ring.PendingCount);
+        MODEL_CHECK(Stream->MaxCompletionDepth <= 2,
+                    "completion routine entered %lu deep", (unsigned long)Stream->MaxCompletionDepth);
+
+        if (ModelError[0] != 0) {
+            break;
+        }
+    }
+
+    //
+    // Stop: the slots in flight are cancelled, though some complete
+    // first, and none is sent again.
+    //
+    ring.State.Stopping = TRUE;
+
+    while (Stream->InFlightCount != 0) {
+
+        if (Chance(32768)) {
+            ControllerComplete(&ring, STATUS_CANCELLED);
+            continue;
+        }
+
+        f = ring.Slots[Stream->InFlight[Stream->InFlightHead]].CompletionFrame;
+
+        if ((LONG)(f - Frame) > 0) {
+            Stream->Frames += f - Frame;
+            Frame = f;
+        }
+
+        ControllerComplete(&ring, STATUS_SUCCESS);
+    }
+
+    QueryStatistics(&ring);
+
+    MODEL_CHECK(ring.SlotsIdle && (ring.SlotsOutstanding == 0) && (ring.State.BusySlots == 0),
+                "stopped with %ld slots outstanding, busy 0x%lx",
+                (long)ring.SlotsOutstanding, (unsigned long)ring.State.BusySlots);
+    MODEL_CHECK(ring.State.Halted == (Stream->Failures != 0),
+                "ring %s when stopped after %lu failures", ring.State.Halted ? "halted" : "running",
+                (unsigned long)Stream->Failures);
+    MODEL_CHECK(!ring.State.Halted || (ring.State.HaltStatus == STATUS_UNSUCCESSFUL),
+                "ring halted with status 0x%lx", (unsigned long)ring.State.HaltStatus);
+
+    MODEL_CHECK(Stream->Sum.IntervalFrames == Stream->Frames,
+                "%lu frames in the intervals, %llu run", (unsigned long)Stream->Sum.IntervalFrames,
+                (unsigned long long)Stream->Frames);
+    MODEL_CHECK(Stream->Sum.LateSubmissions == Stream->Gaps,
+                "%lu late submissions, %lu gaps", (unsigned long)Stream->Sum.LateSubmissions,
+                (unsigned long)Stream->Gaps);
+    MODEL_CHECK(Stream->Sum.TransfersCompleted == Stream->TransfersCompleted,
+                "%lu transfers completed, %llu expected", (unsigned long)Stream->Sum.TransfersCompleted,
+                (unsigned long long)Stream->TransfersCompleted);
+    MODEL_CHECK((Stream->Sum.PacketsTransferred == Stream->PacketsTransferred) &&
+                (Stream->Sum.PacketsLost == Stream->PacketsLost),
+                "%lu packets transferred and %lu lost, %llu and %llu expected",
+                (unsigned long)Stream->Sum.PacketsTransferred, (unsigned long)Stream->Sum.PacketsLost,
+                (unsigned long long)Stream->PacketsTransferred, (unsigned long long)Stream->PacketsLost);
+    MODEL_CHECK((Stream->Sum.TotalCompletionLatency == Stream->TotalCompletionLatency) &&
+                (Stream->Sum.MaxCompletionLatency == Stream->MaxCompletionLatency),
+                "completion latency %lu, at most %lu; %llu and %lu expected",
+                (unsigned long)Stream->Sum.TotalCompletionLatency,
+                (unsigned long)Stream->Sum.MaxCompletionLatency,
+                (unsigned long long)Stream->TotalCompletionLatency,
+                (unsigned long)Stream->MaxCompletionLatency);
+    MODEL_CHECK((Stream->Sum.OverrunBytes == Stream->OverrunBytes) &&
+                (Stream->Sum.UnderrunBytes == Stream->ZeroBytes),
+                "%lu bytes overrun and %lu underrun, %llu and %llu expected",
+                (unsigned long)Stream->Sum.OverrunBytes, (unsigned long)Stream->Sum.UnderrunBytes,
+                (unsigned long long)Stream->OverrunBytes, (unsigned long long)Stream->ZeroBytes);
+    MODEL_CHECK(ring.State.DataLength == Stream->ExpectedLength,
+                "%lu bytes left in the buffer, %lu expected", (unsigned long)ring.State.DataLength,
+                (unsigned long)Stream->ExpectedLength);
+
+    for (i = 0; i < ISOCH_RING_SLOTS; i++) {
+        free(ring.Slots[i].Buffer);
+    }
+
+    free(Stream->Expected);
+    free(ring.State.Data);
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    ENDPOINT endpoint;
+    PIPE_CONTEXT pipeContext;
+    PENDPOINT ep;
+    STREAM stream;
+    ULONG streams = 200;
+    ULONG endpoints = 0;
+    ULONG lateStreams = 0;
+    ULONG overrunStreams = 0;
+    ULONG underrunStreams = 0;
+    ULONG haltedStreams = 0;
+    ULONG inlineStreams = 0;
+    ULONG failedRequests = 0;
+    ULONG i, e, delay, longest;
+    BOOLEAN read;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        streams = strtoul(argv[1], NULL, 0);
+    }
+
+    srand(1);
+
+    //
+    // Every endpoint the driver accepts.
+    //
+
+    for (i = 0; i < 3; i++) {
+
+        ZeroMemory(&endpoint, sizeof(endpoint));
+        endpoint.IsDeviceSuperSpeed = (i == 2);
+        endpoint.IsDeviceHighSpeed = (i == 1);
+
+        for (endpoint.Interval = 1; endpoint.Interval <= 4; endpoint.Interval++) {
+            for (endpoint.MaximumPacketSize = 1;
+                 endpoint.MaximumPacketSize <= 1024 * 16 * 3;
+                 endpoint.MaximumPacketSize++) {
+
+                if (!NT_SUCCESS(InitializePipeContext(&endpoint, &pipeContext))) {
+                    continue;
+                }
+
+                CheckLayout(&endpoint);
+
+                TEST_ASSERT(ModelError[0] == 0,
+                            "%s speed, %lu bytes, interval %lu: %s",
+                            endpoint.IsDeviceSuperSpeed ? "Super" : (endpoint.IsDeviceHighSpeed ? "High" : "Full"),
+                            (unsigned long)endpoint.MaximumPacketSize, (unsigned long)endpoint.Interval,
+                            ModelError);
+
+                endpoints++;
+            }
+        }
+    }
+
+    TEST_COMMENT("%lu endpoints laid out", (unsigned long)endpoints);
+
+    //
+    // Random streams, half of them with completions delayed by no more
+    // than the slots in flight allow, the others now and then by more.
+    // The frame number wraps during most of them.
+    //
+
+    for (i = 0; i < streams; i++) {
+
+        e = Random32() % ARRAYSIZE(Endpoints);
+        ep = &Endpoints[e];
+        read = (Random32() % 2) == 0;
+
+        ZeroMemory(&stream, sizeof(stream));
+        stream.MaxDelay = Random32() % (MAX_DELAY_WITHOUT_GAP + 1);
+        stream.LongDelayChance = (i % 2) ? Random32() % 2048 : 0;
+        stream.PacketLossChance = Random32() % 1024;
+        stream.ShortPacketChance = Random32() % 32768;
+        stream.RequestChance = Random32() % 65536;
+        stream.MaxRequestLength = 1 + Random32() % (2 * ISOCH_RING_FRAMES_PER_SLOT * Endpoints[e].MaximumPacketSize *
+                                                    ((ep->IsDeviceSuperSpeed || ep->IsDeviceHighSpeed) ? 8 : 1));
+        stream.MaxRequestLength = min(stream.MaxRequestLength, sizeof(Scratch));
+
+        Frame = 0xFFFFFFFF - Random32() % 4096;
+
+        RunStream(ep, read, &stream, 1000 + Random32() % 3000);
+
+        TEST_ASSERT(ModelError[0] == 0,
+                    "stream %lu, %s, %s, delays up to %lu: %s",
+                    (unsigned long)i, ep->Name, read ? "read" : "write",
+                    (unsigned long)stream.MaxDelay, ModelError);
+
+        TEST_ASSERT((stream.LongDelayChance != 0) || (stream.Gaps == 0),
+                    "stream %lu, %s, delays up to %lu: %lu gaps",
+                    (unsigned long)i, ep->Name, (unsigned long)stream.MaxDelay, (unsigned long)stream.Gaps);
+
+        if (stream.Gaps != 0) {
+            lateStreams++;
+        }
+
+        if (stream.OverrunBytes != 0) {
+            overrunStreams++;
+        }
+
+        if (stream.ZeroBytes != 0) {
+            underrunStreams++;
+        }
+    }
+
+    TEST_COMMENT("%lu random streams, %lu with late submissions, %lu overrun, %lu underrun",
+                 (unsigned long)streams, (unsigned long)lateStreams,
+                 (unsigned long)overrunStreams, (unsigned long)underrunStreams);
+
+    //
+    // Streams whose slots fail, half of them inline. Reads also complete
+    // inline now and then.
+    //
+
+    for (i = 0; i < streams; i++) {
+
+        e = Random32() % ARRAYSIZE(Endpoints);
+        ep = &Endpoints[e];
+        read = (Random32() % 2) == 0;
+
+        ZeroMemory(&stream, sizeof(stream));
+        stream.MaxDelay = Random32() % (MAX_DELAY_WITHOUT_GAP + 1);
+        stream.PacketLossChance = Random32() % 1024;
+        stream.RequestChance = Random32() % 65536;
+        stream.MaxRequestLength = 1 + ISOCH_RING_FRAMES_PER_SLOT * Endpoints[e].MaximumPacketSize;
+        stream.MaxRequestLength = min(stream.MaxRequestLength, sizeof(Scratch));
+        stream.FailChance = (i % 2) ? 0 : 1 + Random32() % 256;
+        stream.InlineFailChance = (i % 2) ? 1 + Random32() % 256 : 0;
+        stream.InlineChance = Random32() % 8192;
+
+        Frame = 0xFFFFFFFF - Random32() % 4096;
+
+        RunStream(ep, read, &stream, 1000 + Random32() % 3000);
+
+        TEST_ASSERT(ModelError[0] == 0,
+                    "failing stream %lu, %s, %s: %s",
+                    (unsigned long)i, ep->Name, read ? "read" : "write", ModelError);
+
+        if (stream.Failures != 0) {
+            haltedStreams++;
+            inlineStreams += (stream.MaxCompletionDepth > 1);
+            failedRequests += stream.FailedRequests;
+        }
+    }
+
+    TEST_COMMENT("%lu streams with failing slots, %lu halted, %lu of them by a slot completing inline, %lu requests failed",
+                 (unsigned long)streams, (unsigned long)haltedStreams,
+                 (unsigned long)inlineStreams, (unsigned long)failedRequests);
+
+    //
+    // The slot and buffer of a few endpoints, and the longest delay of the
+    // completions that leaves no gap in a stream.
+    //
+
+    for (e = 0; e < ARRAYSIZE(Endpoints); e++) {
+
+        ep = &Endpoints[e];
+        longest = MAXULONG;
+
+        for (delay = 0; delay <= 2 * MAX_DELAY_WITHOUT_GAP; delay++) {
+
+            ZeroMemory(&stream, sizeof(stream));
+            stream.MaxDelay = delay;
+            stream.FixedDelay = TRUE;
+            stream.RequestChance = 65536;
+            stream.MaxRequestLength = 1;
+
+            Frame = 0xFFFFFFFF - 100;
+
+            RunStream(ep, TRUE, &stream, 300);
+
+            TEST_ASSERT(ModelError[0] == 0,
+                        "%s, delay %lu: %s", ep->Name, (unsigned long)delay, ModelError);
+
+            if (stream.Gaps != 0) {
+                break;
+            }
+
+            longest = delay;
+        }
+
+        TEST_ASSERT(longest == MAX_DELAY_WITHOUT_GAP,
+                    "%s: gaps from a delay of %lu frames", ep->Name, (unsigned long)delay);
+
+        InitializePipeContext(ep, &pipeContext);
+
+        TEST_COMMENT("%s: slots of %6lu bytes, %8lu bytes buffered, no gap with completions %lu frames late",
+                     ep->Name, (unsigned long)(ISOCH_RING_FRAMES_PER_SLOT * pipeContext.TransferSizePerFrame),
+                     (unsigned long)(ISOCH_RING_FRAMES_PER_SLOT * pipeContext.TransferSizePerFrame *
+                                     ISOCH_RING_BUFFERED_SLOTS),
+                     (unsigned long)longest);
+    }
+
+End:
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}
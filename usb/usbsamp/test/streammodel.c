@@ -0,0 +1,1037 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    streammodel.c
+
+Abstract:
+
+    This file tests the scheduling of bulk transfers across the streams of
+    a SuperSpeed bulk pipe by usbsamp in user mode.
+
+    The routines of streamstate.h that pick a stream for a transfer,
+    account for the transfers on each stream and read the statistics are
+    built here as they are, and so is pipeline.h. The way bulkrwr.c sends
+    a transfer on a pipe with streams is reproduced around them: the
+    stages of a pipelined transfer go to the streams of their stage
+    requests, and other transfers go, one stage after the other, to the
+    stream picked for them. The failure and cancellation paths are left
+    to bulkmodel.
+
+    The device is a model of a UAS-style device: every stream is a queue
+    the device serves in order, but it picks the stream to serve at
+    random, and the completions reach the driver in any order, as on
+    several processors. Several handles send reads and writes of random
+    lengths at once. Wherever the driver updates the counters the
+    statistics may be queried, and a query may be interrupted by
+    completions.
+
+    The test checks that every transfer completes once with all its bytes
+    at the right offsets; that a transfer goes to a stream with the fewest
+    transfers in flight and that idle streams are used in turn; that a
+    pipelined transfer has no more than the queue depth of stages on any
+    stream; that every snapshot of the statistics is consistent, with no
+    more transfers outstanding than sent or than the peak, and no counter
+    going back; and that once the transfers are done the counters of each
+    stream match what the device saw on it.
+
+    It then prints the statistics of a few runs.
+
+    Usage: streammodel [Runs]
+
+Environment:
+
+    User mode
+
+--*/
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "devioctl.h"
+#include "public.h"
+
+typedef LONG NTSTATUS;
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+#define TEST_ASSERT(_Assertion, _Message, ...) do { \
+        if (!(_Assertion)) { \
+            printf(_Message "\n", __VA_ARGS__); \
+            Success = FALSE; \
+            goto End; \
+        }\
+    } while (0)
+
+#define TEST_COMMENT(_Message, ...) printf(_Message "\n", __VA_ARGS__)
+
+//
+// Checks made inside the model record the first failure, the test
+// reports it once the run is done.
+//
+
+#define MODEL_CHECK(_Assertion, _Message, ...) do { \
+        if (!(_Assertion) && (ModelError[0] == 0)) { \
+            _snprintf_s(ModelError, sizeof(ModelError), _TRUNCATE, _Message, __VA_ARGS__); \
+        }\
+    } while (0)
+
+#define MAX_STREAM_VALID_PACKET_SIZE   1024     // as in private.h
+#define MAX_BULK_STAGES_IN_FLIGHT      16
+#define BULK_STREAM_QUEUE_DEPTH        2
+
+#define MAX_STREAMS                    64
+#define MAX_HANDLES                    8
+#define MAX_TRANSFER_LENGTH            (64 * 1024)
+#define MAX_URBS                       (MAX_BULK_STAGES_IN_FLIGHT + MAX_HANDLES)
+
+#include "pipeline.h"
+
+static BOOLEAN InQuery;
+static VOID Preempt(_In_ BOOLEAN Query);
+
+//
+// Another processor may run after each interlocked operation of
+// streamstate.h: a query of the statistics while the counters are
+// updated, or completions while they are queried.
+//
+
+static
+LONG
+ModelInterlockedIncrement (
+    _Inout_ volatile LONG *Addend
+    )
+{
+    LONG value = InterlockedIncrement(Addend);
+    Preempt(!InQuery);
+    return value;
+}
+
+static
+LONG
+ModelInterlockedDecrement (
+    _Inout_ volatile LONG *Addend
+    )
+{
+    LONG value = InterlockedDecrement(Addend);
+    Preempt(!InQuery);
+    return value;
+}
+
+static
+LONG
+ModelInterlockedCompareExchange (
+    _Inout_ volatile LONG *Destination,
+    _In_ LONG Exchange,
+    _In_ LONG Comperand
+    )
+{
+    LONG value = InterlockedCompareExchange(Destination, Exchange, Comperand);
+    Preempt(!InQuery);
+    return value;
+}
+
+static
+LONG64
+ModelInterlockedIncrement64 (
+    _Inout_ volatile LONG64 *Addend
+    )
+{
+    LONG64 value = InterlockedIncrement64(Addend);
+    Preempt(!InQuery);
+    return value;
+}
+
+static
+LONG64
+ModelInterlockedAdd64 (
+    _Inout_ volatile LONG64 *Addend,
+    _In_ LONG64 Value
+    )
+{
+    LONG64 value = InterlockedAdd64(Addend, Value);
+    Preempt(!InQuery);
+    return value;
+}
+
+static
+LONG64
+ModelInterlockedCompareExchange64 (
+    _Inout_ volatile LONG64 *Destination,
+    _In_ LONG64 Exchange,
+    _In_ LONG64 Comperand
+    )
+{
+    LONG64 value = InterlockedCompareExchange64(Destination, Exchange, Comperand);
+    Preempt(!InQuery);
+    return value;
+}
+
+#undef InterlockedIncrement
+#undef InterlockedDecrement
+#undef InterlockedCompareExchange
+#undef InterlockedIncrement64
+#undef InterlockedAdd64
+#undef InterlockedCompareExchange64
+
+#define InterlockedIncrement ModelInterlockedIncrement
+#define InterlockedDecrement ModelInterlockedDecrement
+#define InterlockedCompareExchange ModelInterlockedCompareExchange
+#define InterlockedIncrement64 ModelInterlockedIncrement64
+#define InterlockedAdd64 ModelInterlockedAdd64
+#define InterlockedCompareExchange64 ModelInterlockedCompareExchange64
+
+#include "streamstate.h"
+
+//
+// The fields of USBSAMP_STREAM_INFO.
+//
+
+typedef struct _USBSAMP_STREAM_INFO {
+    ULONG NumberOfStreams;
+    USBSAMP_STREAM_STATE StreamState[MAX_STREAMS];
+    LONG NextStream;
+} USBSAMP_STREAM_INFO, *PUSBSAMP_STREAM_INFO;
+
+struct _REQUEST;
+
+//
+// A stage request of the pipe, with the fields of STAGE_CONTEXT.
+//
+
+typedef struct _STAGE_REQUEST {
+    ULONG Index;
+    ULONG StreamIndex;
+} STAGE_REQUEST, *PSTAGE_REQUEST;
+
+//
+// The fields of REQUEST_CONTEXT a transfer on a pipe with streams uses,
+// and the state of the request.
+//
+
+typedef struct _REQUEST {
+    ULONG Id;
+    BOOLEAN Read;
+    ULONG TotalLength;
+    PUCHAR Buffer;
+
+    BOOLEAN Pipelined;
+    ULONG Length;
+    ULONG Numxfer;
+    ULONG StreamIndex;
+    PIPELINE_STATE Pipeline;        // VirtualAddress is the offset in Buffer
+
+    BOOLEAN Completed;
+    ULONG Information;
+    UCHAR Hits[MAX_TRANSFER_LENGTH];
+    ULONG StagesOnStream[MAX_STREAMS];
+    ULONG LastOffsetCompleted;
+    BOOLEAN AnyCompleted;
+} REQUEST, *PREQUEST;
+
+//
+// A urb sent on a stream, and the state the device keeps for it.
+//
+
+typedef struct _URB {
+    PREQUEST Request;
+    PSTAGE_REQUEST Stage;           // NULL for a transfer sent stage by stage
+    ULONG StreamIndex;
+    ULONG Offset;
+    ULONG Length;
+} URB, *PURB;
+
+typedef struct _PIPE {
+    USBSAMP_STREAM_INFO StreamInfo;
+    ULONG NumberOfStages;
+    LONG StagesInUse;
+    STAGE_REQUEST StageRequests[MAX_BULK_STAGES_IN_FLIGHT];
+
+    //
+    // The device: a queue of urbs per stream, and the urbs it is done with
+    // whose completion has not reached the driver yet.
+    //
+    URB Queue[MAX_STREAMS][MAX_URBS];
+    ULONG QueueLength[MAX_STREAMS];
+    URB Done[MAX_URBS];
+    ULONG DoneLength;
+
+    //
+    // What the model expects of the counters of each stream.
+    //
+    LONG Outstanding[MAX_STREAMS];
+    LONG PeakOutstanding[MAX_STREAMS];
+    ULONGLONG Transfers[MAX_STREAMS];
+    ULONGLONG BytesTransferred[MAX_STREAMS];
+
+    USBSAMP_STREAM_COUNTERS Previous[MAX_STREAMS];
+    ULONG Queries;
+    ULONG OutOfOrder;
+} PIPE, *PPIPE;
+
+typedef struct _HANDLE_STATE {
+    PREQUEST Request;
+    ULONG Left;
+} HANDLE_STATE, *PHANDLE_STATE;
+
+static PIPE Pipe;
+static HANDLE_STATE Handles[MAX_HANDLES];
+static ULONG NumberOfHandles;
+static ULONG MaxLength;
+static REQUEST Requests[MAX_HANDLES];
+static UCHAR Buffers[MAX_HANDLES][MAX_TRANSFER_LENGTH];
+static ULONG NextRequestId;
+static ULONG PreemptionChance;
+static ULONG InDriver;
+static CHAR ModelError[256];
+
+static VOID SendPipelinedStages(_In_ PREQUEST Request);
+static ULONG ServeHandles(VOID);
+
+static
+ULONG
+Random32 (
+    VOID
+    )
+{
+    return ((ULONG)(rand() & 0x7FFF) << 17) ^ ((ULONG)(rand() & 0x7FFF) << 2) ^ (ULONG)(rand() & 3);
+}
+
+static
+BOOLEAN
+Chance (
+    _In_ ULONG Probability
+    )
+{
+    return (Random32() & 0xFFFF) < Probability;
+}
+
+static
+UCHAR
+DeviceByte (
+    _In_ ULONG Id,
+    _In_ ULONG Offset
+    )
+{
+    return (UCHAR)((Id * 31) ^ (Offset * 7) ^ (Offset >> 8));
+}
+
+//
+// As in SelectStreamForTransfer (stream.c).
+//
+
+static
+ULONG
+SelectStreamForTransfer (
+    VOID
+    )
+{
+    return StreamStateSelect(Pipe.StreamInfo.StreamState,
+                             Pipe.StreamInfo.NumberOfStreams,
+                             &Pipe.StreamInfo.NextStream);
+}
+
+//
+// As in StartStreamTransfer and EndStreamTransfer (stream.c). Another
+// processor may query the statistics between the interlocked operations.
+//
+
+static
+VOID
+StartStreamTransfer (
+    _In_ ULONG StreamIndex
+    )
+{
+    StreamStateStart(&Pipe.StreamInfo.StreamState[StreamIndex]);
+
+    Pipe.Transfers[StreamIndex]++;
+    Pipe.Outstanding[StreamIndex]++;
+    Pipe.PeakOutstanding[StreamIndex] = max(Pipe.PeakOutstanding[StreamIndex], Pipe.Outstanding[StreamIndex]);
+}
+
+static
+VOID
+EndStreamTransfer (
+    _In_ ULONG StreamIndex,
+    _In_ ULONG BytesTransferred
+    )
+{
+    StreamStateEnd(&Pipe.StreamInfo.StreamState[StreamIndex], BytesTransferred);
+
+    Pipe.Outstanding[StreamIndex]--;
+}
+
+//
+// As in GetStreamStatistics (stream.c). Completions may run between the
+// reads.
+//
+
+static
+VOID
+GetStreamStatistics (
+    _Out_ PUSBSAMP_STREAM_STATISTICS Statistics,
+    _In_ ULONG Count
+    )
+{
+    PUSBSAMP_STREAM_INFO pStreamInfo;
+    ULONG i;
+
+    pStreamInfo = &Pipe.StreamInfo;
+
+    Statistics->NumberOfStreams = pStreamInfo->NumberOfStreams;
+    Statistics->QueueDepth = BULK_STREAM_QUEUE_DEPTH;
+
+    for (i = 0; i < Count; i++) {
+        StreamStateQuery(&pStreamInfo->StreamState[i], &Statistics->Streams[i]);
+    }
+}
+
+//
+// Queries the statistics and checks that they are consistent, and that
+// no counter went back since the last query.
+//
+
+static
+VOID
+QueryStatistics (
+    VOID
+    )
+{
+    static UCHAR buffer[FIELD_OFFSET(USBSAMP_STREAM_STATISTICS, Streams) +
+                        MAX_STREAMS * sizeof(USBSAMP_STREAM_COUNTERS)];
+    PUSBSAMP_STREAM_STATISTICS statistics = (PUSBSAMP_STREAM_STATISTICS)buffer;
+    PUSBSAMP_STREAM_COUNTERS counters;
+    ULONG i;
+
+    InQuery = TRUE;
+    GetStreamStatistics(statistics, Pipe.StreamInfo.NumberOfStreams);
+    InQuery = FALSE;
+
+    for (i = 0; i < Pipe.StreamInfo.NumberOfStreams; i++) {
+
+        counters = &statistics->Streams[i];
+
+        MODEL_CHECK((LONG)counters->Outstanding >= 0,
+                    "stream %lu: %ld outstanding", (unsigned long)i, (long)counters->Outstanding);
+        MODEL_CHECK(counters->Outstanding <= counters->Transfers,
+                    "stream %lu: %lu outstanding of %llu transfers", (unsigned long)i,
+                    (unsigned long)counters->Outstanding, (unsigned long long)counters->Transfers);
+        MODEL_CHECK(counters->Outstanding <= counters->PeakOutstanding,
+                    "stream %lu: %lu outstanding, peak %lu", (unsigned long)i,
+                    (unsigned long)counters->Outstanding, (unsigned long)counters->PeakOutstanding);
+        MODEL_CHECK((counters->Transfers >= Pipe.Previous[i].Transfers) &&
+                    (counters->BytesTransferred >= Pipe.Previous[i].BytesTransferred) &&
+                    (counters->PeakOutstanding >= Pipe.Previous[i].PeakOutstanding),
+                    "stream %lu: counters went back", (unsigned long)i);
+
+        Pipe.Previous[i] = *counters;
+    }
+
+    Pipe.Queries++;
+}
+
+//
+// The device.
+//
+
+static
+VOID
+DeviceReceive (
+    _In_ PREQUEST Request,
+    _In_ PSTAGE_REQUEST Stage,
+    _In_ ULONG StreamIndex,
+    _In_ ULONG Offset,
+    _In_ ULONG Length
+    )
+{
+    PURB urb;
+
+    MODEL_CHECK(Pipe.QueueLength[StreamIndex] < MAX_URBS, "%s", "too many urbs on a stream");
+
+    if (Pipe.QueueLength[StreamIndex] == MAX_URBS) {
+        return;
+    }
+
+    urb = &Pipe.Queue[StreamIndex][Pipe.QueueLength[StreamIndex]++];
+    urb->Request = Request;
+    urb->Stage = Stage;
+    urb->StreamIndex = StreamIndex;
+    urb->Offset = Offset;
+    urb->Length = Length;
+}
+
+static
+BOOLEAN
+DeviceServe (
+    VOID
+    )
+{
+    PURB urb;
+    ULONG streams[MAX_STREAMS];
+    ULONG count = 0;
+    ULONG s, i;
+
+    for (s = 0; s < Pipe.StreamInfo.NumberOfStreams; s++) {
+        if (Pipe.QueueLength[s] != 0) {
+            streams[count++] = s;
+        }
+    }
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    s = streams[Random32() % count];
+    urb = &Pipe.Queue[s][0];
+
+    for (i = 0; i < urb->Length; i++) {
+
+        if (urb->Request->Read) {
+            urb->Request->Buffer[urb->Offset + i] = DeviceByte(urb->Request->Id, urb->Offset + i);
+        }
+        else {
+            MODEL_CHECK(urb->Request->Buffer[urb->Offset + i] == DeviceByte(urb->Request->Id, urb->Offset + i),
+                        "request %lu: the device got the wrong byte at %lu",
+                        (unsigned long)urb->Request->Id, (unsigned long)(urb->Offset + i));
+        }
+
+        urb->Request->Hits[urb->Offset + i]++;
+    }
+
+    Pipe.BytesTransferred[s] += urb->Length;
+    Pipe.Done[Pipe.DoneLength++] = *urb;
+
+    Pipe.QueueLength[s]--;
+    MoveMemory(&Pipe.Queue[s][0], &Pipe.Queue[s][1], Pipe.QueueLength[s] * sizeof(URB));
+
+    return TRUE;
+}
+
+static
+VOID
+CompleteRequest (
+    _In_ PREQUEST Request,
+    _In_ ULONG Information
+    )
+{
+    MODEL_CHECK(!Request->Completed, "request %lu completed twice", (unsigned long)Request->Id);
+
+    Request->Completed = TRUE;
+    Request->Information = Information;
+}
+
+//
+// As in ReadWriteBulkEndPoints (bulkrwr.c): a transfer of more than one
+// stage is pipelined if the stage requests of the pipe are free, else
+// it is sent one stage at a time on the stream picked for it.
+//
+
+static
+VOID
+ReadWriteBulkEndPoints (
+    _In_ PREQUEST Request
+    )
+{
+    ULONG totalLength;
+    ULONG stageLength;
+    ULONG s;
+
+    totalLength = Request->TotalLength;
+    stageLength = min(totalLength, MAX_STREAM_VALID_PACKET_SIZE);
+
+    if (totalLength > stageLength &&
+        Pipe.NumberOfStages > 1 &&
+        InterlockedCompareExchange(&Pipe.StagesInUse, 1, 0) == 0) {
+
+        Request->Pipelined = TRUE;
+
+        PipelineInitialize(&Request->Pipeline,
+                           0,
+                           totalLength,
+                           MAX_STREAM_VALID_PACKET_SIZE,
+                           Pipe.NumberOfStages);
+
+        SendPipelinedStages(Request);
+        return;
+    }
+
+    Request->StreamIndex = SelectStreamForTransfer();
+
+    for (s = 0; s < Pipe.StreamInfo.NumberOfStreams; s++) {
+        MODEL_CHECK(Pipe.Outstanding[Request->StreamIndex] <= Pipe.Outstanding[s],
+                    "request %lu sent on stream %lu with %ld outstanding, stream %lu has %ld",
+                    (unsigned long)Request->Id, (unsigned long)Request->StreamIndex,
+                    (long)Pipe.Outstanding[Request->StreamIndex], (unsigned long)s,
+                    (long)Pipe.Outstanding[s]);
+    }
+
+    StartStreamTransfer(Request->StreamIndex);
+
+    Request->Pipelined = FALSE;
+    Request->Length = totalLength - stageLength;
+    Request->Numxfer = 0;
+
+    DeviceReceive(Request, NULL, Request->StreamIndex, 0, stageLength);
+}
+
+//
+// As in UsbSamp_EvtReadWriteCompletion (bulkrwr.c): the next stage goes
+// to the same stream.
+//
+
+static
+VOID
+ReadWriteCompletion (
+    _In_ PURB Urb
+    )
+{
+    PREQUEST request = Urb->Request;
+    ULONG stageLength;
+
+    MODEL_CHECK(Urb->StreamIndex == request->StreamIndex,
+                "request %lu: stage on stream %lu, request on %lu", (unsigned long)request->Id,
+                (unsigned long)Urb->StreamIndex, (unsigned long)request->StreamIndex);
+
+    request->Numxfer += Urb->Length;
+
+    if (request->Length == 0) {
+        EndStreamTransfer(request->StreamIndex, request->Numxfer);
+        CompleteRequest(request, request->Numxfer);
+        return;
+    }
+
+    stageLength = min(request->Length, MAX_STREAM_VALID_PACKET_SIZE);
+
+    request->Length -= stageLength;
+
+    DeviceReceive(request, NULL, request->StreamIndex, request->Numxfer, stageLength);
+}
+
+//
+// As in SendPipelinedStages (bulkrwr.c), less the stop.
+//
+
+static
+VOID
+SendPipelinedStages (
+    _In_ PREQUEST Request
+    )
+{
+    PSTAGE_REQUEST stage;
+    ULONG index;
+    ULONG stageLength;
+    ULONG_PTR virtualAddress;
+
+    if (!PipelineStartSending(&Request->Pipeline)) {
+        return;
+    }
+
+    while (PipelineTakeStage(&Request->Pipeline, &index, &virtualAddress, &stageLength)) {
+
+        stage = &Pipe.StageRequests[index];
+
+        StartStreamTransfer(stage->StreamIndex);
+
+        Request->StagesOnStream[stage->StreamIndex]++;
+
+        MODEL_CHECK(Request->StagesOnStream[stage->StreamIndex] <= BULK_STREAM_QUEUE_DEPTH,
+                    "request %lu: %lu stages on stream %lu", (unsigned long)Request->Id,
+                    (unsigned long)Request->StagesOnStream[stage->StreamIndex],
+                    (unsigned long)stage->StreamIndex);
+
+        DeviceReceive(Request, stage, stage->StreamIndex, (ULONG)virtualAddress, stageLength);
+
+        PipelineStageSent(&Request->Pipeline, index, STATUS_SUCCESS);
+    }
+
+    if (PipelineStopSending(&Request->Pipeline)) {
+
+        InterlockedExchange(&Pipe.StagesInUse, 0);
+
+        CompleteRequest(Request, Request->Pipeline.Numxfer);
+    }
+}
+
+//
+// As in UsbSamp_EvtStageCompletion (bulkrwr.c), on success.
+//
+
+static
+VOID
+StageCompletion (
+    _In_ PURB Urb
+    )
+{
+    PREQUEST request = Urb->Request;
+    PSTAGE_REQUEST stage = Urb->Stage;
+
+    MODEL_CHECK(Urb->StreamIndex == stage->StreamIndex,
+                "stage %lu on stream %lu, bound to %lu", (unsigned long)stage->Index,
+                (unsigned long)Urb->StreamIndex, (unsigned long)stage->StreamIndex);
+    MODEL_CHECK((request->Pipeline.IdleStages & (1 << stage->Index)) == 0,
+                "stage %lu completed and idle", (unsigned long)stage->Index);
+
+    if (request->AnyCompleted && Urb->Offset < request->LastOffsetCompleted) {
+        Pipe.OutOfOrder++;
+    }
+
+    request->AnyCompleted = TRUE;
+    request->LastOffsetCompleted = Urb->Offset;
+
+    EndStreamTransfer(stage->StreamIndex, Urb->Length);
+
+    request->StagesOnStream[stage->StreamIndex]--;
+
+    PipelineStageDone(&request->Pipeline, stage->Index, Urb->Length);
+
+    SendPipelinedStages(request);
+}
+
+//
+// Delivers the completion of one of the urbs the device is done with,
+// picked at random.
+//
+
+static
+BOOLEAN
+DeliverCompletion (
+    VOID
+    )
+{
+    URB urb;
+    ULONG i;
+
+    if (Pipe.DoneLength == 0) {
+        return FALSE;
+    }
+
+    i = Random32() % Pipe.DoneLength;
+    urb = Pipe.Done[i];
+    Pipe.Done[i] = Pipe.Done[--Pipe.DoneLength];
+
+    InDriver++;
+
+    if (urb.Stage != NULL) {
+        StageCompletion(&urb);
+    }
+    else {
+        ReadWriteCompletion(&urb);
+    }
+
+    InDriver--;
+
+    return TRUE;
+}
+
+//
+// Another processor runs between two steps of the driver: a query of the
+// statistics while the counters are updated, or the device, a completion
+// and new reads or writes while they are queried.
+//
+
+static
+VOID
+Preempt (
+    _In_ BOOLEAN Query
+    )
+{
+    if (!Chance(PreemptionChance)) {
+        return;
+    }
+
+    if (Query) {
+        if (!InQuery) {
+            QueryStatistics();
+        }
+    }
+    else if (InDriver == 0) {
+        DeviceServe();
+        DeliverCompletion();
+        ServeHandles();
+    }
+}
+
+static
+VOID
+InitializePipe (
+    _In_ ULONG NumberOfStreams
+    )
+{
+    ULONG i;
+
+    ZeroMemory(&Pipe, sizeof(Pipe));
+
+    Pipe.StreamInfo.NumberOfStreams = NumberOfStreams;
+
+    //
+    // As in InitializeBulkPipeStages (bulkrwr.c).
+    //
+    Pipe.NumberOfStages = min(NumberOfStreams * BULK_STREAM_QUEUE_DEPTH, MAX_BULK_STAGES_IN_FLIGHT);
+
+    for (i = 0; i < Pipe.NumberOfStages; i++) {
+        Pipe.StageRequests[i].Index = i;
+        Pipe.StageRequests[i].StreamIndex = i % NumberOfStreams;
+    }
+}
+
+static
+VOID
+StartRequest (
+    _In_ ULONG Handle
+    )
+{
+    PREQUEST request = &Requests[Handle];
+    ULONG i;
+
+    ZeroMemory(request, sizeof(*request));
+
+    request->Id = ++NextRequestId;
+    request->Read = (Random32() % 2) == 0;
+    request->TotalLength = 1 + Random32() % MaxLength;
+    request->Buffer = Buffers[Handle];
+
+    for (i = 0; i < request->TotalLength; i++) {
+        request->Buffer[i] = request->Read ? 0 : DeviceByte(request->Id, i);
+    }
+
+    InDriver++;
+    ReadWriteBulkEndPoints(request);
+    InDriver--;
+}
+
+static
+VOID
+CheckRequest (
+    _In_ PREQUEST Request
+    )
+{
+    ULONG i;
+
+    MODEL_CHECK(Request->Information == Request->TotalLength,
+                "request %lu of %lu bytes completed with %lu", (unsigned long)Request->Id,
+                (unsigned long)Request->TotalLength, (unsigned long)Request->Information);
+
+    for (i = 0; i < Request->TotalLength; i++) {
+
+        MODEL_CHECK(Request->Hits[i] == 1, "request %lu: byte %lu transferred %lu times",
+                    (unsigned long)Request->Id, (unsigned long)i, (unsigned long)Request->Hits[i]);
+
+        MODEL_CHECK(!Request->Read || (Request->Buffer[i] == DeviceByte(Request->Id, i)),
+                    "request %lu: wrong byte read at %lu", (unsigned long)Request->Id, (unsigned long)i);
+    }
+}
+
+//
+// Every handle sends its next read or write, now and then, once the
+// previous one has completed. Returns the number of handles not done.
+//
+
+static
+ULONG
+ServeHandles (
+    VOID
+    )
+{
+    PHANDLE_STATE handle;
+    ULONG busy = 0;
+    ULONG h;
+
+    for (h = 0; h < NumberOfHandles; h++) {
+
+        handle = &Handles[h];
+
+        if (handle->Request != NULL && handle->Request->Completed) {
+            CheckRequest(handle->Request);
+            handle->Request = NULL;
+        }
+
+        if (handle->Request == NULL && handle->Left != 0 && Chance(16384)) {
+            handle->Left--;
+            handle->Request = &Requests[h];
+            StartRequest(h);
+        }
+
+        if (handle->Request != NULL || handle->Left != 0) {
+            busy++;
+        }
+    }
+
+    return busy;
+}
+
+//
+// Runs reads and writes from a number of handles, each sending the next
+// once the previous one completes, until they have all sent theirs.
+//
+
+static
+VOID
+RunStreams (
+    _In_ ULONG NumberOfStreams,
+    _In_ ULONG NumberOfHandlesToRun,
+    _In_ ULONG TransfersPerHandle,
+    _In_ ULONG MaxTransferLength
+    )
+{
+    ULONG h, s;
+
+    ModelError[0] = 0;
+
+    InitializePipe(NumberOfStreams);
+
+    NumberOfHandles = NumberOfHandlesToRun;
+    MaxLength = MaxTransferLength;
+
+    for (h = 0; h < NumberOfHandles; h++) {
+        Handles[h].Request = NULL;
+        Handles[h].Left = TransfersPerHandle;
+    }
+
+    while (ServeHandles() != 0 && ModelError[0] == 0) {
+
+        switch (Random32() % 4) {
+        case 0:
+        case 1:
+            DeviceServe();
+            break;
+        case 2:
+            DeliverCompletion();
+            break;
+        default:
+            if (Chance(4096)) {
+                QueryStatistics();
+            }
+            break;
+        }
+    }
+    QueryStatistics();
+
+    MODEL_CHECK(Pipe.StagesInUse == 0, "%s", "stage requests left in use");
+
+    for (s = 0; s < NumberOfStreams; s++) {
+
+        MODEL_CHECK(Pipe.Previous[s].Outstanding == 0,
+                    "stream %lu: %lu outstanding when idle", (unsigned long)s,
+                    (unsigned long)Pipe.Previous[s].Outstanding);
+        MODEL_CHECK(Pipe.Previous[s].Transfers == Pipe.Transfers[s],
+                    "stream %lu: %llu transfers, %llu sent", (unsigned long)s,
+                    (unsigned long long)Pipe.Previous[s].Transfers, (unsigned long long)Pipe.Transfers[s]);
+        MODEL_CHECK(Pipe.Previous[s].BytesTransferred == Pipe.BytesTransferred[s],
+                    "stream %lu: %llu bytes, %llu on the device", (unsigned long)s,
+                    (unsigned long long)Pipe.Previous[s].BytesTransferred,
+                    (unsigned long long)Pipe.BytesTransferred[s]);
+        MODEL_CHECK(Pipe.Previous[s].PeakOutstanding == (ULONG)Pipe.PeakOutstanding[s],
+                    "stream %lu: peak %lu, %ld expected", (unsigned long)s,
+                    (unsigned long)Pipe.Previous[s].PeakOutstanding, (long)Pipe.PeakOutstanding[s]);
+    }
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char *argv[]
+    )
+{
+    static const ULONG streamCounts[] = { 2, 4, 8, 16, 64 };
+    ULONG runs = 1000;
+    ULONG i, s, n, handles;
+    ULONGLONG queries = 0;
+    ULONGLONG outOfOrder = 0;
+    ULONGLONG fewest, most;
+    BOOL Success = TRUE;
+
+    if (argc > 1) {
+        runs = strtoul(argv[1], NULL, 0);
+    }
+
+    srand(1);
+
+    //
+    // Random runs: any number of streams and handles, transfers of one
+    // stage or of many, and preemption anywhere.
+    //
+
+    for (i = 0; i < runs; i++) {
+
+        n = streamCounts[Random32() % ARRAYSIZE(streamCounts)];
+        handles = 1 + Random32() % MAX_HANDLES;
+        PreemptionChance = Random32() % 32768;
+
+        RunStreams(n, handles, 1 + Random32() % 16,
+                   (Random32() % 4) ? MAX_TRANSFER_LENGTH : MAX_STREAM_VALID_PACKET_SIZE);
+
+        TEST_ASSERT(ModelError[0] == 0,
+                    "run %lu, %lu streams, %lu handles: %s",
+                    (unsigned long)i, (unsigned long)n, (unsigned long)handles, ModelError);
+
+        queries += Pipe.Queries;
+        outOfOrder += Pipe.OutOfOrder;
+    }
+
+    TEST_COMMENT("%lu random runs, %llu queries, %llu stages completed out of order",
+                 (unsigned long)runs, (unsigned long long)queries, (unsigned long long)outOfOrder);
+
+    //
+    // One handle sending transfers of one stage: every transfer finds all
+    // the streams idle, so they are used in turn.
+    //
+
+    PreemptionChance = 0;
+
+    for (i = 0; i < ARRAYSIZE(streamCounts); i++) {
+
+        n = streamCounts[i];
+
+        RunStreams(n, 1, 10 * n, MAX_STREAM_VALID_PACKET_SIZE);
+
+        fewest = MAXULONGLONG;
+        most = 0;
+
+        for (s = 0; s < n; s++) {
+            fewest = min(fewest, Pipe.Transfers[s]);
+            most = max(most, Pipe.Transfers[s]);
+        }
+
+        TEST_ASSERT(ModelError[0] == 0 && fewest == 10 && most == 10,
+                    "%lu streams, one handle: between %llu and %llu transfers per stream %s",
+                    (unsigned long)n, (unsigned long long)fewest, (unsigned long long)most, ModelError);
+    }
+
+    //
+    // The statistics of a few runs with 8 streams.
+    //
+
+    for (handles = 1; handles <= MAX_HANDLES; handles *= 2) {
+
+        RunStreams(8, handles, 64, MAX_TRANSFER_LENGTH);
+
+        TEST_ASSERT(ModelError[0] == 0, "8 streams, %lu handles: %s", (unsigned long)handles, ModelError);
+
+        TEST_COMMENT("8 streams, %lu handle%s:", (unsigned long)handles, handles > 1 ? "s" : "");
+
+        for (s = 0; s < 8; s++) {
+            TEST_COMMENT("    stream %lu: %5llu transfers, %9llu bytes, peak %lu outstanding",
+                         (unsigned long)s, (unsigned long long)Pipe.Previous[s].Transfers,
+                         (unsigned long long)Pipe.Previous[s].BytesTransferred,
+                         (unsigned long)Pipe.Previous[s].PeakOutstanding);
+        }
+    }
+
+End:
+    TEST_COMMENT("%s", Success ? "PASS" : "FAIL");
+
+    return Success ? 0 : 1;
+}